@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+"""Compares two sets of benchmark results, from bench.microbench --json or
+bench/regional.sh, and exits with 1 if anything got slower (or bigger) by
+more than the threshold.
+
+    bench/compare.py baseline.json current.json [--threshold percent]
+"""
+import argparse
+import json
+import sys
+
+# Figures where more is better; for everything else, less is
+HIGHER_IS_BETTER = ('_per_s',)
+# Figures that describe the run rather than measure it
+IGNORED = ('threads', 'input_bytes', 'tiles_written')
+
+
+def flatten(results):
+	"""The measured figures, by name"""
+	if 'benchmarks' in results:
+		return { b['name']: b['ns_per_op'] for b in results['benchmarks'] }
+	figures = {}
+	for key, value in results.items():
+		if isinstance(value, dict):
+			for phase, seconds in value.items(): figures[key + '.' + phase] = seconds
+		elif isinstance(value, (int, float)) and key not in IGNORED:
+			figures[key] = value
+	return figures
+
+
+def main():
+	parser = argparse.ArgumentParser(description='Compare benchmark results')
+	parser.add_argument('baseline')
+	parser.add_argument('current')
+	parser.add_argument('--threshold', type=float, default=10, help='percentage change counted as a regression')
+	args = parser.parse_args()
+
+	with open(args.baseline) as f: baseline = json.load(f)
+	with open(args.current) as f: current = json.load(f)
+	if baseline.get('sha256', '') != current.get('sha256', ''):
+		print('Warning: the results are from different input files', file=sys.stderr)
+
+	before, after = flatten(baseline), flatten(current)
+	regressions = 0
+	for name in sorted(set(before) & set(after)):
+		old, new = before[name], after[name]
+		if old == 0: continue
+		change = (new - old) * 100.0 / old
+		worse = -change if name.endswith(HIGHER_IS_BETTER) else change
+		flag = ''
+		if worse > args.threshold:
+			flag = '  REGRESSION'
+			regressions += 1
+		print('%-44s %14.3f %14.3f %+8.1f%%%s' % (name, old, new, change, flag))
+	for name in sorted(set(before) ^ set(after)):
+		print('%-44s only in %s' % (name, args.baseline if name in before else args.current))
+
+	if regressions:
+		print('%d regression(s) beyond %g%%' % (regressions, args.threshold))
+		return 1
+	return 0
+
+
+if __name__ == '__main__':
+	sys.exit(main())
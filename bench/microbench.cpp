@@ -0,0 +1,347 @@
+/*
+	Microbenchmarks for the hot paths of reading input and writing tiles.
+
+	Run with `make bench`, or ./bench.microbench [--json file] [--min-time seconds] [name...],
+	where each name picks out the benchmarks that contain it. Compare runs on the
+	same machine: the numbers mean little on their own.
+*/
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <functional>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include "sorted_node_store.h"
+#include "sorted_way_store.h"
+#include "node_store.h"
+#include "attribute_store.h"
+#include "clip_cache.h"
+#include "coordinates_geom.h"
+#include "write_geometry.h"
+#include "helpers.h"
+#include "geom.h"
+
+using namespace std;
+
+bool verbose = false;
+
+// Results are added to this, so the work can't be optimised away
+volatile uint64_t sink = 0;
+
+struct Benchmark {
+	string name;
+	size_t bytesPerOp;					// for a throughput figure, or 0
+	function<void()> setup;				// run once, untimed, if the benchmark is selected
+	function<size_t()> run;				// does some work; returns how many operations it did
+};
+
+struct Result {
+	string name;
+	double nsPerOp;
+	double opsPerSecond;
+	double mbPerSecond;
+};
+
+// Run the benchmark until it's taken at least minTime, after one untimed warm-up call
+Result measure(const Benchmark &benchmark, double minTime) {
+	benchmark.run();
+	uint64_t ops = 0;
+	const auto start = chrono::steady_clock::now();
+	double elapsed = 0;
+	do {
+		ops += benchmark.run();
+		elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	} while (elapsed < minTime);
+	Result result;
+	result.name = benchmark.name;
+	result.nsPerOp = elapsed * 1e9 / ops;
+	result.opsPerSecond = ops / elapsed;
+	result.mbPerSecond = benchmark.bytesPerOp * result.opsPerSecond / (1024 * 1024);
+	return result;
+}
+
+// ---- Inputs
+
+// Nodes as a regional extract has them: ascending IDs with gaps, close together
+vector<NodeStore::element_t> makeNodes(size_t count) {
+	mt19937 rng(1);
+	uniform_int_distribution<int> gap(1, 4), step(-200, 200);
+	vector<NodeStore::element_t> nodes;
+	nodes.reserve(count);
+	NodeID id = 1000000;
+	int32_t latp = 515000000, lon = -1000000;
+	for (size_t i = 0; i < count; i++) {
+		id += gap(rng);
+		latp += step(rng);
+		lon += step(rng);
+		nodes.push_back({ id, LatpLon { latp, lon } });
+	}
+	return nodes;
+}
+
+// A way's nodes are mostly consecutive, with the odd jump to an older node
+vector<NodeID> makeWay(mt19937 &rng, NodeID start, size_t length) {
+	vector<NodeID> way;
+	NodeID id = start;
+	for (size_t i = 0; i < length; i++) {
+		id += (rng() % 8 == 0) ? 1 + rng() % 100000 : 1;
+		way.push_back(id);
+	}
+	return way;
+}
+
+// A wiggly line around a tile, in projected degrees
+Linestring makeLinestring(size_t count) {
+	mt19937 rng(2);
+	uniform_real_distribution<double> wiggle(-0.00002, 0.00002);
+	Linestring ls;
+	for (size_t i = 0; i < count; i++) {
+		double t = double(i) / count;
+		geom::append(ls, Point(-0.1 + 0.2 * t + wiggle(rng), 51.5 + 0.05 * sin(t * 20) + wiggle(rng)));
+	}
+	return ls;
+}
+
+Polygon makePolygon(size_t count) {
+	mt19937 rng(3);
+	uniform_real_distribution<double> wiggle(0.98, 1.02);
+	Polygon poly;
+	for (size_t i = 0; i < count; i++) {
+		double angle = -2 * M_PI * i / count, r = 0.05 * wiggle(rng);
+		geom::append(poly.outer(), Point(r * cos(angle), 51.5 + r * sin(angle)));
+	}
+	geom::append(poly.outer(), poly.outer().front());
+	return poly;
+}
+
+class StubNodeStore : public NodeStore {
+	void clear() override {}
+	void reopen() override {}
+	void batchStart() override {}
+	void finalize(size_t threadNum) override {}
+	size_t size() const override { return 1; }
+	LatpLon at(NodeID id) const override { return { int32_t(id), -int32_t(id) }; }
+	void insert(const std::vector<std::pair<NodeID, LatpLon>>& elements) override {}
+};
+
+int main(int argc, char *argv[]) {
+	string jsonFile;
+	double minTime = 0.5;
+	vector<string> filters;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) jsonFile = argv[++i];
+		else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) minTime = atof(argv[++i]);
+		else filters.push_back(argv[i]);
+	}
+
+	const size_t nodeCount = 4000000, lookups = 100000;
+	vector<NodeStore::element_t> nodes;
+	vector<NodeID> randomNodeIDs;
+	unique_ptr<SortedNodeStore> nodeStore;
+	auto fillNodeStore = [&](SortedNodeStore &store) {
+		// In blocks, as PbfReader hands them over
+		for (size_t i = 0; i < nodes.size(); i += 8000) {
+			store.batchStart();
+			store.insert(vector<NodeStore::element_t>(nodes.begin() + i, nodes.begin() + min(i + 8000, nodes.size())));
+		}
+		store.finalize(1);
+	};
+	auto setupNodes = [&]() {
+		if (!nodes.empty()) return;
+		nodes = makeNodes(nodeCount);
+		mt19937 rng(4);
+		for (size_t i = 0; i < lookups; i++) randomNodeIDs.push_back(nodes[rng() % nodes.size()].first);
+		nodeStore.reset(new SortedNodeStore(true));
+		fillNodeStore(*nodeStore);
+	};
+
+	StubNodeStore stubNodes;
+	unique_ptr<SortedWayStore> wayStore;
+	vector<WayID> randomWayIDs;
+	vector<NodeID> encodeInput;
+	vector<uint8_t> encodeOutput;
+	auto setupWays = [&]() {
+		if (wayStore) return;
+		mt19937 rng(5);
+		encodeInput = makeWay(rng, 5000000000, 200);
+		wayStore.reset(new SortedWayStore(true, stubNodes));
+		vector<pair<WayID, vector<NodeID>>> ways;
+		for (WayID id = 1; id <= 500000; id++) {
+			ways.emplace_back(id * 3, makeWay(rng, 1000000 + id * 10, 4 + rng() % 40));
+			if (ways.size() == 8000) { wayStore->batchStart(); wayStore->insertNodes(ways); ways.clear(); }
+		}
+		wayStore->batchStart();
+		wayStore->insertNodes(ways);
+		wayStore->finalize(1);
+		for (size_t i = 0; i < lookups; i++) randomWayIDs.push_back((1 + rng() % 500000) * 3);
+	};
+
+	// Sets as a profile makes them: a few common keys, some values repeated a lot
+	AttributeStore attributeStore;
+	vector<AttributeSet> attributeSets;
+	auto setupAttributes = [&]() {
+		if (!attributeSets.empty()) return;
+		const char *highways[] = { "primary", "secondary", "tertiary", "residential", "service", "footway", "track", "path" };
+		mt19937 rng(6);
+		for (size_t i = 0; i < 100000; i++) {
+			AttributeSet set;
+			attributeStore.addAttribute(set, "class", string(highways[rng() % 8]), 0);
+			if (rng() % 2) attributeStore.addAttribute(set, "name", "Street " + to_string(rng() % 20000), 12);
+			if (rng() % 4 == 0) attributeStore.addAttribute(set, "oneway", true, 14);
+			if (rng() % 4 == 0) attributeStore.addAttribute(set, "layer", float(rng() % 3), 14);
+			attributeSets.push_back(set);
+		}
+	};
+
+	const TileBbox bbox(TileCoordinates(8186, 5448), 14, false, true);
+	ClipCache<MultiPolygon> clipCache(1, 14);
+	MultiPolygon clipped;
+	auto setupClipCache = [&]() {
+		if (!clipped.empty()) return;
+		clipped.push_back(makePolygon(64));
+	};
+
+	XYString scaled;
+	vector_tile::Tile_Feature feature;
+	auto setupDeltaString = [&]() {
+		if (!scaled.empty()) return;
+		mt19937 rng(7);
+		int x = 2048, y = 2048;
+		for (size_t i = 0; i < 1000; i++) {
+			// Some repeated points, which are dropped
+			if (rng() % 4) { x += int(rng() % 21) - 10; y += int(rng() % 21) - 10; }
+			scaled.emplace_back(x, y);
+		}
+	};
+
+	Linestring linestring;
+	Polygon polygon;
+	auto setupSimplify = [&]() {
+		if (!linestring.empty()) return;
+		linestring = makeLinestring(10000);
+		polygon = makePolygon(10000);
+	};
+
+	string tileBytes;
+	auto setupCompress = [&]() {
+		if (!tileBytes.empty()) return;
+		// Something like an encoded tile: keys, values and zigzagged command runs
+		mt19937 rng(8);
+		vector_tile::Tile tile;
+		vector_tile::Tile_Layer *layer = tile.add_layers();
+		layer->set_name("transportation");
+		layer->set_version(2);
+		for (int i = 0; i < 50; i++) layer->add_keys("key" + to_string(i));
+		for (int i = 0; i < 500; i++) layer->add_values()->set_string_value("Street " + to_string(rng() % 20000));
+		while (tile.ByteSizeLong() < 64 * 1024) {
+			vector_tile::Tile_Feature *f = layer->add_features();
+			f->set_type(vector_tile::Tile_GeomType_LINESTRING);
+			for (int i = 0; i < 6; i++) f->add_tags(rng() % 50), f->add_tags(rng() % 500);
+			f->add_geometry(9);
+			for (int i = 0; i < 40; i++) f->add_geometry(rng() % 64);
+		}
+		tile.SerializeToString(&tileBytes);
+	};
+
+	vector<Benchmark> benchmarks = {
+		{ "sorted_node_store/insert_finalize", 0, setupNodes, [&]() {
+			SortedNodeStore store(true);
+			fillNodeStore(store);
+			sink += store.size();
+			return nodes.size();
+		}},
+		{ "sorted_node_store/at_random", 0, setupNodes, [&]() {
+			for (NodeID id : randomNodeIDs) sink += nodeStore->at(id).lon;
+			return randomNodeIDs.size();
+		}},
+		{ "sorted_node_store/at_sequential", 0, setupNodes, [&]() {
+			for (size_t i = 0; i < lookups; i++) sink += nodeStore->at(nodes[i].first).lon;
+			return lookups;
+		}},
+		{ "sorted_way_store/encode_way", 0, setupWays, [&]() {
+			for (int i = 0; i < 1000; i++) sink += SortedWayStore::encodeWay(encodeInput, encodeOutput, false);
+			return 1000;
+		}},
+		{ "sorted_way_store/encode_way_compressed", 0, setupWays, [&]() {
+			for (int i = 0; i < 1000; i++) sink += SortedWayStore::encodeWay(encodeInput, encodeOutput, true);
+			return 1000;
+		}},
+		{ "sorted_way_store/at_random", 0, setupWays, [&]() {
+			for (WayID id : randomWayIDs) sink += wayStore->at(id).size();
+			return randomWayIDs.size();
+		}},
+		{ "attribute_store/add", 0, setupAttributes, [&]() {
+			for (AttributeSet &set : attributeSets) sink += attributeStore.add(set);
+			return attributeSets.size();
+		}},
+		{ "clip_cache/put_get", 0, setupClipCache, [&]() {
+			// Clip at z12, then look for the clip from each of its z14 tiles' objects
+			for (NodeID id = 0; id < 2000; id++) {
+				clipCache.put(12, TileCoordinates(bbox.index.x / 4, bbox.index.y / 4), id, clipped);
+				for (int dx = 0; dx < 4; dx++)
+					sink += clipCache.get(14, bbox.index.x / 4 * 4 + dx, bbox.index.y, id) != nullptr;
+			}
+			return 2000 * 5;
+		}},
+		{ "write_geometry/write_delta_string", 0, setupDeltaString, [&]() {
+			WriteGeometryVisitor visitor(&bbox, &feature, 0);
+			for (int i = 0; i < 100; i++) {
+				feature.Clear();
+				pair<int,int> lastPos(0, 0);
+				sink += visitor.writeDeltaString(&scaled, &feature, &lastPos, false);
+			}
+			return 100;
+		}},
+		{ "geom/simplify_linestring", 0, setupSimplify, [&]() {
+			sink += simplify(linestring, 0.0001).size();
+			return 1;
+		}},
+		{ "geom/simplify_polygon", 0, setupSimplify, [&]() {
+			sink += simplify(polygon, 0.0001).outer().size();
+			return 1;
+		}},
+		{ "geom/simplify_polygon_fast", 0, setupSimplify, [&]() {
+			sink += simplify(polygon, 0.0001, true).outer().size();
+			return 1;
+		}},
+		{ "helpers/compress_string", 64 * 1024, setupCompress, [&]() {
+			sink += compress_string(tileBytes, Z_DEFAULT_COMPRESSION).size();
+			return 1;
+		}},
+		{ "helpers/compress_string_gzip", 64 * 1024, setupCompress, [&]() {
+			sink += compress_string(tileBytes, Z_DEFAULT_COMPRESSION, true).size();
+			return 1;
+		}},
+	};
+
+	vector<Result> results;
+	for (const Benchmark &benchmark : benchmarks) {
+		bool selected = filters.empty();
+		for (const string &filter : filters) selected = selected || benchmark.name.find(filter) != string::npos;
+		if (!selected) continue;
+		benchmark.setup();
+		results.push_back(measure(benchmark, minTime));
+		const Result &r = results.back();
+		cout << left << setw(42) << r.name << right << fixed << setprecision(1) << setw(14) << r.nsPerOp << " ns/op"
+		     << setw(14) << setprecision(0) << r.opsPerSecond << " ops/s";
+		if (benchmark.bytesPerOp) cout << setw(10) << setprecision(1) << r.mbPerSecond << " MB/s";
+		cout << endl;
+	}
+
+	// The stores report their sizes on stdout, so the results go to their own file
+	if (!jsonFile.empty()) {
+		ofstream out(jsonFile);
+		if (!out) { cerr << "Couldn't open " << jsonFile << endl; return 1; }
+		out << "{\"benchmarks\":[";
+		for (size_t i = 0; i < results.size(); i++) {
+			const Result &r = results[i];
+			out << (i ? "," : "") << "{\"name\":\"" << r.name << "\",\"ns_per_op\":" << r.nsPerOp
+			    << ",\"ops_per_s\":" << r.opsPerSecond;
+			if (r.mbPerSecond > 0) out << ",\"mb_per_s\":" << r.mbPerSecond;
+			out << "}";
+		}
+		out << "]}" << endl;
+	}
+	return 0;
+}
@@ -0,0 +1,71 @@
+#!/bin/sh
+# Times tilemaker on a regional extract, and writes how long each phase took,
+# the input and tile throughput and peak memory to a JSON file.
+#
+#   bench/regional.sh [results.json]
+#
+# PBF is the extract to use; without it, $AREA (liechtenstein, as in CI) is
+# downloaded from Geofabrik. Those files change daily, so to compare runs, keep
+# one and set PBF_SHA256 to its checksum (which is recorded in the results).
+# TILEMAKER, CONFIG, PROCESS and THREADS can be set too, and TILEMAKER_ARGS are
+# passed through (e.g. "--store /tmp/store").
+
+set -e
+
+RESULTS=${1:-bench-regional.json}
+TILEMAKER=${TILEMAKER:-./tilemaker}
+CONFIG=${CONFIG:-resources/config-openmaptiles.json}
+PROCESS=${PROCESS:-resources/process-openmaptiles.lua}
+THREADS=${THREADS:-0}
+AREA=${AREA:-liechtenstein}
+
+if [ -z "$PBF" ]; then
+	PBF=$AREA.osm.pbf
+	[ -f "$PBF" ] || curl -fsSL "https://download.geofabrik.de/europe/$AREA-latest.osm.pbf" -o "$PBF"
+fi
+SHA256=$(sha256sum "$PBF" | cut -d' ' -f1)
+if [ -n "$PBF_SHA256" ] && [ "$PBF_SHA256" != "$SHA256" ]; then
+	echo "$PBF has checksum $SHA256, not $PBF_SHA256" >&2
+	exit 1
+fi
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+"$TILEMAKER" --input "$PBF" --output "$WORK/out.mbtiles" --config "$CONFIG" --process "$PROCESS" \
+	--threads "$THREADS" --log-phase-timings "$WORK/phases.json" --log-tile-timings "$WORK/tiles.ndjson" \
+	$TILEMAKER_ARGS > "$WORK/log.txt" 2>&1 || { cat "$WORK/log.txt" >&2; exit 1; }
+
+# Add up each tile phase across the tiles and layers, in seconds of work (not wall-clock)
+TILE_PHASES=$(awk '
+	{
+		while (match($0, /"[a-z]+_us":[0-9]+/)) {
+			pair = substr($0, RSTART + 1, RLENGTH - 1)
+			split(pair, kv, "\":")
+			if (kv[1] != "total_us") sum[kv[1]] += kv[2]
+			$0 = substr($0, RSTART + RLENGTH)
+		}
+	}
+	END {
+		sep = ""
+		for (k in sum) { name = k; sub(/_us$/, "_s", name); printf "%s\"%s\":%.3f", sep, name, sum[k] / 1e6; sep = "," }
+	}' "$WORK/tiles.ndjson")
+
+# Throughput from the phase timings tilemaker recorded
+awk -v pbf="$PBF" -v sha="$SHA256" -v tilePhases="$TILE_PHASES" '
+	function field(name,   re) {
+		re = "\"" name "\":[0-9.]+"
+		if (!match($0, re)) return 0
+		return substr($0, RSTART + length(name) + 3, RLENGTH - length(name) - 3) + 0
+	}
+	{
+		read = field("read_s"); tiles = field("tiles_s")
+		printf "{\"input\":\"%s\",\"sha256\":\"%s\",", pbf, sha
+		printf "\"input_mb_per_s\":%.3f,", (read > 0 ? field("input_bytes") / 1048576 / read : 0)
+		printf "\"tiles_per_s\":%.1f,", (tiles > 0 ? field("tiles_written") / tiles : 0)
+		printf "\"tile_phases\":{%s},", tilePhases
+		sub(/^\{/, "")
+		print
+	}' "$WORK/phases.json" > "$RESULTS"
+
+cat "$RESULTS"
@@ -0,0 +1,23 @@
+# LIBDEFLATE_FOUND - system has the libdeflate library
+# LIBDEFLATE_INCLUDE_DIR - the libdeflate include directory
+# LIBDEFLATE_LIBRARIES - The libraries needed to use libdeflate
+
+if(LIBDEFLATE_INCLUDE_DIR AND LIBDEFLATE_LIBRARIES)
+  set(LIBDEFLATE_FOUND TRUE)
+else(LIBDEFLATE_INCLUDE_DIR AND LIBDEFLATE_LIBRARIES)
+
+  find_path(LIBDEFLATE_INCLUDE_DIR NAMES libdeflate.h)
+  find_library(LIBDEFLATE_LIBRARIES NAMES deflate)
+
+  include(FindPackageHandleStandardArgs)
+  find_package_handle_standard_args(libdeflate DEFAULT_MSG LIBDEFLATE_INCLUDE_DIR LIBDEFLATE_LIBRARIES)
+
+  mark_as_advanced(LIBDEFLATE_INCLUDE_DIR LIBDEFLATE_LIBRARIES)
+endif(LIBDEFLATE_INCLUDE_DIR AND LIBDEFLATE_LIBRARIES)
+if (LIBDEFLATE_FOUND AND NOT TARGET libdeflate::libdeflate)
+  add_library(libdeflate::libdeflate UNKNOWN IMPORTED)
+  set_target_properties(libdeflate::libdeflate PROPERTIES
+          INTERFACE_INCLUDE_DIRECTORIES  ${LIBDEFLATE_INCLUDE_DIR})
+  set_property(TARGET libdeflate::libdeflate APPEND PROPERTY
+          IMPORTED_LOCATION "${LIBDEFLATE_LIBRARIES}")
+endif()
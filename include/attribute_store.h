@@ -7,20 +7,31 @@
 #include <map>
 #include <iostream>
 #include <atomic>
+#include <algorithm>
 #include <boost/functional/hash.hpp>
-#include <boost/container/flat_map.hpp>
 #include <vector>
+#include <memory>
+#include <cstring>
+#include <boost/utility/string_view.hpp>
+#include "intern_table.h"
 
 /* AttributeStore - global dictionary for attributes */
 
 typedef uint32_t AttributeIndex; // check this is enough
 
+class SnapshotWriter;
+class SnapshotReader;
+
 struct string_ptr_less_than {
 	bool operator()(const std::string* lhs, const std::string* rhs) const {            
 		return *lhs < *rhs;
 	}
 }; 
 
+// The interning indexes are sharded to reduce the odds of lock contention
+// when inserting. It should be at least 2x the number of your cores.
+#define SHARD_BITS 14
+
 class AttributeKeyStore {
 public:
 	AttributeKeyStore(): finalized(false), keys2indexSize(0) {}
@@ -39,45 +50,82 @@ private:
 	std::map<const std::string*, uint16_t, string_ptr_less_than> keys2index;
 };
 
+/** \brief Every distinct string value of an attribute, stored once
+*
+* Strings are copied into an append-only arena, in blocks that each thread
+* fills on its own, and referred to by a 32-bit index. Lookups don't lock
+* (see InternIndex), and each string's hash is worked out once.
+*/
+class AttributeStringStore {
+public:
+	struct StringRef {
+		const char *data;
+		uint32_t length;
+		uint32_t hashValue;
+
+		StringRef(): data(nullptr), length(0), hashValue(0) { }
+		StringRef(const char *data, size_t length);
+		size_t hash() const { return hashValue; }
+		bool operator==(const StringRef &other) const {
+			return length == other.length && hashValue == other.hashValue && memcmp(data, other.data, length) == 0;
+		}
+	};
+
+	AttributeStringStore(): refs(uint64_t(1) << 32), index(SHARD_BITS), count(0) { }
+
+	// Index of this string, storing it if it's new
+	uint32_t add(const std::string &str);
+	boost::string_view get(uint32_t i) const { const StringRef &ref = refs[i]; return boost::string_view(ref.data, ref.length); }
+	uint64_t size() const { return count.load(); }
+
+	// The one store used by all AttributePairs
+	static AttributeStringStore& shared();
+
+private:
+	char* allocate(size_t length);
+
+	ChunkedArray<StringRef> refs;
+	InternIndex<StringRef> index;
+	std::atomic<uint64_t> count;
+	std::mutex blocksMutex;
+	std::vector<std::unique_ptr<char[]>> blocks;
+};
+
 enum class AttributePairType: char { False = 0, True = 1, Float = 2, String = 3 };
-// AttributePair is a key/value pair (with minzoom)
+// AttributePair is a key/value pair (with minzoom). It's 8 bytes: string
+// values are in the AttributeStringStore.
 struct AttributePair {
-	std::string stringValue_;
-	float floatValue_;
+	uint32_t value_;		// the float's bits, or the string's index
 	short keyIndex;
 	char minzoom;
 	AttributePairType valueType;
 
+	AttributePair(): AttributePair(0, false, 0) { }
 	AttributePair(uint32_t keyIndex, bool value, char minzoom)
-		: keyIndex(keyIndex), valueType(value ? AttributePairType::True : AttributePairType::False), minzoom(minzoom)
+		: value_(0), keyIndex(keyIndex), minzoom(minzoom), valueType(value ? AttributePairType::True : AttributePairType::False)
 	{
 	}
 	AttributePair(uint32_t keyIndex, const std::string& value, char minzoom)
-		: keyIndex(keyIndex), valueType(AttributePairType::String), stringValue_(value), minzoom(minzoom)
+		: value_(AttributeStringStore::shared().add(value)), keyIndex(keyIndex), minzoom(minzoom), valueType(AttributePairType::String)
 	{
 	}
 	AttributePair(uint32_t keyIndex, float value, char minzoom)
-		: keyIndex(keyIndex), valueType(AttributePairType::Float), floatValue_(value), minzoom(minzoom)
+		: keyIndex(keyIndex), minzoom(minzoom), valueType(AttributePairType::Float)
 	{
+		memcpy(&value_, &value, sizeof(value_));
 	}
 
+	// Strings are interned, so comparing indices compares the strings
 	bool operator==(const AttributePair &other) const {
-		if (minzoom!=other.minzoom || keyIndex!=other.keyIndex || valueType!=other.valueType) return false;
-		if (valueType == AttributePairType::String)
-			return stringValue_ == other.stringValue_;
-
-		if (valueType == AttributePairType::Float)
-			return floatValue_ == other.floatValue_;
-
-		return true;
+		return value_ == other.value_ && keyIndex == other.keyIndex && minzoom == other.minzoom && valueType == other.valueType;
 	}
 
 	bool hasStringValue() const { return valueType == AttributePairType::String; }
 	bool hasFloatValue() const { return valueType == AttributePairType::Float; }
 	bool hasBoolValue() const { return valueType == AttributePairType::True || valueType == AttributePairType::False; };
 
-	const std::string& stringValue() const { return stringValue_; }
-	float floatValue() const { return floatValue_; }
+	boost::string_view stringValue() const { return AttributeStringStore::shared().get(value_); }
+	float floatValue() const { float v; memcpy(&v, &value_, sizeof(v)); return v; }
 	bool boolValue() const { return valueType == AttributePairType::True; }
 
 	static bool isHot(const AttributePair& pair, const std::string& keyName) {
@@ -123,117 +171,124 @@ struct AttributePair {
 		std::size_t rv = minzoom;
 		boost::hash_combine(rv, keyIndex);
 		boost::hash_combine(rv, valueType);
-
-		if(hasStringValue())
-			boost::hash_combine(rv, stringValue());
-		else if(hasFloatValue())
-			boost::hash_combine(rv, floatValue());
-		else if(hasBoolValue())
-			boost::hash_combine(rv, boolValue());
-		else {
-			throw new std::out_of_range("cannot hash pair, unknown value");
-		}
-
+		boost::hash_combine(rv, value_);
 		return rv;
 	}
 };
 
 
-// We shard the cold pools to reduce the odds of lock contention on
-// inserting/retrieving the "cold" pairs.
-//
-// It should be at least 2x the number of your cores -- 256 shards is probably
-// reasonable for most people.
-//
-// We also reserve the bottom shard for the hot pool.
-#define SHARD_BITS 14
-#define ATTRIBUTE_SHARDS (1 << SHARD_BITS)
+// Pair indices below this are "hot" (see AttributePair::isHot), so fit in a short
+#define HOT_PAIRS (1u << 16)
+
+// Once a key has been used this many times, its statistics decide whether
+// its values go in the hot pool, not AttributePair::isHot's guess
+#define KEY_SAMPLE 10000
+#define KEY_COUNT_BATCH 64
+
+/** \brief How often each attribute key is used, and how many values it has
+*
+* Keys whose values repeat a lot (like class=, surface=) are worth putting in
+* the hot pool, whatever they look like; keys that rarely repeat (ref=,
+* osm_id=) would just fill it up. Counters are updated as attributes are
+* added, so this adapts to the data as it's read.
+*
+* Nearly every attribute of a common key would otherwise add to the same
+* counter, so each thread counts uses itself and adds them to the shared
+* count every KEY_COUNT_BATCH. isHot() sees the shared count and the calling
+* thread's own, which is close enough to decide on; count() adds what every
+* thread still holds.
+*/
+class AttributeKeyStats {
+public:
+	AttributeKeyStats(): stats(new KeyStats[65536]), id(nextId++) { }
+
+	// The key was used in an attribute
+	void used(uint16_t keyIndex) {
+		std::atomic<uint16_t> &local = localCounts()[keyIndex];
+		// Only this thread writes its counts, so this needn't be a locked add
+		uint16_t n = local.load(std::memory_order_relaxed) + 1;
+		if (n == KEY_COUNT_BATCH) {
+			stats[keyIndex].count.fetch_add(KEY_COUNT_BATCH, std::memory_order_relaxed);
+			n = 0;
+		}
+		local.store(n, std::memory_order_relaxed);
+	}
+	// This is the first time we've seen this pair
+	void stored(const AttributePair &pair) {
+		KeyStats &s = stats[pair.keyIndex];
+		s.distinct.fetch_add(1, std::memory_order_relaxed);
+		s.bytes.fetch_add(sizeof(AttributePair) + (pair.hasStringValue() ? pair.stringValue().size() : 0), std::memory_order_relaxed);
+	}
+
+	bool isHot(const AttributePair &pair, const std::string &keyName) const;
+
+	uint64_t count(uint16_t keyIndex) const;
+	uint64_t distinct(uint16_t keyIndex) const { return stats[keyIndex].distinct.load(); }
+	uint64_t bytes(uint16_t keyIndex) const { return stats[keyIndex].bytes.load(); }
+
+private:
+	struct KeyStats {
+		std::atomic<uint64_t> count, distinct, bytes;
+		KeyStats(): count(0), distinct(0), bytes(0) { }
+	};
+	typedef std::unique_ptr<std::atomic<uint16_t>[]> local_counts_t;
+
+	std::atomic<uint16_t>* localCounts() const;
+
+	std::unique_ptr<KeyStats[]> stats;
+	// Each thread's uses not yet added to stats, owned here so they outlive the thread
+	mutable std::mutex localMutex;
+	mutable std::vector<local_counts_t> locals;
+	const uint64_t id;			// so a thread can tell a new AttributeKeyStats at an old address
+	static std::atomic<uint64_t> nextId;
+};
 
 class AttributePairStore {
 public:
 	AttributePairStore():
 		finalized(false),
-		pairs(ATTRIBUTE_SHARDS),
-		pairsMaps(ATTRIBUTE_SHARDS),
-		pairsMutex(ATTRIBUTE_SHARDS),
-		hotShardSize(0)
+		pairs(uint64_t(1) << 32),
+		pairIndex(SHARD_BITS),
+		hotCount(0),
+		coldCount(0)
 	{
-		// NB: the hot shard is stored in its own, pre-allocated vector.
-		// pairs[0] is _not_ the hot shard
-		hotShard.reserve(1 << 16);
-		for (size_t i = 0; i < 1 << 16; i++)
-			hotShard.push_back(AttributePair(0, false, 0));
+		// Index 0 is never handed out, but is a valid (dummy) pair
+		pairs.store(0, AttributePair());
 	}
 
 	void finalize() { finalized = true; }
-	const AttributePair& getPair(uint32_t i) const;
-	const AttributePair& getPairUnsafe(uint32_t i) const;
+	// Both are a plain array lookup; getPairUnsafe is kept for callers that predate that
+	const AttributePair& getPair(uint32_t i) const { return pairs[i]; }
+	const AttributePair& getPairUnsafe(uint32_t i) const { return pairs[i]; }
 	uint32_t addPair(const AttributePair& pair, bool isHot);
 
-	struct key_value_less_ptr {
-		bool operator()(AttributePair const* lhs, AttributePair const* rhs) const {            
-			if (lhs->minzoom != rhs->minzoom)
-				return lhs->minzoom < rhs->minzoom;
-			if (lhs->keyIndex != rhs->keyIndex)
-				return lhs->keyIndex < rhs->keyIndex;
-			if (lhs->valueType != rhs->valueType) return lhs->valueType < rhs->valueType;
-
-			if (lhs->hasStringValue()) return lhs->stringValue() < rhs->stringValue();
-			if (lhs->hasBoolValue()) return lhs->boolValue() < rhs->boolValue();
-			if (lhs->hasFloatValue()) return lhs->floatValue() < rhs->floatValue();
-			throw std::runtime_error("Invalid type in attribute store");
-		}
-	}; 
+	uint32_t hotPairCount() const { return std::min(hotCount.load(), HOT_PAIRS - 1); }
+	uint64_t coldPairCount() const { return coldCount.load(); }
+
+	// Save the pairs to a snapshot, or replace them with a saved copy. Loaded
+	// pairs can be read, but aren't indexed, so no more can be added.
+	void saveSnapshot(SnapshotWriter &out) const;
+	void loadSnapshot(SnapshotReader &in);
 
-	std::vector<std::deque<AttributePair>> pairs;
-	std::vector<boost::container::flat_map<const AttributePair*, uint32_t, AttributePairStore::key_value_less_ptr>> pairsMaps;
+	AttributeKeyStats keyStats;
 
 private:
 	bool finalized;
 	// We refer to all attribute pairs by index.
 	//
-	// Each shard is responsible for a portion of the key space.
-	// 
-	// The 0th shard is special: it's the hot shard, for pairs
-	// we suspect will be popular. It only ever has 64KB items,
-	// so that we can reference it with a short.
-	mutable std::vector<std::mutex> pairsMutex;
-	std::atomic<uint32_t> hotShardSize;
-	std::vector<AttributePair> hotShard;
+	// Indices 1 to 65535 are the hot pool, for pairs we suspect will be
+	// popular, so that we can reference them with a short. (0 is unused.)
+	// The rest start at 65536.
+	ChunkedArray<AttributePair> pairs;
+	InternIndex<AttributePair> pairIndex;
+	std::atomic<uint32_t> hotCount;
+	std::atomic<uint64_t> coldCount;
 };
 
 // AttributeSet is a set of AttributePairs
 // = the complete attributes for one object
 struct AttributeSet {
 
-	struct less_ptr {
-		bool operator()(const AttributeSet* lhs, const AttributeSet* rhs) const {            
-			if (lhs->useVector != rhs->useVector)
-				return lhs->useVector < rhs->useVector;
-
-			if (lhs->useVector) {
-				if (lhs->intValues.size() != rhs->intValues.size())
-					return lhs->intValues.size() < rhs->intValues.size();
-
-				for (int i = 0; i < lhs->intValues.size(); i++) {
-					if (lhs->intValues[i] != rhs->intValues[i]) {
-						return lhs->intValues[i] < rhs->intValues[i];
-					}
-				}
-
-				return false;
-			}
-
-			for (int i = 0; i < sizeof(lhs->shortValues)/sizeof(lhs->shortValues[0]); i++) {
-				if (lhs->shortValues[i] != rhs->shortValues[i]) {
-					return lhs->shortValues[i] < rhs->shortValues[i];
-				}
-			}
-
-			return false;
-		}
-	}; 
-
 	size_t hash() const {
 		// Values are in canonical form after finalizeSet is called, so
 		// can hash them in the order they're stored.
@@ -303,6 +358,17 @@ struct AttributeSet {
 		return rv;
 	}
 
+	// Call f with the index of each pair, in order
+	template <class F>
+	void forEachPair(const F& f) const {
+		if (useVector) {
+			for (uint32_t pairIndex : intValues) f(pairIndex);
+			return;
+		}
+		for (size_t i = 0; i < 8; i++)
+			if (isSet(i)) f(getValueAtIndex(i));
+	}
+
 	const uint32_t getPair(size_t i) const {
 		if (useVector)
 			return intValues[i];
@@ -364,7 +430,7 @@ private:
 	}
 	uint32_t getValueAtIndex(size_t index) const {
 		if (index < 4)
-			return shortValues[index];
+			return uint16_t(shortValues[index]);
 
 		return ((uint32_t*)(&shortValues[4]))[index - 4];
 	}
@@ -376,22 +442,52 @@ private:
 	}
 };
 
+// We can't use the top 2 bits of a set's index (see OutputObject's bitfields)
+#define MAX_ATTRIBUTE_SETS (1u << 30)
+
+// The pair indices of one set, as flattened by AttributeStore::finalize
+struct AttributeSpan {
+	const uint32_t *first, *last;
+	char maxMinZoom;		// every pair is shown at this zoom and above
+
+	const uint32_t* begin() const { return first; }
+	const uint32_t* end() const { return last; }
+	size_t size() const { return last - first; }
+};
+
 // AttributeStore is the store for all AttributeSets
 struct AttributeStore {
 	AttributeIndex add(AttributeSet &attributes);
+	// Only for sets added before the last finalize(); doesn't allocate
+	AttributeSpan getSpan(AttributeIndex index) const {
+		if (index >= flattenedCount)
+			throw std::runtime_error("Failed to fetch attributes at index "+std::to_string(index));
+		return AttributeSpan { setPairs.data() + setOffsets[index], setPairs.data() + setOffsets[index + 1], setMinZooms[index] };
+	}
 	std::vector<const AttributePair*> getUnsafe(AttributeIndex index) const;
+	std::vector<AttributePair> get(AttributeIndex index) const;		// copies the pairs
 	void reportSize() const;
+	// Flatten the sets added since the last call, for getSpan. Sets may be
+	// added while it runs, but nothing may call getSpan.
 	void finalize();
 
+	// Save the keys, pairs and flattened sets to a snapshot (after finalize), or
+	// replace them with a saved copy, which can only be read with getSpan
+	void saveSnapshot(SnapshotWriter &out) const;
+	void loadSnapshot(SnapshotReader &in);
+
 	void addAttribute(AttributeSet& attributeSet, std::string const &key, const std::string& v, char minzoom);
 	void addAttribute(AttributeSet& attributeSet, std::string const &key, float v, char minzoom);
 	void addAttribute(AttributeSet& attributeSet, std::string const &key, bool v, char minzoom);
+
 	
 	AttributeStore():
 		finalized(false),
-		sets(ATTRIBUTE_SHARDS),
-		setsMaps(ATTRIBUTE_SHARDS),
-		setsMutex(ATTRIBUTE_SHARDS),
+		sets(MAX_ATTRIBUTE_SETS),
+		setIndex(SHARD_BITS),
+		setCount(0),
+		flattenedCount(0),
+		setOffsets(1, 0),
 		lookups(0) {
 	}
 
@@ -399,12 +495,21 @@ struct AttributeStore {
 	AttributePairStore pairStore;
 
 private:
+	void addAttribute(AttributeSet& attributeSet, const AttributePair& kv, std::string const &key);
+
 	bool finalized;
-	std::vector<std::deque<AttributeSet>> sets;
-	std::vector<boost::container::flat_map<const AttributeSet*, uint32_t, AttributeSet::less_ptr>> setsMaps;
-	mutable std::vector<std::mutex> setsMutex;
+	ChunkedArray<AttributeSet> sets;
+	InternIndex<AttributeSet> setIndex;
+	std::atomic<uint32_t> setCount;
+
+	// After finalize(), set n's pairs are setPairs[setOffsets[n]] to
+	// setPairs[setOffsets[n+1]-1], so tiles can be written without
+	// decoding each AttributeSet
+	uint32_t flattenedCount;
+	std::vector<uint64_t> setOffsets;
+	std::vector<uint32_t> setPairs;
+	std::vector<char> setMinZooms;
 
-	mutable std::mutex mutex;
 	std::atomic<uint64_t> lookups;
 };
 
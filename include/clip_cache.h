@@ -4,35 +4,56 @@
 #include "coordinates.h"
 #include "coordinates_geom.h"
 #include "geom.h"
+#include "tile_pool.h"
 #include <mutex>
+#include <atomic>
 
 class TileBbox;
 
+/** \brief Cache of geometries already clipped to a tile, so that clipping a
+*          child tile can start from its parent's clip
+*
+* The cache is split into shards by object ID. Each shard is a fixed-capacity,
+* open-addressed hash table whose entries live in a ring buffer, so the oldest
+* clip is evicted first once the shard runs out of entries or bytes. There is
+* no per-entry bookkeeping beyond the ring position.
+*
+* With the tile pool in groups (one per NUMA node), each group has its own
+* share of the shards for clips, as its threads write their own z6 subtrees:
+* its clips stay in its socket's memory and cache, and aren't evicted by the
+* other sockets' clips. Entries stored under an exact key are shared by all.
+*/
 template <class T>
 class ClipCache {
 public:
-	ClipCache(size_t threadNum, unsigned int baseZoom):
+	// Entries per shard, and the approximate bytes of geometry each shard may hold
+	static const size_t shardCapacity = 1024;
+	static const size_t defaultShardBytes = 4 * 1024 * 1024;
+
+	ClipCache(size_t threadNum, unsigned int baseZoom, size_t shardBytes = defaultShardBytes):
 		baseZoom(baseZoom),
-		clipCache(threadNum * 16),
-		clipCacheMutex(threadNum * 16),
-		clipCacheSize(threadNum * 16) {
+		shardBytes(shardBytes),
+		shards(threadNum * 16) {
 	}
 
 	const std::shared_ptr<T> get(uint zoom, TileCoordinate x, TileCoordinate y, NodeID objectID) const{
 		// Look for a previously clipped version at z-1, z-2, ...
-
-		std::lock_guard<std::mutex> lock(clipCacheMutex[objectID % clipCacheMutex.size()]);
-		while (zoom > 0) {
-			zoom--;
-			x /= 2;
-			y /= 2;
-			const auto& cache = clipCache[objectID % clipCache.size()];
-			const auto& rv = cache.find(std::make_tuple(zoom, TileCoordinates(x, y), objectID));
-			if (rv != cache.end()) {
-				return rv->second;
+		const Shard& shard = groupShard(objectID);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		if (!shard.ring.empty()) {
+			while (zoom > 0) {
+				zoom--;
+				x /= 2;
+				y /= 2;
+				size_t slot;
+				if (shard.find(zoom, TileCoordinates(x, y), objectID, slot)) {
+					shard.hits++;
+					return shard.ring[shard.slots[slot]].geometry;
+				}
 			}
 		}
 
+		shard.misses++;
 		return nullptr;
 	}
 
@@ -41,39 +62,163 @@ public:
 		// pointless.
 		if (bbox.zoom == baseZoom)
 			return;
+		store(groupShard(objectID), bbox.zoom, bbox.index, objectID, output);
+	}
+
+	// Look up and store entries under exactly this key, when it isn't a clip to a
+	// tile (e.g. a whole object simplified for a zoom)
+	const std::shared_ptr<T> getExact(uint zoom, TileCoordinates index, NodeID objectID) const {
+		const Shard& shard = shards[objectID % shards.size()];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		size_t slot;
+		if (!shard.ring.empty() && shard.find(zoom, index, objectID, slot)) {
+			shard.hits++;
+			return shard.ring[shard.slots[slot]].geometry;
+		}
+		shard.misses++;
+		return nullptr;
+	}
+
+	void put(uint zoom, TileCoordinates index, const NodeID objectID, const T& output) {
+		store(shards[objectID % shards.size()], zoom, index, objectID, output);
+	}
 
+	// Each shard counts under the lock its lookups already hold, so there's no
+	// shared counter for the threads to fight over; they're summed here
+	uint64_t hitCount() const { return countAll(&Shard::hits); }
+	uint64_t missCount() const { return countAll(&Shard::misses); }
+
+private:
+	struct Shard;
+
+	// The shard for this object's clips, among those of the calling thread's group
+	Shard& groupShard(NodeID objectID) const {
+		const size_t groups = std::min(TilePool::groupCount(), shards.size());
+		const size_t perGroup = shards.size() / groups;
+		return shards[(TilePool::currentGroup() % groups) * perGroup + objectID % perGroup];
+	}
+
+	void store(Shard& shard, uint zoom, TileCoordinates index, const NodeID objectID, const T& output) {
 		std::shared_ptr<T> copy = std::make_shared<T>();
 		boost::geometry::assign(*copy, output);
+		const size_t bytes = sizeof(T) + boost::geometry::num_points(*copy) * sizeof(Point);
+
+		// Evicted geometries are destroyed after the lock is released
+		std::vector<std::shared_ptr<T>> evicted;
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		if (shard.ring.empty()) {
+			shard.ring.resize(shardCapacity);
+			shard.slots.assign(shardCapacity * 2, uint32_t(Shard::emptySlot));
+		}
+
+		size_t slot;
+		if (shard.find(zoom, index, objectID, slot)) {
+			Entry& entry = shard.ring[shard.slots[slot]];
+			shard.bytes -= entry.bytes;
+			evicted.push_back(std::move(entry.geometry));
+			entry.geometry = copy;
+			entry.bytes = bytes;
+			shard.bytes += bytes;
+			return;
+		}
 
-		size_t index = objectID % clipCacheMutex.size();
-		std::vector<std::shared_ptr<T>> objects;
-		std::lock_guard<std::mutex> lock(clipCacheMutex[index]);
-		auto& cache = clipCache[index];
-		// Reset the cache periodically so it doesn't grow without bound.
-		//
-		// I also tried boost's lru_cache -- but it seemed to perform worse, maybe
-		// due to the bookkeeping? We could try authoring a bounded map that
-		// evicts in FIFO order, which will have less bookkeeping.
-		clipCacheSize[index]++;
-		if (clipCacheSize[index] > 1024) {
-			clipCacheSize[index] = 0;
-			// Copy the map's contents to a vector so that calling .clear()
-			// and releasing the lock can happen separately from running the
-			// destructors of all of the objects.
-			objects.reserve(1025);
-			for (const auto& x : cache)
-				objects.push_back(x.second);
-			cache.clear();
+		if (shard.count == shardCapacity || shard.bytes + bytes > shardBytes) {
+			while (shard.count > 0 && (shard.count == shardCapacity || shard.bytes + bytes > shardBytes))
+				evicted.push_back(shard.evictOldest());
+			shard.find(zoom, index, objectID, slot);
 		}
 
-		cache[std::make_tuple(bbox.zoom, bbox.index, objectID)] = copy;
+		uint32_t position = shard.head;
+		Entry& entry = shard.ring[position];
+		entry.zoom = zoom;
+		entry.index = index;
+		entry.objectID = objectID;
+		entry.bytes = bytes;
+		entry.geometry = copy;
+		shard.slots[slot] = position;
+		shard.head = (shard.head + 1) % shardCapacity;
+		shard.count++;
+		shard.bytes += bytes;
+	}
+
+	struct Entry {
+		uint16_t zoom;
+		TileCoordinates index;
+		NodeID objectID;
+		size_t bytes;
+		std::shared_ptr<T> geometry;
+	};
+
+	struct Shard {
+		static const uint32_t emptySlot = 0xFFFFFFFF;
+
+		mutable std::mutex mutex;
+		std::vector<Entry> ring;		// entries in insertion order
+		std::vector<uint32_t> slots;	// open-addressed index into ring
+		uint32_t head = 0;				// next ring position to write
+		size_t count = 0;
+		size_t bytes = 0;
+		mutable uint64_t hits = 0, misses = 0;	// under the mutex
+
+		static size_t hash(uint16_t zoom, const TileCoordinates& index, NodeID objectID) {
+			uint64_t h = objectID * 0x9E3779B97F4A7C15ull;
+			h ^= (uint64_t(index.x) << 32 | index.y) + 0x632BE59BD9B4E019ull + (h << 6) + (h >> 2);
+			h ^= zoom + (h << 6) + (h >> 2);
+			return h;
+		}
+
+		// Find the slot holding this key, or else the empty slot where it belongs
+		bool find(uint16_t zoom, const TileCoordinates& index, NodeID objectID, size_t& slot) const {
+			const size_t mask = slots.size() - 1;
+			slot = hash(zoom, index, objectID) & mask;
+			while (slots[slot] != emptySlot) {
+				const Entry& entry = ring[slots[slot]];
+				if (entry.objectID == objectID && entry.zoom == zoom && entry.index == index)
+					return true;
+				slot = (slot + 1) & mask;
+			}
+			return false;
+		}
+
+		std::shared_ptr<T> evictOldest() {
+			const uint32_t position = (head + shardCapacity - count) % shardCapacity;
+			Entry& entry = ring[position];
+			size_t slot;
+			find(entry.zoom, entry.index, entry.objectID, slot);
+
+			// Backward-shift deletion, so lookups never need tombstones
+			const size_t mask = slots.size() - 1;
+			size_t next = (slot + 1) & mask;
+			while (slots[next] != emptySlot) {
+				const Entry& moving = ring[slots[next]];
+				const size_t home = hash(moving.zoom, moving.index, moving.objectID) & mask;
+				// Move it into the gap if its home isn't cyclically within (slot, next]
+				if (((next - home) & mask) >= ((next - slot) & mask)) {
+					slots[slot] = slots[next];
+					slot = next;
+				}
+				next = (next + 1) & mask;
+			}
+			slots[slot] = emptySlot;
+
+			count--;
+			bytes -= entry.bytes;
+			return std::move(entry.geometry);
+		}
+	};
+
+	uint64_t countAll(uint64_t Shard::*counter) const {
+		uint64_t total = 0;
+		for (const Shard& shard : shards) {
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			total += shard.*counter;
+		}
+		return total;
 	}
 
-private:
 	unsigned int baseZoom;
-	std::vector<std::map<std::tuple<uint16_t, TileCoordinates, NodeID>, std::shared_ptr<T>>> clipCache;
-	mutable std::vector<std::mutex> clipCacheMutex;
-	std::vector<size_t> clipCacheSize;
+	size_t shardBytes;
+	mutable std::vector<Shard> shards;
 };
 
 #endif
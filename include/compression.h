@@ -0,0 +1,53 @@
+/*! \file */
+#ifndef _COMPRESSION_H
+#define _COMPRESSION_H
+
+#include <string>
+#include <map>
+#include <zlib.h>
+
+#ifdef TM_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#ifdef TM_ZSTD
+#include <zstd.h>
+#endif
+
+enum class CompressionType { None, Deflate, Gzip, Zstd };
+
+// Parse "gzip","deflate","zstd" or "none"
+bool parseCompressionType(const std::string &name, CompressionType &type);
+
+/** \brief Reusable compressor state for one thread
+*
+* Setting up zlib's deflate state for every tile is expensive, so each thread
+* keeps one stream per (format, level) and resets it between calls. If tilemaker
+* is built with libdeflate (-DTM_LIBDEFLATE), that is used instead for gzip and
+* deflate; zstd is available when built with -DTM_ZSTD.
+*/
+class TileCompressor {
+public:
+	TileCompressor();
+	~TileCompressor();
+	TileCompressor(const TileCompressor&) = delete;
+	TileCompressor& operator=(const TileCompressor&) = delete;
+
+	// A level of -1 means the codec's default
+	void compress(const std::string &input, CompressionType type, int level, std::string &output);
+
+	/// The compressor for the calling thread
+	static TileCompressor &forThread();
+
+private:
+	std::map<std::pair<bool, int>, z_stream*> zlibStreams;
+	void compressZlib(const std::string &input, bool asGzip, int level, std::string &output);
+
+#ifdef TM_LIBDEFLATE
+	std::map<int, libdeflate_compressor*> libdeflateCompressors;
+#endif
+#ifdef TM_ZSTD
+	ZSTD_CCtx *zstdContext;
+#endif
+};
+
+#endif //_COMPRESSION_H
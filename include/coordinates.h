@@ -77,6 +77,34 @@ namespace std {
 	};
 }
 
+// Interleave the bits of x and y (x above y). Sorting on the result orders
+// tiles of one zoom level depth-first through the quadtree.
+inline uint64_t interleaveBits(uint32_t x, uint32_t y) {
+	auto spread = [](uint64_t v) {
+		v = (v | (v << 16)) & 0x0000FFFF0000FFFFull;
+		v = (v | (v << 8))  & 0x00FF00FF00FF00FFull;
+		v = (v | (v << 4))  & 0x0F0F0F0F0F0F0F0Full;
+		v = (v | (v << 2))  & 0x3333333333333333ull;
+		v = (v | (v << 1))  & 0x5555555555555555ull;
+		return v;
+	};
+	return (spread(x) << 1) | spread(y);
+}
+
+inline void deinterleaveBits(uint64_t key, uint32_t &x, uint32_t &y) {
+	auto compact = [](uint64_t v) {
+		v &= 0x5555555555555555ull;
+		v = (v | (v >> 1))  & 0x3333333333333333ull;
+		v = (v | (v >> 2))  & 0x0F0F0F0F0F0F0F0Full;
+		v = (v | (v >> 4))  & 0x00FF00FF00FF00FFull;
+		v = (v | (v >> 8))  & 0x0000FFFF0000FFFFull;
+		v = (v | (v >> 16)) & 0x00000000FFFFFFFFull;
+		return uint32_t(v);
+	};
+	x = compact(key >> 1);
+	y = compact(key);
+}
+
 struct LatpLon {
 	int32_t latp;
 	int32_t lon;
@@ -87,13 +115,23 @@ namespace std {
 	template<>
 	struct hash<LatpLon> {
 		size_t operator()(const LatpLon &ll) const {
-			return std::hash<int32_t>()(ll.latp) ^ std::hash<int32_t>()(ll.lon);
+			// Both halves, so points with latp and lon swapped don't collide
+			return std::hash<uint64_t>()((uint64_t(uint32_t(ll.latp)) << 32) | uint32_t(ll.lon));
 		}
 	};
 }
 
 typedef std::vector<LatpLon> LatpLonVec;
-typedef std::deque<LatpLon> LatpLonDeque;
+
+// Rings or linestrings joined from a relation's ways, stored one after another
+struct LatpLonRings {
+	std::vector<LatpLon> points;
+	std::vector<std::size_t> ends;		// one past each one's last point
+
+	std::size_t size() const { return ends.size(); }
+	const LatpLon *begin(std::size_t i) const { return points.data() + (i == 0 ? 0 : ends[i - 1]); }
+	const LatpLon *end(std::size_t i) const { return points.data() + ends[i]; }
+};
 
 double deg2rad(double deg);
 double rad2deg(double rad);
@@ -114,6 +152,12 @@ double lat2tileyf(double lat, uint8_t z);
 uint32_t lon2tilex(double lon, uint8_t z);
 uint32_t latp2tiley(double latp, uint8_t z);
 uint32_t lat2tiley(double lat, uint8_t z);
+// As above, but coordinates outside the world give the nearest tile on its edge
+uint32_t lon2tilexClamped(double lon, uint8_t z);
+uint32_t latp2tileyClamped(double latp, uint8_t z);
+// For the far edge of a box: the last tile that starts before it
+uint32_t lon2tilexClampedEnd(double lon, uint8_t z);
+uint32_t latp2tileyClampedEnd(double latp, uint8_t z);
 double tilex2lon(uint32_t x, uint8_t z);
 double tiley2latp(uint32_t y, uint8_t z);
 double tiley2lat(uint32_t y, uint8_t z);
@@ -41,9 +41,10 @@ typedef std::pair<Box, uint> IndexValue;
 typedef boost::geometry::index::rtree< IndexValue, boost::geometry::index::quadratic<16> > RTree;
 
 // Perform self-intersection aware simplification of geometry types
+// (fast: don't check for self-intersections, or merge rings that now overlap)
 Linestring simplify(Linestring const &ls, double max_distance);
-Polygon simplify(Polygon const &p, double max_distance);
-MultiPolygon simplify(MultiPolygon const &mp, double max_distance);
+Polygon simplify(Polygon const &p, double max_distance, bool fast = false);
+MultiPolygon simplify(MultiPolygon const &mp, double max_distance, bool fast = false);
 
 // Combine overlapping elements by performing a union
 template<typename C, typename T>
@@ -77,10 +78,23 @@ void make_valid(GeometryT &geom) { }
 
 void make_valid(MultiPolygon &mp);
 
+// Whether a geometry is cheaply shown to be valid: a polygon with a single
+// simple ring, or a linestring with no repeated points or spikes. False means
+// it may or may not be valid, and should be checked with geom::is_valid.
+template<class GeometryT>
+bool is_simple_valid(GeometryT const &geom) { return false; }
+
+bool is_simple_valid(MultiPolygon const &mp);
+bool is_simple_valid(Linestring const &ls);
+
 Point intersect_edge(Point const &a, Point const &b, char edge, Box const &bbox);
 char bit_code(Point const &p, Box const &bbox);
+bool segment_intersects(Point const &a, Point const &b, Box const &bbox);
 void fast_clip(Ring &points, Box const &bbox);
-void fast_clip(MultiPolygon &mp, Box const &bbox);
+// Clip a multipolygon to an axis-aligned box. Returns false if the result has
+// overlapping edges along the box, in which case it should be clipped with
+// boost instead.
+bool fast_clip(MultiPolygon &mp, Box const &bbox);
 
 #endif //_GEOM_TYPES_H
 
@@ -1,53 +1,183 @@
 #ifndef _GEOMETRY_CACHE_H
 #define _GEOMETRY_CACHE_H
 
-// A small class to map from ID -> geometry, with
-// a bounded size and LRU-ish behaviour.
-//
-// Not safe for multi-threaded use!
+// A map from ID -> geometry, shared between threads, with a bounded size
+// (in bytes) and FIFO eviction.
 
 #include "coordinates.h"
+#include "geom.h"
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <vector>
 
-#define NUM_BUCKETS 256
-// Keep bucket size small so linear search is fast
-#define BUCKET_SIZE 32
-
-
+/** \brief Cache of way geometries rebuilt from the way store
+*
+* Neighbouring tiles, often written by different threads, keep asking for the
+* same long ways, so the cache is shared. As with ClipCache, it's split into
+* shards by ID, each an open-addressed table over a ring buffer of entries,
+* and the oldest entry is evicted once a shard runs out of entries or bytes.
+*/
 template <class T>
 class GeometryCache {
 public:
-	GeometryCache():
-		offsets(NUM_BUCKETS),
-		ids(NUM_BUCKETS * BUCKET_SIZE),
-		geometries(NUM_BUCKETS * BUCKET_SIZE) {}
+	static const size_t shardCapacity = 4096;
+	static const size_t defaultBytes = 64 * 1024 * 1024;
 
-	T* get(NodeID objectID) {
-		const size_t bucket = objectID % NUM_BUCKETS;
+	GeometryCache(size_t threadNum, size_t maxBytes = defaultBytes):
+		shards(std::max<size_t>(1, threadNum) * 16),
+		shardBytes(maxBytes / shards.size()) {
+	}
 
-		for (size_t i = bucket * BUCKET_SIZE; i < (bucket + 1) * BUCKET_SIZE; i++)
-			if (ids[i] == objectID)
-				return geometries[i].get();
+	// Only call this before the cache is used
+	void setCapacity(size_t maxBytes) { shardBytes = maxBytes / shards.size(); }
 
+	std::shared_ptr<const T> get(NodeID objectID) const {
+		const Shard& shard = shards[objectID % shards.size()];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		size_t slot;
+		if (!shard.ring.empty() && shard.find(objectID, slot)) {
+			shard.hits++;
+			return shard.ring[shard.slots[slot]].geometry;
+		}
+		shard.misses++;
 		return nullptr;
 	}
 
-	void add(NodeID objectID, std::shared_ptr<T> geom) {
-		const size_t bucket = objectID % NUM_BUCKETS;
-		size_t offset = bucket * BUCKET_SIZE + offsets[bucket];
-		geometries[offset] = geom;
-		ids[offset] = objectID;
-		offsets[bucket]++;
+	void add(NodeID objectID, std::shared_ptr<const T> geometry) {
+		const size_t bytes = bytesOf(*geometry);
+		if (bytes > shardBytes) return;
+
+		// Evicted geometries are destroyed after the lock is released
+		std::vector<std::shared_ptr<const T>> evicted;
+		Shard& shard = shards[objectID % shards.size()];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		if (shard.ring.empty()) {
+			shard.ring.resize(shardCapacity);
+			shard.slots.assign(shardCapacity * 2, uint32_t(Shard::emptySlot));
+		}
+
+		// Another thread may have built it at the same time
+		size_t slot;
+		if (shard.find(objectID, slot)) return;
+
+		if (shard.count == shardCapacity || shard.bytes + bytes > shardBytes) {
+			while (shard.count > 0 && (shard.count == shardCapacity || shard.bytes + bytes > shardBytes))
+				evicted.push_back(shard.evictOldest());
+			shard.find(objectID, slot);
+		}
 
-		if (offsets[bucket] == BUCKET_SIZE)
-			offsets[bucket] = 0;
+		uint32_t position = shard.head;
+		Entry& entry = shard.ring[position];
+		entry.objectID = objectID;
+		entry.bytes = bytes;
+		entry.geometry = std::move(geometry);
+		shard.slots[slot] = position;
+		shard.head = (shard.head + 1) % shardCapacity;
+		shard.count++;
+		shard.bytes += bytes;
 	}
 
+	void clear() {
+		for (Shard& shard : shards) {
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			shard.ring.clear();
+			shard.slots.clear();
+			shard.head = 0;
+			shard.count = 0;
+			shard.bytes = 0;
+		}
+	}
+
+	// Counted per shard, under the lock a lookup already holds, as in ClipCache
+	uint64_t hitCount() const { return countAll(&Shard::hits); }
+	uint64_t missCount() const { return countAll(&Shard::misses); }
+
 private:
-	std::vector<uint8_t> offsets;
-	std::vector<NodeID> ids;
-	// CONSIDER: we could use a raw pointer - getOrBuildLinestring controls the lifetime
-	std::vector<std::shared_ptr<Linestring>> geometries;
+	// What a geometry takes on the heap, in its own point type, with its rings' vectors
+	template<class Range> static size_t pointBytes(const Range& points) {
+		return points.capacity() * sizeof(typename boost::geometry::point_type<Range>::type);
+	}
+	static size_t bytesOf(const Linestring& ls) { return sizeof(ls) + pointBytes(ls); }
+	static size_t bytesOf(const MultiPolygon& mp) {
+		size_t bytes = sizeof(mp) + (mp.capacity() - mp.size()) * sizeof(Polygon);
+		for (const Polygon& polygon : mp) {
+			bytes += sizeof(Polygon) + pointBytes(polygon.outer()) + polygon.inners().capacity() * sizeof(Ring);
+			for (const Ring& inner : polygon.inners()) bytes += pointBytes(inner);
+		}
+		return bytes;
+	}
+
+	struct Entry {
+		NodeID objectID;
+		size_t bytes;
+		std::shared_ptr<const T> geometry;
+	};
+
+	struct Shard {
+		static const uint32_t emptySlot = 0xFFFFFFFF;
+
+		mutable std::mutex mutex;
+		std::vector<Entry> ring;		// entries in insertion order
+		std::vector<uint32_t> slots;	// open-addressed index into ring
+		uint32_t head = 0;				// next ring position to write
+		size_t count = 0;
+		size_t bytes = 0;
+		mutable uint64_t hits = 0, misses = 0;	// under the mutex; kept by clear()
+
+		static size_t hash(NodeID objectID) {
+			uint64_t h = objectID * 0x9E3779B97F4A7C15ull;
+			return h ^ (h >> 29);
+		}
+
+		// Find the slot holding this ID, or else the empty slot where it belongs
+		bool find(NodeID objectID, size_t& slot) const {
+			const size_t mask = slots.size() - 1;
+			slot = hash(objectID) & mask;
+			while (slots[slot] != emptySlot) {
+				if (ring[slots[slot]].objectID == objectID) return true;
+				slot = (slot + 1) & mask;
+			}
+			return false;
+		}
+
+		std::shared_ptr<const T> evictOldest() {
+			const uint32_t position = (head + shardCapacity - count) % shardCapacity;
+			Entry& entry = ring[position];
+			size_t slot;
+			find(entry.objectID, slot);
+
+			// Backward-shift deletion, so lookups never need tombstones
+			const size_t mask = slots.size() - 1;
+			size_t next = (slot + 1) & mask;
+			while (slots[next] != emptySlot) {
+				const size_t home = hash(ring[slots[next]].objectID) & mask;
+				// Move it into the gap if its home isn't cyclically within (slot, next]
+				if (((next - home) & mask) >= ((next - slot) & mask)) {
+					slots[slot] = slots[next];
+					slot = next;
+				}
+				next = (next + 1) & mask;
+			}
+			slots[slot] = emptySlot;
+
+			count--;
+			bytes -= entry.bytes;
+			return std::move(entry.geometry);
+		}
+	};
+
+	uint64_t countAll(uint64_t Shard::*counter) const {
+		uint64_t total = 0;
+		for (const Shard& shard : shards) {
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			total += shard.*counter;
+		}
+		return total;
+	}
+
+	std::vector<Shard> shards;
+	size_t shardBytes;
 };
 
 #endif
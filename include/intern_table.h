@@ -0,0 +1,170 @@
+/*! \file */
+#ifndef _INTERN_TABLE_H
+#define _INTERN_TABLE_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <new>
+#include <cstdint>
+
+/** \brief Append-only array whose elements never move, readable without locks
+*
+* Elements live in chunks of 64K, allocated the first time an index in them is
+* stored to; a chunk's pointer is published once it's filled with default
+* values, so reading an element is two dereferences.
+*/
+template <class T>
+class ChunkedArray {
+public:
+	static const unsigned int chunkBits = 16;
+	static const uint32_t chunkSize = 1u << chunkBits;
+
+	ChunkedArray(uint64_t maxSize):
+		chunkCount((maxSize + chunkSize - 1) >> chunkBits),
+		chunks(new std::atomic<T*>[chunkCount]) {
+		for (size_t i = 0; i < chunkCount; i++) chunks[i].store(nullptr, std::memory_order_relaxed);
+	}
+	~ChunkedArray() {
+		for (size_t i = 0; i < chunkCount; i++) delete[] chunks[i].load(std::memory_order_relaxed);
+	}
+	ChunkedArray(const ChunkedArray&) = delete;
+	ChunkedArray& operator=(const ChunkedArray&) = delete;
+
+	// Only for indices that have been stored to (and published to this thread)
+	const T& operator[](uint32_t i) const {
+		return chunks[i >> chunkBits].load(std::memory_order_acquire)[i & (chunkSize - 1)];
+	}
+
+	// Copy a value into index i, which no other thread may be using yet
+	void store(uint32_t i, const T& value) {
+		T* chunk = chunks[i >> chunkBits].load(std::memory_order_acquire);
+		if (!chunk) {
+			T* fresh = new T[chunkSize];
+			if (chunks[i >> chunkBits].compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel)) chunk = fresh;
+			else delete[] fresh;
+		}
+		T* element = &chunk[i & (chunkSize - 1)];
+		element->~T();
+		new (element) T(value);
+	}
+
+private:
+	size_t chunkCount;
+	std::unique_ptr<std::atomic<T*>[]> chunks;
+};
+
+/** \brief Hash index of interned values, for finding a value's index
+*
+* T must have a hash() method. Split into shards by hash. Each shard is an open-addressed table of
+* indices (plus 32 bits of each value's hash), read without locks. Inserting
+* takes the shard's lock: the table may need to grow, which copies it and
+* publishes the copy. Old copies are kept until the index is destroyed, as
+* a lookup may still be reading one; a lookup that misses because of that
+* is rechecked under the lock before anything is inserted.
+*/
+template <class T>
+class InternIndex {
+public:
+	InternIndex(size_t shardBits): shardBits(shardBits), shards(size_t(1) << shardBits) { }
+
+	// Find the index of a value equal to this one. values(i) gives the value at index i.
+	template <class Values>
+	bool find(const T& value, const Values& values, uint32_t& index) const {
+		const uint64_t h = mix(value.hash());
+		const Table* table = shards[shardOf(h)].table.load(std::memory_order_acquire);
+		return table && table->find(h, value, values, index);
+	}
+
+	// Find the index of a value equal to this one, or else store it: allocate()
+	// stores the value and returns its new index
+	template <class Values, class Allocate>
+	uint32_t findOrInsert(const T& value, const Values& values, const Allocate& allocate) {
+		const uint64_t h = mix(value.hash());
+		uint32_t index;
+		const Table* current = shards[shardOf(h)].table.load(std::memory_order_acquire);
+		if (current && current->find(h, value, values, index)) return index;
+
+		Shard& shard = shards[shardOf(h)];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		Table* table = shard.table.load(std::memory_order_relaxed);
+		if (table && table->find(h, value, values, index)) return index;
+
+		if (!table || (table->count + 1) * 2 > table->mask + 1) table = grow(shard, table, values);
+		index = allocate();
+		table->insert(h, index);
+		return index;
+	}
+
+	// Wait for the inserts that are under way to finish, by taking each
+	// shard's lock in turn. Values allocated before this is called are then
+	// stored, though more may be inserted meanwhile.
+	void waitForInserts() {
+		for (Shard& shard : shards) std::lock_guard<std::mutex> lock(shard.mutex);
+	}
+
+private:
+	struct Table {
+		size_t mask;
+		size_t count;
+		std::unique_ptr<std::atomic<uint32_t>[]> indices;		// index + 1, or 0 if empty
+		std::unique_ptr<uint32_t[]> hashes;
+
+		Table(size_t size): mask(size - 1), count(0), indices(new std::atomic<uint32_t>[size]), hashes(new uint32_t[size]) {
+			for (size_t i = 0; i < size; i++) indices[i].store(0, std::memory_order_relaxed);
+		}
+
+		template <class Values>
+		bool find(uint64_t h, const T& value, const Values& values, uint32_t& index) const {
+			const uint32_t check = uint32_t(h >> 32);
+			for (size_t slot = h & mask; ; slot = (slot + 1) & mask) {
+				uint32_t stored = indices[slot].load(std::memory_order_acquire);
+				if (stored == 0) return false;
+				if (hashes[slot] == check && values(stored - 1) == value) { index = stored - 1; return true; }
+			}
+		}
+
+		// Only called under the shard's lock
+		void insert(uint64_t h, uint32_t index) {
+			size_t slot = h & mask;
+			while (indices[slot].load(std::memory_order_relaxed) != 0) slot = (slot + 1) & mask;
+			hashes[slot] = uint32_t(h >> 32);
+			indices[slot].store(index + 1, std::memory_order_release);
+			count++;
+		}
+	};
+
+	struct Shard {
+		std::mutex mutex;
+		std::atomic<Table*> table { nullptr };
+		std::vector<std::unique_ptr<Table>> tables;		// current table last
+	};
+
+	template <class Values>
+	Table* grow(Shard& shard, Table* old, const Values& values) {
+		std::unique_ptr<Table> table(new Table(old ? (old->mask + 1) * 2 : 16));
+		if (old) {
+			for (size_t slot = 0; slot <= old->mask; slot++) {
+				uint32_t stored = old->indices[slot].load(std::memory_order_relaxed);
+				if (stored != 0) table->insert(mix(values(stored - 1).hash()), stored - 1);
+			}
+		}
+		Table* rv = table.get();
+		shard.tables.push_back(std::move(table));
+		shard.table.store(rv, std::memory_order_release);
+		return rv;
+	}
+
+	static uint64_t mix(size_t hash) {
+		uint64_t h = uint64_t(hash) * 0x9E3779B97F4A7C15ull;
+		return h ^ (h >> 31);
+	}
+	// Shards use the top bits, and slots the bottom ones
+	size_t shardOf(uint64_t h) const { return h >> (64 - shardBits); }
+
+	size_t shardBits;
+	std::vector<Shard> shards;
+};
+
+#endif //_INTERN_TABLE_H
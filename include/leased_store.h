@@ -13,68 +13,85 @@
 // lock_guard<mutex> lock(mutex);
 // insert(...)
 //
-// Instead, store leases let each of N threads claim a range of 1/N of the IDs.
-// Then each thread can insert into their own stores without taking additional
-// locks.
+// Instead, store leases let each thread claim a range of the IDs: one of the
+// source's numShards stores. Then each thread can insert into their own stores
+// without taking additional locks. Stores are opened as threads first ask for
+// them, so the number of threads isn't fixed by the source.
 
 template<typename S>
-std::vector<std::pair<size_t, S*>>& getAvailableLeases(TileDataSource* source) {
+TileDataSource::StoreLeases<S>& getStoreLeases(TileDataSource* source) {
 	throw std::runtime_error("you need to specialize this");
 }
 
 template<>
-inline std::vector<std::pair<size_t, TileDataSource::point_store_t*>>& getAvailableLeases(TileDataSource* source) {
-	return source->availablePointStoreLeases;
+inline TileDataSource::StoreLeases<TileDataSource::point_store_t>& getStoreLeases(TileDataSource* source) {
+	return source->pointStoreLeases;
 }
 
 template<>
-inline std::vector<std::pair<size_t, TileDataSource::linestring_store_t*>>& getAvailableLeases(TileDataSource* source) {
-	return source->availableLinestringStoreLeases;
+inline TileDataSource::StoreLeases<TileDataSource::linestring_store_t>& getStoreLeases(TileDataSource* source) {
+	return source->linestringStoreLeases;
 }
 
 template<>
-inline std::vector<std::pair<size_t, TileDataSource::multi_linestring_store_t*>>& getAvailableLeases(TileDataSource* source) {
-	return source->availableMultiLinestringStoreLeases;
+inline TileDataSource::StoreLeases<TileDataSource::multi_linestring_store_t>& getStoreLeases(TileDataSource* source) {
+	return source->multiLinestringStoreLeases;
 }
 
 template<>
-inline std::vector<std::pair<size_t, TileDataSource::multi_polygon_store_t*>>& getAvailableLeases(TileDataSource* source) {
-	return source->availableMultiPolygonStoreLeases;
+inline TileDataSource::StoreLeases<TileDataSource::multi_polygon_store_t>& getStoreLeases(TileDataSource* source) {
+	return source->multiPolygonStoreLeases;
 }
 
 
 template <class T>
 class LeasedStore {
-	std::vector<std::pair<TileDataSource*, std::pair<size_t, T*>>> leases;
+	struct Lease {
+		TileDataSource* source;
+		std::pair<size_t, T*> entry;
+		size_t generation;
+	};
+	std::vector<Lease> leases;
 
 public:
 	~LeasedStore() {
 		for (const auto& lease : leases) {
-			auto source = lease.first;
+			auto source = lease.source;
 			std::lock_guard<std::mutex> lock(source->storeMutex);
 
-			std::vector<std::pair<size_t, T*>>& availableLeases = getAvailableLeases<T>(source);
-			availableLeases.push_back(lease.second);
+			// A sealed store isn't given out again
+			TileDataSource::StoreLeases<T>& storeLeases = getStoreLeases<T>(source);
+			if (lease.generation == storeLeases.generation)
+				storeLeases.available.push_back(lease.entry);
 		}
 	}
 
 	std::pair<size_t, T*> get(TileDataSource* source) {
-		for (const auto& lease : leases) {
-			if (lease.first == source)
-				return lease.second;
+		TileDataSource::StoreLeases<T>& storeLeases = getStoreLeases<T>(source);
+		for (auto it = leases.begin(); it != leases.end(); ++it) {
+			if (it->source != source) continue;
+			if (it->generation == storeLeases.generation.load(std::memory_order_relaxed))
+				return it->entry;
+			// Sealed since: drop it for a new one
+			leases.erase(it);
+			break;
 		}
 
 		std::lock_guard<std::mutex> lock(source->storeMutex);
 
-		std::vector<std::pair<size_t, T*>>& availableLeases = getAvailableLeases<T>(source);
-
-		if (availableLeases.empty())
-			throw std::runtime_error("fatal: no available stores to lease");
-
-		std::pair<size_t, T*> entry = availableLeases.back();
-		availableLeases.pop_back();
+		std::pair<size_t, T*> entry;
+		if (!storeLeases.available.empty()) {
+			entry = storeLeases.available.back();
+			storeLeases.available.pop_back();
+		} else {
+			// Open another store, if the IDs have room
+			if (storeLeases.opened == storeLeases.stores->size())
+				throw std::runtime_error("fatal: no available stores to lease (all " + std::to_string(storeLeases.opened) + " are in use)");
+			entry = std::make_pair(storeLeases.opened, &(*storeLeases.stores)[storeLeases.opened]);
+			storeLeases.opened++;
+		}
 
-		leases.push_back(std::make_pair(source, entry));
+		leases.push_back(Lease { source, entry, storeLeases.generation.load() });
 		return entry;
 	}
 
@@ -0,0 +1,36 @@
+/*! \file */
+#ifndef _LOOKUP_TABLE_H
+#define _LOOKUP_TABLE_H
+
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+/** \brief A read-only table of strings, shared by every Lua state (`LookupTable.Load(filename)`)
+*
+* Profiles often carry large tables (brands, languages, class mappings) that
+* each thread's Lua state would otherwise build and keep for itself. A
+* LookupTable is read from a JSON object of strings the first time any state
+* loads it; the others are handed the same one, as userdata. Nothing changes
+* it once it's read, so it's safe to read from every thread.
+*/
+class LookupTable {
+public:
+	// The table in filename, reading it if no state has already
+	static LookupTable *Load(const std::string &filename);
+
+	// The value for key, or the empty string if there isn't one (like Find)
+	std::string Get(const std::string &key) const;
+	bool Has(const std::string &key) const;
+	size_t Size() const { return values.size(); }
+
+private:
+	std::unordered_map<std::string, std::string> values;
+
+	static std::mutex mutex;
+	static std::map<std::string, std::unique_ptr<LookupTable>> tables;
+};
+
+#endif //_LOOKUP_TABLE_H
@@ -0,0 +1,110 @@
+/*! \file */
+#ifndef _LUA_PROFILER_H
+#define _LUA_PROFILER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <cstdint>
+
+class TagMap;
+
+/// Functions in the profile that tilemaker calls
+enum class LuaFunction { Node, Way, Relation, RelationScan, Attribute, NodeBatch, WayBatch, Count };
+
+/// Functions tilemaker provides that the profile calls, timed separately
+enum class LuaHelper { Layer, LayerAsCentroid, Intersects, FindIntersecting, FindCovering, CoveredBy,
+                       AreaIntersecting, Area, Length, Centroid, Count };
+
+/** \brief Where the Lua profile spends its time (`--profile-lua`)
+*
+* Each call into the profile is timed and counted under its function and the
+* object's primary tag: the first of a fixed list of keys (highway, building,
+* landuse...) that it has. Each layer is credited with the objects written to
+* it and the time their calls took, so an object written to two layers counts
+* in both. Calls to the spatial and geometry helpers are timed on their own,
+* and that time is part of their caller's too.
+*
+* Each thread adds to its own counts; report() adds them up, once the threads
+* are done. When the profiler isn't enabled, each timer is a single check.
+*/
+class LuaProfiler {
+public:
+	static void enable() { enabled = true; }
+	static bool active() { return enabled.load(std::memory_order_relaxed); }
+
+	// Note that the object being processed has been written to a layer
+	static void layerWritten(unsigned int layer);
+
+	static void report(std::ostream &out, const std::vector<std::string> &layerNames);
+
+private:
+	struct Stat {
+		uint64_t calls = 0, ns = 0;
+		void add(uint64_t n) { calls++; ns += n; }
+	};
+	struct ThreadStats;
+
+	static std::atomic<bool> enabled;
+	static std::mutex mutex;
+	static std::vector<std::unique_ptr<ThreadStats>> threads;
+	static thread_local ThreadStats *stats;
+
+	static ThreadStats &threadStats();
+	static void beginCall();
+	static void endCall(LuaFunction function, unsigned int tag, uint64_t ns);
+	static void addHelper(LuaHelper helper, uint64_t ns);
+	static unsigned int primaryTag(const TagMap *tags);
+
+	friend class LuaCallTimer;
+	friend class LuaHelperTimer;
+};
+
+///\brief Times a call into the profile, if the profiler is enabled
+class LuaCallTimer {
+public:
+	LuaCallTimer(LuaFunction function, const TagMap *tags = nullptr):
+		function(function), running(LuaProfiler::active()) {
+		if (!running) return;
+		tag = LuaProfiler::primaryTag(tags);
+		LuaProfiler::beginCall();
+		start = std::chrono::steady_clock::now();
+	}
+	~LuaCallTimer() {
+		if (running) LuaProfiler::endCall(function, tag, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+	}
+
+	LuaCallTimer(const LuaCallTimer&) = delete;
+	LuaCallTimer& operator=(const LuaCallTimer&) = delete;
+
+private:
+	LuaFunction function;
+	bool running;
+	unsigned int tag;
+	std::chrono::steady_clock::time_point start;
+};
+
+///\brief Times a call to a helper, if the profiler is enabled
+class LuaHelperTimer {
+public:
+	LuaHelperTimer(LuaHelper helper): helper(helper), running(LuaProfiler::active()) {
+		if (running) start = std::chrono::steady_clock::now();
+	}
+	~LuaHelperTimer() {
+		if (running) LuaProfiler::addHelper(helper, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+	}
+
+	LuaHelperTimer(const LuaHelperTimer&) = delete;
+	LuaHelperTimer& operator=(const LuaHelperTimer&) = delete;
+
+private:
+	LuaHelper helper;
+	bool running;
+	std::chrono::steady_clock::time_point start;
+};
+
+#endif //_LUA_PROFILER_H
@@ -4,7 +4,12 @@
 
 #include <string>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <vector>
+#include <deque>
+#include <tuple>
+#include <unordered_map>
 #include "external/sqlite_modern_cpp.h"
 
 struct PendingStatement {
@@ -17,6 +22,21 @@ struct PendingStatement {
 
 /** \brief Write to MBTiles (sqlite) database
 *
+* New databases use the normalized schema: tile blobs are stored once in `images`,
+* referenced from `map`, and `tiles` is a view joining the two. Existing databases
+* with a plain `tiles` table (e.g. when merging) are written to as before.
+*
+* Tiles are written to SQLite by a single writer thread, fed by a queue. When the
+* queue is full, saveTile blocks until the writer catches up, so memory use stays
+* bounded even if SQLite falls behind the tile generation threads.
+*
+* With --merge, the existing tiles are read ahead of the workers that merge them
+* (see prefetchTiles), in range queries over the tiles listed, and handed over
+* still compressed, so each worker decompresses its own while others build
+* geometries. The reads share the writer's connection: the output is written in
+* one open transaction without a journal, so another connection can't safely
+* read it.
+*
 * (note that sqlite_modern_cpp.h is very slightly changed from the original, for blob support and an .init method)
 */
 class MBTiles { 
@@ -24,12 +44,42 @@ class MBTiles {
 	std::vector<sqlite::database_binder> preparedStatements;
 	std::mutex m;
 	bool inTransaction;
+	bool normalized;
 
-	std::shared_ptr<std::vector<PendingStatement>> pendingStatements1, pendingStatements2;
+	// For the normalized schema: ids of small images already written, so identical tiles share one
+	std::unordered_map<std::string, sqlite3_int64> imageIds;
+	sqlite3_int64 lastImageId;
+	bool replacedTiles;		// so images may have been left with no tile pointing to them
+
+	// Queue of tiles waiting for the writer thread
+	std::vector<PendingStatement> pendingStatements;
+	size_t pendingBytes, maxPendingBytes;
 	std::mutex pendingStatementsMutex;
+	std::condition_variable pendingNotEmpty, pendingNotFull;
+	bool stopWriter;
+	std::thread writerThread;
+
+	// Existing tiles read ahead for --merge, by tileKey; empty if there's no such tile
+	struct PrefetchedTile {
+		bool exists;
+		std::vector<char> data;
+	};
+	std::deque<std::tuple<int,int,int>> prefetchQueue;		// tiles still to read, in order
+	std::unordered_map<uint64_t, unsigned int> prefetchPending;	// tiles queued or being read, and how many times
+	std::unordered_map<uint64_t, PrefetchedTile> prefetched;
+	size_t prefetchedBytes, prefetchWaiting;
+	std::mutex prefetchMutex;
+	std::condition_variable prefetchChanged;
+	bool stopPrefetcher;
+	std::thread prefetchThread;
 
 	void insertOrReplace(int zoom, int x, int y, const std::string& data, bool isMerge);
-	void flushPendingStatements();
+	void writerLoop();
+	void stopWriterThread();
+	void prefetchLoop();
+	void stopPrefetchThread();
+	bool readTile(std::vector<char> &compressed, int zoom, int x, int tmsY);
+	static uint64_t tileKey(int zoom, int x, int y) { return (uint64_t(zoom) << 56) | (uint64_t(x) << 28) | uint64_t(y); }
 
 public:
 	MBTiles();
@@ -38,12 +88,17 @@ public:
 	void writeMetadata(std::string key, std::string value);
 	void saveTile(int zoom, int x, int y, std::string *data, bool isMerge);
 	void closeForWriting();
+	void mergeFrom(const std::string &filename);
+	size_t queueDepth();
 
 	void openForReading(std::string &filename);
 	void readBoundingBox(double &minLon, double &maxLon, double &minLat, double &maxLat);
 	void readTileList(std::vector<std::tuple<int,int,int>> &tileList);
 	std::vector<char> readTile(int zoom, int col, int row);
 	bool readTileAndUncompress(std::string &data, int zoom, int col, int row, bool isCompressed, bool asGzip);
+	// Read these tiles' existing data (zoom, x, y; y counted from the top, as for
+	// readTileAndUncompress) in the background, in the order they'll be asked for
+	void prefetchTiles(const std::vector<std::tuple<int,int,int>> &tiles);
 };
 
 #endif //_MBTILES_H
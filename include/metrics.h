@@ -0,0 +1,128 @@
+/*! \file */
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <memory>
+#include <cstdint>
+
+// Tiles written are counted by zoom up to this one, and together above it
+#define METRICS_MAX_ZOOM 22
+
+// Seconds between rewrites of --metrics-file
+#define METRICS_FILE_INTERVAL 5
+
+///\brief A count that threads add to, on a cache line of its own so they don't contend over it
+struct alignas(64) MetricsCounter {
+	std::atomic<uint64_t> value { 0 };
+	void add(uint64_t n) { value.fetch_add(n, std::memory_order_relaxed); }
+	uint64_t load() const { return value.load(std::memory_order_relaxed); }
+};
+
+///\brief Counts of work done, added to once per block or batch of tiles
+struct Metrics {
+	std::atomic<const char*> phase { "setup" };
+	MetricsCounter nodesRead, waysRead, relationsRead;
+	MetricsCounter tilesWritten[METRICS_MAX_ZOOM + 1];
+
+	void setPhase(const char *name) { phase.store(name, std::memory_order_relaxed); }
+	static unsigned int zoomSlot(unsigned int zoom) { return zoom < METRICS_MAX_ZOOM ? zoom : METRICS_MAX_ZOOM; }
+};
+
+extern Metrics metrics;
+
+// The process's resident memory in bytes, where we can find it (0 otherwise)
+size_t residentBytes();
+
+/** \brief Publishes the Metrics, and anything registered with it, while a run goes on
+*
+* With a port, it serves them over HTTP: /metrics in Prometheus' text format,
+* and /metrics.json as JSON. That's on the address given, which is normally
+* 127.0.0.1 so that only this machine can read them. With a filename, it rewrites that file with the
+* JSON every few seconds, by writing a temporary file and renaming it so that
+* readers never see half of one; each copy also has the rate of every counter
+* since the last.
+*
+* Gauges and counters are functions, called when the metrics are read, that
+* sample something keeping its own count (a store's size, a queue's depth), so
+* nothing extra is done as those change. Each can have one label, so that
+* (e.g.) the objects read are one counter by type.
+*/
+class MetricsExporter {
+public:
+	MetricsExporter(unsigned short port, const std::string &address, const std::string &filename);
+	~MetricsExporter();
+	bool active() const { return port > 0 || !filename.empty(); }
+
+	// Register a value to report; counters only ever go up. Returns an ID for remove()
+	size_t gauge(const std::string &name, const std::string &help, std::function<double()> sample,
+	             const std::string &labelName = "", const std::string &labelValue = "");
+	size_t counter(const std::string &name, const std::string &help, std::function<double()> sample,
+	               const std::string &labelName = "", const std::string &labelValue = "");
+	void remove(const std::vector<size_t> &ids);
+
+	std::string prometheus() const;
+	std::string json() const;
+
+private:
+	struct Sampler {
+		size_t id;
+		std::string name, help, labelName, labelValue;
+		bool isCounter;
+		std::function<double()> sample;
+	};
+	struct Sample {
+		const Sampler *sampler;
+		double value;
+	};
+
+	unsigned short port;
+	std::string address, filename;
+	const std::chrono::steady_clock::time_point start;
+
+	mutable std::mutex mutex;
+	std::vector<Sampler> samplers;
+	size_t nextID;
+
+	std::thread serverThread, fileThread;
+	struct Server;
+	std::unique_ptr<Server> server;
+	std::mutex stopMutex;
+	std::condition_variable stopChanged;
+	bool stopping;
+
+	size_t add(Sampler sampler);
+	std::vector<Sample> sampleAll() const;
+	std::string json(const std::vector<Sample> &samples, const std::map<std::string, double> *previous, double interval) const;
+	void writeFiles();
+};
+
+///\brief Gauges that read something shorter-lived than the exporter, removed when this goes
+class MetricsScope {
+public:
+	MetricsScope(MetricsExporter &exporter): exporter(exporter) { }
+	~MetricsScope() { exporter.remove(ids); }
+
+	void gauge(const std::string &name, const std::string &help, std::function<double()> sample,
+	           const std::string &labelName = "", const std::string &labelValue = "") {
+		ids.push_back(exporter.gauge(name, help, sample, labelName, labelValue));
+	}
+	void counter(const std::string &name, const std::string &help, std::function<double()> sample,
+	             const std::string &labelName = "", const std::string &labelValue = "") {
+		ids.push_back(exporter.counter(name, help, sample, labelName, labelValue));
+	}
+
+private:
+	MetricsExporter &exporter;
+	std::vector<size_t> ids;
+};
+
+#endif //_METRICS_H
@@ -3,6 +3,8 @@
 
 #include <cstddef>
 #include <sstream>
+#include <string>
+#include <utility>
 
 class void_mmap_allocator
 {
@@ -14,7 +16,13 @@ public:
 	static void destroy(void *p);
 	static void shutdown();
 	static void reportStoreSize(std::ostringstream &str);
+	static void reportArenas(std::ostream &str);
+	// Bytes of arenas mapped in RAM, and in store files
+	static std::size_t memoryBytes();
+	static std::size_t fileBytes();
 	static void openMmapFile(const std::string& mmapFilename);
+	// Map in-memory arenas from the kernel's reserved huge pages, if there are enough
+	static void useHugePages(bool enabled);
 };
 
 template<typename T>
@@ -50,12 +58,17 @@ public:
 		void_mmap_allocator::deallocate(p, n);
 	}
 
-	void construct(pointer p, const_reference val)
+	// Forwarded, so that containers move their elements when they grow
+	template<typename U, typename... Args>
+	void construct(U *p, Args&&... args)
 	{
-		new((void *)p) T(val);        
+		new((void *)p) U(std::forward<Args>(args)...);
 	}
 
-	void destroy(pointer p) { void_mmap_allocator::destroy(p); }
+	// Elements live inside a block the container deallocates, so there's
+	// nothing to free for each one
+	template<typename U>
+	void destroy(U *p) { p->~U(); }
 };
 
 template<typename T1, typename T2>
@@ -0,0 +1,52 @@
+/*! \file */ 
+#ifndef _MVT_WRITER_H
+#define _MVT_WRITER_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "vector_tile.pb.h"
+
+/** \brief Encodes a vector tile layer straight into bytes, without building a vector_tile::Tile
+*
+* Features are still filled in as a vector_tile::Tile_Feature, so that the
+* geometry and attribute code is shared with the protobuf types. But each one
+* is serialized as soon as it's complete, and the same message is then reused
+* for the next feature. The result is byte-for-byte what serializing a
+* vector_tile::Tile would give.
+*/
+class MvtLayerWriter {
+public:
+	MvtLayerWriter();
+
+	/// \brief Start a new, empty layer
+	void reset();
+
+	/// \brief The feature to fill in next (cleared)
+	vector_tile::Tile_Feature *feature();
+
+	/// \brief Add the feature returned by feature() to the layer
+	void addFeature();
+
+	/// \brief Add an existing feature, e.g. from a tile being merged
+	void addFeature(const vector_tile::Tile_Feature &feature);
+
+	size_t featureCount() const { return features; }
+
+	/// \brief Append the finished layer to an encoded tile
+	void writeLayer(std::string &tile, const std::string &name,
+	                const std::vector<std::string> &keys, const std::vector<vector_tile::Tile_Value> &values,
+	                uint32_t extent, uint32_t version);
+
+	/// \brief Append an already-built layer to an encoded tile
+	static void writeLayer(std::string &tile, const vector_tile::Tile_Layer &layer);
+
+private:
+	vector_tile::Tile_Feature current;
+	std::string featureData;	// encoded features so far
+	std::string scratch;		// reused for each message serialized
+	std::string layerData;
+	size_t features;
+};
+
+#endif //_MVT_WRITER_H
@@ -23,6 +23,10 @@ public:
 	// Accessors
 	virtual size_t size() const = 0;
 	virtual LatpLon at(NodeID i) const = 0;
+	// Look up several nodes at once, e.g. all of a way's; throws std::out_of_range if any is missing
+	virtual void atBatch(const NodeID* ids, size_t count, LatpLon* out) const {
+		for (size_t i = 0; i < count; i++) out[i] = at(ids[i]);
+	}
 };
 
 #endif
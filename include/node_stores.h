@@ -1,12 +1,21 @@
 #ifndef _NODE_STORES_H
 #define _NODE_STORES_H
 
+#include <deque>
 #include <mutex>
 #include <memory>
+#include <atomic>
+#include <shared_mutex>
 #include "node_store.h"
 #include "sorted_node_store.h"
 #include "mmap_allocator.h"
 
+/** \brief Nodes in sorted deques, one for each NODE_SHARDS range of IDs
+*
+* Reader threads append to the deques, which grow without moving what's in
+* them; finalize() radix-sorts them in place on all the threads, and lookups
+* are interpolation searches.
+*/
 class BinarySearchNodeStore : public NodeStore
 {
 
@@ -68,5 +77,49 @@ private:
 	std::shared_ptr<map_t> mLatpLons;
 };
 
+/** \brief Nodes in an open-addressed hash table, for .pbfs that aren't sorted or renumbered
+*
+* Lookups are constant time, and reader threads insert concurrently, claiming
+* slots with compare-and-swap, so there's no sort at the end. The table is
+* kept at most 60% full, doubling when needed; that costs more memory than
+* BinarySearchNodeStore, so it suits city and country extracts best.
+*
+* IDs and coordinates are kept in separate arrays, so a probe scans eight IDs
+* per cache line.
+*/
+class HashNodeStore : public NodeStore
+{
+
+public:
+	HashNodeStore();
+	~HashNodeStore();
+
+	void reopen() override;
+	void finalize(size_t threadNum) override {}
+	LatpLon at(NodeID i) const override;
+	size_t size() const override;
+	void insert(const std::vector<element_t>& elements) override;
+	void clear() override { reopen(); }
+	void batchStart() override {}
+
+private:
+	static const NodeID EmptySlot = ~NodeID(0);
+
+	std::atomic<NodeID>* ids;
+	LatpLon* latpLons;
+	size_t bits;				// the table has 2^bits slots
+	std::atomic<size_t> reserved;		// slots that inserts so far might have used
+	std::atomic<size_t> count;			// distinct nodes stored
+
+	// Inserts share the table; growing it needs it exclusively
+	mutable std::shared_timed_mutex mutex;
+
+	size_t capacity() const { return size_t(1) << bits; }
+	size_t slotFor(NodeID id) const { return (id * 0x9E3779B97F4A7C15ull) >> (64 - bits); }
+	bool insertOne(NodeID id, LatpLon ll);
+	void allocate(size_t newBits);
+	void release();
+	void grow(size_t needed);
+};
 
 #endif
@@ -25,9 +25,25 @@ extern "C" {
 
 #include "external/kaguya.hpp"
 
+namespace kaguya {
+	// Tag values are views into the PBF block, so push them to Lua without a copy
+	template<> struct lua_type_traits<boost::string_view> {
+		typedef boost::string_view push_type;
+
+		static int push(lua_State* l, boost::string_view s)
+		{
+			lua_pushlstring(l, s.data(), s.size());
+			return 1;
+		}
+	};
+}
+
 // FIXME: why is this global ?
 extern bool verbose;
 
+// Objects handed to a batch function per call
+#define LUA_BATCH_SIZE 256
+
 class AttributeStore;
 class AttributeSet;
 
@@ -64,29 +80,39 @@ public:
 	bool canReadRelations();
 	bool canWriteRelations();
 
+	// Does the profile take nodes/ways in batches (node_batch_function/way_batch_function)?
+	bool batchesNodes();
+	bool batchesWays();
+
 	// Shapefile tag remapping
 	bool canRemapShapefiles();
+	// The Lua files of the modules the profile has required, as found on package.path
+	std::vector<std::string> moduleFiles();
 	kaguya::LuaTable newTable();
 	kaguya::LuaTable remapAttributes(kaguya::LuaTable& in_table, const std::string &layerName);
 
 	// ----	Data loading methods
 
-	using tag_map_t = boost::container::flat_map<std::string, std::string>;
-
 	// Scan non-MP relation
-	bool scanRelation(WayID id, const tag_map_t &tags);
+	bool scanRelation(WayID id, const TagMap &tags);
 
 	/// \brief We are now processing a significant node
-	void setNode(NodeID id, LatpLon node, const tag_map_t &tags);
+	void setNode(NodeID id, LatpLon node, const TagMap &tags);
 
 	/// \brief We are now processing a way
-	bool setWay(WayID wayId, LatpLonVec const &llVec, const tag_map_t &tags);
+	bool setWay(WayID wayId, LatpLonVec const &llVec, const TagMap &tags);
+
+	/// \brief Process significant nodes through node_batch_function, LUA_BATCH_SIZE per call
+	void setNodes(const std::vector<NodeID> &ids, const std::vector<LatpLon> &nodes, const std::vector<TagMap> &tags);
+
+	/// \brief Process ways through way_batch_function; returns, for each, what setWay would
+	std::vector<bool> setWays(const std::vector<WayID> &ids, const std::vector<LatpLonVec> &llVecs, const std::vector<TagMap> &tags);
 
 	/** \brief We are now processing a relation
 	 * (note that we store relations as ways with artificial IDs, and that
 	 *  we use decrementing positive IDs to give a bit more space for way IDs)
 	 */
-	void setRelation(int64_t relationId, WayVec const &outerWayVec, WayVec const &innerWayVec, const tag_map_t &tags, bool isNativeMP, bool isInnerOuter);
+	void setRelation(int64_t relationId, WayVec const &outerWayVec, WayVec const &innerWayVec, const TagMap &tags, bool isNativeMP, bool isInnerOuter);
 
 	// ----	Metadata queries called from Lua
 
@@ -94,10 +120,11 @@ public:
 	std::string Id() const;
 
 	// Check if there's a value for a given key
-	bool Holds(const std::string& key) const;
+	// (keys are taken as const char* so that Lua's strings aren't copied into a std::string for each call)
+	bool Holds(const char *key) const;
 
 	// Get an OSM tag for a given key (or return empty string if none)
-	const std::string& Find(const std::string& key) const;
+	boost::string_view Find(const char *key) const;
 
 	// ----	Spatial queries called from Lua
 
@@ -132,6 +159,8 @@ public:
 	CorrectGeometryResult CorrectGeometry(GeometryT &geom)
 	{
 #if BOOST_VERSION >= 105800
+		// Most are simple enough to be shown valid without boost's full check
+		if (is_simple_valid(geom)) return CorrectGeometryResult::Valid;
 		geom::validity_failure_type failure = geom::validity_failure_type::no_failure;
 		if (isRelation && !geom::is_valid(geom,failure)) {
 			if (verbose) std::cout << "Relation " << originalOsmID << " has " << boost_validity_error(failure) << std::endl;
@@ -185,6 +214,9 @@ public:
 	void setVectorLayerMetadata(const uint_least8_t layer, const std::string &key, const uint type);
 
 	std::vector<std::string> GetSignificantNodeKeys();
+	// "key" or "key=value" entries from way_keys/relation_keys; empty if the profile doesn't set them
+	std::vector<std::string> GetSignificantWayKeys();
+	std::vector<std::string> GetSignificantRelationKeys();
 
 	// ---- Cached geometries creation
 
@@ -196,6 +228,10 @@ public:
 
 	const MultiPolygon &multiPolygonCached();
 
+	// The area written by Layer(), corrected if need be; it's only checked
+	// once, however many layers it's written to
+	CorrectGeometryResult correctedPolygonCached();
+
 	inline AttributeStore &getAttributeStore() { return attributeStore; }
 
 	struct luaProcessingException :std::exception {};
@@ -211,6 +247,7 @@ private:
 		multiLinestringInited = false;
 		polygonInited = false;
 		multiPolygonInited = false;
+		correctedPolygonInited = false;
 		relationAccepted = false;
 		relationSubscript = -1;
 		lastStoredGeometryId = 0;
@@ -226,6 +263,8 @@ private:
 	bool supportsRemappingShapefiles;
 	bool supportsReadingRelations;
 	bool supportsWritingRelations;
+	bool supportsNodes, supportsWays;		// whether the profile has node_function/way_function
+	bool supportsNodeBatches, supportsWayBatches;
 	const class ShpMemTiles &shpMemTiles;
 	class OsmMemTiles &osmMemTiles;
 	AttributeStore &attributeStore;			// key/value store
@@ -234,7 +273,7 @@ private:
 	bool isWay, isRelation, isClosed;		///< Way, node, relation?
 
 	bool relationAccepted;					// in scanRelation, whether we're using a non-MP relation
-	std::vector<WayID> relationList;		// in processWay, list of relations this way is in
+	RelationScanStore::relation_list_t relationList;		// in processWay, list of relations this way is in
 	int relationSubscript = -1;				// in processWay, position in the relation list
 
 	int32_t lon,latp;						///< Node coordinates
@@ -250,6 +289,9 @@ private:
 	bool multiLinestringInited;
 	MultiPolygon multiPolygonCache;
 	bool multiPolygonInited;
+	MultiPolygon correctedPolygonCache;
+	CorrectGeometryResult correctedPolygonResult;
+	bool correctedPolygonInited;
 
 	NodeID lastStoredGeometryId;
 	OutputGeometryType lastStoredGeometryType;
@@ -258,10 +300,28 @@ private:
 	class LayerDefinition &layers;
 
 	std::vector<std::pair<OutputObject, AttributeSet>> outputs;		// All output objects that have been created
-	const boost::container::flat_map<std::string, std::string>* currentTags;
+	const TagMap* currentTags;
 
 	std::vector<OutputObject> finalizeOutputs();
 
+	// Apply the config's rules to the current object; returns whether Lua should see it too
+	bool applyRules();
+	bool ruleApplies(const TagRule &rule) const;
+	bool rulesPassToLua() const;
+
+	// Set up for (and index the outputs of) one node or way
+	void beginNode(NodeID id, LatpLon node, const TagMap &tags);
+	void finishNode();
+	void beginWay(WayID wayId, LatpLonVec const &llVec, const TagMap &tags);
+	bool finishWay();
+	// Just what the rules and batchObject() look at, for the first pass over a batch
+	void describeObject(NodeID id, bool way, bool closed, const TagMap &tags);
+
+	// Batches: the current object as a Lua table, calling the profile, and applying its results
+	kaguya::LuaTable batchObject();
+	kaguya::LuaTable callBatchFunction(const char *function, kaguya::LuaTable &objects, size_t count);
+	void applyDirectives(const kaguya::LuaRef &directives);
+
 	bool materializeGeometries;
 	bool wayEmitted;
 };
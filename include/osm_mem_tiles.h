@@ -8,6 +8,9 @@
 
 #define OSM_THRESHOLD (1ull << 35)
 #define USE_WAY_STORE (1ull << 35)
+// Ways are materialized (with a memory budget) if they'd be rebuilt for at least this many tiles
+#define MATERIALIZE_FANOUT 32
+
 #define IS_WAY(x) (((x) >> 35) == (USE_WAY_STORE >> 35))
 #define OSM_ID(x) ((x) & 0b111111111111111111111111111111111)
 
@@ -41,13 +44,28 @@ public:
 
 	void Clear();
 
+	/// \brief Spend up to this many bytes on materializing ways that would be rebuilt
+	/// for many tiles, and on caching the ways that are rebuilt (0 for the default cache only)
+	void setMemoryBudget(size_t bytes);
+
+	// Whether to store this way's geometry, rather than rebuilding it from the way
+	// store for every tile: only if it's in enough tiles, and there's budget left
+	bool shouldMaterialize(const Linestring &ls, uint minzoom);
+
+	uint64_t linestringCacheHits() const { return linestringCache.hitCount(); }
+	uint64_t linestringCacheMisses() const { return linestringCache.missCount(); }
+
 private:
-	void populateLinestring(Linestring& ls, NodeID objectID);
-	Linestring& getOrBuildLinestring(NodeID objectID);
+	void populateLinestring(Linestring& ls, NodeID objectID) override;
+	std::shared_ptr<const Linestring> getOrBuildLinestring(NodeID objectID);
 	void populateMultiPolygon(MultiPolygon& dst, NodeID objectID) override;
 
 	const NodeStore& nodeStore;
 	const WayStore& wayStore;
+
+	GeometryCache<Linestring> linestringCache;
+	size_t materializeBudget;
+	std::atomic<size_t> materializedBytes;
 };
 
 #endif //_OSM_MEM_TILES
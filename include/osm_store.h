@@ -5,10 +5,16 @@
 #include "geom.h"
 #include "coordinates.h"
 #include "mmap_allocator.h"
+#include "tag_map.h"
 
 #include <utility>
 #include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
 #include <mutex>
+#include <atomic>
+#include <memory>
 #include <unordered_set>
 #include <boost/container/flat_map.hpp>
 
@@ -22,87 +28,148 @@ class WayStore;
 //
 // list of ways used by relations
 // by noting these in advance, we don't need to store all ways in the store
+//
+// This is a sparse bitmap: pages of 2^18 bits are only allocated once a way
+// in their range is marked, so a small extract needs a few pages rather than
+// a bit for every way ID in OSM. The pages are found through directories of
+// 2^12, also allocated as they're needed, so way IDs can go up to the 2^42
+// that the .pbf reader allows. Bits are set with an atomic or, and pages and
+// directories are claimed with compare-and-swap, so marking takes no lock.
 class UsedWays {
 
 private:
-	std::vector<bool> usedList;
-	mutable std::mutex mutex;
-
-public:
-	bool inited = false;
+	static const unsigned PageBits = 18;
+	static const unsigned DirectoryBits = 12;
+	static const size_t PageWords = (size_t(1) << PageBits) / 64;
+	static const size_t DirectorySize = size_t(1) << DirectoryBits;
+	static const size_t DirectoryCount = size_t(1) << (42 - PageBits - DirectoryBits);		// way IDs up to 2^42
+	using page_t = std::atomic<uint64_t>;
+	using directory_t = std::atomic<page_t*>;
+
+	std::unique_ptr<std::atomic<directory_t*>[]> directories;
+
+	// Find an entry, allocating it if it's null and create is set
+	template<class T> static T* claim(std::atomic<T*> &slot, size_t count, bool create) {
+		T* entry = slot.load(std::memory_order_acquire);
+		if (entry != nullptr || !create) return entry;
+		T* newEntry = new T[count]();
+		if (slot.compare_exchange_strong(entry, newEntry, std::memory_order_acq_rel)) return newEntry;
+		delete[] newEntry;		// another thread got there first
+		return entry;
+	}
 
-	// Size the vector to a reasonable estimate, to avoid resizing on the fly
-	// TODO: it'd be preferable if UsedWays didn't know about compact mode --
-	//   instead, use an efficient data structure if numNodes < 1B, otherwise
-	//   use a large bitvector
-	void reserve(bool compact, size_t numNodes) {
-		std::lock_guard<std::mutex> lock(mutex);
-		if (inited) return;
-		inited = true;
-		if (compact) {
-			// If we're running in compact mode, way count is roughly 1/9th of node count... say 1/8 to be safe
-			usedList.reserve(numNodes/8);
-		} else {
-			// Otherwise, we could have anything up to the current max node ID (approaching 2**30 in summer 2021)
-			// 2**31 is 0.25GB with a vector<bool>
-			usedList.reserve(pow(2,31));
+	page_t* page(WayID wayid, bool create) const {
+		const size_t pageIndex = wayid >> PageBits;
+		if (pageIndex >= DirectoryCount * DirectorySize) {
+			if (create) throw std::out_of_range("Way ID too large: " + std::to_string(wayid));
+			return nullptr;
 		}
+		directory_t* directory = claim(directories[pageIndex >> DirectoryBits], DirectorySize, create);
+		if (directory == nullptr) return nullptr;
+		return claim(directory[pageIndex & (DirectorySize - 1)], PageWords, create);
 	}
-	
+
+public:
+	UsedWays(): directories(new std::atomic<directory_t*>[DirectoryCount]) {
+		for (size_t i = 0; i < DirectoryCount; i++) directories[i] = nullptr;
+	}
+	~UsedWays() { clear(); }
+
 	// Mark a way as used
 	void insert(WayID wayid) {
-		std::lock_guard<std::mutex> lock(mutex);
-		if (wayid>usedList.size()) usedList.resize(wayid+256);
-		usedList[wayid] = true;
+		page_t* bits = page(wayid, true);
+		const size_t bit = wayid & ((size_t(1) << PageBits) - 1);
+		bits[bit / 64].fetch_or(uint64_t(1) << (bit % 64), std::memory_order_relaxed);
 	}
 	
 	// See if a way is used
 	bool at(WayID wayid) const {
-		return (wayid>usedList.size()) ? false : usedList[wayid];
+		const page_t* bits = page(wayid, false);
+		if (bits == nullptr) return false;
+		const size_t bit = wayid & ((size_t(1) << PageBits) - 1);
+		return bits[bit / 64].load(std::memory_order_relaxed) & (uint64_t(1) << (bit % 64));
 	}
 	
 	void clear() {
-		std::lock_guard<std::mutex> lock(mutex);
-		usedList.clear();
+		for (size_t i = 0; i < DirectoryCount; i++) {
+			directory_t* directory = directories[i].load();
+			if (directory == nullptr) continue;
+			for (size_t j = 0; j < DirectorySize; j++) delete[] directory[j].load();
+			delete[] directory;
+			directories[i] = nullptr;
+		}
 	}
 };
 
-// scanned relations store
+/** \brief Which ways are in the relations the Lua profile accepted, and those relations' tags
+*
+* During RelationScan each thread appends to its own buffers, so no lock is
+* taken per way. finalize() then sorts everything into flat arrays, indexed
+* like a CSR matrix: the relations for a way are a contiguous run, found by
+* binary search, and handed out without copying. Tag strings are interned,
+* so each distinct key or value is stored once.
+*/
 class RelationScanStore {
 
-private:
-	using tag_map_t = boost::container::flat_map<std::string, std::string>;
-	std::map<WayID, std::vector<WayID>> relationsForWays;
-	std::map<WayID, tag_map_t> relationTags;
-	mutable std::mutex mutex;
-
 public:
+	// The relations a way is in; points into the store, so valid until the next finalize()
+	struct relation_list_t {
+		const WayID *first = nullptr, *last = nullptr;
+		size_t size() const { return last - first; }
+		bool empty() const { return first == last; }
+		WayID operator[](size_t i) const { return first[i]; }
+	};
+
 	void relation_contains_way(WayID relid, WayID wayid) {
-		std::lock_guard<std::mutex> lock(mutex);
-		relationsForWays[wayid].emplace_back(relid);
-	}
-	void store_relation_tags(WayID relid, const tag_map_t &tags) {
-		std::lock_guard<std::mutex> lock(mutex);
-		relationTags[relid] = tags;
-	}
-	bool way_in_any_relations(WayID wayid) {
-		return relationsForWays.find(wayid) != relationsForWays.end();
-	}
-	std::vector<WayID> relations_for_way(WayID wayid) {
-		return relationsForWays[wayid];
+		localBuffer().ways.emplace_back(wayid, relid);
 	}
-	std::string get_relation_tag(WayID relid, const std::string &key) {
-		auto it = relationTags.find(relid);
-		if (it==relationTags.end()) return "";
-		auto jt = it->second.find(key);
-		if (jt==it->second.end()) return "";
-		return jt->second;
-	}
-	void clear() {
-		std::lock_guard<std::mutex> lock(mutex);
-		relationsForWays.clear();
-		relationTags.clear();
+	void store_relation_tags(WayID relid, const TagMap &tags);
+
+	// Make everything added since the last call visible to the lookups below
+	void finalize(unsigned int threadNum);
+
+	bool way_in_any_relations(WayID wayid) const {
+		return std::binary_search(wayIds.begin(), wayIds.end(), wayid);
 	}
+	relation_list_t relations_for_way(WayID wayid) const;
+	std::string get_relation_tag(WayID relid, const std::string &key) const;
+	void clear();
+
+private:
+	using tag_t = std::pair<uint32_t, uint32_t>;		// key and value, as positions in tagStrings
+
+	struct ScanBuffer {
+		std::vector<std::pair<WayID, WayID>> ways;			// way, relation
+		std::vector<std::pair<WayID, std::vector<tag_t>>> tags;		// relation, its tags
+	};
+	ScanBuffer& localBuffer();
+	static thread_local ScanBuffer* threadBuffer;
+	static thread_local uint64_t threadBufferGeneration;
+	// Changed whenever buffers is emptied; drawn from one counter for every
+	// store, so a thread can't take another store's buffer for this one's
+	static std::atomic<uint64_t> nextBufferGeneration;
+	std::atomic<uint64_t> bufferGeneration { nextBufferGeneration++ };
+
+	std::mutex mutex;
+	std::deque<ScanBuffer> buffers;			// one per thread; a deque, so they never move
+
+	// Ways in relations, sorted: the relations for wayIds[i] are
+	// wayRelations[wayOffsets[i]] up to wayRelations[wayOffsets[i+1]]
+	std::vector<WayID> wayIds;
+	std::vector<uint32_t> wayOffsets;
+	std::vector<WayID> wayRelations;
+
+	// Relation tags, laid out the same way
+	std::vector<WayID> relationIds;
+	std::vector<uint32_t> tagOffsets;
+	std::vector<tag_t> relationTags;
+
+	// Interned tag strings. The index holds views into tagStrings, which is a
+	// deque so that they stay valid as it grows
+	std::mutex stringMutex;
+	std::deque<std::string> tagStrings;
+	std::map<boost::string_view, uint32_t> tagStringIndex;
+	uint32_t internString(boost::string_view str);
 };
 
 
@@ -171,6 +238,7 @@ public:
 protected:	
 	bool use_compact_nodes = false;
 	bool require_integrity = true;
+	unsigned int assemblyThreads = 1;
 
 	RelationStore relations; // unused
 	UsedWays used_ways;
@@ -189,6 +257,8 @@ public:
 
 	void use_compact_store(bool use) { use_compact_nodes = use; }
 	void enforce_integrity(bool ei) { require_integrity = ei; }
+	// Threads that may share the assembly of a multipolygon with many rings
+	void assembly_threads(unsigned int n) { assemblyThreads = std::max(1u, n); }
 	bool integrity_enforced() { return require_integrity; }
 
 	void relations_insert_front(std::vector<RelationStore::element_t> &new_relations) {
@@ -199,13 +269,12 @@ public:
 	void mark_way_used(WayID i) { used_ways.insert(i); }
 	bool way_is_used(WayID i) { return used_ways.at(i); }
 
-	void ensureUsedWaysInited();
 
-	using tag_map_t = boost::container::flat_map<std::string, std::string>;
 	void relation_contains_way(WayID relid, WayID wayid) { scanned_relations.relation_contains_way(relid,wayid); }
-	void store_relation_tags(WayID relid, const tag_map_t &tags) { scanned_relations.store_relation_tags(relid,tags); }
+	void store_relation_tags(WayID relid, const TagMap &tags) { scanned_relations.store_relation_tags(relid,tags); }
+	void finalize_scanned_relations(unsigned int threadNum) { scanned_relations.finalize(threadNum); }
 	bool way_in_any_relations(WayID wayid) { return scanned_relations.way_in_any_relations(wayid); }
-	std::vector<WayID> relations_for_way(WayID wayid) { return scanned_relations.relations_for_way(wayid); }
+	RelationScanStore::relation_list_t relations_for_way(WayID wayid) { return scanned_relations.relations_for_way(wayid); }
 	std::string get_relation_tag(WayID relid, const std::string &key) { return scanned_relations.get_relation_tag(relid, key); }
 
 	void clear();
@@ -214,7 +283,7 @@ public:
 	// Relation -> MultiPolygon or MultiLinestring
 	MultiPolygon wayListMultiPolygon(WayVec::const_iterator outerBegin, WayVec::const_iterator outerEnd, WayVec::const_iterator innerBegin, WayVec::const_iterator innerEnd) const;
 	MultiLinestring wayListMultiLinestring(WayVec::const_iterator outerBegin, WayVec::const_iterator outerEnd) const;
-	void mergeMultiPolygonWays(std::vector<LatpLonDeque> &results, std::map<WayID,bool> &done, WayVec::const_iterator itBegin, WayVec::const_iterator itEnd) const;
+	void mergeMultiPolygonWays(LatpLonRings &results, std::unordered_set<WayID> &done, WayVec::const_iterator itBegin, WayVec::const_iterator itEnd) const;
 
 	///It is not really meaningful to try using a relation as a linestring. Not normally used but included
 	///if Lua script attempts to do this.
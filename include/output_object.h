@@ -6,6 +6,10 @@
 #include <string>
 #include <map>
 #include <memory>
+#include <unordered_map>
+#include <deque>
+#include <boost/utility/string_view.hpp>
+#include <boost/functional/hash.hpp>
 #include "geom.h"
 #include "coordinates.h"
 #include "attribute_store.h"
@@ -15,6 +19,52 @@
 #include "osmformat.pb.h"
 #include "vector_tile.pb.h"
 
+/** \brief Key and value dictionaries for one layer of a tile being written
+*
+* Keys are looked up by their index in the AttributeKeyStore, and values by
+* the AttributePair they come from, before falling back to hashing the key or
+* value itself. Workers keep one dictionary each and clear() it for every
+* layer, so the tables' memory is reused.
+*
+* Strings are looked up by view, pointing into the shared string store for
+* values from AttributePairs and into mergedStrings for values read from an
+* existing tile, so a lookup doesn't allocate. Floats are keyed on their bits
+* after normalizing -0.0 to 0.0 and every NaN to one NaN, so that equal values
+* share an entry (NaN would otherwise never compare equal to itself).
+*/
+class LayerDictionary {
+public:
+	std::vector<std::string> keys;
+	std::vector<vector_tile::Tile_Value> values;
+
+	LayerDictionary();
+	void clear();
+
+	// Add an entry from an existing tile (when merging)
+	void addKey(const std::string &key);
+	void addValue(const vector_tile::Tile_Value &value);
+
+	// Subscripts in the layer's key and value lists, adding the entry if new
+	uint32_t keySubscript(uint16_t keyIndex, const std::string &key);
+	uint32_t valueSubscript(const AttributePair &pair);
+
+private:
+	uint32_t generation;
+	std::vector<std::pair<uint32_t, uint32_t>> keysByIndex;	// (generation, subscript)
+	std::unordered_map<std::string, uint32_t> keysByName;
+	std::unordered_map<const AttributePair*, uint32_t> valuesByPair;
+	struct StringViewHash {
+		size_t operator()(const boost::string_view &s) const { return boost::hash_range(s.begin(), s.end()); }
+	};
+	std::unordered_map<boost::string_view, uint32_t, StringViewHash> stringValues;
+	std::deque<std::string> mergedStrings;
+	std::unordered_map<uint32_t, uint32_t> floatValues;
+
+	static float normalizeFloat(float f);
+	static uint32_t floatKey(float f);
+	int64_t boolValues[2];
+};
+
 enum OutputGeometryType : unsigned int { POINT_, LINESTRING_, MULTILINESTRING_, POLYGON_ };
 
 //\brief Display the geometry type
@@ -78,17 +128,9 @@ public:
 	}
 
 	//\brief Write attribute key/value pairs (dictionary-encoded)
-	void writeAttributes(std::vector<std::string> *keyList, 
-		std::vector<vector_tile::Tile_Value> *valueList, 
+	void writeAttributes(LayerDictionary &dictionary,
 		AttributeStore const &attributeStore,
 		vector_tile::Tile_Feature *featurePtr, char zoom) const;
-	
-	/**
-	 * \brief Find a value in the value dictionary
-	 * (we can't easily use find() because of the different value-type encoding - 
-	 *	should be possible to improve this though)
-	 */
-	int findValue(const std::vector<vector_tile::Tile_Value>* valueList, const AttributePair& value) const;
 };
 #pragma pack(pop)
 
@@ -0,0 +1,122 @@
+/*! \file */
+#ifndef _PACKED_OBJECTS_H
+#define _PACKED_OBJECTS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "output_object.h"
+
+// Objects in each block of a packed z6 tile
+#define PACKED_OBJECTS_BLOCK 128
+
+typedef uint32_t Z6OffsetKey;		// an object's position in its z6 tile; see tile_data.h
+
+/** \brief A finalized z6 tile's keys and objects, bit-packed in blocks
+*
+* Each block of PACKED_OBJECTS_BLOCK objects keeps each field as a column:
+* the smallest value in the block, and each value's difference from it in as
+* few bits as the block needs. Objects that are near each other in a sorted
+* tile have similar keys, IDs and attributes, and the same few layers and
+* z_orders, so they take a fraction of their 16 or 28 bytes.
+*
+* The packing is immutable. Any object can be read on its own, so a tile's
+* objects are found by searching the keys as before, and only the blocks
+* with objects in the tile are read.
+*/
+class PackedObjects {
+public:
+	// Replace the contents with these (finalized) keys and objects
+	void pack(const std::vector<Z6OffsetKey> &keys, const std::vector<OutputObject> &objects);
+	void pack(const std::vector<Z6OffsetKey> &keys, const std::vector<OutputObjectID> &objects);
+	void clear();
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	size_t bytes() const { return data.size() + blocks.size() * sizeof(Block); }
+
+	Z6OffsetKey key(size_t i) const {
+		const Block &block = blocks[i / PACKED_OBJECTS_BLOCK];
+		return block.keyBase + readBits(&data[block.offset], i % PACKED_OBJECTS_BLOCK, block.widths[KeyColumn]);
+	}
+	OutputObjectID object(size_t i) const;
+
+	// The first object in [first, last) whose key isn't less than key, if the
+	// keys in that range are sorted
+	size_t lowerBound(size_t first, size_t last, uint64_t key) const;
+
+	// Call f with each object in [first, last), reading each block once
+	template<class F> void forEach(size_t first, size_t last, F const &f) const {
+		for (size_t i = first; i < last; ) {
+			const Block &block = blocks[i / PACKED_OBJECTS_BLOCK];
+			const size_t blockEnd = std::min(last, (i / PACKED_OBJECTS_BLOCK + 1) * PACKED_OBJECTS_BLOCK);
+			const uint8_t *columns[ColumnCount];
+			columnsOf(block, columns);
+			for (; i < blockEnd; i++) f(decode(block, columns, i % PACKED_OBJECTS_BLOCK));
+		}
+	}
+
+	// Unpack them again, e.g. to save to a snapshot
+	void unpack(std::vector<Z6OffsetKey> &keys, std::vector<OutputObject> &objects) const;
+	void unpack(std::vector<Z6OffsetKey> &keys, std::vector<OutputObjectID> &objects) const;
+
+private:
+	enum Column { KeyColumn, ObjectIDColumn, AttributesColumn, RestColumn, IDColumn, ColumnCount };
+
+	// Each column's width in bits; 0 if every value is the base, and 64 if
+	// the values are stored whole
+	struct Block {
+		uint64_t offset;
+		uint64_t objectIDBase, idBase;
+		Z6OffsetKey keyBase, firstKey;
+		uint32_t attributesBase, restBase;
+		uint8_t widths[ColumnCount];
+	};
+
+	size_t count = 0;
+	std::vector<Block> blocks;
+	std::vector<uint8_t> data;		// padded, so that a value can always be read with one 8-byte load
+
+	template<class T> void packObjects(const std::vector<Z6OffsetKey> &keys, const std::vector<T> &objects);
+
+	static uint64_t readBits(const uint8_t *column, size_t i, unsigned width) {
+		if (width == 0) return 0;
+		uint64_t value;
+		if (width == 64) {
+			memcpy(&value, column + i * 8, 8);
+			return value;
+		}
+		const size_t bit = i * width;
+		memcpy(&value, column + bit / 8, 8);
+		return (value >> (bit % 8)) & ((uint64_t(1) << width) - 1);
+	}
+
+	// The layer, geometry type, minZoom and z_order, as one 30-bit value
+	static uint32_t restOf(const OutputObject &oo) {
+		return (uint32_t(oo.layer) << 22) | (uint32_t(oo.geomType) << 20) | (uint32_t(oo.minZoom) << 16) | uint16_t(oo.z_order);
+	}
+
+	void columnsOf(const Block &block, const uint8_t **columns) const {
+		const size_t blockCount = std::min<size_t>(PACKED_OBJECTS_BLOCK, count - (&block - blocks.data()) * PACKED_OBJECTS_BLOCK);
+		const uint8_t *column = &data[block.offset];
+		for (unsigned c = 0; c < ColumnCount; c++) {
+			columns[c] = column;
+			column += (blockCount * block.widths[c] + 7) / 8;
+		}
+	}
+
+	static OutputObjectID decode(const Block &block, const uint8_t * const *columns, size_t i) {
+		const uint32_t rest = block.restBase + readBits(columns[RestColumn], i, block.widths[RestColumn]);
+		OutputObject oo(
+			OutputGeometryType((rest >> 20) & 3),
+			rest >> 22,
+			block.objectIDBase + readBits(columns[ObjectIDColumn], i, block.widths[ObjectIDColumn]),
+			block.attributesBase + readBits(columns[AttributesColumn], i, block.widths[AttributesColumn]),
+			(rest >> 16) & 15);
+		oo.z_order = int16_t(rest & 0xffff);
+		return OutputObjectID({ oo, block.idBase + readBits(columns[IDColumn], i, block.widths[IDColumn]) });
+	}
+};
+
+#endif //_PACKED_OBJECTS_H
@@ -22,6 +22,8 @@ void readMessage(google::protobuf::Message *message, std::istream &input, unsign
 // and parse the unzipped contents into a message
 BlobHeader readHeader(std::istream &input);
 void readBlock(google::protobuf::Message *messagePtr, std::size_t datasize, std::istream &input);
+// Read a Blob and decompress it, without parsing the contents
+void readBlockContents(std::string &contents, std::size_t datasize, std::istream &input);
 
 void writeBlock(google::protobuf::Message *messagePtr, std::ostream &output, std::string headerType);
 /* -------------------
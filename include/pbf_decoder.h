@@ -0,0 +1,145 @@
+/*! \file */
+#ifndef _PBF_DECODER_H
+#define _PBF_DECODER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <boost/utility/string_view.hpp>
+
+/* -------------------
+   Decoding .osm.pbf blocks without libprotobuf
+
+   libprotobuf's generated classes copy every string in a block's string
+   table, and every packed array, before we look at any of it. These read
+   the wire format in place instead: strings are views into the decompressed
+   block, and packed arrays are decoded as they're iterated. Only the fields
+   tilemaker uses are decoded; everything else is skipped.
+   ------------------- */
+
+class PbfPackedVarints;
+
+/// Cursor over the fields of one protobuf message
+class PbfMessage {
+public:
+	PbfMessage(): ptr(nullptr), end(nullptr), tag(0) { }
+	PbfMessage(boost::string_view data): ptr(data.data()), end(data.data() + data.size()), tag(0) { }
+
+	// Move to the next field; false at the end of the message
+	bool next() {
+		if (ptr >= end) return false;
+		tag = readVarint(ptr, end);
+		return true;
+	}
+	uint32_t field() const { return tag >> 3; }
+	uint32_t wireType() const { return tag & 7; }
+
+	// Read the current field's value
+	uint64_t varint() { return readVarint(ptr, end); }
+	int64_t svarint() { return zigzag(readVarint(ptr, end)); }
+	boost::string_view bytes() {
+		uint64_t length = readVarint(ptr, end);
+		if (length > uint64_t(end - ptr)) throw std::runtime_error("PBF field runs past the end of its message");
+		boost::string_view value(ptr, length);
+		ptr += length;
+		return value;
+	}
+	// A packed repeated field, which is how every .osm.pbf writer stores them
+	PbfPackedVarints packed();
+	void skip();
+
+	static int64_t zigzag(uint64_t value) { return int64_t(value >> 1) ^ -int64_t(value & 1); }
+
+	static uint64_t readVarint(const char *&p, const char *end) {
+		// Most values fit in one byte
+		if (p < end && !(*p & 0x80)) return uint8_t(*p++);
+		uint64_t value = 0;
+		for (unsigned shift = 0; shift < 64; shift += 7) {
+			if (p >= end) throw std::runtime_error("PBF varint runs past the end of its message");
+			uint8_t byte = *p++;
+			value |= uint64_t(byte & 0x7F) << shift;
+			if (!(byte & 0x80)) return value;
+		}
+		throw std::runtime_error("PBF varint is too long");
+	}
+
+private:
+	void skipFixed(size_t length);
+
+	const char *ptr, *end;
+	uint64_t tag;
+};
+
+/// A packed repeated varint field, decoded as it's iterated
+class PbfPackedVarints {
+public:
+	PbfPackedVarints(): ptr(nullptr), end(nullptr) { }
+	PbfPackedVarints(boost::string_view data): ptr(data.data()), end(data.data() + data.size()) { }
+
+	bool empty() const { return ptr >= end; }
+	uint64_t next() { return PbfMessage::readVarint(ptr, end); }
+	int64_t nextSigned() { return PbfMessage::zigzag(PbfMessage::readVarint(ptr, end)); }
+
+	// Number of values left: each ends with a byte whose top bit is clear
+	size_t size() const {
+		size_t count = 0;
+		for (const char *p = ptr; p < end; p++) if (!(*p & 0x80)) count++;
+		return count;
+	}
+
+private:
+	const char *ptr, *end;
+};
+
+/// DenseNodes: parallel delta-coded arrays, with tags as key/value/.../0 runs
+struct PbfDenseNodes {
+	PbfPackedVarints ids, lats, lons, keysVals;
+	void parse(boost::string_view data);
+};
+
+struct PbfWay {
+	int64_t id;
+	PbfPackedVarints keys, vals, refs, lats, lons;
+	void parse(boost::string_view data);
+};
+
+struct PbfRelation {
+	int64_t id;
+	PbfPackedVarints keys, vals, roles, memids, types;
+	void parse(boost::string_view data);
+
+	// Whether tag typeKey has value val (both string table positions; -1 if not in the block)
+	bool isType(int typeKey, int val) const;
+};
+
+/// One PrimitiveGroup: we keep where its objects are, and decode them one at a time
+struct PbfPrimitiveGroup {
+	boost::string_view dense;
+	std::vector<boost::string_view> ways, relations;
+	size_t nodes;
+
+	void parse(boost::string_view data);
+	bool hasNodes() const { return !dense.empty() || nodes > 0; }
+};
+
+/// A decompressed PrimitiveBlock. The data must outlive it.
+class PbfPrimitiveBlock {
+public:
+	std::vector<boost::string_view> strings;
+	std::vector<boost::string_view> groups;
+
+	void parse(const char *data, size_t size);
+
+	/// Find a string in the string table, or -1 if it isn't there
+	int findString(boost::string_view str) const;
+
+private:
+	// Open-addressed hash of the string table, built as each block is parsed
+	// (its storage is reused from block to block)
+	std::vector<int32_t> stringIndex;
+	void indexStrings();
+	static size_t hashString(boost::string_view str);
+};
+
+#endif //_PBF_DECODER_H
@@ -0,0 +1,77 @@
+/*! \file */
+#ifndef _PMTILES_H
+#define _PMTILES_H
+
+#include <string>
+#include <mutex>
+#include <vector>
+#include <fstream>
+#include <unordered_map>
+#include <cstdint>
+
+// PMTiles v3 constants (https://github.com/protomaps/PMTiles/blob/main/spec/v3/spec.md)
+#define PMTILES_HEADER_LENGTH 127
+#define PMTILES_ROOT_LENGTH 16384
+#define PMTILES_COMPRESSION_NONE 1
+#define PMTILES_COMPRESSION_GZIP 2
+#define PMTILES_COMPRESSION_ZSTD 4
+#define PMTILES_TILETYPE_MVT 1
+
+///\brief One run of tiles in a PMTiles directory
+struct PMTilesEntry {
+	uint64_t tileId;
+	uint64_t offset;
+	uint32_t length;
+	uint32_t runLength;			// 0 means the entry points to a leaf directory
+};
+
+///\brief Fixed-size header at the start of a PMTiles archive
+struct PMTilesHeader {
+	uint64_t rootDirOffset = 0, rootDirLength = 0;
+	uint64_t jsonMetadataOffset = 0, jsonMetadataLength = 0;
+	uint64_t leafDirsOffset = 0, leafDirsLength = 0;
+	uint64_t tileDataOffset = 0, tileDataLength = 0;
+	uint64_t addressedTilesCount = 0, tileEntriesCount = 0, tileContentsCount = 0;
+	bool clustered = false;
+	uint8_t internalCompression = PMTILES_COMPRESSION_GZIP;
+	uint8_t tileCompression = PMTILES_COMPRESSION_GZIP;
+	uint8_t tileType = PMTILES_TILETYPE_MVT;
+	uint8_t minZoom = 0, maxZoom = 0;
+	int32_t minLonE7 = 0, minLatE7 = 0, maxLonE7 = 0, maxLatE7 = 0;
+	uint8_t centerZoom = 0;
+	int32_t centerLonE7 = 0, centerLatE7 = 0;
+
+	std::string serialize() const;
+};
+
+/** \brief Write to a PMTiles v3 archive
+*
+* Tiles are appended to a single file as they arrive, starting after a reserved
+* block for the header and root directory. Identical small tiles (typically
+* ocean or empty land) are only stored once. The directory, sorted in Hilbert
+* tile-ID order, and the JSON metadata are written when the archive is closed.
+*/
+class PMTiles {
+	std::ofstream outputStream;
+	std::mutex m;
+	std::vector<PMTilesEntry> entries;
+	std::unordered_map<std::string, std::pair<uint64_t, uint32_t>> smallTiles;
+	uint64_t tileDataLength;
+
+	std::string buildDirectories(std::vector<PMTilesEntry> &entries, std::string &leafDirs) const;
+
+public:
+	PMTilesHeader header;
+
+	PMTiles();
+	virtual ~PMTiles();
+	void openForWriting(std::string &filename);
+	void saveTile(int zoom, int x, int y, std::string *data);
+	void closeForWriting(const std::string &jsonMetadata);
+
+	static uint64_t zxyToTileId(uint8_t zoom, uint32_t x, uint32_t y);
+	static std::string serializeDirectory(const std::vector<PMTilesEntry> &entries);
+	static std::vector<PMTilesEntry> deserializeDirectory(const std::string &data);
+};
+
+#endif //_PMTILES_H
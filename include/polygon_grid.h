@@ -0,0 +1,57 @@
+/*! \file */
+#ifndef _POLYGON_GRID_H
+#define _POLYGON_GRID_H
+
+#include <vector>
+#include <cstdint>
+#include "geom.h"
+
+/** \brief Polygons rasterized onto a grid over a box, and traced back into shapes
+*
+* Used to generalize a layer's polygons at low zooms (`aggregate_below`): each
+* polygon fills the cells whose centres it covers, and the filled cells are
+* traced into one multipolygon, with a polygon for each group of cells that
+* share edges. The cost of tracing depends on the grid, not on how many
+* polygons went into it, and there are no unions to take.
+*
+* The outlines follow the cell edges, so the grid's resolution should be about
+* that of the tile's pixels. Polygons smaller than a cell may cover no centres,
+* and then leave nothing.
+*/
+class PolygonGrid {
+public:
+	// Clear the grid, and set it to resolution cells along each side of box
+	void reset(Box const &box, unsigned resolution);
+	void add(MultiPolygon const &mp);
+	bool empty() const { return filled == 0; }
+	// The filled cells' outlines, replacing out's contents
+	void trace(MultiPolygon &out);
+
+	size_t cellCount() const { return cells.size(); }
+	// Free the storage kept for the next grid (reset() must be called before it's reused)
+	void release();
+
+private:
+	Box box;
+	unsigned resolution = 0;
+	double cellWidth = 0, cellHeight = 0;
+	std::vector<uint8_t> cells;					// row by row, from the bottom
+	size_t filled = 0;
+
+	// Kept between calls, to reuse their storage
+	std::vector<std::pair<int, double>> crossings;	// row, and x where a ring crosses its centre
+	struct Edge { uint32_t from, to; uint8_t direction; bool used; };
+	std::vector<Edge> edges;
+	std::vector<int32_t> outgoing;				// two per vertex; -1 if none
+	std::vector<int32_t> components;			// per cell; -1 if not filled
+
+	bool cell(int x, int y) const {
+		return x >= 0 && y >= 0 && x < int(resolution) && y < int(resolution) && cells[y * resolution + x];
+	}
+	void fillPolygon(Polygon const &polygon);
+	void addEdge(uint32_t x, uint32_t y, uint8_t direction);
+	void labelComponents();
+	size_t rightCell(Edge const &edge) const;
+};
+
+#endif //_POLYGON_GRID_H
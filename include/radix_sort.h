@@ -0,0 +1,173 @@
+/*! \file */
+#ifndef _RADIX_SORT_H
+#define _RADIX_SORT_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Below this many elements, std::sort is quicker than a radix sort
+#define RADIX_SORT_MIN_ELEMENTS 4096
+// Below this many, a part of the array is left to std::sort
+#define RADIX_SORT_MIN_BUCKET 64
+// Interpolation steps before a search falls back to binary search, in case
+// the keys aren't evenly spread
+#define INTERPOLATION_SEARCH_STEPS 4
+#define INTERPOLATION_SEARCH_MIN_RANGE 32
+
+namespace RadixSortDetail {
+	// Run f(0)..f(threads-1), each on a thread of its own except the first
+	template<class F> void onThreads(unsigned threads, F const &f) {
+		std::vector<std::thread> running;
+		for (unsigned t = 1; t < threads; t++) running.emplace_back(f, t);
+		f(0);
+		for (auto &thread : running) thread.join();
+	}
+
+	template<class It, class KeyFn> void sortByKey(It begin, It end, KeyFn const &key) {
+		std::sort(begin, end, [&](decltype(*begin) a, decltype(*begin) b) { return key(a) < key(b); });
+	}
+
+	// Swap each element into the bucket for its byte, American flag style:
+	// next[b] is the first slot of bucket b that hasn't been filled yet
+	template<class It, class KeyFn> void permute(It begin, size_t const (&counts)[256], unsigned shift, KeyFn const &key) {
+		size_t next[256], ends[256], position = 0;
+		for (unsigned b = 0; b < 256; b++) {
+			next[b] = position;
+			position += counts[b];
+			ends[b] = position;
+		}
+		for (unsigned b = 0; b < 256; b++) {
+			while (next[b] < ends[b]) {
+				const unsigned d = (key(begin[next[b]]) >> shift) & 0xff;
+				if (d == b) next[b]++;
+				else std::iter_swap(begin + next[b], begin + next[d]++);
+			}
+		}
+	}
+
+	// Sort a part of the array in place on one thread, by the byte at shift and
+	// then the ones below it
+	template<class It, class KeyFn> void sortRange(It begin, It end, int shift, KeyFn const &key) {
+		for (; shift >= 0; shift -= 8) {
+			const size_t n = end - begin;
+			if (n < RADIX_SORT_MIN_BUCKET) { sortByKey(begin, end, key); return; }
+			size_t counts[256] = {};
+			for (It i = begin; i != end; ++i) counts[(key(*i) >> shift) & 0xff]++;
+			if (*std::max_element(counts, counts + 256) == n) continue;	// the same byte throughout
+
+			permute(begin, counts, shift, key);
+			if (shift == 0) return;
+			It bucket = begin;
+			for (unsigned b = 0; b < 256; b++) {
+				sortRange(bucket, bucket + counts[b], shift - 8, key);
+				bucket += counts[b];
+			}
+			return;
+		}
+	}
+}
+
+/** \brief Sort by an unsigned integer key, in place, with a parallel MSD radix sort
+*
+* Each element is swapped into the bucket for the highest byte that the keys
+* differ in, and the buckets sorted in turn by the next byte (an "American
+* flag" sort), so the only extra memory is a few counts. Bytes that are the
+* same for every element, such as the high bytes of small keys, are skipped.
+*
+* The threads count the bytes of a large part of the array between them, but
+* its elements are moved by one thread. Once the parts are small enough to
+* share out, each thread sorts parts of its own. The sort isn't stable.
+*/
+template<class It, class KeyFn>
+void radixSort(It begin, It end, unsigned threadNum, KeyFn const &key) {
+	const size_t n = end - begin;
+	if (n < RADIX_SORT_MIN_ELEMENTS || threadNum == 0) {
+		RadixSortDetail::sortByKey(begin, end, key);
+		return;
+	}
+	const unsigned threads = std::min<size_t>(threadNum, n / RADIX_SORT_MIN_ELEMENTS + 1);
+	auto onChunks = [&](It from, size_t size, auto const &f) {
+		const size_t chunk = (size + threads - 1) / threads;
+		RadixSortDetail::onThreads(threads, [&](unsigned t) {
+			f(t, from + std::min(size, t * chunk), from + std::min(size, (t + 1) * chunk));
+		});
+	};
+
+	std::vector<uint64_t> highest(threads, 0);
+	onChunks(begin, n, [&](unsigned t, It from, It to) {
+		for (It i = from; i != to; ++i) highest[t] = std::max<uint64_t>(highest[t], key(*i));
+	});
+	const uint64_t maxKey = *std::max_element(highest.begin(), highest.end());
+	int topShift = 0;
+	while (topShift < 56 && (maxKey >> (topShift + 8)) > 0) topShift += 8;
+
+	// Split the array until its parts can be shared out
+	struct Part { It begin; It end; int shift; };
+	std::vector<Part> large = { Part { begin, end, topShift } }, parts;
+	std::vector<std::array<size_t, 256>> threadCounts(threads);
+	while (!large.empty()) {
+		Part part = large.back();
+		large.pop_back();
+		const size_t size = part.end - part.begin;
+		if (part.shift < 0) continue;		// all the same key
+		if (size <= n / threads) { parts.push_back(part); continue; }
+
+		onChunks(part.begin, size, [&](unsigned t, It from, It to) {
+			threadCounts[t].fill(0);
+			for (It i = from; i != to; ++i) threadCounts[t][(key(*i) >> part.shift) & 0xff]++;
+		});
+		size_t counts[256] = {};
+		for (unsigned t = 0; t < threads; t++)
+			for (unsigned b = 0; b < 256; b++) counts[b] += threadCounts[t][b];
+		if (*std::max_element(counts, counts + 256) == size) {
+			large.push_back(Part { part.begin, part.end, part.shift - 8 });
+			continue;
+		}
+		RadixSortDetail::permute(part.begin, counts, part.shift, key);
+		if (part.shift == 0) continue;
+		It bucket = part.begin;
+		for (unsigned b = 0; b < 256; b++) {
+			if (counts[b] > 1) large.push_back(Part { bucket, bucket + counts[b], part.shift - 8 });
+			bucket += counts[b];
+		}
+	}
+
+	// The biggest parts first, so that the threads finish together
+	std::sort(parts.begin(), parts.end(), [](Part const &a, Part const &b) { return a.end - a.begin > b.end - b.begin; });
+	std::atomic<size_t> next(0);
+	RadixSortDetail::onThreads(threads, [&](unsigned) {
+		for (size_t i = next++; i < parts.size(); i = next++)
+			RadixSortDetail::sortRange(parts[i].begin, parts[i].end, parts[i].shift, key);
+	});
+}
+
+template<class Container, class KeyFn>
+void radixSort(Container &data, unsigned threadNum, KeyFn const &key) {
+	radixSort(data.begin(), data.end(), threadNum, key);
+}
+
+/** \brief The first element whose key isn't less than target, in elements sorted by key
+*
+* Guesses where target is from the keys at the ends of the range, which finds
+* it in a few steps when the keys are spread evenly, as OSM IDs mostly are.
+* If the guesses aren't narrowing it down, finishes with a binary search.
+*/
+template<class It, class KeyFn>
+It interpolationSearch(It begin, It end, uint64_t target, KeyFn const &key) {
+	for (unsigned step = 0; step < INTERPOLATION_SEARCH_STEPS && end - begin > INTERPOLATION_SEARCH_MIN_RANGE; step++) {
+		const uint64_t low = key(*begin), high = key(*(end - 1));
+		if (target <= low) return begin;
+		if (target > high) return end;
+		It guess = begin + size_t(double(target - low) / double(high - low) * double(end - begin - 1));
+		if (key(*guess) < target) begin = guess + 1;
+		else end = guess;		// if nothing before it is enough, it's the answer
+	}
+	return std::lower_bound(begin, end, target, [&](decltype(*begin) e, uint64_t t) { return key(e) < t; });
+}
+
+#endif //_RADIX_SORT_H
@@ -0,0 +1,74 @@
+/*! \file */
+#ifndef _READ_FGB_H
+#define _READ_FGB_H
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <stdexcept>
+#include <boost/utility/string_view.hpp>
+#include "geom.h"
+
+class LayerDefinition;
+class ShpMemTiles;
+class OsmLuaProcessing;
+
+/** \brief Read-only access to one FlatBuffers table, enough for FlatGeobuf
+*
+* Like the .osm.pbf decoder, this reads the wire format in place rather than
+* pulling in the generated FlatBuffers classes. Every access is checked
+* against the end of the buffer.
+*/
+class FbTable {
+public:
+	FbTable(): buf(nullptr), end(nullptr), table(nullptr), vtable(nullptr), vtableSize(0) { }
+	FbTable(const char *buf, const char *end, const char *table);
+
+	/// The root table of a buffer (which starts with its offset)
+	static FbTable root(const char *buf, size_t size);
+
+	bool valid() const { return table != nullptr; }
+	bool has(int field) const { return fieldPtr(field) != nullptr; }
+
+	template<typename T> T scalar(int field, T defaultValue) const {
+		const char *p = fieldPtr(field);
+		return p ? read<T>(p) : defaultValue;
+	}
+	boost::string_view string(int field) const;
+	FbTable subtable(int field) const;
+
+	// A vector: where its data starts, and how many elements (of elementSize bytes) it has
+	const char *vector(int field, uint32_t &length, size_t elementSize = 1) const;
+	// One element of a vector of tables
+	FbTable tableAt(int field, uint32_t i) const;
+
+	template<typename T> static T read(const char *p) { T value; memcpy(&value, p, sizeof(T)); return value; }
+
+private:
+	const char *buf, *end, *table, *vtable;
+	uint16_t vtableSize;
+
+	const char *fieldPtr(int field) const;
+	const char *indirect(const char *p) const;
+	void check(const char *p, size_t bytes) const {
+		if (p < buf || p > end || size_t(end - p) < bytes) throw std::runtime_error("FlatGeobuf data runs past the end of its buffer");
+	}
+};
+
+/// Search a FlatGeobuf packed Hilbert R-tree for the features intersecting a (lon/lat) box;
+/// returns their offsets from the start of the feature data, sorted
+std::vector<uint64_t> searchFlatGeobufIndex(const char *index, size_t indexSize, uint64_t featureCount, uint16_t nodeSize,
+                                            double minX, double minY, double maxX, double maxY);
+
+/// Bytes taken by the index of a FlatGeobuf file with this many features
+uint64_t flatGeobufIndexSize(uint64_t featureCount, uint16_t nodeSize);
+
+/// Read the features of a FlatGeobuf file in the bounding box, using its index if it has one
+void readFlatGeobuf(const Box &clippingBox,
+                    class LayerDefinition &layers,
+                    uint layerNum,
+                    uint threadNum,
+                    class ShpMemTiles &shpMemTiles,
+                    OsmLuaProcessing &osmLuaProcessing);
+
+#endif //_READ_FGB_H
@@ -0,0 +1,20 @@
+/*! \file */
+#ifndef _READ_GEOJSON_H
+#define _READ_GEOJSON_H
+
+#include "geom.h"
+
+class LayerDefinition;
+class ShpMemTiles;
+class OsmLuaProcessing;
+
+/// Read a GeoJSON FeatureCollection (.geojson/.json), or line-delimited GeoJSON with
+/// one Feature per line (.geojsonl/.geojsons/.ndjson), into a layer
+void readGeoJson(const Box &clippingBox,
+                 class LayerDefinition &layers,
+                 uint layerNum,
+                 uint threadNum,
+                 class ShpMemTiles &shpMemTiles,
+                 OsmLuaProcessing &osmLuaProcessing);
+
+#endif //_READ_GEOJSON_H
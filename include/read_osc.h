@@ -0,0 +1,61 @@
+/*! \file */ 
+#ifndef _READ_OSC_H
+#define _READ_OSC_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <mutex>
+#include <unordered_set>
+#include "coordinates.h"
+
+class NodeStore;
+class WayStore;
+
+///\brief Objects touched by an OSM change (.osc) file
+struct OscChanges {
+	std::vector<NodeID> nodeIds;					// created, modified or deleted nodes
+	std::vector<LatpLon> nodePositions;				// positions given for those nodes
+	std::vector<std::vector<NodeID>> wayNodes;		// node lists of changed ways
+	std::vector<WayID> wayIds;						// changed ways, and ways in changed relations
+	std::vector<int64_t> relationIds;				// changed relations
+
+	/** \brief Find, while the .pbf is read, the objects whose geometry the changes move
+	*
+	* A way moves with any of its nodes, and a relation with any of its ways;
+	* neither is in the change file unless its own tags or members changed.
+	* PbfReader calls these for each way and relation it reads (from several
+	* threads), once index() has been called.
+	*/
+	void index();
+	void checkWay(WayID id, const std::vector<NodeID> &nodes, const std::vector<LatpLon> &points);
+	void checkRelation(int64_t id, const std::vector<WayID> &outers, const std::vector<WayID> &inners, bool area);
+
+	/// Ways found by checkWay, as they are in the .pbf
+	std::vector<std::vector<LatpLon>> affectedWays;
+	/// Relations found by checkRelation: whether each is an area, and its ways
+	std::vector<std::pair<bool, std::vector<WayID>>> affectedRelations;
+
+private:
+	std::unordered_set<NodeID> nodeSet;
+	std::unordered_set<WayID> waySet;
+	std::unordered_set<int64_t> relationSet;
+	std::unordered_set<WayID> movedWays;			// found by checkWay; read-only once relations are checked
+	std::mutex mutex;
+};
+
+/// Read an .osc or .osc.gz file
+bool readOscFile(const std::string &filename, OscChanges &changes);
+
+/** \brief Find the tiles at baseZoom that the changes could affect
+*
+* Uses the positions given in the change file, the ways and relations found
+* while the updated .pbf was read, and the current geometry in the node and
+* way stores. Areas mark the tiles they cover, not their bounding boxes.
+* Positions that objects were moved or deleted from are only covered if the
+* change file includes them.
+*/
+void findDirtyTiles(const OscChanges &changes, const NodeStore &nodes, const WayStore &ways,
+                    uint baseZoom, std::set<TileCoordinates> &dirtyTiles);
+
+#endif //_READ_OSC_H
@@ -7,16 +7,24 @@
 #include <vector>
 #include <mutex>
 #include <map>
+#include <atomic>
+#include <functional>
 #include "osm_store.h"
+#include "mmap_allocator.h"
+#include "pbf_decoder.h"
+#include "tag_map.h"
 
 // Protobuf
 #include "osmformat.pb.h"
 #include "vector_tile.pb.h"
 
 class OsmLuaProcessing;
+struct OscChanges;
 
 extern const std::string OptionSortTypeThenID;
 extern const std::string OptionLocationsOnWays;
+// Blocks read so far in the current phase, and in all
+extern std::atomic<uint64_t> blocksProcessed, blocksToProcess;
 
 struct BlockMetadata {
 	long int offset;
@@ -31,12 +39,42 @@ struct BlockMetadata {
 	// will only process a chunk of the block.
 	size_t chunk;
 	size_t chunks;
+
+	// In the Relations phase, the heaviest relations are each read as a task
+	// of their own; such a task has the relation's ID here, and the block's
+	// other tasks (with 0) skip it.
+	int64_t onlyRelation;
 };
 
 struct IndexedBlockMetadata: BlockMetadata {
 	size_t index;
 };
 
+/** \brief Decompressed blocks kept from one read phase for a later one
+*
+* Relation blocks are read in both the RelationScan and Relations phases, and
+* again for each chunk when a block is subdivided. Keeping their decompressed
+* bytes avoids inflating them more than once. The bytes are allocated with
+* mmap_allocator, so they go to the --store file if there is one.
+*/
+class DecodedBlockCache {
+public:
+	DecodedBlockCache(size_t maxBytes): maxBytes(maxBytes), bytes(0) { }
+
+	// Find a cached block; false if it isn't in the cache
+	bool get(long int offset, const char *&data, size_t &size) const;
+	// Keep a block, if there's room under the budget
+	void add(long int offset, const std::string &contents);
+	void clear();
+
+private:
+	using contents_t = std::vector<char, mmap_allocator<char>>;
+	size_t maxBytes;
+	size_t bytes;
+	mutable std::mutex mutex;
+	std::map<long int, contents_t> blocks;
+};
+
 /**
  *\brief Reads a PBF OSM file and returns objects as a stream of events to a class derived from OsmLuaProcessing
  *
@@ -49,6 +87,27 @@ public:
 
 	PbfReader(OSMStore &osmStore);
 
+	// Node and way stores were loaded from a saved copy, so don't write to them
+	bool storesPreloaded = false;
+	// Store every way, not just those the Lua profile uses (for a store that will be saved)
+	bool storeAllWays = false;
+	// Ways carry their own coordinates, so only nodes the Lua profile sees need storing
+	bool storeTaggedNodesOnly = false;
+	// Decompressed relation blocks to keep between phases, in bytes
+	size_t blockCacheSize = 512 * 1024 * 1024;
+	// Where to save (and look for) which kinds of object each block holds, and
+	// the signature of the .pbf it must match; no index is kept if empty
+	std::string indexFile;
+	uint64_t indexSignature = 0;
+	// The change file (--osc) whose ways and relations to look for, if any
+	OscChanges *oscChanges = nullptr;
+	// Called as each phase of reading starts, if set
+	std::function<void(ReadPhase)> onPhase;
+
+	// Tags the Lua profile wants to see on ways and relations (from way_keys
+	// and relation_keys); anything else is skipped without calling Lua
+	TagFilter wayFilter, relationFilter;
+
 	using pbfreader_generate_output = std::function< std::shared_ptr<OsmLuaProcessing> () >;
 	using pbfreader_generate_stream = std::function< std::shared_ptr<std::istream> () >;
 
@@ -60,51 +119,42 @@ public:
 		const pbfreader_generate_output& generate_output
 	);
 
-	// Read tags into a map from a way/node/relation
-	using tag_map_t = boost::container::flat_map<std::string, std::string>;
-	template<typename T>
-	void readTags(T &pbfObject, PrimitiveBlock const &pb, tag_map_t &tags) {
-		tags.reserve(pbfObject.keys_size());
-		auto keysPtr = pbfObject.mutable_keys();
-		auto valsPtr = pbfObject.mutable_vals();
-		for (uint n=0; n < pbfObject.keys_size(); n++) {
-			tags[pb.stringtable().s(keysPtr->Get(n))] = pb.stringtable().s(valsPtr->Get(n));
-		}
-	}
+	// Read the tags of a way/node/relation, as views into the block's string table
+	static void readTags(PbfPackedVarints keys, PbfPackedVarints vals, PbfPrimitiveBlock const &pb, TagMap &tags);
 
 private:
 	bool ReadBlock(
 		std::istream &infile,
 		OsmLuaProcessing &output,
-		const BlockMetadata& blockMetadata,
+		BlockMetadata& blockMetadata,
+		DecodedBlockCache& blockCache,
 		const std::unordered_set<std::string>& nodeKeys,
 		bool locationsOnWays,
 		ReadPhase phase
 	);
-	bool ReadNodes(OsmLuaProcessing &output, PrimitiveGroup &pg, PrimitiveBlock const &pb, const std::unordered_set<int> &nodeKeyPositions);
+	bool ReadNodes(OsmLuaProcessing &output, PbfPrimitiveGroup const &pg, PbfPrimitiveBlock const &pb, const std::unordered_set<int> &nodeKeyPositions);
 
-	bool ReadWays(OsmLuaProcessing &output, PrimitiveGroup &pg, PrimitiveBlock const &pb, bool locationsOnWays);
-	bool ScanRelations(OsmLuaProcessing &output, PrimitiveGroup &pg, PrimitiveBlock const &pb);
+	bool ReadWays(OsmLuaProcessing &output, PbfPrimitiveGroup const &pg, PbfPrimitiveBlock const &pb, bool locationsOnWays);
+	bool ScanRelations(OsmLuaProcessing &output, PbfPrimitiveGroup const &pg, PbfPrimitiveBlock const &pb, const BlockMetadata &blockMetadata);
 	bool ReadRelations(
 		OsmLuaProcessing& output,
-		PrimitiveGroup& pg,
-		const PrimitiveBlock& pb,
+		PbfPrimitiveGroup const& pg,
+		PbfPrimitiveBlock const& pb,
 		const BlockMetadata& blockMetadata
 	);
 
-	inline bool RelationIsType(Relation const &rel, int typeKey, int val) {
-		if (typeKey==-1 || val==-1) return false;
-		auto typeI = std::find(rel.keys().begin(), rel.keys().end(), typeKey);
-		if (typeI==rel.keys().end()) return false;
-		int typePos = typeI - rel.keys().begin();
-		return rel.vals().Get(typePos) == val;
-	}
-
-	/// Find a string in the dictionary
-	static int findStringPosition(PrimitiveBlock const &pb, char const *str);
-	
 	OSMStore &osmStore;
 	std::mutex ioMutex;
+
+	// Relations with at least RELATION_HEAVY_WAYS ways, found by RelationScan
+	struct HeavyRelation {
+		long int blockOffset;
+		int64_t id;
+		size_t ways;
+	};
+	std::mutex heavyMutex;
+	std::vector<HeavyRelation> heavyRelations;
+	std::unordered_set<int64_t> heavyRelationIDs;
 };
 
 int ReadPbfBoundingBox(const std::string &inputFile, double &minLon, double &maxLon, 
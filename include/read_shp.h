@@ -16,6 +16,22 @@
 
 void fillPointArrayFromShapefile(std::vector<Point> *points, SHPObject *shape, uint part);
 
+/// An attribute value read from a shapefile, GeoJSON or FlatGeobuf feature
+struct SourceValue {
+	enum Type { String, Integer, Double, Boolean };
+	Type type = String;
+	std::string str;
+	double number = 0;
+};
+
+/// The value as text, e.g. for use as a feature name
+std::string sourceValueString(const SourceValue &value);
+
+/// Encode attributes read from any source, calling attribute_function if the profile has one
+AttributeIndex addSourceAttributes(const std::vector<std::pair<std::string, SourceValue>> &values,
+                                   LayerDef &layer,
+                                   OsmLuaProcessing &osmLuaProcessing, uint &minzoom);
+
 /// Read requested attributes from a shapefile, and encode into an OutputObject
 AttributeIndex readShapefileAttributes(DBFHandle &dbf, int recordNum, 
                                        std::unordered_map<int,std::string> &columnMap,
@@ -35,5 +51,14 @@ void readShapefile(const Box &clippingBox,
 void processShapeGeometry(SHPObject* shape, AttributeIndex attrIdx, ShpMemTiles &shpMemTiles,
                           const Box &clippingBox, const LayerDef &layer, uint layerNum, bool hasName, const std::string &name);
 
+// Clip a geometry from any source to the bounding box and store it (coordinates are lon/latp);
+// polygons are made valid first
+void storeSourcePoint(const Point &p, AttributeIndex attrIdx, ShpMemTiles &shpMemTiles,
+                      const Box &clippingBox, const LayerDef &layer, uint layerNum, bool hasName, const std::string &name);
+void storeSourceLinestring(const Linestring &ls, AttributeIndex attrIdx, ShpMemTiles &shpMemTiles,
+                           const Box &clippingBox, const LayerDef &layer, uint layerNum, bool hasName, const std::string &name);
+void storeSourcePolygon(MultiPolygon &multi, int64_t featureId, AttributeIndex attrIdx, ShpMemTiles &shpMemTiles,
+                        const Box &clippingBox, const LayerDef &layer, uint layerNum, bool hasName, const std::string &name);
+
 #endif //_READ_SHP_H
 
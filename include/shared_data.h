@@ -4,13 +4,19 @@
 
 #include <vector>
 #include <map>
+#include <memory>
 
 #include "rapidjson/document.h"
 
 #include "osm_store.h"
 #include "output_object.h"
 #include "mbtiles.h"
+#include "pmtiles.h"
+#include "tile_sink.h"
+#include "tile_dedup.h"
+#include "compression.h"
 #include "tile_data.h"
+#include "tag_rules.h"
 
 ///\brief Defines map single layer appearance
 struct LayerDef {
@@ -21,9 +27,12 @@ struct LayerDef {
 	double simplifyLevel;
 	double simplifyLength;
 	double simplifyRatio;
+	bool simplifyFast;
 	uint filterBelow;
 	double filterArea;
 	uint combinePolygonsBelow;
+	uint aggregateBelow;
+	uint aggregateResolution;
 	bool sortZOrderAscending;
 	uint featureLimit;
 	uint featureLimitBelow;
@@ -46,8 +55,9 @@ public:
 
 	// Define a layer (as read from the .json file)
 	uint addLayer(std::string name, uint minzoom, uint maxzoom,
-			uint simplifyBelow, double simplifyLevel, double simplifyLength, double simplifyRatio, 
-			uint filterBelow, double filterArea, uint combinePolygonsBelow, bool sortZOrderAscending,
+			uint simplifyBelow, double simplifyLevel, double simplifyLength, double simplifyRatio, bool simplifyFast,
+			uint filterBelow, double filterArea, uint combinePolygonsBelow, uint aggregateBelow, uint aggregateResolution,
+			bool sortZOrderAscending,
 			uint featureLimit, uint featureLimitBelow,
 			const std::string &source,
 			const std::vector<std::string> &sourceColumns,
@@ -56,6 +66,8 @@ public:
 			const std::string &indexName,
 			const std::string &writeTo);
 	std::vector<bool> getSortOrders();
+	// Each layer's feature_limit at this zoom, or 0 if it has none there
+	std::vector<uint> getFeatureLimits(uint zoom) const;
 	rapidjson::Value serialiseToJSONValue(rapidjson::Document::AllocatorType &allocator) const;
 	std::string serialiseToJSON() const;
 };
@@ -69,16 +81,19 @@ public:
 	uint mvtVersion, combineBelow;
 	bool includeID, compress, gzip, highResolution;
 	std::string compressOpt;
-	bool clippingBoxFromJSON;
+	CompressionType compression;
+	std::vector<int> compressLevels;		// by zoom; the last entry applies to all higher zooms
 	double minLon, minLat, maxLon, maxLat;
 	std::string projectName, projectVersion, projectDesc;
 	std::string defaultView;
+	TagRules rules;						// declarative tag->layer rules, tried before Lua
 
 	Config();
 	virtual ~Config();
 
 	void readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, Box &clippingBox);
 	void enlargeBbox(double cMinLon, double cMaxLon, double cMinLat, double cMaxLat);
+	int compressLevelAt(uint zoom) const;
 };
 
 ///\brief Data used by worker threads ::outputProc to write output
@@ -86,15 +101,25 @@ class SharedData {
 
 public:
 	const class LayerDefinition &layers;
-	bool sqlite;
+	OutputMode outputMode;
 	bool mergeSqlite;
+	bool replaceTiles;		// overwrite tiles in an existing .mbtiles, rather than merging into them
 	MBTiles mbtiles;
+	std::vector<std::unique_ptr<MBTiles>> mbtilesShards;	// if used, tiles are written here, then merged into mbtiles
+	PMTiles pmtiles;
+	TileDeduplicator tileDedup;
+	FillTileCache fillTiles;
 	std::string outputFile;
+	std::vector<std::unique_ptr<TileSink>> outputSinks;	// each tile is also written to these: a directory output, and any further outputs
 
 	Config &config;
 
 	SharedData(Config &configIn, const class LayerDefinition &layers);
 	virtual ~SharedData();
+
+	void openMbtilesShards(unsigned int shardCount);
+	MBTiles &mbtilesForTile(uint zoom, TileCoordinate x, TileCoordinate y);
+	void mergeMbtilesShards();
 };
 
 #endif //_SHARED_DATA_H
@@ -3,8 +3,19 @@
 #define _SHP_MEM_TILES
 
 #include "tile_data.h"
+#include "geometry_cache.h"
+#include <unordered_map>
+#include <mutex>
 
 extern bool verbose;
+class SourceCache;
+
+// Zoom of the grid that indexed polygon layers are split into for spatial queries
+#define SHP_GRID_ZOOM 8
+// Converted polygons kept for spatial queries. The cache has few shards, so
+// that each can hold a polygon with a million or so points.
+#define SHP_QUERY_CACHE_BYTES (256 * 1024 * 1024)
+#define SHP_QUERY_CACHE_THREADS 1
 
 class ShpMemTiles : public TileDataSource
 {
@@ -13,7 +24,7 @@ public:
 
 	void CreateNamedLayerIndex(const std::string& layerName);
 
-	// Used in shape file loading
+	// Used in shape file loading (from any number of threads)
 	void StoreShapefileGeometry(
 		uint_least8_t layerNum,
 		const std::string& layerName, 
@@ -26,15 +37,33 @@ public:
 		AttributeIndex attrIdx
 	);
 
+	// Also save what's stored for this layer to a cache (nullptr to stop);
+	// only call this while no shapefiles are being read
+	void SetLayerCache(uint layerNum, SourceCache *cache);
+
+	/// \brief Split indexed polygon layers into grid cells; call once all shapefiles are loaded
+	void BuildGridIndices(unsigned int threadNum);
+
+	// If the query's box is inside one grid cell, only that cell's pieces are
+	// checked, with pieceQuery; otherwise the index is queried and checkQuery
+	// is run on whole geometries. pieceQuery is told if the piece covers the
+	// whole cell (so covers the query's geometry too).
 	std::vector<uint> QueryMatchingGeometries(
 		const std::string& layerName,
 		bool once,
 		Box& box, 
 		std::function<std::vector<IndexValue>(const RTree& rtree)> indexQuery, 
-		std::function<bool(const OutputObject& oo)> checkQuery
+		std::function<bool(const OutputObject& oo)> checkQuery,
+		std::function<bool(const MultiPolygon& piece, bool coversCell)> pieceQuery
 	) const;
 	std::vector<std::string> namesOfGeometries(const std::vector<uint>& ids) const;
 
+	// An indexed polygon as Points, for spatial queries. Stored geometries are
+	// converted each time they're retrieved, and the same big polygons (a
+	// country's landcover, say) are tested against object after object, so the
+	// converted polygons are cached.
+	std::shared_ptr<const MultiPolygon> queryMultiPolygon(NodeID objectID) const;
+
 	template <typename GeometryT>
 	double AreaIntersecting(const std::string& layerName, GeometryT& g) const {
 		auto f = indices.find(layerName);
@@ -51,7 +80,7 @@ public:
 		for (const auto &it : results) {
 			OutputObject oo = indexedGeometries.at(it.second);
 			if (oo.geomType!=POLYGON_) continue;
-			geom::union_(mp, retrieveMultiPolygon(oo.objectID), tmp);
+			geom::union_(mp, *queryMultiPolygon(oo.objectID), tmp);
 			geom::assign(mp, tmp);
 		}
 		geom::correct(mp);
@@ -59,9 +88,22 @@ public:
 	}
 
 private:
+	/// The part of an indexed polygon inside one grid cell
+	struct GridPiece {
+		uint id;
+		bool coversCell;
+		Box box;
+		MultiPolygon piece;
+	};
+	using Grid = std::unordered_map<uint64_t, std::vector<GridPiece>>;
+	std::map<std::string, Grid> grids;				// only for layers that are all polygons
+
 	std::vector<OutputObject> indexedGeometries;				// prepared boost::geometry objects (from shapefiles)
 	std::map<uint, std::string> indexedGeometryNames;			//  | optional names for each one
 	std::map<std::string, RTree> indices;			// Spatial indices, boost::geometry::index objects for shapefile indices
+	std::mutex indexMutex;						// held while adding to the three above
+	std::vector<SourceCache*> layerCaches;		// by layer number, see SetLayerCache
+	mutable GeometryCache<MultiPolygon> queryCache;	// see queryMultiPolygon
 };
 
 #endif //_OSM_MEM_TILES
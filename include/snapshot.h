@@ -0,0 +1,190 @@
+/*! \file */
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include <boost/utility/string_view.hpp>
+#include "geom.h"
+
+namespace boost { namespace interprocess { class mapped_region; } }
+
+class TileDataSource;
+struct AttributeStore;
+class LayerDefinition;
+class Config;
+typedef std::vector<class TileDataSource *> SourceList;
+
+// Arrays in a snapshot start on a multiple of this many bytes
+#define SNAPSHOT_ALIGNMENT 8
+
+///\brief A checksum of a snapshot's contents, the same however they're split into calls to add()
+class SnapshotChecksum {
+public:
+	void add(const void *data, size_t length) {
+		const char *bytes = static_cast<const char*>(data);
+		// Finish a word left over from the last call, then go a word at a time
+		while (length > 0 && pendingBytes > 0) { addByte(*bytes++); length--; }
+		for (; length >= 8; bytes += 8, length -= 8) {
+			uint64_t word;
+			memcpy(&word, bytes, 8);
+			addWord(word);
+		}
+		while (length > 0) { addByte(*bytes++); length--; }
+	}
+	uint64_t value() const {
+		uint64_t h = hash;
+		if (pendingBytes > 0) h = (h ^ pending ^ pendingBytes) * 0x100000001b3ull;
+		return h ^ (h >> 29);
+	}
+
+private:
+	uint64_t hash = 14695981039346656037ull;
+	uint64_t pending = 0;
+	unsigned pendingBytes = 0;
+
+	void addWord(uint64_t word) { hash = (hash ^ word) * 0x9E3779B97F4A7C15ull; hash ^= hash >> 32; }
+	void addByte(char byte) {
+		pending |= uint64_t(static_cast<uint8_t>(byte)) << (8 * pendingBytes);
+		if (++pendingBytes == 8) { addWord(pending); pending = 0; pendingBytes = 0; }
+	}
+};
+
+///\brief Writes the sections of a snapshot, one after another, after a header that's filled in last
+class SnapshotWriter {
+public:
+	SnapshotWriter(const std::string &filename, size_t headerLength):
+		out(filename, std::ios::out | std::ios::trunc | std::ios::binary),
+		offset(0) {
+		const std::vector<char> header(headerLength, 0);
+		out.write(header.data(), header.size());
+		offset = headerLength;
+	}
+	bool good() const { return static_cast<bool>(out); }
+	uint64_t size() const { return offset; }
+
+	// Checksum of everything after the header
+	uint64_t checksum() const { return contents.value(); }
+
+	template<typename T> void put(T value) { write(&value, sizeof(value)); }
+	void putString(boost::string_view str) { put<uint32_t>(str.size()); write(str.data(), str.size()); }
+	// A block of fixed-size values, aligned so it can be used in place once mapped
+	void putArray(const void *data, size_t length) {
+		const char padding[SNAPSHOT_ALIGNMENT] = {0};
+		const size_t pad = (SNAPSHOT_ALIGNMENT - offset % SNAPSHOT_ALIGNMENT) % SNAPSHOT_ALIGNMENT;
+		write(padding, pad);
+		if (length > 0) write(data, length);
+	}
+	template<typename RingT> void putPoints(const RingT &ring) {
+		put<uint64_t>(ring.size());
+		putArray(ring.size() ? &*ring.begin() : nullptr, ring.size() * sizeof(typename RingT::value_type));
+	}
+
+	// Fill in the header, so the file can be used
+	bool finish(const void *header, size_t length) {
+		out.seekp(0);
+		out.write(static_cast<const char*>(header), length);
+		out.close();
+		return static_cast<bool>(out);
+	}
+
+private:
+	std::ofstream out;
+	uint64_t offset;
+	SnapshotChecksum contents;
+
+	void write(const void *data, size_t length) {
+		out.write(static_cast<const char*>(data), length);
+		contents.add(data, length);
+		offset += length;
+	}
+};
+
+///\brief Reads back a mapped snapshot, checking against its end
+class SnapshotReader {
+public:
+	SnapshotReader(const char *base, const char *ptr, const char *end): base(base), ptr(ptr), end(end) { }
+
+	template<typename T> T get() {
+		if (size_t(end - ptr) < sizeof(T)) throw std::runtime_error("snapshot is truncated");
+		T value;
+		memcpy(&value, ptr, sizeof(T));
+		ptr += sizeof(T);
+		return value;
+	}
+	std::string getString() {
+		uint32_t length = get<uint32_t>();
+		if (size_t(end - ptr) < length) throw std::runtime_error("snapshot is truncated");
+		std::string str(ptr, length);
+		ptr += length;
+		return str;
+	}
+	// Points into the mapping, which lasts as long as the Snapshot
+	const void* getArray(size_t length) {
+		const size_t pad = (SNAPSHOT_ALIGNMENT - (ptr - base) % SNAPSHOT_ALIGNMENT) % SNAPSHOT_ALIGNMENT;
+		if (size_t(end - ptr) < pad || size_t(end - ptr) - pad < length) throw std::runtime_error("snapshot is truncated");
+		ptr += pad;
+		const void *data = ptr;
+		ptr += length;
+		return data;
+	}
+	template<typename RingT> void getPoints(RingT &ring) {
+		using PointT = typename RingT::value_type;
+		const uint64_t count = get<uint64_t>();
+		if (count > size_t(end - ptr) / sizeof(PointT)) throw std::runtime_error("snapshot is truncated");
+		const PointT *points = static_cast<const PointT*>(getArray(count * sizeof(PointT)));
+		ring.assign(points, points + count);
+	}
+
+private:
+	const char *base, *ptr, *end;
+};
+
+/** \brief Saved copy of everything tiles are written from, once the input has been read
+*
+* Reading a planet takes much longer than writing its tiles, and changing
+* tile settings (simplification, zoom ranges, feature limits) doesn't need it
+* read again. A snapshot holds the sources' output objects, their large-object
+* indexes and generated geometries, and the attribute store, written after
+* they're finalized. The node and way stores that ways are built from are
+* saved alongside it, as with --reuse-store.
+*
+* Output objects are used straight from a read-only memory mapping, like
+* objects spilled with --memory-limit; the rest is copied in. Each file
+* records a signature of the input, the Lua profile and the modules it
+* requires, the base zoom and the bounding box, and can't be used if any of
+* them have changed. It also records the layout of the structures it holds
+* (their sizes, and the byte order), as they're used in place, and a
+* checksum of its contents, so a damaged file is found before any of it is
+* loaded.
+*/
+class Snapshot {
+public:
+	~Snapshot();
+
+	// Fingerprint of everything the snapshot's contents depend on
+	static uint64_t signature(const std::vector<std::string> &inputFiles, const std::vector<std::string> &luaFiles,
+	                          const Config &config, const Box &clippingBox, bool compressNodes, bool compressWays);
+
+	static bool save(const std::string &filename, uint64_t signature, const SourceList &sources,
+	                 const AttributeStore &attributeStore, const LayerDefinition &layers);
+	// Map a snapshot, if it's whole and undamaged, made by a build like this
+	// one, and has this signature; returns nullptr if not, before anything is
+	// loaded from it
+	static std::unique_ptr<Snapshot> open(const std::string &filename, uint64_t signature);
+	// Replaces the sources' and attribute store's contents; returns false if
+	// the layers don't match. Keep the Snapshot until the tiles are written.
+	bool load(const SourceList &sources, AttributeStore &attributeStore, LayerDefinition &layers);
+
+private:
+	Snapshot();
+	std::string filename;
+	std::unique_ptr<boost::interprocess::mapped_region> region;
+};
+
+#endif //_SNAPSHOT_H
@@ -3,9 +3,11 @@
 
 #include "node_store.h"
 #include "mmap_allocator.h"
+#include "store_file.h"
 #include <map>
 #include <memory>
 #include <mutex>
+#include <atomic>
 
 // SortedNodeStore requires the Sort.Type_then_ID property on the source PBF.
 //
@@ -62,6 +64,8 @@ public:
 	void reopen() override;
 	void finalize(size_t threadNum) override;
 	LatpLon at(NodeID i) const override;
+	// Decodes each chunk the nodes are in once, prefetching the next
+	void atBatch(const NodeID* ids, size_t count, LatpLon* out) const override;
 	size_t size() const override;
 	void batchStart() override;
 	void insert(const std::vector<element_t>& elements) override;
@@ -69,6 +73,15 @@ public:
 		reopen();
 	}
 
+	// How often lookups in compressed chunks found the chunk already decoded.
+	// Hits are only counted up to each thread's last miss.
+	uint64_t chunkCacheHits() const;
+	uint64_t chunkCacheMisses() const;
+
+	// Persist the finalized store, or replace the contents with a saved copy
+	bool save(const std::string &filename, uint64_t signature) const;
+	bool load(const std::string &filename, uint64_t signature);
+
 private: 
 	// When true, store chunks compressed. Only store compressed if the
 	// chunk is sufficiently large.
@@ -76,14 +89,25 @@ private:
 
 	mutable std::mutex orphanageMutex;
 	std::vector<SortedNodeStoreTypes::GroupInfo*> groups;
+	std::vector<size_t> groupSizes;
 	std::vector<std::pair<void*, size_t>> allocatedMemory;
+	std::unique_ptr<StoreFile> storeFile;		// if loaded, groups point into this
 
 	// The orphanage stores nodes that come from groups that may be worked on by
 	// multiple threads. They'll get folded into the index during finalize()
 	std::map<NodeID, std::vector<element_t>> orphanage;
 	std::vector<std::vector<element_t>> workerBuffers;
+	// Changed whenever workerBuffers is emptied, so threads don't keep using a stale buffer
+	std::atomic<uint64_t> workerBuffersGeneration;
+	// Changed when the contents are replaced, so threads drop the chunks they decoded.
+	// Not atomic: it's only changed while no thread is looking nodes up, and
+	// it's read on every lookup.
+	uint64_t storeGeneration;
 	void collectOrphans(const std::vector<element_t>& orphans);
 	void publishGroup(const std::vector<element_t>& nodes);
+
+	const SortedNodeStoreTypes::ChunkInfoBase* findChunk(NodeID id) const;
+	LatpLon nodeInChunk(const SortedNodeStoreTypes::ChunkInfoBase* chunk, NodeID id) const;
 };
 
 #endif
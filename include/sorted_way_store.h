@@ -4,8 +4,10 @@
 #include <map>
 #include <memory>
 #include <mutex>
+#include <atomic>
 #include "way_store.h"
 #include "mmap_allocator.h"
+#include "store_file.h"
 
 class NodeStore;
 
@@ -26,6 +28,9 @@ class NodeStore;
 //
 // That is, 50% of the time, ways have 8 or fewer nodes. 90% of the time,
 // they have 32 or fewer nodes.
+//
+// For .pbfs with locations on ways, the store can instead keep each way's
+// coordinates, so the node store only needs the tagged nodes.
 
 namespace SortedWayStoreTypes {
 
@@ -38,6 +43,7 @@ namespace SortedWayStoreTypes {
 		//
 		// 1xxxx: This way is stored zigzag encoded.
 		// z1zzz: This is a closed way, repeat the first node as the last node.
+		// zzz1z: This way is stored as coordinates, not node IDs.
 		//
 		// When it's compressed, we still handle high bits the same,
 		// but the low bytes are compressed.
@@ -50,6 +56,12 @@ namespace SortedWayStoreTypes {
 		// (if compression bit) 2 bytes: compressed length
 		// (if compression bit) 4 bytes: first 32-bit value
 		// N 32-bit ints: the N low ints
+		//
+		// Or, for coordinates:
+		// (if compression bit) 4 bytes each: first latp and lon
+		// (if compression bit) 2 bytes: compressed length of the latps
+		// (if compression bit) the N-1 latps, then the N-1 lons, as zigzag deltas
+		// (otherwise) N LatpLons
 		uint8_t data[0];
 	};
 
@@ -83,16 +95,23 @@ class SortedWayStore: public WayStore {
 
 public:
 	SortedWayStore(bool compressWays, const NodeStore& nodeStore);
+	// Store coordinates rather than node IDs, with insertLatpLons
+	SortedWayStore(bool compressWays);
 	~SortedWayStore();
 	void reopen() override;
 	void batchStart() override;
 	std::vector<LatpLon> at(WayID wayid) const override;
-	bool requiresNodes() const override { return true; }
+	void at(WayID wayid, std::vector<LatpLon> &out) const override;
+	bool requiresNodes() const override { return nodeStore != nullptr; }
 	void insertLatpLons(std::vector<WayStore::ll_element_t> &newWays) override;
 	const void insertNodes(const std::vector<std::pair<WayID, std::vector<NodeID>>>& newWays) override;
 	void clear() override;
 	std::size_t size() const override;
 	void finalize(unsigned int threadNum) override;
+
+	// Persist the finalized store, or replace the contents with a saved copy
+	bool save(const std::string &filename, uint64_t signature) const;
+	bool load(const std::string &filename, uint64_t signature);
 	
 	static uint16_t encodeWay(
 		const std::vector<NodeID>& way,
@@ -101,18 +120,37 @@ public:
 	);
 
 	static std::vector<NodeID> decodeWay(uint16_t flags, const uint8_t* input);
+	static void decodeWay(uint16_t flags, const uint8_t* input, std::vector<NodeID>& out);
+
+	static uint16_t encodeLatpLons(
+		const std::vector<LatpLon>& way,
+		std::vector<uint8_t>& output,
+		bool compress
+	);
+
+	static std::vector<LatpLon> decodeLatpLons(uint16_t flags, const uint8_t* input);
+	static void decodeLatpLons(uint16_t flags, const uint8_t* input, std::vector<LatpLon>& out);
 
 private:
 	bool compressWays;
-	const NodeStore& nodeStore;
+	const NodeStore* nodeStore;		// nullptr if we store coordinates
 	mutable std::mutex orphanageMutex;
 	std::vector<SortedWayStoreTypes::GroupInfo*> groups;
+	std::vector<size_t> groupSizes;
 	std::vector<std::pair<void*, size_t>> allocatedMemory;
+	std::unique_ptr<StoreFile> storeFile;		// if loaded, groups point into this
 
 	// The orphanage stores nodes that come from groups that may be worked on by
 	// multiple threads. They'll get folded into the index during finalize()
+	//
+	// When storing coordinates, each LatpLon is packed into a NodeID until the
+	// way is encoded.
 	std::map<WayID, std::vector<std::pair<WayID, std::vector<NodeID>>>> orphanage;
 	std::vector<std::vector<std::pair<WayID, std::vector<NodeID>>>> workerBuffers;
+	// Changed whenever workerBuffers is emptied, so threads don't keep using a stale buffer
+	std::atomic<uint64_t> workerBuffersGeneration;
+	const SortedWayStoreTypes::EncodedWay* findWay(WayID id) const;
+	void insertWays(const std::vector<std::pair<WayID, std::vector<NodeID>>>& newWays);
 	void collectOrphans(const std::vector<std::pair<WayID, std::vector<NodeID>>>& orphans);
 	void publishGroup(const std::vector<std::pair<WayID, std::vector<NodeID>>>& ways);
 };
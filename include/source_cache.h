@@ -0,0 +1,58 @@
+/*! \file */
+#ifndef _SOURCE_CACHE_H
+#define _SOURCE_CACHE_H
+
+#include <string>
+#include <fstream>
+#include <mutex>
+#include <cstdint>
+#include "geom.h"
+#include "output_object.h"
+
+struct LayerDef;
+struct AttributeStore;
+class ShpMemTiles;
+
+/** \brief Saved copy of the features read from an external layer source
+*
+* Reading a large shapefile means decoding every record, calling
+* attribute_function, and correcting and clipping every polygon, for data
+* that rarely changes. The cache holds the result, as it was handed to
+* ShpMemTiles: geometries, names, minzooms and attributes. Loading it only
+* means adding those again (in parallel, from a read-only memory mapping).
+*
+* Each file records a signature of the source, the layer's config, the
+* bounding box and (if it has an attribute_function) the Lua profile and its
+* modules, and
+* is ignored if any of them have changed.
+*/
+class SourceCache {
+public:
+	SourceCache(const std::string &filename, uint64_t signature, AttributeStore &attributeStore);
+
+	// Fingerprint of everything a layer's features depend on; luaFiles (the
+	// profile and the modules it requires) is empty if the profile doesn't
+	// remap source attributes
+	static uint64_t signature(const LayerDef &layer, const Box &clippingBox, uint baseZoom, const std::vector<std::string> &luaFiles);
+
+	// Add the cached features to shpMemTiles; false if there's no usable cache
+	bool load(uint layerNum, LayerDef &layer, ShpMemTiles &shpMemTiles, unsigned int threadNum);
+
+	// Save features as the source is read: startSaving, then record each one
+	// (from any number of threads), then finishSaving
+	bool startSaving();
+	void record(OutputGeometryType geomType, const Geometry &geometry, bool hasName, const std::string &name,
+	            uint minzoom, AttributeIndex attrIdx);
+	void finishSaving(const LayerDef &layer);
+
+private:
+	std::string filename;
+	uint64_t sig;
+	AttributeStore &attributeStore;
+
+	std::ofstream out;
+	std::mutex outMutex;
+	uint64_t featureCount;
+};
+
+#endif //_SOURCE_CACHE_H
@@ -0,0 +1,44 @@
+/*! \file */
+#ifndef _SPILL_FILE_H
+#define _SPILL_FILE_H
+
+#include <string>
+#include <memory>
+#include <cstdio>
+#include <cstdint>
+
+namespace boost { namespace interprocess { class mapped_region; } }
+
+/** \brief Scratch file for data that doesn't fit in the memory limit
+*
+* Data is appended, then the file is memory-mapped read-only, so the OS only
+* keeps the parts in use resident. It's appended to again after mapping (the
+* mapping must then be renewed with map() to see the new data), and deleted
+* when this is destroyed.
+*/
+class SpillFile {
+public:
+	// Creates a uniquely named file in this directory
+	SpillFile(const std::string &dir);
+	~SpillFile();
+
+	// Write data at the end of the file, starting at a multiple of align,
+	// and return its offset
+	uint64_t append(const void *data, size_t length, size_t align = 1);
+	uint64_t size() const { return length; }
+
+	// Map everything written so far (replacing any earlier mapping)
+	void map();
+	const char* data() const { return base; }
+	// We won't read this part of the mapping again, so drop it from memory
+	void release(uint64_t offset, uint64_t length);
+
+private:
+	std::string filename;
+	FILE *file;
+	uint64_t length;
+	std::unique_ptr<boost::interprocess::mapped_region> region;
+	const char *base;
+};
+
+#endif //_SPILL_FILE_H
@@ -0,0 +1,51 @@
+/*! \file */
+#ifndef _STORE_FILE_H
+#define _STORE_FILE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+namespace boost { namespace interprocess { class mapped_region; } }
+
+#define STORE_FILE_NODES 1
+#define STORE_FILE_WAYS 2
+
+///\brief One serialized group from a SortedNodeStore or SortedWayStore
+struct StoreFileGroup {
+	uint64_t index;
+	const void *data;
+	uint64_t length;
+};
+
+/** \brief Saved copy of the finalized groups in a sorted node or way store
+*
+* Groups only contain offsets relative to their own start, so they can be
+* written out as-is and used straight from a read-only memory mapping on a
+* later run. Each file records a signature of the .pbf it was built from, and
+* is ignored if the input has changed.
+*/
+class StoreFile {
+public:
+	uint64_t slotCount;						// size of the store's group index
+	uint64_t itemCount;						// number of nodes or ways
+	std::vector<StoreFileGroup> groups;		// pointing into the mapped file
+
+	~StoreFile();
+
+	static bool save(const std::string &filename, uint32_t kind, uint64_t signature,
+	                 uint64_t slotCount, uint64_t itemCount, const std::vector<StoreFileGroup> &groups);
+	// Returns nullptr if the file doesn't exist, or wasn't built from the same input
+	static std::unique_ptr<StoreFile> load(const std::string &filename, uint32_t kind, uint64_t signature);
+
+	// Cheap fingerprint of an input file: its size, modification time, and the
+	// first and last 16MB
+	static uint64_t signature(const std::string &filename);
+
+private:
+	StoreFile();
+	std::unique_ptr<boost::interprocess::mapped_region> region;
+};
+
+#endif //_STORE_FILE_H
@@ -0,0 +1,128 @@
+/*! \file */
+#ifndef _TAG_MAP_H
+#define _TAG_MAP_H
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/utility/string_view.hpp>
+#include "pbf_decoder.h"
+
+/** \brief The tags of the object being read, as positions in its block's string table
+*
+* Nothing is copied, so a TagMap is only valid while its block is. A lookup
+* finds the key's position through the block's string index, then compares
+* integers; a key that isn't anywhere in the block (the usual answer to a
+* Lua profile's questions) is rejected without looking at the tags at all.
+*/
+class TagMap {
+public:
+	// Start on a new object from this block
+	void reset(const PbfPrimitiveBlock &pb) {
+		block = &pb;
+		tags.clear();
+	}
+
+	// A key given twice keeps its last value, as it did when tags were read into a map
+	void add(uint64_t key, uint64_t value) {
+		if (key >= block->strings.size() || value >= block->strings.size())
+			throw std::out_of_range("Tag refers past the end of the string table");
+		for (auto &tag : tags) {
+			if (tag.first == key) { tag.second = value; return; }
+		}
+		tags.emplace_back(key, value);
+	}
+
+	// Find the value for a key; false if the object doesn't have it
+	bool find(boost::string_view key, boost::string_view &value) const {
+		if (tags.empty()) return false;
+		int position = block->findString(key);
+		if (position < 0) return false;
+		for (const auto &tag : tags) {
+			if (tag.first == uint32_t(position)) { value = block->strings[tag.second]; return true; }
+		}
+		return false;
+	}
+	bool contains(boost::string_view key) const {
+		boost::string_view value;
+		return find(key, value);
+	}
+
+	size_t size() const { return tags.size(); }
+	bool empty() const { return tags.empty(); }
+	boost::string_view key(size_t i) const { return block->strings[tags[i].first]; }
+	boost::string_view value(size_t i) const { return block->strings[tags[i].second]; }
+
+private:
+	const PbfPrimitiveBlock *block = nullptr;
+	std::vector<std::pair<uint32_t, uint32_t>> tags;
+};
+
+/** \brief Tags a Lua profile has said it's interested in, checked before an object reaches Lua
+*
+* Each entry is either a key ("building"), matching any value, or a key and
+* value ("highway=primary"); several entries for one key match any of their
+* values. An empty filter matches everything. prepare() resolves the entries
+* against a block's string table, so matches() compares integers against the
+* object's raw key/value arrays without building a TagMap.
+*/
+class TagFilter {
+public:
+	/// The filter's keys and values, as positions in one block's string table
+	struct Prepared {
+		bool all = true;
+		std::vector<uint8_t> keyState;		// per string: NoKey, AnyValue or SomeValues
+		std::vector<uint64_t> keyValues;	// (key << 32 | value) for SomeValues keys, sorted
+	};
+
+	TagFilter() { }
+	TagFilter(const std::vector<std::string> &entries) {
+		for (const auto &entry : entries) {
+			size_t eq = entry.find('=');
+			if (eq == std::string::npos) keys.push_back(entry);
+			else values.emplace_back(entry.substr(0, eq), entry.substr(eq + 1));
+		}
+	}
+
+	bool empty() const { return keys.empty() && values.empty(); }
+
+	void prepare(const PbfPrimitiveBlock &pb, Prepared &prepared) const {
+		prepared.all = empty();
+		if (prepared.all) return;
+		prepared.keyState.assign(pb.strings.size(), NoKey);
+		prepared.keyValues.clear();
+		for (const auto &key : keys) {
+			int k = pb.findString(key);
+			if (k >= 0) prepared.keyState[k] = AnyValue;
+		}
+		for (const auto &kv : values) {
+			int k = pb.findString(kv.first), v = pb.findString(kv.second);
+			if (k < 0 || v < 0 || prepared.keyState[k] == AnyValue) continue;
+			prepared.keyState[k] = SomeValues;
+			prepared.keyValues.push_back(uint64_t(k) << 32 | uint32_t(v));
+		}
+		std::sort(prepared.keyValues.begin(), prepared.keyValues.end());
+	}
+
+	static bool matches(const Prepared &prepared, PbfPackedVarints keys, PbfPackedVarints vals) {
+		if (prepared.all) return true;
+		while (!keys.empty() && !vals.empty()) {
+			uint64_t key = keys.next(), value = vals.next();
+			if (key >= prepared.keyState.size()) continue;
+			uint8_t state = prepared.keyState[key];
+			if (state == AnyValue) return true;
+			if (state == SomeValues &&
+			    std::binary_search(prepared.keyValues.begin(), prepared.keyValues.end(), key << 32 | value)) return true;
+		}
+		return false;
+	}
+
+private:
+	enum : uint8_t { NoKey = 0, AnyValue = 1, SomeValues = 2 };
+	std::vector<std::string> keys;
+	std::vector<std::pair<std::string, std::string>> values;
+};
+
+#endif //_TAG_MAP_H
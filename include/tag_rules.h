@@ -0,0 +1,63 @@
+/*! \file */
+#ifndef _TAG_RULES_H
+#define _TAG_RULES_H
+
+#include <string>
+#include <vector>
+#include "rapidjson/document.h"
+#include "tag_map.h"
+
+class LayerDefinition;
+
+/** \brief One declarative rule from the config's "rules" list: matching tags put an object in a layer
+*
+* All the rule's conditions must hold; each condition is a key with either any
+* value or one of a list of values. Attributes are copied from tags (possibly
+* under another name) or set to a constant.
+*/
+struct TagRule {
+	enum class Geometry { Point, Line, Area, Centroid };
+	enum class AttributeType { String, Number, Boolean };
+
+	struct Condition {
+		std::string key;
+		std::vector<std::string> values;	// empty for any value
+	};
+	struct Attribute {
+		std::string key;
+		std::string tag;		// copy from this tag...
+		std::string value;		// ...or, if tag is empty, use this
+		AttributeType type;
+		char minzoom;
+	};
+
+	std::vector<Condition> conditions;
+	Geometry geometry;
+	std::string layer;
+	double minzoom = -1;		// -1 to keep the layer's
+	std::vector<Attribute> attributes;
+	bool fallthrough = false;	// call the Lua function too
+
+	bool matches(const TagMap &tags) const;
+};
+
+/** \brief The config's rules, evaluated in C++ before (or instead of) the Lua profile
+*
+* An object that any rule matches isn't passed to Lua, unless one of the
+* matching rules sets "fallthrough". Rules only cover nodes, ways and
+* multipolygons; other relations are left to relation_function.
+*/
+class TagRules {
+public:
+	std::vector<TagRule> rules;
+
+	// Exits with an error if the rules are malformed or name a missing layer
+	void read(const rapidjson::Value &json, const LayerDefinition &layers);
+	bool empty() const { return rules.empty(); }
+
+	// Tags that let nodes (or ways and multipolygons) through node_keys/way_keys
+	// to reach these rules, as "key" or "key=value"
+	std::vector<std::string> filterEntries(bool nodes) const;
+};
+
+#endif //_TAG_RULES_H
@@ -2,29 +2,50 @@
 #ifndef _TILE_DATA_H
 #define _TILE_DATA_H
 
+#include <algorithm>
+#include <atomic>
 #include <map>
+#include <mutex>
 #include <set>
+#include <stdexcept>
+#include <string>
 #include <vector>
 #include <memory>
+#include <unordered_map>
 #include <boost/sort/sort.hpp>
 #include "output_object.h"
+#include "packed_objects.h"
 #include "clip_cache.h"
+#include "spill_file.h"
+#include "tile_occupancy.h"
+#include <boost/geometry/geometries/register/point.hpp>
+
+// Generated geometries are stored in LatpLon's fixed point, at half the size of a Point
+BOOST_GEOMETRY_REGISTER_POINT_2D(LatpLon, int32_t, boost::geometry::cs::cartesian, lon, latp)
 
 typedef std::vector<class TileDataSource *> SourceList;
 
+// Large objects are clipped from simplified copies below this zoom: level i
+// of the pyramid is used from PYRAMID_ZOOMS[i] up to the next level's zoom
+#define PYRAMID_MAX_ZOOM 6
+#define PYRAMID_LEVELS 2
+#define PYRAMID_ZOOMS { 0, 3 }
+// Geometries with fewer points than this are cheap enough to clip in full
+#define PYRAMID_MIN_POINTS 256
+// Objects with at least this many points in all are simplified whole, once
+// per zoom, for the tiles they're in to share
+#define SHARED_SIMPLIFY_MIN_POINTS 256
+#define SHARED_SIMPLIFY_SHARDS 64
+
 class TileBbox;
+class SnapshotWriter;
+class SnapshotReader;
 
 // We cluster output objects by z6 tile
 #define CLUSTER_ZOOM 6
 #define CLUSTER_ZOOM_WIDTH (1 << CLUSTER_ZOOM)
 #define CLUSTER_ZOOM_AREA (CLUSTER_ZOOM_WIDTH * CLUSTER_ZOOM_WIDTH)
 
-struct OutputObjectXY {
-	OutputObject oo;
-	Z6Offset x;
-	Z6Offset y;
-};
-
 class TileCoordinatesSet {
 public:
 	TileCoordinatesSet(uint zoom);
@@ -37,120 +58,168 @@ private:
 	std::vector<bool> tiles;
 };
 
-struct OutputObjectXYID {
-	OutputObject oo;
-	Z6Offset x;
-	Z6Offset y;
-	uint64_t id;
-};
+// Objects are kept in buckets by the zoom they're written from, so that low
+// zoom tiles skip the many objects, such as buildings, that only appear at high
+// zooms. Bucket b holds minZooms from MINZOOM_BUCKET_STARTS[b] to the next start.
+#define MINZOOM_BUCKETS 4
+#define MINZOOM_BUCKET_STARTS { 0, 6, 10, 13 }
 
-template<typename OO> void finalizeObjects(
-	const size_t& threadNum,
-	const unsigned int& baseZoom,
-	typename std::vector<std::vector<OO>>::iterator begin,
-	typename std::vector<std::vector<OO>>::iterator end
-	) {
-	for (typename std::vector<std::vector<OO>>::iterator it = begin; it != end; it++) {
-		if (it->size() == 0)
-			continue;
+inline unsigned int minZoomBucketStart(unsigned int bucket) {
+	static const unsigned int starts[MINZOOM_BUCKETS] = MINZOOM_BUCKET_STARTS;
+	return starts[bucket];
+}
 
-		it->shrink_to_fit();
-
-		// If the user is doing a a small extract, there are few populated
-		// entries in `object`.
-		//
-		// e.g. Colorado has ~9 z6 tiles, 1 of which has 95% of its output
-		// objects.
-		//
-		// This optimizes for the small extract case by doing:
-		// - for each vector in objects
-		//   - do a multi-threaded sort of vector
-		//
-		// For small extracts, this ensures that all threads are used even if
-		// only a handful of entries in `objects` are non-empty.
-		//
-		// For a global extract, this will have some overhead of repeatedly
-		// setting up/tearing down threads. In that case, it would be 
-		// better to assign chunks of `objects` to each thread.
-		//
-		// That's a future performance improvement, so deferring for now.
-		boost::sort::block_indirect_sort(
-			it->begin(),
-			it->end(), 
-			[baseZoom](const OO& a, const OO& b) {
-				// Cluster by parent zoom, so that a subsequent search
-				// can find a contiguous range of entries for any tile
-				// at zoom 6 or higher.
-				const size_t aX = a.x;
-				const size_t aY = a.y;
-				const size_t bX = b.x;
-				const size_t bY = b.y;
-				for (size_t z = CLUSTER_ZOOM; z <= baseZoom; z++) {
-					const auto aXz = aX / (1 << (baseZoom - z));
-					const auto bXz = bX / (1 << (baseZoom - z));
-					if (aXz != bXz)
-						return aXz < bXz;
-
-					const auto aYz = aY / (1 << (baseZoom - z));
-					const auto bYz = bY / (1 << (baseZoom - z));
-
-					if (aYz != bYz)
-						return aYz < bYz;
-				}
+inline unsigned int minZoomBucket(unsigned int minZoom) {
+	unsigned int bucket = 0;
+	while (bucket + 1 < MINZOOM_BUCKETS && minZoomBucketStart(bucket + 1) <= minZoom)
+		bucket++;
+	return bucket;
+}
 
-				return false;
-			},
-			threadNum
-		);
+// Position of an object within its z6 tile, as its x/y offset at the base zoom
+// with the bits interleaved (x above y). Sorting on this key orders objects
+// first by z7 tile, then by z8 tile within that, and so on, so every tile at
+// zoom 6 or higher covers one contiguous run of keys.
+typedef uint32_t Z6OffsetKey;
 
-	}
+inline Z6OffsetKey z6OffsetKey(Z6Offset x, Z6Offset y) {
+	return interleaveBits(x, y);
 }
 
-template<typename OO> void collectTilesWithObjectsAtZoomTemplate(
-	const unsigned int& baseZoom,
-	const typename std::vector<std::vector<OO>>::iterator objects,
-	const size_t size,
-	const unsigned int zoom,
-	TileCoordinatesSet& output
-) {
-	uint16_t z6OffsetDivisor = baseZoom >= CLUSTER_ZOOM ? (1 << (baseZoom - CLUSTER_ZOOM)) : 1;
-	int64_t lastX = -1;
-	int64_t lastY = -1;
-	for (size_t i = 0; i < size; i++) {
-		const size_t z6x = i / CLUSTER_ZOOM_WIDTH;
-		const size_t z6y = i % CLUSTER_ZOOM_WIDTH;
+inline void z6OffsetFromKey(Z6OffsetKey key, Z6Offset &x, Z6Offset &y) {
+	uint32_t x32, y32;
+	deinterleaveBits(key, x32, y32);
+	x = x32;
+	y = y32;
+}
+
+/** \brief The output objects in one z6 tile
+*
+* Positions and objects are kept in parallel arrays, so that searching for a
+* tile only has to touch the (small) keys, and objects are only read once
+* their position is known to match. Once finalized, they're grouped by
+* minZoom bucket and sorted by key within each bucket.
+*
+* With --memory-limit, a finalized tile's arrays may instead be in the
+* source's spill file (see TileDataSource::spill), and are read from there.
+* Otherwise, once finalized, they're packed (see PackedObjects), and the
+* vectors are freed; keyData() and objectData() are then not to be used.
+*/
+template<typename T> struct ClusteredObjects {
+	std::vector<Z6OffsetKey> keys;
+	std::vector<T> objects;
+
+	// Finalized objects in the spill file, if any; these replace the vectors
+	const Z6OffsetKey *mappedKeys = nullptr;
+	const T *mappedObjects = nullptr;
+	size_t mappedCount = 0;
+	uint64_t mappedKeysOffset = 0, mappedObjectsOffset = 0;
+
+	// Finalized objects, packed in memory, if they're not mapped
+	PackedObjects packed;
+
+	// Where each minZoom bucket starts, and (last) where they end; set by findBuckets()
+	size_t bucketStarts[MINZOOM_BUCKETS + 1] = {};
+
+	size_t size() const { return mappedKeys ? mappedCount : !packed.empty() ? packed.size() : keys.size(); }
+	const Z6OffsetKey* keyData() const { return mappedKeys ? mappedKeys : keys.data(); }
+	const T* objectData() const { return mappedKeys ? mappedObjects : objects.data(); }
+
+	void push_back(Z6Offset x, Z6Offset y, const T& object) {
+		keys.push_back(z6OffsetKey(x, y));
+		objects.push_back(object);
+	}
 
-		for (size_t j = 0; j < objects[i].size(); j++) {
-			// Compute the x, y at the base zoom level
-			TileCoordinate baseX = z6x * z6OffsetDivisor + objects[i][j].x;
-			TileCoordinate baseY = z6y * z6OffsetDivisor + objects[i][j].y;
+	void clear() {
+		keys.clear();
+		objects.clear();
+		mappedKeys = nullptr;
+		mappedObjects = nullptr;
+		mappedCount = 0;
+		packed.clear();
+		std::fill(bucketStarts, bucketStarts + MINZOOM_BUCKETS + 1, 0);
+	}
 
-			// Translate the x, y at the requested zoom level
-			TileCoordinate x = baseX / (1 << (baseZoom - zoom));
-			TileCoordinate y = baseY / (1 << (baseZoom - zoom));
+	void shrink_to_fit() {
+		keys.shrink_to_fit();
+		objects.shrink_to_fit();
+	}
 
-			if (lastX != x || lastY != y) {
-				output.set(x, y);
-				lastX = x;
-				lastY = y;
-			}
+	// Find where each bucket starts in the finalized objects
+	void findBuckets();
+
+	// Pack the finalized objects in the vectors, and free the vectors
+	void pack() {
+		if (keys.empty()) return;
+		packed.pack(keys, objects);
+		std::vector<Z6OffsetKey>().swap(keys);
+		std::vector<T>().swap(objects);
+	}
+
+	// Find the objects [first, last) of a bucket in a tile `levels` zooms above
+	// the base zoom, whose top-left corner is at offset x,y within this z6 tile
+	void rangeForTile(Z6Offset x, Z6Offset y, unsigned int levels, unsigned int bucket, size_t &first, size_t &last) const {
+		const uint64_t startKey = z6OffsetKey(x, y);
+		const uint64_t endKey = startKey + (uint64_t(1) << (2 * levels));
+		if (!packed.empty()) {
+			first = packed.lowerBound(bucketStarts[bucket], bucketStarts[bucket + 1], startKey);
+			last = packed.lowerBound(first, bucketStarts[bucket + 1], endKey);
+			return;
 		}
+		const Z6OffsetKey *keys = keyData();
+		const Z6OffsetKey *begin = keys + bucketStarts[bucket], *end = keys + bucketStarts[bucket + 1];
+		first = std::lower_bound(begin, end, startKey) - keys;
+		last = std::lower_bound(keys + first, end, endKey) - keys;
 	}
-}
+};
 
-template<typename OO>
-OutputObjectID outputObjectWithId(const OO& input) {
-	return OutputObjectID({ input.oo, 0 });
-}
+// One z6 tile's objects, sorted and written to a spill file
+struct SpillRun {
+	uint64_t keysOffset, objectsOffset;
+	size_t count;
+};
+
+inline const OutputObject& outputObjectOf(const OutputObject& input) { return input; }
+inline const OutputObject& outputObjectOf(const OutputObjectID& input) { return input.oo; }
 
-template<>
-inline OutputObjectID outputObjectWithId<OutputObjectXYID>(const OutputObjectXYID& input) {
-	return OutputObjectID({ input.oo, input.id });
+inline OutputObjectID outputObjectWithId(const OutputObject& input) { return OutputObjectID({ input, 0 }); }
+inline const OutputObjectID& outputObjectWithId(const OutputObjectID& input) { return input; }
+
+template<typename T> void ClusteredObjects<T>::findBuckets() {
+	const T *begin = objectData(), *end = begin + size();
+	bucketStarts[0] = 0;
+	for (unsigned int bucket = 1; bucket < MINZOOM_BUCKETS; bucket++)
+		bucketStarts[bucket] = std::partition_point(begin + bucketStarts[bucket - 1], end,
+			[bucket](const T& object) { return minZoomBucket(outputObjectOf(object).minZoom) < bucket; }) - begin;
+	bucketStarts[MINZOOM_BUCKETS] = size();
 }
 
-template<typename OO> void collectObjectsForTileTemplate(
+// The order objects are written in within a tile: by layer, z_order (in the
+// layer's sort order), geomType, attributes, then objectID. Attributes come
+// before objectID so that objects with identical attributes are adjacent,
+// and can be merged into one object to reduce the size of output.
+struct OutputObjectOrder {
+	const std::vector<bool>& sortOrders;
+
+	bool ascending(uint layer) const { return layer >= sortOrders.size() || sortOrders[layer]; }
+
+	bool operator()(const OutputObject& x, const OutputObject& y) const {
+		if (x.layer < y.layer) return true;
+		if (x.layer > y.layer) return false;
+		if (x.z_order < y.z_order) return  ascending(x.layer);
+		if (x.z_order > y.z_order) return !ascending(x.layer);
+		if (x.geomType < y.geomType) return true;
+		if (x.geomType > y.geomType) return false;
+		if (x.attributes < y.attributes) return true;
+		if (x.attributes > y.attributes) return false;
+		return x.objectID < y.objectID;
+	}
+	bool operator()(const OutputObjectID& x, const OutputObjectID& y) const { return (*this)(x.oo, y.oo); }
+};
+
+template<typename T> void collectObjectsForTileTemplate(
 	const unsigned int& baseZoom,
-	typename std::vector<std::vector<OO>>::iterator objects,
+	typename std::vector<ClusteredObjects<T>>::iterator objects,
 	size_t iStart,
 	size_t iEnd,
 	unsigned int zoom,
@@ -160,93 +229,48 @@ template<typename OO> void collectObjectsForTileTemplate(
 	uint16_t z6OffsetDivisor = baseZoom >= CLUSTER_ZOOM ? (1 << (baseZoom - CLUSTER_ZOOM)) : 1;
 
 	for (size_t i = iStart; i < iEnd; i++) {
+		const ClusteredObjects<T>& cluster = objects[i];
+		if (cluster.size() == 0)
+			continue;
+
 		const size_t z6x = i / CLUSTER_ZOOM_WIDTH;
 		const size_t z6y = i % CLUSTER_ZOOM_WIDTH;
 
-		if (zoom >= CLUSTER_ZOOM) {
-			// If z >= 6, we can compute the exact bounds within the objects array.
-			// Translate to the base zoom, then do a binary search to find
-			// the starting point.
-			TileCoordinate z6x = dstIndex.x / (1 << (zoom - CLUSTER_ZOOM));
-			TileCoordinate z6y = dstIndex.y / (1 << (zoom - CLUSTER_ZOOM));
-
-			TileCoordinate baseX = dstIndex.x * (1 << (baseZoom - zoom));
-			TileCoordinate baseY = dstIndex.y * (1 << (baseZoom - zoom));
-
-			Z6Offset needleX = baseX - z6x * z6OffsetDivisor;
-			Z6Offset needleY = baseY - z6y * z6OffsetDivisor;
-
-			// Kind of gross that we have to do this. Might be better if we split
-			// into two arrays, one of x/y and one of OOs. Would have better locality for
-			// searching, too.
-			OutputObject dummyOo(POINT_, 0, 0, 0, 0);
-			const size_t bz = baseZoom;
-
-			const OO targetXY = {dummyOo, needleX, needleY };
-			auto iter = std::lower_bound(
-				objects[i].begin(),
-				objects[i].end(),
-				targetXY,
-				[bz](const OO& a, const OO& b) {
-					// Cluster by parent zoom, so that a subsequent search
-					// can find a contiguous range of entries for any tile
-					// at zoom 6 or higher.
-					const size_t aX = a.x;
-					const size_t aY = a.y;
-					const size_t bX = b.x;
-					const size_t bY = b.y;
-					for (size_t z = CLUSTER_ZOOM; z <= bz; z++) {
-						const auto aXz = aX / (1 << (bz - z));
-						const auto aYz = aY / (1 << (bz - z));
-						const auto bXz = bX / (1 << (bz - z));
-						const auto bYz = bY / (1 << (bz - z));
-
-						if (aXz != bXz)
-							return aXz < bXz;
-
-						if (aYz != bYz)
-							return aYz < bYz;
-					}
-					return false;
-				}
-			);
-			for (; iter != objects[i].end(); iter++) {
-				// Compute the x, y at the base zoom level
-				TileCoordinate baseX = z6x * z6OffsetDivisor + iter->x;
-				TileCoordinate baseY = z6y * z6OffsetDivisor + iter->y;
-
-				// Translate the x, y at the requested zoom level
-				TileCoordinate x = baseX / (1 << (baseZoom - zoom));
-				TileCoordinate y = baseY / (1 << (baseZoom - zoom));
-
-				if (dstIndex.x == x && dstIndex.y == y) {
-					if (iter->oo.minZoom <= zoom) {
-						output.push_back(outputObjectWithId(*iter));
-					}
-				} else {
-					// Short-circuit when we're confident we'd no longer see relevant matches.
-					// We've ordered the entries in `objects` such that all objects that
-					// share the same tile at any zoom are in contiguous runs.
-					//
-					// Thus, as soon as we fail to find a match, we can stop looking.
-					break;
-				}
+		if (zoom < CLUSTER_ZOOM) {
+			// Below z6, every object in a z6 tile is in the same tile
+			TileCoordinate x = z6x * z6OffsetDivisor / (1 << (baseZoom - zoom));
+			TileCoordinate y = z6y * z6OffsetDivisor / (1 << (baseZoom - zoom));
+			if (dstIndex.x != x || dstIndex.y != y)
+				continue;
+		}
+
+		// Buckets that start above this zoom have nothing to write
+		const T *clusterObjects = cluster.packed.empty() ? cluster.objectData() : nullptr;
+		for (unsigned int bucket = 0; bucket < MINZOOM_BUCKETS && minZoomBucketStart(bucket) <= zoom; bucket++) {
+			size_t first = cluster.bucketStarts[bucket], last = cluster.bucketStarts[bucket + 1];
+
+			if (zoom >= CLUSTER_ZOOM) {
+				// If z >= 6, we can compute the exact bounds within the objects array.
+				// Translate to the base zoom, then find the run of keys that
+				// starts at the tile's top-left corner.
+				TileCoordinate baseX = dstIndex.x * (1 << (baseZoom - zoom));
+				TileCoordinate baseY = dstIndex.y * (1 << (baseZoom - zoom));
 
+				Z6Offset needleX = baseX - z6x * z6OffsetDivisor;
+				Z6Offset needleY = baseY - z6y * z6OffsetDivisor;
+
+				cluster.rangeForTile(needleX, needleY, baseZoom - zoom, bucket, first, last);
+			}
+
+			if (!clusterObjects) {
+				cluster.packed.forEach(first, last, [&](const OutputObjectID& object) {
+					if (object.oo.minZoom <= zoom) output.push_back(object);
+				});
+				continue;
 			}
-		} else {
-			for (size_t j = 0; j < objects[i].size(); j++) {
-				// Compute the x, y at the base zoom level
-				TileCoordinate baseX = z6x * z6OffsetDivisor + objects[i][j].x;
-				TileCoordinate baseY = z6y * z6OffsetDivisor + objects[i][j].y;
-
-				// Translate the x, y at the requested zoom level
-				TileCoordinate x = baseX / (1 << (baseZoom - zoom));
-				TileCoordinate y = baseY / (1 << (baseZoom - zoom));
-
-				if (dstIndex.x == x && dstIndex.y == y) {
-					if (objects[i][j].oo.minZoom <= zoom) {
-						output.push_back(outputObjectWithId(objects[i][j]));
-					}
+			for (size_t j = first; j < last; j++) {
+				if (outputObjectOf(clusterObjects[j]).minZoom <= zoom) {
+					output.push_back(outputObjectWithId(clusterObjects[j]));
 				}
 			}
 		}
@@ -255,31 +279,49 @@ template<typename OO> void collectObjectsForTileTemplate(
 
 class TileDataSource {
 public:
-	// Store for generated geometries
-	using point_store_t = std::vector<Point>;
+	// Store for generated geometries. Vertices are kept as 1e-7 degrees (points
+	// as their coordinates, which are already scaled), and converted back to
+	// Points when they're retrieved.
+	using point_store_t = std::vector<LatpLon>;
 
-	using linestring_t = boost::geometry::model::linestring<Point, std::vector, mmap_allocator>;
+	using linestring_t = boost::geometry::model::linestring<LatpLon, std::vector, mmap_allocator>;
 	using linestring_store_t = std::vector<linestring_t>;
 
 	using multi_linestring_t = boost::geometry::model::multi_linestring<linestring_t, std::vector, mmap_allocator>;
 	using multi_linestring_store_t = std::vector<multi_linestring_t>;
 
-	using polygon_t = boost::geometry::model::polygon<Point, true, true, std::vector, std::vector, mmap_allocator, mmap_allocator>;
+	using polygon_t = boost::geometry::model::polygon<LatpLon, true, true, std::vector, std::vector, mmap_allocator, mmap_allocator>;
 	using multi_polygon_t = boost::geometry::model::multi_polygon<polygon_t, std::vector, mmap_allocator>;
 	using multi_polygon_store_t = std::vector<multi_polygon_t>;
 
 	std::mutex storeMutex;
 	// Threads can grab one of the stores and work on them in a thread local.
-	std::vector<std::pair<size_t, point_store_t*>> availablePointStoreLeases;
-	std::vector<std::pair<size_t, linestring_store_t*>> availableLinestringStoreLeases;
-	std::vector<std::pair<size_t, multi_linestring_store_t*>> availableMultiLinestringStoreLeases;
-	std::vector<std::pair<size_t, multi_polygon_store_t*>> availableMultiPolygonStoreLeases;
+	// A store is only opened when a thread first needs one and none have been
+	// given back, so there can be more threads than at the start, up to
+	// numShards. Each keeps its index, which is the shard in its IDs.
+	// sealStores() stops the stores in use so far being given out again, and
+	// the leases threads still hold from being used.
+	template<class T> struct StoreLeases {
+		std::vector<T> *stores;
+		std::vector<std::pair<size_t, T*>> available;
+		size_t opened;
+		std::atomic<size_t> generation { 0 };
+	};
+	StoreLeases<point_store_t> pointStoreLeases;
+	StoreLeases<linestring_store_t> linestringStoreLeases;
+	StoreLeases<multi_linestring_store_t> multiLinestringStoreLeases;
+	StoreLeases<multi_polygon_store_t> multiPolygonStoreLeases;
+	void openStores(size_t opened);
+
+	// Geometries stored from now on go in stores of their own, so the ones
+	// stored so far can be read (as Lua's spatial queries do) while others
+	// are being added
+	void sealStores();
 
 
 protected:	
 	size_t numShards;
 	uint8_t shardBits;
-	std::mutex mutex;
 	bool includeID;
 	uint16_t z6OffsetDivisor;
 
@@ -292,16 +334,48 @@ protected:
 	//
 	// If config.include_ids is true, objectsWithIds will be populated.
 	// Otherwise, objects.
-	std::vector<std::vector<OutputObjectXY>> objects;
-	std::vector<std::vector<OutputObjectXYID>> objectsWithIds;
+	std::vector<ClusteredObjects<OutputObject>> objects;
+	std::vector<ClusteredObjects<OutputObjectID>> objectsWithIds;
+
+	// With a memory limit, once the small objects take more than memoryLimit
+	// bytes, each z6 tile's objects are sorted and written to the spill file
+	// as a run. finalize() merges each tile's runs into one sorted array in
+	// the same file, which is then mapped, so only the z6 tiles being written
+	// need to be resident.
+	size_t memoryLimit;
+	std::atomic<size_t> smallObjectBytes;
+	std::mutex spillMutex;
+	std::unique_ptr<SpillFile> spillFile;
+	std::vector<std::vector<SpillRun>> spilledRuns, spilledRunsWithIds;		// per z6 tile
+	uint64_t spilledBytes;
+	void spill();
 	
 	// rtree index of large objects
 	using oo_rtree_param_type = boost::geometry::index::quadratic<128>;
-	boost::geometry::index::rtree< std::pair<Box,OutputObject>, oo_rtree_param_type> boxRtree;
-	boost::geometry::index::rtree< std::pair<Box,OutputObjectID>, oo_rtree_param_type> boxRtreeWithIds;
+	// One of each per minZoom bucket, as for small objects
+	boost::geometry::index::rtree< std::pair<Box,OutputObject>, oo_rtree_param_type> boxRtree[MINZOOM_BUCKETS];
+	boost::geometry::index::rtree< std::pair<Box,OutputObjectID>, oo_rtree_param_type> boxRtreeWithIds[MINZOOM_BUCKETS];
+
+	// Large objects are collected in per-thread buffers as they're added,
+	// then bulk-loaded into the rtrees by finalize()
+	struct LargeObjectBuffer {
+		std::mutex mutex;
+		std::vector<std::pair<Box,OutputObject>> objects;
+		std::vector<std::pair<Box,OutputObjectID>> objectsWithIds;
+	};
+	std::vector<LargeObjectBuffer> largeObjectBuffers;
 
 	unsigned int baseZoom;
 
+	// The tiles with small and large objects in them, at every zoom, filled
+	// as objects are added (small ones are cleared with them, for mapsplit)
+	TileOccupancy smallObjectTiles, largeObjectTiles;
+
+	// With a bounding box, the base zoom tiles (inclusive) it covers; objects
+	// are only kept in these, so every tile with objects is to be written
+	bool clipping;
+	TileCoordinate clipMinX, clipMinY, clipMaxX, clipMaxY;
+
 	std::vector<point_store_t> pointStores;
 	std::vector<linestring_store_t> linestringStores;
 	std::vector<multi_linestring_store_t> multilinestringStores;
@@ -309,6 +383,34 @@ protected:
 	
 	ClipCache<MultiPolygon> multiPolygonClipCache;
 	ClipCache<MultiLinestring> multiLinestringClipCache;
+	ClipCache<MultiLinestring> linestringClipCache;
+
+	// Simplified copies of large objects for low zooms, one map per pyramid
+	// level. Built by buildPyramids() before tiles are written, then read-only.
+	std::unordered_map<NodeID, MultiLinestring> linestringPyramid[PYRAMID_LEVELS];
+	std::unordered_map<NodeID, MultiLinestring> multiLinestringPyramid[PYRAMID_LEVELS];
+	std::unordered_map<NodeID, MultiPolygon> polygonPyramid[PYRAMID_LEVELS];
+
+	virtual void populateLinestring(Linestring& ls, NodeID objectID);
+
+	// Whole objects simplified for a zoom, keyed by (geometry type, layer), so
+	// that an object crossing many tiles is simplified once rather than per tile
+	ClipCache<MultiPolygon> simplifiedPolygonCache;
+	ClipCache<MultiLinestring> simplifiedLinestringCache;
+
+	// Whether each object asked about has SHARED_SIMPLIFY_MIN_POINTS, by
+	// (geometry type, ID), in shards that each have a lock
+	struct SharedSimplifyShard {
+		std::mutex mutex;
+		std::unordered_map<uint64_t, bool> big;
+	};
+	SharedSimplifyShard sharedSimplifyShards[SHARED_SIMPLIFY_SHARDS];
+
+	MultiPolygon clipMultiPolygon(const MultiPolygon &input, const TileBbox &bbox) const;
+
+	// Objects with the same key in a z6 tile are kept in this order (see
+	// OutputObjectOrder), so each tile's objects arrive in a few sorted runs
+	std::vector<bool> sortOrders;
 
 public:
 	TileDataSource(size_t threadNum, unsigned int baseZoom, bool includeID);
@@ -317,9 +419,51 @@ public:
 
 	void collectTilesWithLargeObjectsAtZoom(uint zoom, TileCoordinatesSet& output);
 
+	// Add the tiles with small and large objects in them to output
+	void getTileOccupancy(std::vector<const TileOccupancy*>& output) const;
+
 	void collectObjectsForTile(uint zoom, TileCoordinates dstIndex, std::vector<OutputObjectID>& output);
+
+	// Number of small (non-rtree) objects in a tile, as a cheap estimate of its cost
+	size_t countObjectsForTile(uint zoom, TileCoordinates dstIndex) const;
+	// Set (before any objects are added) the layers' sort orders
+	void setSortOrders(const std::vector<bool>& orders) { sortOrders = orders; }
+	// ...and the bounding box (in lon/latp) to keep objects within
+	void setClippingBox(const Box& box);
+	bool inClippingBox(const TileCoordinates& index) const {
+		return !clipping || (index.x >= clipMinX && index.x <= clipMaxX && index.y >= clipMinY && index.y <= clipMaxY);
+	}
 	void finalize(size_t threadNum);
 
+	// Save the finalized objects, large objects and generated geometries to a
+	// snapshot, or (before any objects are added) replace them with a saved copy.
+	// Loaded small objects are used from the snapshot's mapping; large ones are
+	// indexed by the next finalize().
+	void saveSnapshot(SnapshotWriter &out) const;
+	void loadSnapshot(SnapshotReader &in);
+
+	// Spill small objects to a file in spillDir beyond this many bytes
+	void setMemoryLimit(size_t bytes, const std::string &spillDir);
+
+	// For writing one z6 tile at a time: once all its tiles are written, free its objects
+	void releaseCell(TileCoordinates cell);
+
+	// Simplify the large objects that will be written below PYRAMID_MAX_ZOOM,
+	// as far as each level's zooms and the objects' layers allow
+	void buildPyramids(const class LayerDefinition& layers, uint startZoom, size_t threadNum);
+
+	// The simplified copy to clip at this zoom in place of the full geometry, if there is one
+	const MultiLinestring* pyramidLinestring(OutputGeometryType geomType, NodeID objectID, uint zoom) const;
+	const MultiPolygon* pyramidPolygon(NodeID objectID, uint zoom) const;
+
+	// Clip cache hits and misses, summed over all geometry types
+	uint64_t clipCacheHits() const {
+		return multiPolygonClipCache.hitCount() + multiLinestringClipCache.hitCount() + linestringClipCache.hitCount();
+	}
+	uint64_t clipCacheMisses() const {
+		return multiPolygonClipCache.missCount() + multiLinestringClipCache.missCount() + linestringClipCache.missCount();
+	}
+
 	void addGeometryToIndex(
 		const Linestring& geom,
 		const std::vector<OutputObject>& outputs,
@@ -338,29 +482,42 @@ public:
 
 	void addObjectToSmallIndex(const TileCoordinates& index, const OutputObject& oo, uint64_t id);
 
-	void addObjectToLargeIndex(const Box& envelope, const OutputObject& oo, uint64_t id) {
-		std::lock_guard<std::mutex> lock(mutex);
-		if (id == 0 || !includeID)
-			boxRtree.insert(std::make_pair(envelope, oo));
-		else
-			boxRtreeWithIds.insert(std::make_pair(envelope, OutputObjectID({oo, id})));
-	}
+	void addObjectToLargeIndex(const Box& envelope, const OutputObject& oo, uint64_t id);
 
 	void collectLargeObjectsForTile(uint zoom, TileCoordinates dstIndex, std::vector<OutputObjectID>& output);
 
-	std::vector<OutputObjectID> getObjectsForTile(
+	// Replaces the contents of output, so callers can reuse its storage from tile to tile.
+	// Layers with a feature limit (from getFeatureLimits) keep only that many objects.
+	void getObjectsForTile(
 		const std::vector<bool>& sortOrders, 
+		const std::vector<uint>& featureLimits,
 		unsigned int zoom,
-		TileCoordinates coordinates
+		TileCoordinates coordinates,
+		std::vector<OutputObjectID>& output
 	);
 
 	virtual Geometry buildWayGeometry(OutputGeometryType const geomType, NodeID const objectID, const TileBbox &bbox);
+
+	// Whether the object is big enough to be simplified whole. This depends
+	// only on the object, so that every tile it's in (on any run) agrees.
+	bool sharesSimplified(OutputGeometryType geomType, NodeID objectID);
+	// If the object has already been simplified for this zoom and layer, clip that
+	// to the tile and return true
+	bool buildSimplifiedWayGeometry(OutputGeometryType geomType, NodeID objectID, uint layer,
+	                                const TileBbox &bbox, Geometry &output);
+	// Simplify the whole object for this zoom and layer, for its other tiles to
+	// share, and return it clipped to this one
+	Geometry simplifyWayGeometry(OutputGeometryType geomType, NodeID objectID, uint layer,
+	                             const TileBbox &bbox, double simplifyLevel, bool fastSimplify);
 	LatpLon buildNodeGeometry(OutputGeometryType const geomType, NodeID const objectID, const TileBbox &bbox) const;
+	// Does a polygon cover the whole tile? Only checks what's already to hand (a
+	// simplified copy, or a clip of it at a lower zoom), so can miss some.
+	bool polygonCoversTile(NodeID const objectID, const TileBbox &bbox) const;
 
 	void open() {
 		// Put something at index 0 of all stores so that 0 can be used
 		// as a sentinel.
-		pointStores[0].push_back(Point(0,0));
+		pointStores[0].push_back(LatpLon { 0, 0 });
 		linestringStores[0].push_back(linestring_t());
 		multipolygonStores[0].push_back(multi_polygon_t());
 		multilinestringStores[0].push_back(multi_linestring_t());
@@ -383,21 +540,33 @@ public:
 
 	virtual void populateMultiPolygon(MultiPolygon& dst, NodeID objectID);
 
+	// The ID of the geometry at `offset` in store `shard`; throws if the offset
+	// would run into the store bits
+	inline NodeID storeId(size_t shard, NodeID offset) const {
+		if (offset >> (35 - shardBits))
+			throw std::out_of_range("generated geometry store " + std::to_string(shard) + " is full (" + std::to_string(offset) + " geometries)");
+		return (NodeID(shard) << (35 - shardBits)) + offset;
+	}
+
 	inline size_t getId(NodeID id) const {
 		return id & (~(~0ull << (35 - shardBits)));
 	}
 
-	const Point& retrievePoint(NodeID id) const {
+	const LatpLon& storedPoint(NodeID id) const {
 		const auto& shardId = getShard(id);
 		const auto& shard = pointStores[shardId];
 		const auto offset = getId(id);
 		if (offset > shard.size()) throw std::out_of_range("Could not find generated node with id " + std::to_string(id) + ", shard " + std::to_string(shardId) + ", offset=" + std::to_string(offset));
 		return shard.at(offset);
 	}
+	Point retrievePoint(NodeID id) const {
+		const LatpLon& p = storedPoint(id);
+		return Point(p.lon, p.latp);
+	}
 	
 	NodeID storeLinestring(const Linestring& src);
 
-	const linestring_t& retrieveLinestring(NodeID id) const {
+	const linestring_t& storedLinestring(NodeID id) const {
 		const auto& shardId = getShard(id);
 		const auto& shard = linestringStores[shardId];
 		const auto offset = getId(id);
@@ -407,7 +576,7 @@ public:
 	
 	NodeID storeMultiLinestring(const MultiLinestring& src);
 
-	multi_linestring_t const &retrieveMultiLinestring(NodeID id) const {
+	multi_linestring_t const &storedMultiLinestring(NodeID id) const {
 		const auto& shardId = getShard(id);
 		const auto& shard = multilinestringStores[shardId];
 		const auto offset = getId(id);
@@ -417,18 +586,23 @@ public:
 
 	NodeID storeMultiPolygon(const MultiPolygon& src);
 
-	multi_polygon_t const &retrieveMultiPolygon(NodeID id) const {
+	multi_polygon_t const &storedMultiPolygon(NodeID id) const {
 		const auto& shardId = getShard(id);
 		const auto& shard = multipolygonStores[shardId];
 		const auto offset = getId(id);
 		if (offset > shard.size()) throw std::out_of_range("Could not find generated multi-polygon with id " + std::to_string(id) + ", shard " + std::to_string(shardId) + ", offset=" + std::to_string(offset));
 		return shard.at(offset);
 	}
-};
 
-TileCoordinatesSet getTilesAtZoom(
-	const std::vector<class TileDataSource *>& sources,
-	unsigned int zoom
-);
+	// Stored geometries as Points, replacing out's contents
+	void retrieveLinestring(NodeID id, Linestring& out) const;
+	void retrieveMultiLinestring(NodeID id, MultiLinestring& out) const;
+	void retrieveMultiPolygon(NodeID id, MultiPolygon& out) const;
+	MultiPolygon retrieveMultiPolygon(NodeID id) const {
+		MultiPolygon mp;
+		retrieveMultiPolygon(id, mp);
+		return mp;
+	}
+};
 
 #endif //_TILE_DATA_H
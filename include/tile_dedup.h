@@ -0,0 +1,90 @@
+/*! \file */
+#ifndef _TILE_DEDUP_H
+#define _TILE_DEDUP_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+
+/** \brief Shared cache of compressed tiles, keyed on their uncompressed payload
+*
+* Most ocean and empty-land tiles at high zooms serialize to byte-identical
+* blobs. Worker threads look up each small serialized tile here before
+* compressing it, so that repeated tiles are only compressed once.
+*
+* Lookups hash the payload and then compare it byte-for-byte, so a hash
+* collision can never return the wrong tile.
+*/
+class TileDeduplicator {
+public:
+	// Only tiles up to this size are cached; larger tiles are rarely identical
+	static const size_t maxTileSize = 1024;
+
+	TileDeduplicator(size_t shardCount = 64):
+		shards(shardCount),
+		shardMutex(shardCount),
+		hits(0) {
+	}
+
+	// Fetch the compressed form of a previously seen tile
+	bool find(const std::string &raw, std::string &compressed) {
+		if (raw.size() > maxTileSize) return false;
+		size_t index = std::hash<std::string>()(raw) % shards.size();
+		std::lock_guard<std::mutex> lock(shardMutex[index]);
+		const auto it = shards[index].find(raw);
+		if (it == shards[index].end()) return false;
+		compressed = it->second;
+		hits++;
+		return true;
+	}
+
+	void add(const std::string &raw, const std::string &compressed) {
+		if (raw.size() > maxTileSize) return;
+		size_t index = std::hash<std::string>()(raw) % shards.size();
+		std::lock_guard<std::mutex> lock(shardMutex[index]);
+		auto &shard = shards[index];
+		// Reset the shard periodically so it doesn't grow without bound;
+		// the common tiles will quickly be added back.
+		if (shard.size() >= 1024) shard.clear();
+		shard.emplace(raw, compressed);
+	}
+
+	uint64_t hitCount() const { return hits.load(); }
+
+private:
+	std::vector<std::unordered_map<std::string, std::string>> shards;
+	std::vector<std::mutex> shardMutex;
+	std::atomic<uint64_t> hits;
+};
+
+/** \brief Shared cache of encoded tiles that hold nothing but one polygon covering them
+*
+* Such tiles (open sea, a large forest...) only differ in the polygon's layer
+* and attributes, so each combination is encoded once and the bytes reused.
+* The key is made by the caller from those, and anything else that changes
+* the encoding.
+*/
+class FillTileCache {
+public:
+	bool find(const std::string &key, std::string &tile) {
+		std::lock_guard<std::mutex> lock(mutex);
+		const auto it = tiles.find(key);
+		if (it == tiles.end()) return false;
+		tile = it->second;
+		return true;
+	}
+
+	void add(const std::string &key, const std::string &tile) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (tiles.size() >= 65536) tiles.clear();
+		tiles.emplace(key, tile);
+	}
+
+private:
+	std::unordered_map<std::string, std::string> tiles;
+	std::mutex mutex;
+};
+
+#endif //_TILE_DEDUP_H
@@ -0,0 +1,145 @@
+/*! \file */
+#ifndef _TILE_OCCUPANCY_H
+#define _TILE_OCCUPANCY_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "coordinates.h"
+
+// Each zoom's bitmap within a cell is allocated in chunks of this many bits
+// (a 64x64 square of tiles), as the parts of it with something in them are set
+#define OCCUPANCY_CHUNK_BITS 12
+
+/** \brief Which tiles, at every zoom up to the base zoom, have something in them
+*
+* The world is divided into cells at cellZoom. A cell holds a bitmap of its
+* tiles at each zoom from cellZoom to the base zoom, in Morton (interleaved
+* x/y) order, so that each chunk of a bitmap is a square of tiles. Cells and
+* chunks are only allocated once something is added to them.
+*
+* Adding a tile sets its bit and those of the tiles above it, so finding the
+* tiles at a zoom only has to read that zoom's bits. Tiles can be added from
+* many threads at once, but should only be read once adding has finished.
+*/
+class TileOccupancy {
+public:
+	TileOccupancy(uint baseZoom, uint cellZoom);
+	~TileOccupancy();
+	TileOccupancy(const TileOccupancy&) = delete;
+	TileOccupancy& operator=(const TileOccupancy&) = delete;
+
+	// Add a tile, or a box of tiles (inclusive), at the base zoom
+	void set(TileCoordinate x, TileCoordinate y);
+	void setBox(TileCoordinate minX, TileCoordinate minY, TileCoordinate maxX, TileCoordinate maxY);
+
+	bool test(uint zoom, TileCoordinate x, TileCoordinate y) const;
+	void clear();
+
+	// Call f(x, y) once for each occupied tile at a zoom
+	template<typename F> void forEachTile(uint zoom, F f) const {
+		if (zoom < cellZoom) {
+			// Tiles above the cells are occupied if any cell below them is
+			const uint shift = cellZoom - zoom;
+			std::vector<bool> seen(1 << (2 * zoom));
+			for (uint32_t i = 0; i < cellCount(); i++) {
+				if (!cells[i].load(std::memory_order_acquire)) continue;
+				const TileCoordinate x = (i >> cellZoom) >> shift, y = (i & (cellWidth() - 1)) >> shift;
+				if (seen[(x << zoom) + y]) continue;
+				seen[(x << zoom) + y] = true;
+				f(x, y);
+			}
+			return;
+		}
+		const uint level = zoom - cellZoom;
+		for (uint32_t i = 0; i < cellCount(); i++) {
+			const TileCoordinate x = (i >> cellZoom) << level, y = (i & (cellWidth() - 1)) << level;
+			forEachInCell(i, level, [&](TileCoordinate cx, TileCoordinate cy) { f(x + cx, y + cy); });
+		}
+	}
+
+	// Call f(x, y) for each occupied tile at a zoom (at least cellZoom) in
+	// one cell, with coordinates relative to the cell
+	template<typename F> void forEachTileInCell(uint zoom, TileCoordinates cell, F f) const {
+		if (cell.x >= cellWidth() || cell.y >= cellWidth()) return;
+		forEachInCell((cell.x << cellZoom) + cell.y, zoom - cellZoom, f);
+	}
+
+private:
+	typedef std::atomic<uint64_t> Word;
+	typedef std::atomic<Word*> Chunk;
+
+	const uint baseZoom, cellZoom, levels;
+	std::vector<size_t> chunkOffset;	// first chunk of each level in a cell
+	size_t chunksPerCell;
+	// Each cell is an array of chunk pointers, or null if it's empty
+	std::vector<std::atomic<Chunk*>> cells;
+
+	uint32_t cellWidth() const { return 1u << cellZoom; }
+	uint32_t cellCount() const { return 1u << (2 * cellZoom); }
+	static size_t chunkWords(uint level) {
+		const uint bits = std::min<uint>(2 * level, OCCUPANCY_CHUNK_BITS);
+		return bits < 6 ? 1 : size_t(1) << (bits - 6);
+	}
+
+	Chunk* cellFor(uint32_t cell);
+	Word* chunkFor(Chunk* cell, uint level, uint64_t morton);
+	bool testBit(const Chunk* cell, uint level, uint64_t morton) const;
+	void setBit(Chunk* cell, uint level, uint64_t morton);
+	void setRange(Chunk* cell, uint level, uint64_t first, uint64_t end);
+	void fillBox(Chunk* cell, uint level, uint32_t x, uint32_t y,
+	             uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2);
+
+	template<typename F> void forEachInCell(uint32_t i, uint level, F f) const {
+		const Chunk* cell = cells[i].load(std::memory_order_acquire);
+		if (!cell || level > levels) return;
+		const size_t count = (level == levels ? chunksPerCell : chunkOffset[level + 1]) - chunkOffset[level];
+		const size_t words = chunkWords(level);
+		for (size_t c = 0; c < count; c++) {
+			const Word* chunk = cell[chunkOffset[level] + c].load(std::memory_order_acquire);
+			if (!chunk) continue;
+			for (size_t w = 0; w < words; w++) {
+				uint64_t bits = chunk[w].load(std::memory_order_relaxed);
+				for (uint bit = 0; bits; bit++, bits >>= 1) {
+					if (!(bits & 1)) continue;
+					uint32_t x, y;
+					deinterleaveBits((uint64_t(c) << OCCUPANCY_CHUNK_BITS) + (w << 6) + bit, x, y);
+					f(x, y);
+				}
+			}
+		}
+	}
+};
+
+// Call f(zoom, x, y) for each tile from minZoom to maxZoom that is occupied in
+// any of occupancies, by zoom, then x, then y. This tests every tile, so is
+// meant for the low zooms.
+template<typename F> void forEachOccupiedTileByZoom(const std::vector<const TileOccupancy*>& occupancies, uint minZoom, uint maxZoom, F f) {
+	for (uint zoom = minZoom; zoom <= maxZoom; zoom++)
+		for (uint32_t x = 0; x < (1u << zoom); x++)
+			for (uint32_t y = 0; y < (1u << zoom); y++)
+				for (const TileOccupancy* occupancy : occupancies)
+					if (occupancy->test(zoom, x, y)) { f(zoom, x, y); break; }
+}
+
+// Call f(zoom, x, y) for each occupied tile from minZoom to maxZoom in the tile
+// zoom/x/y, depth-first: each tile comes before the four below it, which are
+// visited in Morton order. Only occupied tiles are descended into.
+template<typename F> void forEachOccupiedTileDepthFirst(const std::vector<const TileOccupancy*>& occupancies,
+                                                        uint zoom, uint32_t x, uint32_t y, uint minZoom, uint maxZoom, F& f) {
+	bool occupied = false;
+	for (const TileOccupancy* occupancy : occupancies)
+		if (occupancy->test(zoom, x, y)) { occupied = true; break; }
+	if (!occupied)
+		return;
+	if (zoom >= minZoom)
+		f(zoom, x, y);
+	if (zoom >= maxZoom)
+		return;
+	for (uint32_t dx = 0; dx < 2; dx++)
+		for (uint32_t dy = 0; dy < 2; dy++)
+			forEachOccupiedTileDepthFirst(occupancies, zoom + 1, x * 2 + dx, y * 2 + dy, minZoom, maxZoom, f);
+}
+
+#endif //_TILE_OCCUPANCY_H
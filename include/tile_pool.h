@@ -0,0 +1,74 @@
+/*! \file */
+#ifndef _TILE_POOL_H
+#define _TILE_POOL_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/post.hpp>
+
+/** \brief The threads that write tiles, in a group for each NUMA node (`--pin-threads`)
+*
+* Each group has its own queue, and its threads are pinned to the CPUs of its
+* node, one CPU each, so that work posted to a group stays on one socket: the
+* geometry it reads stays in that socket's cache, and the memory it allocates
+* on its node. The threads are shared out in proportion to the CPUs each node
+* has that tilemaker may use.
+*
+* Without pinning, or on a machine with one node, there's one group and the
+* pool works like a boost::asio::thread_pool.
+*/
+class TilePool {
+public:
+	TilePool(size_t threadNum, bool pin);
+	~TilePool() { join(); }
+
+	TilePool(const TilePool&) = delete;
+	TilePool& operator=(const TilePool&) = delete;
+
+	size_t groups() const { return contexts.size(); }
+
+	template<class F> void post(size_t group, F &&f) {
+		group %= contexts.size();
+		std::atomic<size_t> *groupBusy = &busy[group];
+		boost::asio::post(*contexts[group], [groupBusy, f = std::forward<F>(f)]() mutable {
+			(*groupBusy)++;
+			f();
+			(*groupBusy)--;
+		});
+	}
+
+	// Run f(0)...f(count-1) on the calling thread, helped by any of its group's
+	// threads that are idle, so that a big tile can use them without starting
+	// threads of its own. Returns once all have run. Off the pool, or with no
+	// thread idle, they're run in turn.
+	static void runShared(size_t count, std::function<void(size_t)> const &f);
+
+	// Wait for everything posted to finish
+	void join();
+
+	// The groups of the running pool, and the group of the calling thread (0
+	// if it isn't one of the pool's)
+	static size_t groupCount() { return activeGroups.load(std::memory_order_relaxed); }
+	static size_t currentGroup() { return threadGroup; }
+
+private:
+	typedef boost::asio::executor_work_guard<boost::asio::io_context::executor_type> WorkGuard;
+
+	std::vector<std::unique_ptr<boost::asio::io_context>> contexts;
+	std::vector<WorkGuard> guards;
+	std::vector<std::thread> threads;
+	std::vector<size_t> groupThreads;
+	std::unique_ptr<std::atomic<size_t>[]> busy;	// each group's threads running a task
+
+	static std::atomic<size_t> activeGroups;
+	static thread_local size_t threadGroup;
+	static thread_local TilePool *threadPool;
+};
+
+#endif //_TILE_POOL_H
@@ -0,0 +1,130 @@
+/*! \file */
+#ifndef _TILE_PROFILER_H
+#define _TILE_PROFILER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <chrono>
+#include <cstdint>
+#include "coordinates.h"
+#include "trace.h"
+
+/// Stages of writing a tile that the profiler times separately
+enum class TilePhase { Collect, Geometry, Clip, Simplify, Encode, Compress, Write, Count };
+
+inline const char *tilePhaseName(TilePhase phase) {
+	static const char *names[] = { "collect", "geometry", "clip", "simplify", "encode", "compress", "write" };
+	return names[size_t(phase)];
+}
+
+/** \brief Per-tile and per-layer timings, written as CSV or NDJSON
+*
+* Each thread formats its rows into its own buffer, which is only written to
+* the file (under a lock) once it fills up, so profiling a run doesn't
+* serialise the workers. Phase times are exclusive: time spent clipping inside
+* a geometry build counts as clipping, not as geometry.
+*
+* There is one row per layer that has any work in it, then one row for the
+* tile, whose phase times and feature count include all its layers.
+*/
+class TileProfiler {
+public:
+	// The format is NDJSON if the filename ends in .json or .ndjson, otherwise CSV
+	TileProfiler(const std::string &filename);
+	~TileProfiler();
+	TileProfiler(const TileProfiler&) = delete;
+	TileProfiler& operator=(const TileProfiler&) = delete;
+
+	bool good() const { return bool(out); }
+
+	// Start profiling a tile on the calling thread
+	void beginTile(unsigned int zoom, TileCoordinates index);
+
+	// These do nothing unless the calling thread is profiling a tile
+	static void beginLayer(const std::string &name);
+	static void endLayer(size_t features, size_t bytes);
+	static void endTile(size_t bytes, size_t compressedBytes);
+
+	// Write out what all threads have buffered so far
+	void flush();
+
+	static bool active() { return current != nullptr; }
+	static void addTime(TilePhase phase, uint64_t ns);
+
+private:
+	struct Counters {
+		uint64_t ns[size_t(TilePhase::Count)];
+		void clear() { for (auto &n : ns) n = 0; }
+	};
+
+	struct ThreadState {
+		TileProfiler *profiler;
+		std::string buffer;
+		unsigned int zoom;
+		TileCoordinates index;
+		std::string layer;
+		bool inLayer;
+		Counters tile, layerCounters;
+		size_t features;
+		std::chrono::steady_clock::time_point tileStart, layerStart;
+		uint64_t childNs;		// time taken by nested timers, see TilePhaseTimer
+	};
+
+	void writeRow(ThreadState &state, const char *layer, uint64_t totalNs, const Counters &counters,
+	              size_t features, size_t bytes, size_t compressedBytes);
+	void writeBuffer(std::string &buffer);
+
+	static thread_local ThreadState *current;
+	static thread_local ThreadState *threadState;
+
+	std::ofstream out;
+	bool ndjson;
+	std::mutex mutex;
+	std::vector<std::unique_ptr<ThreadState>> states;
+
+	friend class TilePhaseTimer;
+};
+
+/** \brief Adds the time until it goes out of scope to a phase of the current tile
+*
+* Free when the thread isn't profiling. Nested timers' time is taken away from
+* the enclosing one. In a build with tracing, each is a span too.
+*/
+class TilePhaseTimer {
+public:
+	TilePhaseTimer(TilePhase phase):
+#ifdef TM_TRACE
+		span(tilePhaseName(phase)),
+#endif
+		phase(phase), running(TileProfiler::active()) {
+		if (!running) return;
+		savedChildNs = TileProfiler::current->childNs;
+		TileProfiler::current->childNs = 0;
+		start = std::chrono::steady_clock::now();
+	}
+
+	~TilePhaseTimer() {
+		if (!running || !TileProfiler::active()) return;
+		uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		uint64_t child = TileProfiler::current->childNs;
+		TileProfiler::addTime(phase, elapsed > child ? elapsed - child : 0);
+		TileProfiler::current->childNs = savedChildNs + elapsed;
+	}
+
+	TilePhaseTimer(const TilePhaseTimer&) = delete;
+	TilePhaseTimer& operator=(const TilePhaseTimer&) = delete;
+
+private:
+#ifdef TM_TRACE
+	TraceSpan span;
+#endif
+	TilePhase phase;
+	bool running;
+	uint64_t savedChildNs;
+	std::chrono::steady_clock::time_point start;
+};
+
+#endif //_TILE_PROFILER_H
@@ -0,0 +1,62 @@
+/*! \file */
+#ifndef _TILE_SERVER_H
+#define _TILE_SERVER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+
+/** \brief Serves the tiles in an .mbtiles over HTTP (`tilemaker --serve`)
+*
+* Requests are handled asynchronously with Boost.Asio, on a pool of threads
+* sharing one event loop. Each request borrows a read-only SQLite handle from
+* a pool, with the tile query already prepared, so lookups don't wait on each
+* other or reparse SQL.
+*
+* Tiles are sent as stored: gzip-compressed tiles go out with
+* `Content-Encoding: gzip` (unless the client can't take it), and every tile
+* has an ETag so that clients can revalidate with If-None-Match.
+*
+* Paths are /z/x/y.pbf (or .mvt) for tiles, and /metadata for the .mbtiles'
+* metadata as JSON.
+*/
+class TileServer {
+public:
+	struct Response {
+		int status;
+		std::string contentType;
+		std::string contentEncoding;
+		std::string etag;
+		std::string body;
+		bool varyEncoding;	// the body depends on Accept-Encoding
+	};
+
+	TileServer(const std::string &filename, unsigned int maxAge = 0);
+	~TileServer();
+	bool good() const { return !metadataJson.empty(); }
+
+	// Listen on a port and serve until interrupted
+	void run(unsigned short port, unsigned int threadNum);
+
+	// Answer one request
+	Response handle(const std::string &method, const std::string &target,
+	                const std::string &ifNoneMatch, const std::string &acceptEncoding);
+
+private:
+	struct Connection;
+
+	std::string filename;
+	unsigned int maxAge;
+	std::string metadataJson;
+
+	std::vector<std::unique_ptr<Connection>> idleConnections;
+	std::mutex poolMutex;
+
+	std::unique_ptr<Connection> acquire();
+	void release(std::unique_ptr<Connection> connection);
+	bool readTile(unsigned int zoom, unsigned int x, unsigned int y, std::string &data);
+	bool readMetadata();
+};
+
+#endif //_TILE_SERVER_H
@@ -0,0 +1,69 @@
+/*! \file */
+#ifndef _TILE_SINK_H
+#define _TILE_SINK_H
+
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <unordered_set>
+#include "mbtiles.h"
+#include "pmtiles.h"
+
+///\brief Where generated tiles are written
+enum class OutputMode { File, MBTiles, PMTiles };
+
+OutputMode outputModeFor(const std::string &path);
+
+/** \brief An output that finished tiles are handed to: a directory, or any output after the first
+*
+* This lets one run write the same tiles to, say, an .mbtiles and a directory
+* or .pmtiles. Tiles are queued and written by threads of the sink's own, so
+* that a slow output doesn't hold up tile generation. When the queue is full,
+* saveTile blocks until the writers catch up, so memory use stays bounded.
+* (.mbtiles already have a writer thread, so their tiles go straight to it.)
+*
+* Directory output is also written like this. Most of its time is spent
+* waiting on the filesystem for each tile's file, so it has several writer
+* threads, each taking tiles a batch at a time, and each remembering which
+* directories it has already made.
+*/
+class TileSink {
+public:
+	const OutputMode mode;
+	const std::string path;
+	MBTiles mbtiles;	// if mode is MBTiles
+	PMTiles pmtiles;	// if mode is PMTiles
+
+	TileSink(const std::string &path);
+	~TileSink();
+
+	// Start the writer thread, once the output has been opened
+	void start();
+	void saveTile(int zoom, int x, int y, std::string *data);
+	// Write out everything queued, and stop the writer thread
+	void finish();
+
+private:
+	struct PendingTile {
+		int zoom;
+		int x;
+		int y;
+		std::string data;
+	};
+
+	std::deque<PendingTile> pendingTiles;
+	size_t pendingBytes;
+	std::mutex pendingMutex;
+	std::condition_variable pendingNotEmpty, pendingNotFull;
+	bool stopWriter;
+	std::vector<std::thread> writerThreads;
+
+	void writerLoop();
+	// Write a tile to the directory's zoom/x/y.pbf
+	void writeTileFile(const PendingTile &tile, std::unordered_set<std::string> &knownDirs);
+};
+
+#endif //_TILE_SINK_H
@@ -0,0 +1,95 @@
+/*! \file */
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Spans kept per thread by default (32 bytes each); beyond this, each thread's oldest are overwritten
+#define TRACE_EVENTS_PER_THREAD (1 << 16)
+
+/** \brief Timelines of what each thread is doing, written as a Chrome trace (`--trace`)
+*
+* Spans are marked with TRACE_SPAN, which compiles to nothing unless tilemaker
+* is built with TM_TRACE (`make TRACE=1`, or `cmake -DTILEMAKER_TRACE=ON`), so
+* they cost nothing in hot paths otherwise. Built in, a span is two clock reads
+* and a write to its thread's own ring buffer while the tracer runs, and a
+* single check when it doesn't. The rings are only read by finish().
+*
+* The file opens in chrome://tracing or https://ui.perfetto.dev. A span's name,
+* and its detail if it has one, must outlive the tracer: use string literals,
+* or strings such as layer names that last the whole run.
+*/
+class Tracer {
+public:
+	static bool start(const std::string &filename, size_t eventsPerThread = TRACE_EVENTS_PER_THREAD);
+	// Write out what's been recorded, once the threads that recorded it are done
+	static void finish();
+
+	static bool active() { return enabled.load(std::memory_order_relaxed); }
+	static uint64_t now() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+	}
+	static void record(const char *name, const char *detail, uint64_t start, uint64_t end);
+
+private:
+	struct Event {
+		const char *name;
+		const char *detail;
+		uint64_t start, duration;
+	};
+	struct ThreadBuffer {
+		std::vector<Event> events;
+		size_t next;			// where the next event goes, once the ring is full
+		bool wrapped;
+		unsigned int id;
+	};
+
+	static std::atomic<bool> enabled;
+	static std::chrono::steady_clock::time_point origin;
+	static std::string filename;
+	static size_t capacity;
+	static std::mutex mutex;
+	static std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+	static thread_local ThreadBuffer *buffer;
+};
+
+///\brief Records the time until it goes out of scope as a span, if the tracer is running
+class TraceSpan {
+public:
+	TraceSpan(const char *name, const char *detail = nullptr):
+		name(name), detail(detail), running(Tracer::active()), start(running ? Tracer::now() : 0) { }
+	~TraceSpan() { if (running) Tracer::record(name, detail, start, Tracer::now()); }
+
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+	const char *name, *detail;
+	bool running;
+	uint64_t start;
+};
+
+#ifdef TM_TRACE
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SPAN(...) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(__VA_ARGS__)
+#else
+#define TRACE_SPAN(...) ((void)0)
+#endif
+
+// Lock a mutex, recording a span for the wait if it's held by another thread
+template<class Mutex> void tracedLock(Mutex &mutex, const char *name) {
+#ifdef TM_TRACE
+	if (mutex.try_lock()) return;
+	TraceSpan span(name);
+#endif
+	mutex.lock();
+}
+
+#endif //_TRACE_H
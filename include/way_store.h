@@ -15,6 +15,8 @@ public:
 	// meaningful for SortedWayStore
 	virtual void batchStart() = 0;
 	virtual std::vector<LatpLon> at(WayID wayid) const = 0;
+	// As above, into a vector the caller reuses, so its storage needn't be reallocated
+	virtual void at(WayID wayid, std::vector<LatpLon> &out) const { out = at(wayid); }
 	virtual bool requiresNodes() const = 0;
 	virtual void insertLatpLons(std::vector<ll_element_t>& newWays) = 0;
 	virtual const void insertNodes(const std::vector<std::pair<WayID, std::vector<NodeID>>>& newWays) = 0;
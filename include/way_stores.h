@@ -1,6 +1,7 @@
 #ifndef _WAY_STORES_H
 #define _WAY_STORES_H
 
+#include <deque>
 #include <memory>
 #include <mutex>
 #include "way_store.h"
@@ -14,6 +15,7 @@ public:
 	void reopen() override;
 	void batchStart() override {}
 	std::vector<LatpLon> at(WayID wayid) const override;
+	void at(WayID wayid, std::vector<LatpLon> &out) const override;
 	bool requiresNodes() const override { return false; }
 	void insertLatpLons(std::vector<WayStore::ll_element_t> &newWays) override;
 	const void insertNodes(const std::vector<std::pair<WayID, std::vector<NodeID>>>& newWays) override;
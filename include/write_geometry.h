@@ -25,8 +25,9 @@ public:
 	const TileBbox *bboxPtr;
 	vector_tile::Tile_Feature *featurePtr;
 	double simplifyLevel;
+	bool fastSimplify;		// simplify polygons without keeping their topology
 
-	WriteGeometryVisitor(const TileBbox *bp, vector_tile::Tile_Feature *fp, double sl);
+	WriteGeometryVisitor(const TileBbox *bp, vector_tile::Tile_Feature *fp, double sl, bool fast = false);
 
 	// Point
 	void operator()(const Point &p) const;
@@ -40,6 +41,9 @@ public:
 	// Linestring
 	void operator()(const Linestring &ls) const;
 
+	/// \brief Scale a linestring to tile co-ordinates
+	void scaleLinestring(const Linestring &ls, XYString &output) const;
+
 	/// \brief Encode a series of pixel co-ordinates into the feature, using delta and zigzag encoding
 	bool writeDeltaString(XYString *scaledString, vector_tile::Tile_Feature *featurePtr, std::pair<int,int> *lastPos, bool closePath) const;
 };
@@ -1,8 +1,11 @@
 #include "attribute_store.h"
+#include "snapshot.h"
 
 #include <iostream>
 #include <algorithm>
 
+extern bool verbose;
+
 // AttributeKeyStore
 thread_local std::map<const std::string*, uint16_t, string_ptr_less_than> tlsKeys2Index;
 thread_local uint16_t tlsKeys2IndexSize = 0;
@@ -55,97 +58,157 @@ const std::string& AttributeKeyStore::getKeyUnsafe(uint16_t index) const {
 	return keys[index];
 }
 
-// AttributePairStore
-thread_local boost::container::flat_map<const AttributePair*, uint32_t, AttributePairStore::key_value_less_ptr> tlsHotShardMap;
-thread_local uint16_t tlsHotShardSize = 0;
-const AttributePair& AttributePairStore::getPair(uint32_t i) const {
-	uint32_t shard = i >> (32 - SHARD_BITS);
-	uint32_t offset = i & (~(~0u << (32 - SHARD_BITS)));
-
-	if (shard == 0)
-		return hotShard[offset];
-
-	std::lock_guard<std::mutex> lock(pairsMutex[shard]);
-	return pairs[shard].at(offset);
-};
-const AttributePair& AttributePairStore::getPairUnsafe(uint32_t i) const {
-	// NB: This is unsafe if called before the PBF has been fully read.
-	// If called during the output phase, it's safe.
-
-	uint32_t shard = i >> (32 - SHARD_BITS);
-	uint32_t offset = i & (~(~0u << (32 - SHARD_BITS)));
-
-	if (shard == 0)
-		return hotShard[offset];
-
-	return pairs[shard].at(offset);
-};
+// AttributeStringStore
+#define STRING_BLOCK_SIZE (1 << 20)
+#define LARGE_STRING (1 << 16)
+thread_local char* tlsStringBlock = nullptr;
+thread_local size_t tlsStringBlockLeft = 0;
+
+AttributeStringStore::StringRef::StringRef(const char *data, size_t length): data(data), length(length) {
+	// FNV-1a, worked out once when the string is first seen
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < length; i++) { h ^= uint8_t(data[i]); h *= 16777619u; }
+	hashValue = h;
+}
 
-uint32_t AttributePairStore::addPair(const AttributePair& pair, bool isHot) {
-	if (isHot) {
-		{
-			// First, check our thread-local map.
-			const auto& it = tlsHotShardMap.find(&pair);
-			if (it != tlsHotShardMap.end())
-				return it->second;
-		}
-		// Not found, ensure our local map is up-to-date for future calls,
-		// and fall through to the main map.
-		//
-		// Note that we can read `hotShard` without a lock
-		while (tlsHotShardSize < hotShardSize.load()) {
-			tlsHotShardSize++;
-			tlsHotShardMap[&hotShard[tlsHotShardSize]] = tlsHotShardSize;
-		}
+AttributeStringStore& AttributeStringStore::shared() {
+	static AttributeStringStore store;
+	return store;
+}
 
-		// This might be a popular pair, worth re-using.
-		// Have we already assigned it a hot ID?
-		std::lock_guard<std::mutex> lock(pairsMutex[0]);
-		const auto& it = pairsMaps[0].find(&pair);
-		if (it != pairsMaps[0].end())
-			return it->second;
-
-		if (hotShardSize.load() < 1 << 16) {
-			hotShardSize++;
-			uint32_t offset = hotShardSize.load();
-
-			hotShard[offset] = pair;
-			const AttributePair* ptr = &hotShard[offset];
-			uint32_t rv = (0 << (32 - SHARD_BITS)) + offset;
-			pairsMaps[0][ptr] = rv;
-			return rv;
-		}
+char* AttributeStringStore::allocate(size_t length) {
+	// Long strings (rare) get a block of their own
+	if (length > LARGE_STRING) {
+		std::lock_guard<std::mutex> lock(blocksMutex);
+		blocks.emplace_back(new char[length]);
+		return blocks.back().get();
 	}
+	// Otherwise, each thread fills its own block, so only needs the lock for a new one
+	if (length > tlsStringBlockLeft) {
+		std::lock_guard<std::mutex> lock(blocksMutex);
+		blocks.emplace_back(new char[STRING_BLOCK_SIZE]);
+		tlsStringBlock = blocks.back().get();
+		tlsStringBlockLeft = STRING_BLOCK_SIZE;
+	}
+	char *rv = tlsStringBlock;
+	tlsStringBlock += length;
+	tlsStringBlockLeft -= length;
+	return rv;
+}
 
-	// This is either not a hot key, or there's no room for in the hot shard.
-	// Throw it on the pile with the rest of the pairs.
-	size_t hash = pair.hash();
+uint32_t AttributeStringStore::add(const std::string &str) {
+	if (str.size() > 0xFFFFFFFFull) throw std::out_of_range("attribute string too long");
+	StringRef ref(str.data(), str.size());
+	return index.findOrInsert(ref, [this](uint32_t i) -> const StringRef& { return refs[i]; }, [&]() {
+		// Only the thread that stores a string copies it into the arena
+		uint64_t offset = count.fetch_add(1);
+		if (offset >= 0xFFFFFFFFull)
+			throw std::out_of_range("attribute string store overflow");
+		StringRef stored = ref;
+		stored.data = allocate(ref.length);
+		memcpy(const_cast<char*>(stored.data), ref.data, ref.length);
+		refs.store(offset, stored);
+		return uint32_t(offset);
+	});
+}
 
-	size_t shard = hash % ATTRIBUTE_SHARDS;
-	// Shard 0 is for hot pairs -- pick another shard if it gets selected.
-	if (shard == 0) shard = (hash >> 8) % ATTRIBUTE_SHARDS;
-	if (shard == 0) shard = (hash >> 16) % ATTRIBUTE_SHARDS;
-	if (shard == 0) shard = (hash >> 24) % ATTRIBUTE_SHARDS;
-	if (shard == 0) shard = 1;
+// AttributeKeyStats
+std::atomic<uint64_t> AttributeKeyStats::nextId(1);
+
+std::atomic<uint16_t>* AttributeKeyStats::localCounts() const {
+	thread_local uint64_t ownerId = 0;
+	thread_local std::atomic<uint16_t>* counts = nullptr;
+	if (ownerId == id) return counts;
+
+	local_counts_t newCounts(new std::atomic<uint16_t>[65536]);
+	for (size_t i = 0; i < 65536; i++) newCounts[i] = 0;
+	counts = newCounts.get();
+	ownerId = id;
+	std::lock_guard<std::mutex> lock(localMutex);
+	locals.push_back(std::move(newCounts));
+	return counts;
+}
 
-	std::lock_guard<std::mutex> lock(pairsMutex[shard]);
-	const auto& it = pairsMaps[shard].find(&pair);
-	if (it != pairsMaps[shard].end())
-		return it->second;
+uint64_t AttributeKeyStats::count(uint16_t keyIndex) const {
+	uint64_t total = stats[keyIndex].count.load();
+	std::lock_guard<std::mutex> lock(localMutex);
+	for (const auto &local : locals) total += local[keyIndex].load(std::memory_order_relaxed);
+	return total;
+}
 
-	uint32_t offset = pairs[shard].size();
+bool AttributeKeyStats::isHot(const AttributePair &pair, const std::string &keyName) const {
+	const KeyStats &s = stats[pair.keyIndex];
+	uint64_t count = s.count.load(std::memory_order_relaxed) + localCounts()[pair.keyIndex].load(std::memory_order_relaxed);
+	if (count >= KEY_SAMPLE) {
+		uint64_t distinct = s.distinct.load(std::memory_order_relaxed);
+		// Each value is used 64 times on average: hot, even if it's "Primary" or "30"
+		if (distinct * 64 <= count) return true;
+		// Most values are only used a few times: not worth a hot slot
+		if (distinct * 4 >= count) return false;
+	}
+	return AttributePair::isHot(pair, keyName);
+}
 
-	if (offset >= (1 << (32 - SHARD_BITS)))
-		throw std::out_of_range("pair shard overflow");
+// AttributePairStore
+uint32_t AttributePairStore::addPair(const AttributePair& pair, bool isHot) {
+	// Only the first thread to see a pair stores it; everyone else just finds it
+	return pairIndex.findOrInsert(pair, [this](uint32_t i) -> const AttributePair& { return pairs[i]; }, [&]() {
+		keyStats.stored(pair);
+		if (isHot && hotCount.load() < HOT_PAIRS - 1) {
+			// This might be a popular pair, worth re-using, so give it a hot index if there's room
+			uint32_t offset = hotCount.fetch_add(1) + 1;
+			if (offset < HOT_PAIRS) {
+				pairs.store(offset, pair);
+				return offset;
+			}
+			hotCount = HOT_PAIRS;
+		}
 
-	pairs[shard].push_back(pair);
-	const AttributePair* ptr = &pairs[shard][offset];
-	uint32_t rv = (shard << (32 - SHARD_BITS)) + offset;
+		// This is either not a hot key, or there's no room left in the hot pool.
+		// Throw it on the pile with the rest of the pairs.
+		uint64_t offset = HOT_PAIRS + coldCount.fetch_add(1);
+		if (offset >= 0xFFFFFFFFull)
+			throw std::out_of_range("pair store overflow");
+		pairs.store(offset, pair);
+		return uint32_t(offset);
+	});
+}
 
-	pairsMaps[shard][ptr] = rv;
-	return rv;
-};
+void AttributePairStore::saveSnapshot(SnapshotWriter &out) const {
+	const uint32_t hot = hotPairCount();
+	const uint64_t cold = coldCount.load();
+	out.put<uint32_t>(hot);
+	out.put<uint64_t>(cold);
+	auto putPair = [&](const AttributePair &pair) {
+		out.put<short>(pair.keyIndex);
+		out.put<char>(pair.minzoom);
+		out.put<uint8_t>(uint8_t(pair.valueType));
+		if (pair.hasStringValue()) out.putString(pair.stringValue());
+		else out.put<uint32_t>(pair.value_);
+	};
+	for (uint32_t i = 1; i <= hot; i++) putPair(pairs[i]);
+	for (uint64_t i = 0; i < cold; i++) putPair(pairs[HOT_PAIRS + i]);
+}
 
+void AttributePairStore::loadSnapshot(SnapshotReader &in) {
+	const uint32_t hot = in.get<uint32_t>();
+	const uint64_t cold = in.get<uint64_t>();
+	if (hot >= HOT_PAIRS || cold >= 0xFFFFFFFFull - HOT_PAIRS) throw std::runtime_error("too many attribute pairs");
+	// Strings are interned again, so may have different indices than before
+	auto getPair = [&]() {
+		AttributePair pair;
+		pair.keyIndex = in.get<short>();
+		pair.minzoom = in.get<char>();
+		pair.valueType = AttributePairType(in.get<uint8_t>());
+		pair.value_ = pair.hasStringValue() ? AttributeStringStore::shared().add(in.getString()) : in.get<uint32_t>();
+		return pair;
+	};
+	for (uint32_t i = 1; i <= hot; i++) pairs.store(i, getPair());
+	for (uint64_t i = 0; i < cold; i++) pairs.store(HOT_PAIRS + i, getPair());
+	hotCount = hot;
+	coldCount = cold;
+	finalized = true;
+}
 
 // AttributeSet
 void AttributeSet::addPair(uint32_t pairIndex) {
@@ -199,20 +262,17 @@ void AttributeSet::removePairWithKey(const AttributePairStore& pairStore, uint32
 }
 
 void AttributeStore::addAttribute(AttributeSet& attributeSet, std::string const &key, const std::string& v, char minzoom) {
-	AttributePair kv(keyStore.key2index(key),v,minzoom);
-	bool isHot = AttributePair::isHot(kv, key);
-	attributeSet.removePairWithKey(pairStore, kv.keyIndex);
-	attributeSet.addPair(pairStore.addPair(kv, isHot));
+	addAttribute(attributeSet, AttributePair(keyStore.key2index(key),v,minzoom), key);
 }
 void AttributeStore::addAttribute(AttributeSet& attributeSet, std::string const &key, bool v, char minzoom) {
-	AttributePair kv(keyStore.key2index(key),v,minzoom);
-	bool isHot = AttributePair::isHot(kv, key);
-	attributeSet.removePairWithKey(pairStore, kv.keyIndex);
-	attributeSet.addPair(pairStore.addPair(kv, isHot));
+	addAttribute(attributeSet, AttributePair(keyStore.key2index(key),v,minzoom), key);
 }
 void AttributeStore::addAttribute(AttributeSet& attributeSet, std::string const &key, float v, char minzoom) {
-	AttributePair kv(keyStore.key2index(key),v,minzoom);
-	bool isHot = AttributePair::isHot(kv, key);
+	addAttribute(attributeSet, AttributePair(keyStore.key2index(key),v,minzoom), key);
+}
+void AttributeStore::addAttribute(AttributeSet& attributeSet, const AttributePair& kv, std::string const &key) {
+	pairStore.keyStats.used(kv.keyIndex);
+	bool isHot = pairStore.keyStats.isHot(kv, key);
 	attributeSet.removePairWithKey(pairStore, kv.keyIndex);
 	attributeSet.addPair(pairStore.addPair(kv, isHot));
 }
@@ -258,100 +318,69 @@ AttributeIndex AttributeStore::add(AttributeSet &attributes) {
 	// TODO: there's probably a way to use C++ types to distinguish a finalized
 	// and non-finalized AttributeSet, which would make this safer.
 	attributes.finalize();
-
-	size_t hash = attributes.hash();
-	size_t shard = hash % ATTRIBUTE_SHARDS;
-
-	// We can't use the top 2 bits (see OutputObject's bitfields)
-	shard = shard >> 2;
-
-	std::lock_guard<std::mutex> lock(setsMutex[shard]);
-	lookups++;
-
-	// Do we already have it?
-	const auto& existing = setsMaps[shard].find(&attributes);
-	if (existing != setsMaps[shard].end()) return existing->second;
-
-	// No, so add and return the index
-	uint32_t offset = sets[shard].size();
-	if (offset >= (1 << (32 - SHARD_BITS)))
-		throw std::out_of_range("set shard overflow");
-	sets[shard].push_back(attributes);
-
-	const AttributeSet* ptr = &sets[shard][offset];
-	uint32_t rv = (shard << (32 - SHARD_BITS)) + offset;
-	setsMaps[shard][ptr] = rv;
-	return rv;
+	lookups.fetch_add(1, std::memory_order_relaxed);
+
+	return setIndex.findOrInsert(attributes, [this](uint32_t i) -> const AttributeSet& { return sets[i]; }, [&]() {
+		uint32_t offset = setCount.fetch_add(1);
+		if (offset >= MAX_ATTRIBUTE_SETS)
+			throw std::out_of_range("attribute set store overflow");
+		sets.store(offset, attributes);
+		return offset;
+	});
 }
 
 std::vector<const AttributePair*> AttributeStore::getUnsafe(AttributeIndex index) const {
-	// NB: This is unsafe if called before the PBF has been fully read.
-	// If called during the output phase, it's safe.
-
-	try {
-		uint32_t shard = index >> (32 - SHARD_BITS);
-		uint32_t offset = index & (~(~0u << (32 - SHARD_BITS)));
-
-		const AttributeSet& attrSet = sets[shard].at(offset);
-
-		const size_t n = attrSet.numPairs();
-
-		std::vector<const AttributePair*> rv;
-		for (size_t i = 0; i < n; i++) {
-			rv.push_back(&pairStore.getPairUnsafe(attrSet.getPair(i)));
-		}
-
-		return rv;
-	} catch (std::out_of_range &err) {
+	if (index >= setCount.load())
 		throw std::runtime_error("Failed to fetch attributes at index "+std::to_string(index));
+
+	std::vector<const AttributePair*> rv;
+	if (index < flattenedCount) {
+		for (uint32_t pairIndex : getSpan(index))
+			rv.push_back(&pairStore.getPair(pairIndex));
+	} else {
+		sets[index].forEachPair([&](uint32_t pairIndex) { rv.push_back(&pairStore.getPair(pairIndex)); });
 	}
+	return rv;
+}
+
+std::vector<AttributePair> AttributeStore::get(AttributeIndex index) const {
+	std::vector<AttributePair> rv;
+	for (const AttributePair* pair : getUnsafe(index))
+		rv.push_back(*pair);
+	return rv;
 }
 
 void AttributeStore::reportSize() const {
-	size_t numAttributeSets = 0;
-	for (int i = 0; i < ATTRIBUTE_SHARDS; i++)
-		numAttributeSets += sets[i].size();
-	std::cout << "Attributes: " << numAttributeSets << " sets from " << lookups.load() << " objects" << std::endl;
+	std::cout << "Attributes: " << setCount.load() << " sets from " << lookups.load() << " objects, "
+	          << pairStore.hotPairCount() << " hot and " << pairStore.coldPairCount() << " other pairs, "
+	          << AttributeStringStore::shared().size() << " strings" << std::endl;
+
+	if (verbose) {
+		// Busiest keys first
+		std::vector<uint16_t> keys;
+		std::vector<uint64_t> counts(keyStore.keys2indexSize + 1);
+		for (uint32_t k = 1; k <= keyStore.keys2indexSize; k++) { keys.push_back(k); counts[k] = pairStore.keyStats.count(k); }
+		std::sort(keys.begin(), keys.end(), [&](uint16_t a, uint16_t b) { return counts[a] > counts[b]; });
+		for (uint16_t k : keys) {
+			std::cout << "  " << keyStore.getKey(k) << ": used " << counts[k] << " times, "
+			          << pairStore.keyStats.distinct(k) << " values, "
+			          << pairStore.keyStats.bytes(k) / 1024 << "KB" << std::endl;
+		}
+	}
 
 	// Print detailed histogram of frequencies of attributes.
 	if (false) {
-		for (int i = 0; i < ATTRIBUTE_SHARDS; i++) {
-			std::cout << "pairsMaps[" << i << "] has " << pairStore.pairsMaps[i].size() << " entries" << std::endl;
-		}
-
 		std::map<uint32_t, uint32_t> tagCountDist;
-
-		for (size_t i = 0; i < pairStore.pairs.size(); i++) {
-			std::cout << "pairs[" << i << "] has size " << pairStore.pairs[i].size() << std::endl;
-			size_t j = 0;
-			for (const auto& ap: pairStore.pairs[i]) {
-				std::cout << "pairs[" << i << "][" << j << "] keyIndex=" << ap.keyIndex << " minzoom=" << (65+ap.minzoom) << " stringValue=" << ap.stringValue() << " floatValue=" << ap.floatValue() << " boolValue=" << ap.boolValue() << " key=" << keyStore.getKey(ap.keyIndex) << std::endl;
-				j++;
-
-			}
-		}
 		size_t pairs = 0;
 		std::map<uint32_t, size_t> uniques;
-		for (const auto& attributeSetSet: sets) {
-			for (const auto& attrSet: attributeSetSet) {
-				pairs += attrSet.numPairs();
-
-				try {
-					tagCountDist[attrSet.numPairs()]++;
-				} catch (std::out_of_range &err) {
-					tagCountDist[attrSet.numPairs()] = 1;
-				}
-
-				const size_t n = attrSet.numPairs();
-				for (size_t i = 0; i < n; i++) {
-					uint32_t attr = attrSet.getPair(i);
-					try {
-						uniques[attr]++;
-					} catch (std::out_of_range &err) {
-						uniques[attr] = 1;
-					}
-				}
-			}
+		for (uint32_t s = 0; s < setCount.load(); s++) {
+			const AttributeSet& attrSet = sets[s];
+			pairs += attrSet.numPairs();
+			tagCountDist[attrSet.numPairs()]++;
+
+			const size_t n = attrSet.numPairs();
+			for (size_t i = 0; i < n; i++)
+				uniques[attrSet.getPair(i)]++;
 		}
 		std::cout << "AttributePairs: " << pairs << ", unique: " << uniques.size() << std::endl;
 
@@ -363,7 +392,7 @@ void AttributeStore::reportSize() const {
 			const auto& pair = pairStore.getPair(entry.first);
 			// It's useful to occasionally confirm that anything with high freq has hot=1,
 			// and also that things with hot=1 have high freq.
-			std::cout << "attrpair freq= " << entry.second << " hot=" << (entry.first < 65536 ? 1 : 0) << " key=" << keyStore.getKey(pair.keyIndex) <<" stringValue=" << pair.stringValue() << " floatValue=" << pair.floatValue() << " boolValue=" << pair.boolValue() << std::endl;
+			std::cout << "attrpair freq= " << entry.second << " hot=" << (entry.first < HOT_PAIRS ? 1 : 0) << " key=" << keyStore.getKey(pair.keyIndex) <<" stringValue=" << (pair.hasStringValue() ? pair.stringValue() : boost::string_view()) << " floatValue=" << pair.floatValue() << " boolValue=" << pair.boolValue() << std::endl;
 		}
 	}
 }
@@ -372,4 +401,60 @@ void AttributeStore::finalize() {
 	finalized = true;
 	keyStore.finalize();
 	pairStore.finalize();
+
+	// With mapsplit, this is called after each tile is read, so only
+	// flatten the sets we haven't seen. Other tiles may still be being read:
+	// sets are numbered and stored under their shard's lock, so once any
+	// inserts under way have finished, every set numbered so far is stored.
+	const uint32_t count = setCount.load();
+	setIndex.waitForInserts();
+	setOffsets.reserve(count + 1);
+	setMinZooms.reserve(count);
+	for (uint32_t s = flattenedCount; s < count; s++) {
+		char maxMinZoom = 0;
+		sets[s].forEachPair([&](uint32_t pairIndex) {
+			setPairs.push_back(pairIndex);
+			maxMinZoom = std::max(maxMinZoom, pairStore.getPair(pairIndex).minzoom);
+		});
+		setOffsets.push_back(setPairs.size());
+		setMinZooms.push_back(maxMinZoom);
+	}
+	flattenedCount = count;
+}
+
+void AttributeStore::saveSnapshot(SnapshotWriter &out) const {
+	const uint32_t keyCount = keyStore.keys2indexSize.load();
+	out.put<uint32_t>(keyCount);
+	for (uint32_t k = 1; k <= keyCount; k++) out.putString(keyStore.getKeyUnsafe(k));
+	pairStore.saveSnapshot(out);
+
+	out.put<uint32_t>(flattenedCount);
+	out.putArray(setOffsets.data(), setOffsets.size() * sizeof(uint64_t));
+	out.put<uint64_t>(setPairs.size());
+	out.putArray(setPairs.data(), setPairs.size() * sizeof(uint32_t));
+	out.putArray(setMinZooms.data(), setMinZooms.size());
+}
+
+void AttributeStore::loadSnapshot(SnapshotReader &in) {
+	// Keys are numbered in the order they're first seen, so adding them in order gives the same numbers
+	const uint32_t keyCount = in.get<uint32_t>();
+	for (uint32_t k = 1; k <= keyCount; k++)
+		if (keyStore.key2index(in.getString()) != k) throw std::runtime_error("attribute keys were added before the snapshot was loaded");
+	pairStore.loadSnapshot(in);
+
+	const uint32_t count = in.get<uint32_t>();
+	const uint64_t *offsets = static_cast<const uint64_t*>(in.getArray((uint64_t(count) + 1) * sizeof(uint64_t)));
+	setOffsets.assign(offsets, offsets + count + 1);
+	const uint64_t pairCount = in.get<uint64_t>();
+	if (pairCount != setOffsets.back()) throw std::runtime_error("attribute sets don't match their pairs");
+	const uint32_t *setPairData = static_cast<const uint32_t*>(in.getArray(pairCount * sizeof(uint32_t)));
+	setPairs.assign(setPairData, setPairData + pairCount);
+	const char *minZooms = static_cast<const char*>(in.getArray(count));
+	setMinZooms.assign(minZooms, minZooms + count);
+
+	flattenedCount = count;
+	setCount = count;
+	finalized = true;
+	keyStore.finalize();
+	pairStore.finalize();
 }
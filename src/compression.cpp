@@ -0,0 +1,122 @@
+#include "compression.h"
+#include <stdexcept>
+#include <sstream>
+#include <cstring>
+
+#define MOD_GZIP_ZLIB_WINDOWSIZE 15
+#define MOD_GZIP_ZLIB_CFACTOR 9
+
+using namespace std;
+
+bool parseCompressionType(const string &name, CompressionType &type) {
+	if      (name == "gzip"   ) { type = CompressionType::Gzip; }
+	else if (name == "deflate") { type = CompressionType::Deflate; }
+	else if (name == "zstd"   ) { type = CompressionType::Zstd; }
+	else if (name == "none"   ) { type = CompressionType::None; }
+	else return false;
+	return true;
+}
+
+TileCompressor::TileCompressor() {
+#ifdef TM_ZSTD
+	zstdContext = nullptr;
+#endif
+}
+
+TileCompressor::~TileCompressor() {
+	for (auto &it : zlibStreams) {
+		deflateEnd(it.second);
+		delete it.second;
+	}
+#ifdef TM_LIBDEFLATE
+	for (auto &it : libdeflateCompressors) libdeflate_free_compressor(it.second);
+#endif
+#ifdef TM_ZSTD
+	if (zstdContext) ZSTD_freeCCtx(zstdContext);
+#endif
+}
+
+TileCompressor &TileCompressor::forThread() {
+	thread_local TileCompressor compressor;
+	return compressor;
+}
+
+void TileCompressor::compress(const string &input, CompressionType type, int level, string &output) {
+	switch (type) {
+		case CompressionType::None:
+			output = input;
+			return;
+
+		case CompressionType::Deflate:
+		case CompressionType::Gzip: {
+#ifdef TM_LIBDEFLATE
+			// libdeflate levels run from 1-12; treat zlib's "default" as 6
+			if (level < 0) level = 6;
+			auto it = libdeflateCompressors.find(level);
+			if (it == libdeflateCompressors.end()) {
+				libdeflate_compressor *c = libdeflate_alloc_compressor(level);
+				if (!c) throw runtime_error("libdeflate_alloc_compressor failed for level " + to_string(level));
+				it = libdeflateCompressors.emplace(level, c).first;
+			}
+			bool asGzip = type == CompressionType::Gzip;
+			size_t bound = asGzip ? libdeflate_gzip_compress_bound(it->second, input.size())
+			                      : libdeflate_zlib_compress_bound(it->second, input.size());
+			output.resize(bound);
+			size_t length = asGzip ? libdeflate_gzip_compress(it->second, input.data(), input.size(), &output[0], bound)
+			                       : libdeflate_zlib_compress(it->second, input.data(), input.size(), &output[0], bound);
+			if (length == 0) throw runtime_error("libdeflate compression failed");
+			output.resize(length);
+#else
+			compressZlib(input, type == CompressionType::Gzip, level, output);
+#endif
+			return;
+		}
+
+		case CompressionType::Zstd: {
+#ifdef TM_ZSTD
+			if (!zstdContext) zstdContext = ZSTD_createCCtx();
+			output.resize(ZSTD_compressBound(input.size()));
+			size_t length = ZSTD_compressCCtx(zstdContext, &output[0], output.size(), input.data(), input.size(),
+			                                  level < 0 ? ZSTD_CLEVEL_DEFAULT : level);
+			if (ZSTD_isError(length)) throw runtime_error(string("zstd compression failed: ") + ZSTD_getErrorName(length));
+			output.resize(length);
+			return;
+#else
+			throw runtime_error("tilemaker was built without zstd support");
+#endif
+		}
+	}
+}
+
+// Deflate in a single call, reusing a stream already set up for this format and level
+void TileCompressor::compressZlib(const string &input, bool asGzip, int level, string &output) {
+	z_stream *zs;
+	auto it = zlibStreams.find(make_pair(asGzip, level));
+	if (it == zlibStreams.end()) {
+		zs = new z_stream;
+		memset(zs, 0, sizeof(z_stream));
+		int windowBits = asGzip ? MOD_GZIP_ZLIB_WINDOWSIZE + 16 : MOD_GZIP_ZLIB_WINDOWSIZE;
+		if (deflateInit2(zs, level, Z_DEFLATED, windowBits, MOD_GZIP_ZLIB_CFACTOR, Z_DEFAULT_STRATEGY) != Z_OK) {
+			delete zs;
+			throw runtime_error("deflateInit2 failed while compressing.");
+		}
+		zlibStreams[make_pair(asGzip, level)] = zs;
+	} else {
+		zs = it->second;
+		deflateReset(zs);
+	}
+
+	output.resize(deflateBound(zs, input.size()));
+	zs->next_in = (Bytef*)input.data();
+	zs->avail_in = input.size();
+	zs->next_out = reinterpret_cast<Bytef*>(&output[0]);
+	zs->avail_out = output.size();
+
+	int ret = deflate(zs, Z_FINISH);
+	if (ret != Z_STREAM_END) {
+		std::ostringstream oss;
+		oss << "Exception during zlib compression: (" << ret << ") " << (zs->msg ? zs->msg : "");
+		throw(std::runtime_error(oss.str()));
+	}
+	output.resize(zs->total_out);
+}
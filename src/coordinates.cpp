@@ -30,6 +30,13 @@ double lat2tileyf(double lat, uint8_t z) { return latp2tileyf(lat2latp(lat), z);
 uint32_t lon2tilex(double lon, uint8_t z) { return lon2tilexf(lon, z); }
 uint32_t latp2tiley(double latp, uint8_t z) { return latp2tileyf(latp, z); }
 uint32_t lat2tiley(double lat, uint8_t z) { return lat2tileyf(lat, z); }
+// Clamped before converting, as a negative tile would wrap
+static uint32_t clampTile(double tile, uint8_t z) { return std::min(std::max(0.0, tile), scalbn(1.0, (int)z) - 1); }
+uint32_t lon2tilexClamped(double lon, uint8_t z) { return clampTile(lon2tilexf(lon, z), z); }
+uint32_t latp2tileyClamped(double latp, uint8_t z) { return clampTile(latp2tileyf(latp, z), z); }
+// The last tile starting before the edge, so one that only touches it is left out
+uint32_t lon2tilexClampedEnd(double lon, uint8_t z) { return clampTile(ceil(lon2tilexf(lon, z)) - 1, z); }
+uint32_t latp2tileyClampedEnd(double latp, uint8_t z) { return clampTile(ceil(latp2tileyf(latp, z)) - 1, z); }
 double tilex2lon(uint32_t x, uint8_t z) { return scalbn(x, -(int)z) * 360.0 - 180.0; }
 double tiley2latp(uint32_t y, uint8_t z) { return 180.0 - scalbn(y, -(int)z) * 360.0; }
 double tiley2lat(uint32_t y, uint8_t z) { return latp2lat(tiley2latp(y, z)); }
@@ -9,94 +9,143 @@
 #include <boost/range/adaptor/transformed.hpp>
 #include <boost/range/irange.hpp>
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
 typedef boost::geometry::model::segment<Point> simplify_segment;
 typedef boost::geometry::index::rtree<simplify_segment, boost::geometry::index::quadratic<16>> simplify_rtree;
 
+// Squared distance from each of points [first, last) to the segment a-b, into out.
+// The same sums as boost's projected_point strategy, so the results are
+// identical to comparable_distance; written without early exits, so the
+// compiler can vectorize it.
 template<typename GeometryType>
-static inline void simplify_ring(GeometryType const &input, GeometryType &output, double distance, simplify_rtree const &outer_rtree = simplify_rtree())
+static inline void segment_distances(GeometryType const &input, std::size_t first, std::size_t last,
+                                     Point const &a, Point const &b, std::vector<double> &out)
 {
-    std::deque<std::size_t> nodes(input.size());
-    for(std::size_t i = 0; i < input.size(); ++i)
-        nodes[i] = i;
-
-	simplify_rtree rtree(
-		boost::irange<std::size_t>(0, input.size() - 1)
-		| boost::adaptors::transformed(std::function<simplify_segment(std::size_t)>([&input](std::size_t i) {
-			return simplify_segment(input[i], input[i+1]);
-		})));
-
-    Box envelope; boost::geometry::envelope(input, envelope);
-
-	for(std::size_t pq = input.size() - 2; pq--; ) {
-        auto entry = pq;
-
-        auto start = nodes[entry];
-        auto middle = nodes[entry + 1];
-        auto end = nodes[entry + 2];
-
-        if (input[middle].x()==envelope.min_corner().x() ||
-            input[middle].y()==envelope.min_corner().y() ||
-            input[middle].x()==envelope.max_corner().x() ||
-            input[middle].y()==envelope.max_corner().y()) continue;
-
-        simplify_segment line(input[start], input[end]);
+	const double vx = b.x() - a.x(), vy = b.y() - a.y();
+	const double c2 = vx * vx + vy * vy;
+	out.resize(last - first);
+	for (std::size_t i = first; i < last; ++i) {
+		const double wx = input[i].x() - a.x(), wy = input[i].y() - a.y();
+		const double c1 = wx * vx + wy * vy;
+		const double t = c1 / c2;
+		const double px = c1 <= 0 ? a.x() : c2 <= c1 ? b.x() : a.x() + t * vx;
+		const double py = c1 <= 0 ? a.y() : c2 <= c1 ? b.y() : a.y() + t * vy;
+		const double dx = input[i].x() - px, dy = input[i].y() - py;
+		out[i - first] = dx * dx + dy * dy;
+	}
+}
 
-        double max_comp_distance = 0.0;
-		std::size_t max_comp_i = start + 1;
+// Work space for simplify_ring, kept per thread so big rings don't allocate every tile
+struct simplify_scratch {
+	std::vector<std::size_t> kept;
+	std::vector<double> distances;
+};
+static thread_local simplify_scratch scratch;
+
+// Visit the ring's points from the end, taking out each one that is within
+// distance of the line joining its neighbours. Unless fast, a point is only
+// taken out if the new line doesn't cross another segment of this ring or of
+// the rings in other_rtree, so the topology is kept.
+//
+// Points at the end of the ring that are kept are on a stack (top: the next
+// point after the current one), so taking one out doesn't move the others.
+template<typename GeometryType>
+static inline void simplify_ring(GeometryType const &input, GeometryType &output, double distance,
+                                 bool fast, simplify_rtree const &outer_rtree = simplify_rtree())
+{
+	const std::size_t n = input.size();
+	if (n < 3) { output.assign(input.begin(), input.end()); return; }
+
+	std::vector<std::size_t> &kept = scratch.kept;
+	kept.clear();
+	kept.push_back(n - 1);
+	kept.push_back(n - 2);
+
+	simplify_rtree rtree;
+	if (!fast) {
+		rtree = simplify_rtree(
+			boost::irange<std::size_t>(0, n - 1)
+			| boost::adaptors::transformed(std::function<simplify_segment(std::size_t)>([&input](std::size_t i) {
+				return simplify_segment(input[i], input[i+1]);
+			})));
+	}
 
-        for(auto i = start + 1; i < end; ++i) {
-			auto comp_distance = boost::geometry::comparable_distance(line, input[i]);
-            if(comp_distance > max_comp_distance) {
-				max_comp_distance = comp_distance;
-				max_comp_i = i;
+	Box envelope; boost::geometry::envelope(input, envelope);
+
+	for (std::size_t entry = n - 2; entry--; ) {
+		const std::size_t start = entry;
+		const std::size_t middle = kept[kept.size() - 1];
+		const std::size_t end = kept[kept.size() - 2];
+
+		if (input[middle].x()==envelope.min_corner().x() ||
+		    input[middle].y()==envelope.min_corner().y() ||
+		    input[middle].x()==envelope.max_corner().x() ||
+		    input[middle].y()==envelope.max_corner().y()) { kept.push_back(start); continue; }
+
+		segment_distances(input, start + 1, end, input[start], input[end], scratch.distances);
+		double maxDistance = 0.0;
+		for (double d : scratch.distances) maxDistance = std::max(maxDistance, d);
+
+		if (std::sqrt(maxDistance) < distance) {
+			bool clear = true;
+			simplify_segment line(input[start], input[end]);
+			if (!fast) {
+				std::size_t query_count = 0;
+				for (auto const &result: rtree | boost::geometry::index::adaptors::queried(boost::geometry::index::intersects(line)))
+					++query_count;
+				for (auto const &result: outer_rtree | boost::geometry::index::adaptors::queried(boost::geometry::index::intersects(line)))
+					++query_count;
+				std::size_t expected_count = std::min<std::size_t>(4, start + kept.size());
+				clear = query_count == expected_count;
+			}
+			if (clear) {
+				kept.pop_back();
+				if (!fast) {
+					rtree.remove(simplify_segment(input[start], input[middle]));
+					rtree.remove(simplify_segment(input[middle], input[end]));
+					rtree.insert(line);
+				}
 			}
 		}
+		kept.push_back(start);
+	}
+
+	output.resize(kept.size());
+	for (std::size_t i = 0; i < kept.size(); ++i)
+		output[i] = input[kept[kept.size() - 1 - i]];
+}
 
-        if(boost::geometry::distance(line, input[max_comp_i]) < distance) {
-			std::size_t query_count = 0;
-            for(auto const &result: rtree | boost::geometry::index::adaptors::queried(boost::geometry::index::intersects(line)))
-				++query_count;
-            for(auto const &result: outer_rtree | boost::geometry::index::adaptors::queried(boost::geometry::index::intersects(line)))
-				++query_count;
-
-			std::size_t expected_count = std::min<std::size_t>(4, nodes.size() - 1);
-            if(query_count == expected_count) {
-                nodes.erase(nodes.begin() + entry + 1);
-                rtree.remove(simplify_segment(input[start], input[middle]));
-                rtree.remove(simplify_segment(input[middle], input[end]));
-                rtree.insert(line);
-            }
-        }
-    }
-
-	output.resize(nodes.size());
-	for(std::size_t i = 0; i < nodes.size(); ++i)
-		output[i] = input[nodes[i]];
-}
-
-Polygon simplify(Polygon const &p, double max_distance) 
+Polygon simplify(Polygon const &p, double max_distance, bool fast)
 {
 	Polygon result;
 
-	simplify_rtree outer_rtree(
-		boost::irange<std::size_t>(0, p.outer().size() - 1)
-		| boost::adaptors::transformed(std::function<simplify_segment(std::size_t)>([&p](std::size_t i) {
-			return simplify_segment(p.outer()[i], p.outer()[i+1]);
-		})));
+	simplify_rtree outer_rtree;
+	if (!fast) {
+		outer_rtree = simplify_rtree(
+			boost::irange<std::size_t>(0, p.outer().size() - 1)
+			| boost::adaptors::transformed(std::function<simplify_segment(std::size_t)>([&p](std::size_t i) {
+				return simplify_segment(p.outer()[i], p.outer()[i+1]);
+			})));
+	}
 
 	for(auto const &inner: p.inners()) {
 		Ring new_inner;
-		simplify_ring(inner, new_inner, max_distance, outer_rtree);
+		simplify_ring(inner, new_inner, max_distance, fast, outer_rtree);
 
 		std::reverse(new_inner.begin(), new_inner.end());
 		if(new_inner.size() > 3 && boost::geometry::perimeter(new_inner) > 3 * max_distance) {
-			simplify_combine(result.inners(), std::move(new_inner));
+			if (fast) result.inners().push_back(std::move(new_inner));
+			else simplify_combine(result.inners(), std::move(new_inner));
 		}
 	}
 
 	simplify_rtree inners_rtree;
 	for(auto &inner: result.inners()) {
 		std::reverse(inner.begin(), inner.end());
+		if (fast) continue;
 
 		inners_rtree.insert(
 			boost::irange<std::size_t>(0, inner.size() - 1)
@@ -105,7 +154,7 @@ Polygon simplify(Polygon const &p, double max_distance)
 			})));
 	}
 
-	simplify_ring(p.outer(), result.outer(), max_distance, inners_rtree);
+	simplify_ring(p.outer(), result.outer(), max_distance, fast, inners_rtree);
 	if(result.outer().size() > 3 && boost::geometry::perimeter(result.outer()) > 3 * max_distance) {
 		return result;
 	}
@@ -121,14 +170,15 @@ Linestring simplify(Linestring const &ls, double max_distance)
 	return result;
 }
 
-MultiPolygon simplify(MultiPolygon const &mp, double max_distance) 
+MultiPolygon simplify(MultiPolygon const &mp, double max_distance, bool fast)
 {
 	MultiPolygon result_mp;
 	for(auto const &p: mp) {
-		Polygon new_p = simplify(p, max_distance);
+		Polygon new_p = simplify(p, max_distance, fast);
 		if(!new_p.outer().empty()) {
 			geom::correct(new_p);
-			simplify_combine(result_mp, std::move(new_p));
+			if (fast) result_mp.push_back(std::move(new_p));
+			else simplify_combine(result_mp, std::move(new_p));
 		}
 	}
 
@@ -144,6 +194,120 @@ void make_valid(MultiPolygon &mp)
 	mp = result;
 }
 
+// ---------------
+// Quick validity check
+// Works on the OSM coordinates (in 1e-7 degrees) the geometry was made from,
+// so the tests are exact
+
+// Segment pairs compared per segment, on average, before leaving it to boost
+#define SIMPLE_VALID_MAX_TESTS 32
+// Largest span of coordinates for which the cross products fit in int64_t
+#define SIMPLE_VALID_MAX_SPAN (int64_t(1) << 31)
+
+struct FixedPoint {
+	int64_t x, y;
+	bool operator==(FixedPoint const &other) const { return x==other.x && y==other.y; }
+};
+
+// Returns false if the points aren't whole numbers of 1e-7 degrees, or are too far apart
+static bool to_fixed(std::vector<Point> const &points, std::vector<FixedPoint> &out) {
+	out.clear();
+	int64_t minX = INT64_MAX, maxX = INT64_MIN, minY = INT64_MAX, maxY = INT64_MIN;
+	for (auto const &p : points) {
+		if (!std::isfinite(p.x()) || !std::isfinite(p.y()) || std::abs(p.x()) > 1000 || std::abs(p.y()) > 1000) return false;
+		FixedPoint f { std::llround(p.x() * 10000000.0), std::llround(p.y() * 10000000.0) };
+		if (f.x / 10000000.0 != p.x() || f.y / 10000000.0 != p.y()) return false;
+		minX = std::min(minX, f.x); maxX = std::max(maxX, f.x);
+		minY = std::min(minY, f.y); maxY = std::max(maxY, f.y);
+		out.push_back(f);
+	}
+	return maxX - minX < SIMPLE_VALID_MAX_SPAN && maxY - minY < SIMPLE_VALID_MAX_SPAN;
+}
+
+// 1 if a-b-c turns left, -1 if right, 0 if they're in a line
+static inline int orientation(FixedPoint const &a, FixedPoint const &b, FixedPoint const &c) {
+	int64_t cross = (b.x-a.x)*(c.y-a.y) - (b.y-a.y)*(c.x-a.x);
+	return (cross > 0) - (cross < 0);
+}
+
+// Whether q-a and q-b, from a point they share, overlap: they're in a line, going the same way
+static inline bool overlaps_from(FixedPoint const &q, FixedPoint const &a, FixedPoint const &b) {
+	return orientation(q, a, b) == 0 && (a.x-q.x)*(b.x-q.x) + (a.y-q.y)*(b.y-q.y) > 0;
+}
+
+// Given c is in line with a-b, whether it's within the segment
+static inline bool within_segment(FixedPoint const &a, FixedPoint const &b, FixedPoint const &c) {
+	return std::min(a.x,b.x) <= c.x && c.x <= std::max(a.x,b.x) && std::min(a.y,b.y) <= c.y && c.y <= std::max(a.y,b.y);
+}
+
+// Whether segments a-b and c-d cross or touch
+static bool segments_meet(FixedPoint const &a, FixedPoint const &b, FixedPoint const &c, FixedPoint const &d) {
+	const int o1 = orientation(a,b,c), o2 = orientation(a,b,d), o3 = orientation(c,d,a), o4 = orientation(c,d,b);
+	if (o1 != o2 && o3 != o4) return true;
+	return (o1 == 0 && within_segment(a,b,c)) || (o2 == 0 && within_segment(a,b,d)) ||
+	       (o3 == 0 && within_segment(c,d,a)) || (o4 == 0 && within_segment(c,d,b));
+}
+
+// A closed ring, with no repeated points or spikes, that doesn't touch itself
+// and goes round the right way. Segments are swept in order of their left
+// end, and each is only compared with those whose x ranges overlap it.
+static bool is_simple_ring(std::vector<FixedPoint> const &ring, bool clockwise) {
+	const size_t n = ring.size();
+	if (n < 4 || !(ring.front() == ring.back())) return false;
+	for (size_t i = 1; i < n; i++) if (ring[i] == ring[i-1]) return false;
+
+	// The orientation at the lowest of the leftmost points is the ring's
+	const size_t segments = n - 1;
+	size_t extreme = 0;
+	for (size_t i = 1; i < segments; i++)
+		if (ring[i].x < ring[extreme].x || (ring[i].x == ring[extreme].x && ring[i].y < ring[extreme].y)) extreme = i;
+	const int turn = orientation(ring[extreme == 0 ? segments - 1 : extreme - 1], ring[extreme], ring[extreme + 1]);
+	if (turn != (clockwise ? -1 : 1)) return false;
+
+	thread_local std::vector<size_t> order, active;
+	order.resize(segments);
+	for (size_t i = 0; i < segments; i++) order[i] = i;
+	auto minX = [&](size_t s) { return std::min(ring[s].x, ring[s+1].x); };
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return minX(a) < minX(b); });
+
+	active.clear();
+	size_t tests = 0;
+	for (size_t s : order) {
+		FixedPoint const &a = ring[s], &b = ring[s+1];
+		const int64_t left = minX(s), minY = std::min(a.y,b.y), maxY = std::max(a.y,b.y);
+		active.erase(std::remove_if(active.begin(), active.end(),
+			[&](size_t t) { return std::max(ring[t].x, ring[t+1].x) < left; }), active.end());
+		for (size_t t : active) {
+			FixedPoint const &c = ring[t], &d = ring[t+1];
+			if (std::max(c.y,d.y) < minY || std::min(c.y,d.y) > maxY) continue;
+			if (++tests > SIMPLE_VALID_MAX_TESTS * segments) return false;
+			// Neighbouring segments share a point, and mustn't double back over each other
+			if (t == s + 1 || (s == segments - 1 && t == 0)) { if (overlaps_from(b, a, d)) return false; }
+			else if (s == t + 1 || (t == segments - 1 && s == 0)) { if (overlaps_from(a, b, c)) return false; }
+			else if (segments_meet(a, b, c, d)) return false;
+		}
+		active.push_back(s);
+	}
+	return true;
+}
+
+bool is_simple_valid(MultiPolygon const &mp) {
+	if (mp.size() != 1 || !mp[0].inners().empty()) return false;
+	thread_local std::vector<FixedPoint> ring;
+	return to_fixed(mp[0].outer(), ring) &&
+	       is_simple_ring(ring, geom::point_order<Polygon>::value == geom::clockwise);
+}
+
+bool is_simple_valid(Linestring const &ls) {
+	thread_local std::vector<FixedPoint> line;
+	if (ls.size() < 2 || !to_fixed(ls, line)) return false;
+	for (size_t i = 1; i < line.size(); i++) {
+		if (line[i] == line[i-1]) return false;
+		if (i > 1 && overlaps_from(line[i-1], line[i-2], line[i])) return false;
+	}
+	return true;
+}
+
 // ---------------
 // Sutherland-Hodgeman clipper
 // ported from Volodymyr Agafonkin's https://github.com/mapbox/lineclip
@@ -172,6 +336,16 @@ char bit_code(Point const &p, Box const &bbox) {
 	return code;
 }
 
+// Does the segment a-b touch the bbox? The bit codes settle most segments
+// (Cohen-Sutherland), leaving only those that cross a corner region to boost
+bool segment_intersects(Point const &a, Point const &b, Box const &bbox) {
+	char codeA = bit_code(a, bbox), codeB = bit_code(b, bbox);
+	if (codeA == 0 || codeB == 0) return true;  // an end is inside
+	if (codeA & codeB) return false;            // both ends beyond the same edge
+	if ((codeA | codeB) == 3 || (codeA | codeB) == 12) return true; // crosses straight over
+	return geom::intersects(Linestring({ a, b }), bbox);
+}
+
 // Sutherland-Hodgeman polygon clipping algorithm
 void fast_clip(Ring &points, Box const &bbox) {
 	// clip against each side of the clip rectangle
@@ -195,15 +369,57 @@ void fast_clip(Ring &points, Box const &bbox) {
 	}
 }
 
+// Remove repeated points, such as where a ring was clipped to a bbox corner
+static void remove_repeated_points(Ring &ring) {
+	ring.erase(std::unique(ring.begin(), ring.end(),
+		[](Point const &a, Point const &b) { return a.x()==b.x() && a.y()==b.y(); }),
+		ring.end());
+	if (ring.size() < 4) ring.clear(); // collapsed to a line or point
+}
+
+// Where a concave ring leaves the bbox and comes back, Sutherland-Hodgman joins
+// the pieces with edges along the bbox. That's fine unless two such edges
+// overlap, which makes the polygon invalid; look for that here.
+static void collect_bbox_edges(Ring const &ring, Box const &bbox, std::vector<std::pair<double,double>> (&edges)[4]) {
+	for (size_t i = 1; i < ring.size(); i++) {
+		Point const &a = ring[i-1], &b = ring[i];
+		if      (a.x()==b.x() && a.x()==bbox.min_corner().x()) edges[0].emplace_back(std::min(a.y(),b.y()), std::max(a.y(),b.y()));
+		else if (a.x()==b.x() && a.x()==bbox.max_corner().x()) edges[1].emplace_back(std::min(a.y(),b.y()), std::max(a.y(),b.y()));
+		else if (a.y()==b.y() && a.y()==bbox.min_corner().y()) edges[2].emplace_back(std::min(a.x(),b.x()), std::max(a.x(),b.x()));
+		else if (a.y()==b.y() && a.y()==bbox.max_corner().y()) edges[3].emplace_back(std::min(a.x(),b.x()), std::max(a.x(),b.x()));
+	}
+}
+
+static bool has_overlapping_edges(std::vector<std::pair<double,double>> (&edges)[4]) {
+	for (auto &side : edges) {
+		std::sort(side.begin(), side.end());
+		for (size_t i = 1; i < side.size(); i++)
+			if (side[i].first < side[i-1].second) return true;
+	}
+	return false;
+}
+
 // Wrappers for polygon/multipolygon
 void fast_clip(Polygon &polygon, Box const &bbox) {
+	// Nothing to do if the polygon is wholly inside or outside the bbox
+	Box envelope;
+	geom::envelope(polygon.outer(), envelope);
+	if (geom::covered_by(envelope, bbox)) return;
+	if (!geom::intersects(envelope, bbox)) {
+		polygon.outer().clear();
+		polygon.inners().resize(0);
+		return;
+	}
+
 	fast_clip(polygon.outer(), bbox);
+	remove_repeated_points(polygon.outer());
 	if (polygon.outer().empty()) {
 		polygon.inners().resize(0);
 		return;
 	}
 	for (auto &inner: polygon.inners()) {
 		fast_clip(inner, bbox);
+		remove_repeated_points(inner);
 	}
 	polygon.inners().erase(std::remove_if(
 		polygon.inners().begin(), polygon.inners().end(), 
@@ -211,7 +427,7 @@ void fast_clip(Polygon &polygon, Box const &bbox) {
 		polygon.inners().end());
 }
 
-void fast_clip(MultiPolygon &mp, Box const &bbox) {
+bool fast_clip(MultiPolygon &mp, Box const &bbox) {
 	for (auto &polygon: mp) {
 		fast_clip(polygon, bbox);
 	}
@@ -219,4 +435,12 @@ void fast_clip(MultiPolygon &mp, Box const &bbox) {
 		mp.begin(), mp.end(), 
 		[](const Polygon &poly) -> bool { return poly.outer().empty(); }),
 		mp.end());
+
+	std::vector<std::pair<double,double>> edges[4];
+	for (auto const &polygon: mp) {
+		collect_bbox_edges(polygon.outer(), bbox, edges);
+		for (auto const &inner: polygon.inners())
+			collect_bbox_edges(inner, bbox, edges);
+	}
+	return !has_overlapping_edges(edges);
 }
@@ -1,4 +1,5 @@
 #include "helpers.h"
+#include "compression.h"
 #include <string>
 #include <stdexcept>
 #include <iostream>
@@ -19,48 +20,9 @@ using namespace std;
 std::string compress_string(const std::string& str,
                             int compressionlevel,
                             bool asGzip) {
-    z_stream zs;                        // z_stream is zlib's control structure
-    memset(&zs, 0, sizeof(zs));
-
-	if (asGzip) {
-		if (deflateInit2(&zs, compressionlevel, Z_DEFLATED,
-		                MOD_GZIP_ZLIB_WINDOWSIZE + 16, MOD_GZIP_ZLIB_CFACTOR, Z_DEFAULT_STRATEGY) != Z_OK)
-	        throw(std::runtime_error("deflateInit2 failed while compressing."));
-	} else {
-	    if (deflateInit(&zs, compressionlevel) != Z_OK)
-	        throw(std::runtime_error("deflateInit failed while compressing."));
-	}
-
-    zs.next_in = (Bytef*)str.data();
-    zs.avail_in = str.size();           // set the z_stream's input
-
-    int ret;
-    char outbuffer[32768];
-    std::string outstring;
-
-    // retrieve the compressed bytes blockwise
-    do {
-        zs.next_out = reinterpret_cast<Bytef*>(outbuffer);
-        zs.avail_out = sizeof(outbuffer);
-
-        ret = deflate(&zs, Z_FINISH);
-
-        if (outstring.size() < zs.total_out) {
-            // append the block to the output string
-            outstring.append(outbuffer,
-                             zs.total_out - outstring.size());
-        }
-    } while (ret == Z_OK);
-
-    deflateEnd(&zs);
-
-    if (ret != Z_STREAM_END) {          // an error occurred that was not EOF
-        std::ostringstream oss;
-        oss << "Exception during zlib compression: (" << ret << ") " << zs.msg;
-        throw(std::runtime_error(oss.str()));
-    }
-
-    return outstring;
+	std::string outstring;
+	TileCompressor::forThread().compress(str, asGzip ? CompressionType::Gzip : CompressionType::Deflate, compressionlevel, outstring);
+	return outstring;
 }
 
 // Decompress an STL string using zlib and return the original data.
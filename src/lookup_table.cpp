@@ -0,0 +1,44 @@
+#include "lookup_table.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "rapidjson/document.h"
+
+using namespace std;
+
+std::mutex LookupTable::mutex;
+std::map<std::string, std::unique_ptr<LookupTable>> LookupTable::tables;
+
+LookupTable *LookupTable::Load(const string &filename) {
+	lock_guard<std::mutex> lock(mutex);
+	auto it = tables.find(filename);
+	if (it != tables.end()) return it->second.get();
+
+	ifstream infile(filename);
+	if (!infile) throw runtime_error("Couldn't open lookup table " + filename);
+	stringstream contents;
+	contents << infile.rdbuf();
+	rapidjson::Document document;
+	document.Parse(contents.str().c_str());
+	if (document.HasParseError() || !document.IsObject())
+		throw runtime_error("Lookup table " + filename + " isn't a JSON object");
+
+	unique_ptr<LookupTable> table(new LookupTable());
+	for (auto member = document.MemberBegin(); member != document.MemberEnd(); ++member) {
+		if (!member->value.IsString())
+			throw runtime_error("Lookup table " + filename + " has a value that isn't a string, for " + member->name.GetString());
+		table->values.emplace(member->name.GetString(), member->value.GetString());
+	}
+	cout << "Read " << table->values.size() << " entries from lookup table " << filename << endl;
+	return (tables[filename] = std::move(table)).get();
+}
+
+string LookupTable::Get(const string &key) const {
+	auto it = values.find(key);
+	return it == values.end() ? string() : it->second;
+}
+
+bool LookupTable::Has(const string &key) const {
+	return values.count(key) > 0;
+}
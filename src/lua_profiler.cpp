@@ -0,0 +1,145 @@
+#include "lua_profiler.h"
+#include "tag_map.h"
+#include <algorithm>
+#include <cstdio>
+
+using namespace std;
+
+// Keys that decide what an object is, most telling first
+static const char *primaryKeys[] = {
+	"building", "highway", "railway", "waterway", "aeroway", "landuse", "natural", "leisure", "amenity",
+	"shop", "tourism", "historic", "man_made", "power", "barrier", "boundary", "place", "route", "type"
+};
+static const unsigned int primaryKeyCount = sizeof(primaryKeys) / sizeof(primaryKeys[0]);
+// Objects with none of them are counted together, after the keys
+static const unsigned int tagCount = primaryKeyCount + 1;
+
+static const char *functionNames[] = {
+	"node_function", "way_function", "relation_function", "relation_scan_function",
+	"attribute_function", "node_batch_function", "way_batch_function"
+};
+static const char *helperNames[] = {
+	"Layer", "LayerAsCentroid", "Intersects", "FindIntersecting", "FindCovering", "CoveredBy",
+	"AreaIntersecting", "Area", "Length", "Centroid"
+};
+
+struct LuaProfiler::ThreadStats {
+	Stat calls[size_t(LuaFunction::Count)][tagCount];
+	Stat helpers[size_t(LuaHelper::Count)];
+	vector<Stat> layers;			// calls = features written, ns = time of the calls that wrote them
+	vector<unsigned int> callLayers;	// layers written by the call being timed
+	bool inCall = false;
+};
+
+std::atomic<bool> LuaProfiler::enabled(false);
+std::mutex LuaProfiler::mutex;
+std::vector<std::unique_ptr<LuaProfiler::ThreadStats>> LuaProfiler::threads;
+thread_local LuaProfiler::ThreadStats *LuaProfiler::stats = nullptr;
+
+LuaProfiler::ThreadStats &LuaProfiler::threadStats() {
+	if (!stats) {
+		lock_guard<std::mutex> lock(mutex);
+		threads.emplace_back(new ThreadStats());
+		stats = threads.back().get();
+	}
+	return *stats;
+}
+
+unsigned int LuaProfiler::primaryTag(const TagMap *tags) {
+	if (!tags) return primaryKeyCount;
+	unsigned int best = primaryKeyCount;
+	for (size_t i = 0; i < tags->size(); i++) {
+		boost::string_view key = tags->key(i);
+		for (unsigned int k = 0; k < best; k++)
+			if (key == primaryKeys[k]) { best = k; break; }
+	}
+	return best;
+}
+
+void LuaProfiler::beginCall() {
+	ThreadStats &s = threadStats();
+	s.callLayers.clear();
+	s.inCall = true;
+}
+
+void LuaProfiler::endCall(LuaFunction function, unsigned int tag, uint64_t ns) {
+	ThreadStats &s = threadStats();
+	s.calls[size_t(function)][tag].add(ns);
+	for (unsigned int layer : s.callLayers) s.layers[layer].ns += ns;
+	s.inCall = false;
+}
+
+void LuaProfiler::addHelper(LuaHelper helper, uint64_t ns) {
+	threadStats().helpers[size_t(helper)].add(ns);
+}
+
+void LuaProfiler::layerWritten(unsigned int layer) {
+	if (!active()) return;
+	ThreadStats &s = threadStats();
+	if (s.layers.size() <= layer) s.layers.resize(layer + 1);
+	s.layers[layer].calls++;
+	// Batched results are written after the call, so only their features are counted
+	if (s.inCall && find(s.callLayers.begin(), s.callLayers.end(), layer) == s.callLayers.end())
+		s.callLayers.push_back(layer);
+}
+
+namespace {
+	struct Row { string name, detail; uint64_t calls, ns; };
+
+	void printRows(ostream &out, vector<Row> rows, const char *heading, const char *detailHeading, const char *callsHeading, uint64_t totalNs) {
+		rows.erase(remove_if(rows.begin(), rows.end(), [](const Row &r) { return r.calls == 0; }), rows.end());
+		if (rows.empty()) return;
+		sort(rows.begin(), rows.end(), [](const Row &a, const Row &b) { return a.ns > b.ns; });
+		char line[160];
+		snprintf(line, sizeof(line), "\n%-24s %-12s %12s %10s %10s %7s\n", heading, detailHeading, callsHeading, "seconds", "us each", "share");
+		out << line;
+		for (const Row &r : rows) {
+			snprintf(line, sizeof(line), "%-24s %-12s %12llu %10.2f %10.2f %6.1f%%\n",
+			         r.name.c_str(), r.detail.c_str(), (unsigned long long)r.calls, r.ns / 1e9,
+			         r.ns / 1e3 / r.calls, totalNs ? r.ns * 100.0 / totalNs : 0.0);
+			out << line;
+		}
+	}
+}
+
+void LuaProfiler::report(ostream &out, const vector<string> &layerNames) {
+	lock_guard<std::mutex> lock(mutex);
+	ThreadStats total;
+	for (const auto &thread : threads) {
+		for (size_t f = 0; f < size_t(LuaFunction::Count); f++)
+			for (size_t t = 0; t < tagCount; t++) {
+				total.calls[f][t].calls += thread->calls[f][t].calls;
+				total.calls[f][t].ns += thread->calls[f][t].ns;
+			}
+		for (size_t h = 0; h < size_t(LuaHelper::Count); h++) {
+			total.helpers[h].calls += thread->helpers[h].calls;
+			total.helpers[h].ns += thread->helpers[h].ns;
+		}
+		if (total.layers.size() < thread->layers.size()) total.layers.resize(thread->layers.size());
+		for (size_t l = 0; l < thread->layers.size(); l++) {
+			total.layers[l].calls += thread->layers[l].calls;
+			total.layers[l].ns += thread->layers[l].ns;
+		}
+	}
+
+	vector<Row> calls, layers, helpers;
+	uint64_t totalNs = 0, totalCalls = 0;
+	for (size_t f = 0; f < size_t(LuaFunction::Count); f++)
+		for (size_t t = 0; t < tagCount; t++) {
+			const Stat &s = total.calls[f][t];
+			calls.push_back(Row { functionNames[f], t < primaryKeyCount ? primaryKeys[t] : "(other)", s.calls, s.ns });
+			totalNs += s.ns;
+			totalCalls += s.calls;
+		}
+	for (size_t l = 0; l < total.layers.size(); l++)
+		layers.push_back(Row { l < layerNames.size() ? layerNames[l] : to_string(l), "", total.layers[l].calls, total.layers[l].ns });
+	for (size_t h = 0; h < size_t(LuaHelper::Count); h++)
+		helpers.push_back(Row { helperNames[h], "", total.helpers[h].calls, total.helpers[h].ns });
+
+	char line[120];
+	snprintf(line, sizeof(line), "\nLua profile: %.2f seconds in %llu calls, on all threads\n", totalNs / 1e9, (unsigned long long)totalCalls);
+	out << line;
+	printRows(out, calls, "Function", "Primary tag", "calls", totalNs);
+	printRows(out, layers, "Layer", "", "features", totalNs);
+	printRows(out, helpers, "Helper", "", "calls", totalNs);
+}
@@ -1,7 +1,9 @@
 #include "mbtiles.h"
 #include "helpers.h"
+#include "trace.h"
 #include <iostream>
 #include <cmath>
+#include <algorithm>
 #include <boost/iostreams/filtering_streambuf.hpp>
 #include <boost/iostreams/copy.hpp>
 #include <boost/iostreams/stream.hpp>
@@ -13,12 +15,32 @@ using namespace sqlite;
 using namespace std;
 namespace bio = boost::iostreams;
 
+// Images up to this size are checked for duplicates before being written
+#define MBTILES_DEDUPE_MAX_SIZE 1024
+
+// Tile data that can be queued for the writer thread before saveTile blocks
+#define MBTILES_MAX_PENDING_BYTES (128 * 1024 * 1024)
+
+// Existing tiles that can be read ahead for --merge, and how many are read at once
+#define MBTILES_MAX_PREFETCHED_BYTES (64 * 1024 * 1024)
+#define MBTILES_PREFETCH_CHUNK 1024
+
 MBTiles::MBTiles():
-  pendingStatements1(std::make_shared<std::vector<PendingStatement>>()),
-  pendingStatements2(std::make_shared<std::vector<PendingStatement>>())
+  inTransaction(false),
+  normalized(false),
+  lastImageId(0),
+  replacedTiles(false),
+  pendingBytes(0),
+  maxPendingBytes(MBTILES_MAX_PENDING_BYTES),
+  stopWriter(false),
+  prefetchedBytes(0),
+  prefetchWaiting(0),
+  stopPrefetcher(false)
 {}
 
 MBTiles::~MBTiles() {
+	stopPrefetchThread();
+	stopWriterThread();
 	if (db && inTransaction) db << "COMMIT;"; // commit all the changes if open
 }
 
@@ -41,13 +63,32 @@ void MBTiles::openForWriting(string &filename) {
 	db << "PRAGMA page_size = 65536;";
 	db << "VACUUM;"; // make sure page_size takes effect
 	db << "CREATE TABLE IF NOT EXISTS metadata (name text, value text, UNIQUE (name));";
-	db << "CREATE TABLE IF NOT EXISTS tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob, UNIQUE (zoom_level, tile_column, tile_row));";
-	preparedStatements.emplace_back(db << "INSERT INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?,?,?,?);");
-	preparedStatements.emplace_back(db << "REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?,?,?,?);");
+
+	// Use the normalized schema unless we're merging into a database with a plain tiles table
+	int tilesTables = 0;
+	db << "SELECT COUNT(*) FROM sqlite_master WHERE type='table' AND name='tiles';" >> tilesTables;
+	normalized = tilesTables == 0;
+
+	if (normalized) {
+		db << "CREATE TABLE IF NOT EXISTS map (zoom_level integer, tile_column integer, tile_row integer, tile_id integer, UNIQUE (zoom_level, tile_column, tile_row));";
+		db << "CREATE TABLE IF NOT EXISTS images (tile_id integer primary key, tile_data blob);";
+		db << "CREATE VIEW IF NOT EXISTS tiles AS SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column, map.tile_row AS tile_row, images.tile_data AS tile_data FROM map JOIN images ON images.tile_id = map.tile_id;";
+		db << "SELECT IFNULL(MAX(tile_id), 0) FROM images;" >> lastImageId;
+		preparedStatements.emplace_back(db << "INSERT INTO map (zoom_level, tile_column, tile_row, tile_id) VALUES (?,?,?,?);");
+		preparedStatements.emplace_back(db << "REPLACE INTO map (zoom_level, tile_column, tile_row, tile_id) VALUES (?,?,?,?);");
+		preparedStatements.emplace_back(db << "INSERT INTO images (tile_id, tile_data) VALUES (?,?);");
+	} else {
+		db << "CREATE TABLE IF NOT EXISTS tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob, UNIQUE (zoom_level, tile_column, tile_row));";
+		preparedStatements.emplace_back(db << "INSERT INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?,?,?,?);");
+		preparedStatements.emplace_back(db << "REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?,?,?,?);");
+	}
 
 	db << "BEGIN;"; // begin a transaction
 	cout << "Creating mbtiles at " << filename << endl;
 	inTransaction = true;
+
+	stopWriter = false;
+	writerThread = std::thread(&MBTiles::writerLoop, this);
 }
 	
 void MBTiles::writeMetadata(string key, string value) {
@@ -60,44 +101,125 @@ void MBTiles::insertOrReplace(int zoom, int x, int y, const std::string& data, b
 	// NB: assumes we have the `m` mutex
 	int tmsY = pow(2, zoom) - 1 - y;
 	int s = isMerge ? 1 : 0;
+	if (!normalized) {
+		preparedStatements[s].reset();
+		preparedStatements[s] << zoom << x << tmsY && data;
+		preparedStatements[s].execute();
+		return;
+	}
+
+	// Reuse an identical image if we've already written one
+	sqlite3_int64 imageId = 0;
+	bool isSmall = data.size() <= MBTILES_DEDUPE_MAX_SIZE;
+	if (isSmall) {
+		auto existing = imageIds.find(data);
+		if (existing != imageIds.end()) imageId = existing->second;
+	}
+	if (imageId == 0) {
+		imageId = ++lastImageId;
+		preparedStatements[2].reset();
+		preparedStatements[2] << imageId && data;
+		preparedStatements[2].execute();
+		if (isSmall) imageIds[data] = imageId;
+	}
+
 	preparedStatements[s].reset();
-	preparedStatements[s] << zoom << x << tmsY && data;
+	preparedStatements[s] << zoom << x << tmsY << imageId;
 	preparedStatements[s].execute();
+	if (isMerge) replacedTiles = true;
 }
 
-void MBTiles::flushPendingStatements() {
-	// NB: assumes we have the `m` mutex
+// Take everything from the queue in one go, and write it in the same transaction
+void MBTiles::writerLoop() {
+	std::vector<PendingStatement> batch;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(pendingStatementsMutex);
+			pendingNotEmpty.wait(lock, [&]() { return !pendingStatements.empty() || stopWriter; });
+			if (pendingStatements.empty()) return;
+			batch.swap(pendingStatements);
+			pendingBytes = 0;
+		}
+		pendingNotFull.notify_all();
 
-	for (int i = 0; i < 2; i++) {
-		while(!pendingStatements2->empty()) {
-			const PendingStatement& stmt = pendingStatements2->back();
-			insertOrReplace(stmt.zoom, stmt.x, stmt.y, stmt.data, stmt.isMerge);
-			pendingStatements2->pop_back();
+		tracedLock(m, "wait for mbtiles lock");
+		std::lock_guard<std::mutex> lock(m, std::adopt_lock);
+		TRACE_SPAN("write mbtiles batch");
+		for (const PendingStatement& stmt : batch) {
+			try {
+				insertOrReplace(stmt.zoom, stmt.x, stmt.y, stmt.data, stmt.isMerge);
+			} catch (std::runtime_error &e) {
+				cerr << "Couldn't write tile " << stmt.zoom << "/" << stmt.x << "/" << stmt.y << " to mbtiles: " << e.what() << endl;
+			}
 		}
+		batch.clear();
+	}
+}
 
+void MBTiles::stopWriterThread() {
+	{
 		std::lock_guard<std::mutex> lock(pendingStatementsMutex);
-		pendingStatements1.swap(pendingStatements2);
+		stopWriter = true;
 	}
+	pendingNotEmpty.notify_all();
+	if (writerThread.joinable()) writerThread.join();
 }
-	
-void MBTiles::saveTile(int zoom, int x, int y, string *data, bool isMerge) {
-	// If the lock is available, write directly to SQLite.
-	if (m.try_lock()) {
-		insertOrReplace(zoom, x, y, *data, isMerge);
-		flushPendingStatements();
-		m.unlock();
+
+// Copy all tiles from another (closed) .mbtiles into this one
+void MBTiles::mergeFrom(const std::string &filename) {
+	std::lock_guard<std::mutex> lock(m);
+
+	// SQLite can't attach a database in the middle of a transaction
+	db << "COMMIT;";
+	db << "ATTACH DATABASE ? AS shard;" << filename;
+	db << "BEGIN;";
+	if (normalized) {
+		// Renumber the shard's images so they don't clash with ours
+		const sqlite3_int64 offset = lastImageId;
+		db << "INSERT INTO images (tile_id, tile_data) SELECT tile_id + ?, tile_data FROM shard.images;" << offset;
+		db << "REPLACE INTO map (zoom_level, tile_column, tile_row, tile_id) SELECT zoom_level, tile_column, tile_row, tile_id + ? FROM shard.map;" << offset;
+		db << "SELECT IFNULL(MAX(tile_id), 0) FROM images;" >> lastImageId;
+		replacedTiles = true;
 	} else {
-		// Else buffer the write for later, copying its binary blob.
-		const std::lock_guard<std::mutex> lock(pendingStatementsMutex);
-		pendingStatements1->push_back({zoom, x, y, *data, isMerge});
+		db << "REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) SELECT zoom_level, tile_column, tile_row, tile_data FROM shard.tiles;";
+	}
+	db << "COMMIT;";
+	db << "DETACH DATABASE shard;";
+	db << "BEGIN;";
+}
+
+size_t MBTiles::queueDepth() {
+	std::lock_guard<std::mutex> lock(pendingStatementsMutex);
+	return pendingStatements.size();
+}
+
+void MBTiles::saveTile(int zoom, int x, int y, string *data, bool isMerge) {
+	{
+		// Wait for the writer thread if it's fallen behind
+		std::unique_lock<std::mutex> lock(pendingStatementsMutex);
+		auto hasRoom = [&]() { return pendingBytes < maxPendingBytes || pendingStatements.empty(); };
+		if (!hasRoom()) {
+			TRACE_SPAN("wait for mbtiles writer");
+			pendingNotFull.wait(lock, hasRoom);
+		}
+		pendingStatements.push_back({zoom, x, y, *data, isMerge});
+		pendingBytes += data->size();
 	}
+	pendingNotEmpty.notify_one();
 }
 
 void MBTiles::closeForWriting() {
-	flushPendingStatements();
-	db << "CREATE UNIQUE INDEX IF NOT EXISTS tile_index on tiles (zoom_level, tile_column, tile_row);";
-	preparedStatements[0].used(true);
-	preparedStatements[1].used(true);
+	stopPrefetchThread();
+	stopWriterThread();
+	if (normalized) {
+		// A replaced tile's old image stays behind unless another tile shares it
+		if (replacedTiles) db << "DELETE FROM images WHERE tile_id NOT IN (SELECT tile_id FROM map);";
+		db << "CREATE UNIQUE INDEX IF NOT EXISTS map_index on map (zoom_level, tile_column, tile_row);";
+	} else {
+		db << "CREATE UNIQUE INDEX IF NOT EXISTS tile_index on tiles (zoom_level, tile_column, tile_row);";
+	}
+	for (auto &statement : preparedStatements) statement.used(true);
+	imageIds.clear();
 }
 
 // ---- Read mbtiles
@@ -126,18 +248,136 @@ vector<char> MBTiles::readTile(int zoom, int col, int row) {
 	return pbfBlob;
 }
 
+// The tile's data, from the prefetcher if it's been asked for, or read now
+bool MBTiles::readTile(std::vector<char> &compressed, int zoom, int x, int tmsY) {
+	const uint64_t key = tileKey(zoom, x, tmsY);
+	{
+		std::unique_lock<std::mutex> lock(prefetchMutex);
+		if (prefetchPending.count(key)) {
+			prefetchWaiting++;
+			prefetchChanged.notify_all();
+			{
+				TRACE_SPAN("wait for merged tile");
+				prefetchChanged.wait(lock, [&]() { return prefetched.count(key) || !prefetchPending.count(key); });
+			}
+			prefetchWaiting--;
+		}
+		auto it = prefetched.find(key);
+		if (it != prefetched.end()) {
+			const bool exists = it->second.exists;
+			compressed.swap(it->second.data);
+			prefetchedBytes -= compressed.size();
+			prefetched.erase(it);
+			lock.unlock();
+			prefetchChanged.notify_all();
+			return exists;
+		}
+	}
+
+	bool exists = false;
+	std::lock_guard<std::mutex> lock(m);
+	db << "SELECT tile_data FROM tiles WHERE zoom_level=? AND tile_column=? AND tile_row=?" << zoom << x << tmsY
+	   >> [&](std::vector<char> blob) { compressed.swap(blob); exists = true; };
+	return exists;
+}
+
+void MBTiles::prefetchTiles(const std::vector<std::tuple<int,int,int>> &tiles) {
+	if (tiles.empty()) return;
+	{
+		std::lock_guard<std::mutex> lock(prefetchMutex);
+		for (auto const &tile : tiles) {
+			const int zoom = std::get<0>(tile), tmsY = (1 << zoom) - 1 - std::get<2>(tile);
+			prefetchQueue.emplace_back(zoom, std::get<1>(tile), tmsY);
+			prefetchPending[tileKey(zoom, std::get<1>(tile), tmsY)]++;
+		}
+		if (!prefetchThread.joinable()) {
+			stopPrefetcher = false;
+			prefetchThread = std::thread(&MBTiles::prefetchLoop, this);
+		}
+	}
+	prefetchChanged.notify_all();
+}
+
+// Take the next tiles from the queue, and read each zoom's with a query over
+// their range. Stays ahead of the workers by MBTILES_MAX_PREFETCHED_BYTES, unless
+// one is already waiting for a tile.
+void MBTiles::prefetchLoop() {
+	std::vector<std::tuple<int,int,int>> chunk;
+	std::unordered_map<uint64_t, PrefetchedTile> read;
+	while (true) {
+		chunk.clear();
+		{
+			std::unique_lock<std::mutex> lock(prefetchMutex);
+			prefetchChanged.wait(lock, [&]() {
+				return stopPrefetcher || (!prefetchQueue.empty() && (prefetchedBytes < MBTILES_MAX_PREFETCHED_BYTES || prefetchWaiting > 0));
+			});
+			if (stopPrefetcher) return;
+			while (!prefetchQueue.empty() && chunk.size() < MBTILES_PREFETCH_CHUNK) {
+				chunk.push_back(prefetchQueue.front());
+				prefetchQueue.pop_front();
+			}
+		}
+
+		// Tiles at the same zoom are near each other in the queue, which is in z6 tiles
+		read.clear();
+		for (auto const &tile : chunk) read[tileKey(std::get<0>(tile), std::get<1>(tile), std::get<2>(tile))] = PrefetchedTile { false, {} };
+		std::sort(chunk.begin(), chunk.end());
+		{
+			TRACE_SPAN("prefetch merged tiles");
+			std::lock_guard<std::mutex> lock(m);
+			for (size_t first = 0; first < chunk.size(); ) {
+				const int zoom = std::get<0>(chunk[first]);
+				int minX = std::get<1>(chunk[first]), maxX = minX, minY = std::get<2>(chunk[first]), maxY = minY;
+				size_t last = first;
+				for (; last < chunk.size() && std::get<0>(chunk[last]) == zoom; last++) {
+					minX = std::min(minX, std::get<1>(chunk[last])); maxX = std::max(maxX, std::get<1>(chunk[last]));
+					minY = std::min(minY, std::get<2>(chunk[last])); maxY = std::max(maxY, std::get<2>(chunk[last]));
+				}
+				try {
+					db << "SELECT tile_column, tile_row, tile_data FROM tiles WHERE zoom_level=? AND tile_column BETWEEN ? AND ? AND tile_row BETWEEN ? AND ?"
+					   << zoom << minX << maxX << minY << maxY
+					   >> [&](int x, int y, std::vector<char> blob) {
+						auto it = read.find(tileKey(zoom, x, y));
+						if (it != read.end()) it->second = PrefetchedTile { true, std::move(blob) };
+					};
+				} catch (std::runtime_error &e) {
+					// Leave these tiles unfetched, so readTile reads each itself
+					cerr << "Couldn't prefetch z" << zoom << " tiles to merge, so they'll be read one by one: " << e.what() << endl;
+					for (size_t i = first; i < last; i++) read.erase(tileKey(zoom, std::get<1>(chunk[i]), std::get<2>(chunk[i])));
+				}
+				first = last;
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(prefetchMutex);
+			for (auto &tile : read) {
+				PrefetchedTile &slot = prefetched[tile.first];
+				prefetchedBytes += tile.second.data.size() - slot.data.size();
+				slot = std::move(tile.second);
+			}
+			for (auto const &tile : chunk) {
+				auto pending = prefetchPending.find(tileKey(std::get<0>(tile), std::get<1>(tile), std::get<2>(tile)));
+				if (--pending->second == 0) prefetchPending.erase(pending);
+			}
+		}
+		prefetchChanged.notify_all();
+	}
+}
+
+void MBTiles::stopPrefetchThread() {
+	{
+		std::lock_guard<std::mutex> lock(prefetchMutex);
+		stopPrefetcher = true;
+	}
+	prefetchChanged.notify_all();
+	if (prefetchThread.joinable()) prefetchThread.join();
+}
+
 bool MBTiles::readTileAndUncompress(string &data, int zoom, int x, int y, bool isCompressed, bool asGzip) {
-	m.lock();
 	int tmsY = pow(2,zoom) - 1 - y;
-	int exists=0;
-	db << "SELECT COUNT(*) FROM tiles WHERE zoom_level=? AND tile_column=? AND tile_row=?" << zoom << x << tmsY >> exists;
-	m.unlock();
-	if (exists==0) return false;
-
-	m.lock();
 	std::vector<char> compressed;
-	db << "SELECT tile_data FROM tiles WHERE zoom_level=? AND tile_column=? AND tile_row=?" << zoom << x << tmsY >> compressed;
-	m.unlock();
+	if (!readTile(compressed, zoom, x, tmsY)) return false;
 	try {
 		bio::stream<bio::array_source> in(compressed.data(), compressed.size());
 		bio::filtering_streambuf<bio::input> out;
@@ -0,0 +1,269 @@
+#include "metrics.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <boost/asio.hpp>
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+using namespace std;
+using boost::asio::ip::tcp;
+
+Metrics metrics;
+
+size_t residentBytes() {
+#ifdef __linux__
+	ifstream statm("/proc/self/statm");
+	size_t total = 0, resident = 0;
+	if (statm >> total >> resident) return resident * sysconf(_SC_PAGESIZE);
+#endif
+	return 0;
+}
+
+static string formatNumber(double value) {
+	char number[32];
+	snprintf(number, sizeof(number), "%.15g", value);
+	return number;
+}
+
+// ---- HTTP
+
+// Answers one request on each connection, then closes it
+struct MetricsExporter::Server {
+	boost::asio::io_context context;
+	tcp::acceptor acceptor;
+	const MetricsExporter &exporter;
+
+	Server(const string &address, unsigned short port, const MetricsExporter &exporter):
+		context(1), acceptor(context, tcp::endpoint(boost::asio::ip::make_address(address), port)), exporter(exporter) { }
+
+	struct Session {
+		tcp::socket socket;
+		boost::asio::streambuf buffer;
+		string response;
+		Session(tcp::socket socket): socket(std::move(socket)), buffer(8192) { }
+	};
+
+	void accept() {
+		acceptor.async_accept([this](const boost::system::error_code &ec, tcp::socket socket) {
+			if (!ec) respond(make_shared<Session>(std::move(socket)));
+			if (acceptor.is_open()) accept();
+		});
+	}
+
+	void respond(shared_ptr<Session> session) {
+		boost::asio::async_read_until(session->socket, session->buffer, "\r\n\r\n", [this, session](const boost::system::error_code &ec, size_t) {
+			if (ec) return;
+			istream in(&session->buffer);
+			string method, target;
+			in >> method >> target;
+			target = target.substr(0, target.find('?'));
+
+			string status = "200 OK", contentType, body;
+			if (target == "/metrics") { contentType = "text/plain; version=0.0.4"; body = exporter.prometheus(); }
+			else if (target == "/metrics.json") { contentType = "application/json"; body = exporter.json(); }
+			else status = "404 Not Found";
+			if (method == "HEAD") body.clear();
+
+			ostringstream out;
+			out << "HTTP/1.1 " << status << "\r\n";
+			if (!contentType.empty()) out << "Content-Type: " << contentType << "\r\n";
+			out << "Content-Length: " << body.size() << "\r\nConnection: close\r\n\r\n" << body;
+			session->response = out.str();
+			boost::asio::async_write(session->socket, boost::asio::buffer(session->response), [session](const boost::system::error_code &, size_t) {
+				boost::system::error_code ignored;
+				session->socket.shutdown(tcp::socket::shutdown_both, ignored);
+			});
+		});
+	}
+};
+
+// ---- MetricsExporter
+
+MetricsExporter::MetricsExporter(unsigned short port, const string &address, const string &filename):
+	port(port),
+	address(address),
+	filename(filename),
+	start(chrono::steady_clock::now()),
+	nextID(0),
+	stopping(false) {
+
+	counter("objects_read", "OSM objects read from the .pbf", []() { return metrics.nodesRead.load(); }, "type", "node");
+	counter("objects_read", "OSM objects read from the .pbf", []() { return metrics.waysRead.load(); }, "type", "way");
+	counter("objects_read", "OSM objects read from the .pbf", []() { return metrics.relationsRead.load(); }, "type", "relation");
+	for (unsigned int zoom = 0; zoom <= METRICS_MAX_ZOOM; zoom++)
+		counter("tiles_written", "Tiles written", [zoom]() { return metrics.tilesWritten[zoom].load(); }, "zoom", to_string(zoom));
+	gauge("resident_bytes", "Resident memory", []() { return residentBytes(); });
+
+	if (port > 0) {
+		try {
+			server.reset(new Server(address, port, *this));
+		} catch (boost::system::system_error &e) {
+			cerr << "Couldn't listen on " << address << " port " << port << " for metrics: " << e.what() << endl;
+		}
+		if (server) {
+			server->accept();
+			serverThread = thread([this]() { server->context.run(); });
+			cout << "Serving metrics at http://" << address << ":" << port << "/metrics" << endl;
+		}
+	}
+	if (!filename.empty()) fileThread = thread([this]() { writeFiles(); });
+}
+
+MetricsExporter::~MetricsExporter() {
+	{
+		lock_guard<std::mutex> lock(stopMutex);
+		stopping = true;
+	}
+	stopChanged.notify_all();
+	if (fileThread.joinable()) fileThread.join();
+	if (server) {
+		server->context.stop();
+		serverThread.join();
+	}
+}
+
+size_t MetricsExporter::add(Sampler sampler) {
+	lock_guard<std::mutex> lock(mutex);
+	sampler.id = nextID++;
+	samplers.push_back(std::move(sampler));
+	return samplers.back().id;
+}
+
+size_t MetricsExporter::gauge(const string &name, const string &help, function<double()> sample,
+                              const string &labelName, const string &labelValue) {
+	return add(Sampler { 0, name, help, labelName, labelValue, false, sample });
+}
+
+size_t MetricsExporter::counter(const string &name, const string &help, function<double()> sample,
+                                const string &labelName, const string &labelValue) {
+	return add(Sampler { 0, name, help, labelName, labelValue, true, sample });
+}
+
+void MetricsExporter::remove(const vector<size_t> &ids) {
+	lock_guard<std::mutex> lock(mutex);
+	for (size_t id : ids)
+		for (auto it = samplers.begin(); it != samplers.end(); ++it)
+			if (it->id == id) { samplers.erase(it); break; }
+}
+
+// Call with the mutex held. Labelled counters that haven't started (tiles at
+// zooms that aren't being written) are left out.
+vector<MetricsExporter::Sample> MetricsExporter::sampleAll() const {
+	vector<Sample> samples;
+	for (const Sampler &sampler : samplers) {
+		const double value = sampler.sample();
+		if (sampler.isCounter && !sampler.labelName.empty() && value == 0) continue;
+		samples.push_back(Sample { &sampler, value });
+	}
+	return samples;
+}
+
+string MetricsExporter::prometheus() const {
+	lock_guard<std::mutex> lock(mutex);
+	ostringstream out;
+	const double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	out << "# HELP tilemaker_phase What tilemaker is doing\n# TYPE tilemaker_phase gauge\n"
+	    << "tilemaker_phase{phase=\"" << metrics.phase.load() << "\"} 1\n"
+	    << "# HELP tilemaker_elapsed_seconds Time since tilemaker started\n# TYPE tilemaker_elapsed_seconds gauge\n"
+	    << "tilemaker_elapsed_seconds " << formatNumber(elapsed) << "\n";
+
+	string lastName;
+	for (const Sample &sample : sampleAll()) {
+		const Sampler &sampler = *sample.sampler;
+		const string name = "tilemaker_" + sampler.name + (sampler.isCounter ? "_total" : "");
+		if (name != lastName) {
+			out << "# HELP " << name << " " << sampler.help << "\n# TYPE " << name << " " << (sampler.isCounter ? "counter" : "gauge") << "\n";
+			lastName = name;
+		}
+		out << name;
+		if (!sampler.labelName.empty()) out << "{" << sampler.labelName << "=\"" << sampler.labelValue << "\"}";
+		out << " " << formatNumber(sample.value) << "\n";
+	}
+	return out.str();
+}
+
+string MetricsExporter::json() const {
+	lock_guard<std::mutex> lock(mutex);
+	return json(sampleAll(), nullptr, 0);
+}
+
+static string sampleKey(const string &name, const string &labelValue) { return name + "/" + labelValue; }
+
+// Labelled values become an object of their own, e.g. "tiles_written":{"12":345}.
+// With previous values, adds the rate of each counter, in "per_second".
+string MetricsExporter::json(const vector<Sample> &samples, const map<string, double> *previous, double interval) const {
+	// Values with the same name are registered one after another
+	struct Group { string name; bool labelled; vector<pair<string, double>> values; };
+	auto group = [&](bool rates) {
+		vector<Group> groups;
+		for (const Sample &sample : samples) {
+			const Sampler &sampler = *sample.sampler;
+			double value = sample.value;
+			if (rates) {
+				if (!sampler.isCounter) continue;
+				auto it = previous->find(sampleKey(sampler.name, sampler.labelValue));
+				value = (value - (it == previous->end() ? 0 : it->second)) / interval;
+			}
+			if (groups.empty() || groups.back().name != sampler.name)
+				groups.push_back(Group { sampler.name, !sampler.labelName.empty(), {} });
+			groups.back().values.emplace_back(sampler.labelValue, value);
+		}
+		return groups;
+	};
+	ostringstream out;
+	auto write = [&](const vector<Group> &groups) {
+		for (const Group &g : groups) {
+			out << ",\"" << g.name << "\":";
+			if (!g.labelled) { out << formatNumber(g.values.front().second); continue; }
+			out << "{";
+			for (size_t i = 0; i < g.values.size(); i++)
+				out << (i ? "," : "") << "\"" << g.values[i].first << "\":" << formatNumber(g.values[i].second);
+			out << "}";
+		}
+	};
+
+	const double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	out << "{\"phase\":\"" << metrics.phase.load() << "\",\"elapsed_s\":" << formatNumber(elapsed);
+	write(group(false));
+	if (previous && interval > 0) {
+		out << ",\"per_second\":{\"interval_s\":" << formatNumber(interval);
+		write(group(true));
+		out << "}";
+	}
+	out << "}";
+	return out.str();
+}
+
+// Rewrite the file now and then, and once more at the end
+void MetricsExporter::writeFiles() {
+	map<string, double> previous;
+	auto lastWrite = chrono::steady_clock::now();
+	bool last = false;
+	while (!last) {
+		{
+			unique_lock<std::mutex> lock(stopMutex);
+			last = stopChanged.wait_for(lock, chrono::seconds(METRICS_FILE_INTERVAL), [this]() { return stopping; });
+		}
+		const auto now = chrono::steady_clock::now();
+		const double interval = chrono::duration<double>(now - lastWrite).count();
+		lastWrite = now;
+
+		string contents;
+		{
+			lock_guard<std::mutex> lock(mutex);
+			vector<Sample> samples = sampleAll();
+			contents = json(samples, &previous, interval);
+			for (const Sample &sample : samples) previous[sampleKey(sample.sampler->name, sample.sampler->labelValue)] = sample.value;
+		}
+		const string temporary = filename + ".tmp";
+		{
+			ofstream out(temporary, ios::trunc);
+			out << contents << endl;
+			if (!out) { cerr << "Couldn't write metrics to " << temporary << endl; continue; }
+		}
+		if (rename(temporary.c_str(), filename.c_str()) != 0) cerr << "Couldn't replace " << filename << " with new metrics" << endl;
+	}
+}
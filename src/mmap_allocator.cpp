@@ -1,4 +1,5 @@
 #include "mmap_allocator.h"
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <memory>
@@ -12,172 +13,199 @@
 
 #include <boost/filesystem.hpp>
 
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/* -------------------
+   Arenas
+
+   Each thread allocates from its own arena, either an anonymous mapping in RAM
+   or (with --store) a file in the store directory. When a thread's arena is
+   full, it maps a new one for itself; arenas are pushed onto a list that is
+   never shrunk until exit, so neither growing nor looking up an arena needs a
+   global lock.
+
+   In RAM, an arena's pages are bound (preferably) to the NUMA node of the
+   thread that created it, since that's the thread that will fill it. They're
+   marked for transparent huge pages, or with --huge-pages, mapped from the
+   kernel's reserved huge pages when it has enough.
+   ------------------- */
+
+static constexpr std::size_t file_increase = 1024000000;
+static constexpr std::size_t memory_increase = 64000000;
+static constexpr std::size_t alignment = 32;
+static constexpr std::size_t huge_page_size = 2 * 1024 * 1024;
+static constexpr int max_numa_nodes = 64;
 
-struct mmap_file
-{
-	std::string filename;
+using allocator_t = boost::interprocess::allocator<uint8_t, boost::interprocess::managed_external_buffer::segment_manager>;
 
+struct mmap_arena
+{
 	std::mutex mutex;
+	uint8_t *base = nullptr;
+	std::size_t size = 0;
+	int node = -1;				// NUMA node it's bound to, or -1 if unknown
+	bool hugeTlb = false;
+	std::string filename;		// empty for an arena in RAM
+
 	boost::interprocess::file_mapping mapping;
 	boost::interprocess::mapped_region region;
 	boost::interprocess::managed_external_buffer buffer;
+	mmap_arena *next = nullptr;
 
-	mmap_file(std::string const &filename, std::size_t offset = 0);
-	~mmap_file();
-
-	void remove();
-};
-
-using mmap_file_ptr = std::shared_ptr<mmap_file>;
-
-struct mmap_dir_t
-{
-	static constexpr std::size_t increase = 1024000000;  
-	static constexpr std::size_t alignment = 32;
-
-	std::string mmap_dir_filename;
-	bool mmap_dir_created = false;
-
-public:
-	~mmap_dir_t();
-
-	bool is_open();
-	void open_mmap_file(std::string const &filename, size_t file_size = increase);
-	void resize_mmap_file(size_t add_size);
-	
-	size_t mmap_file_size = 0;
+	mmap_arena(std::size_t size, bool tryHugeTlb);
+	mmap_arena(std::string const &filename);
+	~mmap_arena();
 
-	std::vector<mmap_file_ptr> files;
+	bool contains(void const *p) const { return p >= base && p < base + size; }
 };
 
-thread_local mmap_file_ptr mmap_file_thread_ptr;
-
-struct mmap_shm 
+struct mmap_arena_list
 {
-	std::mutex mutex;
-	std::vector<uint8_t> region;
-	boost::interprocess::managed_external_buffer buffer;
-
-	static size_t mmap_file_size;
-
-	mmap_shm(size_t size);
-
-	static void open(size_t add_size);
-	static void close();
+	std::atomic<mmap_arena*> head { nullptr };
+	std::atomic<std::size_t> count { 0 };
+	std::atomic<std::size_t> fileCount { 0 };
+	std::atomic<std::size_t> fileSize { 0 };
+	std::atomic<std::size_t> memorySize { 0 };
+	std::atomic<std::size_t> nodeSize[max_numa_nodes];
+
+	std::string dir;
+	bool dirCreated = false;
+	bool hugePages = false;
+
+	mmap_arena_list() { for (auto &n : nodeSize) n = 0; }
+	~mmap_arena_list();
+
+	void push(mmap_arena *arena) {
+		arena->next = head.load();
+		while (!head.compare_exchange_weak(arena->next, arena)) { }
+		count++;
+	}
 };
 
-using mmap_shm_ptr = std::shared_ptr<mmap_shm>;
-
-using allocator_t = boost::interprocess::allocator<uint8_t, boost::interprocess::managed_external_buffer::segment_manager>;
-
-static mmap_dir_t mmap_dir;
-     
-std::vector< mmap_shm_ptr > mmap_shm_regions;  
-size_t mmap_shm::mmap_file_size = 0;
-thread_local mmap_shm_ptr mmap_shm_thread_region_ptr;
-
-std::mutex mmap_allocator_mutex;
-
-mmap_file::mmap_file(std::string const &filename, std::size_t offset)
-	: mapping(filename.c_str(), boost::interprocess::read_write)
-	, region(mapping, boost::interprocess::read_write)
-	, buffer(boost::interprocess::create_only, reinterpret_cast<uint8_t *>(region.get_address()) + offset, region.get_size() - offset)
-	, filename(filename)
-{ }
-
-mmap_file::~mmap_file()
-{
-	mapping = boost::interprocess::file_mapping();
-	region = boost::interprocess::mapped_region();
-	buffer = boost::interprocess::managed_external_buffer();
+static mmap_arena_list arenas;
+thread_local mmap_arena *mmap_thread_arena = nullptr;
 
-	remove();
+// The NUMA node this thread is running on, or -1
+static int current_numa_node() {
+#if defined(__linux__) && defined(SYS_getcpu)
+	unsigned cpu = 0, node = 0;
+	if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0 && node < max_numa_nodes) return node;
+#endif
+	return -1;
 }
 
-void mmap_file::remove()
+mmap_arena::mmap_arena(std::size_t size, bool tryHugeTlb)
 {
-	if(!filename.empty()) {
-		try {
-			boost::filesystem::remove(filename.c_str());
-		} catch(boost::filesystem::filesystem_error &e) {
-			std::cout << e.what() << std::endl;
-		}
+#ifdef __linux__
+	void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (tryHugeTlb) {
+		// Fails if the kernel hasn't got enough huge pages reserved
+		std::size_t hugeSize = (size + huge_page_size - 1) / huge_page_size * huge_page_size;
+		p = mmap(nullptr, hugeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) { size = hugeSize; hugeTlb = true; }
 	}
+#endif
+	if (p == MAP_FAILED) p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) throw std::bad_alloc();
+	base = static_cast<uint8_t*>(p);
+	this->size = size;
+
+#ifdef MADV_HUGEPAGE
+	if (!hugeTlb) madvise(base, size, MADV_HUGEPAGE);
+#endif
+	node = current_numa_node();
+#ifdef SYS_mbind
+	if (node >= 0) {
+		// MPOL_PREFERRED: use this node while it has room, without needing libnuma
+		const int mpol_preferred = 1;
+		unsigned long nodemask[max_numa_nodes / (8 * sizeof(unsigned long))] = { 0 };
+		nodemask[node / (8 * sizeof(unsigned long))] |= 1ul << (node % (8 * sizeof(unsigned long)));
+		if (syscall(SYS_mbind, base, size, mpol_preferred, nodemask, max_numa_nodes + 1, 0) != 0) node = -1;
+	}
+#endif
+#else
+	base = new uint8_t[size]();
+	this->size = size;
+#endif
+	buffer = boost::interprocess::managed_external_buffer(boost::interprocess::create_only, base, this->size);
 }
 
-void mmap_dir_t::open_mmap_file(std::string const &dir_filename, size_t file_size)
+mmap_arena::mmap_arena(std::string const &filename)
+	: filename(filename)
+	, mapping(filename.c_str(), boost::interprocess::read_write)
+	, region(mapping, boost::interprocess::read_write)
+	, buffer(boost::interprocess::create_only, region.get_address(), region.get_size())
 {
-	mmap_dir_filename = dir_filename;
-	mmap_file_size = file_size;
-
-	mmap_dir_created |= boost::filesystem::create_directory(dir_filename);
-
-	std::string new_filename = mmap_dir_filename + "/mmap_" + std::to_string(mmap_dir.files.size()) + ".dat";
-	std::cout << "Filename: " << new_filename << ", size: " << mmap_file_size << std::endl;
-	if(std::ofstream(new_filename.c_str()).fail())
-		throw std::runtime_error("Failed to open mmap file");
-	boost::filesystem::resize_file(new_filename.c_str(), 0);
-	boost::filesystem::resize_file(new_filename.c_str(), mmap_file_size);
-	mmap_file_thread_ptr = std::make_shared<mmap_file>(new_filename.c_str());
-
-	mmap_dir.files.emplace_back(mmap_file_thread_ptr);
+	base = static_cast<uint8_t*>(region.get_address());
+	size = region.get_size();
 }
 
-void mmap_dir_t::resize_mmap_file(size_t add_size)
+mmap_arena::~mmap_arena()
 {
-	auto offset = mmap_file_size;
-	auto size = increase + (add_size + alignment) - (add_size % alignment);
-
-	std::string new_filename = mmap_dir_filename + "/mmap_" + std::to_string(mmap_dir.files.size()) + ".dat";
-	if(std::ofstream(new_filename.c_str()).fail())
-		throw std::runtime_error("Failed to open mmap file");
-	boost::filesystem::resize_file(new_filename.c_str(), size);
-	mmap_file_thread_ptr = std::make_shared<mmap_file>(new_filename.c_str(), 0);
-
-	mmap_dir.files.emplace_back(mmap_file_thread_ptr);
-	mmap_file_size = offset + size;
-}
+	buffer = boost::interprocess::managed_external_buffer();
+	if (filename.empty()) {
+#ifdef __linux__
+		munmap(base, size);
+#else
+		delete[] base;
+#endif
+		return;
+	}
 
-bool mmap_dir_t::is_open() 
-{ 
-	return !mmap_dir.files.empty(); 
+	mapping = boost::interprocess::file_mapping();
+	region = boost::interprocess::mapped_region();
+	try {
+		boost::filesystem::remove(filename.c_str());
+	} catch(boost::filesystem::filesystem_error &e) {
+		std::cout << e.what() << std::endl;
+	}
 }
 
- mmap_dir_t::~mmap_dir_t()
+mmap_arena_list::~mmap_arena_list()
 {
-	if(!mmap_dir_filename.empty()) {
-		try {
-			files.clear();
+	mmap_arena *arena = head.load();
+	while (arena) {
+		mmap_arena *next = arena->next;
+		delete arena;
+		arena = next;
+	}
 
-			if(mmap_dir_created) {
-				boost::filesystem::remove(mmap_dir_filename.c_str());
-			}
+	if (dirCreated) {
+		try {
+			boost::filesystem::remove(dir.c_str());
 		} catch(boost::filesystem::filesystem_error &e) {
 			std::cout << e.what() << std::endl;
 		}
 	}
 }
 
-mmap_shm::mmap_shm(size_t size) 
-	: region(size)
-	, buffer(boost::interprocess::create_only, region.data(), region.size())
-{ }
-
-void mmap_shm::open(size_t add_size)
-{
-	constexpr std::size_t increase = 64000000;  
-	constexpr std::size_t alignment = 32;
-
-	auto size = increase + (add_size + alignment) - (add_size % alignment);
-	mmap_shm_thread_region_ptr = std::make_shared<mmap_shm>(size);
-	mmap_shm_regions.emplace_back(mmap_shm_thread_region_ptr);
-	mmap_file_size += size;
-}
-
-void mmap_shm::close() 
+// Map a new arena with room for at least add_size bytes, and make it this thread's
+static void open_thread_arena(std::size_t add_size)
 {
-	mmap_shm_regions.clear();
-	mmap_shm_thread_region_ptr.reset();
+	mmap_arena *arena;
+	if (!arenas.dir.empty()) {
+		auto size = file_increase + (add_size + alignment) - (add_size % alignment);
+		std::size_t fileNum = arenas.fileCount++;
+		std::string new_filename = arenas.dir + "/mmap_" + std::to_string(fileNum) + ".dat";
+		if (fileNum == 0) std::cout << "Filename: " << new_filename << ", size: " << size << std::endl;
+		if (std::ofstream(new_filename.c_str()).fail())
+			throw std::runtime_error("Failed to open mmap file");
+		boost::filesystem::resize_file(new_filename.c_str(), size);
+		arena = new mmap_arena(new_filename);
+		arenas.fileSize += arena->size;
+	} else {
+		auto size = memory_increase + (add_size + alignment) - (add_size % alignment);
+		arena = new mmap_arena(size, arenas.hugePages);
+		arenas.memorySize += arena->size;
+		if (arena->node >= 0) arenas.nodeSize[arena->node] += arena->size;
+	}
+	arenas.push(arena);
+	mmap_thread_arena = arena;
 }
 
 bool void_mmap_allocator_shutdown = false;
@@ -187,27 +215,19 @@ void void_mmap_allocator::shutdown() { void_mmap_allocator_shutdown = true; }
 void * void_mmap_allocator::allocate(size_type n, const void *hint)
 {
 	while(true) {
-		try {
-			if(mmap_dir.is_open() && mmap_file_thread_ptr != nullptr) {	
-				auto &i = *mmap_file_thread_ptr;
-				std::lock_guard<std::mutex> lock(i.mutex);
-				allocator_t allocator(i.buffer.get_segment_manager());
-				return &(*allocator.allocate(n, hint));
-			} else if(mmap_shm_thread_region_ptr != nullptr) {	
-				auto &i = *mmap_shm_thread_region_ptr;
-				std::lock_guard<std::mutex> lock(i.mutex);
-				allocator_t allocator(i.buffer.get_segment_manager());
+		// Only use this thread's arena if it's the right kind: --store may
+		// have been given after this thread allocated in RAM
+		mmap_arena *arena = mmap_thread_arena;
+		if (arena != nullptr && arena->filename.empty() == arenas.dir.empty()) {
+			try {
+				std::lock_guard<std::mutex> lock(arena->mutex);
+				allocator_t allocator(arena->buffer.get_segment_manager());
 				return &(*allocator.allocate(n, hint));
+			} catch(boost::interprocess::bad_alloc &e) {
+				// This arena is full
 			}
-		} catch(boost::interprocess::bad_alloc &e) {
-			// This mmap file is full
 		}
-
-		std::lock_guard<std::mutex> lock(mmap_allocator_mutex);
-		if(mmap_dir.is_open()) 
-			mmap_dir.resize_mmap_file(n);
-		else
-			mmap_shm::open(n);
+		open_thread_arena(n);
 	}
 }
 
@@ -220,50 +240,57 @@ void void_mmap_allocator::destroy(void *p)
 {
 	if(void_mmap_allocator_shutdown) return;
 
-	if(mmap_shm_thread_region_ptr != nullptr) {	
-		auto &i = *mmap_shm_thread_region_ptr;
-		if(p >= (void const *)i.region.data()  && p < reinterpret_cast<void const *>(reinterpret_cast<uint8_t const *>(i.region.data()) + i.region.size())) {
-			allocator_t allocator(i.buffer.get_segment_manager());
-			return allocator.destroy(reinterpret_cast<uint8_t *>(p));
-		}
+	mmap_arena *arena = mmap_thread_arena;
+	if (arena == nullptr || !arena->contains(p)) {
+		for (arena = arenas.head.load(); arena != nullptr; arena = arena->next)
+			if (arena->contains(p)) break;
+		if (arena == nullptr) return;
 	}
+	std::lock_guard<std::mutex> lock(arena->mutex);
+	allocator_t allocator(arena->buffer.get_segment_manager());
+	allocator.destroy(reinterpret_cast<uint8_t *>(p));
+}
 
-	if(mmap_file_thread_ptr != nullptr) {	
-		auto &i = *mmap_file_thread_ptr;
-		if(p >= i.region.get_address()  && p < reinterpret_cast<void const *>(reinterpret_cast<uint8_t const *>(i.region.get_address()) + i.region.get_size())) {
-			allocator_t allocator(i.buffer.get_segment_manager());
-			allocator.destroy(reinterpret_cast<uint8_t *>(p));
-			return;
-		}
-	} 
-
-	std::lock_guard<std::mutex> lock(mmap_allocator_mutex);
-	for(auto &i: mmap_shm_regions) {
-		if(p >= (void const *)i->region.data()  && p < reinterpret_cast<void const *>(reinterpret_cast<uint8_t const *>(i->region.data()) + i->region.size())) {
-			std::lock_guard<std::mutex> lock(i->mutex);
-			allocator_t allocator(i->buffer.get_segment_manager());
-			allocator.destroy(reinterpret_cast<uint8_t *>(p));
-			return;
-		}
-	}
+std::size_t void_mmap_allocator::memoryBytes() { return arenas.memorySize.load(); }
+std::size_t void_mmap_allocator::fileBytes() { return arenas.fileSize.load(); }
 
-	for(auto &i: mmap_dir.files) {
-		if(p >= i->region.get_address()  && p < reinterpret_cast<void const *>(reinterpret_cast<uint8_t const *>(i->region.get_address()) + i->region.get_size())) {
-			std::lock_guard<std::mutex> lock(i->mutex);
-			allocator_t allocator(i->buffer.get_segment_manager());
-			allocator.destroy(reinterpret_cast<uint8_t *>(p));
-			return;
-		}
-	} 
+void void_mmap_allocator::reportStoreSize(std::ostringstream &str) {
+	if (arenas.fileSize > 0) { str << "Store size " << (arenas.fileSize / 1000000000) << "G | "; }
+
+	// On multi-socket machines, show how the arenas are spread across nodes
+	int nodes = 0;
+	for (auto &n : arenas.nodeSize) if (n > 0) nodes++;
+	if (nodes > 1) {
+		str << "RAM";
+		for (int i = 0; i < max_numa_nodes; i++)
+			if (arenas.nodeSize[i] > 0) str << " node" << i << " " << (arenas.nodeSize[i] / 1000000) << "M";
+		str << " | ";
+	}
 }
 
-void void_mmap_allocator::reportStoreSize(std::ostringstream &str) {
-	if (mmap_dir.mmap_file_size>0) { str << "Store size " << (mmap_dir.mmap_file_size / 1000000000) << "G | "; }
+void void_mmap_allocator::reportArenas(std::ostream &str) {
+	str << "Allocator: " << arenas.count.load() << " arenas, " << (arenas.memorySize / 1000000) << "MB in RAM, "
+	    << (arenas.fileSize / 1000000) << "MB in store files" << std::endl;
+	std::vector<mmap_arena*> list;
+	for (mmap_arena *arena = arenas.head.load(); arena != nullptr; arena = arena->next) list.push_back(arena);
+	for (auto it = list.rbegin(); it != list.rend(); ++it) {
+		mmap_arena &arena = **it;
+		std::lock_guard<std::mutex> lock(arena.mutex);
+		std::size_t used = arena.size - arena.buffer.get_free_memory();
+		str << "  " << (arena.filename.empty() ? "RAM" : arena.filename) << ": " << (used / 1000000) << "MB of " << (arena.size / 1000000) << "MB used";
+		if (arena.node >= 0) str << ", node " << arena.node;
+		if (arena.hugeTlb) str << ", huge pages";
+		str << std::endl;
+	}
 }
 
 void void_mmap_allocator::openMmapFile(const std::string& mmapFilename) {
-	mmap_dir.open_mmap_file(mmapFilename);
+	arenas.dirCreated |= boost::filesystem::create_directory(mmapFilename);
+	arenas.dir = mmapFilename;
+	open_thread_arena(0);
 }
 
-
+void void_mmap_allocator::useHugePages(bool enabled) {
+	arenas.hugePages = enabled;
+}
 
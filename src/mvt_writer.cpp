@@ -0,0 +1,86 @@
+#include "mvt_writer.h"
+
+using namespace std;
+
+// Field numbers from vector_tile.proto
+#define MVT_TILE_LAYERS 3
+#define MVT_LAYER_NAME 1
+#define MVT_LAYER_FEATURES 2
+#define MVT_LAYER_KEYS 3
+#define MVT_LAYER_VALUES 4
+#define MVT_LAYER_EXTENT 5
+#define MVT_LAYER_VERSION 15
+
+#define WIRETYPE_VARINT 0
+#define WIRETYPE_LENGTH_DELIMITED 2
+
+static void writeVarint(string &out, uint64_t value) {
+	while (value >= 0x80) {
+		out.push_back(static_cast<char>(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back(static_cast<char>(value));
+}
+
+static void writeTag(string &out, uint32_t field, uint32_t wireType) {
+	writeVarint(out, (field << 3) | wireType);
+}
+
+static void writeBytes(string &out, uint32_t field, const char *data, size_t length) {
+	writeTag(out, field, WIRETYPE_LENGTH_DELIMITED);
+	writeVarint(out, length);
+	out.append(data, length);
+}
+
+static void writeBytes(string &out, uint32_t field, const string &data) {
+	writeBytes(out, field, data.data(), data.size());
+}
+
+MvtLayerWriter::MvtLayerWriter(): features(0) { }
+
+void MvtLayerWriter::reset() {
+	featureData.clear();
+	features = 0;
+}
+
+vector_tile::Tile_Feature *MvtLayerWriter::feature() {
+	current.Clear();
+	return &current;
+}
+
+void MvtLayerWriter::addFeature() {
+	addFeature(current);
+}
+
+void MvtLayerWriter::addFeature(const vector_tile::Tile_Feature &feature) {
+	scratch.clear();
+	feature.SerializeToString(&scratch);
+	writeBytes(featureData, MVT_LAYER_FEATURES, scratch);
+	features++;
+}
+
+void MvtLayerWriter::writeLayer(string &tile, const string &name,
+                                const vector<string> &keys, const vector<vector_tile::Tile_Value> &values,
+                                uint32_t extent, uint32_t version) {
+	// Fields in field number order, as protobuf writes them
+	layerData.clear();
+	writeBytes(layerData, MVT_LAYER_NAME, name);
+	layerData.append(featureData);
+	for (const auto &key : keys)
+		writeBytes(layerData, MVT_LAYER_KEYS, key);
+	for (const auto &value : values) {
+		scratch.clear();
+		value.SerializeToString(&scratch);
+		writeBytes(layerData, MVT_LAYER_VALUES, scratch);
+	}
+	writeTag(layerData, MVT_LAYER_EXTENT, WIRETYPE_VARINT);
+	writeVarint(layerData, extent);
+	writeTag(layerData, MVT_LAYER_VERSION, WIRETYPE_VARINT);
+	writeVarint(layerData, version);
+
+	writeBytes(tile, MVT_TILE_LAYERS, layerData);
+}
+
+void MvtLayerWriter::writeLayer(string &tile, const vector_tile::Tile_Layer &layer) {
+	writeBytes(tile, MVT_TILE_LAYERS, layer.SerializeAsString());
+}
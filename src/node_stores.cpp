@@ -1,6 +1,6 @@
 #include <algorithm>
-#include <boost/sort/sort.hpp>
 #include "node_stores.h"
+#include "radix_sort.h"
 
 void BinarySearchNodeStore::reopen()
 {
@@ -15,14 +15,12 @@ void BinarySearchNodeStore::reopen()
 }
 
 LatpLon BinarySearchNodeStore::at(NodeID i) const {
-	auto shard = mLatpLons[shardPart(i)];
+	const map_t &shard = *mLatpLons[shardPart(i)];
 	auto id = idPart(i);
 
-	auto iter = std::lower_bound(shard->begin(), shard->end(), id, [](auto const &e, auto i) { 
-		return e.first < i; 
-	});
+	auto iter = interpolationSearch(shard.begin(), shard.end(), id, [](auto const &e) { return e.first; });
 
-	if(iter == shard->end() || iter->first != id)
+	if(iter == shard.end() || iter->first != id)
 		throw std::out_of_range("Could not find node with id " + std::to_string(i));
 
 	return iter->second;
@@ -65,12 +63,8 @@ void BinarySearchNodeStore::insert(const std::vector<element_t>& elements) {
 
 void BinarySearchNodeStore::finalize(size_t threadNum) {
 	std::lock_guard<std::mutex> lock(mutex);
-	for (auto i = 0; i < NODE_SHARDS; i++) {
-		boost::sort::block_indirect_sort(
-			mLatpLons[i]->begin(), mLatpLons[i]->end(), 
-			[](auto const &a, auto const &b) { return a.first < b.first; },
-			threadNum);
-	}
+	for (auto i = 0; i < NODE_SHARDS; i++)
+		radixSort(*mLatpLons[i], threadNum, [](auto const &e) { return e.first; });
 }
 
 void CompactNodeStore::reopen()
@@ -103,3 +97,106 @@ void CompactNodeStore::clear() {
 }
 
 
+
+// The table starts with 2^20 slots, and doubles as it fills
+#define HASH_NODE_STORE_INITIAL_BITS 20
+#define HASH_NODE_STORE_MAX_LOAD 0.6
+
+HashNodeStore::HashNodeStore(): ids(nullptr), latpLons(nullptr), bits(0), reserved(0), count(0) {
+	allocate(HASH_NODE_STORE_INITIAL_BITS);
+}
+
+HashNodeStore::~HashNodeStore() {
+	release();
+}
+
+void HashNodeStore::allocate(size_t newBits) {
+	bits = newBits;
+	ids = static_cast<std::atomic<NodeID>*>(void_mmap_allocator::allocate(capacity() * sizeof(std::atomic<NodeID>)));
+	latpLons = static_cast<LatpLon*>(void_mmap_allocator::allocate(capacity() * sizeof(LatpLon)));
+	for (size_t i = 0; i < capacity(); i++)
+		new (&ids[i]) std::atomic<NodeID>(EmptySlot);
+}
+
+void HashNodeStore::release() {
+	if (ids) void_mmap_allocator::deallocate(ids, capacity() * sizeof(std::atomic<NodeID>));
+	if (latpLons) void_mmap_allocator::deallocate(latpLons, capacity() * sizeof(LatpLon));
+	ids = nullptr;
+	latpLons = nullptr;
+}
+
+void HashNodeStore::reopen() {
+	std::unique_lock<std::shared_timed_mutex> lock(mutex);
+	release();
+	allocate(HASH_NODE_STORE_INITIAL_BITS);
+	reserved = 0;
+	count = 0;
+}
+
+LatpLon HashNodeStore::at(NodeID i) const {
+	const size_t mask = capacity() - 1;
+	for (size_t slot = slotFor(i); ; slot = (slot + 1) & mask) {
+		const NodeID id = ids[slot].load(std::memory_order_relaxed);
+		if (id == i) return latpLons[slot];
+		if (id == EmptySlot) throw std::out_of_range("Could not find node with id " + std::to_string(i));
+	}
+}
+
+size_t HashNodeStore::size() const {
+	return count.load();
+}
+
+// Returns false if the node was already stored (its coordinates are replaced)
+bool HashNodeStore::insertOne(NodeID id, LatpLon ll) {
+	if (id == EmptySlot) throw std::runtime_error("HashNodeStore can't store node " + std::to_string(id));
+	const size_t mask = capacity() - 1;
+	for (size_t slot = slotFor(id); ; slot = (slot + 1) & mask) {
+		NodeID current = ids[slot].load(std::memory_order_relaxed);
+		if (current == EmptySlot && ids[slot].compare_exchange_strong(current, id, std::memory_order_relaxed)) {
+			latpLons[slot] = ll;
+			return true;
+		}
+		// Either it was already full, or another thread just took it
+		if (current == id) {
+			latpLons[slot] = ll;
+			return false;
+		}
+	}
+}
+
+void HashNodeStore::grow(size_t needed) {
+	std::unique_lock<std::shared_timed_mutex> lock(mutex);
+	if (needed <= capacity() * HASH_NODE_STORE_MAX_LOAD) return;		// another thread got here first
+
+	size_t newBits = bits;
+	while (needed > (size_t(1) << newBits) * HASH_NODE_STORE_MAX_LOAD) newBits++;
+
+	std::atomic<NodeID>* oldIds = ids;
+	LatpLon* oldLatpLons = latpLons;
+	const size_t oldCapacity = capacity();
+	allocate(newBits);
+	for (size_t i = 0; i < oldCapacity; i++) {
+		const NodeID id = oldIds[i].load(std::memory_order_relaxed);
+		if (id != EmptySlot) insertOne(id, oldLatpLons[i]);
+	}
+	void_mmap_allocator::deallocate(oldIds, oldCapacity * sizeof(std::atomic<NodeID>));
+	void_mmap_allocator::deallocate(oldLatpLons, oldCapacity * sizeof(LatpLon));
+}
+
+void HashNodeStore::insert(const std::vector<element_t>& elements) {
+	// Make sure there's room for the whole batch (counting any repeats) before we start
+	const size_t needed = reserved.fetch_add(elements.size()) + elements.size();
+	while (true) {
+		{
+			std::shared_lock<std::shared_timed_mutex> lock(mutex);
+			if (needed <= capacity() * HASH_NODE_STORE_MAX_LOAD) {
+				size_t added = 0;
+				for (const auto& element : elements)
+					if (insertOne(element.first, element.second)) added++;
+				count += added;
+				return;
+			}
+		}
+		grow(needed);
+	}
+}
@@ -1,17 +1,24 @@
 #include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
 
 #include "osm_lua_processing.h"
 #include "attribute_store.h"
 #include "helpers.h"
+#include "trace.h"
+#include "lua_profiler.h"
 #include "coordinates_geom.h"
 #include "osm_mem_tiles.h"
+#include "lookup_table.h"
+#include <map>
+#include <mutex>
 
 
 using namespace std;
 
 thread_local kaguya::State *g_luaState = nullptr;
 bool supportsRemappingShapefiles = false;
-const std::string EMPTY_STRING = "";
 
 int lua_error_handler(int errCode, const char *errMessage)
 {
@@ -23,6 +30,33 @@ int lua_error_handler(int errCode, const char *errMessage)
 
 // ----	initialization routines
 
+// The profile compiled to bytecode, once for all the threads' Lua states, so
+// that it's only parsed once; empty if it doesn't compile, to report the error
+// as before. Debug information is kept, for line numbers in errors.
+static const string &compiledProfile(const string &luaFile) {
+	static std::mutex mutex;
+	static std::map<string, string> compiled;
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = compiled.find(luaFile);
+	if (it != compiled.end()) return it->second;
+
+	string bytecode;
+	lua_State *L = luaL_newstate();
+	if (luaL_loadfile(L, luaFile.c_str()) == 0) {
+		auto writer = [](lua_State *, const void *p, size_t size, void *out) -> int {
+			static_cast<string*>(out)->append(static_cast<const char*>(p), size);
+			return 0;
+		};
+#if LUA_VERSION_NUM >= 503
+		lua_dump(L, writer, &bytecode, 0);
+#else
+		lua_dump(L, writer, &bytecode);
+#endif
+	}
+	lua_close(L);
+	return compiled[luaFile] = bytecode;
+}
+
 OsmLuaProcessing::OsmLuaProcessing(
 	OSMStore &osmStore,
 	const class Config &configIn,
@@ -44,7 +78,22 @@ OsmLuaProcessing::OsmLuaProcessing(
 	// ----	Initialise Lua
 	g_luaState = &luaState;
 	luaState.setErrorHandler(lua_error_handler);
-	luaState.dofile(luaFile.c_str());
+	luaState["LookupTable"].setClass(kaguya::UserdataMetatable<LookupTable>()
+		.addStaticFunction("Load", &LookupTable::Load)
+		.addFunction("Get", &LookupTable::Get)
+		.addFunction("Has", &LookupTable::Has)
+		.addFunction("Size", &LookupTable::Size)
+	);
+	const string &bytecode = compiledProfile(luaFile);
+	if (bytecode.empty()) {
+		luaState.dofile(luaFile.c_str());
+	} else {
+		lua_State *L = luaState.state();
+		kaguya::util::ScopedSavedStack save(L);
+		int status = luaL_loadbuffer(L, bytecode.data(), bytecode.size(), ("@" + luaFile).c_str());
+		if (status == 0) status = kaguya::lua_pcall_wrap(L, 0, 0);
+		if (status) kaguya::ErrorHandler::handle(status, L);
+	}
 	luaState["OSM"].setClass(kaguya::UserdataMetatable<OsmLuaProcessing>()
 		.addFunction("Id", &OsmLuaProcessing::Id)
 		.addFunction("Holds", &OsmLuaProcessing::Holds)
@@ -73,6 +122,10 @@ OsmLuaProcessing::OsmLuaProcessing(
 	supportsRemappingShapefiles = !!luaState["attribute_function"];
 	supportsReadingRelations    = !!luaState["relation_scan_function"];
 	supportsWritingRelations    = !!luaState["relation_function"];
+	supportsNodes               = !!luaState["node_function"];
+	supportsWays                = !!luaState["way_function"];
+	supportsNodeBatches         = !!luaState["node_batch_function"];
+	supportsWayBatches          = !!luaState["way_batch_function"];
 
 	// ---- Call init_function of Lua logic
 
@@ -97,6 +150,40 @@ bool OsmLuaProcessing::canRemapShapefiles() {
 	return supportsRemappingShapefiles;
 }
 
+vector<string> OsmLuaProcessing::moduleFiles() {
+	lua_State *L = luaState.state();
+	kaguya::util::ScopedSavedStack save(L);
+	vector<string> modules, files;
+	lua_getglobal(L, "package");
+	if (!lua_istable(L, -1)) return files;
+	lua_getfield(L, -1, "path");
+	const string path = lua_isstring(L, -1) ? lua_tostring(L, -1) : "";
+	lua_getfield(L, -2, "loaded");
+	if (!lua_istable(L, -1)) return files;
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		if (lua_type(L, -2) == LUA_TSTRING) modules.push_back(lua_tostring(L, -2));
+		lua_pop(L, 1);
+	}
+
+	// As require looks for them (package.searchpath isn't in Lua 5.1);
+	// built-in and C modules aren't found, and don't need to be
+	for (string module : modules) {
+		replace(module.begin(), module.end(), '.', '/');
+		size_t start = 0;
+		while (start <= path.size()) {
+			size_t end = path.find(';', start);
+			if (end == string::npos) end = path.size();
+			string file = path.substr(start, end - start);
+			for (size_t q = file.find('?'); q != string::npos; q = file.find('?', q + module.size())) file.replace(q, 1, module);
+			if (!file.empty() && ifstream(file).good()) { files.push_back(file); break; }
+			start = end + 1;
+		}
+	}
+	sort(files.begin(), files.end());
+	return files;
+}
+
 bool OsmLuaProcessing::canReadRelations() {
 	return supportsReadingRelations;
 }
@@ -105,11 +192,21 @@ bool OsmLuaProcessing::canWriteRelations() {
 	return supportsWritingRelations;
 }
 
+bool OsmLuaProcessing::batchesNodes() {
+	return supportsNodeBatches;
+}
+
+bool OsmLuaProcessing::batchesWays() {
+	return supportsWayBatches;
+}
+
 kaguya::LuaTable OsmLuaProcessing::newTable() {
 	return luaState.newTable();//kaguya::LuaTable(luaState);
 }
 
 kaguya::LuaTable OsmLuaProcessing::remapAttributes(kaguya::LuaTable& in_table, const std::string &layerName) {
+	TRACE_SPAN("lua attribute_function");
+	LuaCallTimer timer(LuaFunction::Attribute);
 	kaguya::LuaTable out_table = luaState["attribute_function"].call<kaguya::LuaTable>(in_table, layerName);
 	return out_table;
 }
@@ -122,20 +219,21 @@ string OsmLuaProcessing::Id() const {
 }
 
 // Check if there's a value for a given key
-bool OsmLuaProcessing::Holds(const string& key) const {
-	return currentTags->find(key) != currentTags->end();
+bool OsmLuaProcessing::Holds(const char *key) const {
+	return key && currentTags->contains(key);
 }
 
 // Get an OSM tag for a given key (or return empty string if none)
-const string& OsmLuaProcessing::Find(const string& key) const {
-	auto it = currentTags->find(key);
-	if(it == currentTags->end()) return EMPTY_STRING;
-	return it->second;
+boost::string_view OsmLuaProcessing::Find(const char *key) const {
+	boost::string_view value;
+	if (key) currentTags->find(key, value);
+	return value;
 }
 
 // ----	Spatial queries called from Lua
 
 vector<string> OsmLuaProcessing::FindIntersecting(const string &layerName) {
+	LuaHelperTimer timer(LuaHelper::FindIntersecting);
 	if      (!isWay   ) { return shpMemTiles.namesOfGeometries(intersectsQuery(layerName, false, getPoint())); }
 	else if (!isClosed && isRelation) { return shpMemTiles.namesOfGeometries(intersectsQuery(layerName, false, multiLinestringCached())); }
 	else if (!isClosed) { return shpMemTiles.namesOfGeometries(intersectsQuery(layerName, false, linestringCached())); }
@@ -144,6 +242,7 @@ vector<string> OsmLuaProcessing::FindIntersecting(const string &layerName) {
 }
 
 bool OsmLuaProcessing::Intersects(const string &layerName) {
+	LuaHelperTimer timer(LuaHelper::Intersects);
 	if      (!isWay   ) { return !intersectsQuery(layerName, true, getPoint()).empty(); }
 	else if (!isClosed) { return !intersectsQuery(layerName, true, linestringCached()).empty(); }
 	else if (!isClosed && isRelation) { return !intersectsQuery(layerName, true, multiLinestringCached()).empty(); }
@@ -152,6 +251,7 @@ bool OsmLuaProcessing::Intersects(const string &layerName) {
 }
 
 vector<string> OsmLuaProcessing::FindCovering(const string &layerName) {
+	LuaHelperTimer timer(LuaHelper::FindCovering);
 	if      (!isWay   ) { return shpMemTiles.namesOfGeometries(coveredQuery(layerName, false, getPoint())); }
 	else if (!isClosed) { return shpMemTiles.namesOfGeometries(coveredQuery(layerName, false, linestringCached())); }
 	else if (!isClosed && isRelation) { return shpMemTiles.namesOfGeometries(coveredQuery(layerName, false, multiLinestringCached())); }
@@ -160,6 +260,7 @@ vector<string> OsmLuaProcessing::FindCovering(const string &layerName) {
 }
 
 bool OsmLuaProcessing::CoveredBy(const string &layerName) {
+	LuaHelperTimer timer(LuaHelper::CoveredBy);
 	if      (!isWay   ) { return !coveredQuery(layerName, true, getPoint()).empty(); }
 	else if (!isClosed) { return !coveredQuery(layerName, true, linestringCached()).empty(); }
 	else if (!isClosed && isRelation) { return !coveredQuery(layerName, true, multiLinestringCached()).empty(); }
@@ -168,6 +269,7 @@ bool OsmLuaProcessing::CoveredBy(const string &layerName) {
 }
 
 double OsmLuaProcessing::AreaIntersecting(const string &layerName) {
+	LuaHelperTimer timer(LuaHelper::AreaIntersecting);
 	if      (!isWay || !isClosed) { return 0.0; }
 	else if (isRelation){ return intersectsArea(layerName, multiPolygonCached()); }
 	else                { return intersectsArea(layerName, polygonCached()); }
@@ -184,7 +286,10 @@ std::vector<uint> OsmLuaProcessing::intersectsQuery(const string &layerName, boo
 			return results;
 		},
 		[&](OutputObject const &oo) { // checkQuery
-			return geom::intersects(geom, shpMemTiles.retrieveMultiPolygon(oo.objectID));
+			return geom::intersects(geom, *shpMemTiles.queryMultiPolygon(oo.objectID));
+		},
+		[&](MultiPolygon const &piece, bool coversCell) { // pieceQuery
+			return coversCell || geom::intersects(geom, piece);
 		}
 	);
 	return ids;
@@ -202,7 +307,13 @@ double OsmLuaProcessing::intersectsArea(const string &layerName, GeometryT &geom
 		},
 		[&](OutputObject const &oo) { // checkQuery
 			MultiPolygon tmp;
-			geom::intersection(geom, shpMemTiles.retrieveMultiPolygon(oo.objectID), tmp);
+			geom::intersection(geom, *shpMemTiles.queryMultiPolygon(oo.objectID), tmp);
+			area += multiPolygonArea(tmp);
+			return false;
+		},
+		[&](MultiPolygon const &piece, bool coversCell) { // pieceQuery
+			MultiPolygon tmp;
+			geom::intersection(geom, piece, tmp);
 			area += multiPolygonArea(tmp);
 			return false;
 		}
@@ -221,7 +332,10 @@ std::vector<uint> OsmLuaProcessing::coveredQuery(const string &layerName, bool o
 		},
 		[&](OutputObject const &oo) { // checkQuery
 			if (oo.geomType!=POLYGON_) return false; // can only be covered by a polygon!
-			return geom::covered_by(geom, shpMemTiles.retrieveMultiPolygon(oo.objectID));
+			return geom::covered_by(geom, *shpMemTiles.queryMultiPolygon(oo.objectID));
+		},
+		[&](MultiPolygon const &piece, bool coversCell) { // pieceQuery
+			return coversCell || geom::covered_by(geom, piece);
 		}
 	);
 	return ids;
@@ -239,6 +353,7 @@ void reverse_project(DegPoint& p) {
 
 // Returns area
 double OsmLuaProcessing::Area() {
+	LuaHelperTimer timer(LuaHelper::Area);
 	if (!IsClosed()) return 0;
 
 #if BOOST_VERSION >= 106700
@@ -278,6 +393,7 @@ double OsmLuaProcessing::multiPolygonArea(const MultiPolygon &mp) const {
 
 // Returns length
 double OsmLuaProcessing::Length() {
+	LuaHelperTimer timer(LuaHelper::Length);
 	if (isWay) {
 		geom::model::linestring<DegPoint> l;
 		geom::assign(l, linestringCached());
@@ -323,10 +439,36 @@ const MultiPolygon &OsmLuaProcessing::multiPolygonCached() {
 	return multiPolygonCache;
 }
 
+OsmLuaProcessing::CorrectGeometryResult OsmLuaProcessing::correctedPolygonCached() {
+	if (!correctedPolygonInited) {
+		if (isRelation) {
+			correctedPolygonCache = multiPolygonCached();
+		} else {
+			Polygon p;
+			geom::assign_points(p, linestringCached());
+			correctedPolygonCache.clear();
+			correctedPolygonCache.push_back(std::move(p));
+		}
+		correctedPolygonResult = CorrectGeometry(correctedPolygonCache);
+		correctedPolygonInited = true;
+	}
+	return correctedPolygonResult;
+}
+
 // ----	Requests from Lua to write this way/node to a vector tile's Layer
 
+// Tells the profiler which layer, if any, a Layer() call wrote to
+struct LayerWriteCheck {
+	const std::vector<std::pair<OutputObject, AttributeSet>> &outputs;
+	size_t before;
+	LayerWriteCheck(const std::vector<std::pair<OutputObject, AttributeSet>> &outputs): outputs(outputs), before(outputs.size()) { }
+	~LayerWriteCheck() { if (outputs.size() > before) LuaProfiler::layerWritten(outputs.back().first.layer); }
+};
+
 // Add object to specified layer from Lua
 void OsmLuaProcessing::Layer(const string &layerName, bool area) {
+	LuaHelperTimer timer(LuaHelper::Layer);
+	LayerWriteCheck check(outputs);
 	if (layers.layerMap.count(layerName) == 0) {
 		throw out_of_range("ERROR: Layer(): a layer named as \"" + layerName + "\" doesn't exist.");
 	}
@@ -358,13 +500,10 @@ void OsmLuaProcessing::Layer(const string &layerName, bool area) {
 		else if (geomType==POLYGON_) {
 			// polygon
 
-			MultiPolygon mp;
-
 			if (isRelation) {
 				try {
-					mp = multiPolygonCached();
-					if(CorrectGeometry(mp) == CorrectGeometryResult::Invalid) return;
-					NodeID id = osmMemTiles.storeMultiPolygon(mp);
+					if(correctedPolygonCached() == CorrectGeometryResult::Invalid) return;
+					NodeID id = osmMemTiles.storeMultiPolygon(correctedPolygonCache);
 					OutputObject oo(geomType, layers.layerMap[layerName], id, 0, layerMinZoom);
 					outputs.push_back(std::make_pair(std::move(oo), attributes));
 				} catch(std::out_of_range &err) {
@@ -373,20 +512,15 @@ void OsmLuaProcessing::Layer(const string &layerName, bool area) {
 				}
 			}
 			else if (isWay) {
-				//Is there a more efficient way to do this?
-				Linestring ls = linestringCached();
-				Polygon p;
-				geom::assign_points(p, ls);
-				mp.push_back(p);
-
-				auto correctionResult = CorrectGeometry(mp);
+				auto correctionResult = correctedPolygonCached();
 				if(correctionResult == CorrectGeometryResult::Invalid) return;
 				NodeID id = 0;
-				if (!materializeGeometries && correctionResult == CorrectGeometryResult::Valid) {
+				if (!materializeGeometries && correctionResult == CorrectGeometryResult::Valid &&
+				    !osmMemTiles.shouldMaterialize(linestringCached(), layerMinZoom)) {
 					id = USE_WAY_STORE | originalOsmID;
 					wayEmitted = true;
 				} else 
-					id = osmMemTiles.storeMultiPolygon(mp);
+					id = osmMemTiles.storeMultiPolygon(correctedPolygonCache);
 				OutputObject oo(geomType, layers.layerMap[layerName], id, 0, layerMinZoom);
 				outputs.push_back(std::make_pair(std::move(oo), attributes));
 			}
@@ -418,7 +552,8 @@ void OsmLuaProcessing::Layer(const string &layerName, bool area) {
 
 			if (isWay && !isRelation) {
 				NodeID id = 0;
-				if (!materializeGeometries && correctionResult == CorrectGeometryResult::Valid) {
+				if (!materializeGeometries && correctionResult == CorrectGeometryResult::Valid &&
+				    !osmMemTiles.shouldMaterialize(ls, layerMinZoom)) {
 					id = USE_WAY_STORE | originalOsmID;
 					wayEmitted = true;
 				}	else 
@@ -441,6 +576,8 @@ void OsmLuaProcessing::Layer(const string &layerName, bool area) {
 }
 
 void OsmLuaProcessing::LayerAsCentroid(const string &layerName) {
+	LuaHelperTimer timer(LuaHelper::LayerAsCentroid);
+	LayerWriteCheck check(outputs);
 	if (layers.layerMap.count(layerName) == 0) {
 		throw out_of_range("ERROR: LayerAsCentroid(): a layer named as \"" + layerName + "\" doesn't exist.");
 	}	
@@ -490,6 +627,7 @@ Point OsmLuaProcessing::calculateCentroid() {
 }
 
 std::vector<double> OsmLuaProcessing::Centroid() {
+	LuaHelperTimer timer(LuaHelper::Centroid);
 	Point c = calculateCentroid();
 	return std::vector<double> { latp2lat(c.y()/10000000.0), c.x()/10000000.0 };
 }
@@ -556,13 +694,15 @@ void OsmLuaProcessing::setVectorLayerMetadata(const uint_least8_t layer, const s
 
 // Scan relation (but don't write geometry)
 // return true if we want it, false if we don't
-bool OsmLuaProcessing::scanRelation(WayID id, const tag_map_t &tags) {
+bool OsmLuaProcessing::scanRelation(WayID id, const TagMap &tags) {
 	reset();
 	originalOsmID = id;
 	isWay = false;
 	isRelation = true;
 	currentTags = &tags;
 	try {
+		TRACE_SPAN("lua relation_scan_function");
+		LuaCallTimer timer(LuaFunction::RelationScan, currentTags);
 		luaState["relation_scan_function"](this);
 	} catch(luaProcessingException &e) {
 		std::cerr << "Lua error on scanning relation " << originalOsmID << std::endl;
@@ -574,8 +714,7 @@ bool OsmLuaProcessing::scanRelation(WayID id, const tag_map_t &tags) {
 	return true;
 }
 
-void OsmLuaProcessing::setNode(NodeID id, LatpLon node, const tag_map_t &tags) {
-
+void OsmLuaProcessing::beginNode(NodeID id, LatpLon node, const TagMap &tags) {
 	reset();
 	originalOsmID = id;
 	isWay = false;
@@ -583,17 +722,19 @@ void OsmLuaProcessing::setNode(NodeID id, LatpLon node, const tag_map_t &tags) {
 	lon = node.lon;
 	latp= node.latp;
 	currentTags = &tags;
+}
 
-	//Start Lua processing for node
-	try {
-		luaState["node_function"](this);
-	} catch(luaProcessingException &e) {
-		std::cerr << "Lua error on node " << originalOsmID << std::endl;
-		exit(1);
-	}
+void OsmLuaProcessing::describeObject(NodeID id, bool way, bool closed, const TagMap &tags) {
+	originalOsmID = id;
+	isWay = way;
+	isRelation = false;
+	isClosed = closed;
+	currentTags = &tags;
+}
 
+void OsmLuaProcessing::finishNode() {
 	if (!this->empty()) {
-		TileCoordinates index = latpLon2index(node, this->config.baseZoom);
+		TileCoordinates index = latpLon2index(LatpLon{latp, lon}, this->config.baseZoom);
 
 		for (auto &output : finalizeOutputs()) {
 			osmMemTiles.addObjectToSmallIndex(index, output, originalOsmID);
@@ -601,8 +742,23 @@ void OsmLuaProcessing::setNode(NodeID id, LatpLon node, const tag_map_t &tags) {
 	} 
 }
 
-// We are now processing a way
-bool OsmLuaProcessing::setWay(WayID wayId, LatpLonVec const &llVec, const tag_map_t &tags) {
+void OsmLuaProcessing::setNode(NodeID id, LatpLon node, const TagMap &tags) {
+	beginNode(id, node, tags);
+
+	//Start Lua processing for node
+	if (applyRules() && supportsNodes) try {
+		TRACE_SPAN("lua node_function");
+		LuaCallTimer timer(LuaFunction::Node, currentTags);
+		luaState["node_function"](this);
+	} catch(luaProcessingException &e) {
+		std::cerr << "Lua error on node " << originalOsmID << std::endl;
+		exit(1);
+	}
+
+	finishNode();
+}
+
+void OsmLuaProcessing::beginWay(WayID wayId, LatpLonVec const &llVec, const TagMap &tags) {
 	reset();
 	wayEmitted = false;
 	originalOsmID = wayId;
@@ -616,7 +772,7 @@ bool OsmLuaProcessing::setWay(WayID wayId, LatpLonVec const &llVec, const tag_ma
 	if (supportsReadingRelations && osmStore.way_in_any_relations(wayId)) {
 		relationList = osmStore.relations_for_way(wayId);
 	} else {
-		relationList.clear();
+		relationList = RelationScanStore::relation_list_t();
 	}
 
 	try {
@@ -629,11 +785,25 @@ bool OsmLuaProcessing::setWay(WayID wayId, LatpLonVec const &llVec, const tag_ma
 	}
 
 	currentTags = &tags;
+}
 
-	bool ok = true;
-	if (ok) {
+bool OsmLuaProcessing::finishWay() {
+	if (!this->empty()) {
+		osmMemTiles.addGeometryToIndex(linestringCached(), finalizeOutputs(), originalOsmID);
+		return wayEmitted;
+	}
+	return false;
+}
+
+// We are now processing a way
+bool OsmLuaProcessing::setWay(WayID wayId, LatpLonVec const &llVec, const TagMap &tags) {
+	beginWay(wayId, llVec, tags);
+
+	if (applyRules() && supportsWays) {
 		//Start Lua processing for way
 		try {
+			TRACE_SPAN("lua way_function");
+			LuaCallTimer timer(LuaFunction::Way, currentTags);
 			kaguya::LuaFunction way_function = luaState["way_function"];
 			kaguya::LuaRef ret = way_function(this);
 			assert(!ret);
@@ -643,16 +813,123 @@ bool OsmLuaProcessing::setWay(WayID wayId, LatpLonVec const &llVec, const tag_ma
 		}
 	}
 
-	if (!this->empty()) {
-		osmMemTiles.addGeometryToIndex(linestringCached(), finalizeOutputs(), originalOsmID);
-		return wayEmitted;
+	return finishWay();
+}
+
+// ----	Batched processing: the profile gets a table of objects per call, and returns what to write for each
+
+void OsmLuaProcessing::setNodes(const std::vector<NodeID> &ids, const std::vector<LatpLon> &nodes, const std::vector<TagMap> &tags) {
+	for (size_t start = 0; start < ids.size(); start += LUA_BATCH_SIZE) {
+		size_t end = std::min(ids.size(), start + LUA_BATCH_SIZE);
+		kaguya::LuaTable objects = luaState.newTable();
+		std::vector<bool> toLua(end - start);
+		size_t count = 0;
+		for (size_t i = start; i < end; i++) {
+			describeObject(ids[i], false, false, tags[i]);
+			if ((toLua[i - start] = rulesPassToLua())) objects[++count] = batchObject();
+		}
+		kaguya::LuaTable results = callBatchFunction("node_batch_function", objects, count);
+
+		count = 0;
+		for (size_t i = start; i < end; i++) {
+			beginNode(ids[i], nodes[i], tags[i]);
+			applyRules();
+			if (toLua[i - start]) applyDirectives(results[++count]);
+			finishNode();
+		}
 	}
+}
 
-	return false;
+std::vector<bool> OsmLuaProcessing::setWays(const std::vector<WayID> &ids, const std::vector<LatpLonVec> &llVecs, const std::vector<TagMap> &tags) {
+	std::vector<bool> emitted(ids.size());
+	for (size_t start = 0; start < ids.size(); start += LUA_BATCH_SIZE) {
+		size_t end = std::min(ids.size(), start + LUA_BATCH_SIZE);
+		kaguya::LuaTable objects = luaState.newTable();
+		std::vector<bool> toLua(end - start);
+		size_t count = 0;
+		for (size_t i = start; i < end; i++) {
+			describeObject(ids[i], true, !llVecs[i].empty() && llVecs[i].front() == llVecs[i].back(), tags[i]);
+			if ((toLua[i - start] = rulesPassToLua())) objects[++count] = batchObject();
+		}
+		kaguya::LuaTable results = callBatchFunction("way_batch_function", objects, count);
+
+		count = 0;
+		for (size_t i = start; i < end; i++) {
+			if (toLua[i - start]) count++;
+			try {
+				beginWay(ids[i], llVecs[i], tags[i]);
+				applyRules();
+				if (toLua[i - start]) applyDirectives(results[count]);
+				emitted[i] = finishWay();
+			} catch (std::out_of_range &err) {
+				// Way is missing a node? Keep it, as some of it may have been written
+				std::cerr << std::endl << err.what() << std::endl;
+				emitted[i] = true;
+			}
+		}
+	}
+	return emitted;
+}
+
+// The current object as a Lua table: { id=, tags={ key=value,... }, closed=, relation= }
+kaguya::LuaTable OsmLuaProcessing::batchObject() {
+	kaguya::LuaTable object = luaState.newTable();
+	kaguya::LuaTable tagTable = luaState.newTable();
+	for (size_t i = 0; i < currentTags->size(); i++) {
+		boost::string_view key = currentTags->key(i);
+		tagTable[std::string(key.data(), key.size())] = currentTags->value(i);
+	}
+	object["id"] = originalOsmID;
+	object["tags"] = tagTable;
+	if (isWay) {
+		object["closed"] = isClosed;
+		object["relation"] = isRelation;
+	}
+	return object;
+}
+
+kaguya::LuaTable OsmLuaProcessing::callBatchFunction(const char *function, kaguya::LuaTable &objects, size_t count) {
+	if (count == 0) return luaState.newTable();
+	try {
+		TRACE_SPAN("lua batch function", function);
+		LuaCallTimer timer(strcmp(function, "node_batch_function") == 0 ? LuaFunction::NodeBatch : LuaFunction::WayBatch);
+		return luaState[function].call<kaguya::LuaTable>(objects);
+	} catch(luaProcessingException &e) {
+		std::cerr << "Lua error in " << function << " on a batch of " << count << " objects" << std::endl;
+		exit(1);
+	}
+}
+
+// Each directive is a table: { layer=, area=, centroid=, minzoom=, z_order=, attributes={ key=value,... } }
+void OsmLuaProcessing::applyDirectives(const kaguya::LuaRef &directives) {
+	if (directives.type() != LUA_TTABLE) return;
+	kaguya::LuaTable list = directives;
+	for (size_t j = 1; j <= list.size(); j++) {
+		kaguya::LuaTable directive = list[j];
+		if (directive["layer"].type() != LUA_TSTRING) { ProcessingError("Batch result has no layer"); continue; }
+		std::string layer = directive["layer"];
+
+		size_t before = outputs.size();
+		if (directive["centroid"].get<bool>()) LayerAsCentroid(layer);
+		else Layer(layer, directive["area"].get<bool>());
+		if (outputs.size() == before) continue;		// invalid geometry
+
+		if (directive["minzoom"].type() == LUA_TNUMBER) MinZoom(directive["minzoom"].get<double>());
+		if (directive["z_order"].type() == LUA_TNUMBER) ZOrder(directive["z_order"].get<double>());
+		if (directive["attributes"].type() != LUA_TTABLE) continue;
+		kaguya::LuaTable attributes = directive["attributes"];
+		attributes.foreach_table<std::string, kaguya::LuaRef>([&](const std::string &key, const kaguya::LuaRef &value) {
+			switch (value.type()) {
+				case LUA_TNUMBER:  AttributeNumeric(key, value.get<float>()); break;
+				case LUA_TBOOLEAN: AttributeBoolean(key, value.get<bool>()); break;
+				default:           Attribute(key, value.get<std::string>()); break;
+			}
+		});
+	}
 }
 
 // We are now processing a relation
-void OsmLuaProcessing::setRelation(int64_t relationId, WayVec const &outerWayVec, WayVec const &innerWayVec, const tag_map_t &tags, 
+void OsmLuaProcessing::setRelation(int64_t relationId, WayVec const &outerWayVec, WayVec const &innerWayVec, const TagMap &tags, 
                                    bool isNativeMP,      // only OSM type=multipolygon
                                    bool isInnerOuter) {  // any OSM relation with "inner" and "outer" roles (e.g. type=multipolygon|boundary)
 	reset();
@@ -668,7 +945,17 @@ void OsmLuaProcessing::setRelation(int64_t relationId, WayVec const &outerWayVec
 
 	// Start Lua processing for relation
 	if (!isNativeMP && !supportsWritingRelations) return;
-	try {
+	if (isNativeMP && !supportsWays && supportsWayBatches) {
+		// A batch of one, as each multipolygon is assembled on its own
+		if (applyRules()) {
+			kaguya::LuaTable objects = luaState.newTable();
+			objects[1] = batchObject();
+			kaguya::LuaTable results = callBatchFunction("way_batch_function", objects, 1);
+			applyDirectives(results[1]);
+		}
+	} else if (!isNativeMP || (applyRules() && supportsWays)) try {
+		TRACE_SPAN(isNativeMP ? "lua way_function" : "lua relation_function");
+		LuaCallTimer timer(isNativeMP ? LuaFunction::Way : LuaFunction::Relation, currentTags);
 		luaState[isNativeMP ? "way_function" : "relation_function"](this);
 	} catch(luaProcessingException &e) {
 		std::cerr << "Lua error on relation " << originalOsmID << std::endl;
@@ -692,6 +979,76 @@ vector<string> OsmLuaProcessing::GetSignificantNodeKeys() {
 	return luaState["node_keys"];
 }
 
+vector<string> OsmLuaProcessing::GetSignificantWayKeys() {
+	if (luaState["way_keys"].type() != LUA_TTABLE) return vector<string>();
+	return luaState["way_keys"];
+}
+
+vector<string> OsmLuaProcessing::GetSignificantRelationKeys() {
+	if (luaState["relation_keys"].type() != LUA_TTABLE) return vector<string>();
+	return luaState["relation_keys"];
+}
+
+// ----	Declarative rules from the config
+
+bool OsmLuaProcessing::ruleApplies(const TagRule &rule) const {
+	// Each geometry only makes sense for some kinds of object
+	switch (rule.geometry) {
+		case TagRule::Geometry::Point:    if (isWay) return false; break;
+		case TagRule::Geometry::Line:     if (!isWay || isRelation) return false; break;
+		case TagRule::Geometry::Area:     if (!isWay || !isClosed) return false; break;
+		case TagRule::Geometry::Centroid: if (!isWay) return false; break;
+	}
+	return rule.matches(*currentTags);
+}
+
+// Whether applyRules() would leave the current object for Lua, without writing anything
+bool OsmLuaProcessing::rulesPassToLua() const {
+	for (const TagRule &rule : config.rules.rules) {
+		if (!rule.fallthrough && ruleApplies(rule)) return false;
+	}
+	return true;
+}
+
+bool OsmLuaProcessing::applyRules() {
+	if (config.rules.empty()) return true;
+	bool callLua = true;
+	for (const TagRule &rule : config.rules.rules) {
+		if (!ruleApplies(rule)) continue;
+		if (!rule.fallthrough) callLua = false;
+
+		size_t before = outputs.size();
+		if (rule.geometry == TagRule::Geometry::Centroid) LayerAsCentroid(rule.layer);
+		else Layer(rule.layer, rule.geometry == TagRule::Geometry::Area);
+		if (outputs.size() == before) continue;		// invalid geometry
+		if (rule.minzoom >= 0) MinZoom(rule.minzoom);
+
+		for (const TagRule::Attribute &attribute : rule.attributes) {
+			std::string value = attribute.value;
+			if (!attribute.tag.empty()) {
+				boost::string_view found;
+				if (!currentTags->find(attribute.tag, found)) continue;
+				value = std::string(found.data(), found.size());
+			}
+			switch (attribute.type) {
+				case TagRule::AttributeType::String:
+					AttributeWithMinZoom(attribute.key, value, attribute.minzoom);
+					break;
+				case TagRule::AttributeType::Number: {
+					char *end;
+					float number = strtof(value.c_str(), &end);
+					if (end != value.c_str()) AttributeNumericWithMinZoom(attribute.key, number, attribute.minzoom);
+					break;
+				}
+				case TagRule::AttributeType::Boolean:
+					AttributeBooleanWithMinZoom(attribute.key, value != "no" && value != "false" && value != "0", attribute.minzoom);
+					break;
+			}
+		}
+	}
+	return callLua;
+}
+
 std::vector<OutputObject> OsmLuaProcessing::finalizeOutputs() {
 	std::vector<OutputObject> list;
 	list.reserve(this->outputs.size());
@@ -3,8 +3,6 @@
 #include "way_store.h"
 using namespace std;
 
-thread_local GeometryCache<Linestring> linestringCache;
-
 OsmMemTiles::OsmMemTiles(
 	size_t threadNum,
 	uint baseZoom,
@@ -14,10 +12,43 @@ OsmMemTiles::OsmMemTiles(
 )
 	: TileDataSource(threadNum, baseZoom, includeID),
 	nodeStore(nodeStore),
-	wayStore(wayStore)
+	wayStore(wayStore),
+	linestringCache(threadNum),
+	materializeBudget(0),
+	materializedBytes(0)
 {
 }
 
+void OsmMemTiles::setMemoryBudget(size_t bytes) {
+	if (bytes == 0) return;
+	// A quarter for the cache; the rest for materialized ways, which are
+	// chosen as they're read, so can't be evicted
+	linestringCache.setCapacity(bytes / 4);
+	materializeBudget = bytes - bytes / 4;
+}
+
+bool OsmMemTiles::shouldMaterialize(const Linestring &ls, uint minzoom) {
+	if (materializeBudget == 0 || ls.empty()) return false;
+
+	// Count the tiles it's in, from its minzoom up to the base zoom: it's rebuilt for each one
+	Box box;
+	geom::envelope(ls, box);
+	uint64_t fanOut = 0;
+	for (uint z = std::min(minzoom, baseZoom); z <= baseZoom && fanOut < MATERIALIZE_FANOUT; z++) {
+		uint64_t width  = lon2tilex(box.max_corner().x(), z) - lon2tilex(box.min_corner().x(), z) + 1;
+		uint64_t height = latp2tiley(box.min_corner().y(), z) - latp2tiley(box.max_corner().y(), z) + 1;
+		fanOut += width * height;
+	}
+	if (fanOut < MATERIALIZE_FANOUT) return false;
+
+	const size_t bytes = sizeof(Linestring) + ls.size() * sizeof(Point);
+	if (materializedBytes.fetch_add(bytes) + bytes > materializeBudget) {
+		materializedBytes -= bytes;
+		return false;
+	}
+	return true;
+}
+
 Geometry OsmMemTiles::buildWayGeometry(
 	const OutputGeometryType geomType, 
 	const NodeID objectID,
@@ -28,7 +59,14 @@ Geometry OsmMemTiles::buildWayGeometry(
 	}
 
 	if (geomType == LINESTRING_ && IS_WAY(objectID)) {
-		Linestring& ls = getOrBuildLinestring(objectID);
+		if (const MultiLinestring *simplified = pyramidLinestring(LINESTRING_, objectID, bbox.zoom)) {
+			MultiLinestring result;
+			geom::intersection(*simplified, bbox.getExtendBox(), result);
+			return result;
+		}
+
+		std::shared_ptr<const Linestring> cached = getOrBuildLinestring(objectID);
+		const Linestring& ls = *cached;
 
 		MultiLinestring out;
 		if(ls.empty())
@@ -59,30 +97,28 @@ Geometry OsmMemTiles::buildWayGeometry(
 }
 
 void OsmMemTiles::populateLinestring(Linestring& ls, NodeID objectID) {
-	std::vector<LatpLon> nodes = wayStore.at(OSM_ID(objectID));
+	if (!IS_WAY(objectID))
+		return TileDataSource::populateLinestring(ls, objectID);
+
+	thread_local std::vector<LatpLon> nodes;
+	wayStore.at(OSM_ID(objectID), nodes);
 
 	for (const LatpLon& node : nodes) {
 		boost::geometry::range::push_back(ls, boost::geometry::make<Point>(node.lon/10000000.0, node.latp/10000000.0));
 	}
 }
 
-Linestring& OsmMemTiles::getOrBuildLinestring(NodeID objectID) {
-	// Note: this function returns a reference, not a shared_ptr.
-	//
-	// This is safe, because this function is the only thing that can
-	// create/destroy entries in the cache, and the cache is thread-local.
-
-	Linestring* cachedEntry = linestringCache.get(objectID);
+std::shared_ptr<const Linestring> OsmMemTiles::getOrBuildLinestring(NodeID objectID) {
+	// The cache is shared, so hold on to the geometry in case another thread evicts it
+	std::shared_ptr<const Linestring> cachedEntry = linestringCache.get(objectID);
 	if (cachedEntry != nullptr)
-		return *cachedEntry;
+		return cachedEntry;
 
 	std::shared_ptr<Linestring> rv = std::make_shared<Linestring>();
-
-	Linestring& ls = *rv;
-	populateLinestring(ls, objectID);
+	populateLinestring(*rv, objectID);
 
 	linestringCache.add(objectID, rv);
-	return *rv;
+	return rv;
 }
 
 void OsmMemTiles::populateMultiPolygon(MultiPolygon& dst, NodeID objectID) {
@@ -107,4 +143,13 @@ void OsmMemTiles::Clear() {
 		entry.clear();
 	for (auto& entry : objectsWithIds)
 		entry.clear();
+	smallObjectBytes = 0;
+	smallObjectTiles.clear();
+	linestringCache.clear();
+	// Objects are read again for each mapsplit tile, so pyramids are rebuilt
+	for (size_t level = 0; level < PYRAMID_LEVELS; level++) {
+		linestringPyramid[level].clear();
+		multiLinestringPyramid[level].clear();
+		polygonPyramid[level].clear();
+	}
 }
@@ -4,6 +4,11 @@
 #include <fstream>
 #include <iterator>
 #include <unordered_map>
+#include <limits>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
 
 #include <ciso646>
 #include <boost/sort/sort.hpp>
@@ -13,8 +18,26 @@
 using namespace std;
 namespace bg = boost::geometry;
 
+// Multipolygons with more outer/inner pairs than this to test are assembled on several threads
+#define MULTIPOLYGON_PARALLEL_PAIRS 65536
+
+// Threads helping to assemble multipolygons, over all the relation threads.
+// They share assemblyThreads-1 of them, so that many threads each assembling
+// a big multipolygon don't start as many threads again apiece.
+static std::atomic<unsigned int> assemblyHelpersRunning(0);
+
+static unsigned int claimAssemblyHelpers(unsigned int wanted, unsigned int limit) {
+	unsigned int running = assemblyHelpersRunning.load();
+	unsigned int claimed;
+	do {
+		claimed = running < limit ? std::min(wanted, limit - running) : 0;
+		if (claimed == 0) return 0;
+	} while (!assemblyHelpersRunning.compare_exchange_weak(running, running + claimed));
+	return claimed;
+}
+
 static inline bool isClosed(const std::vector<LatpLon>& way) {
-	return way.begin() == way.end();
+	return way.size() > 1 && way.front() == way.back();
 }
 
 void OSMStore::open(std::string const &osm_store_filename)
@@ -27,9 +50,9 @@ MultiPolygon OSMStore::wayListMultiPolygon(WayVec::const_iterator outerBegin, Wa
 	MultiPolygon mp;
 	if (outerBegin == outerEnd) { return mp; } // no outers so quit
 
-	std::vector<LatpLonDeque> outers;
-	std::vector<LatpLonDeque> inners;
-	std::map<WayID,bool> done; // true=this way has already been added to outers/inners, don't reconsider
+	LatpLonRings outers;
+	LatpLonRings inners;
+	std::unordered_set<WayID> done; // ways already added to outers/inners, not to be reconsidered
 
 	// merge constituent ways together
 	mergeMultiPolygonWays(outers, done, outerBegin, outerEnd);
@@ -37,23 +60,57 @@ MultiPolygon OSMStore::wayListMultiPolygon(WayVec::const_iterator outerBegin, Wa
 
 	// add all inners and outers to the multipolygon
 	std::vector<Ring> filledInners;
-	for (auto it = inners.begin(); it != inners.end(); ++it) {
+	std::vector<Box> innerBoxes;
+	for (size_t i = 0; i < inners.size(); i++) {
 		Ring inner;
-		fillPoints(inner, it->begin(), it->end());
+		fillPoints(inner, inners.begin(i), inners.end(i));
+		innerBoxes.push_back(geom::return_envelope<Box>(inner));
 		filledInners.emplace_back(inner);
 	}
+	// Each outer takes the inners within it; only those whose box is inside
+	// the outer's box need the full test
 	bool onlyOneOuter = outers.size()==1;
-	for (auto ot = outers.begin(); ot != outers.end(); ot++) {
-		Polygon poly;
-		fillPoints(poly.outer(), ot->begin(), ot->end());
-		for (auto it = filledInners.begin(); it != filledInners.end(); ++it) {
-			if (onlyOneOuter || geom::within(*it, poly.outer())) { poly.inners().emplace_back(*it); }
+	mp.resize(outers.size());
+	auto buildPolygons = [&](size_t begin, size_t end) {
+		for (size_t o = begin; o < end; o++) {
+			Polygon &poly = mp[o];
+			fillPoints(poly.outer(), outers.begin(o), outers.end(o));
+			Box box = geom::return_envelope<Box>(poly.outer());
+			for (size_t i = 0; i < filledInners.size(); i++) {
+				if (onlyOneOuter || (geom::covered_by(innerBoxes[i], box) && geom::within(filledInners[i], poly.outer())))
+					poly.inners().emplace_back(filledInners[i]);
+			}
+			// fix winding
+			geom::correct(poly);
 		}
-		mp.emplace_back(move(poly));
+	};
+	const bool parallel = assemblyThreads > 1 && outers.size() > 1 && outers.size() * inners.size() >= MULTIPOLYGON_PARALLEL_PAIRS;
+	const unsigned int helpers = parallel ? claimAssemblyHelpers(std::min<size_t>(assemblyThreads, outers.size()) - 1, assemblyThreads - 1) : 0;
+	if (helpers > 0) {
+		// This thread works through the tasks too; errors are passed back to it
+		const size_t tasks = std::min<size_t>(outers.size(), (helpers + 1) * 4);
+		std::atomic<size_t> next(0);
+		std::exception_ptr error;
+		std::mutex errorMutex;
+		auto work = [&]() {
+			for (size_t t = next++; t < tasks; t = next++) {
+				try {
+					buildPolygons(outers.size() * t / tasks, outers.size() * (t + 1) / tasks);
+				} catch (...) {
+					std::lock_guard<std::mutex> lock(errorMutex);
+					if (!error) error = std::current_exception();
+				}
+			}
+		};
+		std::vector<std::thread> threads;
+		for (unsigned int h = 0; h < helpers; h++) threads.emplace_back(work);
+		work();
+		for (auto &thread : threads) thread.join();
+		assemblyHelpersRunning -= helpers;
+		if (error) std::rethrow_exception(error);
+	} else {
+		buildPolygons(0, outers.size());
 	}
-
-	// fix winding
-	geom::correct(mp);
 	return mp;
 }
 
@@ -61,14 +118,14 @@ MultiLinestring OSMStore::wayListMultiLinestring(WayVec::const_iterator outerBeg
 	MultiLinestring mls;
 	if (outerBegin == outerEnd) { return mls; }
 
-	std::vector<LatpLonDeque> linestrings;
-	std::map<WayID,bool> done;
+	LatpLonRings linestrings;
+	std::unordered_set<WayID> done;
 
 	mergeMultiPolygonWays(linestrings, done, outerBegin, outerEnd);
 
-	for (auto ot = linestrings.begin(); ot != linestrings.end(); ot++) {
+	for (size_t i = 0; i < linestrings.size(); i++) {
 		Linestring ls;
-		fillPoints(ls, ot->begin(), ot->end());
+		fillPoints(ls, linestrings.begin(i), linestrings.end(i));
 		mls.emplace_back(move(ls));
 	}
 
@@ -76,116 +133,92 @@ MultiLinestring OSMStore::wayListMultiLinestring(WayVec::const_iterator outerBeg
 }
 
 // Assemble multipolygon constituent ways
-// - Any closed polygons are added as-is
-// - Linestrings are joined to existing linestrings with which they share a start/end
-// - If no matches can be found, then one linestring is added (to 'attract' others)
-// - The process is rerun until no ways are left
-// There's quite a lot of copying going on here - could potentially be addressed
-void OSMStore::mergeMultiPolygonWays(std::vector<LatpLonDeque> &results, std::map<WayID,bool> &done, WayVec::const_iterator itBegin, WayVec::const_iterator itEnd) const {
-
-	// Create maps of start/end nodes
-	std::unordered_map<LatpLon, std::vector<WayID>> startNodes;
-	std::unordered_map<LatpLon, std::vector<WayID>> endNodes;
+// - Any closed ways are added as-is
+// - Each other way starts a chain, which takes unused ways that share its
+//   last point, then its first, until it closes or none are left
+// Each way is fetched once, ends are found through a hash of endpoints, and
+// each chain is written straight to the results once it's complete.
+void OSMStore::mergeMultiPolygonWays(LatpLonRings &results, std::unordered_set<WayID> &done, WayVec::const_iterator itBegin, WayVec::const_iterator itEnd) const {
+
+	std::vector<std::vector<LatpLon>> open;
+	std::vector<LatpLon> way;
 	for (auto it = itBegin; it != itEnd; ++it) {
-		if (done[*it]) { continue; }
+		if (!done.insert(*it).second) { continue; }
 		try {
-			auto const &way = ways.at(*it);
-			if (isClosed(way) || results.empty()) {
-				// if start==end, simply add it to the set
-				results.emplace_back(way.begin(), way.end());
-				done[*it] = true;
+			ways.at(*it, way);
+			if (way.empty()) { continue; }
+			if (isClosed(way)) {
+				results.points.insert(results.points.end(), way.begin(), way.end());
+				results.ends.push_back(results.points.size());
 			} else {
-				startNodes[way.front()].emplace_back(*it);
-				endNodes[way.back()].emplace_back(*it);
+				open.emplace_back(way);
 			}
 		} catch (std::out_of_range &err) {
 			if (verbose) { cerr << "Missing way in relation: " << err.what() << endl; }
-			done[*it] = true;
 		}
 	}
+	if (open.empty()) { return; }
 
-	auto deleteFromWayList = [&](LatpLon n, WayID w, bool which) {
-		auto &nodemap = which ? startNodes : endNodes;
-		std::vector<WayID> &waylist = nodemap.find(n)->second;
-		waylist.erase(std::remove(waylist.begin(), waylist.end(), w), waylist.end());
-		if (waylist.empty()) { nodemap.erase(nodemap.find(n)); }
-	};
-	auto removeWay = [&](WayID w) {
-		auto const &way = ways.at(w);
-		LatpLon first = way.front();
-		LatpLon last  = way.back();
-		if (startNodes.find(first) != startNodes.end()) { deleteFromWayList(first, w, true ); }
-		if (startNodes.find(last)  != startNodes.end()) { deleteFromWayList(last,  w, true ); }
-		if (endNodes.find(first)   != endNodes.end()  ) { deleteFromWayList(first, w, false); }
-		if (endNodes.find(last)    != endNodes.end()  ) { deleteFromWayList(last,  w, false); }
-		done[w] = true;
+	// Endpoint 2n is the start of open[n], 2n+1 its end. Endpoints at the
+	// same point are linked through nextAt, from the one in firstAt.
+	const unsigned int none = std::numeric_limits<unsigned int>::max();
+	std::unordered_map<LatpLon, unsigned int> firstAt;
+	firstAt.reserve(open.size() * 2);
+	std::vector<unsigned int> nextAt(open.size() * 2, none);
+	for (unsigned int e = 0; e < open.size() * 2; e++) {
+		const std::vector<LatpLon> &way = open[e / 2];
+		auto inserted = firstAt.emplace(e % 2 ? way.back() : way.front(), e);
+		if (!inserted.second) {
+			nextAt[e] = inserted.first->second;
+			inserted.first->second = e;
+		}
+	}
+	std::vector<bool> used(open.size(), false);
+	auto unusedAt = [&](LatpLon point) -> unsigned int {
+		auto found = firstAt.find(point);
+		if (found == firstAt.end()) { return none; }
+		for (unsigned int e = found->second; e != none; e = nextAt[e])
+			if (!used[e / 2]) { return e; }
+		return none;
 	};
 
-	// Loop through, repeatedly adding start/end nodes if we can
-	int added;
-	do {
-		added = 0;
-		for (auto rt = results.begin(); rt != results.end(); rt++) {
-			bool working=true;
-			do {
-				LatpLon rFirst = rt->front();
-				LatpLon rLast  = rt->back();
-				if (rFirst==rLast) break;
-				if (startNodes.find(rLast)!=startNodes.end()) {
-					// append to the result
-					auto match = startNodes.find(rLast)->second;
-					auto nodes = ways.at(match.back());
-					rt->insert(rt->end(), nodes.begin(), nodes.end());
-					removeWay(match.back());
-					added++;
-
-				} else if (endNodes.find(rLast)!=endNodes.end()) {
-					// append reversed to the original
-					auto match = endNodes.find(rLast)->second;
-					auto nodes = ways.at(match.back());
-					rt->insert(rt->end(),
-						std::make_reverse_iterator(nodes.end()),
-						std::make_reverse_iterator(nodes.begin()));
-					removeWay(match.back());
-					added++;
-
-				} else if (endNodes.find(rFirst)!=endNodes.end()) {
-					// prepend to the original
-					auto match = endNodes.find(rFirst)->second;
-					auto nodes = ways.at(match.back());
-					rt->insert(rt->begin(), nodes.begin(), nodes.end());
-					removeWay(match.back());
-					added++;
-
-				} else if (startNodes.find(rFirst)!=startNodes.end()) {
-					// prepend reversed to the original
-					auto match = startNodes.find(rFirst)->second;
-					auto nodes = ways.at(match.back());
-					rt->insert(rt->begin(),
-						std::make_reverse_iterator(nodes.end()),
-						std::make_reverse_iterator(nodes.begin()));
-					removeWay(match.back());
-					added++;
-
-				} else { working=false; }
-				
-			} while (working);
+	// A chain is a run of ways, each either forwards or reversed
+	std::deque<std::pair<unsigned int, bool>> chain;
+	auto firstOf = [&](std::pair<unsigned int, bool> piece) { return piece.second ? open[piece.first].back() : open[piece.first].front(); };
+	auto lastOf  = [&](std::pair<unsigned int, bool> piece) { return piece.second ? open[piece.first].front() : open[piece.first].back(); };
+
+	for (unsigned int seed = 0; seed < open.size(); seed++) {
+		if (used[seed]) { continue; }
+		used[seed] = true;
+		chain.clear();
+		chain.emplace_back(seed, false);
+		LatpLon first = open[seed].front(), last = open[seed].back();
+
+		// add ways to the end, then to the start, until it closes
+		for (unsigned int e; !(first == last) && (e = unusedAt(last)) != none; ) {
+			used[e / 2] = true;
+			chain.emplace_back(e / 2, e % 2 == 1);
+			last = lastOf(chain.back());
+		}
+		for (unsigned int e; !(first == last) && (e = unusedAt(first)) != none; ) {
+			used[e / 2] = true;
+			chain.emplace_front(e / 2, e % 2 == 0);
+			first = firstOf(chain.front());
 		}
 
-		// If nothing was added, then 'seed' it with a remaining unallocated way
-		for (int i=0; i<=1; i++) {
-			if (added>0) continue;
-			for (auto nt : (i==0 ? startNodes : endNodes)) {
-				WayID w = nt.second.back();
-				auto const &way = ways.at(w);
-				results.emplace_back(way.begin(), way.end());
-				added++;
-				removeWay(w);
-				break;
-			}
+		// each way after the first starts with the point the one before ended on
+		bool skipFirst = false;
+		for (auto const &piece : chain) {
+			const std::vector<LatpLon> &way = open[piece.first];
+			if (piece.second)
+				results.points.insert(results.points.end(), way.rbegin() + (skipFirst ? 1 : 0), way.rend());
+			else
+				results.points.insert(results.points.end(), way.begin() + (skipFirst ? 1 : 0), way.end());
+			skipFirst = true;
 		}
-	} while (added>0);
-};
+		results.ends.push_back(results.points.size());
+	}
+}
 
 
 void OSMStore::reportSize() const {
@@ -198,10 +231,6 @@ void OSMStore::reopen() {
 	relations.reopen();
 }
 
-void OSMStore::ensureUsedWaysInited() {
-	if (!used_ways.inited) used_ways.reserve(use_compact_nodes, nodes.size());
-}
-
 void OSMStore::clear() {
 	nodes.clear();
 	ways.clear();
@@ -210,3 +239,133 @@ void OSMStore::clear() {
 } 
 
 
+
+// ----	Relations found during RelationScan
+
+thread_local RelationScanStore::ScanBuffer* RelationScanStore::threadBuffer = nullptr;
+thread_local uint64_t RelationScanStore::threadBufferGeneration = 0;
+std::atomic<uint64_t> RelationScanStore::nextBufferGeneration(1);
+
+RelationScanStore::ScanBuffer& RelationScanStore::localBuffer() {
+	if (threadBuffer == nullptr || threadBufferGeneration != bufferGeneration) {
+		std::lock_guard<std::mutex> lock(mutex);
+		buffers.emplace_back();
+		threadBuffer = &buffers.back();
+		threadBufferGeneration = bufferGeneration;
+	}
+	return *threadBuffer;
+}
+
+// Must be called with stringMutex held
+uint32_t RelationScanStore::internString(boost::string_view str) {
+	auto it = tagStringIndex.find(str);
+	if (it != tagStringIndex.end()) return it->second;
+	const uint32_t index = tagStrings.size();
+	tagStrings.emplace_back(str.data(), str.size());
+	tagStringIndex.emplace(boost::string_view(tagStrings.back()), index);
+	return index;
+}
+
+void RelationScanStore::store_relation_tags(WayID relid, const TagMap &tags) {
+	// The tags are views into a block we're about to discard, so copy them
+	std::vector<tag_t> interned;
+	interned.reserve(tags.size());
+	{
+		std::lock_guard<std::mutex> lock(stringMutex);
+		for (size_t i = 0; i < tags.size(); i++)
+			interned.emplace_back(internString(tags.key(i)), internString(tags.value(i)));
+	}
+	localBuffer().tags.emplace_back(relid, std::move(interned));
+}
+
+void RelationScanStore::finalize(unsigned int threadNum) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (buffers.empty()) return;
+
+	// Ways in relations: merge the new pairs with any from an earlier .pbf, and sort
+	std::vector<std::pair<WayID, WayID>> ways;
+	size_t total = wayRelations.size();
+	for (const auto& buffer : buffers) total += buffer.ways.size();
+	if (total > std::numeric_limits<uint32_t>::max())
+		throw std::runtime_error("Too many ways in relations: " + std::to_string(total));
+	ways.reserve(total);
+	for (size_t i = 0; i < wayIds.size(); i++)
+		for (uint32_t j = wayOffsets[i]; j < wayOffsets[i + 1]; j++)
+			ways.emplace_back(wayIds[i], wayRelations[j]);
+	for (auto& buffer : buffers) {
+		ways.insert(ways.end(), buffer.ways.begin(), buffer.ways.end());
+		std::vector<std::pair<WayID, WayID>>().swap(buffer.ways);
+	}
+	boost::sort::block_indirect_sort(ways.begin(), ways.end(), std::max(threadNum, 1u));
+
+	wayIds.clear();
+	wayOffsets.clear();
+	wayRelations.clear();
+	wayRelations.reserve(ways.size());
+	for (const auto& way : ways) {
+		if (wayIds.empty() || wayIds.back() != way.first) {
+			wayIds.push_back(way.first);
+			wayOffsets.push_back(wayRelations.size());
+		}
+		wayRelations.push_back(way.second);
+	}
+	wayOffsets.push_back(wayRelations.size());
+	std::vector<std::pair<WayID, WayID>>().swap(ways);
+
+	// Relation tags: a relation read again (from a later .pbf) replaces its earlier tags
+	std::vector<std::pair<WayID, std::vector<tag_t>>> tags;
+	for (size_t i = 0; i < relationIds.size(); i++)
+		tags.emplace_back(relationIds[i], std::vector<tag_t>(relationTags.begin() + tagOffsets[i], relationTags.begin() + tagOffsets[i + 1]));
+	for (auto& buffer : buffers)
+		std::move(buffer.tags.begin(), buffer.tags.end(), std::back_inserter(tags));
+	std::stable_sort(tags.begin(), tags.end(), [](auto const &a, auto const &b) { return a.first < b.first; });
+
+	relationIds.clear();
+	tagOffsets.clear();
+	relationTags.clear();
+	for (size_t i = 0; i < tags.size(); i++) {
+		if (i + 1 < tags.size() && tags[i + 1].first == tags[i].first) continue;
+		relationIds.push_back(tags[i].first);
+		tagOffsets.push_back(relationTags.size());
+		relationTags.insert(relationTags.end(), tags[i].second.begin(), tags[i].second.end());
+	}
+	tagOffsets.push_back(relationTags.size());
+
+	buffers.clear();
+	bufferGeneration = nextBufferGeneration++;
+}
+
+RelationScanStore::relation_list_t RelationScanStore::relations_for_way(WayID wayid) const {
+	relation_list_t list;
+	auto it = std::lower_bound(wayIds.begin(), wayIds.end(), wayid);
+	if (it == wayIds.end() || *it != wayid) return list;
+	const size_t i = it - wayIds.begin();
+	list.first = wayRelations.data() + wayOffsets[i];
+	list.last = wayRelations.data() + wayOffsets[i + 1];
+	return list;
+}
+
+std::string RelationScanStore::get_relation_tag(WayID relid, const std::string &key) const {
+	auto it = std::lower_bound(relationIds.begin(), relationIds.end(), relid);
+	if (it == relationIds.end() || *it != relid) return "";
+	const size_t i = it - relationIds.begin();
+	for (uint32_t j = tagOffsets[i]; j < tagOffsets[i + 1]; j++)
+		if (tagStrings[relationTags[j].first] == key) return tagStrings[relationTags[j].second];
+	return "";
+}
+
+void RelationScanStore::clear() {
+	std::lock_guard<std::mutex> lock(mutex);
+	buffers.clear();
+	bufferGeneration = nextBufferGeneration++;
+	wayIds.clear();
+	wayOffsets.clear();
+	wayRelations.clear();
+	relationIds.clear();
+	tagOffsets.clear();
+	relationTags.clear();
+
+	std::lock_guard<std::mutex> stringLock(stringMutex);
+	tagStringIndex.clear();
+	tagStrings.clear();
+}
@@ -6,6 +6,9 @@
 #include "helpers.h"
 #include "coordinates_geom.h"
 #include <iostream>
+#include <cmath>
+#include <cstring>
+#include <limits>
 using namespace std;
 namespace geom = boost::geometry;
 
@@ -34,64 +37,121 @@ std::ostream& operator<<(std::ostream& os, OutputGeometryType geomType)
 
 // Write attribute key/value pairs (dictionary-encoded)
 void OutputObject::writeAttributes(
-	vector<string> *keyList, 
-	vector<vector_tile::Tile_Value> *valueList, 
+	LayerDictionary &dictionary,
 	AttributeStore const &attributeStore,
 	vector_tile::Tile_Feature *featurePtr,
 	char zoom) const {
 
-	auto attr = attributeStore.getUnsafe(attributes);
-
-	for(auto const &it: attr) {
-		if (it->minzoom > zoom) continue;
-
-		// Look for key
-		std::string const &key = attributeStore.keyStore.getKeyUnsafe(it->keyIndex);
-		auto kt = find(keyList->begin(), keyList->end(), key);
-		if (kt != keyList->end()) {
-			uint32_t subscript = kt - keyList->begin();
-			featurePtr->add_tags(subscript);
-		} else {
-			uint32_t subscript = keyList->size();
-			keyList->push_back(key);
-			featurePtr->add_tags(subscript);
-		}
-		
-		// Look for value
-		int subscript = findValue(valueList, *it);
-		if (subscript>-1) {
-			featurePtr->add_tags(subscript);
-		} else {
-			uint32_t subscript = valueList->size();
-			vector_tile::Tile_Value value;
-			if (it->hasStringValue()) {
-				value.set_string_value(it->stringValue());
-			} else if (it->hasBoolValue()) {
-				value.set_bool_value(it->boolValue());
-			} else if (it->hasFloatValue()) {
-				value.set_float_value(it->floatValue());
-			}
-			
-			valueList->push_back(value);
-			featurePtr->add_tags(subscript);
-		}
+	AttributeSpan span = attributeStore.getSpan(attributes);
+	const bool allShown = zoom >= span.maxMinZoom;
 
-		//if(value.hasStringValue())
-		//	std::cout << "Write attr: " << key << " " << value.string_value() << std::endl;	
+	for (uint32_t pairIndex : span) {
+		const AttributePair &pair = attributeStore.pairStore.getPairUnsafe(pairIndex);
+		if (!allShown && pair.minzoom > zoom) continue;
+		const std::string &key = attributeStore.keyStore.getKeyUnsafe(pair.keyIndex);
+		featurePtr->add_tags(dictionary.keySubscript(pair.keyIndex, key));
+		featurePtr->add_tags(dictionary.valueSubscript(pair));
 	}
 }
 
-// Find a value in the value dictionary
-// (we can't easily use find() because of the different value-type encoding - 
-//	should be possible to improve this though)
-int OutputObject::findValue(const vector<vector_tile::Tile_Value>* valueList, const AttributePair& value) const {
-	for (size_t i=0; i<valueList->size(); i++) {
-		const vector_tile::Tile_Value& v = valueList->at(i);
-		if (v.has_string_value() && value.hasStringValue() && v.string_value()==value.stringValue()) { return i; }
-		if (v.has_float_value()  && value.hasFloatValue()  && v.float_value() ==value.floatValue() ) { return i; }
-		if (v.has_bool_value()	 && value.hasBoolValue()   && v.bool_value()  ==value.boolValue()	) { return i; }
+// **********************************************************
+
+LayerDictionary::LayerDictionary(): generation(1) {
+	boolValues[0] = boolValues[1] = -1;
+}
+
+void LayerDictionary::clear() {
+	keys.clear();
+	values.clear();
+	generation++;
+	keysByName.clear();
+	valuesByPair.clear();
+	stringValues.clear();
+	mergedStrings.clear();
+	floatValues.clear();
+	boolValues[0] = boolValues[1] = -1;
+}
+
+float LayerDictionary::normalizeFloat(float f) {
+	if (std::isnan(f)) return std::numeric_limits<float>::quiet_NaN();
+	if (f == 0.0f) return 0.0f;
+	return f;
+}
+
+uint32_t LayerDictionary::floatKey(float f) {
+	f = normalizeFloat(f);
+	uint32_t bits;
+	std::memcpy(&bits, &f, sizeof(bits));
+	return bits;
+}
+
+void LayerDictionary::addKey(const std::string &key) {
+	keysByName.emplace(key, keys.size());
+	keys.push_back(key);
+}
+
+void LayerDictionary::addValue(const vector_tile::Tile_Value &value) {
+	// Values of other types can't match an AttributePair, so needn't be indexed
+	if (value.has_string_value()) {
+		mergedStrings.push_back(value.string_value());
+		stringValues.emplace(boost::string_view(mergedStrings.back()), values.size());
+	}
+	else if (value.has_float_value()) floatValues.emplace(floatKey(value.float_value()), values.size());
+	else if (value.has_bool_value() && boolValues[value.bool_value()] < 0) boolValues[value.bool_value()] = values.size();
+	values.push_back(value);
+}
+
+uint32_t LayerDictionary::keySubscript(uint16_t keyIndex, const std::string &key) {
+	if (keyIndex >= keysByIndex.size()) keysByIndex.resize(keyIndex + 1, std::make_pair(0, 0));
+	auto &cached = keysByIndex[keyIndex];
+	if (cached.first == generation) return cached.second;
+
+	auto it = keysByName.find(key);
+	uint32_t subscript;
+	if (it != keysByName.end()) {
+		subscript = it->second;
+	} else {
+		subscript = keys.size();
+		addKey(key);
+	}
+	cached = std::make_pair(generation, subscript);
+	return subscript;
+}
+
+uint32_t LayerDictionary::valueSubscript(const AttributePair &pair) {
+	auto cached = valuesByPair.find(&pair);
+	if (cached != valuesByPair.end()) return cached->second;
+
+	uint32_t subscript = values.size();
+	bool found = false;
+	if (pair.hasStringValue()) {
+		auto it = stringValues.find(pair.stringValue());
+		if (it != stringValues.end()) { subscript = it->second; found = true; }
+	} else if (pair.hasFloatValue()) {
+		auto it = floatValues.find(floatKey(pair.floatValue()));
+		if (it != floatValues.end()) { subscript = it->second; found = true; }
+	} else if (pair.hasBoolValue()) {
+		if (boolValues[pair.boolValue()] >= 0) { subscript = boolValues[pair.boolValue()]; found = true; }
+	}
+
+	if (!found) {
+		vector_tile::Tile_Value value;
+		if (pair.hasStringValue()) {
+			// The interned string outlives the dictionary, so the view can point at it
+			boost::string_view str = pair.stringValue();
+			value.set_string_value(str.data(), str.size());
+			stringValues.emplace(str, values.size());
+		} else if (pair.hasBoolValue()) {
+			value.set_bool_value(pair.boolValue());
+			boolValues[pair.boolValue()] = values.size();
+		} else if (pair.hasFloatValue()) {
+			value.set_float_value(normalizeFloat(pair.floatValue()));
+			floatValues.emplace(floatKey(pair.floatValue()), values.size());
+		}
+		values.push_back(value);
 	}
-	return -1;
+	valuesByPair.emplace(&pair, subscript);
+	return subscript;
 }
 
 // Comparision functions
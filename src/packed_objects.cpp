@@ -0,0 +1,125 @@
+#include "packed_objects.h"
+
+// Wider differences are stored whole, so that a value always fits one 8-byte load
+#define PACKED_OBJECTS_MAX_WIDTH 57
+
+static uint8_t widthFor(uint64_t range) {
+	uint8_t width = 0;
+	while (width < 64 && (range >> width) != 0) width++;
+	return width > PACKED_OBJECTS_MAX_WIDTH ? 64 : width;
+}
+
+static void writeColumn(std::vector<uint8_t> &data, const std::vector<uint64_t> &values, unsigned width) {
+	const size_t start = data.size();
+	data.resize(start + (values.size() * width + 7) / 8);
+	if (width == 0) return;
+	for (size_t i = 0; i < values.size(); i++) {
+		if (width == 64) {
+			memcpy(&data[start + i * 8], &values[i], 8);
+			continue;
+		}
+		size_t bit = i * width;
+		uint64_t value = values[i];
+		for (unsigned written = 0; written < width; ) {
+			data[start + bit / 8] |= uint8_t(value << (bit % 8));
+			const unsigned taken = std::min(width - written, 8 - unsigned(bit % 8));
+			value >>= taken;
+			bit += taken;
+			written += taken;
+		}
+	}
+}
+
+static uint64_t idOf(const OutputObject &) { return 0; }
+static uint64_t idOf(const OutputObjectID &object) { return object.id; }
+static const OutputObject &objectOf(const OutputObject &object) { return object; }
+static const OutputObject &objectOf(const OutputObjectID &object) { return object.oo; }
+
+template<class T> void PackedObjects::packObjects(const std::vector<Z6OffsetKey> &keys, const std::vector<T> &objects) {
+	clear();
+	count = keys.size();
+	blocks.reserve((count + PACKED_OBJECTS_BLOCK - 1) / PACKED_OBJECTS_BLOCK);
+	std::vector<uint64_t> columns[ColumnCount];
+	for (size_t start = 0; start < count; start += PACKED_OBJECTS_BLOCK) {
+		const size_t end = std::min(count, start + PACKED_OBJECTS_BLOCK);
+		for (auto &column : columns) column.clear();
+		for (size_t i = start; i < end; i++) {
+			const OutputObject &oo = objectOf(objects[i]);
+			columns[KeyColumn].push_back(keys[i]);
+			columns[ObjectIDColumn].push_back(oo.objectID);
+			columns[AttributesColumn].push_back(oo.attributes);
+			columns[RestColumn].push_back(restOf(oo));
+			columns[IDColumn].push_back(idOf(objects[i]));
+		}
+
+		Block block;
+		uint64_t bases[ColumnCount];
+		for (unsigned c = 0; c < ColumnCount; c++) {
+			auto range = std::minmax_element(columns[c].begin(), columns[c].end());
+			bases[c] = *range.first;
+			block.widths[c] = widthFor(*range.second - *range.first);
+			for (uint64_t &value : columns[c]) value -= bases[c];
+		}
+		block.offset = data.size();
+		block.keyBase = bases[KeyColumn];
+		block.firstKey = keys[start];
+		block.objectIDBase = bases[ObjectIDColumn];
+		block.attributesBase = bases[AttributesColumn];
+		block.restBase = bases[RestColumn];
+		block.idBase = bases[IDColumn];
+		for (unsigned c = 0; c < ColumnCount; c++) writeColumn(data, columns[c], block.widths[c]);
+		blocks.push_back(block);
+	}
+	data.resize(data.size() + 8);
+	data.shrink_to_fit();
+}
+
+void PackedObjects::pack(const std::vector<Z6OffsetKey> &keys, const std::vector<OutputObject> &objects) { packObjects(keys, objects); }
+void PackedObjects::pack(const std::vector<Z6OffsetKey> &keys, const std::vector<OutputObjectID> &objects) { packObjects(keys, objects); }
+
+void PackedObjects::clear() {
+	count = 0;
+	std::vector<Block>().swap(blocks);
+	std::vector<uint8_t>().swap(data);
+}
+
+OutputObjectID PackedObjects::object(size_t i) const {
+	const Block &block = blocks[i / PACKED_OBJECTS_BLOCK];
+	const uint8_t *columns[ColumnCount];
+	columnsOf(block, columns);
+	return decode(block, columns, i % PACKED_OBJECTS_BLOCK);
+}
+
+size_t PackedObjects::lowerBound(size_t first, size_t last, uint64_t target) const {
+	if (first >= last) return first;
+	// The blocks that start after first are searched by their first keys,
+	// then the one block the answer can be in, by its keys
+	const size_t firstBlock = first / PACKED_OBJECTS_BLOCK, lastBlock = (last - 1) / PACKED_OBJECTS_BLOCK;
+	size_t low = firstBlock + 1, high = lastBlock + 1;
+	while (low < high) {
+		const size_t middle = (low + high) / 2;
+		if (blocks[middle].firstKey < target) low = middle + 1;
+		else high = middle;
+	}
+	size_t begin = std::max(first, (low - 1) * PACKED_OBJECTS_BLOCK), end = std::min(last, low * PACKED_OBJECTS_BLOCK);
+	while (begin < end) {
+		const size_t middle = (begin + end) / 2;
+		if (key(middle) < target) begin = middle + 1;
+		else end = middle;
+	}
+	return begin;
+}
+
+void PackedObjects::unpack(std::vector<Z6OffsetKey> &keys, std::vector<OutputObjectID> &objects) const {
+	keys.clear();
+	objects.clear();
+	for (size_t i = 0; i < count; i++) keys.push_back(key(i));
+	forEach(0, count, [&](const OutputObjectID &object) { objects.push_back(object); });
+}
+
+void PackedObjects::unpack(std::vector<Z6OffsetKey> &keys, std::vector<OutputObject> &objects) const {
+	keys.clear();
+	objects.clear();
+	for (size_t i = 0; i < count; i++) keys.push_back(key(i));
+	forEach(0, count, [&](const OutputObjectID &object) { objects.push_back(object.oo); });
+}
@@ -32,13 +32,21 @@ BlobHeader readHeader(istream &input) {
 void readBlock(google::protobuf::Message *messagePtr, std::size_t datasize, istream &input) {
 	if (input.eof()) { return ; }
 
+	string contents;
+	readBlockContents(contents, datasize, input);
+	messagePtr->ParseFromString(contents);
+}
+
+void readBlockContents(string &contents, std::size_t datasize, istream &input) {
+	contents.clear();
+	if (input.eof()) { return ; }
+
 	// get Blob and parse
 	Blob blob;
 	readMessage(&blob, input, datasize);
 
 	// Unzip the gzipped content
-	string contents = decompress_string(blob.zlib_data(), false);
-	messagePtr->ParseFromString(contents);
+	contents = decompress_string(blob.zlib_data(), false);
 }
 
 void writeBlock(google::protobuf::Message *messagePtr, ostream &output, string headerType) {
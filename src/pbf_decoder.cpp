@@ -0,0 +1,154 @@
+#include "pbf_decoder.h"
+using namespace std;
+
+PbfPackedVarints PbfMessage::packed() {
+	if (wireType() != 2) throw runtime_error("PBF repeated field " + to_string(field()) + " isn't packed");
+	return PbfPackedVarints(bytes());
+}
+
+void PbfMessage::skip() {
+	switch (wireType()) {
+		case 0: readVarint(ptr, end); break;
+		case 1: skipFixed(8); break;
+		case 2: bytes(); break;
+		case 5: skipFixed(4); break;
+		default: throw runtime_error("Unsupported PBF wire type " + to_string(wireType()));
+	}
+}
+
+void PbfMessage::skipFixed(size_t length) {
+	// Checked before moving, as a pointer past the end is undefined
+	if (length > size_t(end - ptr)) throw runtime_error("PBF field runs past the end of its message");
+	ptr += length;
+}
+
+void PbfDenseNodes::parse(boost::string_view data) {
+	*this = PbfDenseNodes();
+	PbfMessage message(data);
+	while (message.next()) {
+		switch (message.field()) {
+			case 1:  ids = message.packed(); break;
+			case 8:  lats = message.packed(); break;
+			case 9:  lons = message.packed(); break;
+			case 10: keysVals = message.packed(); break;
+			default: message.skip();
+		}
+	}
+}
+
+void PbfWay::parse(boost::string_view data) {
+	*this = PbfWay();
+	PbfMessage message(data);
+	while (message.next()) {
+		switch (message.field()) {
+			case 1:  id = message.varint(); break;
+			case 2:  keys = message.packed(); break;
+			case 3:  vals = message.packed(); break;
+			case 8:  refs = message.packed(); break;
+			case 9:  lats = message.packed(); break;
+			case 10: lons = message.packed(); break;
+			default: message.skip();
+		}
+	}
+}
+
+void PbfRelation::parse(boost::string_view data) {
+	*this = PbfRelation();
+	PbfMessage message(data);
+	while (message.next()) {
+		switch (message.field()) {
+			case 1:  id = message.varint(); break;
+			case 2:  keys = message.packed(); break;
+			case 3:  vals = message.packed(); break;
+			case 8:  roles = message.packed(); break;
+			case 9:  memids = message.packed(); break;
+			case 10: types = message.packed(); break;
+			default: message.skip();
+		}
+	}
+}
+
+bool PbfRelation::isType(int typeKey, int val) const {
+	if (typeKey==-1 || val==-1) return false;
+	PbfPackedVarints k = keys, v = vals;
+	while (!k.empty() && !v.empty()) {
+		uint64_t key = k.next(), value = v.next();
+		if (key == uint64_t(typeKey)) return value == uint64_t(val);
+	}
+	return false;
+}
+
+void PbfPrimitiveGroup::parse(boost::string_view data) {
+	dense = boost::string_view();
+	ways.clear();
+	relations.clear();
+	nodes = 0;
+	PbfMessage message(data);
+	while (message.next()) {
+		switch (message.field()) {
+			case 1:  message.skip(); nodes++; break;
+			case 2:  dense = message.bytes(); break;
+			case 3:  ways.push_back(message.bytes()); break;
+			case 4:  relations.push_back(message.bytes()); break;
+			default: message.skip();
+		}
+	}
+}
+
+void PbfPrimitiveBlock::parse(const char *data, size_t size) {
+	strings.clear();
+	groups.clear();
+	PbfMessage message(boost::string_view(data, size));
+	while (message.next()) {
+		switch (message.field()) {
+			case 1: {
+				PbfMessage table(message.bytes());
+				while (table.next()) {
+					if (table.field() == 1) strings.push_back(table.bytes());
+					else table.skip();
+				}
+				break;
+			}
+			case 2:  groups.push_back(message.bytes()); break;
+			default: message.skip();
+		}
+	}
+	indexStrings();
+}
+
+// FNV-1a
+size_t PbfPrimitiveBlock::hashString(boost::string_view str) {
+	uint64_t hash = 14695981039346656037ull;
+	for (char c : str) {
+		hash ^= uint8_t(c);
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+void PbfPrimitiveBlock::indexStrings() {
+	size_t size = 16;
+	while (size < strings.size() * 2) size *= 2;
+	stringIndex.assign(size, -1);
+	const size_t mask = size - 1;
+	for (size_t i=0; i<strings.size(); i++) {
+		size_t slot = hashString(strings[i]) & mask;
+		while (stringIndex[slot] != -1) {
+			// Keep the first of any duplicates, as a linear search would find
+			if (strings[stringIndex[slot]] == strings[i]) break;
+			slot = (slot + 1) & mask;
+		}
+		if (stringIndex[slot] == -1) stringIndex[slot] = i;
+	}
+}
+
+int PbfPrimitiveBlock::findString(boost::string_view str) const {
+	if (stringIndex.empty()) return -1;
+	const size_t mask = stringIndex.size() - 1;
+	size_t slot = hashString(str) & mask;
+	while (stringIndex[slot] != -1) {
+		if (strings[stringIndex[slot]] == str) return stringIndex[slot];
+		slot = (slot + 1) & mask;
+	}
+	return -1;
+}
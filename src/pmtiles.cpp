@@ -0,0 +1,246 @@
+#include "pmtiles.h"
+#include "helpers.h"
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+// Tiles at or below this size are checked for duplicates before being written
+#define PMTILES_DEDUPE_MAX_SIZE 1024
+
+// ---- Little-endian and varint encoding
+
+static void writeUint(string &out, uint64_t value, unsigned bytes) {
+	for (unsigned i = 0; i < bytes; i++) {
+		out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+	}
+}
+
+static void writeVarint(string &out, uint64_t value) {
+	while (value >= 0x80) {
+		out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+		value >>= 7;
+	}
+	out.push_back(static_cast<char>(value));
+}
+
+static uint64_t readVarint(const string &data, size_t &pos) {
+	uint64_t value = 0;
+	for (unsigned shift = 0; shift < 64; shift += 7) {
+		if (pos >= data.size()) throw runtime_error("PMTiles directory ended unexpectedly");
+		uint8_t byte = static_cast<uint8_t>(data[pos++]);
+		value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) return value;
+	}
+	throw runtime_error("PMTiles varint too long");
+}
+
+std::string PMTilesHeader::serialize() const {
+	string out = "PMTiles";
+	writeUint(out, 3, 1);
+	writeUint(out, rootDirOffset, 8);
+	writeUint(out, rootDirLength, 8);
+	writeUint(out, jsonMetadataOffset, 8);
+	writeUint(out, jsonMetadataLength, 8);
+	writeUint(out, leafDirsOffset, 8);
+	writeUint(out, leafDirsLength, 8);
+	writeUint(out, tileDataOffset, 8);
+	writeUint(out, tileDataLength, 8);
+	writeUint(out, addressedTilesCount, 8);
+	writeUint(out, tileEntriesCount, 8);
+	writeUint(out, tileContentsCount, 8);
+	writeUint(out, clustered ? 1 : 0, 1);
+	writeUint(out, internalCompression, 1);
+	writeUint(out, tileCompression, 1);
+	writeUint(out, tileType, 1);
+	writeUint(out, minZoom, 1);
+	writeUint(out, maxZoom, 1);
+	writeUint(out, static_cast<uint32_t>(minLonE7), 4);
+	writeUint(out, static_cast<uint32_t>(minLatE7), 4);
+	writeUint(out, static_cast<uint32_t>(maxLonE7), 4);
+	writeUint(out, static_cast<uint32_t>(maxLatE7), 4);
+	writeUint(out, centerZoom, 1);
+	writeUint(out, static_cast<uint32_t>(centerLonE7), 4);
+	writeUint(out, static_cast<uint32_t>(centerLatE7), 4);
+	return out;
+}
+
+// ---- Tile IDs and directories
+
+// Tile IDs count through all tiles at lower zooms, then along a Hilbert curve at this zoom
+uint64_t PMTiles::zxyToTileId(uint8_t zoom, uint32_t x, uint32_t y) {
+	uint64_t acc = 0;
+	for (uint8_t z = 0; z < zoom; z++) acc += (1ull << z) * (1ull << z);
+
+	int64_t n = 1ll << zoom;
+	int64_t tx = x, ty = y, d = 0;
+	for (int64_t s = n / 2; s > 0; s /= 2) {
+		int64_t rx = (tx & s) > 0;
+		int64_t ry = (ty & s) > 0;
+		d += s * s * ((3 * rx) ^ ry);
+		if (ry == 0) {
+			if (rx == 1) {
+				tx = n - 1 - tx;
+				ty = n - 1 - ty;
+			}
+			std::swap(tx, ty);
+		}
+	}
+	return acc + d;
+}
+
+std::string PMTiles::serializeDirectory(const std::vector<PMTilesEntry> &entries) {
+	string out;
+	writeVarint(out, entries.size());
+	uint64_t lastId = 0;
+	for (const auto &entry : entries) {
+		writeVarint(out, entry.tileId - lastId);
+		lastId = entry.tileId;
+	}
+	for (const auto &entry : entries) writeVarint(out, entry.runLength);
+	for (const auto &entry : entries) writeVarint(out, entry.length);
+	for (size_t i = 0; i < entries.size(); i++) {
+		// 0 means "directly after the previous entry"
+		if (i > 0 && entries[i].offset == entries[i-1].offset + entries[i-1].length) {
+			writeVarint(out, 0);
+		} else {
+			writeVarint(out, entries[i].offset + 1);
+		}
+	}
+	return out;
+}
+
+std::vector<PMTilesEntry> PMTiles::deserializeDirectory(const std::string &data) {
+	size_t pos = 0;
+	const uint64_t numEntries = readVarint(data, pos);
+	std::vector<PMTilesEntry> entries(numEntries);
+	uint64_t lastId = 0;
+	for (auto &entry : entries) {
+		lastId += readVarint(data, pos);
+		entry.tileId = lastId;
+	}
+	for (auto &entry : entries) entry.runLength = readVarint(data, pos);
+	for (auto &entry : entries) entry.length = readVarint(data, pos);
+	for (size_t i = 0; i < entries.size(); i++) {
+		uint64_t offset = readVarint(data, pos);
+		if (offset == 0 && i > 0) {
+			entries[i].offset = entries[i-1].offset + entries[i-1].length;
+		} else {
+			entries[i].offset = offset - 1;
+		}
+	}
+	return entries;
+}
+
+// Build the (compressed) root directory, splitting into leaf directories if it
+// wouldn't otherwise fit in the space reserved after the header
+std::string PMTiles::buildDirectories(std::vector<PMTilesEntry> &entries, std::string &leafDirs) const {
+	const size_t maxRootLength = PMTILES_ROOT_LENGTH - PMTILES_HEADER_LENGTH;
+	leafDirs.clear();
+	string root = compress_string(serializeDirectory(entries), Z_DEFAULT_COMPRESSION, true);
+	if (root.size() <= maxRootLength) return root;
+
+	for (size_t leafSize = 4096; ; leafSize *= 2) {
+		leafDirs.clear();
+		std::vector<PMTilesEntry> rootEntries;
+		for (size_t i = 0; i < entries.size(); i += leafSize) {
+			std::vector<PMTilesEntry> leaf(entries.begin() + i, entries.begin() + std::min(i + leafSize, entries.size()));
+			string serialized = compress_string(serializeDirectory(leaf), Z_DEFAULT_COMPRESSION, true);
+			rootEntries.push_back({ leaf.front().tileId, leafDirs.size(), static_cast<uint32_t>(serialized.size()), 0 });
+			leafDirs += serialized;
+		}
+		root = compress_string(serializeDirectory(rootEntries), Z_DEFAULT_COMPRESSION, true);
+		if (root.size() <= maxRootLength) return root;
+	}
+}
+
+// ---- Write .pmtiles
+
+PMTiles::PMTiles():
+	tileDataLength(0)
+{}
+
+PMTiles::~PMTiles() {
+	if (outputStream.is_open()) outputStream.close();
+}
+
+void PMTiles::openForWriting(string &filename) {
+	outputStream.open(filename, ios::out | ios::trunc | ios::binary);
+	if (!outputStream) throw runtime_error("Couldn't open " + filename + " for writing");
+
+	// Reserve space for the header and root directory, which are written last
+	string reserved(PMTILES_ROOT_LENGTH, '\0');
+	outputStream.write(reserved.data(), reserved.size());
+	cout << "Creating pmtiles at " << filename << endl;
+}
+
+void PMTiles::saveTile(int zoom, int x, int y, string *data) {
+	const uint64_t tileId = zxyToTileId(zoom, x, y);
+	const uint32_t length = data->size();
+
+	std::lock_guard<std::mutex> lock(m);
+	if (length <= PMTILES_DEDUPE_MAX_SIZE) {
+		auto existing = smallTiles.find(*data);
+		if (existing != smallTiles.end()) {
+			entries.push_back({ tileId, existing->second.first, existing->second.second, 1 });
+			return;
+		}
+		smallTiles[*data] = std::make_pair(tileDataLength, length);
+	}
+
+	outputStream.write(data->data(), length);
+	entries.push_back({ tileId, tileDataLength, length, 1 });
+	tileDataLength += length;
+	header.tileContentsCount++;
+}
+
+void PMTiles::closeForWriting(const std::string &jsonMetadata) {
+	std::lock_guard<std::mutex> lock(m);
+
+	// Sort into tile ID order, and collapse runs of identical consecutive tiles
+	std::sort(entries.begin(), entries.end(), [](const PMTilesEntry &a, const PMTilesEntry &b) { return a.tileId < b.tileId; });
+	header.addressedTilesCount = entries.size();
+	std::vector<PMTilesEntry> runs;
+	for (const auto &entry : entries) {
+		if (!runs.empty()) {
+			PMTilesEntry &last = runs.back();
+			if (last.tileId + last.runLength == entry.tileId && last.offset == entry.offset && last.length == entry.length) {
+				last.runLength++;
+				continue;
+			}
+		}
+		runs.push_back(entry);
+	}
+	entries.clear();
+	entries.shrink_to_fit();
+	smallTiles.clear();
+	header.tileEntriesCount = runs.size();
+
+	string leafDirs;
+	string root = buildDirectories(runs, leafDirs);
+	string metadata = compress_string(jsonMetadata, Z_DEFAULT_COMPRESSION, true);
+
+	// Tiles are written in z6-clustered order rather than tile ID order
+	header.clustered = false;
+	header.internalCompression = PMTILES_COMPRESSION_GZIP;
+	header.rootDirOffset = PMTILES_HEADER_LENGTH;
+	header.rootDirLength = root.size();
+	header.tileDataOffset = PMTILES_ROOT_LENGTH;
+	header.tileDataLength = tileDataLength;
+	header.jsonMetadataOffset = header.tileDataOffset + tileDataLength;
+	header.jsonMetadataLength = metadata.size();
+	header.leafDirsOffset = header.jsonMetadataOffset + metadata.size();
+	header.leafDirsLength = leafDirs.size();
+
+	outputStream.seekp(header.jsonMetadataOffset);
+	outputStream.write(metadata.data(), metadata.size());
+	outputStream.write(leafDirs.data(), leafDirs.size());
+
+	string headerData = header.serialize();
+	outputStream.seekp(0);
+	outputStream.write(headerData.data(), headerData.size());
+	outputStream.write(root.data(), root.size());
+	outputStream.close();
+	if (!outputStream) cerr << "Couldn't finish writing .pmtiles file" << endl;
+}
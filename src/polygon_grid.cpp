@@ -0,0 +1,189 @@
+#include "polygon_grid.h"
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+
+// Edge directions, anticlockwise from +x; an edge has a filled cell on its right
+enum : uint8_t { GRID_RIGHT = 0, GRID_UP = 1, GRID_LEFT = 2, GRID_DOWN = 3 };
+static const int gridDX[4] = { 1, 0, -1, 0 };
+static const int gridDY[4] = { 0, 1, 0, -1 };
+
+void PolygonGrid::reset(Box const &b, unsigned res) {
+	box = b;
+	resolution = res;
+	cellWidth  = (box.max_corner().x() - box.min_corner().x()) / resolution;
+	cellHeight = (box.max_corner().y() - box.min_corner().y()) / resolution;
+	cells.assign(size_t(resolution) * resolution, 0);
+	filled = 0;
+}
+
+void PolygonGrid::release() {
+	std::vector<uint8_t>().swap(cells);
+	std::vector<std::pair<int, double>>().swap(crossings);
+	std::vector<Edge>().swap(edges);
+	std::vector<int32_t>().swap(outgoing);
+	std::vector<int32_t>().swap(components);
+	resolution = 0;
+	filled = 0;
+}
+
+void PolygonGrid::add(MultiPolygon const &mp) {
+	for (auto const &polygon : mp) fillPolygon(polygon);
+}
+
+// Fill the cells whose centres are inside the polygon, row by row: each ring
+// edge crosses the centre lines of the rows it spans, and the cells between
+// each pair of crossings are inside (even-odd, so holes are left out)
+void PolygonGrid::fillPolygon(Polygon const &polygon) {
+	const double minX = box.min_corner().x(), minY = box.min_corner().y();
+	crossings.clear();
+	auto addRing = [&](Ring const &ring) {
+		for (size_t i = 1; i < ring.size(); i++) {
+			Point const &p = ring[i-1], &q = ring[i];
+			if (p.y() == q.y()) continue;
+			const double low = std::min(p.y(), q.y()), high = std::max(p.y(), q.y());
+			// Rows whose centre is in [low, high)
+			int first = std::max(0, int(std::ceil((low - minY) / cellHeight - 0.5)));
+			int last = std::min(int(resolution) - 1, int(std::ceil((high - minY) / cellHeight - 0.5)) - 1);
+			for (int row = first; row <= last; row++) {
+				const double cy = minY + (row + 0.5) * cellHeight;
+				crossings.emplace_back(row, p.x() + (cy - p.y()) * (q.x() - p.x()) / (q.y() - p.y()));
+			}
+		}
+	};
+	addRing(polygon.outer());
+	for (auto const &inner : polygon.inners()) addRing(inner);
+	std::sort(crossings.begin(), crossings.end());
+
+	for (size_t i = 0; i + 1 < crossings.size(); i += 2) {
+		if (crossings[i].first != crossings[i+1].first) { i--; continue; }	// an odd crossing, from a ring that isn't closed
+		const int row = crossings[i].first;
+		const int from = std::max(0, int(std::ceil((crossings[i].second - minX) / cellWidth - 0.5)));
+		const int to = std::min(int(resolution), int(std::ceil((crossings[i+1].second - minX) / cellWidth - 0.5)));
+		uint8_t *rowCells = &cells[size_t(row) * resolution];
+		for (int x = from; x < to; x++) {
+			filled += !rowCells[x];
+			rowCells[x] = 1;
+		}
+	}
+}
+
+void PolygonGrid::addEdge(uint32_t x, uint32_t y, uint8_t direction) {
+	const uint32_t from = y * (resolution + 1) + x;
+	const uint32_t to = (y + gridDY[direction]) * (resolution + 1) + (x + gridDX[direction]);
+	int32_t *slots = &outgoing[size_t(from) * 2];
+	slots[slots[0] == -1 ? 0 : 1] = edges.size();
+	edges.push_back(Edge { from, to, direction, false });
+}
+
+// The filled cell on an edge's right
+size_t PolygonGrid::rightCell(Edge const &edge) const {
+	int x = edge.from % (resolution + 1), y = edge.from / (resolution + 1);
+	switch (edge.direction) {
+		case GRID_UP:                 break;
+		case GRID_DOWN: x--; y--;     break;
+		case GRID_LEFT: x--;          break;
+		case GRID_RIGHT: y--;         break;
+	}
+	return size_t(y) * resolution + x;
+}
+
+// Number the groups of filled cells that share edges
+void PolygonGrid::labelComponents() {
+	components.assign(cells.size(), -1);
+	std::vector<size_t> stack;
+	int32_t next = 0;
+	for (size_t start = 0; start < cells.size(); start++) {
+		if (!cells[start] || components[start] != -1) continue;
+		components[start] = next;
+		stack.push_back(start);
+		while (!stack.empty()) {
+			const size_t c = stack.back();
+			stack.pop_back();
+			const int x = c % resolution, y = c / resolution;
+			for (int d = 0; d < 4; d++) {
+				const int nx = x + gridDX[d], ny = y + gridDY[d];
+				if (!cell(nx, ny)) continue;
+				const size_t n = size_t(ny) * resolution + nx;
+				if (components[n] == -1) { components[n] = next; stack.push_back(n); }
+			}
+		}
+		next++;
+	}
+}
+
+// Trace each ring of boundary edges. Where two filled cells meet only at a
+// corner, the vertex has two edges out: if the cells are in different groups,
+// turning right keeps each group's rings to itself, and if they're in the same
+// group, turning left keeps apart the rings round the two empty cells, so no
+// ring ever touches itself. The filled cells are on the right, so outer rings
+// go clockwise and holes anticlockwise, as boost wants.
+void PolygonGrid::trace(MultiPolygon &out) {
+	out.clear();
+	if (filled == 0) return;
+
+	edges.clear();
+	outgoing.assign(size_t(resolution + 1) * (resolution + 1) * 2, -1);
+	for (uint32_t y = 0; y < resolution; y++)
+		for (uint32_t x = 0; x <= resolution; x++) {
+			const bool left = cell(x - 1, y), right = cell(x, y);
+			if (right && !left) addEdge(x, y, GRID_UP);
+			if (left && !right) addEdge(x, y + 1, GRID_DOWN);
+		}
+	for (uint32_t y = 0; y <= resolution; y++)
+		for (uint32_t x = 0; x < resolution; x++) {
+			const bool below = cell(x, y - 1), above = cell(x, y);
+			if (above && !below) addEdge(x + 1, y, GRID_LEFT);
+			if (below && !above) addEdge(x, y, GRID_RIGHT);
+		}
+	labelComponents();
+
+	auto nextEdge = [&](Edge const &edge) -> int32_t {
+		const int32_t *slots = &outgoing[size_t(edge.to) * 2];
+		if (slots[1] == -1) return slots[0];
+		const bool firstIsRight = edges[slots[0]].direction == (edge.direction + 3) % 4;
+		const int32_t right = firstIsRight ? slots[0] : slots[1], left = firstIsRight ? slots[1] : slots[0];
+		// Turning left crosses to the cell diagonally opposite
+		return components[rightCell(edge)] == components[rightCell(edges[left])] ? left : right;
+	};
+	auto vertex = [&](uint32_t v) {
+		return Point(box.min_corner().x() + (v % (resolution + 1)) * cellWidth,
+		             box.min_corner().y() + (v / (resolution + 1)) * cellHeight);
+	};
+
+	std::unordered_map<int32_t, size_t> polygonFor;		// by component
+	std::vector<std::pair<int32_t, Ring>> holes;
+	for (size_t start = 0; start < edges.size(); start++) {
+		if (edges[start].used) continue;
+		// Only the corners are kept
+		Ring ring;
+		int32_t e = start;
+		uint8_t lastDirection = 0;
+		bool first = true;
+		do {
+			Edge &edge = edges[e];
+			edge.used = true;
+			if (first || edge.direction != lastDirection) ring.push_back(vertex(edge.from));
+			lastDirection = edge.direction;
+			first = false;
+			e = nextEdge(edge);
+		} while (e != int32_t(start));
+		// The start is a corner only if the ring turns there
+		if (edges[start].direction == lastDirection) ring.erase(ring.begin());
+		ring.push_back(ring.front());
+
+		const int32_t component = components[rightCell(edges[start])];
+		if (geom::area(ring) > 0) {
+			// Clockwise: an outer ring (boost counts its area as positive)
+			polygonFor[component] = out.size();
+			out.emplace_back();
+			out.back().outer() = std::move(ring);
+		} else {
+			holes.emplace_back(component, std::move(ring));
+		}
+	}
+	for (auto &hole : holes) {
+		auto it = polygonFor.find(hole.first);
+		if (it != polygonFor.end()) out[it->second].inners().push_back(std::move(hole.second));
+	}
+}
@@ -0,0 +1,413 @@
+#include "read_fgb.h"
+#include "read_shp.h"
+#include "shp_mem_tiles.h"
+
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <limits>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+extern bool verbose;
+
+using namespace std;
+namespace geom = boost::geometry;
+
+/*
+	Read FlatGeobuf files (https://flatgeobuf.org) into Boost geometries
+*/
+
+// Features each thread takes at a time
+#define FEATURES_PER_RUN 64
+
+// Schema positions of the fields we read
+enum { HeaderGeometryType = 2, HeaderColumns = 7, HeaderFeaturesCount = 8, HeaderIndexNodeSize = 9 };
+enum { ColumnName = 0, ColumnType = 1 };
+enum { FeatureGeometry = 0, FeatureProperties = 1, FeatureColumns = 2 };
+enum { GeometryEnds = 0, GeometryXY = 1, GeometryType = 6, GeometryParts = 7 };
+
+enum class FgbGeometry : uint8_t { Unknown = 0, Point, LineString, Polygon, MultiPoint, MultiLineString, MultiPolygon };
+enum class FgbColumn : uint8_t { Byte = 0, UByte, Bool, Short, UShort, Int, UInt, Long, ULong, Float, Double, String, Json, DateTime, Binary };
+
+// ----	FlatBuffers tables
+
+FbTable::FbTable(const char *buf, const char *end, const char *table): buf(buf), end(end), table(table) {
+	check(table, 4);
+	vtable = table - read<int32_t>(table);
+	check(vtable, 4);
+	vtableSize = read<uint16_t>(vtable);
+	check(vtable, vtableSize);
+}
+
+FbTable FbTable::root(const char *buf, size_t size) {
+	if (size < 4) throw std::runtime_error("FlatGeobuf table is too short");
+	return FbTable(buf, buf + size, buf + read<uint32_t>(buf));
+}
+
+const char *FbTable::fieldPtr(int field) const {
+	if (!table) return nullptr;
+	size_t pos = 4 + 2 * field;
+	if (pos + 2 > vtableSize) return nullptr;
+	uint16_t offset = read<uint16_t>(vtable + pos);
+	if (offset == 0) return nullptr;
+	check(table + offset, 1);
+	return table + offset;
+}
+
+const char *FbTable::indirect(const char *p) const {
+	check(p, 4);
+	const char *target = p + read<uint32_t>(p);
+	check(target, 4);
+	return target;
+}
+
+boost::string_view FbTable::string(int field) const {
+	const char *p = fieldPtr(field);
+	if (!p) return boost::string_view();
+	const char *s = indirect(p);
+	uint32_t length = read<uint32_t>(s);
+	check(s + 4, length);
+	return boost::string_view(s + 4, length);
+}
+
+FbTable FbTable::subtable(int field) const {
+	const char *p = fieldPtr(field);
+	if (!p) return FbTable();
+	return FbTable(buf, end, indirect(p));
+}
+
+const char *FbTable::vector(int field, uint32_t &length, size_t elementSize) const {
+	length = 0;
+	const char *p = fieldPtr(field);
+	if (!p) return nullptr;
+	const char *v = indirect(p);
+	length = read<uint32_t>(v);
+	check(v + 4, size_t(length) * elementSize);
+	return v + 4;
+}
+
+FbTable FbTable::tableAt(int field, uint32_t i) const {
+	uint32_t length;
+	const char *v = vector(field, length, 4);
+	if (i >= length) throw std::out_of_range("FlatGeobuf vector index out of range");
+	return FbTable(buf, end, indirect(v + 4 * i));
+}
+
+// ----	Packed Hilbert R-tree
+
+// Node counts per level, leaves first
+static vector<uint64_t> levelNodeCounts(uint64_t featureCount, uint16_t nodeSize) {
+	vector<uint64_t> counts;
+	uint64_t n = featureCount;
+	counts.push_back(n);
+	do {
+		n = (n + nodeSize - 1) / nodeSize;
+		counts.push_back(n);
+	} while (n != 1);
+	return counts;
+}
+
+uint64_t flatGeobufIndexSize(uint64_t featureCount, uint16_t nodeSize) {
+	if (featureCount == 0 || nodeSize < 2) return 0;
+	// There are at most twice as many nodes as features, so this can't overflow
+	if (featureCount > std::numeric_limits<uint64_t>::max() / 80) throw std::runtime_error("FlatGeobuf feature count is too large");
+	uint64_t nodes = 0;
+	for (uint64_t n : levelNodeCounts(featureCount, nodeSize)) nodes += n;
+	return nodes * 40;
+}
+
+vector<uint64_t> searchFlatGeobufIndex(const char *index, size_t indexSize, uint64_t featureCount, uint16_t nodeSize,
+                                       double minX, double minY, double maxX, double maxY) {
+	vector<uint64_t> counts = levelNodeCounts(featureCount, nodeSize);
+	uint64_t totalNodes = 0;
+	for (uint64_t n : counts) totalNodes += n;
+	if (totalNodes > indexSize / 40) throw std::runtime_error("FlatGeobuf index is truncated");
+
+	// The root is stored first, the leaves last
+	vector<uint64_t> levelEnds;
+	uint64_t offset = totalNodes;
+	for (uint64_t n : counts) { levelEnds.push_back(offset); offset -= n; }
+	const uint64_t firstLeaf = totalNodes - featureCount;
+
+	vector<uint64_t> results;
+	vector<pair<uint64_t, size_t>> pending { { 0, counts.size() - 1 } };
+	while (!pending.empty()) {
+		uint64_t node = pending.back().first;
+		size_t level = pending.back().second;
+		pending.pop_back();
+		uint64_t last = min<uint64_t>(node + nodeSize, levelEnds[level]);
+		for (uint64_t pos = node; pos < last; pos++) {
+			const char *item = index + pos * 40;
+			if (FbTable::read<double>(item) > maxX || FbTable::read<double>(item + 8) > maxY ||
+			    FbTable::read<double>(item + 16) < minX || FbTable::read<double>(item + 24) < minY) continue;
+			uint64_t target = FbTable::read<uint64_t>(item + 32);
+			if (pos >= firstLeaf) results.push_back(target);
+			else if (level > 0) {
+				// A child outside the level below would read past the index, or loop
+				if (target < levelEnds[level - 1] - counts[level - 1] || target >= levelEnds[level - 1])
+					throw std::runtime_error("FlatGeobuf index is malformed");
+				pending.emplace_back(target, level - 1);
+			}
+		}
+	}
+	sort(results.begin(), results.end());
+	return results;
+}
+
+// ----	Features
+
+struct FgbColumnDef {
+	std::string name;
+	FgbColumn type;
+	bool wanted;		// as an attribute
+};
+
+static Point fgbPoint(const char *xy, uint32_t i) {
+	double lat = fmin(fmax(FbTable::read<double>(xy + i * 16 + 8), MinLat), MaxLat);	// To avoid infinite latp
+	return Point(FbTable::read<double>(xy + i * 16), lat2latp(lat));
+}
+
+// The parts of a geometry (rings, or lines), as point lists split at its ends
+static vector<vector<Point>> fgbParts(const FbTable &geometry) {
+	uint32_t xyLength, endsLength;
+	const char *xy = geometry.vector(GeometryXY, xyLength, 8);
+	const char *ends = geometry.vector(GeometryEnds, endsLength, 4);
+	const uint32_t points = xyLength / 2;
+
+	// With no ends, it's all one part
+	vector<vector<Point>> parts;
+	uint32_t start = 0;
+	for (uint32_t e = 0; e < max(endsLength, 1u); e++) {
+		uint32_t partEnd = endsLength ? min(FbTable::read<uint32_t>(ends + 4 * e), points) : points;
+		parts.emplace_back();
+		for (uint32_t i = start; i < partEnd; i++) parts.back().push_back(fgbPoint(xy, i));
+		start = max(start, partEnd);
+	}
+	return parts;
+}
+
+static Polygon fgbPolygon(const FbTable &geometry) {
+	Polygon poly;
+	vector<vector<Point>> rings = fgbParts(geometry);
+	for (size_t r = 0; r < rings.size(); r++) {
+		if (r == 0) {
+			geom::append(poly.outer(), rings[r]);
+		} else {
+			poly.inners().emplace_back();
+			geom::append(poly.inners().back(), rings[r]);
+		}
+	}
+	return poly;
+}
+
+static void readFeature(const char *data, size_t size, uint64_t featureNum, FgbGeometry headerType,
+                        const vector<FgbColumnDef> &columns, const LayerDef &layerDef,
+                        const Box &clippingBox, LayerDefinition &layers, uint layerNum,
+                        ShpMemTiles &shpMemTiles, OsmLuaProcessing &osmLuaProcessing) {
+	LayerDef &layer = layers.layers[layerNum];
+	FbTable feature = FbTable::root(data, size);
+	FbTable geometry = feature.subtable(FeatureGeometry);
+	if (!geometry.valid()) return;
+	FgbGeometry type = headerType != FgbGeometry::Unknown ? headerType :
+		FgbGeometry(geometry.scalar<uint8_t>(GeometryType, 0));
+
+	// Build the geometry first, so features outside the box are skipped before their attributes are read
+	vector<Point> points;
+	MultiLinestring lines;
+	MultiPolygon multi;
+	Box box;
+	switch (type) {
+		case FgbGeometry::Point:
+		case FgbGeometry::MultiPoint:
+			for (auto &part : fgbParts(geometry)) points.insert(points.end(), part.begin(), part.end());
+			if (points.empty()) return;
+			geom::assign_inverse(box);
+			for (const Point &pt : points) geom::expand(box, pt);
+			break;
+		case FgbGeometry::LineString:
+		case FgbGeometry::MultiLineString:
+			for (auto &part : fgbParts(geometry)) {
+				if (part.size() < 2) continue;
+				lines.emplace_back();
+				geom::assign_points(lines.back(), part);
+			}
+			if (lines.empty()) return;
+			geom::envelope(lines, box);
+			break;
+		case FgbGeometry::Polygon:
+			multi.push_back(fgbPolygon(geometry));
+			geom::envelope(multi, box);
+			break;
+		case FgbGeometry::MultiPolygon: {
+			uint32_t partCount;
+			geometry.vector(GeometryParts, partCount, 4);
+			for (uint32_t p = 0; p < partCount; p++) multi.push_back(fgbPolygon(geometry.tableAt(GeometryParts, p)));
+			if (multi.empty()) return;
+			geom::envelope(multi, box);
+			break;
+		}
+		default:
+			cerr << "FlatGeobuf feature #" << featureNum << " in " << layer.source << " has an unsupported geometry type " << int(type) << endl;
+			return;
+	}
+	if (!geom::intersects(box, clippingBox)) return;
+
+	// Properties: a run of (column number, value)
+	vector<pair<string, SourceValue>> values;
+	string name;
+	bool hasName = false;
+	uint32_t length;
+	const char *p = feature.vector(FeatureProperties, length);
+	const char *end = p + length;
+	auto need = [&](size_t bytes) {
+		if (size_t(end - p) < bytes) throw std::runtime_error("FlatGeobuf feature properties run past their end");
+	};
+	while (p && p < end) {
+		need(2);
+		uint16_t column = FbTable::read<uint16_t>(p); p += 2;
+		if (column >= columns.size()) throw std::runtime_error("FlatGeobuf feature refers to a missing column");
+		const FgbColumnDef &def = columns[column];
+		SourceValue value;
+		value.type = SourceValue::Integer;
+		switch (def.type) {
+			case FgbColumn::Byte:   need(1); value.number = FbTable::read<int8_t>(p);   p += 1; break;
+			case FgbColumn::UByte:  need(1); value.number = FbTable::read<uint8_t>(p);  p += 1; break;
+			case FgbColumn::Bool:   need(1); value.number = FbTable::read<uint8_t>(p);  p += 1; value.type = SourceValue::Boolean; break;
+			case FgbColumn::Short:  need(2); value.number = FbTable::read<int16_t>(p);  p += 2; break;
+			case FgbColumn::UShort: need(2); value.number = FbTable::read<uint16_t>(p); p += 2; break;
+			case FgbColumn::Int:    need(4); value.number = FbTable::read<int32_t>(p);  p += 4; break;
+			case FgbColumn::UInt:   need(4); value.number = FbTable::read<uint32_t>(p); p += 4; break;
+			case FgbColumn::Long:   need(8); value.number = double(FbTable::read<int64_t>(p));  p += 8; break;
+			case FgbColumn::ULong:  need(8); value.number = double(FbTable::read<uint64_t>(p)); p += 8; break;
+			case FgbColumn::Float:  need(4); value.number = FbTable::read<float>(p);    p += 4; value.type = SourceValue::Double; break;
+			case FgbColumn::Double: need(8); value.number = FbTable::read<double>(p);   p += 8; value.type = SourceValue::Double; break;
+			default: {	// strings, JSON, dates and binary are all length-prefixed
+				need(4);
+				uint32_t bytes = FbTable::read<uint32_t>(p); p += 4;
+				need(bytes);
+				value.type = SourceValue::String;
+				value.str.assign(p, bytes);
+				p += bytes;
+				if (def.type == FgbColumn::Binary) continue;
+			}
+		}
+		if (def.name == layerDef.indexName) {
+			name = sourceValueString(value);
+			hasName = true;
+		}
+		if (def.wanted) values.emplace_back(def.name, std::move(value));
+	}
+	AttributeIndex attrIdx = addSourceAttributes(values, layer, osmLuaProcessing, layer.minzoom);
+
+	for (const Point &pt : points) storeSourcePoint(pt, attrIdx, shpMemTiles, clippingBox, layer, layerNum, hasName, name);
+	for (const Linestring &ls : lines) storeSourceLinestring(ls, attrIdx, shpMemTiles, clippingBox, layer, layerNum, hasName, name);
+	if (!multi.empty()) {
+		geom::correct(multi);
+		storeSourcePolygon(multi, featureNum, attrIdx, shpMemTiles, clippingBox, layer, layerNum, hasName, name);
+	}
+}
+
+static vector<FgbColumnDef> readColumns(const FbTable &table, int field, const LayerDef &layer) {
+	vector<FgbColumnDef> columns;
+	uint32_t count;
+	table.vector(field, count, 4);
+	for (uint32_t i = 0; i < count; i++) {
+		FbTable column = table.tableAt(field, i);
+		FgbColumnDef def;
+		def.name = column.string(ColumnName).to_string();
+		def.type = FgbColumn(column.scalar<uint8_t>(ColumnType, 0));
+		def.wanted = layer.allSourceColumns ||
+			find(layer.sourceColumns.begin(), layer.sourceColumns.end(), def.name) != layer.sourceColumns.end();
+		columns.push_back(def);
+	}
+	return columns;
+}
+
+void readFlatGeobuf(const Box &clippingBox,
+                    class LayerDefinition &layers,
+                    uint layerNum,
+                    uint threadNum,
+                    class ShpMemTiles &shpMemTiles,
+                    OsmLuaProcessing &osmLuaProcessing) {
+	const LayerDef &layer = layers.layers[layerNum];
+	const string &filename = layer.source;
+
+	// Map the file, so only the parts of it we need are read
+	std::unique_ptr<boost::interprocess::mapped_region> region;
+	try {
+		boost::interprocess::file_mapping mapping(filename.c_str(), boost::interprocess::read_only);
+		region.reset(new boost::interprocess::mapped_region(mapping, boost::interprocess::read_only));
+	} catch (boost::interprocess::interprocess_exception &e) {
+		cerr << "Couldn't open FlatGeobuf file " << filename << " (" << e.what() << ")" << endl;
+		return;
+	}
+	const char *data = static_cast<const char*>(region->get_address());
+	const size_t size = region->get_size();
+
+	try {
+		if (size < 12 || memcmp(data, "fgb", 3) != 0 || memcmp(data + 4, "fgb", 3) != 0 || data[3] != 3) {
+			cerr << filename << " isn't a FlatGeobuf (version 3) file" << endl;
+			return;
+		}
+		uint32_t headerSize = FbTable::read<uint32_t>(data + 8);
+		if (headerSize > size - 12) throw std::runtime_error("header runs past the end of the file");
+		FbTable header = FbTable::root(data + 12, headerSize);
+		FgbGeometry headerType = FgbGeometry(header.scalar<uint8_t>(HeaderGeometryType, 0));
+		vector<FgbColumnDef> columns = readColumns(header, HeaderColumns, layer);
+		uint64_t featureCount = header.scalar<uint64_t>(HeaderFeaturesCount, 0);
+		uint16_t nodeSize = header.scalar<uint16_t>(HeaderIndexNodeSize, 16);
+
+		const size_t indexStart = 12 + headerSize;
+		const uint64_t indexSize = flatGeobufIndexSize(featureCount, nodeSize);
+		if (indexSize > size - indexStart) throw std::runtime_error("index runs past the end of the file");
+		const size_t featuresStart = indexStart + indexSize;
+
+		// Find the features to read: from the index, or by walking through them all
+		vector<uint64_t> offsets;
+		if (indexSize > 0) {
+			Box box = clippingBox;
+			offsets = searchFlatGeobufIndex(data + indexStart, indexSize, featureCount, nodeSize,
+				box.min_corner().x(), latp2lat(box.min_corner().y()), box.max_corner().x(), latp2lat(box.max_corner().y()));
+			if (verbose) cout << "FlatGeobuf index found " << offsets.size() << " of " << featureCount << " features in the bounding box" << endl;
+		} else {
+			for (size_t pos = featuresStart; pos + 4 <= size; pos += 4 + FbTable::read<uint32_t>(data + pos))
+				offsets.push_back(pos - featuresStart);
+		}
+
+		// Each thread reads runs of features
+		std::atomic<size_t> next(0);
+		std::atomic<bool> failed(false);
+		auto worker = [&]() {
+			try {
+				for (size_t start = next.fetch_add(FEATURES_PER_RUN); start < offsets.size() && !failed; start = next.fetch_add(FEATURES_PER_RUN)) {
+					size_t end = min(offsets.size(), start + FEATURES_PER_RUN);
+					for (size_t i = start; i < end; i++) {
+						if (offsets[i] > size - featuresStart || size - featuresStart - offsets[i] < 4) throw std::runtime_error("feature runs past the end of the file");
+						size_t pos = featuresStart + offsets[i];
+						uint32_t featureSize = FbTable::read<uint32_t>(data + pos);
+						if (featureSize > size - pos - 4) throw std::runtime_error("feature runs past the end of the file");
+
+						// Features can carry their own columns
+						FbTable feature = FbTable::root(data + pos + 4, featureSize);
+						if (feature.has(FeatureColumns)) {
+							vector<FgbColumnDef> featureColumns = readColumns(feature, FeatureColumns, layer);
+							readFeature(data + pos + 4, featureSize, i, headerType, featureColumns, layer, clippingBox, layers, layerNum, shpMemTiles, osmLuaProcessing);
+						} else {
+							readFeature(data + pos + 4, featureSize, i, headerType, columns, layer, clippingBox, layers, layerNum, shpMemTiles, osmLuaProcessing);
+						}
+					}
+				}
+			} catch (std::exception &e) {
+				if (!failed.exchange(true)) cerr << "Couldn't read " << filename << ": " << e.what() << endl;
+			}
+		};
+		vector<thread> threads;
+		for (uint t = 0; t < max(1u, threadNum); t++) threads.emplace_back(worker);
+		for (auto &t : threads) t.join();
+
+	} catch (std::exception &e) {
+		cerr << "Couldn't read " << filename << ": " << e.what() << endl;
+	}
+}
@@ -0,0 +1,198 @@
+#include "read_geojson.h"
+#include "read_shp.h"
+#include "shp_mem_tiles.h"
+#include "helpers.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include "rapidjson/document.h"
+
+extern bool verbose;
+
+using namespace std;
+namespace geom = boost::geometry;
+
+/*
+	Read GeoJSON features into Boost geometries
+*/
+
+// Features (or lines) each thread takes at a time
+#define FEATURES_PER_RUN 64
+
+static Point geoJsonPoint(const rapidjson::Value &coordinates) {
+	if (!coordinates.IsArray() || coordinates.Size() < 2 || !coordinates[0].IsNumber() || !coordinates[1].IsNumber())
+		throw std::runtime_error("position should be an array of two numbers");
+	double lat = fmin(fmax(coordinates[1].GetDouble(), MinLat), MaxLat);	// To avoid infinite latp
+	return Point(coordinates[0].GetDouble(), lat2latp(lat));
+}
+
+static void geoJsonPoints(const rapidjson::Value &coordinates, vector<Point> &points) {
+	if (!coordinates.IsArray()) throw std::runtime_error("coordinates should be an array");
+	for (uint i = 0; i < coordinates.Size(); i++) points.push_back(geoJsonPoint(coordinates[i]));
+}
+
+static Polygon geoJsonPolygon(const rapidjson::Value &rings) {
+	Polygon poly;
+	if (!rings.IsArray()) throw std::runtime_error("polygon should be an array of rings");
+	for (uint r = 0; r < rings.Size(); r++) {
+		vector<Point> points;
+		geoJsonPoints(rings[r], points);
+		if (r == 0) {
+			geom::append(poly.outer(), points);
+		} else {
+			poly.inners().emplace_back();
+			geom::append(poly.inners().back(), points);
+		}
+	}
+	return poly;
+}
+
+static void readFeature(const rapidjson::Value &feature, uint64_t featureNum,
+                        const Box &clippingBox, LayerDefinition &layers, uint layerNum,
+                        ShpMemTiles &shpMemTiles, OsmLuaProcessing &osmLuaProcessing) {
+	LayerDef &layer = layers.layers[layerNum];
+	if (!feature.IsObject() || !feature.HasMember("geometry") || !feature["geometry"].IsObject()) return;
+	const rapidjson::Value &geometry = feature["geometry"];
+	if (!geometry.HasMember("type") || !geometry.HasMember("coordinates")) return;
+	if (!geometry["type"].IsString()) throw std::runtime_error("geometry type should be a string");
+	const string type = geometry["type"].GetString();
+	const rapidjson::Value &coordinates = geometry["coordinates"];
+
+	// Build the geometry first, so features outside the box are skipped before their attributes are read
+	vector<Point> points;
+	MultiLinestring lines;
+	MultiPolygon multi;
+	Box box;
+	if (type == "Point") {
+		points.push_back(geoJsonPoint(coordinates));
+	} else if (type == "MultiPoint") {
+		geoJsonPoints(coordinates, points);
+	} else if (type == "LineString" || type == "MultiLineString") {
+		const bool single = type == "LineString";
+		if (!coordinates.IsArray()) throw std::runtime_error("coordinates should be an array");
+		for (uint i = 0; i < (single ? 1 : coordinates.Size()); i++) {
+			vector<Point> line;
+			geoJsonPoints(single ? coordinates : coordinates[i], line);
+			if (line.size() < 2) continue;
+			lines.emplace_back();
+			geom::assign_points(lines.back(), line);
+		}
+	} else if (type == "Polygon") {
+		multi.push_back(geoJsonPolygon(coordinates));
+	} else if (type == "MultiPolygon") {
+		if (!coordinates.IsArray()) throw std::runtime_error("coordinates should be an array");
+		for (uint i = 0; i < coordinates.Size(); i++) multi.push_back(geoJsonPolygon(coordinates[i]));
+	} else {
+		cerr << "GeoJSON feature #" << featureNum << " in " << layer.source << " has an unsupported geometry type " << type << endl;
+		return;
+	}
+
+	geom::assign_inverse(box);
+	for (const Point &pt : points) geom::expand(box, pt);
+	if (!lines.empty()) { Box b; geom::envelope(lines, b); geom::expand(box, b); }
+	if (!multi.empty()) { Box b; geom::envelope(multi, b); geom::expand(box, b); }
+	if (points.empty() && lines.empty() && multi.empty()) return;
+	if (!geom::intersects(box, clippingBox)) return;
+
+	// Properties
+	vector<pair<string, SourceValue>> values;
+	string name;
+	bool hasName = false;
+	if (feature.HasMember("properties") && feature["properties"].IsObject()) {
+		const rapidjson::Value &properties = feature["properties"];
+		for (auto it = properties.MemberBegin(); it != properties.MemberEnd(); ++it) {
+			string key = it->name.GetString();
+			const rapidjson::Value &v = it->value;
+			SourceValue value;
+			if (v.IsString())     { value.type = SourceValue::String;  value.str = v.GetString(); }
+			else if (v.IsBool())  { value.type = SourceValue::Boolean; value.number = v.GetBool(); }
+			else if (v.IsInt64()) { value.type = SourceValue::Integer; value.number = double(v.GetInt64()); }
+			else if (v.IsNumber()) { value.type = SourceValue::Double; value.number = v.GetDouble(); }
+			else continue;		// nulls, and nested objects or arrays
+
+			if (key == layer.indexName) {
+				name = sourceValueString(value);
+				hasName = true;
+			}
+			if (layer.allSourceColumns || find(layer.sourceColumns.begin(), layer.sourceColumns.end(), key) != layer.sourceColumns.end())
+				values.emplace_back(key, std::move(value));
+		}
+	}
+	AttributeIndex attrIdx = addSourceAttributes(values, layer, osmLuaProcessing, layer.minzoom);
+
+	for (const Point &pt : points) storeSourcePoint(pt, attrIdx, shpMemTiles, clippingBox, layer, layerNum, hasName, name);
+	for (const Linestring &ls : lines) storeSourceLinestring(ls, attrIdx, shpMemTiles, clippingBox, layer, layerNum, hasName, name);
+	if (!multi.empty()) {
+		geom::correct(multi);
+		storeSourcePolygon(multi, featureNum, attrIdx, shpMemTiles, clippingBox, layer, layerNum, hasName, name);
+	}
+}
+
+void readGeoJson(const Box &clippingBox,
+                 class LayerDefinition &layers,
+                 uint layerNum,
+                 uint threadNum,
+                 class ShpMemTiles &shpMemTiles,
+                 OsmLuaProcessing &osmLuaProcessing) {
+	const string filename = layers.layers[layerNum].source;
+	ifstream infile(filename, ios::in | ios::binary);
+	if (!infile) { cerr << "Couldn't open GeoJSON file " << filename << endl; return; }
+	stringstream contents;
+	contents << infile.rdbuf();
+	const string text = contents.str();
+	const bool lineDelimited = ends_with(filename, ".geojsonl") || ends_with(filename, ".geojsons") || ends_with(filename, ".ndjson");
+
+	// A FeatureCollection is parsed in one go; lines are parsed by whichever thread reads them
+	rapidjson::Document collection;
+	struct Line { size_t start, length, number; };
+	vector<Line> lines;
+	size_t count = 0;
+	if (lineDelimited) {
+		size_t number = 1;
+		for (size_t start = 0; start < text.size(); number++) {
+			size_t end = text.find('\n', start);
+			if (end == string::npos) end = text.size();
+			// GeoJSON text sequences (RFC 8142) start each record with a record separator
+			const size_t first = text.find_first_not_of(" \t\r\x1e", start);
+			if (first < end) lines.push_back({ first, end - first, number });
+			start = end + 1;
+		}
+		count = lines.size();
+	} else {
+		collection.Parse(text.c_str());
+		if (collection.HasParseError() || !collection.IsObject() || !collection.HasMember("features") || !collection["features"].IsArray()) {
+			cerr << filename << " isn't a GeoJSON FeatureCollection" << endl;
+			return;
+		}
+		count = collection["features"].Size();
+	}
+
+	std::atomic<size_t> next(0);
+	auto worker = [&]() {
+		for (size_t start = next.fetch_add(FEATURES_PER_RUN); start < count; start = next.fetch_add(FEATURES_PER_RUN)) {
+			size_t end = min(count, start + FEATURES_PER_RUN);
+			for (size_t i = start; i < end; i++) {
+				try {
+					if (lineDelimited) {
+						rapidjson::Document feature;
+						feature.Parse(text.substr(lines[i].start, lines[i].length).c_str());
+						if (feature.HasParseError()) { cerr << "Line " << lines[i].number << " of " << filename << " isn't valid JSON" << endl; continue; }
+						readFeature(feature, i, clippingBox, layers, layerNum, shpMemTiles, osmLuaProcessing);
+					} else {
+						readFeature(collection["features"][i], i, clippingBox, layers, layerNum, shpMemTiles, osmLuaProcessing);
+					}
+				} catch (std::runtime_error &e) {
+					if (lineDelimited) cerr << "Line " << lines[i].number << " of " << filename << ": " << e.what() << endl;
+					else cerr << "GeoJSON feature #" << i << " in " << filename << ": " << e.what() << endl;
+				}
+			}
+		}
+	};
+	vector<thread> threads;
+	for (uint t = 0; t < max(1u, threadNum); t++) threads.emplace_back(worker);
+	for (auto &t : threads) t.join();
+}
@@ -0,0 +1,210 @@
+#include "read_osc.h"
+#include "node_store.h"
+#include "way_store.h"
+#include "helpers.h"
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <cstring>
+#include <algorithm>
+#include <limits>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+
+using namespace std;
+namespace bio = boost::iostreams;
+
+/*
+	Read OSM change files
+
+	osmChange XML is machine-generated with one element per tag and no nested
+	markup in attributes, so we scan it a tag at a time rather than building a
+	DOM for what can be a very large file.
+*/
+
+static bool readAttribute(const string &tag, const char *name, string &value) {
+	string search = string(" ") + name + "=\"";
+	size_t start = tag.find(search);
+	if (start == string::npos) return false;
+	start += search.size();
+	size_t end = tag.find('"', start);
+	if (end == string::npos) return false;
+	value = tag.substr(start, end - start);
+	return true;
+}
+
+static bool tagIs(const string &tag, const char *name) {
+	size_t length = strlen(name);
+	return tag.compare(0, length, name) == 0 && (tag.size() == length || tag[length] == ' ' || tag[length] == '/');
+}
+
+bool readOscFile(const string &filename, OscChanges &changes) {
+	ifstream file(filename, ios::in | ios::binary);
+	if (!file) { cerr << "Couldn't open .osc file " << filename << endl; return false; }
+	bio::filtering_istream in;
+	if (ends_with(filename, ".gz")) in.push(bio::gzip_decompressor());
+	in.push(file);
+
+	string chunk, value;
+	bool inWay = false;
+	vector<NodeID> wayNodes;
+	try {
+		while (getline(in, chunk, '>')) {
+			size_t open = chunk.find('<');
+			if (open == string::npos) continue;
+			string tag = chunk.substr(open + 1);
+
+			if (tagIs(tag, "node")) {
+				if (!readAttribute(tag, "id", value)) continue;
+				changes.nodeIds.push_back(stoll(value));
+				string lat, lon;
+				if (readAttribute(tag, "lat", lat) && readAttribute(tag, "lon", lon)) {
+					changes.nodePositions.push_back({ int(lat2latp(stod(lat))*10000000.0), int(stod(lon)*10000000.0) });
+				}
+
+			} else if (tagIs(tag, "way")) {
+				if (!readAttribute(tag, "id", value)) continue;
+				changes.wayIds.push_back(stoll(value));
+				wayNodes.clear();
+				inWay = tag.back() != '/';
+
+			} else if (inWay && tagIs(tag, "nd")) {
+				if (readAttribute(tag, "ref", value)) wayNodes.push_back(stoll(value));
+
+			} else if (inWay && tagIs(tag, "/way")) {
+				if (!wayNodes.empty()) changes.wayNodes.push_back(wayNodes);
+				inWay = false;
+
+			} else if (tagIs(tag, "relation")) {
+				if (readAttribute(tag, "id", value)) changes.relationIds.push_back(stoll(value));
+
+			} else if (tagIs(tag, "member")) {
+				string type;
+				if (!readAttribute(tag, "type", type) || !readAttribute(tag, "ref", value)) continue;
+				if (type == "way") changes.wayIds.push_back(stoll(value));
+				else if (type == "node") changes.nodeIds.push_back(stoll(value));
+			}
+		}
+	} catch (std::exception &e) {
+		cerr << "Couldn't read .osc file " << filename << ": " << e.what() << endl;
+		return false;
+	}
+	return true;
+}
+
+void OscChanges::index() {
+	nodeSet.insert(nodeIds.begin(), nodeIds.end());
+	waySet.insert(wayIds.begin(), wayIds.end());
+	relationSet.insert(relationIds.begin(), relationIds.end());
+}
+
+void OscChanges::checkWay(WayID id, const vector<NodeID> &nodes, const vector<LatpLon> &points) {
+	bool affected = waySet.count(id) > 0;
+	for (size_t i = 0; !affected && i < nodes.size(); i++) affected = nodeSet.count(nodes[i]) > 0;
+	if (!affected) return;
+	std::lock_guard<std::mutex> lock(mutex);
+	movedWays.insert(id);
+	affectedWays.push_back(points);
+}
+
+void OscChanges::checkRelation(int64_t id, const vector<WayID> &outers, const vector<WayID> &inners, bool area) {
+	bool affected = relationSet.count(id) > 0;
+	for (size_t i = 0; !affected && i < outers.size(); i++) affected = movedWays.count(outers[i]) > 0;
+	for (size_t i = 0; !affected && i < inners.size(); i++) affected = movedWays.count(inners[i]) > 0;
+	if (!affected) return;
+	vector<WayID> members(outers);
+	members.insert(members.end(), inners.begin(), inners.end());
+	std::lock_guard<std::mutex> lock(mutex);
+	affectedRelations.emplace_back(area, move(members));
+}
+
+// Mark the tiles along each segment of some lines
+static void markLineTiles(const vector<vector<LatpLon>> &lines, uint baseZoom, set<TileCoordinates> &dirtyTiles) {
+	auto markBox = [&](const LatpLon &a, const LatpLon &b) {
+		TileCoordinate x1 = lon2tilex(min(a.lon, b.lon) / 10000000.0, baseZoom);
+		TileCoordinate x2 = lon2tilex(max(a.lon, b.lon) / 10000000.0, baseZoom);
+		TileCoordinate y1 = latp2tiley(max(a.latp, b.latp) / 10000000.0, baseZoom);
+		TileCoordinate y2 = latp2tiley(min(a.latp, b.latp) / 10000000.0, baseZoom);
+		for (TileCoordinate x = x1; x <= x2; x++)
+			for (TileCoordinate y = y1; y <= y2; y++)
+				dirtyTiles.insert(TileCoordinates(x, y));
+	};
+	for (const auto &points : lines) {
+		if (points.empty()) continue;
+		markBox(points.front(), points.front());
+		for (size_t i = 1; i < points.size(); i++) markBox(points[i-1], points[i]);
+	}
+}
+
+// Mark the tiles an area covers: its outline, and the tiles inside it. The
+// rings can be split over several lines (as a multipolygon's ways are), as
+// the inside is found by counting the crossings of each row of tiles.
+static void markAreaTiles(const vector<vector<LatpLon>> &rings, uint baseZoom, set<TileCoordinates> &dirtyTiles) {
+	markLineTiles(rings, baseZoom, dirtyTiles);
+
+	int32_t minLatp = numeric_limits<int32_t>::max(), maxLatp = numeric_limits<int32_t>::min();
+	for (const auto &points : rings)
+		for (const auto &p : points) { minLatp = min(minLatp, p.latp); maxLatp = max(maxLatp, p.latp); }
+	if (minLatp > maxLatp) return;
+
+	vector<double> crossings;
+	for (TileCoordinate y = latp2tiley(maxLatp / 10000000.0, baseZoom); y <= latp2tiley(minLatp / 10000000.0, baseZoom); y++) {
+		// Where the row's middle crosses the outline
+		const double rowLatp = (tiley2latp(y, baseZoom) + tiley2latp(y + 1, baseZoom)) / 2 * 10000000.0;
+		crossings.clear();
+		for (const auto &points : rings)
+			for (size_t i = 1; i < points.size(); i++) {
+				const LatpLon &a = points[i-1], &b = points[i];
+				if ((a.latp > rowLatp) == (b.latp > rowLatp)) continue;
+				crossings.push_back(a.lon + (rowLatp - a.latp) / (double(b.latp) - a.latp) * (double(b.lon) - a.lon));
+			}
+		sort(crossings.begin(), crossings.end());
+		for (size_t i = 1; i < crossings.size(); i += 2) {
+			TileCoordinate x1 = lon2tilex(crossings[i-1] / 10000000.0, baseZoom);
+			TileCoordinate x2 = lon2tilex(crossings[i] / 10000000.0, baseZoom);
+			for (TileCoordinate x = x1; x <= x2; x++) dirtyTiles.insert(TileCoordinates(x, y));
+		}
+	}
+}
+
+// Mark the tiles covering a way: those it covers if closed (so that any fill
+// is included), otherwise along each segment
+static void markWayTiles(const vector<LatpLon> &points, uint baseZoom, set<TileCoordinates> &dirtyTiles) {
+	if (points.size() > 2 && points.front() == points.back()) markAreaTiles({ points }, baseZoom, dirtyTiles);
+	else markLineTiles({ points }, baseZoom, dirtyTiles);
+}
+
+void findDirtyTiles(const OscChanges &changes, const NodeStore &nodes, const WayStore &ways,
+                    uint baseZoom, set<TileCoordinates> &dirtyTiles) {
+	for (const auto &ll : changes.nodePositions) {
+		dirtyTiles.insert(TileCoordinates(lon2tilex(ll.lon / 10000000.0, baseZoom), latp2tiley(ll.latp / 10000000.0, baseZoom)));
+	}
+	for (NodeID id : changes.nodeIds) {
+		try {
+			LatpLon ll = nodes.at(id);
+			dirtyTiles.insert(TileCoordinates(lon2tilex(ll.lon / 10000000.0, baseZoom), latp2tiley(ll.latp / 10000000.0, baseZoom)));
+		} catch (std::out_of_range &err) {}		// deleted, or not in the .pbf
+	}
+	for (const auto &wayNodes : changes.wayNodes) {
+		vector<LatpLon> points;
+		for (NodeID id : wayNodes) {
+			try { points.push_back(nodes.at(id)); } catch (std::out_of_range &err) {}
+		}
+		markWayTiles(points, baseZoom, dirtyTiles);
+	}
+	for (WayID id : changes.wayIds) {
+		try {
+			vector<LatpLon> points = ways.at(id);
+			markWayTiles(points, baseZoom, dirtyTiles);
+		} catch (std::out_of_range &err) {}		// deleted, or not stored
+	}
+	for (const auto &points : changes.affectedWays) markWayTiles(points, baseZoom, dirtyTiles);
+	for (const auto &relation : changes.affectedRelations) {
+		vector<vector<LatpLon>> members;
+		for (WayID id : relation.second) {
+			try { members.push_back(ways.at(id)); } catch (std::out_of_range &err) {}
+		}
+		if (relation.first) markAreaTiles(members, baseZoom, dirtyTiles);
+		else markLineTiles(members, baseZoom, dirtyTiles);
+	}
+}
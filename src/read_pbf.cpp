@@ -1,6 +1,10 @@
 #include <iostream>
+#include <fstream>
+#include <cstring>
 #include "read_pbf.h"
+#include "read_osc.h"
 #include "pbf_blocks.h"
+#include "pbf_decoder.h"
 
 #include <boost/interprocess/streams/bufferstream.hpp>
 #include <boost/asio/thread_pool.hpp>
@@ -11,6 +15,12 @@
 #include "way_store.h"
 #include "osm_lua_processing.h"
 #include "mmap_allocator.h"
+#include "metrics.h"
+#include "trace.h"
+
+// Relations with this many ways (such as coastlines and national boundaries)
+// are read on their own, ahead of the rest
+#define RELATION_HEAVY_WAYS 1000
 
 using namespace std;
 
@@ -22,108 +32,230 @@ PbfReader::PbfReader(OSMStore &osmStore)
 	: osmStore(osmStore)
 { }
 
-bool PbfReader::ReadNodes(OsmLuaProcessing &output, PrimitiveGroup &pg, PrimitiveBlock const &pb, const unordered_set<int> &nodeKeyPositions)
+bool DecodedBlockCache::get(long int offset, const char *&data, size_t &size) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = blocks.find(offset);
+	if (it == blocks.end()) return false;
+	// Entries are only removed by clear(), so the data stays valid outside the lock
+	data = it->second.data();
+	size = it->second.size();
+	return true;
+}
+
+void DecodedBlockCache::add(long int offset, const std::string &contents) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (bytes + contents.size() > maxBytes || blocks.count(offset)) return;
+	blocks.emplace(offset, contents_t(contents.begin(), contents.end()));
+	bytes += contents.size();
+}
+
+void DecodedBlockCache::clear() {
+	std::lock_guard<std::mutex> lock(mutex);
+	blocks.clear();
+	bytes = 0;
+}
+
+// Record which kinds of group a block holds, so later phases can skip it
+static void setBlockContents(BlockMetadata &blockMetadata, PbfPrimitiveBlock const &pb) {
+	blockMetadata.hasNodes = blockMetadata.hasWays = blockMetadata.hasRelations = false;
+	PbfPrimitiveGroup pg;
+	for (auto group : pb.groups) {
+		pg.parse(group);
+		if (pg.hasNodes()) blockMetadata.hasNodes = true;
+		if (!pg.ways.empty()) blockMetadata.hasWays = true;
+		if (!pg.relations.empty()) blockMetadata.hasRelations = true;
+	}
+}
+
+void PbfReader::readTags(PbfPackedVarints keys, PbfPackedVarints vals, PbfPrimitiveBlock const &pb, TagMap &tags) {
+	tags.reset(pb);
+	while (!keys.empty() && !vals.empty()) {
+		uint64_t key = keys.next();
+		tags.add(key, vals.next());
+	}
+}
+
+bool PbfReader::ReadNodes(OsmLuaProcessing &output, PbfPrimitiveGroup const &pg, PbfPrimitiveBlock const &pb, const unordered_set<int> &nodeKeyPositions)
 {
 	// ----	Read nodes
 
-	if (pg.has_dense()) {
+	if (!pg.dense.empty()) {
+		TRACE_SPAN("read nodes");
 		int64_t nodeId  = 0;
 		int lon = 0;
 		int lat = 0;
-		int kvPos = 0;
-		DenseNodes dense = pg.dense();
+		PbfDenseNodes dense;
+		dense.parse(pg.dense);
+		PbfPackedVarints keysVals = dense.keysVals;
+		const bool hasTags = !keysVals.empty();
 
 		std::vector<NodeStore::element_t> nodes;		
-		for (int j=0; j<dense.id_size(); j++) {
-			nodeId += dense.id(j);
-			lon    += dense.lon(j);
-			lat    += dense.lat(j);
+		thread_local TagMap tags;
+		size_t nodesRead = 0;
+
+		// Significant nodes for a batching profile, processed together at the end
+		const bool batched = output.batchesNodes();
+		std::vector<NodeID> batchIds;
+		std::vector<LatpLon> batchNodes;
+		thread_local std::vector<TagMap> batchTags;
+		while (!dense.ids.empty()) {
+			nodeId += dense.ids.nextSigned();
+			lon    += dense.lons.nextSigned();
+			lat    += dense.lats.nextSigned();
+			nodesRead++;
 			LatpLon node = { int(lat2latp(double(lat)/10000000.0)*10000000.0), lon };
 
 			bool significant = false;
-			int kvStart = kvPos;
-			if (dense.keys_vals_size()>0) {
-				while (dense.keys_vals(kvPos)>0) {
-					if (nodeKeyPositions.find(dense.keys_vals(kvPos)) != nodeKeyPositions.end()) {
+			PbfPackedVarints nodeKeysVals = keysVals;
+			if (hasTags) {
+				while (!keysVals.empty()) {
+					uint64_t key = keysVals.next();
+					if (key == 0) break;
+					if (nodeKeyPositions.find(int(key)) != nodeKeyPositions.end()) {
 						significant = true;
 					}
-					kvPos+=2;
+					keysVals.next();
 				}
-				kvPos++;
 			}
 
-			nodes.push_back(std::make_pair(static_cast<NodeID>(nodeId), node));
+			if (!storesPreloaded && (significant || !storeTaggedNodesOnly)) nodes.push_back(std::make_pair(static_cast<NodeID>(nodeId), node));
 
 			if (significant) {
 				// For tagged nodes, call Lua, then save the OutputObject
-				boost::container::flat_map<std::string, std::string> tags;
-				tags.reserve(kvPos / 2);
-
-				for (uint n=kvStart; n<kvPos-1; n+=2) {
-					tags[pb.stringtable().s(dense.keys_vals(n))] = pb.stringtable().s(dense.keys_vals(n+1));
+				if (batched && batchTags.size() <= batchIds.size()) batchTags.emplace_back();
+				TagMap &nodeTags = batched ? batchTags[batchIds.size()] : tags;
+				nodeTags.reset(pb);
+				while (!nodeKeysVals.empty()) {
+					uint64_t key = nodeKeysVals.next();
+					if (key == 0) break;
+					nodeTags.add(key, nodeKeysVals.next());
+				}
+				if (batched) {
+					batchIds.push_back(static_cast<NodeID>(nodeId));
+					batchNodes.push_back(node);
+				} else {
+					output.setNode(static_cast<NodeID>(nodeId), node, tags);
 				}
-				output.setNode(static_cast<NodeID>(nodeId), node, tags);
 			} 
 
 		}
+		if (batched) {
+			output.setNodes(batchIds, batchNodes, batchTags);
+		}
 
-		osmStore.nodes.insert(nodes);
+		if (!storesPreloaded) {
+			TRACE_SPAN("insert nodes");
+			osmStore.nodes.insert(nodes);
+		}
+		metrics.nodesRead.add(nodesRead);
 		return true;
 	}
 	return false;
 }
 
-bool PbfReader::ReadWays(OsmLuaProcessing &output, PrimitiveGroup &pg, PrimitiveBlock const &pb, bool locationsOnWays) {
+bool PbfReader::ReadWays(OsmLuaProcessing &output, PbfPrimitiveGroup const &pg, PbfPrimitiveBlock const &pb, bool locationsOnWays) {
 	// ----	Read ways
 
-	if (pg.ways_size() > 0) {
-		Way pbfWay;
+	if (pg.ways.size() > 0) {
+		TRACE_SPAN("read ways");
+		metrics.waysRead.add(pg.ways.size());
+		PbfWay pbfWay;
+		thread_local TagMap tags;
 
 		const bool wayStoreRequiresNodes = osmStore.ways.requiresNodes();
+		thread_local TagFilter::Prepared filter;
+		wayFilter.prepare(pb, filter);
 
 		std::vector<WayStore::ll_element_t> llWays;
 		std::vector<std::pair<WayID, std::vector<NodeID>>> nodeWays;
 
-		for (int j=0; j<pg.ways_size(); j++) {
-			pbfWay = pg.ways(j);
-			WayID wayId = static_cast<WayID>(pbfWay.id());
+		// Ways for a batching profile, processed together once the group's been read
+		const bool batched = output.batchesWays();
+		std::vector<WayID> batchIds;
+		std::vector<LatpLonVec> batchLatpLons;
+		std::vector<std::vector<NodeID>> batchNodes;
+		thread_local std::vector<TagMap> batchTags;
+
+		for (auto data : pg.ways) {
+			pbfWay.parse(data);
+			WayID wayId = static_cast<WayID>(pbfWay.id);
 			if (wayId >= pow(2,42)) throw std::runtime_error("Way ID negative or too large: "+std::to_string(wayId));
 
+			// Ways in relations go to Lua whatever their tags, as the profile may look at the relations
+			const bool wanted = TagFilter::matches(filter, pbfWay.keys, pbfWay.vals) || osmStore.way_in_any_relations(wayId);
+			if (!wanted && (storesPreloaded || (!storeAllWays && !osmStore.way_is_used(wayId)))) continue;
+
 			// Assemble nodelist
 			LatpLonVec llVec;
 			std::vector<NodeID> nodeVec;
 			if (locationsOnWays) {
 				int lat=0, lon=0;
-				llVec.reserve(pbfWay.lats_size());
-				for (int k=0; k<pbfWay.lats_size(); k++) {
-					lat += pbfWay.lats(k);
-					lon += pbfWay.lons(k);
+				llVec.reserve(pbfWay.lats.size());
+				while (!pbfWay.lats.empty() && !pbfWay.lons.empty()) {
+					lat += pbfWay.lats.nextSigned();
+					lon += pbfWay.lons.nextSigned();
 					LatpLon ll = { int(lat2latp(double(lat)/10000000.0)*10000000.0), lon };
 					llVec.push_back(ll);
 				}
 			} else {
 				int64_t nodeId = 0;
-				llVec.reserve(pbfWay.refs_size());
-				nodeVec.reserve(pbfWay.refs_size());
-				for (int k=0; k<pbfWay.refs_size(); k++) {
-					nodeId += pbfWay.refs(k);
-					try {
-						llVec.push_back(osmStore.nodes.at(static_cast<NodeID>(nodeId)));
-						nodeVec.push_back(nodeId);
-					} catch (std::out_of_range &err) {
-						if (osmStore.integrity_enforced()) throw err;
+				const size_t refs = pbfWay.refs.size();
+				nodeVec.reserve(refs);
+				while (!pbfWay.refs.empty()) {
+					nodeId += pbfWay.refs.nextSigned();
+					nodeVec.push_back(nodeId);
+				}
+				llVec.resize(nodeVec.size());
+				try {
+					osmStore.nodes.atBatch(nodeVec.data(), nodeVec.size(), llVec.data());
+				} catch (std::out_of_range &err) {
+					if (osmStore.integrity_enforced()) throw err;
+
+					// Some nodes are missing, so look them up one at a time and leave those out
+					llVec.clear();
+					std::vector<NodeID> foundNodes;
+					for (NodeID id : nodeVec) {
+						try {
+							llVec.push_back(osmStore.nodes.at(id));
+							foundNodes.push_back(id);
+						} catch (std::out_of_range &err) { }
 					}
+					nodeVec.swap(foundNodes);
 				}
 			}
 			if (llVec.empty()) continue;
 
+			if (oscChanges) {
+				if (locationsOnWays) {
+					// The refs are there too, if only to find the ways a node moves
+					int64_t nodeId = 0;
+					while (!pbfWay.refs.empty()) {
+						nodeId += pbfWay.refs.nextSigned();
+						nodeVec.push_back(nodeId);
+					}
+				}
+				oscChanges->checkWay(wayId, nodeVec, llVec);
+				if (locationsOnWays) nodeVec.clear();
+			}
+
+			if (batched && wanted) {
+				if (batchTags.size() <= batchIds.size()) batchTags.emplace_back();
+				readTags(pbfWay.keys, pbfWay.vals, pb, batchTags[batchIds.size()]);
+				batchIds.push_back(wayId);
+				batchLatpLons.push_back(std::move(llVec));
+				batchNodes.push_back(std::move(nodeVec));
+				continue;
+			}
+
 			try {
-				tag_map_t tags;
-				readTags(pbfWay, pb, tags);
-				bool emitted = output.setWay(static_cast<WayID>(pbfWay.id()), llVec, tags);
+				bool emitted = false;
+				if (wanted) {
+					readTags(pbfWay.keys, pbfWay.vals, pb, tags);
+					emitted = output.setWay(wayId, llVec, tags);
+				}
 
 				// If we need it for later, store the way's coordinates in the global way store
-				if (emitted || osmStore.way_is_used(wayId)) {
+				if (!storesPreloaded && (emitted || storeAllWays || osmStore.way_is_used(wayId))) {
 					if (wayStoreRequiresNodes)
 						nodeWays.push_back(std::make_pair(wayId, nodeVec));
 					else
@@ -137,10 +269,32 @@ bool PbfReader::ReadWays(OsmLuaProcessing &output, PrimitiveGroup &pg, Primitive
 
 		}
 
-		if (wayStoreRequiresNodes) {
-			osmStore.ways.insertNodes(nodeWays);
-		} else {
-			osmStore.ways.insertLatpLons(llWays);
+		if (!batchIds.empty()) {
+			std::vector<bool> emitted;
+			try {
+				emitted = output.setWays(batchIds, batchLatpLons, batchTags);
+			} catch (std::out_of_range &err) {
+				// The profile's call failed (each way's own errors are caught in setWays),
+				// so keep all the batch's ways, as we don't know which were written
+				cerr << endl << err.what() << endl;
+				emitted.assign(batchIds.size(), true);
+			}
+			for (size_t i = 0; i < batchIds.size(); i++) {
+				if (storesPreloaded || !(emitted[i] || storeAllWays || osmStore.way_is_used(batchIds[i]))) continue;
+				if (wayStoreRequiresNodes)
+					nodeWays.push_back(std::make_pair(batchIds[i], std::move(batchNodes[i])));
+				else
+					llWays.push_back(std::make_pair(batchIds[i], WayStore::latplon_vector_t(batchLatpLons[i].begin(), batchLatpLons[i].end())));
+			}
+		}
+
+		if (!storesPreloaded) {
+			TRACE_SPAN("insert ways");
+			if (wayStoreRequiresNodes) {
+				osmStore.ways.insertNodes(nodeWays);
+			} else {
+				osmStore.ways.insertLatpLons(llWays);
+			}
 		}
 
 		return true;
@@ -148,33 +302,45 @@ bool PbfReader::ReadWays(OsmLuaProcessing &output, PrimitiveGroup &pg, Primitive
 	return false;
 }
 
-bool PbfReader::ScanRelations(OsmLuaProcessing &output, PrimitiveGroup &pg, PrimitiveBlock const &pb) {
+bool PbfReader::ScanRelations(OsmLuaProcessing &output, PbfPrimitiveGroup const &pg, PbfPrimitiveBlock const &pb, const BlockMetadata &blockMetadata) {
 	// Scan relations to see which ways we need to save
-	if (pg.relations_size()==0) return false;
-
-	int typeKey = findStringPosition(pb, "type");
-	int mpKey   = findStringPosition(pb, "multipolygon");
-
-	for (int j=0; j<pg.relations_size(); j++) {
-		Relation pbfRelation = pg.relations(j);
-		bool isMultiPolygon = RelationIsType(pbfRelation, typeKey, mpKey);
+	if (pg.relations.size()==0) return false;
+	TRACE_SPAN("scan relations");
+
+	int typeKey = pb.findString("type");
+	int mpKey   = pb.findString("multipolygon");
+
+	PbfRelation pbfRelation;
+	thread_local TagMap tags;
+	thread_local TagFilter::Prepared filter;
+	relationFilter.prepare(pb, filter);
+	for (auto data : pg.relations) {
+		pbfRelation.parse(data);
+		if (!TagFilter::matches(filter, pbfRelation.keys, pbfRelation.vals)) continue;
+		bool isMultiPolygon = pbfRelation.isType(typeKey, mpKey);
 		bool isAccepted = false;
-		WayID relid = static_cast<WayID>(pbfRelation.id());
+		WayID relid = static_cast<WayID>(pbfRelation.id);
 		if (!isMultiPolygon) {
 			if (output.canReadRelations()) {
-				tag_map_t tags;
-				readTags(pbfRelation, pb, tags);
+				readTags(pbfRelation.keys, pbfRelation.vals, pb, tags);
 				isAccepted = output.scanRelation(relid, tags);
 			}
 			if (!isAccepted) continue;
 		}
 		int64_t lastID = 0;
-		for (int n=0; n < pbfRelation.memids_size(); n++) {
-			lastID += pbfRelation.memids(n);
-			if (pbfRelation.types(n) != Relation_MemberType_WAY) { continue; }
+		size_t ways = 0;
+		while (!pbfRelation.memids.empty() && !pbfRelation.types.empty()) {
+			lastID += pbfRelation.memids.nextSigned();
+			if (pbfRelation.types.next() != Relation_MemberType_WAY) { continue; }
 			if (lastID >= pow(2,42)) throw std::runtime_error("Way ID in relation "+std::to_string(relid)+" negative or too large: "+std::to_string(lastID));
 			osmStore.mark_way_used(static_cast<WayID>(lastID));
 			if (isAccepted) { osmStore.relation_contains_way(relid, lastID); }
+			ways++;
+		}
+		if (ways >= RELATION_HEAVY_WAYS) {
+			std::lock_guard<std::mutex> lock(heavyMutex);
+			heavyRelations.push_back({ blockMetadata.offset, pbfRelation.id, ways });
+			heavyRelationIDs.insert(pbfRelation.id);
 		}
 	}
 	return true;
@@ -182,47 +348,59 @@ bool PbfReader::ScanRelations(OsmLuaProcessing &output, PrimitiveGroup &pg, Prim
 
 bool PbfReader::ReadRelations(
 	OsmLuaProcessing& output,
-	PrimitiveGroup& pg,
-	const PrimitiveBlock& pb,
+	PbfPrimitiveGroup const& pg,
+	PbfPrimitiveBlock const& pb,
 	const BlockMetadata& blockMetadata
 ) {
 	// ----	Read relations
 
-	if (pg.relations_size() > 0) {
+	if (pg.relations.size() > 0) {
+		TRACE_SPAN("read relations");
 		std::vector<RelationStore::element_t> relations;
+		size_t relationsRead = 0;
 
-		int typeKey = findStringPosition(pb, "type");
-		int mpKey   = findStringPosition(pb, "multipolygon");
-		int boundaryKey = findStringPosition(pb, "boundary");
-		int innerKey= findStringPosition(pb, "inner");
-		int outerKey= findStringPosition(pb, "outer");
+		int typeKey = pb.findString("type");
+		int mpKey   = pb.findString("multipolygon");
+		int boundaryKey = pb.findString("boundary");
+		int innerKey= pb.findString("inner");
+		int outerKey= pb.findString("outer");
 		if (typeKey >-1 && mpKey>-1) {
-			for (int j=0; j<pg.relations_size(); j++) {
+			PbfRelation pbfRelation;
+			thread_local TagMap tags;
+			thread_local TagFilter::Prepared filter;
+			relationFilter.prepare(pb, filter);
+			for (size_t j=0; j<pg.relations.size(); j++) {
 				if (j % blockMetadata.chunks != blockMetadata.chunk)
 					continue;
 
-				Relation pbfRelation = pg.relations(j);
-				bool isMultiPolygon = RelationIsType(pbfRelation, typeKey, mpKey);
-				bool isBoundary = RelationIsType(pbfRelation, typeKey, boundaryKey);
+				pbfRelation.parse(pg.relations[j]);
+				if (blockMetadata.onlyRelation != 0 ? pbfRelation.id != blockMetadata.onlyRelation :
+				    heavyRelationIDs.count(pbfRelation.id) > 0)
+					continue;
+				relationsRead++;
+				if (!TagFilter::matches(filter, pbfRelation.keys, pbfRelation.vals)) continue;
+				bool isMultiPolygon = pbfRelation.isType(typeKey, mpKey);
+				bool isBoundary = pbfRelation.isType(typeKey, boundaryKey);
 				if (!isMultiPolygon && !isBoundary && !output.canWriteRelations()) continue;
 
 				// Read relation members
 				WayVec outerWayVec, innerWayVec;
 				int64_t lastID = 0;
 				bool isInnerOuter = isBoundary || isMultiPolygon;
-				for (int n=0; n < pbfRelation.memids_size(); n++) {
-					lastID += pbfRelation.memids(n);
-					if (pbfRelation.types(n) != Relation_MemberType_WAY) { continue; }
-					int32_t role = pbfRelation.roles_sid(n);
+				while (!pbfRelation.memids.empty() && !pbfRelation.types.empty() && !pbfRelation.roles.empty()) {
+					lastID += pbfRelation.memids.nextSigned();
+					int32_t role = pbfRelation.roles.next();
+					if (pbfRelation.types.next() != Relation_MemberType_WAY) { continue; }
 					if (role==innerKey || role==outerKey) isInnerOuter=true;
 					WayID wayId = static_cast<WayID>(lastID);
 					(role == innerKey ? innerWayVec : outerWayVec).push_back(wayId);
 				}
 
+				if (oscChanges) oscChanges->checkRelation(pbfRelation.id, outerWayVec, innerWayVec, isInnerOuter);
+
 				try {
-					tag_map_t tags;
-					readTags(pbfRelation, pb, tags);
-					output.setRelation(pbfRelation.id(), outerWayVec, innerWayVec, tags, isMultiPolygon, isInnerOuter);
+					readTags(pbfRelation.keys, pbfRelation.vals, pb, tags);
+					output.setRelation(pbfRelation.id, outerWayVec, innerWayVec, tags, isMultiPolygon, isInnerOuter);
 
 				} catch (std::out_of_range &err) {
 					// Relation is missing a member?
@@ -232,6 +410,7 @@ bool PbfReader::ReadRelations(
 		}
 
 		osmStore.relations_insert_front(relations);
+		metrics.relationsRead.add(relationsRead);
 		return true;
 	}
 	return false;
@@ -241,18 +420,39 @@ bool PbfReader::ReadRelations(
 bool PbfReader::ReadBlock(
 	std::istream& infile,
 	OsmLuaProcessing& output,
-	const BlockMetadata& blockMetadata,
+	BlockMetadata& blockMetadata,
+	DecodedBlockCache& blockCache,
 	const unordered_set<string>& nodeKeys,
 	bool locationsOnWays,
 	ReadPhase phase
 ) 
 {
-	infile.seekg(blockMetadata.offset);
+	// Decompress the block, unless RelationScan left it in the cache
+	thread_local std::string contents;
+	thread_local PbfPrimitiveBlock pb;
+	const char *data;
+	size_t size;
+	bool cached;
+	{
+		TRACE_SPAN("decode block");
+		cached = blockCache.get(blockMetadata.offset, data, size);
+		if (!cached) {
+			infile.seekg(blockMetadata.offset);
+			readBlockContents(contents, blockMetadata.length, infile);
+			if (infile.eof()) {
+				return true;
+			}
+			data = contents.data();
+			size = contents.size();
+		}
+		pb.parse(data, size);
+	}
+	if (!cached) {
+		setBlockContents(blockMetadata, pb);
 
-	PrimitiveBlock pb;
-	readBlock(&pb, blockMetadata.length, infile);
-	if (infile.eof()) {
-		return true;
+		// Relation blocks are read again in the Relations phase
+		if (phase == ReadPhase::RelationScan && blockMetadata.hasRelations)
+			blockCache.add(blockMetadata.offset, contents);
 	}
 
 	// Keep count of groups read during this phase.
@@ -261,19 +461,19 @@ bool PbfReader::ReadBlock(
 	// Read the string table, and pre-calculate the positions of valid node keys
 	unordered_set<int> nodeKeyPositions;
 	for (auto it : nodeKeys) {
-		nodeKeyPositions.insert(findStringPosition(pb, it.c_str()));
+		nodeKeyPositions.insert(pb.findString(it));
 	}
 
-	for (int i=0; i<pb.primitivegroup_size(); i++) {
-		PrimitiveGroup pg;
-		pg = pb.primitivegroup(i);
+	thread_local PbfPrimitiveGroup pg;
+	for (auto group : pb.groups) {
+		pg.parse(group);
 	
 		auto output_progress = [&]()
 		{
 			if (ioMutex.try_lock()) {
 				std::ostringstream str;
 				void_mmap_allocator::reportStoreSize(str);
-				str << "Block " << blocksProcessed.load() << "/" << blocksToProcess.load() << " ways " << pg.ways_size() << " relations " << pg.relations_size() << "                  \r";
+				str << "Block " << blocksProcessed.load() << "/" << blocksToProcess.load() << " ways " << pg.ways.size() << " relations " << pg.relations.size() << "                  \r";
 				std::cout << str.str();
 				std::cout.flush();
 				ioMutex.unlock();
@@ -290,8 +490,7 @@ bool PbfReader::ReadBlock(
 		}
 
 		if(phase == ReadPhase::RelationScan) {
-			osmStore.ensureUsedWaysInited();
-			bool done = ScanRelations(output, pg, pb);
+			bool done = ScanRelations(output, pg, pb, blockMetadata);
 			if(done) { 
 				std::cout << "(Scanning for ways used in relations: " << (100*blocksProcessed.load()/blocksToProcess.load()) << "%)\r";
 				std::cout.flush();
@@ -326,7 +525,7 @@ bool PbfReader::ReadBlock(
 	// In later case block would not be handled during this phase, and should be
 	// read again in remaining phases. Thus we return false to indicate that the
 	// block was not handled completelly.
-	if(read_groups != pb.primitivegroup_size()) {
+	if(read_groups != pb.groups.size()) {
 		return false;
 	}
 
@@ -335,32 +534,99 @@ bool PbfReader::ReadBlock(
 	return blockMetadata.chunks == 1;
 }
 
-bool blockHasPrimitiveGroupSatisfying(
-	std::istream& infile,
-	const BlockMetadata block,
-	std::function<bool(const PrimitiveGroup&)> test
-) {
-	PrimitiveBlock pb;
-
+// Read a block just to find which kinds of group it holds
+BlockMetadata probeBlockContents(std::istream& infile, BlockMetadata block) {
 	// We may have previously read to EOF, so clear the internal error state
 	infile.clear();
 	infile.seekg(block.offset);
-	readBlock(&pb, block.length, infile);
+	std::string contents;
+	readBlockContents(contents, block.length, infile);
 	if (infile.eof()) {
-		throw std::runtime_error("blockHasPrimitiveGroupSatisfying got unexpected eof");
+		throw std::runtime_error("probeBlockContents got unexpected eof");
 	}
 
-	for (int i=0; i<pb.primitivegroup_size(); i++) {
-		PrimitiveGroup pg;
-		pg = pb.primitivegroup(i);
+	PbfPrimitiveBlock pb;
+	pb.parse(contents.data(), contents.size());
+	setBlockContents(block, pb);
+	return block;
+}
+
+// ----	Saved block index
+//
+// Which kinds of object each block holds, so that on a later run with the same
+// .pbf we needn't scan the headers or probe any blocks, and even the Nodes
+// phase can skip blocks that only hold ways and relations.
+
+#define BLOCK_INDEX_VERSION 1
+#define BLOCK_INDEX_NODES 1
+#define BLOCK_INDEX_WAYS 2
+#define BLOCK_INDEX_RELATIONS 4
+
+namespace {
+	struct BlockIndexHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t reserved;
+		uint64_t signature;
+		uint64_t blockCount;
+	};
+
+	struct BlockIndexEntry {
+		int64_t offset;
+		int32_t length;
+		uint32_t contents;
+	};
+
+	const char blockIndexMagic[8] = { 'T','M','P','B','F','I','D','X' };
+}
+
+// Returns false if there's no index, or it was built from a different .pbf
+static bool loadBlockIndex(const string &filename, uint64_t signature, map<size_t, BlockMetadata> &blocks, size_t &filesize) {
+	ifstream in(filename, ios::in | ios::binary);
+	if (!in) return false;
+	BlockIndexHeader header;
+	in.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if (!in || memcmp(header.magic, blockIndexMagic, sizeof(header.magic)) != 0 ||
+	    header.version != BLOCK_INDEX_VERSION || header.signature != signature || header.blockCount == 0)
+		return false;
+
+	vector<BlockIndexEntry> entries(header.blockCount);
+	in.read(reinterpret_cast<char*>(entries.data()), entries.size() * sizeof(BlockIndexEntry));
+	if (!in) return false;
 
-		if (test(pg))
-			return false;
+	blocks.clear();
+	filesize = 0;
+	for (const auto &entry : entries) {
+		blocks[blocks.size()] = { (long int)entry.offset, entry.length,
+			bool(entry.contents & BLOCK_INDEX_NODES), bool(entry.contents & BLOCK_INDEX_WAYS), bool(entry.contents & BLOCK_INDEX_RELATIONS), 0, 1 };
+		filesize += entry.length;
 	}
-	
 	return true;
 }
 
+static void saveBlockIndex(const string &filename, uint64_t signature, const map<long int, BlockMetadata> &blocks) {
+	ofstream out(filename, ios::out | ios::trunc | ios::binary);
+	if (!out) {
+		cerr << "Couldn't open " << filename << " to save block index" << endl;
+		return;
+	}
+	BlockIndexHeader header;
+	memcpy(header.magic, blockIndexMagic, sizeof(header.magic));
+	header.version = BLOCK_INDEX_VERSION;
+	header.reserved = 0;
+	header.signature = signature;
+	header.blockCount = blocks.size();
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	for (const auto &it : blocks) {
+		const BlockMetadata &block = it.second;
+		BlockIndexEntry entry = { block.offset, block.length,
+			(block.hasNodes ? BLOCK_INDEX_NODES : 0u) | (block.hasWays ? BLOCK_INDEX_WAYS : 0u) | (block.hasRelations ? BLOCK_INDEX_RELATIONS : 0u) };
+		out.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+	}
+	if (!out) cerr << "Couldn't write block index to " << filename << endl;
+	else cout << "Saved block index to " << filename << endl;
+}
+
 int PbfReader::ReadPbfFile(
 	bool hasSortTypeThenID,
 	unordered_set<string> const& nodeKeys,
@@ -372,7 +638,10 @@ int PbfReader::ReadPbfFile(
 	auto infile = generate_stream();
 
 	// ----	Read PBF
-	osmStore.clear();
+	if (!storesPreloaded) osmStore.clear();
+	osmStore.assembly_threads(threadNum);
+	heavyRelations.clear();
+	heavyRelationIDs.clear();
 
 	HeaderBlock block;
 	readBlock(&block, readHeader(*infile).datasize(), *infile);
@@ -389,18 +658,24 @@ int PbfReader::ReadPbfFile(
 	// Track the filesize - note that we can't rely on tellg(), as
 	// its meant to be an opaque token useful only for seeking.
 	size_t filesize = 0;
-	while (true) {
-		BlobHeader bh = readHeader(*infile);
-		filesize += bh.datasize();
-		if (infile->eof()) {
-			break;
-		}
+	const bool indexed = !indexFile.empty() && loadBlockIndex(indexFile, indexSignature, blocks, filesize);
+	if (indexed) {
+		std::cout << "Using block index " << indexFile << std::endl;
+	} else {
+		while (true) {
+			BlobHeader bh = readHeader(*infile);
+			filesize += bh.datasize();
+			if (infile->eof()) {
+				break;
+			}
 
-		blocks[blocks.size()] = { (long int)infile->tellg(), bh.datasize(), true, true, true, 0, 1 };
-		infile->seekg(bh.datasize(), std::ios_base::cur);
+			blocks[blocks.size()] = { (long int)infile->tellg(), bh.datasize(), true, true, true, 0, 1 };
+			infile->seekg(bh.datasize(), std::ios_base::cur);
+		}
 	}
+	const size_t blockCount = blocks.size();
 
-	if (hasSortTypeThenID) {
+	if (hasSortTypeThenID && !indexed) {
 		// The PBF's blocks are sorted by type, then ID. We can do a binary search
 		// to learn where the blocks transition between object types, which
 		// enables a more efficient partitioning of work for reading.
@@ -408,16 +683,21 @@ int PbfReader::ReadPbfFile(
 		for (int i = 0; i < blocks.size(); i++)
 			indexes.push_back(i);
 
+		// The two searches probe many of the same blocks, so only read each once
+		std::map<size_t, BlockMetadata> probed;
+		auto probe = [&](size_t i) -> const BlockMetadata& {
+			auto it = probed.find(i);
+			if (it == probed.end()) it = probed.emplace(i, probeBlockContents(*infile, blocks[i])).first;
+			return it->second;
+		};
+
 		const auto& waysStart = std::lower_bound(
 			indexes.begin(),
 			indexes.end(),
 			0,
-			[&blocks, &infile](const auto &i, const auto &ignored) {
-				return blockHasPrimitiveGroupSatisfying(
-					*infile,
-					blocks[i],
-					[](const PrimitiveGroup&pg) { return pg.ways_size() > 0 || pg.relations_size() > 0; }
-				);
+			[&probe](const auto &i, const auto &ignored) {
+				const BlockMetadata& block = probe(i);
+				return !block.hasWays && !block.hasRelations;
 			}
 		);
 
@@ -425,12 +705,8 @@ int PbfReader::ReadPbfFile(
 			indexes.begin(),
 			indexes.end(),
 			0,
-			[&blocks, &infile](const auto &i, const auto &ignored) {
-				return blockHasPrimitiveGroupSatisfying(
-					*infile,
-					blocks[i],
-					[](const PrimitiveGroup&pg) { return pg.relations_size() > 0; }
-				);
+			[&probe](const auto &i, const auto &ignored) {
+				return !probe(i).hasRelations;
 			}
 		);
 
@@ -457,8 +733,17 @@ int PbfReader::ReadPbfFile(
 	}
 
 
+	// Relation blocks decompressed during RelationScan, for the Relations phase
+	DecodedBlockCache blockCache(blockCacheSize);
+
+	// What each block turned out to hold once read, by offset, for the index.
+	// Every block is read in at least one phase, since those that might hold
+	// nodes, ways or relations together cover the whole file.
+	std::map<long int, BlockMetadata> blockContents;
+
 	std::vector<ReadPhase> all_phases = { ReadPhase::Nodes, ReadPhase::RelationScan, ReadPhase::Ways, ReadPhase::Relations };
 	for(auto phase: all_phases) {
+		if (onPhase) onPhase(phase);
 		// Launch the pool with threadNum threads
 		boost::asio::thread_pool pool(threadNum);
 		std::mutex block_mutex;
@@ -490,7 +775,29 @@ int PbfReader::ReadPbfFile(
 				filteredBlocks[entry.first] = entry.second;
 		}
 
-		blocksToProcess = filteredBlocks.size();
+		// The heaviest relations are each a task of their own, queued first
+		// and largest first, so that they're started while there are other
+		// blocks to keep the rest of the threads busy, rather than one of
+		// them holding up the end of the phase
+		if (phase == ReadPhase::Relations && !heavyRelations.empty()) {
+			std::sort(heavyRelations.begin(), heavyRelations.end(), [](const HeavyRelation &a, const HeavyRelation &b) { return a.ways > b.ways; });
+			std::map<long int, std::size_t> blockAt;
+			for (const auto& entry : filteredBlocks) blockAt.emplace(entry.second.offset, entry.first);
+			for (const HeavyRelation &relation : heavyRelations) {
+				auto found = blockAt.find(relation.blockOffset);
+				if (found == blockAt.end()) { heavyRelationIDs.erase(relation.id); continue; }
+				IndexedBlockMetadata ibm;
+				memcpy(&ibm, &filteredBlocks[found->second], sizeof(BlockMetadata));
+				ibm.index = found->second;
+				ibm.chunk = 0;
+				ibm.chunks = 1;
+				ibm.onlyRelation = relation.id;
+				blockRanges.push_back({ ibm });
+			}
+			if (verbose) std::cout << blockRanges.size() << " relations with " << RELATION_HEAVY_WAYS << " or more ways will be read first" << std::endl;
+		}
+
+		blocksToProcess = filteredBlocks.size() + blockRanges.size();
 		blocksProcessed = 0;
 
 		// When processing blocks, we try to give each worker large batches
@@ -516,20 +823,28 @@ int PbfReader::ReadPbfFile(
 
 		{
 			for(const std::vector<IndexedBlockMetadata>& blockRange: blockRanges) {
-				boost::asio::post(pool, [=, &blockRange, &blocks, &block_mutex, &nodeKeys]() {
-					if (phase == ReadPhase::Nodes)
+				boost::asio::post(pool, [=, &blockRange, &blocks, &block_mutex, &blockCache, &blockContents, &nodeKeys]() {
+					if (phase == ReadPhase::Nodes && !storesPreloaded)
 						osmStore.nodes.batchStart();
-					if (phase == ReadPhase::Ways)
+					if (phase == ReadPhase::Ways && !storesPreloaded)
 						osmStore.ways.batchStart();
 
-					for (const IndexedBlockMetadata& indexedBlockMetadata: blockRange) {
+					for (IndexedBlockMetadata indexedBlockMetadata: blockRange) {
 						auto infile = generate_stream();
 						auto output = generate_output();
 
-						if(ReadBlock(*infile, *output, indexedBlockMetadata, nodeKeys, locationsOnWays, phase)) {
-							const std::lock_guard<std::mutex> lock(block_mutex);
+						bool done = ReadBlock(*infile, *output, indexedBlockMetadata, blockCache, nodeKeys, locationsOnWays, phase);
+						const std::lock_guard<std::mutex> lock(block_mutex);
+						if (!indexed) blockContents[indexedBlockMetadata.offset] = indexedBlockMetadata;
+						if (done) {
 							blocks.erase(indexedBlockMetadata.index);	
 							blocksProcessed++;
+						} else {
+							// Now we've read it, later phases only need to revisit it for what it holds
+							BlockMetadata& block = blocks[indexedBlockMetadata.index];
+							block.hasNodes = indexedBlockMetadata.hasNodes;
+							block.hasWays = indexedBlockMetadata.hasWays;
+							block.hasRelations = indexedBlockMetadata.hasRelations;
 						}
 					}
 				});
@@ -538,26 +853,25 @@ int PbfReader::ReadPbfFile(
 	
 		pool.join();
 
-		if(phase == ReadPhase::Nodes) {
+		if(phase == ReadPhase::Nodes && !storesPreloaded) {
 			osmStore.nodes.finalize(threadNum);
 		}
-		if(phase == ReadPhase::Ways) {
+		if(phase == ReadPhase::Ways && !storesPreloaded) {
 			osmStore.ways.finalize(threadNum);
 		}
+		if(phase == ReadPhase::RelationScan) {
+			osmStore.finalize_scanned_relations(threadNum);
+		}
 	}
-	return 0;
-}
+	blockCache.clear();
 
-// Find a string in the dictionary
-int PbfReader::findStringPosition(PrimitiveBlock const &pb, char const *str) {
-	for (int i=0; i<pb.stringtable().s_size(); i++) {
-		if(pb.stringtable().s(i) == str)
-			return i;
+	if (!indexFile.empty() && !indexed) {
+		if (blockContents.size() == blockCount) saveBlockIndex(indexFile, indexSignature, blockContents);
+		else std::cerr << "Not all blocks were read, so no block index was saved" << std::endl;
 	}
-	return -1;
+	return 0;
 }
 
-
 // *************************************************
 
 int ReadPbfBoundingBox(const std::string &inputFile, double &minLon, double &maxLon, 
@@ -1,7 +1,10 @@
 #include "read_shp.h"
 
-#include <boost/asio/thread_pool.hpp>
-#include <boost/asio/post.hpp>
+#include <thread>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <sstream>
 
 extern bool verbose;
 
@@ -14,6 +17,9 @@ namespace geom = boost::geometry;
 
 std::mutex attributeMutex;
 
+// Shapes each thread takes at a time
+#define SHAPES_PER_RUN 64
+
 void fillPointArrayFromShapefile(vector<Point> *points, SHPObject *shape, uint part) {
 	uint start = shape->panPartStart[part];
 	uint end   = (int(part)==shape->nParts-1) ? shape->nVertices : shape->panPartStart[part+1];
@@ -36,10 +42,25 @@ void fillPointArrayFromShapefile(vector<Point> *points, SHPObject *shape, uint p
 	}
 }
 
-// Read requested attributes from a shapefile, and encode into an OutputObject
-AttributeIndex readShapefileAttributes(
-		DBFHandle &dbf,
-		int recordNum, unordered_map<int,string> &columnMap, unordered_map<int,int> &columnTypeMap,
+// Integers which fit in a Lua int are passed as one, and anything bigger as a double
+static bool fitsInt(double number) {
+	return number >= INT_MIN && number <= INT_MAX && number == std::floor(number);
+}
+
+string sourceValueString(const SourceValue &value) {
+	if (value.type == SourceValue::String) return value.str;
+	// Long/ULong columns can hold more than an int64_t, so only those in range are written as integers
+	if (value.type == SourceValue::Integer && value.number >= -9.2e18 && value.number <= 9.2e18)
+		return to_string(int64_t(value.number));
+	ostringstream out;
+	out.precision(17);
+	out << value.number;
+	return out.str();
+}
+
+// Encode attributes read from any source, passing them through attribute_function if the profile has one
+AttributeIndex addSourceAttributes(
+		const vector<pair<string, SourceValue>> &values,
 		LayerDef &layer,
 		OsmLuaProcessing &osmLuaProcessing, uint &minzoom) {
 
@@ -50,13 +71,16 @@ AttributeIndex readShapefileAttributes(
 	if (osmLuaProcessing.canRemapShapefiles()) {
 		// Create table object
 		kaguya::LuaTable in_table = osmLuaProcessing.newTable();
-		for (auto it : columnMap) {
-			int pos = it.first;
-			string key = it.second;
-			switch (columnTypeMap[pos]) {
-				case 1:  in_table[key] = DBFReadIntegerAttribute(dbf, recordNum, pos); break;
-				case 2:  in_table[key] =  DBFReadDoubleAttribute(dbf, recordNum, pos); break;
-				default: in_table[key] =  DBFReadStringAttribute(dbf, recordNum, pos); break;
+		for (const auto &it : values) {
+			const string &key = it.first;
+			switch (it.second.type) {
+				case SourceValue::Integer:
+					if (fitsInt(it.second.number)) in_table[key] = int(it.second.number);
+					else in_table[key] = it.second.number;
+					break;
+				case SourceValue::Double:  in_table[key] = it.second.number; break;
+				case SourceValue::Boolean: in_table[key] = it.second.number != 0; break;
+				default:                   in_table[key] = it.second.str; break;
 			}
 		}
 
@@ -85,26 +109,49 @@ AttributeIndex readShapefileAttributes(
 			}
 		}
 	} else {
-		for (auto it : columnMap) {
-			int pos = it.first;
-			string key = it.second;
-			vector_tile::Tile_Value v;
-			switch (columnTypeMap[pos]) {
-				case 1:  attributeStore.addAttribute(attributes, key, (float)DBFReadIntegerAttribute(dbf, recordNum, pos), 0);
-				         layer.attributeMap[key] = 1;
-				         break;
-				case 2:  attributeStore.addAttribute(attributes, key, static_cast<float>(DBFReadDoubleAttribute(dbf, recordNum, pos)), 0);
-				         layer.attributeMap[key] = 1;
-				         break;
-				default: attributeStore.addAttribute(attributes, key, DBFReadStringAttribute(dbf, recordNum, pos), 0);
-				         layer.attributeMap[key] = 0;
-				         break;
+		for (const auto &it : values) {
+			const string &key = it.first;
+			switch (it.second.type) {
+				case SourceValue::Integer:
+				case SourceValue::Double:
+					attributeStore.addAttribute(attributes, key, static_cast<float>(it.second.number), 0);
+					layer.attributeMap[key] = 1;
+					break;
+				case SourceValue::Boolean:
+					attributeStore.addAttribute(attributes, key, it.second.number != 0, 0);
+					layer.attributeMap[key] = 2;
+					break;
+				default:
+					attributeStore.addAttribute(attributes, key, it.second.str, 0);
+					layer.attributeMap[key] = 0;
+					break;
 			}
 		}
 	}
 	return attributeStore.add(attributes);
 }
 
+// Read requested attributes from a shapefile, and encode into an OutputObject
+AttributeIndex readShapefileAttributes(
+		DBFHandle &dbf,
+		int recordNum, unordered_map<int,string> &columnMap, unordered_map<int,int> &columnTypeMap,
+		LayerDef &layer,
+		OsmLuaProcessing &osmLuaProcessing, uint &minzoom) {
+
+	vector<pair<string, SourceValue>> values;
+	for (auto it : columnMap) {
+		int pos = it.first;
+		SourceValue value;
+		switch (columnTypeMap[pos]) {
+			case 1:  value.type = SourceValue::Integer; value.number = DBFReadIntegerAttribute(dbf, recordNum, pos); break;
+			case 2:  value.type = SourceValue::Double;  value.number = DBFReadDoubleAttribute(dbf, recordNum, pos); break;
+			default: value.type = SourceValue::String;  value.str = DBFReadStringAttribute(dbf, recordNum, pos); break;
+		}
+		values.emplace_back(it.second, std::move(value));
+	}
+	return addSourceAttributes(values, layer, osmLuaProcessing, minzoom);
+}
+
 // Read shapefile, and create OutputObjects for all objects within the specified bounding box
 void readShapefile(const Box &clippingBox, 
                    class LayerDefinition &layers,
@@ -148,33 +195,51 @@ void readShapefile(const Box &clippingBox,
 	int indexField=-1;
 	if (indexName!="") { indexField = DBFGetFieldIndex(dbf,indexName.c_str()); }
 
-	boost::asio::thread_pool pool(threadNum);
-	for (int i=0; i<numEntities; i++) {
-		SHPObject* shape = SHPReadObject(shp, i);
-		if(shape == nullptr) { cerr << "Error loading shape from shapefile" << endl; continue; }
-
-		// Check shape is in clippingBox
-		Box shapeBox(Point(shape->dfXMin, lat2latp(shape->dfYMin)), Point(shape->dfXMax, lat2latp(shape->dfYMax)));
-		if (shapeBox.min_corner().get<0>() > clippingBox.max_corner().get<0>() ||
-		    shapeBox.max_corner().get<0>() < clippingBox.min_corner().get<0>() ||
-		    shapeBox.min_corner().get<1>() > clippingBox.max_corner().get<1>() ||
-		    shapeBox.max_corner().get<1>() < clippingBox.min_corner().get<1>()) {
-			SHPDestroyObject(shape);
-			continue;
+	// Each thread reads its own runs of shapes, through its own shapelib handles
+	// as they can't be shared, then corrects and clips them
+	std::atomic<int> nextShape(0);
+	auto worker = [&]() {
+		SHPHandle threadShp = SHPOpen(filename.c_str(), "rb");
+		DBFHandle threadDbf = DBFOpen(filename.c_str(), "rb");
+		if (threadShp == nullptr || threadDbf == nullptr) {
+			cerr << "Couldn't open shapefile " << filename << endl;
+			if (threadShp) SHPClose(threadShp);
+			if (threadDbf) DBFClose(threadDbf);
+			return;
 		}
+		for (int start = nextShape.fetch_add(SHAPES_PER_RUN); start < numEntities; start = nextShape.fetch_add(SHAPES_PER_RUN)) {
+			int end = std::min(numEntities, start + SHAPES_PER_RUN);
+			for (int i=start; i<end; i++) {
+				SHPObject* shape = SHPReadObject(threadShp, i);
+				if(shape == nullptr) { cerr << "Error loading shape from shapefile" << endl; continue; }
 
-		boost::asio::post(pool, [&, shape]() {
-			// process attributes
-			string name;
-			bool hasName = false;
-			if (indexField>-1) { name=DBFReadStringAttribute(dbf, i, indexField); hasName = true;}
-			AttributeIndex attrIdx = readShapefileAttributes(dbf, i, columnMap, columnTypeMap, layer, osmLuaProcessing, layer.minzoom);
-			// process geometry
-			processShapeGeometry(shape, attrIdx, shpMemTiles, clippingBox, layer, layerNum, hasName, name);
-			SHPDestroyObject(shape);
-		});
-	}
-	pool.join();
+				// Check shape is in clippingBox
+				Box shapeBox(Point(shape->dfXMin, lat2latp(shape->dfYMin)), Point(shape->dfXMax, lat2latp(shape->dfYMax)));
+				if (shapeBox.min_corner().get<0>() > clippingBox.max_corner().get<0>() ||
+				    shapeBox.max_corner().get<0>() < clippingBox.min_corner().get<0>() ||
+				    shapeBox.min_corner().get<1>() > clippingBox.max_corner().get<1>() ||
+				    shapeBox.max_corner().get<1>() < clippingBox.min_corner().get<1>()) {
+					SHPDestroyObject(shape);
+					continue;
+				}
+
+				// process attributes
+				string name;
+				bool hasName = false;
+				if (indexField>-1) { name=DBFReadStringAttribute(threadDbf, i, indexField); hasName = true;}
+				AttributeIndex attrIdx = readShapefileAttributes(threadDbf, i, columnMap, columnTypeMap, layer, osmLuaProcessing, layer.minzoom);
+				// process geometry
+				processShapeGeometry(shape, attrIdx, shpMemTiles, clippingBox, layer, layerNum, hasName, name);
+				SHPDestroyObject(shape);
+			}
+		}
+		SHPClose(threadShp);
+		DBFClose(threadDbf);
+	};
+
+	std::vector<std::thread> threads;
+	for (uint t=0; t<std::max(1u, threadNum); t++) threads.emplace_back(worker);
+	for (auto &t : threads) t.join();
 	SHPClose(shp);
 	DBFClose(dbf);
 }
@@ -182,14 +247,11 @@ void readShapefile(const Box &clippingBox,
 void processShapeGeometry(SHPObject* shape, AttributeIndex attrIdx, ShpMemTiles &shpMemTiles,
                           const Box &clippingBox, const LayerDef &layer, uint layerNum, bool hasName, const string &name) {
 	int shapeType = shape->nSHPType;	// 1=point, 3=polyline, 5=(multi)polygon [8=multipoint, 11+=3D]
-	int minzoom = layer.minzoom;
 
 	if (shapeType==1) {
 		// Points
 		Point p( shape->padfX[0], lat2latp(shape->padfY[0]) );
-		if (geom::within(p, clippingBox)) {
-			shpMemTiles.StoreShapefileGeometry(layerNum, layer.name, POINT_, p, layer.indexed, hasName, name, minzoom, attrIdx);
-		}
+		storeSourcePoint(p, attrIdx, shpMemTiles, clippingBox, layer, layerNum, hasName, name);
 
 	} else if (shapeType==3) {
 		// (Multi)-polylines
@@ -200,11 +262,7 @@ void processShapeGeometry(SHPObject* shape, AttributeIndex attrIdx, ShpMemTiles
 			Linestring ls;
 			fillPointArrayFromShapefile(&points, shape, j);
 			geom::assign_points(ls, points);
-			MultiLinestring out;
-			geom::intersection(ls, clippingBox, out);
-			for (MultiLinestring::const_iterator it = out.begin(); it != out.end(); ++it) {
-				shpMemTiles.StoreShapefileGeometry(layerNum, layer.name, LINESTRING_, *it, layer.indexed, hasName, name, minzoom, attrIdx);
-			}
+			storeSourceLinestring(ls, attrIdx, shpMemTiles, clippingBox, layer, layerNum, hasName, name);
 		}
 
 	} else if (shapeType==5) {
@@ -245,28 +303,51 @@ void processShapeGeometry(SHPObject* shape, AttributeIndex attrIdx, ShpMemTiles
 
 		// All parts read. Add the last polygon.
 		multi.push_back(poly);
-		geom::remove_spikes(multi);
-
-		// Make valid if needs be
-		string reason;
-		if (!geom::is_valid(multi, reason)) {
-			if (verbose) cerr << "Shapefile entity " << shape->nShapeId << " type " << shapeType << " is invalid. Parts:" << shape->nParts << ". Reason:" << reason;
-			make_valid(multi);
-			if (verbose) {
-				if (geom::is_valid(multi, reason)) { cerr << "... corrected"; }
-				                              else { cerr << "... failed to correct. Reason: " << reason; }
-				cerr << endl;
-			}
-		}
-		// clip to bounding box
-		MultiPolygon out;
-		geom::intersection(multi, clippingBox, out);
-		if (boost::size(out)>0) {
-			shpMemTiles.StoreShapefileGeometry(layerNum, layer.name, POLYGON_, out, layer.indexed, hasName, name, minzoom, attrIdx);
-		}
+		storeSourcePolygon(multi, shape->nShapeId, attrIdx, shpMemTiles, clippingBox, layer, layerNum, hasName, name);
 
 	} else {
 		// Not supported
 		cerr << "Shapefile entity #" << shape->nShapeId << " type " << shapeType << " not supported" << endl;
 	}
 }
+
+// ----	Clip geometries from any source to the bounding box, and store them
+
+void storeSourcePoint(const Point &p, AttributeIndex attrIdx, ShpMemTiles &shpMemTiles,
+                      const Box &clippingBox, const LayerDef &layer, uint layerNum, bool hasName, const string &name) {
+	if (geom::within(p, clippingBox)) {
+		shpMemTiles.StoreShapefileGeometry(layerNum, layer.name, POINT_, p, layer.indexed, hasName, name, layer.minzoom, attrIdx);
+	}
+}
+
+void storeSourceLinestring(const Linestring &ls, AttributeIndex attrIdx, ShpMemTiles &shpMemTiles,
+                           const Box &clippingBox, const LayerDef &layer, uint layerNum, bool hasName, const string &name) {
+	MultiLinestring out;
+	geom::intersection(ls, clippingBox, out);
+	for (MultiLinestring::const_iterator it = out.begin(); it != out.end(); ++it) {
+		shpMemTiles.StoreShapefileGeometry(layerNum, layer.name, LINESTRING_, *it, layer.indexed, hasName, name, layer.minzoom, attrIdx);
+	}
+}
+
+void storeSourcePolygon(MultiPolygon &multi, int64_t featureId, AttributeIndex attrIdx, ShpMemTiles &shpMemTiles,
+                        const Box &clippingBox, const LayerDef &layer, uint layerNum, bool hasName, const string &name) {
+	geom::remove_spikes(multi);
+
+	// Make valid if needs be
+	string reason;
+	if (!geom::is_valid(multi, reason)) {
+		if (verbose) cerr << "Entity " << featureId << " in " << layer.source << " is invalid. Reason:" << reason;
+		make_valid(multi);
+		if (verbose) {
+			if (geom::is_valid(multi, reason)) { cerr << "... corrected"; }
+			                              else { cerr << "... failed to correct. Reason: " << reason; }
+			cerr << endl;
+		}
+	}
+	// clip to bounding box
+	MultiPolygon out;
+	geom::intersection(multi, clippingBox, out);
+	if (boost::size(out)>0) {
+		shpMemTiles.StoreShapefileGeometry(layerNum, layer.name, POLYGON_, out, layer.indexed, hasName, name, layer.minzoom, attrIdx);
+	}
+}
@@ -1,4 +1,5 @@
 #include "shared_data.h"
+#include <cstdio>
 #include "rapidjson/document.h"
 #include "rapidjson/writer.h"
 #include "rapidjson/stringbuffer.h"
@@ -8,18 +9,61 @@ using namespace rapidjson;
 
 SharedData::SharedData(Config &configIn, const class LayerDefinition &layers)
 	: layers(layers), config(configIn) {
-	sqlite=false;
+	outputMode=OutputMode::File;
 	mergeSqlite=false;
+	replaceTiles=false;
 }
 
 SharedData::~SharedData() { }
 
+static std::string mbtilesShardFilename(const std::string &outputFile, unsigned int shard) {
+	return outputFile + ".shard" + std::to_string(shard);
+}
+
+// Write tiles to several .mbtiles files at once, so that SQLite doesn't become the bottleneck
+void SharedData::openMbtilesShards(unsigned int shardCount) {
+	for (unsigned int i = 0; i < shardCount; i++) {
+		std::string filename = mbtilesShardFilename(outputFile, i);
+		std::remove(filename.c_str());
+		mbtilesShards.emplace_back(new MBTiles());
+		mbtilesShards.back()->openForWriting(filename);
+	}
+}
+
+// Pick a shard by z6 tile (or by tile, for lower zooms)
+MBTiles &SharedData::mbtilesForTile(uint zoom, TileCoordinate x, TileCoordinate y) {
+	if (mbtilesShards.empty()) return mbtiles;
+
+	size_t index;
+	if (zoom >= CLUSTER_ZOOM) {
+		index = (x >> (zoom - CLUSTER_ZOOM)) * CLUSTER_ZOOM_WIDTH + (y >> (zoom - CLUSTER_ZOOM));
+	} else {
+		index = x * (1 << zoom) + y;
+	}
+	return *mbtilesShards[index % mbtilesShards.size()];
+}
+
+// Close each shard and copy its tiles into the main .mbtiles
+void SharedData::mergeMbtilesShards() {
+	for (unsigned int i = 0; i < mbtilesShards.size(); i++) {
+		std::string filename = mbtilesShardFilename(outputFile, i);
+		mbtilesShards[i]->closeForWriting();
+		mbtilesShards[i].reset();
+		cout << "Merging mbtiles shard " << (i+1) << "/" << mbtilesShards.size() << "          \r" << std::flush;
+		mbtiles.mergeFrom(filename);
+		std::remove(filename.c_str());
+	}
+	if (!mbtilesShards.empty()) cout << endl;
+	mbtilesShards.clear();
+}
+
 // *****************************************************************
 
 // Define a layer (as read from the .json file)
 uint LayerDefinition::addLayer(string name, uint minzoom, uint maxzoom,
-		uint simplifyBelow, double simplifyLevel, double simplifyLength, double simplifyRatio, 
-		uint filterBelow, double filterArea, uint combinePolygonsBelow, bool sortZOrderAscending,
+		uint simplifyBelow, double simplifyLevel, double simplifyLength, double simplifyRatio, bool simplifyFast,
+		uint filterBelow, double filterArea, uint combinePolygonsBelow, uint aggregateBelow, uint aggregateResolution,
+		bool sortZOrderAscending,
 		uint featureLimit, uint featureLimitBelow,
 		const std::string &source,
 		const std::vector<std::string> &sourceColumns,
@@ -29,8 +73,9 @@ uint LayerDefinition::addLayer(string name, uint minzoom, uint maxzoom,
 		const std::string &writeTo)  {
 
 	bool isWriteTo = !writeTo.empty();
-	LayerDef layer = { name, minzoom, maxzoom, simplifyBelow, simplifyLevel, simplifyLength, simplifyRatio, 
-		filterBelow, filterArea, combinePolygonsBelow, sortZOrderAscending, featureLimit, featureLimitBelow,
+	LayerDef layer = { name, minzoom, maxzoom, simplifyBelow, simplifyLevel, simplifyLength, simplifyRatio, simplifyFast,
+		filterBelow, filterArea, combinePolygonsBelow, aggregateBelow, aggregateResolution,
+		sortZOrderAscending, featureLimit, featureLimitBelow,
 		source, sourceColumns, allSourceColumns, indexed, indexName,
 		std::map<std::string,uint>(), isWriteTo };
 	layers.push_back(layer);
@@ -61,6 +106,12 @@ std::vector<bool> LayerDefinition::getSortOrders() {
 	return orders;
 }
 
+std::vector<uint> LayerDefinition::getFeatureLimits(uint zoom) const {
+	std::vector<uint> limits;
+	for (auto &layer : layers) { limits.emplace_back(zoom < layer.featureLimitBelow ? layer.featureLimit : 0); }
+	return limits;
+}
+
 Value LayerDefinition::serialiseToJSONValue(rapidjson::Document::AllocatorType &allocator) const {
 	Value layerArray(kArrayType);
 	for (auto it = layers.begin(); it != layers.end(); ++it) {
@@ -107,7 +158,7 @@ std::string LayerDefinition::serialiseToJSON() const {
 
 Config::Config() {
 	includeID = false, compress = true, gzip = true, highResolution = false;
-	clippingBoxFromJSON = false;
+	compression = CompressionType::Gzip;
 	baseZoom = 0;
 	combineBelow = 0;
 }
@@ -123,6 +174,13 @@ void Config::enlargeBbox(double cMinLon, double cMaxLon, double cMinLat, double
 	maxLat = std::max(maxLat, cMaxLat);
 }
 
+// ----	Compression level to use at a given zoom (-1 for the codec's default)
+
+int Config::compressLevelAt(uint zoom) const {
+	if (compressLevels.empty()) return -1;
+	return compressLevels[std::min<size_t>(zoom, compressLevels.size()-1)];
+}
+
 // ----	Read all config details from JSON file
 
 void Config::readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, Box &clippingBox)  {
@@ -132,7 +190,7 @@ void Config::readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, B
 	includeID      = jsonConfig["settings"]["include_ids"].GetBool();
 	highResolution = jsonConfig["settings"].HasMember("high_resolution") && jsonConfig["settings"]["high_resolution"].GetBool();
 	if (! jsonConfig["settings"]["compress"].IsString()) {
-		cerr << "\"compress\" should be any of \"gzip\",\"deflate\",\"none\" in JSON file." << endl;
+		cerr << "\"compress\" should be any of \"gzip\",\"deflate\",\"zstd\",\"none\" in JSON file." << endl;
 		exit (EXIT_FAILURE);
 	}
 	if (endZoom>15) {
@@ -150,13 +208,23 @@ void Config::readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, B
 #endif
 
 	compressOpt    = jsonConfig["settings"]["compress"].GetString();
+	if (jsonConfig["settings"].HasMember("compress_level")) {
+		const rapidjson::Value &level = jsonConfig["settings"]["compress_level"];
+		if (level.IsArray()) {
+			for (uint i=0; i<level.Size(); i++) compressLevels.push_back(level[i].GetInt());
+		} else if (level.IsInt()) {
+			compressLevels.push_back(level.GetInt());
+		} else {
+			cerr << "\"compress_level\" should be a number, or an array of numbers by zoom, in JSON file." << endl;
+			exit (EXIT_FAILURE);
+		}
+	}
 	combineBelow   = jsonConfig["settings"].HasMember("combine_below") ? jsonConfig["settings"]["combine_below"].GetUint() : 0;
 	mvtVersion     = jsonConfig["settings"].HasMember("mvt_version") ? jsonConfig["settings"]["mvt_version"].GetUint() : 2;
 	projectName    = jsonConfig["settings"]["name"].GetString();
 	projectVersion = jsonConfig["settings"]["version"].GetString();
 	projectDesc    = jsonConfig["settings"]["description"].GetString();
 	if (jsonConfig["settings"].HasMember("bounding_box")) {
-		clippingBoxFromJSON = true;
 		hasClippingBox = true;
 		minLon = jsonConfig["settings"]["bounding_box"][0].GetDouble();
 		minLat = jsonConfig["settings"]["bounding_box"][1].GetDouble();
@@ -179,11 +247,11 @@ void Config::readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, B
 	// Check config is valid
 	if (endZoom > baseZoom) { cerr << "maxzoom must be the same or smaller than basezoom." << endl; exit (EXIT_FAILURE); }
 	if (! compressOpt.empty()) {
-		if      (compressOpt == "gzip"   ) { gzip = true;  }
-		else if (compressOpt == "deflate") { gzip = false; }
-		else if (compressOpt == "none"   ) { compress = false; }
-		else {
-			cerr << "\"compress\" should be any of \"gzip\",\"deflate\",\"none\" in JSON file." << endl;
+		if (parseCompressionType(compressOpt, compression)) {
+			compress = compression != CompressionType::None;
+			gzip = compression == CompressionType::Gzip;
+		} else {
+			cerr << "\"compress\" should be any of \"gzip\",\"deflate\",\"zstd\",\"none\" in JSON file." << endl;
 			exit (EXIT_FAILURE);
 		}
 	}
@@ -201,9 +269,20 @@ void Config::readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, B
 		double simplifyLevel  = it->value.HasMember("simplify_level" ) ? it->value["simplify_level" ].GetDouble() : 0.01;
 		double simplifyLength = it->value.HasMember("simplify_length") ? it->value["simplify_length"].GetDouble() : 0.0;
 		double simplifyRatio  = it->value.HasMember("simplify_ratio" ) ? it->value["simplify_ratio" ].GetDouble() : 2.0;
+		string simplifyAlgorithm = it->value.HasMember("simplify_algorithm") ? it->value["simplify_algorithm"].GetString() : "topology";
+		if (simplifyAlgorithm != "topology" && simplifyAlgorithm != "fast") {
+			cerr << "\"simplify_algorithm\" should be \"topology\" or \"fast\" in JSON file." << endl;
+			exit (EXIT_FAILURE);
+		}
 		int    filterBelow    = it->value.HasMember("filter_below"   ) ? it->value["filter_below"   ].GetInt()    : 0;
 		double filterArea     = it->value.HasMember("filter_area"    ) ? it->value["filter_area"    ].GetDouble() : 0.5;
 		int    combinePolyBelow=it->value.HasMember("combine_polygons_below") ? it->value["combine_polygons_below"].GetInt() : 0;
+		int    aggregateBelow = it->value.HasMember("aggregate_below") ? it->value["aggregate_below"].GetInt()    : 0;
+		int aggregateResolution=it->value.HasMember("aggregate_resolution") ? it->value["aggregate_resolution"].GetInt() : 256;
+		if (aggregateResolution < 1 || aggregateResolution > 4096) {
+			cerr << "\"aggregate_resolution\" should be from 1 to 4096 in JSON file." << endl;
+			exit (EXIT_FAILURE);
+		}
 		int    featureLimit   = it->value.HasMember("feature_limit"  ) ? it->value["feature_limit"  ].GetInt()    : 0;
 		int  featureLimitBelow= it->value.HasMember("feature_limit_below") ? it->value["feature_limit_below"].GetInt() : (maxZoom+1);
 		bool sortZOrderAscending = it->value.HasMember("z_order_ascending") ? it->value["z_order_ascending"].GetBool() : (featureLimit==0);
@@ -225,8 +304,9 @@ void Config::readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, B
 		string indexName = it->value.HasMember("index_column") ? it->value["index_column"].GetString() : "";
 
 		layers.addLayer(layerName, minZoom, maxZoom,
-				simplifyBelow, simplifyLevel, simplifyLength, simplifyRatio, 
-				filterBelow, filterArea, combinePolyBelow, sortZOrderAscending, featureLimit, featureLimitBelow,
+				simplifyBelow, simplifyLevel, simplifyLength, simplifyRatio, simplifyAlgorithm == "fast",
+				filterBelow, filterArea, combinePolyBelow, aggregateBelow, aggregateResolution,
+				sortZOrderAscending, featureLimit, featureLimitBelow,
 				source, sourceColumns, allSourceColumns, indexed, indexName,
 				writeTo);
 
@@ -234,5 +314,11 @@ void Config::readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, B
 		if (it->value.HasMember("write_to")) { cout << " -> " << it->value["write_to"].GetString(); }
 		cout << endl;
 	}
+
+	// Rules, which need the layers to be read first
+	if (jsonConfig.HasMember("rules")) {
+		rules.read(jsonConfig["rules"], layers);
+		cout << rules.rules.size() << " rules read from JSON file" << endl;
+	}
 }
 
@@ -1,13 +1,93 @@
 #include "shp_mem_tiles.h"
+#include "source_cache.h"
 #include <iostream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
 using namespace std;
 namespace geom = boost::geometry;
 extern bool verbose;
 
 ShpMemTiles::ShpMemTiles(size_t threadNum, uint baseZoom)
-	: TileDataSource(threadNum, baseZoom, false)
+	: TileDataSource(threadNum, baseZoom, false),
+	  queryCache(SHP_QUERY_CACHE_THREADS, SHP_QUERY_CACHE_BYTES)
 { }
 
+std::shared_ptr<const MultiPolygon> ShpMemTiles::queryMultiPolygon(NodeID objectID) const {
+	std::shared_ptr<const MultiPolygon> mp = queryCache.get(objectID);
+	if (mp) return mp;
+	std::shared_ptr<MultiPolygon> built = std::make_shared<MultiPolygon>();
+	retrieveMultiPolygon(objectID, *built);
+	queryCache.add(objectID, built);
+	return built;
+}
+
+static uint64_t gridCell(uint32_t x, uint32_t y) { return (uint64_t(x) << 32) | y; }
+static uint32_t clampTile(uint32_t t) { return std::min(t, (1u << SHP_GRID_ZOOM) - 1); }
+
+static Box gridCellBox(uint32_t x, uint32_t y) {
+	return Box(geom::make<Point>(tilex2lon(x, SHP_GRID_ZOOM), tiley2latp(y+1, SHP_GRID_ZOOM)),
+	           geom::make<Point>(tilex2lon(x+1, SHP_GRID_ZOOM), tiley2latp(y, SHP_GRID_ZOOM)));
+}
+
+// Clip each indexed polygon to the grid cells its bounding box touches. Lua's
+// spatial queries are mostly for small OSM objects, which then only need
+// testing against the few small pieces in their cell, and are answered with
+// no geometry test at all when a piece covers the whole cell.
+void ShpMemTiles::BuildGridIndices(unsigned int threadNum) {
+	for (auto &index : indices) {
+		vector<IndexValue> values(index.second.begin(), index.second.end());
+		bool allPolygons = !values.empty();
+		for (const auto &value : values) {
+			if (indexedGeometries.at(value.second).geomType != POLYGON_) { allPolygons = false; break; }
+		}
+		if (!allPolygons) continue;
+
+		Grid &grid = grids[index.first];
+		mutex gridMutex;
+		atomic<size_t> next(0);
+		auto worker = [&]() {
+			Grid local;
+			for (size_t i = next++; i < values.size(); i = next++) {
+				const Box &box = values[i].first;
+				uint id = values[i].second;
+				const MultiPolygon mp = retrieveMultiPolygon(indexedGeometries[id].objectID);
+				uint32_t minX = clampTile(lon2tilex(box.min_corner().x(), SHP_GRID_ZOOM));
+				uint32_t maxX = clampTile(lon2tilex(box.max_corner().x(), SHP_GRID_ZOOM));
+				uint32_t minY = clampTile(latp2tiley(box.max_corner().y(), SHP_GRID_ZOOM));
+				uint32_t maxY = clampTile(latp2tiley(box.min_corner().y(), SHP_GRID_ZOOM));
+				for (uint32_t x = minX; x <= maxX; x++) {
+					for (uint32_t y = minY; y <= maxY; y++) {
+						Box cellBox = gridCellBox(x, y);
+						GridPiece piece { id, false, Box(), MultiPolygon() };
+						geom::intersection(mp, cellBox, piece.piece);
+						if (piece.piece.empty()) continue;
+						geom::envelope(piece.piece, piece.box);
+						piece.coversCell = piece.piece.size() == 1 && piece.piece[0].inners().empty() &&
+						                   geom::area(piece.piece) >= geom::area(cellBox) * (1 - 1e-9);
+						local[gridCell(x, y)].push_back(std::move(piece));
+					}
+				}
+			}
+			lock_guard<mutex> lock(gridMutex);
+			for (auto &cell : local) {
+				auto &pieces = grid[cell.first];
+				for (auto &piece : cell.second) pieces.push_back(std::move(piece));
+			}
+		};
+		vector<thread> threads;
+		for (unsigned int t = 0; t < std::max(1u, threadNum); t++) threads.emplace_back(worker);
+		for (auto &t : threads) t.join();
+
+		// Pieces in the order the geometries were stored, as the index would find them
+		for (auto &cell : grid) {
+			sort(cell.second.begin(), cell.second.end(), [](const GridPiece &a, const GridPiece &b) { return a.id < b.id; });
+		}
+		if (verbose) cout << "Indexed layer " << index.first << " split into " << grid.size() << " grid cells" << endl;
+	}
+}
+
 // Look for shapefile objects that fulfil a spatial query (e.g. intersects)
 // Parameters:
 // - shapefile layer name to search
@@ -19,7 +99,8 @@ vector<uint> ShpMemTiles::QueryMatchingGeometries(
 	bool once,
 	Box& box,
 	function<vector<IndexValue>(const RTree &rtree)> indexQuery,
-	function<bool(const OutputObject& oo)> checkQuery
+	function<bool(const OutputObject& oo)> checkQuery,
+	function<bool(const MultiPolygon& piece, bool coversCell)> pieceQuery
 ) const {
 	
 	// Find the layer
@@ -28,6 +109,32 @@ vector<uint> ShpMemTiles::QueryMatchingGeometries(
 		if (verbose) cerr << "Couldn't find indexed layer " << layerName << endl;
 		return vector<uint>();	// empty, relations not supported
 	}
+
+	// A box inside one grid cell only needs that cell's pieces. Successive
+	// objects tend to fall in the same cell, so each thread remembers the last one.
+	auto g = grids.find(layerName);
+	if (g != grids.end()) {
+		uint32_t x = clampTile(lon2tilex(box.min_corner().x(), SHP_GRID_ZOOM));
+		uint32_t y = clampTile(latp2tiley(box.max_corner().y(), SHP_GRID_ZOOM));
+		if (x == clampTile(lon2tilex(box.max_corner().x(), SHP_GRID_ZOOM)) &&
+		    y == clampTile(latp2tiley(box.min_corner().y(), SHP_GRID_ZOOM))) {
+			struct LastCell { const Grid *grid = nullptr; uint64_t cell; const vector<GridPiece> *pieces; };
+			thread_local LastCell last;
+			uint64_t cell = gridCell(x, y);
+			if (last.grid != &g->second || last.cell != cell) {
+				auto c = g->second.find(cell);
+				last = { &g->second, cell, c == g->second.end() ? nullptr : &c->second };
+			}
+
+			vector<uint> ids;
+			if (!last.pieces) return ids;
+			for (const GridPiece &piece : *last.pieces) {
+				if (!geom::intersects(box, piece.box)) continue;
+				if (pieceQuery(piece.piece, piece.coversCell)) { ids.push_back(piece.id); if (once) break; }
+			}
+			return ids;
+		}
+	}
 	
 	// Run the index query
 	vector<IndexValue> results = indexQuery(f->second);
@@ -55,6 +162,11 @@ void ShpMemTiles::CreateNamedLayerIndex(const std::string& layerName) {
 	indices[layerName]=RTree();
 }
 
+void ShpMemTiles::SetLayerCache(uint layerNum, SourceCache *cache) {
+	if (layerCaches.size() <= layerNum) layerCaches.resize(layerNum + 1, nullptr);
+	layerCaches[layerNum] = cache;
+}
+
 void ShpMemTiles::StoreShapefileGeometry(
 	uint_least8_t layerNum,
 	const std::string& layerName,
@@ -66,16 +178,21 @@ void ShpMemTiles::StoreShapefileGeometry(
 	uint minzoom,
 	AttributeIndex attrIdx
 ) {
+	if (layerNum < layerCaches.size() && layerCaches[layerNum])
+		layerCaches[layerNum]->record(geomType, geometry, hasName, name, minzoom, attrIdx);
 
 	geom::model::box<Point> box;
 	geom::envelope(geometry, box);
 
-	uint id = indexedGeometries.size();
-	if (isIndexed) {
+	auto addToIndex = [&](const OutputObject &oo) {
+		if (!isIndexed) return;
+		std::lock_guard<std::mutex> lock(indexMutex);
+		uint id = indexedGeometries.size();
+		indexedGeometries.push_back(oo);
 		indices.at(layerName).insert(std::make_pair(box, id));
 		if (hasName)
 			indexedGeometryNames[id] = name;
-	}
+	};
 
 	uint tilex = 0, tiley = 0;
 	switch(geomType) {
@@ -87,7 +204,7 @@ void ShpMemTiles::StoreShapefileGeometry(
 				Point sp(p->x()*10000000.0, p->y()*10000000.0);
 				NodeID oid = storePoint(sp);
 				OutputObject oo(geomType, layerNum, oid, attrIdx, minzoom);
-				if (isIndexed) indexedGeometries.push_back(oo);
+				addToIndex(oo);
 
 				tilex =  lon2tilex(p->x(), baseZoom);
 				tiley = latp2tiley(p->y(), baseZoom);
@@ -99,7 +216,7 @@ void ShpMemTiles::StoreShapefileGeometry(
 		{
 			NodeID oid = storeLinestring(boost::get<Linestring>(geometry));
 			OutputObject oo(geomType, layerNum, oid, attrIdx, minzoom);
-			if (isIndexed) indexedGeometries.push_back(oo);
+			addToIndex(oo);
 
 			std::vector<OutputObject> oolist { oo };
 			addGeometryToIndex(boost::get<Linestring>(geometry), oolist, 0);
@@ -110,7 +227,7 @@ void ShpMemTiles::StoreShapefileGeometry(
 		{
 			NodeID oid = storeMultiPolygon(boost::get<MultiPolygon>(geometry));
 			OutputObject oo(geomType, layerNum, oid, attrIdx, minzoom);
-			if (isIndexed) indexedGeometries.push_back(oo);
+			addToIndex(oo);
 
 			std::vector<OutputObject> oolist { oo };
 			addGeometryToIndex(boost::get<MultiPolygon>(geometry), oolist, 0);
@@ -0,0 +1,203 @@
+#include "snapshot.h"
+#include "tile_data.h"
+#include "attribute_store.h"
+#include "shared_data.h"
+#include "store_file.h"
+#include <iostream>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/filesystem.hpp>
+
+using namespace std;
+namespace bi = boost::interprocess;
+
+#define SNAPSHOT_VERSION 4
+// Written in this machine's byte order, so that it reads differently on another
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+
+namespace {
+	struct SnapshotHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t byteOrder;
+		uint64_t layout;		// sizes of what's used in place; see snapshotLayout
+		uint64_t signature;
+		uint64_t length;		// of the whole file, to spot truncation
+		uint64_t checksum;		// of everything after the header
+	};
+
+	const char snapshotMagic[8] = { 'T','M','S','N','A','P','\0','\0' };
+
+	// FNV-1a
+	void hashBytes(uint64_t &hash, const void *data, size_t length) {
+		const char *bytes = static_cast<const char*>(data);
+		for (size_t i = 0; i < length; i++) {
+			hash ^= static_cast<uint8_t>(bytes[i]);
+			hash *= 1099511628211ull;
+		}
+	}
+	template<typename T> void hashValue(uint64_t &hash, T value) { hashBytes(hash, &value, sizeof(value)); }
+
+	// Objects and geometries are used straight from the mapping, so a snapshot
+	// can only be read by a build that lays them out the same way
+	uint64_t snapshotLayout() {
+		uint64_t hash = 14695981039346656037ull;
+		hashValue(hash, uint32_t(sizeof(void*)));
+		hashValue(hash, uint32_t(sizeof(size_t)));
+		hashValue(hash, uint32_t(sizeof(OutputObject)));
+		hashValue(hash, uint32_t(sizeof(OutputObjectID)));
+		hashValue(hash, uint32_t(sizeof(AttributePair)));
+		hashValue(hash, uint32_t(sizeof(LatpLon)));
+		hashValue(hash, uint32_t(sizeof(NodeID)));
+		hashValue(hash, uint32_t(sizeof(TileCoordinates)));
+		return hash;
+	}
+}
+
+// ---- Snapshot
+
+Snapshot::Snapshot() { }
+
+Snapshot::~Snapshot() { }
+
+uint64_t Snapshot::signature(const vector<string> &inputFiles, const vector<string> &luaFiles,
+                             const Config &config, const Box &clippingBox, bool compressNodes, bool compressWays) {
+	uint64_t hash = 14695981039346656037ull;
+	for (const string &file : inputFiles) hashValue(hash, StoreFile::signature(file));
+	for (const string &luaFile : luaFiles) {
+		hashBytes(hash, luaFile.data(), luaFile.size());
+		hashValue(hash, StoreFile::signature(luaFile));
+	}
+	for (const LayerDef &layer : config.layers.layers)
+		if (!layer.source.empty() && boost::filesystem::exists(layer.source)) hashValue(hash, StoreFile::signature(layer.source));
+	hashValue(hash, config.baseZoom);
+	hashValue(hash, config.includeID);
+	hashValue(hash, clippingBox.min_corner().x()); hashValue(hash, clippingBox.min_corner().y());
+	hashValue(hash, clippingBox.max_corner().x()); hashValue(hash, clippingBox.max_corner().y());
+	hashValue(hash, compressNodes);
+	hashValue(hash, compressWays);
+	return hash;
+}
+
+bool Snapshot::save(const string &filename, uint64_t signature, const SourceList &sources,
+                    const AttributeStore &attributeStore, const LayerDefinition &layers) {
+	SnapshotWriter out(filename, sizeof(SnapshotHeader));
+	if (!out.good()) {
+		cerr << "Couldn't open " << filename << " to save snapshot" << endl;
+		return false;
+	}
+
+	// Layers, with the attribute types the profile gave them (for the metadata)
+	out.put<uint32_t>(layers.layers.size());
+	for (const LayerDef &layer : layers.layers) {
+		out.putString(layer.name);
+		out.put<uint32_t>(layer.attributeMap.size());
+		for (const auto &it : layer.attributeMap) {
+			out.putString(it.first);
+			out.put<uint32_t>(it.second);
+		}
+	}
+	attributeStore.saveSnapshot(out);
+	out.put<uint32_t>(sources.size());
+	for (const TileDataSource *source : sources) source->saveSnapshot(out);
+
+	SnapshotHeader header;
+	memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.byteOrder = SNAPSHOT_BYTE_ORDER;
+	header.layout = snapshotLayout();
+	header.signature = signature;
+	header.length = out.size();
+	header.checksum = out.checksum();
+	if (!out.finish(&header, sizeof(header))) {
+		cerr << "Couldn't finish writing snapshot to " << filename << endl;
+		remove(filename.c_str());
+		return false;
+	}
+	return true;
+}
+
+std::unique_ptr<Snapshot> Snapshot::open(const string &filename, uint64_t signature) {
+	if (!boost::filesystem::exists(filename)) {
+		cerr << "Couldn't find snapshot " << filename << endl;
+		return nullptr;
+	}
+
+	std::unique_ptr<Snapshot> snapshot(new Snapshot());
+	snapshot->filename = filename;
+	try {
+		bi::file_mapping mapping(filename.c_str(), bi::read_only);
+		snapshot->region.reset(new bi::mapped_region(mapping, bi::read_only));
+	} catch (bi::interprocess_exception &e) {
+		cerr << "Couldn't map " << filename << ": " << e.what() << endl;
+		return nullptr;
+	}
+	const char *base = static_cast<const char*>(snapshot->region->get_address());
+	const size_t size = snapshot->region->get_size();
+
+	SnapshotHeader header;
+	if (size < sizeof(header)) { cerr << filename << " isn't a snapshot" << endl; return nullptr; }
+	memcpy(&header, base, sizeof(header));
+	if (memcmp(header.magic, snapshotMagic, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_VERSION) {
+		cerr << filename << " isn't a compatible snapshot" << endl;
+		return nullptr;
+	}
+	if (header.byteOrder != SNAPSHOT_BYTE_ORDER || header.layout != snapshotLayout()) {
+		cerr << filename << " was made by a tilemaker built for another platform, or with other settings" << endl;
+		return nullptr;
+	}
+	if (header.signature != signature) {
+		cerr << filename << " was made from a different input, profile, base zoom or bounding box" << endl;
+		return nullptr;
+	}
+	if (header.length != size) {
+		cerr << filename << " is truncated" << endl;
+		return nullptr;
+	}
+	SnapshotChecksum checksum;
+	checksum.add(base + sizeof(header), size - sizeof(header));
+	if (checksum.value() != header.checksum) {
+		cerr << filename << " is corrupt" << endl;
+		return nullptr;
+	}
+	return snapshot;
+}
+
+bool Snapshot::load(const SourceList &sources, AttributeStore &attributeStore, LayerDefinition &layers) {
+	const char *base = static_cast<const char*>(region->get_address());
+	const size_t size = region->get_size();
+
+	SnapshotReader in(base, base + sizeof(SnapshotHeader), base + size);
+	try {
+		// The layers must be the same, as objects refer to them by number
+		const uint32_t layerCount = in.get<uint32_t>();
+		vector<string> names;
+		vector<map<string, uint>> attributeMaps(layerCount);
+		for (uint32_t i = 0; i < layerCount; i++) {
+			names.push_back(in.getString());
+			const uint32_t attributeCount = in.get<uint32_t>();
+			for (uint32_t a = 0; a < attributeCount; a++) {
+				string key = in.getString();
+				attributeMaps[i][key] = in.get<uint32_t>();
+			}
+		}
+		bool sameLayers = layerCount == layers.layers.size();
+		for (uint32_t i = 0; sameLayers && i < layerCount; i++) sameLayers = names[i] == layers.layers[i].name;
+		if (!sameLayers) {
+			cerr << filename << " was made with different layers; the config's layers must be the same, in the same order" << endl;
+			return false;
+		}
+		for (uint32_t i = 0; i < layerCount; i++) layers.layers[i].attributeMap = std::move(attributeMaps[i]);
+
+		attributeStore.loadSnapshot(in);
+		if (in.get<uint32_t>() != sources.size()) throw std::runtime_error("snapshot has the wrong number of sources");
+		for (TileDataSource *source : sources) source->loadSnapshot(in);
+	} catch (std::runtime_error &e) {
+		// It matched its checksum, so this tilemaker wrote something it can't
+		// read back; and the stores have been partly filled, so we can't go on
+		cerr << filename << " couldn't be read back (" << e.what() << "); delete it and run again" << endl;
+		exit(EXIT_FAILURE);
+	}
+	cout << "Loaded snapshot " << filename << endl;
+	return true;
+}
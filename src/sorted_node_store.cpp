@@ -5,11 +5,20 @@
 #include <atomic>
 #include <map>
 #include <bitset>
+#include <thread>
+#include <mutex>
+#include <exception>
 #include "sorted_node_store.h"
 #include "external/libpopcnt.h"
 #include "external/streamvbyte.h"
 #include "external/streamvbyte_zigzag.h"
 
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH(ptr) __builtin_prefetch(ptr)
+#else
+#define PREFETCH(ptr)
+#endif
+
 namespace SortedNodeStoreTypes {
 	const uint16_t GroupSize = 256;
 	const uint16_t ChunkSize = 256;
@@ -34,10 +43,28 @@ namespace SortedNodeStoreTypes {
 	thread_local bool collectingOrphans = true;
 	thread_local uint64_t groupStart = -1;
 	thread_local std::vector<NodeStore::element_t>* localNodes = nullptr;
-
-	thread_local int64_t cachedChunk = -1;
-	thread_local std::vector<int32_t> cacheChunkLons;
-	thread_local std::vector<int32_t> cacheChunkLatps;
+	thread_local uint64_t localNodesGeneration = 0;
+	// Each store's generations are drawn from this, so a thread that moves
+	// between stores (mapsplit reads several at once) can't mistake one
+	// store's buffers or chunks for another's
+	std::atomic<uint64_t> nextGeneration(1);
+
+	// Each thread keeps the compressed chunks it decoded most recently,
+	// direct-mapped by chunk number. Way nodes are very local, so most
+	// lookups find their chunk already decoded.
+	const size_t DecodedChunkSlots = 64;
+	struct DecodedChunk {
+		int64_t chunk;
+		int32_t latps[256];
+		int32_t lons[256];
+	};
+	thread_local std::vector<DecodedChunk> decodedChunks;
+	thread_local uint64_t decodedChunksGeneration = 0;
+
+	// Hits are counted per thread, and added to the total at each miss
+	thread_local uint64_t localCacheHits = 0;
+	std::atomic<uint64_t> totalCacheHits;
+	std::atomic<uint64_t> totalCacheMisses;
 
 	thread_local uint32_t arenaSpace = 0;
 	thread_local char* arenaPtr = nullptr;
@@ -45,11 +72,15 @@ namespace SortedNodeStoreTypes {
 
 using namespace SortedNodeStoreTypes;
 
-SortedNodeStore::SortedNodeStore(bool compressNodes): compressNodes(compressNodes) {
+SortedNodeStore::SortedNodeStore(bool compressNodes):
+	compressNodes(compressNodes),
+	workerBuffersGeneration(nextGeneration++),
+	storeGeneration(nextGeneration++) {
 	// Each group can store 64K nodes. If we allocate 256K slots
 	// for groups, we support 2^34 = 17B nodes, or about twice
 	// the number used by OSM as of November 2023.
 	groups.resize(256 * 1024);
+	groupSizes.resize(256 * 1024);
 }
 
 void SortedNodeStore::reopen()
@@ -66,8 +97,13 @@ void SortedNodeStore::reopen()
 	memset(groupSizeFreqs, 0, sizeof(groupSizeFreqs));
 	orphanage.clear();
 	workerBuffers.clear();
+	workerBuffersGeneration = nextGeneration++;
 	groups.clear();
 	groups.resize(256 * 1024);
+	groupSizes.clear();
+	groupSizes.resize(256 * 1024);
+	storeFile.reset();
+	storeGeneration = nextGeneration++;
 }
 
 SortedNodeStore::~SortedNodeStore() {
@@ -75,16 +111,13 @@ SortedNodeStore::~SortedNodeStore() {
 		void_mmap_allocator::deallocate(entry.first, entry.second);
 }
 
-LatpLon SortedNodeStore::at(const NodeID id) const {
+const ChunkInfoBase* SortedNodeStore::findChunk(const NodeID id) const {
 	const size_t groupIndex = id / (GroupSize * ChunkSize);
 	const size_t chunk = (id % (GroupSize * ChunkSize)) / ChunkSize;
 	const uint64_t chunkMaskByte = chunk / 8;
 	const uint64_t chunkMaskBit = chunk % 8;
 
-	const uint64_t nodeMaskByte = (id % ChunkSize) / 8;
-	const uint64_t nodeMaskBit = id % 8;
-
-	GroupInfo* groupPtr = groups[groupIndex];
+	GroupInfo* groupPtr = groupIndex < groups.size() ? groups[groupIndex] : nullptr;
 
 	if (groupPtr == nullptr) {
 		throw std::out_of_range("SortedNodeStore::at(" + std::to_string(id) + ") uses non-existent group " + std::to_string(groupIndex));
@@ -102,59 +135,107 @@ LatpLon SortedNodeStore::at(const NodeID id) const {
 	}
 
 	uint16_t scaledOffset = groupPtr->chunkOffsets[chunkOffset];
-	ChunkInfoBase* basePtr = (ChunkInfoBase*)(((char *)(groupPtr->chunkOffsets + popcnt(groupPtr->chunkMask, 32))) + (scaledOffset * ChunkAlignment));
+	return (ChunkInfoBase*)(((char *)(groupPtr->chunkOffsets + popcnt(groupPtr->chunkMask, 32))) + (scaledOffset * ChunkAlignment));
+}
+
+LatpLon SortedNodeStore::nodeInChunk(const ChunkInfoBase* basePtr, const NodeID id) const {
+	const uint64_t nodeMaskByte = (id % ChunkSize) / 8;
+	const uint64_t nodeMaskBit = id % 8;
+
+	size_t nodeOffset = 0;
+	nodeOffset = popcnt(basePtr->nodeMask, nodeMaskByte);
+	uint8_t maskByte = basePtr->nodeMask[nodeMaskByte];
+	maskByte = maskByte & ((1 << nodeMaskBit) - 1);
+	nodeOffset += popcnt(&maskByte, 1);
+	if (!(basePtr->nodeMask[nodeMaskByte] & (1 << nodeMaskBit)))
+		throw std::out_of_range("SortedNodeStore: node " + std::to_string(id) + " missing, no node");
 
 	if (basePtr->flags & ChunkCompressed) {
-		CompressedChunkInfo* ptr = (CompressedChunkInfo*)basePtr;
+		const CompressedChunkInfo* ptr = (const CompressedChunkInfo*)basePtr;
 		size_t latpSize = (ptr->flags >> 10) & ((1 << 10) - 1);
 		// TODO: we don't actually need the lonSize to decompress the data.
 		//       May as well store it as a sanity check for now.
 		size_t lonSize = ptr->flags & ((1 << 10) - 1);
 		size_t n = popcnt(ptr->nodeMask, 32) - 1;
 
-		const size_t neededChunk = groupIndex * ChunkSize + chunk;
+		const int64_t neededChunk = id / ChunkSize;
 
-		// Really naive caching strategy - just cache the last-used chunk.
-		// Probably good enough?
-		if (cachedChunk != neededChunk) {
-			cachedChunk = neededChunk;
-			cacheChunkLons.reserve(256);
-			cacheChunkLatps.reserve(256);
+		if (decodedChunksGeneration != storeGeneration) {
+			decodedChunks.resize(DecodedChunkSlots);
+			for (auto& decoded : decodedChunks) decoded.chunk = -1;
+			decodedChunksGeneration = storeGeneration;
+		}
+
+		DecodedChunk& decoded = decodedChunks[neededChunk % DecodedChunkSlots];
+		if (decoded.chunk == neededChunk) {
+			localCacheHits++;
+		} else {
+			totalCacheHits += localCacheHits;
+			localCacheHits = 0;
+			totalCacheMisses++;
 
-			uint8_t* latpData = ptr->data;
-			uint8_t* lonData = ptr->data + latpSize;
+			const uint8_t* latpData = ptr->data;
+			const uint8_t* lonData = ptr->data + latpSize;
 			uint32_t recovdata[256] = {0};
 
 			streamvbyte_decode(latpData, recovdata, n);
-			cacheChunkLatps[0] = ptr->firstLatp;
-			zigzag_delta_decode(recovdata, &cacheChunkLatps[1], n, cacheChunkLatps[0]);
+			decoded.latps[0] = ptr->firstLatp;
+			zigzag_delta_decode(recovdata, &decoded.latps[1], n, decoded.latps[0]);
 
 			streamvbyte_decode(lonData, recovdata, n);
-			cacheChunkLons[0] = ptr->firstLon;
-			zigzag_delta_decode(recovdata, &cacheChunkLons[1], n, cacheChunkLons[0]);
+			decoded.lons[0] = ptr->firstLon;
+			zigzag_delta_decode(recovdata, &decoded.lons[1], n, decoded.lons[0]);
+			decoded.chunk = neededChunk;
 		}
 
-		size_t nodeOffset = 0;
-		nodeOffset = popcnt(ptr->nodeMask, nodeMaskByte);
-		uint8_t maskByte = ptr->nodeMask[nodeMaskByte];
-		maskByte = maskByte & ((1 << nodeMaskBit) - 1);
-		nodeOffset += popcnt(&maskByte, 1);
-		if (!(ptr->nodeMask[nodeMaskByte] & (1 << nodeMaskBit)))
-			throw std::out_of_range("SortedNodeStore: node " + std::to_string(id) + " missing, no node");
+		return { decoded.latps[nodeOffset], decoded.lons[nodeOffset] };
+	}
+
+	const UncompressedChunkInfo* ptr = (const UncompressedChunkInfo*)basePtr;
+	return ptr->nodes[nodeOffset];
+}
+
+LatpLon SortedNodeStore::at(const NodeID id) const {
+	return nodeInChunk(findChunk(id), id);
+}
+
+void SortedNodeStore::atBatch(const NodeID* ids, size_t count, LatpLon* out) const {
+	if (count == 0) return;
+
+	// Visit the nodes in ID order, so that each chunk is found and decoded
+	// once, even when a way goes back and forth between chunks
+	thread_local std::vector<uint32_t> order;
+	order.resize(count);
+	for (size_t i = 0; i < count; i++) order[i] = i;
+	if (!std::is_sorted(ids, ids + count))
+		std::sort(order.begin(), order.end(), [ids](uint32_t a, uint32_t b) { return ids[a] < ids[b]; });
+
+	// Find the next chunk while we read this one, so it's already on its way into the cache
+	const ChunkInfoBase* chunk = findChunk(ids[order[0]]);
+	size_t i = 0;
+	while (i < count) {
+		const NodeID chunkId = ids[order[i]] / ChunkSize;
+		size_t end = i + 1;
+		while (end < count && ids[order[end]] / ChunkSize == chunkId) end++;
+
+		const ChunkInfoBase* nextChunk = nullptr;
+		if (end < count) {
+			nextChunk = findChunk(ids[order[end]]);
+			PREFETCH(nextChunk);
+		}
 
-		return { cacheChunkLatps[nodeOffset], cacheChunkLons[nodeOffset] };
+		for (; i < end; i++)
+			out[order[i]] = nodeInChunk(chunk, ids[order[i]]);
+		chunk = nextChunk;
 	}
+}
 
-	UncompressedChunkInfo* ptr = (UncompressedChunkInfo*)basePtr;
-	size_t nodeOffset = 0;
-	nodeOffset = popcnt(ptr->nodeMask, nodeMaskByte);
-	uint8_t maskByte = ptr->nodeMask[nodeMaskByte];
-	maskByte = maskByte & ((1 << nodeMaskBit) - 1);
-	nodeOffset += popcnt(&maskByte, 1);
-	if (!(ptr->nodeMask[nodeMaskByte] & (1 << nodeMaskBit)))
-		throw std::out_of_range("SortedNodeStore: node " + std::to_string(id) + " missing, no node");
+uint64_t SortedNodeStore::chunkCacheHits() const {
+	return totalCacheHits.load();
+}
 
-	return ptr->nodes[nodeOffset];
+uint64_t SortedNodeStore::chunkCacheMisses() const {
+	return totalCacheMisses.load();
 }
 
 size_t SortedNodeStore::size() const {
@@ -184,7 +265,7 @@ size_t SortedNodeStore::size() const {
 }
 
 void SortedNodeStore::insert(const std::vector<element_t>& elements) {
-	if (localNodes == nullptr) {
+	if (localNodes == nullptr || localNodesGeneration != workerBuffersGeneration) {
 		std::lock_guard<std::mutex> lock(orphanageMutex);
 		if (workerBuffers.size() == 0)
 			workerBuffers.reserve(256);
@@ -192,6 +273,7 @@ void SortedNodeStore::insert(const std::vector<element_t>& elements) {
 			throw std::runtime_error("SortedNodeStore doesn't support more than 256 cores");
 		workerBuffers.push_back(std::vector<element_t>());
 		localNodes = &workerBuffers.back();
+		localNodesGeneration = workerBuffersGeneration;
 	}
 
 	if (groupStart == -1) {
@@ -231,7 +313,7 @@ void SortedNodeStore::insert(const std::vector<element_t>& elements) {
 void SortedNodeStore::batchStart() {
 	collectingOrphans = true;
 	groupStart = -1;
-	if (localNodes == nullptr || localNodes->size() == 0)
+	if (localNodes == nullptr || localNodesGeneration != workerBuffersGeneration || localNodes->size() == 0)
 		return;
 
 	collectOrphans(*localNodes);
@@ -245,22 +327,47 @@ void SortedNodeStore::finalize(size_t threadNum) {
 		}
 	}
 	workerBuffers.clear();
-
-	// Empty the orphanage into the index.
-	std::vector<element_t> copy;
-	for (const auto& entry: orphanage) {
-		for (const auto& orphan: entry.second)
-			copy.push_back(orphan);
-
-		// Orphans may come from different workers, and thus be unsorted.
-		std::sort(
-			copy.begin(),
-			copy.end(), 
-			[](auto const &a, auto const &b) { return a.first < b.first; }
-		);
-		publishGroup(copy);
-		copy.clear();
-	}
+	workerBuffersGeneration = nextGeneration++;
+
+	// Empty the orphanage into the index. With small blocks and many threads,
+	// a lot of groups end up here; each is independent of the others, so
+	// publish them in parallel.
+	std::vector<std::vector<element_t>*> orphanGroups;
+	orphanGroups.reserve(orphanage.size());
+	for (auto& entry: orphanage)
+		orphanGroups.push_back(&entry.second);
+
+	std::atomic<size_t> nextGroup(0);
+	// The first error is kept to throw once every publisher has stopped
+	std::exception_ptr error;
+	std::mutex errorMutex;
+	auto publishOrphans = [&]() {
+		for (size_t i = nextGroup++; i < orphanGroups.size(); i = nextGroup++) {
+			std::vector<element_t>& orphans = *orphanGroups[i];
+
+			try {
+				// Orphans may come from different workers, and thus be unsorted.
+				std::sort(
+					orphans.begin(),
+					orphans.end(),
+					[](auto const &a, auto const &b) { return a.first < b.first; }
+				);
+				publishGroup(orphans);
+			} catch (...) {
+				std::lock_guard<std::mutex> lock(errorMutex);
+				if (!error) error = std::current_exception();
+				nextGroup = orphanGroups.size();
+			}
+		}
+	};
+	std::vector<std::thread> publishers;
+	const size_t publisherCount = std::min(threadNum, orphanGroups.size() / 16);
+	for (size_t i = 1; i < publisherCount; i++)
+		publishers.emplace_back(publishOrphans);
+	publishOrphans();
+	for (auto& publisher: publishers)
+		publisher.join();
+	if (error) std::rethrow_exception(error);
 
 	orphanage.clear();
 
@@ -273,6 +380,34 @@ void SortedNodeStore::finalize(size_t threadNum) {
 		*/
 }
 
+bool SortedNodeStore::save(const std::string &filename, uint64_t signature) const {
+	std::vector<StoreFileGroup> saved;
+	for (size_t i = 0; i < groups.size(); i++) {
+		if (groups[i] != nullptr) saved.push_back({ i, groups[i], groupSizes[i] });
+	}
+	return StoreFile::save(filename, STORE_FILE_NODES, signature, groups.size(), totalNodes.load(), saved);
+}
+
+bool SortedNodeStore::load(const std::string &filename, uint64_t signature) {
+	std::unique_ptr<StoreFile> file = StoreFile::load(filename, STORE_FILE_NODES, signature);
+	if (!file) return false;
+
+	reopen();
+	if (groups.size() < file->slotCount) {
+		groups.resize(file->slotCount);
+		groupSizes.resize(file->slotCount);
+	}
+	for (const auto &group : file->groups) {
+		groups[group.index] = (GroupInfo*)group.data;
+		groupSizes[group.index] = group.length;
+	}
+	totalNodes = file->itemCount;
+	totalGroups = file->groups.size();
+	storeFile = std::move(file);
+	std::cout << "SortedNodeStore: loaded " << totalGroups << " groups, " << totalNodes.load() << " nodes from " << filename << std::endl;
+	return true;
+}
+
 void SortedNodeStore::collectOrphans(const std::vector<element_t>& orphans) {
 	std::lock_guard<std::mutex> lock(orphanageMutex);
 	size_t groupIndex = orphans[0].first / (GroupSize * ChunkSize);
@@ -430,6 +565,7 @@ void SortedNodeStore::publishGroup(const std::vector<element_t>& nodes) {
 	if (groups[groupIndex] != nullptr)
 		throw std::runtime_error("SortedNodeStore: group already present");
 	groups[groupIndex] = groupInfo;
+	groupSizes[groupIndex] = groupSpace;
 
 	lastChunk = -1;
 	uint8_t chunkMask[32], nodeMask[32];
@@ -6,6 +6,9 @@
 #include "external/libpopcnt.h"
 #include "external/streamvbyte.h"
 #include "external/streamvbyte_zigzag.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "sorted_way_store.h"
 #include "node_store.h"
 
@@ -18,10 +21,14 @@ namespace SortedWayStoreTypes {
 	const uint16_t CompressedWay = 1 << 15;
 	const uint16_t ClosedWay = 1 << 14;
 	const uint16_t UniformUpperBits = 1 << 13;
+	const uint16_t LatpLonWay = 1 << 12;
 
 	thread_local bool collectingOrphans = true;
 	thread_local uint64_t groupStart = -1;
 	thread_local std::vector<std::pair<WayID, std::vector<NodeID>>>* localWays = NULL;
+	thread_local uint64_t localWaysGeneration = 0;
+	// Each store's generations are drawn from this, as for SortedNodeStore
+	std::atomic<uint64_t> nextGeneration(1);
 
 	thread_local std::vector<uint8_t> encodedWay;
 
@@ -32,22 +39,63 @@ namespace SortedWayStoreTypes {
 	thread_local uint64_t highBytes[2000];
 	thread_local uint32_t uint32Buffer[2000];
 	thread_local int32_t int32Buffer[2000];
-	thread_local uint8_t uint8Buffer[8192];
+	// Room for 2,000 values at up to 4 bytes each, plus their control bytes
+	thread_local uint8_t uint8Buffer[8704];
+	thread_local std::vector<LatpLon> latpLonBuffer;
+	thread_local std::vector<NodeID> nodeIDBuffer;
 
 	std::atomic<uint64_t> totalWays;
 	std::atomic<uint64_t> totalNodes;
 	std::atomic<uint64_t> totalGroups;
 	std::atomic<uint64_t> totalGroupSpace;
 	std::atomic<uint64_t> totalChunks;
+
+	inline NodeID packLatpLon(LatpLon ll) {
+		return (uint64_t(uint32_t(ll.latp)) << 32) | uint32_t(ll.lon);
+	}
+	inline LatpLon unpackLatpLon(NodeID packed) {
+		return { int32_t(uint32_t(packed >> 32)), int32_t(uint32_t(packed)) };
+	}
 }
 
 using namespace SortedWayStoreTypes;
 
-SortedWayStore::SortedWayStore(bool compressWays, const NodeStore& nodeStore): compressWays(compressWays), nodeStore(nodeStore) {
+// Undo zigzag_delta_encode, four values at a time where SSE2 is available:
+// each group is unzigzagged, summed along the register, and offset by the
+// last value of the group before.
+static void zigzagDeltaDecode(const uint32_t* in, int32_t* out, size_t n, int32_t prev) {
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i one = _mm_set1_epi32(1);
+	__m128i running = _mm_set1_epi32(prev);
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+		v = _mm_xor_si128(_mm_srli_epi32(v, 1), _mm_sub_epi32(_mm_setzero_si128(), _mm_and_si128(v, one)));
+		v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+		v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+		v = _mm_add_epi32(v, running);
+		_mm_storeu_si128((__m128i*)(out + i), v);
+		running = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3));
+	}
+	if (i > 0) prev = out[i - 1];
+#endif
+	uint32_t value = prev;
+	for (; i < n; i++) {
+		value += (in[i] >> 1) ^ (0 - (in[i] & 1));
+		out[i] = value;
+	}
+}
+
+SortedWayStore::SortedWayStore(bool compressWays, const NodeStore& nodeStore): SortedWayStore(compressWays) {
+	this->nodeStore = &nodeStore;
+}
+
+SortedWayStore::SortedWayStore(bool compressWays): compressWays(compressWays), nodeStore(nullptr), workerBuffersGeneration(nextGeneration++) {
 	// Each group can store 64K ways. If we allocate 32K slots,
 	// we support 2^31 = 2B ways, or about twice the number used
 	// by OSM as of December 2023.
 	groups.resize(32 * 1024);
+	groupSizes.resize(32 * 1024);
 }
 
 SortedWayStore::~SortedWayStore() {
@@ -67,12 +115,33 @@ void SortedWayStore::reopen() {
 	totalChunks = 0;
 	orphanage.clear();
 	workerBuffers.clear();
+	workerBuffersGeneration = nextGeneration++;
 	groups.clear();
 	groups.resize(256 * 1024);
-
+	groupSizes.clear();
+	groupSizes.resize(256 * 1024);
+	storeFile.reset();
 }
 
 std::vector<LatpLon> SortedWayStore::at(WayID id) const {
+	std::vector<LatpLon> rv;
+	at(id, rv);
+	return rv;
+}
+
+// Decodes into out, and the node IDs into a buffer kept by each thread, so
+// callers that reuse out make no allocations once their buffers have grown
+void SortedWayStore::at(WayID id, std::vector<LatpLon> &out) const {
+	const EncodedWay* wayPtr = findWay(id);
+	if (wayPtr->flags & LatpLonWay)
+		return SortedWayStore::decodeLatpLons(wayPtr->flags, wayPtr->data, out);
+
+	SortedWayStore::decodeWay(wayPtr->flags, wayPtr->data, nodeIDBuffer);
+	out.resize(nodeIDBuffer.size());
+	nodeStore->atBatch(nodeIDBuffer.data(), nodeIDBuffer.size(), out.data());
+}
+
+const EncodedWay* SortedWayStore::findWay(WayID id) const {
 	const size_t groupIndex = id / (GroupSize * ChunkSize);
 	const size_t chunk = (id % (GroupSize * ChunkSize)) / ChunkSize;
 	const uint64_t chunkMaskByte = chunk / 8;
@@ -129,24 +198,38 @@ std::vector<LatpLon> SortedWayStore::at(WayID id) const {
 		wayPtr = (EncodedWay*)(endOfWayOffsetPtr + chunkPtr->wayOffsets[wayOffset] * LargeWayAlignment);
 	}
 
-	std::vector<NodeID> nodes = SortedWayStore::decodeWay(wayPtr->flags, wayPtr->data);
-	std::vector<LatpLon> rv;
-	for (const NodeID& node : nodes)
-		rv.push_back(nodeStore.at(node));
-	return rv;
+	return wayPtr;
 }
 
 void SortedWayStore::insertLatpLons(std::vector<WayStore::ll_element_t> &newWays) {
-	throw std::runtime_error("SortedWayStore does not support insertLatpLons");
+	if (nodeStore != nullptr)
+		throw std::runtime_error("SortedWayStore stores node IDs, so does not support insertLatpLons");
+
+	std::vector<std::pair<WayID, std::vector<NodeID>>> packed;
+	packed.reserve(newWays.size());
+	for (const auto& way : newWays) {
+		std::vector<NodeID> lls;
+		lls.reserve(way.second.size());
+		for (const LatpLon& ll : way.second)
+			lls.push_back(packLatpLon(ll));
+		packed.push_back(std::make_pair(way.first, std::move(lls)));
+	}
+	insertWays(packed);
 }
 
 const void SortedWayStore::insertNodes(const std::vector<std::pair<WayID, std::vector<NodeID>>>& newWays) {
+	if (nodeStore == nullptr)
+		throw std::runtime_error("SortedWayStore stores coordinates, so does not support insertNodes");
+	insertWays(newWays);
+}
+
+void SortedWayStore::insertWays(const std::vector<std::pair<WayID, std::vector<NodeID>>>& newWays) {
 	// read_pbf can call with an empty array if the only ways it read were unable to
 	// be processed due to missing nodes, so be robust against empty way vector.
 	if (newWays.empty())
 		return;
 
-	if (localWays == nullptr) {
+	if (localWays == nullptr || localWaysGeneration != workerBuffersGeneration) {
 		std::lock_guard<std::mutex> lock(orphanageMutex);
 		if (workerBuffers.size() == 0)
 			workerBuffers.reserve(256);
@@ -154,6 +237,7 @@ const void SortedWayStore::insertNodes(const std::vector<std::pair<WayID, std::v
 			throw std::runtime_error("SortedWayStore doesn't support more than 256 cores");
 		workerBuffers.push_back(std::vector<std::pair<WayID, std::vector<NodeID>>>());
 		localWays = &workerBuffers.back();
+		localWaysGeneration = workerBuffersGeneration;
 	}
 
 	if (groupStart == -1) {
@@ -206,6 +290,7 @@ void SortedWayStore::finalize(unsigned int threadNum) {
 		}
 	}
 	workerBuffers.clear();
+	workerBuffersGeneration = nextGeneration++;
 
 	// Empty the orphanage into the index.
 	std::vector<std::pair<WayID, std::vector<NodeID>>> copy;
@@ -228,10 +313,38 @@ void SortedWayStore::finalize(unsigned int threadNum) {
 	std::cout << "SortedWayStore: " << totalGroups << " groups, " << totalChunks << " chunks, " << totalWays.load() << " ways, " << totalNodes.load() << " nodes, " << totalGroupSpace.load() << " bytes" << std::endl;
 }
 
+bool SortedWayStore::save(const std::string &filename, uint64_t signature) const {
+	std::vector<StoreFileGroup> saved;
+	for (size_t i = 0; i < groups.size(); i++) {
+		if (groups[i] != nullptr) saved.push_back({ i, groups[i], groupSizes[i] });
+	}
+	return StoreFile::save(filename, STORE_FILE_WAYS, signature, groups.size(), totalWays.load(), saved);
+}
+
+bool SortedWayStore::load(const std::string &filename, uint64_t signature) {
+	std::unique_ptr<StoreFile> file = StoreFile::load(filename, STORE_FILE_WAYS, signature);
+	if (!file) return false;
+
+	reopen();
+	if (groups.size() < file->slotCount) {
+		groups.resize(file->slotCount);
+		groupSizes.resize(file->slotCount);
+	}
+	for (const auto &group : file->groups) {
+		groups[group.index] = (GroupInfo*)group.data;
+		groupSizes[group.index] = group.length;
+	}
+	totalWays = file->itemCount;
+	totalGroups = file->groups.size();
+	storeFile = std::move(file);
+	std::cout << "SortedWayStore: loaded " << totalGroups << " groups, " << totalWays.load() << " ways from " << filename << std::endl;
+	return true;
+}
+
 void SortedWayStore::batchStart() {
 	collectingOrphans = true;
 	groupStart = -1;
-	if (localWays == nullptr || localWays->size() == 0)
+	if (localWays == nullptr || localWaysGeneration != workerBuffersGeneration || localWays->size() == 0)
 		return;
 
 	collectOrphans(*localWays);
@@ -250,58 +363,57 @@ void SortedWayStore::collectOrphans(const std::vector<std::pair<WayID, std::vect
 
 std::vector<NodeID> SortedWayStore::decodeWay(uint16_t flags, const uint8_t* input) {
 	std::vector<NodeID> rv;
+	decodeWay(flags, input, rv);
+	return rv;
+}
 
+void SortedWayStore::decodeWay(uint16_t flags, const uint8_t* input, std::vector<NodeID>& out) {
 	bool isCompressed = flags & CompressedWay;
 	bool isClosed = flags & ClosedWay;
 
 	const uint16_t length = flags & 0b0000011111111111;
+	// No way is encoded without nodes, but the compressed form would read
+	// and write past a node that isn't there
+	if (length == 0) {
+		out.clear();
+		return;
+	}
+	out.resize(length + (isClosed ? 1 : 0));
+	NodeID* rv = out.data();
 
 	if (!(flags & UniformUpperBits)) {
 		// The nodes don't all share the same upper int; unpack which
-		// bits are set on a per-node basis.
-		for (int i = 0; i <= (length - 1) / 2; i++) {
-			uint8_t byte = *input;
-			for (int j = i * 2; j < std::min<int>(length, i * 2 + 2); j++) {
-				uint64_t highByte = 0;
-				highByte |= (byte & 0b00001111);
-				byte = byte >> 4;
-				highBytes[j] = (highByte << 31);
-			}
-			input++;
-		}
+		// bits are set on a per-node basis, two to a byte.
+		for (int i = 0; i < length; i++)
+			rv[i] = uint64_t((input[i / 2] >> (4 * (i % 2))) & 0b00001111) << 31;
+		input += (length + 1) / 2;
 	} else {
-		uint8_t setBits = *(uint8_t*)input;
+		uint64_t highByte = *(uint8_t*)input;
 		input++;
-		uint64_t highByte = setBits;
-		highByte = highByte << 31;
-		for (int i = 0; i < length; i++)
-			highBytes[i] = highByte;
+		std::fill(rv, rv + length, highByte << 31);
 	}
 
 	if (!isCompressed) {
 		// Decode the low ints
 		uint32_t* lowIntData = (uint32_t*)input;
 		for (int i = 0; i < length; i++)
-			rv.push_back(highBytes[i] | lowIntData[i]);
+			rv[i] |= lowIntData[i];
 	} else {
-		uint16_t compressedLength = *(uint16_t*)input;
+		// skip the compressed length
 		input += 2;
 
 		uint32_t firstInt = *(uint32_t*)(input);
 		input += 4;
-		rv.push_back(highBytes[0] | firstInt);
+		rv[0] |= firstInt;
 
 		streamvbyte_decode(input, uint32Buffer, length - 1);
-		zigzag_delta_decode(uint32Buffer, int32Buffer, length - 1, firstInt);
-		for (int i = 1; i < length; i++) {
-			uint32_t tmp = int32Buffer[i - 1];
-			rv.push_back(highBytes[i] | tmp);
-		}
+		zigzagDeltaDecode(uint32Buffer, int32Buffer, length - 1, firstInt);
+		for (int i = 1; i < length; i++)
+			rv[i] |= uint32_t(int32Buffer[i - 1]);
 	}
 
 	if (isClosed)
-		rv.push_back(rv[0]);
-	return rv;
+		rv[length] = rv[0];
 };
 
 uint16_t SortedWayStore::encodeWay(const std::vector<NodeID>& way, std::vector<uint8_t>& output, bool compress) {
@@ -396,6 +508,95 @@ uint16_t SortedWayStore::encodeWay(const std::vector<NodeID>& way, std::vector<u
 	return rv;
 }
 
+std::vector<LatpLon> SortedWayStore::decodeLatpLons(uint16_t flags, const uint8_t* input) {
+	std::vector<LatpLon> rv;
+	decodeLatpLons(flags, input, rv);
+	return rv;
+}
+
+void SortedWayStore::decodeLatpLons(uint16_t flags, const uint8_t* input, std::vector<LatpLon>& out) {
+	const bool isCompressed = flags & CompressedWay;
+	const bool isClosed = flags & ClosedWay;
+	const uint16_t length = flags & 0b0000011111111111;
+	// As for decodeWay
+	if (length == 0) {
+		out.clear();
+		return;
+	}
+
+	out.resize(length + (isClosed ? 1 : 0));
+	LatpLon* rv = out.data();
+	if (!isCompressed) {
+		memcpy(rv, input, length * sizeof(LatpLon));
+	} else {
+		const int32_t firstLatp = *(int32_t*)input;
+		const int32_t firstLon = *(int32_t*)(input + 4);
+		const uint16_t latpLength = *(uint16_t*)(input + 8);
+		input += 10;
+
+		rv[0] = { firstLatp, firstLon };
+		streamvbyte_decode(input, uint32Buffer, length - 1);
+		zigzagDeltaDecode(uint32Buffer, int32Buffer, length - 1, firstLatp);
+		for (int i = 1; i < length; i++)
+			rv[i].latp = int32Buffer[i - 1];
+
+		streamvbyte_decode(input + latpLength, uint32Buffer, length - 1);
+		zigzagDeltaDecode(uint32Buffer, int32Buffer, length - 1, firstLon);
+		for (int i = 1; i < length; i++)
+			rv[i].lon = int32Buffer[i - 1];
+	}
+
+	if (isClosed)
+		rv[length] = rv[0];
+}
+
+uint16_t SortedWayStore::encodeLatpLons(const std::vector<LatpLon>& way, std::vector<uint8_t>& output, bool compress) {
+	if (way.size() == 0)
+		throw std::runtime_error("Cannot encode an empty way");
+
+	if (way.size() > 2000)
+		throw std::runtime_error("Way had more than 2,000 nodes");
+
+	const LatpLon& first = way[0];
+	const LatpLon& last = way[way.size() - 1];
+	bool isClosed = way.size() > 1 && first.latp == last.latp && first.lon == last.lon;
+	output.clear();
+
+	const int max = isClosed ? way.size() - 1 : way.size();
+
+	uint16_t rv = max | LatpLonWay;
+
+	if (isClosed)
+		rv |= ClosedWay;
+
+	if (!compress || max < 2) {
+		output.resize(max * sizeof(LatpLon));
+		memcpy(output.data(), way.data(), max * sizeof(LatpLon));
+		return rv;
+	}
+
+	rv |= CompressedWay;
+	output.resize(10);
+	*(int32_t*)(output.data()) = first.latp;
+	*(int32_t*)(output.data() + 4) = first.lon;
+
+	// Latps, then lons, each as zigzag deltas from the previous point
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 1; i < max; i++)
+			int32Buffer[i - 1] = pass == 0 ? way[i].latp : way[i].lon;
+		zigzag_delta_encode(int32Buffer, uint32Buffer, max - 1, pass == 0 ? first.latp : first.lon);
+		const size_t compressedSize = streamvbyte_encode(uint32Buffer, max - 1, uint8Buffer);
+		if (pass == 0)
+			*(uint16_t*)(output.data() + 8) = compressedSize;
+
+		const size_t oldSize = output.size();
+		output.resize(oldSize + compressedSize);
+		memcpy(output.data() + oldSize, uint8Buffer, compressedSize);
+	}
+
+	return rv;
+}
+
 void populateMask(uint8_t* mask, const std::vector<uint8_t>& ids) {
 	// mask should be a 32-byte array of uint8_t
 	memset(mask, 0, 32);
@@ -451,7 +652,15 @@ void SortedWayStore::publishGroup(const std::vector<std::pair<WayID, std::vector
 		const WayID id = way.first;
 		lastChunk->wayIds.push_back(id % ChunkSize);
 
-		uint16_t flags = encodeWay(way.second, encodedWay, compressWays && way.second.size() >= 4);
+		uint16_t flags;
+		if (nodeStore != nullptr) {
+			flags = encodeWay(way.second, encodedWay, compressWays && way.second.size() >= 4);
+		} else {
+			latpLonBuffer.clear();
+			for (const NodeID packed : way.second)
+				latpLonBuffer.push_back(unpackLatpLon(packed));
+			flags = encodeLatpLons(latpLonBuffer, encodedWay, compressWays && way.second.size() >= 4);
+		}
 		lastChunk->wayFlags.push_back(flags);
 
 		std::vector<uint8_t> encoded;
@@ -511,6 +720,7 @@ void SortedWayStore::publishGroup(const std::vector<std::pair<WayID, std::vector
 	if (groups[groupIndex] != nullptr)
 		throw std::runtime_error("SortedNodeStore: group already present");
 	groups[groupIndex] = groupInfo;
+	groupSizes[groupIndex] = groupSpace;
 
 	// 3. populate the masks and offsets
 	std::vector<uint8_t> chunkIds;
@@ -0,0 +1,353 @@
+#include "source_cache.h"
+#include "shp_mem_tiles.h"
+#include "attribute_store.h"
+#include "shared_data.h"
+#include "store_file.h"
+#include "helpers.h"
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <thread>
+#include <atomic>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/filesystem.hpp>
+
+using namespace std;
+namespace bi = boost::interprocess;
+
+#define SOURCE_CACHE_VERSION 1
+
+// Features each thread adds at a time when loading
+#define FEATURES_PER_RUN 256
+
+namespace {
+	struct SourceCacheHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t reserved;
+		uint64_t signature;
+		uint64_t featureCount;
+		uint64_t layerOffset;		// where the layer's minzoom and attribute types are
+	};
+
+	const char sourceCacheMagic[8] = { 'T','M','S','O','U','R','C','E' };
+
+	// FNV-1a
+	void hashBytes(uint64_t &hash, const void *data, size_t length) {
+		const char *bytes = static_cast<const char*>(data);
+		for (size_t i = 0; i < length; i++) {
+			hash ^= static_cast<uint8_t>(bytes[i]);
+			hash *= 1099511628211ull;
+		}
+	}
+	template<typename T> void hashValue(uint64_t &hash, T value) { hashBytes(hash, &value, sizeof(value)); }
+	void hashString(uint64_t &hash, const string &str) { hashValue(hash, uint64_t(str.size())); hashBytes(hash, str.data(), str.size()); }
+
+	// Appends fixed-size values and length-prefixed strings to a record
+	struct RecordWriter {
+		string &buffer;
+		template<typename T> void put(T value) { buffer.append(reinterpret_cast<const char*>(&value), sizeof(value)); }
+		void putString(boost::string_view str) { put<uint32_t>(str.size()); buffer.append(str.data(), str.size()); }
+		void putPoints(const vector<Point> &points) {
+			put<uint32_t>(points.size());
+			for (const Point &p : points) { put(p.x()); put(p.y()); }
+		}
+		template<typename RingT> void putRing(const RingT &ring) {
+			put<uint32_t>(ring.size());
+			for (const Point &p : ring) { put(p.x()); put(p.y()); }
+		}
+	};
+
+	// Reads them back, checking against the end of the record
+	struct RecordReader {
+		const char *ptr, *end;
+		template<typename T> T get() {
+			if (size_t(end - ptr) < sizeof(T)) throw runtime_error("record is truncated");
+			T value;
+			memcpy(&value, ptr, sizeof(T));
+			ptr += sizeof(T);
+			return value;
+		}
+		string getString() {
+			uint32_t length = get<uint32_t>();
+			if (size_t(end - ptr) < length) throw runtime_error("record is truncated");
+			string str(ptr, length);
+			ptr += length;
+			return str;
+		}
+		template<typename RingT> void getRing(RingT &ring) {
+			uint32_t count = get<uint32_t>();
+			if (size_t(end - ptr) / (2 * sizeof(double)) < count) throw runtime_error("record is truncated");
+			ring.reserve(count);
+			for (uint32_t i = 0; i < count; i++) {
+				double x = get<double>();
+				ring.push_back(Point(x, get<double>()));
+			}
+		}
+	};
+}
+
+SourceCache::SourceCache(const string &filename, uint64_t signature, AttributeStore &attributeStore):
+	filename(filename), sig(signature), attributeStore(attributeStore), featureCount(0) { }
+
+uint64_t SourceCache::signature(const LayerDef &layer, const Box &clippingBox, uint baseZoom, const vector<string> &luaFiles) {
+	uint64_t hash = 14695981039346656037ull;
+	hashValue(hash, StoreFile::signature(layer.source));
+	// A shapefile's attributes are in its .dbf
+	if (ends_with(layer.source, ".shp")) {
+		string dbf = layer.source.substr(0, layer.source.size() - 4) + ".dbf";
+		if (boost::filesystem::exists(dbf)) hashValue(hash, StoreFile::signature(dbf));
+	}
+	for (const string &luaFile : luaFiles) {
+		hashString(hash, luaFile);
+		hashValue(hash, StoreFile::signature(luaFile));
+	}
+
+	hashString(hash, layer.name);
+	hashValue(hash, layer.minzoom);
+	for (const string &column : layer.sourceColumns) hashString(hash, column);
+	hashValue(hash, layer.allSourceColumns);
+	hashValue(hash, layer.indexed);
+	hashString(hash, layer.indexName);
+	hashValue(hash, clippingBox.min_corner().x()); hashValue(hash, clippingBox.min_corner().y());
+	hashValue(hash, clippingBox.max_corner().x()); hashValue(hash, clippingBox.max_corner().y());
+	hashValue(hash, baseZoom);
+	return hash;
+}
+
+bool SourceCache::load(uint layerNum, LayerDef &layer, ShpMemTiles &shpMemTiles, unsigned int threadNum) {
+	if (!boost::filesystem::exists(filename)) return false;
+
+	unique_ptr<bi::mapped_region> region;
+	try {
+		bi::file_mapping mapping(filename.c_str(), bi::read_only);
+		region.reset(new bi::mapped_region(mapping, bi::read_only));
+	} catch (bi::interprocess_exception &e) {
+		cerr << "Couldn't map " << filename << ": " << e.what() << endl;
+		return false;
+	}
+	const char *base = static_cast<const char*>(region->get_address());
+	const size_t size = region->get_size();
+	if (size < sizeof(SourceCacheHeader)) return false;
+
+	SourceCacheHeader header;
+	memcpy(&header, base, sizeof(header));
+	if (memcmp(header.magic, sourceCacheMagic, sizeof(header.magic)) != 0 || header.version != SOURCE_CACHE_VERSION) {
+		cerr << filename << " isn't a compatible source cache" << endl;
+		return false;
+	}
+	if (header.signature != sig) {
+		cout << filename << " was built from a different source or layer config" << endl;
+		return false;
+	}
+
+	// Find where each record starts, so they can be shared among threads
+	vector<pair<const char*, uint32_t>> records;
+	records.reserve(header.featureCount);
+	const char *ptr = base + sizeof(header);
+	const char *end = base + min<uint64_t>(size, header.layerOffset);
+	for (uint64_t i = 0; i < header.featureCount; i++) {
+		uint32_t length;
+		if (end - ptr < ptrdiff_t(sizeof(length))) break;
+		memcpy(&length, ptr, sizeof(length));
+		ptr += sizeof(length);
+		if (size_t(end - ptr) < length) break;
+		records.emplace_back(ptr, length);
+		ptr += length;
+	}
+	if (records.size() != header.featureCount || header.layerOffset > size) {
+		cerr << filename << " is truncated" << endl;
+		return false;
+	}
+
+	// The layer's attribute types (for the metadata) and minzoom, which attribute_function can change
+	uint layerMinzoom;
+	map<string, uint> attributeMap;
+	try {
+		RecordReader reader { base + header.layerOffset, base + size };
+		layerMinzoom = reader.get<uint32_t>();
+		uint32_t attributeCount = reader.get<uint32_t>();
+		for (uint32_t i = 0; i < attributeCount; i++) {
+			string key = reader.getString();
+			attributeMap[key] = reader.get<uint32_t>();
+		}
+	} catch (std::runtime_error &e) {
+		cerr << filename << " is truncated" << endl;
+		return false;
+	}
+
+	// Each record is read twice: first to check it, as once features have
+	// been stored the source can't be read instead, then to store it
+	auto readRecord = [&](size_t i, bool storing) {
+		RecordReader reader { records[i].first, records[i].first + records[i].second };
+		OutputGeometryType geomType = OutputGeometryType(reader.get<uint8_t>());
+		bool hasName = reader.get<uint8_t>();
+		uint minzoom = reader.get<uint32_t>();
+		string name = reader.getString();
+
+		AttributeSet attributes;
+		uint16_t attributeCount = reader.get<uint16_t>();
+		for (uint16_t a = 0; a < attributeCount; a++) {
+			string key = reader.getString();
+			char attributeMinzoom = reader.get<char>();
+			AttributePairType type = AttributePairType(reader.get<uint8_t>());
+			if (type == AttributePairType::String) {
+				string value = reader.getString();
+				if (storing) attributeStore.addAttribute(attributes, key, value, attributeMinzoom);
+			} else if (type == AttributePairType::Float) {
+				float value = reader.get<float>();
+				if (storing) attributeStore.addAttribute(attributes, key, value, attributeMinzoom);
+			} else if (type == AttributePairType::True || type == AttributePairType::False) {
+				if (storing) attributeStore.addAttribute(attributes, key, type == AttributePairType::True, attributeMinzoom);
+			} else throw runtime_error("unknown attribute type");
+		}
+
+		Geometry geometry;
+		if (geomType == POINT_) {
+			double x = reader.get<double>();
+			geometry = Point(x, reader.get<double>());
+		} else if (geomType == LINESTRING_) {
+			Linestring ls;
+			reader.getRing(ls);
+			geometry = std::move(ls);
+		} else if (geomType == POLYGON_) {
+			uint32_t polygons = reader.get<uint32_t>();
+			if (size_t(reader.end - reader.ptr) / sizeof(uint32_t) < polygons) throw runtime_error("record is truncated");
+			MultiPolygon mp;
+			mp.resize(polygons);
+			for (Polygon &poly : mp) {
+				uint32_t rings = reader.get<uint32_t>();
+				if (rings == 0) continue;
+				if (size_t(reader.end - reader.ptr) / sizeof(uint32_t) < rings) throw runtime_error("record is truncated");
+				reader.getRing(poly.outer());
+				poly.inners().resize(rings - 1);
+				for (Ring &inner : poly.inners()) reader.getRing(inner);
+			}
+			geometry = std::move(mp);
+		} else throw runtime_error("unknown geometry type");
+
+		if (storing)
+			shpMemTiles.StoreShapefileGeometry(layerNum, layer.name, geomType, std::move(geometry),
+			                                   layer.indexed, hasName, name, minzoom, attributeStore.add(attributes));
+	};
+
+	atomic<bool> failed(false);
+	auto readAll = [&](bool storing) {
+		atomic<size_t> next(0);
+		auto worker = [&]() {
+			for (size_t start = next.fetch_add(FEATURES_PER_RUN); start < records.size() && !failed; start = next.fetch_add(FEATURES_PER_RUN)) {
+				size_t stop = min(records.size(), start + FEATURES_PER_RUN);
+				for (size_t i = start; i < stop; i++) {
+					try {
+						readRecord(i, storing);
+					} catch (std::runtime_error &e) {
+						failed = true;
+					}
+				}
+			}
+		};
+		vector<thread> threads;
+		for (unsigned int t = 0; t < std::max(1u, threadNum); t++) threads.emplace_back(worker);
+		for (auto &t : threads) t.join();
+	};
+
+	readAll(false);
+	if (failed) {
+		cerr << filename << " is corrupt, so the source will be read instead" << endl;
+		return false;
+	}
+	layer.minzoom = layerMinzoom;
+	for (const auto &attribute : attributeMap) layer.attributeMap[attribute.first] = attribute.second;
+	readAll(true);
+	return true;
+}
+
+bool SourceCache::startSaving() {
+	out.open(filename, ios::out | ios::trunc | ios::binary);
+	if (!out) {
+		cerr << "Couldn't open " << filename << " to save source cache" << endl;
+		return false;
+	}
+	// The header is only filled in once everything else is written, so an
+	// unfinished file is never used
+	SourceCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	featureCount = 0;
+	return true;
+}
+
+void SourceCache::record(OutputGeometryType geomType, const Geometry &geometry, bool hasName, const string &name,
+                         uint minzoom, AttributeIndex attrIdx) {
+	if (geomType != POINT_ && geomType != LINESTRING_ && geomType != POLYGON_) return;
+
+	thread_local string buffer;
+	buffer.clear();
+	RecordWriter writer { buffer };
+	writer.put<uint32_t>(0);		// length, filled in below
+	writer.put<uint8_t>(geomType);
+	writer.put<uint8_t>(hasName);
+	writer.put<uint32_t>(minzoom);
+	writer.putString(name);
+
+	vector<AttributePair> pairs = attributeStore.get(attrIdx);
+	writer.put<uint16_t>(pairs.size());
+	for (const AttributePair &pair : pairs) {
+		writer.putString(attributeStore.keyStore.getKey(pair.keyIndex));
+		writer.put<char>(pair.minzoom);
+		writer.put<uint8_t>(uint8_t(pair.valueType));
+		if (pair.hasStringValue()) writer.putString(pair.stringValue());
+		else if (pair.hasFloatValue()) writer.put<float>(pair.floatValue());
+	}
+
+	if (geomType == POINT_) {
+		const Point &p = boost::get<Point>(geometry);
+		writer.put(p.x()); writer.put(p.y());
+	} else if (geomType == LINESTRING_) {
+		writer.putRing(boost::get<Linestring>(geometry));
+	} else {
+		const MultiPolygon &mp = boost::get<MultiPolygon>(geometry);
+		writer.put<uint32_t>(mp.size());
+		for (const Polygon &poly : mp) {
+			writer.put<uint32_t>(1 + poly.inners().size());
+			writer.putRing(poly.outer());
+			for (const Ring &inner : poly.inners()) writer.putRing(inner);
+		}
+	}
+	uint32_t length = buffer.size() - sizeof(uint32_t);
+	memcpy(&buffer[0], &length, sizeof(length));
+
+	std::lock_guard<std::mutex> lock(outMutex);
+	out.write(buffer.data(), buffer.size());
+	featureCount++;
+}
+
+void SourceCache::finishSaving(const LayerDef &layer) {
+	SourceCacheHeader header;
+	memcpy(header.magic, sourceCacheMagic, sizeof(header.magic));
+	header.version = SOURCE_CACHE_VERSION;
+	header.reserved = 0;
+	header.signature = sig;
+	header.featureCount = featureCount;
+	header.layerOffset = out.tellp();
+
+	string buffer;
+	RecordWriter writer { buffer };
+	writer.put<uint32_t>(layer.minzoom);
+	writer.put<uint32_t>(layer.attributeMap.size());
+	for (const auto &it : layer.attributeMap) {
+		writer.putString(it.first);
+		writer.put<uint32_t>(it.second);
+	}
+	out.write(buffer.data(), buffer.size());
+	out.seekp(0);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.close();
+	if (!out) {
+		cerr << "Couldn't finish writing source cache to " << filename << endl;
+		remove(filename.c_str());
+		return;
+	}
+	cout << "Saved " << featureCount << " features to " << filename << endl;
+}
@@ -0,0 +1,61 @@
+#include "spill_file.h"
+#include <stdexcept>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/filesystem.hpp>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace bi = boost::interprocess;
+
+SpillFile::SpillFile(const std::string &dir): length(0), base(nullptr) {
+	boost::filesystem::path path = boost::filesystem::path(dir) / boost::filesystem::unique_path("tilemaker-%%%%-%%%%-%%%%.spill");
+	filename = path.string();
+	file = fopen(filename.c_str(), "w+b");
+	if (!file) throw std::runtime_error("Couldn't create spill file " + filename);
+}
+
+SpillFile::~SpillFile() {
+	region.reset();
+	fclose(file);
+	boost::system::error_code ec;
+	boost::filesystem::remove(filename, ec);
+}
+
+uint64_t SpillFile::append(const void *data, size_t size, size_t align) {
+	static const char zeros[64] = { 0 };
+	size_t padding = (align - length % align) % align;
+	while (padding > 0) {
+		size_t n = std::min(padding, sizeof(zeros));
+		if (fwrite(zeros, 1, n, file) != n) throw std::runtime_error("Couldn't write to spill file " + filename);
+		length += n;
+		padding -= n;
+	}
+	uint64_t offset = length;
+	if (size > 0 && fwrite(data, 1, size, file) != size) throw std::runtime_error("Couldn't write to spill file " + filename);
+	length += size;
+	return offset;
+}
+
+void SpillFile::map() {
+	region.reset();
+	base = nullptr;
+	if (length == 0) return;
+	if (fflush(file) != 0) throw std::runtime_error("Couldn't write to spill file " + filename);
+	bi::file_mapping mapping(filename.c_str(), bi::read_only);
+	region.reset(new bi::mapped_region(mapping, bi::read_only, 0, length));
+	base = static_cast<const char*>(region->get_address());
+}
+
+void SpillFile::release(uint64_t offset, uint64_t size) {
+#ifndef _WIN32
+	if (!base || size == 0) return;
+	// Only whole pages inside the range can go
+	const uint64_t page = sysconf(_SC_PAGESIZE);
+	const uint64_t start = (offset + page - 1) / page * page;
+	const uint64_t end = (offset + size) / page * page;
+	if (end > start) madvise(const_cast<char*>(base) + start, end - start, MADV_DONTNEED);
+#endif
+}
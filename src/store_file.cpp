@@ -0,0 +1,160 @@
+#include "store_file.h"
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/filesystem.hpp>
+
+using namespace std;
+namespace bi = boost::interprocess;
+
+#define STORE_FILE_VERSION 1
+#define STORE_FILE_ALIGNMENT 64
+
+namespace {
+	struct StoreFileHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t kind;
+		uint64_t signature;
+		uint64_t slotCount;
+		uint64_t itemCount;
+		uint64_t groupCount;
+	};
+
+	struct StoreFileIndexEntry {
+		uint64_t index;
+		uint64_t offset;
+		uint64_t length;
+	};
+
+	const char storeFileMagic[8] = { 'T','M','S','T','O','R','E','\0' };
+
+	uint64_t alignUp(uint64_t value) {
+		return (value + STORE_FILE_ALIGNMENT - 1) / STORE_FILE_ALIGNMENT * STORE_FILE_ALIGNMENT;
+	}
+
+	// FNV-1a
+	void hashBytes(uint64_t &hash, const char *data, size_t length) {
+		for (size_t i = 0; i < length; i++) {
+			hash ^= static_cast<uint8_t>(data[i]);
+			hash *= 1099511628211ull;
+		}
+	}
+}
+
+StoreFile::StoreFile(): slotCount(0), itemCount(0) { }
+
+StoreFile::~StoreFile() { }
+
+bool StoreFile::save(const string &filename, uint32_t kind, uint64_t signature,
+                     uint64_t slotCount, uint64_t itemCount, const vector<StoreFileGroup> &groups) {
+	ofstream out(filename, ios::out | ios::trunc | ios::binary);
+	if (!out) {
+		cerr << "Couldn't open " << filename << " to save store" << endl;
+		return false;
+	}
+
+	StoreFileHeader header;
+	memcpy(header.magic, storeFileMagic, sizeof(header.magic));
+	header.version = STORE_FILE_VERSION;
+	header.kind = kind;
+	header.signature = signature;
+	header.slotCount = slotCount;
+	header.itemCount = itemCount;
+	header.groupCount = groups.size();
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	uint64_t offset = alignUp(sizeof(header) + groups.size() * sizeof(StoreFileIndexEntry));
+	for (const auto &group : groups) {
+		StoreFileIndexEntry entry = { group.index, offset, group.length };
+		out.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+		offset = alignUp(offset + group.length);
+	}
+
+	const char padding[STORE_FILE_ALIGNMENT] = {0};
+	for (const auto &group : groups) {
+		uint64_t position = out.tellp();
+		out.write(padding, alignUp(position) - position);
+		out.write(static_cast<const char*>(group.data), group.length);
+	}
+	out.close();
+	if (!out) {
+		cerr << "Couldn't finish writing store to " << filename << endl;
+		remove(filename.c_str());
+		return false;
+	}
+	return true;
+}
+
+unique_ptr<StoreFile> StoreFile::load(const string &filename, uint32_t kind, uint64_t signature) {
+	if (!boost::filesystem::exists(filename)) return nullptr;
+
+	unique_ptr<StoreFile> store(new StoreFile());
+	try {
+		bi::file_mapping mapping(filename.c_str(), bi::read_only);
+		store->region.reset(new bi::mapped_region(mapping, bi::read_only));
+	} catch (bi::interprocess_exception &e) {
+		cerr << "Couldn't map " << filename << ": " << e.what() << endl;
+		return nullptr;
+	}
+
+	const char *base = static_cast<const char*>(store->region->get_address());
+	const size_t size = store->region->get_size();
+	if (size < sizeof(StoreFileHeader)) return nullptr;
+
+	StoreFileHeader header;
+	memcpy(&header, base, sizeof(header));
+	if (memcmp(header.magic, storeFileMagic, sizeof(header.magic)) != 0 ||
+	    header.version != STORE_FILE_VERSION || header.kind != kind) {
+		cerr << filename << " isn't a compatible store file" << endl;
+		return nullptr;
+	}
+	if (header.signature != signature) {
+		cout << filename << " was built from a different input file" << endl;
+		return nullptr;
+	}
+	if (sizeof(header) + header.groupCount * sizeof(StoreFileIndexEntry) > size) {
+		cerr << filename << " is truncated" << endl;
+		return nullptr;
+	}
+
+	store->slotCount = header.slotCount;
+	store->itemCount = header.itemCount;
+	store->groups.reserve(header.groupCount);
+	const char *indexPtr = base + sizeof(header);
+	for (uint64_t i = 0; i < header.groupCount; i++) {
+		StoreFileIndexEntry entry;
+		memcpy(&entry, indexPtr + i * sizeof(entry), sizeof(entry));
+		if (entry.offset + entry.length > size || entry.index >= header.slotCount) {
+			cerr << filename << " is truncated" << endl;
+			return nullptr;
+		}
+		store->groups.push_back({ entry.index, base + entry.offset, entry.length });
+	}
+	return store;
+}
+
+uint64_t StoreFile::signature(const string &filename) {
+	const uint64_t sampleSize = 16 * 1024 * 1024;
+	uint64_t hash = 14695981039346656037ull;
+	uint64_t fileSize = boost::filesystem::file_size(filename);
+	hashBytes(hash, reinterpret_cast<const char*>(&fileSize), sizeof(fileSize));
+	// An edit that keeps the size, away from the ends, still changes the time
+	int64_t modified = boost::filesystem::last_write_time(filename);
+	hashBytes(hash, reinterpret_cast<const char*>(&modified), sizeof(modified));
+
+	ifstream in(filename, ios::in | ios::binary);
+	vector<char> buffer(sampleSize);
+	in.read(buffer.data(), min(sampleSize, fileSize));
+	hashBytes(hash, buffer.data(), in.gcount());
+	if (fileSize > sampleSize) {
+		in.clear();
+		in.seekg(fileSize - sampleSize);
+		in.read(buffer.data(), sampleSize);
+		hashBytes(hash, buffer.data(), in.gcount());
+	}
+	return hash;
+}
@@ -0,0 +1,129 @@
+#include "tag_rules.h"
+#include "shared_data.h"
+#include <iostream>
+#include <stdexcept>
+
+using namespace std;
+
+static void ruleError(size_t ruleNum, const string &message) {
+	throw runtime_error("Rule " + to_string(ruleNum+1) + " in JSON file: " + message);
+}
+
+bool TagRule::matches(const TagMap &tags) const {
+	boost::string_view found;
+	for (const Condition &condition : conditions) {
+		if (!tags.find(condition.key, found)) return false;
+		if (condition.values.empty()) continue;
+		bool any = false;
+		for (const string &value : condition.values) {
+			if (found == value) { any = true; break; }
+		}
+		if (!any) return false;
+	}
+	return true;
+}
+
+void TagRules::read(const rapidjson::Value &json, const LayerDefinition &layers) {
+	if (!json.IsArray()) throw runtime_error("\"rules\" should be an array in JSON file.");
+
+	for (uint i = 0; i < json.Size(); i++) {
+		const rapidjson::Value &r = json[i];
+		if (!r.IsObject()) ruleError(i, "should be an object");
+		TagRule rule;
+
+		// "match": { "key": "*" | "value" | ["value", ...], ... }
+		if (!r.HasMember("match") || !r["match"].IsObject() || r["match"].MemberBegin() == r["match"].MemberEnd())
+			ruleError(i, "needs a \"match\" object with at least one tag");
+		for (auto it = r["match"].MemberBegin(); it != r["match"].MemberEnd(); ++it) {
+			TagRule::Condition condition;
+			condition.key = it->name.GetString();
+			if (it->value.IsArray()) {
+				for (uint j = 0; j < it->value.Size(); j++) {
+					if (!it->value[j].IsString()) ruleError(i, "values to match should be strings");
+					condition.values.push_back(it->value[j].GetString());
+				}
+			} else if (it->value.IsString()) {
+				if (string(it->value.GetString()) != "*") condition.values.push_back(it->value.GetString());
+			} else {
+				ruleError(i, "values to match should be strings");
+			}
+			rule.conditions.push_back(condition);
+		}
+
+		if (!r.HasMember("layer") || !r["layer"].IsString()) ruleError(i, "needs a \"layer\"");
+		rule.layer = r["layer"].GetString();
+		if (layers.layerMap.count(rule.layer) == 0) ruleError(i, "there's no layer called \"" + rule.layer + "\"");
+
+		if (r.HasMember("geometry") && !r["geometry"].IsString()) ruleError(i, "\"geometry\" should be a string");
+		string geometry = r.HasMember("geometry") ? r["geometry"].GetString() : "";
+		if      (geometry == "point"   ) rule.geometry = TagRule::Geometry::Point;
+		else if (geometry == "line"    ) rule.geometry = TagRule::Geometry::Line;
+		else if (geometry == "area"    ) rule.geometry = TagRule::Geometry::Area;
+		else if (geometry == "centroid") rule.geometry = TagRule::Geometry::Centroid;
+		else ruleError(i, "\"geometry\" should be any of \"point\",\"line\",\"area\",\"centroid\"");
+
+		if (r.HasMember("minzoom")) {
+			if (!r["minzoom"].IsNumber()) ruleError(i, "\"minzoom\" should be a number");
+			rule.minzoom = r["minzoom"].GetDouble();
+		}
+		if (r.HasMember("fallthrough") && !r["fallthrough"].IsBool()) ruleError(i, "\"fallthrough\" should be true or false");
+		rule.fallthrough = r.HasMember("fallthrough") && r["fallthrough"].GetBool();
+
+		// "attributes": { "name": "tag" | true/false | number | { "tag"/"value", "type", "minzoom" } }
+		if (r.HasMember("attributes")) {
+			if (!r["attributes"].IsObject()) ruleError(i, "\"attributes\" should be an object");
+			for (auto it = r["attributes"].MemberBegin(); it != r["attributes"].MemberEnd(); ++it) {
+				TagRule::Attribute attribute;
+				attribute.key = it->name.GetString();
+				attribute.type = TagRule::AttributeType::String;
+				attribute.minzoom = 0;
+				const rapidjson::Value &a = it->value;
+				if (a.IsString()) {
+					attribute.tag = a.GetString();
+				} else if (a.IsBool()) {
+					attribute.type = TagRule::AttributeType::Boolean;
+					attribute.value = a.GetBool() ? "true" : "false";
+				} else if (a.IsNumber()) {
+					attribute.type = TagRule::AttributeType::Number;
+					attribute.value = to_string(a.GetDouble());
+				} else if (a.IsObject()) {
+					const string where = "attribute \"" + attribute.key + "\"";
+					if (a.HasMember("tag")) {
+						if (!a["tag"].IsString()) ruleError(i, where + " should have a string \"tag\"");
+						attribute.tag = a["tag"].GetString();
+					} else if (a.HasMember("value")) {
+						if (!a["value"].IsString()) ruleError(i, where + " should have a string \"value\"");
+						attribute.value = a["value"].GetString();
+					} else ruleError(i, where + " needs a \"tag\" or a \"value\"");
+					if (a.HasMember("type") && !a["type"].IsString()) ruleError(i, where + " should have a string \"type\"");
+					string type = a.HasMember("type") ? a["type"].GetString() : "string";
+					if      (type == "string" ) attribute.type = TagRule::AttributeType::String;
+					else if (type == "number" ) attribute.type = TagRule::AttributeType::Number;
+					else if (type == "boolean") attribute.type = TagRule::AttributeType::Boolean;
+					else ruleError(i, "attribute \"type\" should be any of \"string\",\"number\",\"boolean\"");
+					if (a.HasMember("minzoom")) {
+						if (!a["minzoom"].IsInt()) ruleError(i, where + " should have a whole number \"minzoom\"");
+						attribute.minzoom = a["minzoom"].GetInt();
+					}
+				} else {
+					ruleError(i, "attribute \"" + attribute.key + "\" should be a tag name, a constant or an object");
+				}
+				rule.attributes.push_back(attribute);
+			}
+		}
+
+		rules.push_back(rule);
+	}
+}
+
+// One condition is enough to get an object past the filter, as all must hold
+std::vector<std::string> TagRules::filterEntries(bool nodes) const {
+	vector<string> entries;
+	for (const TagRule &rule : rules) {
+		if ((rule.geometry == TagRule::Geometry::Point) != nodes) continue;
+		const TagRule::Condition &condition = rule.conditions.front();
+		if (nodes || condition.values.empty()) { entries.push_back(condition.key); continue; }
+		for (const string &value : condition.values) entries.push_back(condition.key + "=" + value);
+	}
+	return entries;
+}
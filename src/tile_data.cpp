@@ -1,9 +1,16 @@
 #include <algorithm>
 #include <iostream>
+#include <atomic>
+#include <queue>
 #include "tile_data.h"
 #include "coordinates_geom.h"
 #include "leased_store.h"
+#include "tile_profiler.h"
+#include "shared_data.h"
+#include "snapshot.h"
 #include <ciso646>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/post.hpp>
 
 using namespace std;
 extern bool verbose;
@@ -41,6 +48,246 @@ thread_local LeasedStore<TileDataSource::linestring_store_t> linestringStore;
 thread_local LeasedStore<TileDataSource::multi_linestring_store_t> multilinestringStore;
 thread_local LeasedStore<TileDataSource::multi_polygon_store_t> multipolygonStore;
 
+template<typename T> inline unsigned int bucketOf(const T& object) { return minZoomBucket(outputObjectOf(object).minZoom); }
+
+// Sort the objects in [begin, end) that share a bucket and key into the order
+// they'll be written in, so that a tile's objects form one sorted run per key
+// in each bucket
+template<typename T> void sortObjectsWithinKeys(ClusteredObjects<T>& cluster, const OutputObjectOrder& objectOrder, size_t begin, size_t end) {
+	auto compare = [&objectOrder](const T& x, const T& y) { return objectOrder(outputObjectOf(x), outputObjectOf(y)); };
+	size_t first = begin;
+	while (first < end) {
+		size_t last = first + 1;
+		while (last < end && cluster.keys[last] == cluster.keys[first] && bucketOf(cluster.objects[last]) == bucketOf(cluster.objects[first]))
+			last++;
+		if (last - first > 1)
+			std::sort(cluster.objects.begin() + first, cluster.objects.begin() + last, compare);
+		first = last;
+	}
+}
+
+// Sort one z6 tile's objects by minZoom bucket, then key, then objectOrder
+template<typename T> void sortClusteredObjects(ClusteredObjects<T>& cluster, const OutputObjectOrder& objectOrder, size_t threadNum) {
+	// We sort (key, position) pairs, then move the objects into place by
+	// following the permutation's cycles, so no second copy is needed. The
+	// pairs are first placed by bucket, then each bucket is sorted by key.
+	size_t bucketStarts[MINZOOM_BUCKETS + 1] = {};
+	for (const T& object : cluster.objects)
+		bucketStarts[bucketOf(object) + 1]++;
+	for (unsigned int bucket = 1; bucket <= MINZOOM_BUCKETS; bucket++)
+		bucketStarts[bucket] += bucketStarts[bucket - 1];
+
+	std::vector<std::pair<Z6OffsetKey, uint32_t>> order(cluster.keys.size());
+	{
+		size_t next[MINZOOM_BUCKETS];
+		std::copy(bucketStarts, bucketStarts + MINZOOM_BUCKETS, next);
+		for (size_t i = 0; i < order.size(); i++)
+			order[next[bucketOf(cluster.objects[i])]++] = std::make_pair(cluster.keys[i], (uint32_t)i);
+	}
+
+	for (unsigned int bucket = 0; bucket < MINZOOM_BUCKETS; bucket++) {
+		auto begin = order.begin() + bucketStarts[bucket], end = order.begin() + bucketStarts[bucket + 1];
+		if (threadNum > 1)
+			boost::sort::block_indirect_sort(begin, end, threadNum);
+		else
+			std::sort(begin, end);
+	}
+
+	for (size_t i = 0; i < order.size(); i++)
+		cluster.keys[i] = order[i].first;
+
+	for (size_t i = 0; i < order.size(); i++) {
+		if (order[i].second == i)
+			continue;
+		T displaced = std::move(cluster.objects[i]);
+		size_t j = i;
+		while (true) {
+			size_t from = order[j].second;
+			order[j].second = j;
+			if (from == i) {
+				cluster.objects[j] = std::move(displaced);
+				break;
+			}
+			cluster.objects[j] = std::move(cluster.objects[from]);
+			j = from;
+		}
+	}
+
+	// Each thread takes a share of the keys
+	const size_t count = cluster.keys.size();
+	if (threadNum > 1 && count > threadNum) {
+		boost::asio::thread_pool pool(threadNum);
+		size_t begin = 0;
+		for (size_t t = 1; t <= threadNum && begin < count; t++) {
+			size_t end = t == threadNum ? count : count * t / threadNum;
+			while (end < count && end > begin && cluster.keys[end] == cluster.keys[end - 1])
+				end++;
+			if (end <= begin)
+				continue;
+			boost::asio::post(pool, [&cluster, &objectOrder, begin, end]() { sortObjectsWithinKeys(cluster, objectOrder, begin, end); });
+			begin = end;
+		}
+		pool.join();
+	} else {
+		sortObjectsWithinKeys(cluster, objectOrder, 0, count);
+	}
+	cluster.shrink_to_fit();
+}
+
+template<typename T> void finalizeObjects(
+	const size_t& threadNum,
+	const OutputObjectOrder& objectOrder,
+	typename std::vector<ClusteredObjects<T>>::iterator begin,
+	typename std::vector<ClusteredObjects<T>>::iterator end
+	) {
+	// A small extract has only a few populated z6 tiles (e.g. Colorado has
+	// ~9, 1 of which has 95% of its output objects), so those are sorted
+	// one at a time using all threads. A global extract populates all 4096
+	// z6 tiles, and setting up threads for each one would dominate; there
+	// we sort many tiles at once, each on a single thread.
+	//
+	// Any z6 tile holding more than a thread's fair share of the objects
+	// is treated as big; the rest are shared out through a pool.
+	size_t total = 0;
+	for (auto it = begin; it != end; it++)
+		total += it->keys.size();
+	if (total == 0)
+		return;
+	const size_t fairShare = total / threadNum;
+
+	std::vector<ClusteredObjects<T>*> small;
+	for (auto it = begin; it != end; it++) {
+		if (it->keys.empty())
+			continue;
+		if (threadNum > 1 && it->keys.size() < fairShare)
+			small.push_back(&*it);
+		else
+			sortClusteredObjects(*it, objectOrder, threadNum);
+	}
+	if (small.empty())
+		return;
+
+	// Largest first, so that no thread is left with a big tile at the end
+	std::sort(small.begin(), small.end(), [](const ClusteredObjects<T>* a, const ClusteredObjects<T>* b) {
+		return a->keys.size() > b->keys.size();
+	});
+	boost::asio::thread_pool pool(threadNum);
+	for (ClusteredObjects<T>* cluster : small)
+		boost::asio::post(pool, [cluster, &objectOrder]() { sortClusteredObjects(*cluster, objectOrder, 1); });
+	pool.join();
+}
+
+// Sort a z6 tile's objects and write them to the spill file as a run,
+// returning the bytes freed
+template<typename T> size_t spillClusteredObjects(ClusteredObjects<T>& cluster, const OutputObjectOrder& objectOrder, std::vector<SpillRun>& runs, SpillFile& file) {
+	const size_t count = cluster.keys.size();
+	if (count == 0)
+		return 0;
+	sortClusteredObjects(cluster, objectOrder, 1);
+
+	SpillRun run;
+	run.keysOffset = file.append(cluster.keys.data(), count * sizeof(Z6OffsetKey), 8);
+	run.objectsOffset = file.append(cluster.objects.data(), count * sizeof(T), 8);
+	run.count = count;
+	runs.push_back(run);
+
+	std::vector<Z6OffsetKey>().swap(cluster.keys);
+	std::vector<T>().swap(cluster.objects);
+	return count * (sizeof(Z6OffsetKey) + sizeof(T));
+}
+
+// Merge a z6 tile's spilled runs, any objects it already had mapped and
+// those still in memory (already sorted) into one sorted array at the end of
+// the spill file. The file must be mapped.
+template<typename T> void mergeSpilledObjects(ClusteredObjects<T>& cluster, const OutputObjectOrder& objectOrder, std::vector<SpillRun>& runs, SpillFile& file) {
+	if (runs.empty() && (cluster.mappedCount == 0 || cluster.keys.empty()))
+		return;
+
+	struct Source {
+		const Z6OffsetKey *keys;
+		const T *objects;
+		size_t count;
+	};
+	// Sources are ordered by bucket, key, then by objectOrder; earlier sources were
+	// added first, so remaining ties are broken in their favour
+	std::vector<Source> sources;
+	const char *base = file.data();
+	if (cluster.mappedCount > 0)
+		sources.push_back({ reinterpret_cast<const Z6OffsetKey*>(base + cluster.mappedKeysOffset), reinterpret_cast<const T*>(base + cluster.mappedObjectsOffset), cluster.mappedCount });
+	for (const SpillRun& run : runs)
+		sources.push_back({ reinterpret_cast<const Z6OffsetKey*>(base + run.keysOffset), reinterpret_cast<const T*>(base + run.objectsOffset), run.count });
+	if (!cluster.keys.empty())
+		sources.push_back({ cluster.keys.data(), cluster.objects.data(), cluster.keys.size() });
+
+	size_t total = 0;
+	for (const Source& source : sources)
+		total += source.count;
+
+	// Merge twice, writing the keys then the objects, in chunks
+	auto merge = [&sources, &objectOrder](auto emit) {
+		std::vector<size_t> positions(sources.size(), 0);
+		// True if source a's next object comes after source b's
+		auto after = [&](size_t a, size_t b) {
+			const unsigned int ba = bucketOf(sources[a].objects[positions[a]]), bb = bucketOf(sources[b].objects[positions[b]]);
+			if (ba != bb) return ba > bb;
+			const Z6OffsetKey ka = sources[a].keys[positions[a]], kb = sources[b].keys[positions[b]];
+			if (ka != kb) return ka > kb;
+			const OutputObject &oa = outputObjectOf(sources[a].objects[positions[a]]), &ob = outputObjectOf(sources[b].objects[positions[b]]);
+			if (objectOrder(ob, oa)) return true;
+			if (objectOrder(oa, ob)) return false;
+			return a > b;
+		};
+		std::priority_queue<size_t, std::vector<size_t>, decltype(after)> heads(after);
+		for (size_t i = 0; i < sources.size(); i++)
+			if (sources[i].count > 0) heads.push(i);
+		while (!heads.empty()) {
+			const size_t i = heads.top();
+			heads.pop();
+			emit(sources[i], positions[i]);
+			if (++positions[i] < sources[i].count)
+				heads.push(i);
+		}
+	};
+	const size_t chunk = 65536;
+	std::vector<Z6OffsetKey> keyBuffer;
+	cluster.mappedKeysOffset = file.append(nullptr, 0, 8);
+	merge([&](const Source& source, size_t i) {
+		keyBuffer.push_back(source.keys[i]);
+		if (keyBuffer.size() == chunk) { file.append(keyBuffer.data(), chunk * sizeof(Z6OffsetKey)); keyBuffer.clear(); }
+	});
+	file.append(keyBuffer.data(), keyBuffer.size() * sizeof(Z6OffsetKey));
+	std::vector<T> objectBuffer;
+	cluster.mappedObjectsOffset = file.append(nullptr, 0, 8);
+	merge([&](const Source& source, size_t i) {
+		objectBuffer.push_back(source.objects[i]);
+		if (objectBuffer.size() == chunk) { file.append(objectBuffer.data(), chunk * sizeof(T)); objectBuffer.clear(); }
+	});
+	file.append(objectBuffer.data(), objectBuffer.size() * sizeof(T));
+
+	cluster.mappedCount = total;
+	cluster.mappedKeys = nullptr;
+	cluster.mappedObjects = nullptr;
+	std::vector<Z6OffsetKey>().swap(cluster.keys);
+	std::vector<T>().swap(cluster.objects);
+	runs.clear();
+}
+
+// Point a z6 tile's arrays at the (re)mapped spill file
+template<typename T> void mapSpilledObjects(ClusteredObjects<T>& cluster, const SpillFile& file) {
+	if (cluster.mappedCount == 0)
+		return;
+	cluster.mappedKeys = reinterpret_cast<const Z6OffsetKey*>(file.data() + cluster.mappedKeysOffset);
+	cluster.mappedObjects = reinterpret_cast<const T*>(file.data() + cluster.mappedObjectsOffset);
+}
+
+// Stores that can be leased for each thread at the start, so that more threads
+// (or tasks that outlive theirs) can store geometries too. Each doubling of
+// this takes a bit from the IDs within each store.
+#define STORE_LEASES_PER_THREAD 4
+// ...but no more than this many bits of the IDs go on the store, leaving each
+// store room for 2^25 geometries
+#define STORE_MAX_SHARD_BITS 10
+
 TileDataSource::TileDataSource(size_t threadNum, unsigned int baseZoom, bool includeID)
 	:
 	includeID(includeID),
@@ -48,35 +295,192 @@ TileDataSource::TileDataSource(size_t threadNum, unsigned int baseZoom, bool inc
 	objectsMutex(threadNum * 4),
 	objects(CLUSTER_ZOOM_AREA),
 	objectsWithIds(CLUSTER_ZOOM_AREA),
+	memoryLimit(0),
+	smallObjectBytes(0),
+	spilledRuns(CLUSTER_ZOOM_AREA),
+	spilledRunsWithIds(CLUSTER_ZOOM_AREA),
+	spilledBytes(0),
+	largeObjectBuffers(threadNum),
 	baseZoom(baseZoom),
-	pointStores(threadNum),
-	linestringStores(threadNum),
-	multipolygonStores(threadNum),
-	multilinestringStores(threadNum),
-	multiPolygonClipCache(ClipCache<MultiPolygon>(threadNum, baseZoom)),
-	multiLinestringClipCache(ClipCache<MultiLinestring>(threadNum, baseZoom))
+	smallObjectTiles(baseZoom, CLUSTER_ZOOM),
+	largeObjectTiles(baseZoom, CLUSTER_ZOOM),
+	clipping(false),
+	pointStores(1),
+	linestringStores(1),
+	multipolygonStores(1),
+	multilinestringStores(1),
+	multiPolygonClipCache(threadNum, baseZoom),
+	multiLinestringClipCache(threadNum, baseZoom),
+	linestringClipCache(threadNum, baseZoom),
+	simplifiedPolygonCache(threadNum, baseZoom),
+	simplifiedLinestringCache(threadNum, baseZoom)
 {
 	shardBits = 0;
 	numShards = 1;
-	while(numShards < threadNum) {
+	while(numShards < threadNum * STORE_LEASES_PER_THREAD && shardBits < STORE_MAX_SHARD_BITS) {
 		shardBits++;
 		numShards *= 2;
 	}
+	openStores(1);
+}
+
+// Allocate every store that IDs have room for, so that opening one (when a
+// thread leases it) doesn't move the others; the first `opened` are in use.
+void TileDataSource::openStores(size_t opened) {
+	pointStores.resize(numShards);
+	linestringStores.resize(numShards);
+	multilinestringStores.resize(numShards);
+	multipolygonStores.resize(numShards);
+	auto reset = [&](auto& leases, auto& stores) {
+		leases.stores = &stores;
+		leases.available.clear();
+		for (size_t i = 0; i < opened; i++) leases.available.push_back(std::make_pair(i, &stores[i]));
+		leases.opened = opened;
+	};
+	reset(pointStoreLeases, pointStores);
+	reset(linestringStoreLeases, linestringStores);
+	reset(multiLinestringStoreLeases, multilinestringStores);
+	reset(multiPolygonStoreLeases, multipolygonStores);
+}
+
+void TileDataSource::sealStores() {
+	std::lock_guard<std::mutex> lock(storeMutex);
+	auto seal = [&](auto& leases) {
+		leases.available.clear();
+		leases.generation++;
+	};
+	seal(pointStoreLeases);
+	seal(linestringStoreLeases);
+	seal(multiLinestringStoreLeases);
+	seal(multiPolygonStoreLeases);
+}
+
+void TileDataSource::setClippingBox(const Box& box) {
+	clipping = true;
+	// Clamped, as a box reaching the poles or beyond ±180° is outside the tile grid.
+	// The far edges are exclusive: a tile that only touches the box isn't written
+	clipMinX = lon2tilexClamped(box.min_corner().x(), baseZoom);
+	clipMaxX = lon2tilexClampedEnd(box.max_corner().x(), baseZoom);
+	// Tile y runs southwards
+	clipMinY = latp2tileyClamped(box.max_corner().y(), baseZoom);
+	clipMaxY = latp2tileyClampedEnd(box.min_corner().y(), baseZoom);
+}
+
+void TileDataSource::setMemoryLimit(size_t bytes, const std::string &spillDir) {
+	memoryLimit = bytes;
+	spillFile.reset(bytes > 0 ? new SpillFile(spillDir) : nullptr);
+}
+
+void TileDataSource::spill() {
+	// Only one thread spills at a time; the others carry on adding objects
+	std::unique_lock<std::mutex> lock(spillMutex, std::try_to_lock);
+	if (!lock.owns_lock() || smallObjectBytes.load() <= memoryLimit)
+		return;
 
-	for (int i = 0; i < threadNum; i++) {
-		availablePointStoreLeases.push_back(std::make_pair(i, &pointStores[i]));
-		availableLinestringStoreLeases.push_back(std::make_pair(i, &linestringStores[i]));
-		availableMultiLinestringStoreLeases.push_back(std::make_pair(i, &multilinestringStores[i]));
-		availableMultiPolygonStoreLeases.push_back(std::make_pair(i, &multipolygonStores[i]));
+	size_t spilled = 0;
+	for (size_t i = 0; i < CLUSTER_ZOOM_AREA; i++) {
+		std::lock_guard<std::mutex> cellLock(objectsMutex[i % objectsMutex.size()]);
+		spilled += spillClusteredObjects(objects[i], OutputObjectOrder{sortOrders}, spilledRuns[i], *spillFile);
+		spilled += spillClusteredObjects(objectsWithIds[i], OutputObjectOrder{sortOrders}, spilledRunsWithIds[i], *spillFile);
 	}
+	smallObjectBytes -= spilled;
+	spilledBytes += spilled;
 }
 
 void TileDataSource::finalize(size_t threadNum) {
-	finalizeObjects<OutputObjectXY>(threadNum, baseZoom, objects.begin(), objects.end());
-	finalizeObjects<OutputObjectXYID>(threadNum, baseZoom, objectsWithIds.begin(), objectsWithIds.end());
+	const OutputObjectOrder objectOrder{sortOrders};
+	finalizeObjects<OutputObject>(threadNum, objectOrder, objects.begin(), objects.end());
+	finalizeObjects<OutputObjectID>(threadNum, objectOrder, objectsWithIds.begin(), objectsWithIds.end());
+
+	if (spillFile && spilledBytes > 0) {
+		// Merge each z6 tile's runs. Tiles that were never spilled stay in memory.
+		std::lock_guard<std::mutex> lock(spillMutex);
+		spillFile->map();
+		for (size_t i = 0; i < CLUSTER_ZOOM_AREA; i++) {
+			mergeSpilledObjects(objects[i], objectOrder, spilledRuns[i], *spillFile);
+			mergeSpilledObjects(objectsWithIds[i], objectOrder, spilledRunsWithIds[i], *spillFile);
+		}
+		spillFile->map();
+		size_t inMemory = 0;
+		for (size_t i = 0; i < CLUSTER_ZOOM_AREA; i++) {
+			mapSpilledObjects(objects[i], *spillFile);
+			mapSpilledObjects(objectsWithIds[i], *spillFile);
+			inMemory += objects[i].keys.size() * (sizeof(Z6OffsetKey) + sizeof(OutputObject)) +
+			            objectsWithIds[i].keys.size() * (sizeof(Z6OffsetKey) + sizeof(OutputObjectID));
+		}
+		smallObjectBytes = inMemory;
+	}
+	for (size_t i = 0; i < CLUSTER_ZOOM_AREA; i++) {
+		objects[i].findBuckets();
+		objectsWithIds[i].findBuckets();
+	}
+	// Those in memory are packed; those in the spill file stay as they are
+	{
+		boost::asio::thread_pool pool(threadNum);
+		for (size_t i = 0; i < CLUSTER_ZOOM_AREA; i++)
+			boost::asio::post(pool, [this, i]() {
+				objects[i].pack();
+				objectsWithIds[i].pack();
+			});
+		pool.join();
+	}
+
+	// Pack the buffered large objects, and any already indexed, into new
+	// rtrees, one per minZoom bucket
+	auto bulkLoad = [this](auto* rtrees, auto member) {
+		using rtree_t = typename std::decay<decltype(rtrees[0])>::type;
+		size_t buffered = 0;
+		for (auto& buffer : largeObjectBuffers)
+			buffered += (buffer.*member).size();
+		if (buffered == 0)
+			return;
+
+		std::vector<typename rtree_t::value_type> values[MINZOOM_BUCKETS];
+		for (unsigned int bucket = 0; bucket < MINZOOM_BUCKETS; bucket++)
+			values[bucket].insert(values[bucket].end(), rtrees[bucket].begin(), rtrees[bucket].end());
+		for (auto& buffer : largeObjectBuffers) {
+			auto& buffered = buffer.*member;
+			for (auto const& value : buffered)
+				values[bucketOf(value.second)].push_back(value);
+			std::remove_reference_t<decltype(buffered)>().swap(buffered);
+		}
+		for (unsigned int bucket = 0; bucket < MINZOOM_BUCKETS; bucket++) {
+			rtree_t packed(values[bucket].begin(), values[bucket].end());
+			rtrees[bucket].swap(packed);
+		}
+	};
+	bulkLoad(boxRtree, &LargeObjectBuffer::objects);
+	bulkLoad(boxRtreeWithIds, &LargeObjectBuffer::objectsWithIds);
+}
+
+void TileDataSource::addObjectToLargeIndex(const Box& envelope, const OutputObject& oo, uint64_t id) {
+	// Each thread keeps to its own buffer, so the lock is rarely contended
+	static std::atomic<size_t> nextBuffer(0);
+	thread_local size_t bufferIndex = nextBuffer++;
+	LargeObjectBuffer& buffer = largeObjectBuffers[bufferIndex % largeObjectBuffers.size()];
+
+	// Only the part of the object within the bounding box has tiles written
+	double minX = std::max(0.0, envelope.min_corner().x()), minY = std::max(0.0, envelope.min_corner().y());
+	double maxX = std::max(0.0, envelope.max_corner().x()), maxY = std::max(0.0, envelope.max_corner().y());
+	if (clipping) {
+		minX = std::max<double>(minX, clipMinX); minY = std::max<double>(minY, clipMinY);
+		maxX = std::min<double>(maxX, clipMaxX); maxY = std::min<double>(maxY, clipMaxY);
+		if (minX > maxX || minY > maxY)
+			return;
+	}
+	largeObjectTiles.setBox(minX, minY, maxX, maxY);
+
+	std::lock_guard<std::mutex> lock(buffer.mutex);
+	if (id == 0 || !includeID)
+		buffer.objects.push_back(std::make_pair(envelope, oo));
+	else
+		buffer.objectsWithIds.push_back(std::make_pair(envelope, OutputObjectID({oo, id})));
 }
 
 void TileDataSource::addObjectToSmallIndex(const TileCoordinates& index, const OutputObject& oo, uint64_t id) {
+	if (!inClippingBox(index))
+		return;
+
 	// Pick the z6 index
 	const size_t z6x = index.x / z6OffsetDivisor;
 	const size_t z6y = index.y / z6OffsetDivisor;
@@ -88,49 +492,228 @@ void TileDataSource::addObjectToSmallIndex(const TileCoordinates& index, const O
 
 	const size_t z6index = z6x * CLUSTER_ZOOM_WIDTH + z6y;
 
-	std::lock_guard<std::mutex> lock(objectsMutex[z6index % objectsMutex.size()]);
+	{
+		std::mutex &cellMutex = objectsMutex[z6index % objectsMutex.size()];
+		tracedLock(cellMutex, "wait for objects lock");
+		std::lock_guard<std::mutex> lock(cellMutex, std::adopt_lock);
+
+		if (id == 0 || !includeID)
+			objects[z6index].push_back(
+				(Z6Offset)(index.x - (z6x * z6OffsetDivisor)),
+				(Z6Offset)(index.y - (z6y * z6OffsetDivisor)),
+				oo
+			);
+		else
+			objectsWithIds[z6index].push_back(
+				(Z6Offset)(index.x - (z6x * z6OffsetDivisor)),
+				(Z6Offset)(index.y - (z6y * z6OffsetDivisor)),
+				OutputObjectID({ oo, id })
+			);
+	}
+	smallObjectTiles.set(index.x, index.y);
 
-	if (id == 0 || !includeID)
-		objects[z6index].push_back({
-			oo,
-			(Z6Offset)(index.x - (z6x * z6OffsetDivisor)),
-			(Z6Offset)(index.y - (z6y * z6OffsetDivisor))
-		});
-	else
-		objectsWithIds[z6index].push_back({
-			oo,
-			(Z6Offset)(index.x - (z6x * z6OffsetDivisor)),
-			(Z6Offset)(index.y - (z6y * z6OffsetDivisor)),
-			id
-		});
+	if (memoryLimit > 0) {
+		size_t bytes = sizeof(Z6OffsetKey) + (id == 0 || !includeID ? sizeof(OutputObject) : sizeof(OutputObjectID));
+		if (smallObjectBytes.fetch_add(bytes, std::memory_order_relaxed) + bytes > memoryLimit)
+			spill();
+	}
 }
 
 void TileDataSource::collectTilesWithObjectsAtZoom(uint zoom, TileCoordinatesSet& output) {
-	// Scan through all shards. Convert to base zoom, then convert to the requested zoom.
-	collectTilesWithObjectsAtZoomTemplate<OutputObjectXY>(baseZoom, objects.begin(), objects.size(), zoom, output);
-	collectTilesWithObjectsAtZoomTemplate<OutputObjectXYID>(baseZoom, objectsWithIds.begin(), objectsWithIds.size(), zoom, output);
+	smallObjectTiles.forEachTile(zoom, [&output](TileCoordinate x, TileCoordinate y) { output.set(x, y); });
+}
+
+// Find the tiles used by the "large objects" from the rtree index
+void TileDataSource::collectTilesWithLargeObjectsAtZoom(uint zoom, TileCoordinatesSet &output) {
+	largeObjectTiles.forEachTile(zoom, [&output](TileCoordinate x, TileCoordinate y) { output.set(x, y); });
+}
+
+void TileDataSource::getTileOccupancy(std::vector<const TileOccupancy*>& output) const {
+	output.push_back(&smallObjectTiles);
+	output.push_back(&largeObjectTiles);
+}
+
+template<typename T> void releaseClusteredObjects(ClusteredObjects<T>& cluster, SpillFile* file) {
+	if (cluster.mappedCount > 0 && file) {
+		file->release(cluster.mappedKeysOffset, cluster.mappedCount * sizeof(Z6OffsetKey));
+		file->release(cluster.mappedObjectsOffset, cluster.mappedCount * sizeof(T));
+	}
+	cluster.clear();
+	cluster.shrink_to_fit();
+}
+
+void TileDataSource::releaseCell(TileCoordinates cell) {
+	// Small objects are only ever in the tiles of their own z6 tile, so once
+	// those (and z0-z5) are written, they're no longer needed
+	const size_t i = cell.x * CLUSTER_ZOOM_WIDTH + cell.y;
+	std::lock_guard<std::mutex> lock(objectsMutex[i % objectsMutex.size()]);
+	releaseClusteredObjects(objects[i], spillFile.get());
+	releaseClusteredObjects(objectsWithIds[i], spillFile.get());
+}
+
+static const uint pyramidZooms[PYRAMID_LEVELS] = PYRAMID_ZOOMS;
+
+static uint pyramidLevelEnd(size_t level) {
+	return level + 1 < PYRAMID_LEVELS ? pyramidZooms[level + 1] : PYRAMID_MAX_ZOOM;
+}
+
+static size_t pyramidLevel(uint zoom) {
+	size_t level = 0;
+	while (level + 1 < PYRAMID_LEVELS && pyramidZooms[level + 1] <= zoom) level++;
+	return level;
+}
+
+// How far a level may move an object's points, in degrees: half a pixel of
+// an 8192-pixel tile at the level's most detailed zoom, so the simplification
+// can't be seen, or half the layer's own simplification if that's more at
+// all the level's zooms (measured at the latitude nearest the equator)
+static double pyramidTolerance(const LayerDef& ld, size_t level, const Box& box) {
+	const uint end = pyramidLevelEnd(level);
+	const double pixel = 360.0 / (1 << (end - 1)) / 8192.0;
+
+	double latp = 0.0;
+	if (box.min_corner().y() > 0) latp = box.min_corner().y();
+	else if (box.max_corner().y() < 0) latp = box.max_corner().y();
+
+	double layerTolerance = 0.0;
+	for (uint z = pyramidZooms[level]; z < end; z++) {
+		if (z >= ld.simplifyBelow) { layerTolerance = 0.0; break; }
+		double simplifyLevel = ld.simplifyLength > 0 ? meter2degp(ld.simplifyLength, latp) : ld.simplifyLevel;
+		simplifyLevel *= pow(ld.simplifyRatio, (ld.simplifyBelow-1) - z);
+		layerTolerance = z == pyramidZooms[level] ? simplifyLevel : std::min(layerTolerance, simplifyLevel);
+	}
+	return std::max(pixel / 2, layerTolerance / 2);
 }
 
-void addCoveredTilesToOutput(const uint baseZoom, const uint zoom, const Box& box, TileCoordinatesSet& output) {
-	int scale = pow(2, baseZoom-zoom);
-	TileCoordinate minx = box.min_corner().x() / scale;
-	TileCoordinate maxx = box.max_corner().x() / scale;
-	TileCoordinate miny = box.min_corner().y() / scale;
-	TileCoordinate maxy = box.max_corner().y() / scale;
-	for (int x=minx; x<=maxx; x++) {
-		for (int y=miny; y<=maxy; y++) {
-			output.set(x, y);
+void TileDataSource::buildPyramids(const LayerDefinition& layers, uint startZoom, size_t threadNum) {
+	// Gather the large objects written below PYRAMID_MAX_ZOOM. An object can be
+	// in several layers, so each level takes the least tolerance of them.
+	struct Simplified {
+		OutputGeometryType geomType;
+		NodeID objectID;
+		double tolerance[PYRAMID_LEVELS];
+		MultiLinestring linestrings[PYRAMID_LEVELS];
+		MultiPolygon polygons[PYRAMID_LEVELS];
+	};
+	std::map<std::pair<OutputGeometryType, NodeID>, size_t> positions;
+	std::vector<Simplified> pending;
+	auto gather = [&](const Box& box, const OutputObject& oo) {
+		if (oo.geomType == POINT_ || oo.minZoom >= PYRAMID_MAX_ZOOM) return;
+		const LayerDef& ld = layers.layers[oo.layer];
+		for (size_t level = 0; level < PYRAMID_LEVELS; level++) {
+			const uint end = pyramidLevelEnd(level);
+			if (end <= std::max(startZoom, std::max<uint>(oo.minZoom, ld.minzoom)) || pyramidZooms[level] > ld.maxzoom) continue;
+			if (oo.geomType == POLYGON_ ? polygonPyramid[level].count(oo.objectID) :
+			    oo.geomType == LINESTRING_ ? linestringPyramid[level].count(oo.objectID) :
+			    multiLinestringPyramid[level].count(oo.objectID)) continue;
+
+			auto inserted = positions.emplace(std::make_pair(oo.geomType, oo.objectID), pending.size());
+			if (inserted.second) {
+				pending.emplace_back();
+				pending.back().geomType = oo.geomType;
+				pending.back().objectID = oo.objectID;
+				for (double& tolerance : pending.back().tolerance) tolerance = 0.0;
+			}
+			double& tolerance = pending[inserted.first->second].tolerance[level];
+			const double wanted = pyramidTolerance(ld, level, box);
+			tolerance = tolerance == 0.0 ? wanted : std::min(tolerance, wanted);
+		}
+	};
+	for (unsigned int bucket = 0; bucket < MINZOOM_BUCKETS; bucket++) {
+		for (auto const& entry : boxRtree[bucket]) gather(entry.first, entry.second);
+		for (auto const& entry : boxRtreeWithIds[bucket]) gather(entry.first, entry.second.oo);
+	}
+	if (pending.empty()) return;
+
+	// Simplify each object once per level from its full geometry. Levels that
+	// wouldn't leave out at least a quarter of the points aren't kept.
+	std::atomic<size_t> simplifiedCount(0);
+	auto simplifyObject = [&](Simplified& object) {
+		try {
+			if (object.geomType == POLYGON_) {
+				MultiPolygon full;
+				populateMultiPolygon(full, object.objectID);
+				const size_t points = geom::num_points(full);
+				if (points < PYRAMID_MIN_POINTS) return;
+				for (size_t level = 0; level < PYRAMID_LEVELS; level++) {
+					if (object.tolerance[level] == 0.0) continue;
+					MultiPolygon simplified = simplify(full, object.tolerance[level]);
+					geom::remove_spikes(simplified);
+					geom::correct(simplified);
+					if (!geom::is_empty(simplified) && geom::num_points(simplified) * 4 <= points * 3) {
+						object.polygons[level] = std::move(simplified);
+						simplifiedCount++;
+					}
+				}
+				return;
+			}
+
+			MultiLinestring full;
+			if (object.geomType == LINESTRING_) {
+				Linestring ls;
+				populateLinestring(ls, object.objectID);
+				full.push_back(std::move(ls));
+			} else {
+				retrieveMultiLinestring(object.objectID, full);
+			}
+			const size_t points = geom::num_points(full);
+			if (points < PYRAMID_MIN_POINTS) return;
+			for (size_t level = 0; level < PYRAMID_LEVELS; level++) {
+				if (object.tolerance[level] == 0.0) continue;
+				MultiLinestring simplified;
+				for (auto const& ls : full) {
+					Linestring part = simplify(ls, object.tolerance[level]);
+					if (part.size() > 1) simplified.push_back(std::move(part));
+				}
+				if (!simplified.empty() && geom::num_points(simplified) * 4 <= points * 3) {
+					object.linestrings[level] = std::move(simplified);
+					simplifiedCount++;
+				}
+			}
+		} catch (std::out_of_range &err) {
+			if (verbose) std::cerr << "Error while simplifying geometry " << object.geomType << "," << object.objectID << "," << err.what() << std::endl;
+		}
+	};
+	boost::asio::thread_pool pool(threadNum);
+	const size_t chunk = 256;
+	for (size_t i = 0; i < pending.size(); i += chunk) {
+		boost::asio::post(pool, [&, i]() {
+			for (size_t j = i; j < std::min(i + chunk, pending.size()); j++) simplifyObject(pending[j]);
+		});
+	}
+	pool.join();
+
+	size_t points = 0;
+	for (Simplified& object : pending) {
+		for (size_t level = 0; level < PYRAMID_LEVELS; level++) {
+			if (object.geomType == POLYGON_ && !object.polygons[level].empty()) {
+				points += geom::num_points(object.polygons[level]);
+				polygonPyramid[level][object.objectID] = std::move(object.polygons[level]);
+			} else if (object.geomType != POLYGON_ && !object.linestrings[level].empty()) {
+				points += geom::num_points(object.linestrings[level]);
+				auto& pyramid = object.geomType == LINESTRING_ ? linestringPyramid : multiLinestringPyramid;
+				pyramid[level][object.objectID] = std::move(object.linestrings[level]);
+			}
 		}
 	}
+	if (simplifiedCount > 0)
+		std::cout << "Simplified " << simplifiedCount << " copies of large objects for low zooms (" << (points * sizeof(Point) / 1000000) << "MB)" << std::endl;
 }
 
-// Find the tiles used by the "large objects" from the rtree index
-void TileDataSource::collectTilesWithLargeObjectsAtZoom(uint zoom, TileCoordinatesSet &output) {
-	for(auto const &result: boxRtree)
-		addCoveredTilesToOutput(baseZoom, zoom, result.first, output);
+const MultiLinestring* TileDataSource::pyramidLinestring(OutputGeometryType geomType, NodeID objectID, uint zoom) const {
+	if (zoom >= PYRAMID_MAX_ZOOM) return nullptr;
+	auto const& pyramid = (geomType == LINESTRING_ ? linestringPyramid : multiLinestringPyramid)[pyramidLevel(zoom)];
+	if (pyramid.empty()) return nullptr;
+	auto it = pyramid.find(objectID);
+	return it == pyramid.end() ? nullptr : &it->second;
+}
 
-	for(auto const &result: boxRtreeWithIds)
-		addCoveredTilesToOutput(baseZoom, zoom, result.first, output);
+const MultiPolygon* TileDataSource::pyramidPolygon(NodeID objectID, uint zoom) const {
+	if (zoom >= PYRAMID_MAX_ZOOM) return nullptr;
+	auto const& pyramid = polygonPyramid[pyramidLevel(zoom)];
+	if (pyramid.empty()) return nullptr;
+	auto it = pyramid.find(objectID);
+	return it == pyramid.end() ? nullptr : &it->second;
 }
 
 // Copy objects from the tile at dstIndex (in the dataset srcTiles) into output
@@ -157,8 +740,40 @@ void TileDataSource::collectObjectsForTile(
 		iEnd = iStart + 1;
 	}
 
-	collectObjectsForTileTemplate<OutputObjectXY>(baseZoom, objects.begin(), iStart, iEnd, zoom, dstIndex, output);
-	collectObjectsForTileTemplate<OutputObjectXYID>(baseZoom, objectsWithIds.begin(), iStart, iEnd, zoom, dstIndex, output);
+	collectObjectsForTileTemplate<OutputObject>(baseZoom, objects.begin(), iStart, iEnd, zoom, dstIndex, output);
+	collectObjectsForTileTemplate<OutputObjectID>(baseZoom, objectsWithIds.begin(), iStart, iEnd, zoom, dstIndex, output);
+}
+
+size_t TileDataSource::countObjectsForTile(uint zoom, TileCoordinates dstIndex) const {
+	if (zoom < CLUSTER_ZOOM) {
+		// Add up the z6 tiles (or base zoom tiles, if that's lower) it covers
+		const uint clusterZoom = std::min<uint>(baseZoom, CLUSTER_ZOOM);
+		const size_t span = 1 << (clusterZoom - std::min(zoom, clusterZoom));
+		size_t count = 0;
+		for (size_t x = dstIndex.x * span; x < (dstIndex.x + 1) * span && x < CLUSTER_ZOOM_WIDTH; x++) {
+			for (size_t y = dstIndex.y * span; y < (dstIndex.y + 1) * span && y < CLUSTER_ZOOM_WIDTH; y++) {
+				count += objects[x * CLUSTER_ZOOM_WIDTH + y].size() + objectsWithIds[x * CLUSTER_ZOOM_WIDTH + y].size();
+			}
+		}
+		return count;
+	}
+
+	TileCoordinate z6x = dstIndex.x / (1 << (zoom - CLUSTER_ZOOM));
+	TileCoordinate z6y = dstIndex.y / (1 << (zoom - CLUSTER_ZOOM));
+	if (z6x >= 64 || z6y >= 64) return 0;
+	const size_t i = z6x * CLUSTER_ZOOM_WIDTH + z6y;
+	Z6Offset needleX = dstIndex.x * (1 << (baseZoom - zoom)) - z6x * z6OffsetDivisor;
+	Z6Offset needleY = dstIndex.y * (1 << (baseZoom - zoom)) - z6y * z6OffsetDivisor;
+
+	// Only the buckets that could be written at this zoom
+	size_t first, last, count = 0;
+	for (unsigned int bucket = 0; bucket < MINZOOM_BUCKETS && minZoomBucketStart(bucket) <= zoom; bucket++) {
+		objects[i].rangeForTile(needleX, needleY, baseZoom - zoom, bucket, first, last);
+		count += last - first;
+		objectsWithIds[i].rangeForTile(needleX, needleY, baseZoom - zoom, bucket, first, last);
+		count += last - first;
+	}
+	return count;
 }
 
 // Copy objects from the large index into output
@@ -172,15 +787,231 @@ void TileDataSource::collectLargeObjectsForTile(
 	TileCoordinates srcIndex2((dstIndex.x+1)*scale-1, (dstIndex.y+1)*scale-1);
 	Box box = Box(geom::make<Point>(srcIndex1.x, srcIndex1.y),
 	              geom::make<Point>(srcIndex2.x, srcIndex2.y));
-	for(auto const& result: boxRtree | boost::geometry::index::adaptors::queried(boost::geometry::index::intersects(box))) {
-		if (result.second.minZoom <= zoom)
-			output.push_back({result.second, 0});
+	// Buckets that start above this zoom have nothing to write
+	for (unsigned int bucket = 0; bucket < MINZOOM_BUCKETS && minZoomBucketStart(bucket) <= zoom; bucket++) {
+		for(auto const& result: boxRtree[bucket] | boost::geometry::index::adaptors::queried(boost::geometry::index::intersects(box))) {
+			if (result.second.minZoom <= zoom)
+				output.push_back({result.second, 0});
+		}
+
+		for(auto const& result: boxRtreeWithIds[bucket] | boost::geometry::index::adaptors::queried(boost::geometry::index::intersects(box))) {
+			if (result.second.oo.minZoom <= zoom)
+				output.push_back({result.second.oo, result.second.id});
+		}
 	}
+}
+
+// Linestrings shorter than this are cheap enough to clip from scratch
+#define CLIP_CACHE_MIN_POINTS 256
+
+// Polygons with fewer points than this are clipped without first testing
+// whether they cover the tile, as the test would cost about as much
+#define COVERS_BOX_MIN_POINTS 64
 
-	for(auto const& result: boxRtreeWithIds | boost::geometry::index::adaptors::queried(boost::geometry::index::intersects(box))) {
-		if (result.second.oo.minZoom <= zoom)
-			output.push_back({result.second.oo, result.second.id});
+// Does a multipolygon cover all of the box? Only if none of its rings touch
+// the box, and a corner of the box is inside a polygon whose envelope holds it.
+static bool coversBox(const MultiPolygon &input, const Box &box) {
+	auto ringTouches = [&](const Ring &ring) {
+		for (std::size_t i = 1; i < ring.size(); i++)
+			if (segment_intersects(ring[i-1], ring[i], box)) return true;
+		return false;
+	};
+	bool inside = false;
+	for (auto const &p : input) {
+		Box envelope;
+		geom::envelope(p.outer(), envelope);
+		if (!geom::intersects(envelope, box)) continue;
+		if (ringTouches(p.outer())) return false;
+		for (auto const &inner : p.inners())
+			if (ringTouches(inner)) return false;
+		if (!inside && geom::covered_by(box, envelope) && geom::within(box.min_corner(), p)) inside = true;
 	}
+	return inside;
+}
+
+bool TileDataSource::polygonCoversTile(NodeID const objectID, const TileBbox &bbox) const {
+	const MultiPolygon *simplified = pyramidPolygon(objectID, bbox.zoom);
+	if (simplified != nullptr) return coversBox(*simplified, bbox.clippingBox);
+	std::shared_ptr<MultiPolygon> cachedClip = multiPolygonClipCache.get(bbox.zoom, bbox.index.x, bbox.index.y, objectID);
+	return cachedClip != nullptr && coversBox(*cachedClip, bbox.clippingBox);
+}
+
+// Clip a multipolygon to the tile. At the end zoom, the box is widened (up to
+// the tile's buffer) to take in the whole of any edge that crosses its border.
+MultiPolygon TileDataSource::clipMultiPolygon(const MultiPolygon &input, const TileBbox &bbox) const {
+	TilePhaseTimer timer(TilePhase::Clip);
+
+	// A polygon covering the whole tile (open sea, a forest...) clips to the box
+	if (geom::num_points(input) >= COVERS_BOX_MIN_POINTS && coversBox(input, bbox.clippingBox)) {
+		MultiPolygon output;
+		output.resize(1);
+		geom::convert(bbox.clippingBox, output[0]);
+		return output;
+	}
+
+	Box box = bbox.clippingBox;
+	
+	if (bbox.endZoom) {
+		for(auto const &p: input) {
+			for(auto const &inner: p.inners()) {
+				for(std::size_t i = 0; i < inner.size() - 1; ++i) 
+				{
+					Point p1 = inner[i];
+					Point p2 = inner[i + 1];
+
+					if(geom::within(p1, bbox.clippingBox) != geom::within(p2, bbox.clippingBox)) {
+						box.min_corner() = Point(	
+							std::min(box.min_corner().x(), std::min(p1.x(), p2.x())), 
+							std::min(box.min_corner().y(), std::min(p1.y(), p2.y())));
+						box.max_corner() = Point(	
+							std::max(box.max_corner().x(), std::max(p1.x(), p2.x())), 
+							std::max(box.max_corner().y(), std::max(p1.y(), p2.y())));
+					}
+				}
+			}
+
+			for(std::size_t i = 0; i < p.outer().size() - 1; ++i) {
+				Point p1 = p.outer()[i];
+				Point p2 = p.outer()[i + 1];
+
+				if(geom::within(p1, bbox.clippingBox) != geom::within(p2, bbox.clippingBox)) {
+					box.min_corner() = Point(	
+						std::min(box.min_corner().x(), std::min(p1.x(), p2.x())), 
+						std::min(box.min_corner().y(), std::min(p1.y(), p2.y())));
+					box.max_corner() = Point(	
+						std::max(box.max_corner().x(), std::max(p1.x(), p2.x())), 
+						std::max(box.max_corner().y(), std::max(p1.y(), p2.y())));
+				}
+			}
+		}
+
+		Box extBox = bbox.getExtendBox();
+		box.min_corner() = Point(	
+			std::max(box.min_corner().x(), extBox.min_corner().x()), 
+			std::max(box.min_corner().y(), extBox.min_corner().y()));
+		box.max_corner() = Point(	
+			std::min(box.max_corner().x(), extBox.max_corner().x()), 
+			std::min(box.max_corner().y(), extBox.max_corner().y()));
+	}
+
+	MultiPolygon mp;
+	geom::assign(mp, input);
+	if (!fast_clip(mp, box)) {
+		// fast_clip couldn't separate a ring that leaves and re-enters the box
+		MultiPolygon output;
+		geom::intersection(input, box, output);
+		geom::correct(output);
+		return output;
+	}
+	geom::correct(mp);
+	geom::validity_failure_type failure = geom::validity_failure_type::no_failure;
+	if (!geom::is_valid(mp,failure)) { 
+		if (failure==geom::failure_spikes) {
+			geom::remove_spikes(mp);
+		} else if (failure==geom::failure_self_intersections || failure==geom::failure_intersecting_interiors) {
+			// retry with Boost intersection if fast_clip has caused self-intersections
+			MultiPolygon output;
+			geom::intersection(input, box, output);
+			geom::correct(output);
+			return output;
+		} else {
+			// occasionally also wrong_topological_dimension, disconnected_interior
+		}
+	}
+
+	return mp;
+}
+
+bool TileDataSource::sharesSimplified(OutputGeometryType geomType, NodeID objectID) {
+	const uint64_t key = (uint64_t(geomType) << 40) | objectID;
+	SharedSimplifyShard &shard = sharedSimplifyShards[std::hash<uint64_t>()(key) % SHARED_SIMPLIFY_SHARDS];
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto it = shard.big.find(key);
+		if (it != shard.big.end()) return it->second;
+	}
+
+	size_t points;
+	if (geomType == POLYGON_) {
+		MultiPolygon full;
+		populateMultiPolygon(full, objectID);
+		points = geom::num_points(full);
+	} else if (geomType == LINESTRING_) {
+		Linestring ls;
+		populateLinestring(ls, objectID);
+		points = ls.size();
+	} else {
+		MultiLinestring full;
+		retrieveMultiLinestring(objectID, full);
+		points = geom::num_points(full);
+	}
+	const bool big = points >= SHARED_SIMPLIFY_MIN_POINTS;
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	shard.big[key] = big;
+	return big;
+}
+
+bool TileDataSource::buildSimplifiedWayGeometry(OutputGeometryType geomType, NodeID objectID, uint layer,
+                                                const TileBbox &bbox, Geometry &output) {
+	const TileCoordinates key(geomType, layer);
+	if (geomType == POLYGON_) {
+		std::shared_ptr<MultiPolygon> simplified = simplifiedPolygonCache.getExact(bbox.zoom, key, objectID);
+		if (simplified == nullptr) return false;
+		output = clipMultiPolygon(*simplified, bbox);
+		return true;
+	}
+
+	std::shared_ptr<MultiLinestring> simplified = simplifiedLinestringCache.getExact(bbox.zoom, key, objectID);
+	if (simplified == nullptr) return false;
+	TilePhaseTimer timer(TilePhase::Clip);
+	MultiLinestring result;
+	geom::intersection(*simplified, bbox.getExtendBox(), result);
+	output = std::move(result);
+	return true;
+}
+
+Geometry TileDataSource::simplifyWayGeometry(OutputGeometryType geomType, NodeID objectID, uint layer,
+                                             const TileBbox &bbox, double simplifyLevel, bool fastSimplify) {
+	const TileCoordinates key(geomType, layer);
+	if (geomType == POLYGON_) {
+		// Start from the low-zoom copy if there is one: it's simplified by less than this
+		const MultiPolygon *pyramid = pyramidPolygon(objectID, bbox.zoom);
+		MultiPolygon full;
+		if (pyramid == nullptr) populateMultiPolygon(full, objectID);
+		MultiPolygon simplified;
+		{
+			TilePhaseTimer timer(TilePhase::Simplify);
+			simplified = simplify(pyramid ? *pyramid : full, simplifyLevel, fastSimplify);
+			geom::remove_spikes(simplified);
+		}
+		simplifiedPolygonCache.put(bbox.zoom, key, objectID, simplified);
+		return clipMultiPolygon(simplified, bbox);
+	}
+
+	MultiLinestring full;
+	if (const MultiLinestring *pyramid = pyramidLinestring(geomType, objectID, bbox.zoom)) {
+		full = *pyramid;
+	} else if (geomType == LINESTRING_) {
+		Linestring ls;
+		populateLinestring(ls, objectID);
+		full.push_back(std::move(ls));
+	} else {
+		retrieveMultiLinestring(objectID, full);
+	}
+	MultiLinestring simplified;
+	{
+		TilePhaseTimer timer(TilePhase::Simplify);
+		for (auto const &ls : full) {
+			Linestring part = simplify(ls, simplifyLevel);
+			if (part.size() > 1) simplified.push_back(std::move(part));
+		}
+	}
+	simplifiedLinestringCache.put(bbox.zoom, key, objectID, simplified);
+
+	TilePhaseTimer timer(TilePhase::Clip);
+	MultiLinestring result;
+	geom::intersection(simplified, bbox.getExtendBox(), result);
+	return result;
 }
 
 // Build node and way geometries
@@ -196,44 +1027,77 @@ Geometry TileDataSource::buildWayGeometry(OutputGeometryType const geomType,
 		}
 
 		case LINESTRING_: {
-			auto const &ls = retrieveLinestring(objectID);
+			auto const &ls = storedLinestring(objectID);
 
 			MultiLinestring out;
 			if(ls.empty())
 				return out;
+			TilePhaseTimer timer(TilePhase::Clip);
+
+			// Split into runs of segments that touch the tile
+			auto appendRuns = [&](auto const &input) {
+				Linestring current_ls;
+				geom::append(current_ls, input[0]);
+
+				for(size_t i = 1; i < input.size(); ++i) {
+					if(!segment_intersects(input[i-1], input[i], bbox.clippingBox)) {
+						if(current_ls.size() > 1)
+							out.push_back(std::move(current_ls));
+						current_ls.clear();
+					}
+					geom::append(current_ls, input[i]);
+				}
 
-			Linestring current_ls;
-			geom::append(current_ls, ls[0]);
+				if(current_ls.size() > 1)
+					out.push_back(std::move(current_ls));
+			};
 
-			for(size_t i = 1; i < ls.size(); ++i) {
-				if(!geom::intersects(Linestring({ ls[i-1], ls[i] }), bbox.clippingBox)) {
-					if(current_ls.size() > 1)
-						out.push_back(std::move(current_ls));
-					current_ls.clear();
-				}
-				geom::append(current_ls, ls[i]);
+			// At low zooms, long ways are clipped from a simplified copy
+			if (const MultiLinestring *simplified = pyramidLinestring(LINESTRING_, objectID, bbox.zoom)) {
+				MultiLinestring result;
+				geom::intersection(*simplified, bbox.getExtendBox(), result);
+				return result;
 			}
 
-			if(current_ls.size() > 1)
-				out.push_back(std::move(current_ls));
+			// Long ways (coastlines, ferry routes...) start from a previously
+			// clipped version at z-1, z-2, ... if there is one
+			const bool useCache = ls.size() >= CLIP_CACHE_MIN_POINTS;
+			std::shared_ptr<MultiLinestring> cachedClip = useCache ?
+				linestringClipCache.get(bbox.zoom, bbox.index.x, bbox.index.y, objectID) : nullptr;
+
+			if (cachedClip == nullptr) {
+				Linestring full;
+				retrieveLinestring(objectID, full);
+				appendRuns(full);
+			} else
+				for (auto const &part : *cachedClip)
+					if (!part.empty()) appendRuns(part);
 
 			MultiLinestring result;
 			geom::intersection(out, bbox.getExtendBox(), result);
+			if (useCache)
+				linestringClipCache.add(bbox, objectID, result);
 			return result;
 		}
 
 		case MULTILINESTRING_: {
+			if (const MultiLinestring *simplified = pyramidLinestring(MULTILINESTRING_, objectID, bbox.zoom)) {
+				TilePhaseTimer timer(TilePhase::Clip);
+				MultiLinestring result;
+				geom::intersection(*simplified, bbox.getExtendBox(), result);
+				return result;
+			}
+
 			// Look for a previously clipped version at z-1, z-2, ...
 			std::shared_ptr<MultiLinestring> cachedClip = multiLinestringClipCache.get(bbox.zoom, bbox.index.x, bbox.index.y, objectID);
 
 			MultiLinestring uncached;
 
-			if (cachedClip == nullptr) {
-				const auto& input = retrieveMultiLinestring(objectID);
-				boost::geometry::assign(uncached, input);
-			}
+			if (cachedClip == nullptr)
+				retrieveMultiLinestring(objectID, uncached);
 
 			const auto &mls = cachedClip == nullptr ? uncached : *cachedClip;
+			TilePhaseTimer timer(TilePhase::Clip);
 
 			// investigate whether filtering the constituent linestrings improves performance
 			MultiLinestring result;
@@ -243,85 +1107,25 @@ Geometry TileDataSource::buildWayGeometry(OutputGeometryType const geomType,
 		}
 
 		case POLYGON_: {
-			// Look for a previously clipped version at z-1, z-2, ...
-			std::shared_ptr<MultiPolygon> cachedClip = multiPolygonClipCache.get(bbox.zoom, bbox.index.x, bbox.index.y, objectID);
+			// At low zooms, large polygons are clipped from a simplified copy. Those
+			// clips aren't cached, as higher zooms need the full geometry.
+			const MultiPolygon *simplified = pyramidPolygon(objectID, bbox.zoom);
+
+			// Otherwise, look for a previously clipped version at z-1, z-2, ...
+			std::shared_ptr<MultiPolygon> cachedClip = simplified == nullptr ?
+				multiPolygonClipCache.get(bbox.zoom, bbox.index.x, bbox.index.y, objectID) : nullptr;
 
 			MultiPolygon uncached;
 
-			if (cachedClip == nullptr) {
+			if (simplified == nullptr && cachedClip == nullptr) {
 				// The cached multipolygon uses a non-standard allocator, so copy it
 				populateMultiPolygon(uncached, objectID);
 			}
 
-			const auto &input = cachedClip == nullptr ? uncached : *cachedClip;
-
-			Box box = bbox.clippingBox;
-			
-			if (bbox.endZoom) {
-				for(auto const &p: input) {
-					for(auto const &inner: p.inners()) {
-						for(std::size_t i = 0; i < inner.size() - 1; ++i) 
-						{
-							Point p1 = inner[i];
-							Point p2 = inner[i + 1];
-
-							if(geom::within(p1, bbox.clippingBox) != geom::within(p2, bbox.clippingBox)) {
-								box.min_corner() = Point(	
-									std::min(box.min_corner().x(), std::min(p1.x(), p2.x())), 
-									std::min(box.min_corner().y(), std::min(p1.y(), p2.y())));
-								box.max_corner() = Point(	
-									std::max(box.max_corner().x(), std::max(p1.x(), p2.x())), 
-									std::max(box.max_corner().y(), std::max(p1.y(), p2.y())));
-							}
-						}
-					}
-
-					for(std::size_t i = 0; i < p.outer().size() - 1; ++i) {
-						Point p1 = p.outer()[i];
-						Point p2 = p.outer()[i + 1];
-
-						if(geom::within(p1, bbox.clippingBox) != geom::within(p2, bbox.clippingBox)) {
-							box.min_corner() = Point(	
-								std::min(box.min_corner().x(), std::min(p1.x(), p2.x())), 
-								std::min(box.min_corner().y(), std::min(p1.y(), p2.y())));
-							box.max_corner() = Point(	
-								std::max(box.max_corner().x(), std::max(p1.x(), p2.x())), 
-								std::max(box.max_corner().y(), std::max(p1.y(), p2.y())));
-						}
-					}
-				}
-
-				Box extBox = bbox.getExtendBox();
-				box.min_corner() = Point(	
-					std::max(box.min_corner().x(), extBox.min_corner().x()), 
-					std::max(box.min_corner().y(), extBox.min_corner().y()));
-				box.max_corner() = Point(	
-					std::min(box.max_corner().x(), extBox.max_corner().x()), 
-					std::min(box.max_corner().y(), extBox.max_corner().y()));
-			}
-
-			MultiPolygon mp;
-			geom::assign(mp, input);
-			fast_clip(mp, box);
-			geom::correct(mp);
-			geom::validity_failure_type failure = geom::validity_failure_type::no_failure;
-			if (!geom::is_valid(mp,failure)) { 
-				if (failure==geom::failure_spikes) {
-					geom::remove_spikes(mp);
-				} else if (failure==geom::failure_self_intersections || failure==geom::failure_intersecting_interiors) {
-					// retry with Boost intersection if fast_clip has caused self-intersections
-					MultiPolygon output;
-					geom::intersection(input, box, output);
-					geom::correct(output);
-					multiPolygonClipCache.add(bbox, objectID, output);
-					return output;
-				} else {
-					// occasionally also wrong_topological_dimension, disconnected_interior
-				}
-			}
-
-			multiPolygonClipCache.add(bbox, objectID, mp);
-			return mp;
+			const auto &input = simplified != nullptr ? *simplified : cachedClip == nullptr ? uncached : *cachedClip;
+			MultiPolygon output = clipMultiPolygon(input, bbox);
+			if (simplified == nullptr) multiPolygonClipCache.add(bbox, objectID, output);
+			return output;
 		}
 
 		default:
@@ -332,13 +1136,8 @@ Geometry TileDataSource::buildWayGeometry(OutputGeometryType const geomType,
 LatpLon TileDataSource::buildNodeGeometry(OutputGeometryType const geomType, 
                                           NodeID const objectID, const TileBbox &bbox) const {
 	switch(geomType) {
-		case POINT_: {
-			auto p = retrievePoint(objectID);
-			LatpLon out;
-			out.latp = p.y();
-			out.lon  = p.x();
-			return out;
-		}
+		case POINT_:
+			return storedPoint(objectID);
 
 		default:
 			break;
@@ -364,49 +1163,116 @@ void TileDataSource::reportSize() const {
 		polygons += store.size();
 
 	std::cout << "Generated points: " << (points - 1) << ", lines: " << (linestrings - 2) << ", polygons: " << (polygons - 1) << std::endl;
+	if (spilledBytes > 0)
+		std::cout << "Spilled " << (spilledBytes / 1000000) << "MB of output objects to disk" << std::endl;
 }
 
-TileCoordinatesSet getTilesAtZoom(
-	const std::vector<class TileDataSource *>& sources,
-	unsigned int zoom
+// More sorted runs than this in a tile's small objects, and they're sorted afresh
+#define MAX_MERGED_RUNS 16
+
+// Only the first featureLimit objects of a limited layer, in output order,
+// are written, so rather than sorting a layer that has more than that,
+// select them with nth_element and drop the rest. The same object can be
+// collected from several keys, so the selection grows until it holds
+// enough distinct objects.
+//
+// The objects of other layers keep their order. The selected ones are
+// moved to the end, with the large objects, which are sorted anyway.
+// Returns the new number of small objects.
+static size_t selectFeatureLimits(
+	std::vector<OutputObjectID>& data,
+	size_t smallCount,
+	const std::vector<uint>& featureLimits,
+	const OutputObjectOrder& order
 ) {
-	TileCoordinatesSet tileCoordinates(zoom);
-
-	for(size_t i=0; i<sources.size(); i++) {
-		sources[i]->collectTilesWithObjectsAtZoom(zoom, tileCoordinates);
-		sources[i]->collectTilesWithLargeObjectsAtZoom(zoom, tileCoordinates);
+	// Count the objects in each limited layer; a count of 0 marks a layer that's within its limit
+	thread_local std::vector<size_t> counts;
+	counts.assign(featureLimits.size(), 0);
+	for (auto const& oo : data)
+		if (oo.oo.layer < featureLimits.size() && featureLimits[oo.oo.layer] > 0) counts[oo.oo.layer]++;
+	bool over = false;
+	for (size_t l = 0; l < counts.size(); l++) {
+		if (counts[l] > featureLimits[l]) over = true;
+		else counts[l] = 0;
 	}
-
-	return tileCoordinates;
+	if (!over) return smallCount;
+	auto limited = [&](const OutputObjectID& oo) { return oo.oo.layer < counts.size() && counts[oo.oo.layer] > 0; };
+
+	thread_local std::vector<OutputObjectID> candidates;
+	candidates.clear();
+	size_t kept = 0, keptSmall = smallCount;
+	for (size_t i = 0; i < data.size(); i++) {
+		if (i == smallCount) keptSmall = kept;
+		if (limited(data[i])) candidates.push_back(data[i]);
+		else data[kept++] = data[i];
+	}
+	if (smallCount == data.size()) keptSmall = kept;
+	data.erase(data.begin() + kept, data.end());
+
+	auto layerStart = candidates.begin();
+	for (size_t l = 0; l < counts.size(); l++) {
+		if (counts[l] == 0) continue;
+		const auto layerEnd = std::partition(layerStart, candidates.end(), [l](const OutputObjectID& oo) { return oo.oo.layer == l; });
+		const size_t total = layerEnd - layerStart, limit = featureLimits[l];
+		size_t selected = limit, distinct = 0;
+		while (true) {
+			if (selected < total) std::nth_element(layerStart, layerStart + selected, layerEnd, order);
+			boost::sort::pdqsort(layerStart, layerStart + selected, order);
+			distinct = 1;
+			for (auto it = layerStart + 1; it != layerStart + selected; ++it)
+				if (!(*it == *(it - 1))) distinct++;
+			if (distinct >= limit || selected == total) break;
+			selected = std::min(total, selected * 2);
+		}
+		size_t added = 0;
+		for (auto it = layerStart; it != layerStart + selected && added < limit; ++it)
+			if (it == layerStart || !(*it == *(it - 1))) { data.push_back(*it); added++; }
+		layerStart = layerEnd;
+	}
+	return keptSmall;
 }
 
-std::vector<OutputObjectID> TileDataSource::getObjectsForTile(
+void TileDataSource::getObjectsForTile(
 	const std::vector<bool>& sortOrders, 
+	const std::vector<uint>& featureLimits,
 	unsigned int zoom,
-	TileCoordinates coordinates
+	TileCoordinates coordinates,
+	std::vector<OutputObjectID>& data
 ) {
-	std::vector<OutputObjectID> data;
+	data.clear();
 	collectObjectsForTile(zoom, coordinates, data);
+	size_t smallCount = data.size();
 	collectLargeObjectsForTile(zoom, coordinates, data);
 
-	// Lexicographic comparison, with the order of: layer, geomType, attributes, and objectID.
-	// Note that attributes is preferred to objectID.
-	// It is to arrange objects with the identical attributes continuously.
-	// Such objects will be merged into one object, to reduce the size of output.
-	boost::sort::pdqsort(data.begin(), data.end(), [&sortOrders](const OutputObjectID& x, const OutputObjectID& y) -> bool {
-		if (x.oo.layer < y.oo.layer) return true;
-		if (x.oo.layer > y.oo.layer) return false;
-		if (x.oo.z_order < y.oo.z_order) return  sortOrders[x.oo.layer];
-		if (x.oo.z_order > y.oo.z_order) return !sortOrders[x.oo.layer];
-		if (x.oo.geomType < y.oo.geomType) return true;
-		if (x.oo.geomType > y.oo.geomType) return false;
-		if (x.oo.attributes < y.oo.attributes) return true;
-		if (x.oo.attributes > y.oo.attributes) return false;
-		if (x.oo.objectID < y.oo.objectID) return true;
-		return false;
-	});
+	const OutputObjectOrder order{sortOrders};
+	smallCount = selectFeatureLimits(data, smallCount, featureLimits, order);
+
+	// Small objects were sorted within each key at finalize, so they arrive
+	// as one sorted run per key (per z6 tile, below z6). When there are only
+	// a few runs, as at the base zoom, merging them is cheaper than sorting.
+	std::vector<size_t> runStarts { 0 };
+	for (size_t i = 1; i < smallCount && runStarts.size() <= MAX_MERGED_RUNS; i++)
+		if (order(data[i], data[i - 1])) runStarts.push_back(i);
+	if (runStarts.size() > MAX_MERGED_RUNS) {
+		boost::sort::pdqsort(data.begin(), data.begin() + smallCount, order);
+	} else {
+		runStarts.push_back(smallCount);
+		while (runStarts.size() > 2) {
+			std::vector<size_t> merged;
+			for (size_t r = 0; r + 2 < runStarts.size(); r += 2) {
+				std::inplace_merge(data.begin() + runStarts[r], data.begin() + runStarts[r + 1], data.begin() + runStarts[r + 2], order);
+				merged.push_back(runStarts[r]);
+			}
+			if (runStarts.size() % 2 == 0) merged.push_back(runStarts[runStarts.size() - 2]);
+			merged.push_back(smallCount);
+			runStarts.swap(merged);
+		}
+	}
+
+	// Large objects come from the rtree in no particular order
+	boost::sort::pdqsort(data.begin() + smallCount, data.end(), order);
+	std::inplace_merge(data.begin(), data.begin() + smallCount, data.end(), order);
 	data.erase(unique(data.begin(), data.end()), data.end());
-	return data;
 }
 
 // ------------------------------------
@@ -527,44 +1393,86 @@ void TileDataSource::addGeometryToIndex(
 	}
 }
 
+// Vertices of stored geometries, in the same fixed point as the node store
+static inline LatpLon toStored(const Point& p) {
+	return LatpLon { int32_t(std::lround(p.y() * 10000000.0)), int32_t(std::lround(p.x() * 10000000.0)) };
+}
+static inline Point fromStored(const LatpLon& ll) {
+	return Point(ll.lon / 10000000.0, ll.latp / 10000000.0);
+}
+template<class Out, class In> static void storeRange(Out& out, const In& in) {
+	out.resize(in.size());
+	std::transform(in.begin(), in.end(), out.begin(), toStored);
+}
+template<class Out, class In> static void retrieveRange(Out& out, const In& in) {
+	out.resize(in.size());
+	std::transform(in.begin(), in.end(), out.begin(), fromStored);
+}
+
 NodeID TileDataSource::storePoint(const Point& input) {
 	const auto& store = pointStore.get(this);
 
-	NodeID offset = store.second->size();
-	store.second->emplace_back(input);
-	NodeID rv = (store.first << (35 - shardBits)) + offset;
+	// Points are already scaled by 10^7
+	NodeID rv = storeId(store.first, store.second->size());
+	store.second->emplace_back(LatpLon { int32_t(std::lround(input.y())), int32_t(std::lround(input.x())) });
 	return rv;
 }
 
 NodeID TileDataSource::storeLinestring(const Linestring& src) {
 	const auto& store = linestringStore.get(this);
-	linestring_t dst(src.begin(), src.end());
+	linestring_t dst;
+	storeRange(dst, src);
 
-	NodeID offset = store.second->size();
+	NodeID rv = storeId(store.first, store.second->size());
 	store.second->emplace_back(std::move(dst));
-	NodeID rv = (store.first << (35 - shardBits)) + offset;
 	return rv;
 }
 
-NodeID TileDataSource::storeMultiPolygon(const MultiPolygon& src) {
-	const auto& store = multipolygonStore.get(this);
-
-	multi_polygon_t dst;
+// Snap a multipolygon to the stored fixed point; returns whether any vertex moved
+static bool storeMultiPolygonRange(TileDataSource::multi_polygon_t& dst, const MultiPolygon& src) {
+	bool moved = false;
+	auto store = [&](TileDataSource::multi_polygon_t::value_type::ring_type& out, const Ring& in) {
+		storeRange(out, in);
+		for (std::size_t i = 0; i < in.size() && !moved; ++i) {
+			const Point p = fromStored(out[i]);
+			moved = p.x() != in[i].x() || p.y() != in[i].y();
+		}
+	};
 	dst.resize(src.size());
 	for(std::size_t i = 0; i < src.size(); ++i) {
-		dst[i].outer().resize(src[i].outer().size());
-		boost::geometry::assign(dst[i].outer(), src[i].outer());
+		store(dst[i].outer(), src[i].outer());
 
 		dst[i].inners().resize(src[i].inners().size());
-		for(std::size_t j = 0; j < src[i].inners().size(); ++j) {
-			dst[i].inners()[j].resize(src[i].inners()[j].size());
-			boost::geometry::assign(dst[i].inners()[j], src[i].inners()[j]);
+		for(std::size_t j = 0; j < src[i].inners().size(); ++j)
+			store(dst[i].inners()[j], src[i].inners()[j]);
+	}
+	return moved;
+}
+
+NodeID TileDataSource::storeMultiPolygon(const MultiPolygon& src) {
+	const auto& store = multipolygonStore.get(this);
+
+	// Snapping to 1e-7 degrees can make a polygon that wasn't made from OSM
+	// nodes (from a shapefile, or an operation in Lua) touch or cross itself,
+	// so if any vertex moved, it's checked, and repaired if it needs to be
+	multi_polygon_t dst;
+	if (storeMultiPolygonRange(dst, src)) {
+		MultiPolygon snapped;
+		snapped.resize(dst.size());
+		for (std::size_t i = 0; i < dst.size(); ++i) {
+			retrieveRange(snapped[i].outer(), dst[i].outer());
+			snapped[i].inners().resize(dst[i].inners().size());
+			for (std::size_t j = 0; j < dst[i].inners().size(); ++j)
+				retrieveRange(snapped[i].inners()[j], dst[i].inners()[j]);
+		}
+		if (!is_simple_valid(snapped) && !geom::is_valid(snapped)) {
+			make_valid(snapped);
+			storeMultiPolygonRange(dst, snapped);
 		}
 	}
 
-	NodeID offset = store.second->size();
+	NodeID rv = storeId(store.first, store.second->size());
 	store.second->emplace_back(std::move(dst));
-	NodeID rv = (store.first << (35 - shardBits)) + offset;
 	return rv;
 }
 
@@ -574,16 +1482,184 @@ NodeID TileDataSource::storeMultiLinestring(const MultiLinestring& src) {
 	multi_linestring_t dst;
 	dst.resize(src.size());
 	for (std::size_t i=0; i<src.size(); ++i) {
-		boost::geometry::assign(dst[i], src[i]);
+		storeRange(dst[i], src[i]);
 	}
 
-	NodeID offset = store.second->size();
+	NodeID rv = storeId(store.first, store.second->size());
 	store.second->emplace_back(std::move(dst));
-	NodeID rv = (store.first << (35 - shardBits)) + offset;
 	return rv;
 }
 
+void TileDataSource::retrieveLinestring(NodeID id, Linestring& out) const {
+	retrieveRange(out, storedLinestring(id));
+}
+
+void TileDataSource::retrieveMultiLinestring(NodeID id, MultiLinestring& out) const {
+	const auto &input = storedMultiLinestring(id);
+	out.resize(input.size());
+	for (std::size_t i = 0; i < input.size(); ++i)
+		retrieveRange(out[i], input[i]);
+}
+
+void TileDataSource::retrieveMultiPolygon(NodeID id, MultiPolygon& out) const {
+	const auto &input = storedMultiPolygon(id);
+	out.resize(input.size());
+	for (std::size_t i = 0; i < input.size(); ++i) {
+		retrieveRange(out[i].outer(), input[i].outer());
+		out[i].inners().resize(input[i].inners().size());
+		for (std::size_t j = 0; j < input[i].inners().size(); ++j)
+			retrieveRange(out[i].inners()[j], input[i].inners()[j]);
+	}
+}
+
 void TileDataSource::populateMultiPolygon(MultiPolygon& dst, NodeID objectID) {
-	const auto &input = retrieveMultiPolygon(objectID);
-	boost::geometry::assign(dst, input);
+	retrieveMultiPolygon(objectID, dst);
+}
+
+void TileDataSource::populateLinestring(Linestring& ls, NodeID objectID) {
+	retrieveLinestring(objectID, ls);
+}
+
+// ------------------------------------
+// Snapshots
+
+template<typename T> void saveClusteredObjects(const ClusteredObjects<T>& cluster, SnapshotWriter& out) {
+	out.put<uint64_t>(cluster.size());
+	if (!cluster.packed.empty()) {
+		std::vector<Z6OffsetKey> keys;
+		std::vector<T> objects;
+		cluster.packed.unpack(keys, objects);
+		out.putArray(keys.data(), keys.size() * sizeof(Z6OffsetKey));
+		out.putArray(objects.data(), objects.size() * sizeof(T));
+		return;
+	}
+	out.putArray(cluster.keyData(), cluster.size() * sizeof(Z6OffsetKey));
+	out.putArray(cluster.objectData(), cluster.size() * sizeof(T));
+}
+
+// Point a z6 tile's arrays into the snapshot, as for a spill file
+template<typename T> void loadClusteredObjects(ClusteredObjects<T>& cluster, SnapshotReader& in) {
+	cluster.clear();
+	const uint64_t count = in.get<uint64_t>();
+	const void *keys = in.getArray(count * sizeof(Z6OffsetKey));
+	const void *objects = in.getArray(count * sizeof(T));
+	if (count == 0)
+		return;
+	cluster.mappedKeys = static_cast<const Z6OffsetKey*>(keys);
+	cluster.mappedObjects = static_cast<const T*>(objects);
+	cluster.mappedCount = count;
+	cluster.findBuckets();
+}
+
+template<typename V> void saveLargeObjects(const boost::geometry::index::rtree<V, boost::geometry::index::quadratic<128>> *rtrees, SnapshotWriter& out) {
+	std::vector<V> values;
+	for (unsigned int bucket = 0; bucket < MINZOOM_BUCKETS; bucket++)
+		values.insert(values.end(), rtrees[bucket].begin(), rtrees[bucket].end());
+	out.put<uint64_t>(values.size());
+	out.putArray(values.data(), values.size() * sizeof(V));
+}
+
+void TileDataSource::saveSnapshot(SnapshotWriter &out) const {
+	out.put<uint32_t>(baseZoom);
+	out.put<uint8_t>(includeID);
+	for (size_t i = 0; i < CLUSTER_ZOOM_AREA; i++) {
+		saveClusteredObjects(objects[i], out);
+		saveClusteredObjects(objectsWithIds[i], out);
+	}
+	saveLargeObjects(boxRtree, out);
+	saveLargeObjects(boxRtreeWithIds, out);
+
+	// Generated geometries are numbered by shard, so the shards are kept as they are
+	out.put<uint32_t>(shardBits);
+	out.put<uint64_t>(pointStores.size());
+	for (const point_store_t& store : pointStores) out.putPoints(store);
+	for (const linestring_store_t& store : linestringStores) {
+		out.put<uint64_t>(store.size());
+		for (const linestring_t& ls : store) out.putPoints(ls);
+	}
+	for (const multi_linestring_store_t& store : multilinestringStores) {
+		out.put<uint64_t>(store.size());
+		for (const multi_linestring_t& mls : store) {
+			out.put<uint64_t>(mls.size());
+			for (const linestring_t& ls : mls) out.putPoints(ls);
+		}
+	}
+	for (const multi_polygon_store_t& store : multipolygonStores) {
+		out.put<uint64_t>(store.size());
+		for (const multi_polygon_t& mp : store) {
+			out.put<uint64_t>(mp.size());
+			for (const polygon_t& poly : mp) {
+				out.putPoints(poly.outer());
+				out.put<uint64_t>(poly.inners().size());
+				for (const auto& inner : poly.inners()) out.putPoints(inner);
+			}
+		}
+	}
+}
+
+void TileDataSource::loadSnapshot(SnapshotReader &in) {
+	if (in.get<uint32_t>() != baseZoom || bool(in.get<uint8_t>()) != includeID)
+		throw std::runtime_error("snapshot has a different base zoom or include_ids");
+
+	// Small objects stay in the mapping; the tiles they're in are marked again
+	for (size_t i = 0; i < CLUSTER_ZOOM_AREA; i++) {
+		loadClusteredObjects(objects[i], in);
+		loadClusteredObjects(objectsWithIds[i], in);
+		const TileCoordinate z6x = i / CLUSTER_ZOOM_WIDTH, z6y = i % CLUSTER_ZOOM_WIDTH;
+		auto markTiles = [&](const Z6OffsetKey *keys, size_t count) {
+			for (size_t j = 0; j < count; j++) {
+				if (j > 0 && keys[j] == keys[j - 1]) continue;
+				Z6Offset x, y;
+				z6OffsetFromKey(keys[j], x, y);
+				smallObjectTiles.set(z6x * z6OffsetDivisor + x, z6y * z6OffsetDivisor + y);
+			}
+		};
+		markTiles(objects[i].keyData(), objects[i].size());
+		markTiles(objectsWithIds[i].keyData(), objectsWithIds[i].size());
+	}
+
+	// Large objects go through the buffers as if they'd just been added, ready for finalize()
+	uint64_t count = in.get<uint64_t>();
+	const auto *large = static_cast<const std::pair<Box,OutputObject>*>(in.getArray(count * sizeof(std::pair<Box,OutputObject>)));
+	for (uint64_t i = 0; i < count; i++)
+		addObjectToLargeIndex(large[i].first, large[i].second, 0);
+	count = in.get<uint64_t>();
+	const auto *largeWithIds = static_cast<const std::pair<Box,OutputObjectID>*>(in.getArray(count * sizeof(std::pair<Box,OutputObjectID>)));
+	for (uint64_t i = 0; i < count; i++)
+		addObjectToLargeIndex(largeWithIds[i].first, largeWithIds[i].second.oo, largeWithIds[i].second.id);
+
+	shardBits = in.get<uint32_t>();
+	numShards = size_t(1) << shardBits;
+	const uint64_t shards = in.get<uint64_t>();
+	if (shards > numShards) throw std::runtime_error("snapshot has too many geometry shards");
+	std::vector<point_store_t>(shards).swap(pointStores);
+	std::vector<linestring_store_t>(shards).swap(linestringStores);
+	std::vector<multi_linestring_store_t>(shards).swap(multilinestringStores);
+	std::vector<multi_polygon_store_t>(shards).swap(multipolygonStores);
+	for (point_store_t& store : pointStores) in.getPoints(store);
+	for (linestring_store_t& store : linestringStores) {
+		store.resize(in.get<uint64_t>());
+		for (linestring_t& ls : store) in.getPoints(ls);
+	}
+	for (multi_linestring_store_t& store : multilinestringStores) {
+		store.resize(in.get<uint64_t>());
+		for (multi_linestring_t& mls : store) {
+			mls.resize(in.get<uint64_t>());
+			for (linestring_t& ls : mls) in.getPoints(ls);
+		}
+	}
+	for (multi_polygon_store_t& store : multipolygonStores) {
+		store.resize(in.get<uint64_t>());
+		for (multi_polygon_t& mp : store) {
+			mp.resize(in.get<uint64_t>());
+			for (polygon_t& poly : mp) {
+				in.getPoints(poly.outer());
+				poly.inners().resize(in.get<uint64_t>());
+				for (auto& inner : poly.inners()) in.getPoints(inner);
+			}
+		}
+	}
+
+	// The stores have moved, so hand out leases on the new ones
+	openStores(shards);
 }
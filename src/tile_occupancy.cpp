@@ -0,0 +1,158 @@
+#include "tile_occupancy.h"
+
+TileOccupancy::TileOccupancy(uint baseZoom, uint cellZoom):
+	baseZoom(baseZoom),
+	cellZoom(std::min(cellZoom, baseZoom)),
+	levels(baseZoom - std::min(cellZoom, baseZoom)),
+	cells(size_t(1) << (2 * std::min(cellZoom, baseZoom)))
+{
+	chunksPerCell = 0;
+	for (uint level = 0; level <= levels; level++) {
+		chunkOffset.push_back(chunksPerCell);
+		chunksPerCell += 2 * level > OCCUPANCY_CHUNK_BITS ? size_t(1) << (2 * level - OCCUPANCY_CHUNK_BITS) : 1;
+	}
+	for (auto& cell : cells)
+		cell.store(nullptr);
+}
+
+TileOccupancy::~TileOccupancy() {
+	clear();
+}
+
+void TileOccupancy::clear() {
+	for (auto& slot : cells) {
+		Chunk* cell = slot.exchange(nullptr);
+		if (!cell) continue;
+		for (size_t c = 0; c < chunksPerCell; c++)
+			delete[] cell[c].load();
+		delete[] cell;
+	}
+}
+
+// Find (or make) an array of n items, in slot, that other threads may be making too
+template<typename T> static T* allocateOnce(std::atomic<T*>& slot, size_t n) {
+	T* existing = slot.load(std::memory_order_acquire);
+	if (existing)
+		return existing;
+	T* created = new T[n]();
+	if (slot.compare_exchange_strong(existing, created, std::memory_order_acq_rel))
+		return created;
+	delete[] created;
+	return existing;
+}
+
+TileOccupancy::Chunk* TileOccupancy::cellFor(uint32_t cell) {
+	return allocateOnce(cells[cell], chunksPerCell);
+}
+
+TileOccupancy::Word* TileOccupancy::chunkFor(Chunk* cell, uint level, uint64_t morton) {
+	return allocateOnce(cell[chunkOffset[level] + (morton >> OCCUPANCY_CHUNK_BITS)], chunkWords(level));
+}
+
+bool TileOccupancy::testBit(const Chunk* cell, uint level, uint64_t morton) const {
+	const Word* chunk = cell[chunkOffset[level] + (morton >> OCCUPANCY_CHUNK_BITS)].load(std::memory_order_acquire);
+	if (!chunk)
+		return false;
+	const uint64_t within = morton & ((uint64_t(1) << OCCUPANCY_CHUNK_BITS) - 1);
+	return chunk[within >> 6].load(std::memory_order_relaxed) & (uint64_t(1) << (within & 63));
+}
+
+void TileOccupancy::setBit(Chunk* cell, uint level, uint64_t morton) {
+	Word* chunk = chunkFor(cell, level, morton);
+	const uint64_t within = morton & ((uint64_t(1) << OCCUPANCY_CHUNK_BITS) - 1);
+	const uint64_t mask = uint64_t(1) << (within & 63);
+	// Most tiles are set many times over, so only write if the bit isn't set yet
+	Word& word = chunk[within >> 6];
+	if (!(word.load(std::memory_order_relaxed) & mask))
+		word.fetch_or(mask, std::memory_order_relaxed);
+}
+
+// Set the bits [first, end) in Morton order at a level
+void TileOccupancy::setRange(Chunk* cell, uint level, uint64_t first, uint64_t end) {
+	while (first < end) {
+		Word* chunk = chunkFor(cell, level, first);
+		const uint64_t chunkEnd = std::min(end, ((first >> OCCUPANCY_CHUNK_BITS) + 1) << OCCUPANCY_CHUNK_BITS);
+		while (first < chunkEnd) {
+			const uint64_t within = first & ((uint64_t(1) << OCCUPANCY_CHUNK_BITS) - 1);
+			const uint64_t count = std::min<uint64_t>(chunkEnd - first, 64 - (within & 63));
+			const uint64_t mask = (count == 64 ? ~uint64_t(0) : ((uint64_t(1) << count) - 1)) << (within & 63);
+			Word& word = chunk[within >> 6];
+			if ((word.load(std::memory_order_relaxed) & mask) != mask)
+				word.fetch_or(mask, std::memory_order_relaxed);
+			first += count;
+		}
+	}
+}
+
+// Set the tile x, y at a level, and those below it that are in the box
+// x1, y1 - x2, y2 (at the deepest level). A tile wholly inside the box has
+// all the tiles below it set, which are a contiguous run in Morton order.
+void TileOccupancy::fillBox(Chunk* cell, uint level, uint32_t x, uint32_t y,
+                            uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2) {
+	const uint shift = levels - level;
+	const uint32_t minX = x << shift, minY = y << shift;
+	const uint32_t maxX = minX + (1u << shift) - 1, maxY = minY + (1u << shift) - 1;
+	if (maxX < x1 || minX > x2 || maxY < y1 || minY > y2)
+		return;
+
+	const uint64_t morton = interleaveBits(x, y);
+	setBit(cell, level, morton);
+	if (minX >= x1 && maxX <= x2 && minY >= y1 && maxY <= y2) {
+		for (uint d = 1; d <= shift; d++)
+			setRange(cell, level + d, morton << (2 * d), (morton + 1) << (2 * d));
+		return;
+	}
+	for (uint32_t dx = 0; dx < 2; dx++)
+		for (uint32_t dy = 0; dy < 2; dy++)
+			fillBox(cell, level + 1, x * 2 + dx, y * 2 + dy, x1, y1, x2, y2);
+}
+
+void TileOccupancy::set(TileCoordinate x, TileCoordinate y) {
+	const uint32_t cx = x >> levels, cy = y >> levels;
+	if (cx >= cellWidth() || cy >= cellWidth())
+		return;
+	Chunk* cell = cellFor((cx << cellZoom) + cy);
+	const uint32_t ox = x - (cx << levels), oy = y - (cy << levels);
+
+	// If the tile is already set, so are all those above it
+	if (testBit(cell, levels, interleaveBits(ox, oy)))
+		return;
+	for (uint level = 0; level <= levels; level++)
+		setBit(cell, level, interleaveBits(ox >> (levels - level), oy >> (levels - level)));
+}
+
+void TileOccupancy::setBox(TileCoordinate minX, TileCoordinate minY, TileCoordinate maxX, TileCoordinate maxY) {
+	const uint32_t last = (uint32_t(1) << baseZoom) - 1;
+	const uint32_t x1 = minX, y1 = minY;
+	const uint32_t x2 = std::min<uint32_t>(maxX, last), y2 = std::min<uint32_t>(maxY, last);
+	if (x1 > x2 || y1 > y2)
+		return;
+
+	const uint32_t span = (uint32_t(1) << levels) - 1;
+	for (uint32_t cx = x1 >> levels; cx <= x2 >> levels; cx++) {
+		for (uint32_t cy = y1 >> levels; cy <= y2 >> levels; cy++) {
+			const uint32_t originX = cx << levels, originY = cy << levels;
+			fillBox(cellFor((cx << cellZoom) + cy), 0, 0, 0,
+			        std::max(x1, originX) - originX, std::max(y1, originY) - originY,
+			        std::min(x2, originX + span) - originX, std::min(y2, originY + span) - originY);
+		}
+	}
+}
+
+bool TileOccupancy::test(uint zoom, TileCoordinate x, TileCoordinate y) const {
+	if (zoom < cellZoom) {
+		const uint shift = cellZoom - zoom;
+		for (uint32_t cx = uint32_t(x) << shift; cx < (uint32_t(x) + 1) << shift && cx < cellWidth(); cx++)
+			for (uint32_t cy = uint32_t(y) << shift; cy < (uint32_t(y) + 1) << shift && cy < cellWidth(); cy++)
+				if (cells[(cx << cellZoom) + cy].load(std::memory_order_acquire)) return true;
+		return false;
+	}
+	const uint level = zoom - cellZoom;
+	if (level > levels)
+		return false;
+	const uint32_t cx = x >> level, cy = y >> level;
+	if (cx >= cellWidth() || cy >= cellWidth())
+		return false;
+	const Chunk* cell = cells[(cx << cellZoom) + cy].load(std::memory_order_acquire);
+	return cell && testBit(cell, level, interleaveBits(x - (cx << level), y - (cy << level)));
+}
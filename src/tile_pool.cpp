@@ -0,0 +1,171 @@
+#include "tile_pool.h"
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+using namespace std;
+
+// Nodes looked for in /sys; as for the allocator's arenas
+#define TILE_POOL_MAX_NODES 64
+
+std::atomic<size_t> TilePool::activeGroups(1);
+thread_local size_t TilePool::threadGroup = 0;
+thread_local TilePool *TilePool::threadPool = nullptr;
+
+// The CPUs of each NUMA node that this process may run on, leaving out nodes
+// with none
+static vector<vector<int>> nodeCpus() {
+	vector<vector<int>> nodes;
+#ifdef __linux__
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return nodes;
+
+	for (int node = 0; node < TILE_POOL_MAX_NODES; node++) {
+		ifstream file("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+		if (!file) continue;
+		// e.g. "0-31,64-95"
+		string list;
+		getline(file, list);
+		vector<int> cpus;
+		stringstream ranges(list);
+		string range;
+		while (getline(ranges, range, ',')) {
+			if (range.empty()) continue;
+			const size_t dash = range.find('-');
+			const int first = stoi(range.substr(0, dash));
+			const int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+			for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+				if (CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+		}
+		if (!cpus.empty()) nodes.push_back(cpus);
+	}
+#endif
+	return nodes;
+}
+
+static void pinTo(int cpu) {
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	sched_setaffinity(0, sizeof(set), &set);	// just this thread; left to the scheduler if it fails
+#endif
+}
+
+TilePool::TilePool(size_t threadNum, bool pin) {
+	threadNum = max<size_t>(threadNum, 1);
+	vector<vector<int>> nodes;
+	if (pin) nodes = nodeCpus();
+	if (nodes.size() > threadNum) nodes.resize(threadNum);
+	// With one node (or one thread), there's nothing to keep apart, so the scheduler is left to it
+	if (nodes.size() < 2) nodes.clear();
+
+	// Each node's share of the threads, at least one
+	if (nodes.empty()) {
+		groupThreads.push_back(threadNum);
+	} else {
+		size_t totalCpus = 0;
+		for (auto const &cpus : nodes) totalCpus += cpus.size();
+		size_t assigned = 0, cpusBefore = 0;
+		for (size_t node = 0; node < nodes.size(); node++) {
+			cpusBefore += nodes[node].size();
+			const size_t nodesAfter = nodes.size() - node - 1;
+			const size_t upTo = min(threadNum - nodesAfter, max(assigned + 1, (threadNum * cpusBefore + totalCpus / 2) / totalCpus));
+			groupThreads.push_back(upTo - assigned);
+			assigned = upTo;
+		}
+	}
+
+	for (size_t group = 0; group < groupThreads.size(); group++) {
+		contexts.emplace_back(new boost::asio::io_context());
+		guards.emplace_back(boost::asio::make_work_guard(*contexts.back()));
+	}
+	busy.reset(new std::atomic<size_t>[contexts.size()]);
+	for (size_t group = 0; group < contexts.size(); group++) busy[group] = 0;
+	activeGroups = contexts.size();
+	for (size_t group = 0; group < groupThreads.size(); group++) {
+		for (size_t t = 0; t < groupThreads[group]; t++) {
+			const int cpu = nodes.empty() ? -1 : nodes[group][t % nodes[group].size()];
+			boost::asio::io_context *context = contexts[group].get();
+			threads.emplace_back([this, context, group, cpu]() {
+				if (cpu >= 0) pinTo(cpu);
+				threadGroup = group;
+				threadPool = this;
+				context->run();
+			});
+		}
+	}
+}
+
+void TilePool::join() {
+	// Once the guards are gone, each group's threads finish when its queue is empty
+	guards.clear();
+	for (auto &thread : threads) thread.join();
+	threads.clear();
+	activeGroups = 1;
+}
+
+namespace {
+	// The tasks of a runShared call. Helpers that start after the last task has
+	// been taken return without touching them, as the caller may be gone.
+	struct SharedRun {
+		std::function<void(size_t)> const *f;
+		size_t count, next = 0, running = 0;
+		std::exception_ptr error;
+		std::mutex mutex;
+		std::condition_variable finished;
+
+		void work() {
+			for (;;) {
+				size_t i;
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					if (next >= count) return;
+					i = next++;
+					running++;
+				}
+				try {
+					(*f)(i);
+				} catch (...) {
+					std::lock_guard<std::mutex> lock(mutex);
+					if (!error) error = std::current_exception();
+				}
+				std::lock_guard<std::mutex> lock(mutex);
+				if (--running == 0 && next >= count) finished.notify_all();
+			}
+		}
+	};
+}
+
+void TilePool::runShared(size_t count, std::function<void(size_t)> const &f) {
+	TilePool *pool = threadPool;
+	size_t helpers = 0;
+	if (pool && count > 1) {
+		const size_t group = threadGroup;
+		const size_t busyThreads = pool->busy[group].load();
+		const size_t idle = pool->groupThreads[group] > busyThreads ? pool->groupThreads[group] - busyThreads : 0;
+		helpers = min(idle, count - 1);
+	}
+	if (helpers == 0) {
+		for (size_t i = 0; i < count; i++) f(i);
+		return;
+	}
+
+	std::shared_ptr<SharedRun> run = std::make_shared<SharedRun>();
+	run->f = &f;
+	run->count = count;
+	for (size_t h = 0; h < helpers; h++) pool->post(threadGroup, [run]() { run->work(); });
+	run->work();
+	std::unique_lock<std::mutex> lock(run->mutex);
+	run->finished.wait(lock, [&]() { return run->running == 0; });
+	if (run->error) std::rethrow_exception(run->error);
+}
@@ -0,0 +1,147 @@
+#include "tile_profiler.h"
+#include "helpers.h"
+#include <iostream>
+#include <cstdio>
+
+using namespace std;
+
+// Each thread writes its rows out once it has buffered this much
+#define PROFILE_BUFFER_SIZE (1024 * 1024)
+
+thread_local TileProfiler::ThreadState *TileProfiler::current = nullptr;
+thread_local TileProfiler::ThreadState *TileProfiler::threadState = nullptr;
+
+static const char *phaseColumns[] = { "collect_us", "geometry_us", "clip_us", "simplify_us", "encode_us", "compress_us", "write_us" };
+
+static uint64_t nanosecondsSince(chrono::steady_clock::time_point start) {
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+// Layer names come from the config, so only quotes and backslashes need escaping
+static void appendQuoted(string &buffer, const char *text, bool ndjson) {
+	buffer += '"';
+	for (const char *c = text; *c; c++) {
+		if (*c == '"') buffer += ndjson ? "\\\"" : "\"\"";
+		else if (*c == '\\' && ndjson) buffer += "\\\\";
+		else buffer += *c;
+	}
+	buffer += '"';
+}
+
+TileProfiler::TileProfiler(const string &filename):
+	out(filename, ios::out | ios::trunc),
+	ndjson(ends_with(filename, ".json") || ends_with(filename, ".ndjson")) {
+	if (!out) {
+		cerr << "Couldn't open " << filename << " to write tile timings" << endl;
+		return;
+	}
+	if (!ndjson) {
+		out << "zoom,x,y,layer,total_us";
+		for (auto column : phaseColumns) out << "," << column;
+		out << ",features,bytes,compressed_bytes" << endl;
+	}
+}
+
+TileProfiler::~TileProfiler() {
+	flush();
+}
+
+void TileProfiler::beginTile(unsigned int zoom, TileCoordinates index) {
+	if (!threadState || threadState->profiler != this) {
+		std::lock_guard<std::mutex> lock(mutex);
+		states.emplace_back(new ThreadState());
+		threadState = states.back().get();
+		threadState->profiler = this;
+		threadState->buffer.reserve(PROFILE_BUFFER_SIZE);
+	}
+	ThreadState &state = *threadState;
+	state.zoom = zoom;
+	state.index = index;
+	state.inLayer = false;
+	state.tile.clear();
+	state.features = 0;
+	state.childNs = 0;
+	state.tileStart = chrono::steady_clock::now();
+	current = threadState;
+}
+
+void TileProfiler::beginLayer(const string &name) {
+	if (!current) return;
+	current->layer = name;
+	current->inLayer = true;
+	current->layerCounters.clear();
+	current->layerStart = chrono::steady_clock::now();
+}
+
+void TileProfiler::endLayer(size_t features, size_t bytes) {
+	if (!current || !current->inLayer) return;
+	ThreadState &state = *current;
+	state.inLayer = false;
+	uint64_t total = nanosecondsSince(state.layerStart);
+	for (size_t i = 0; i < size_t(TilePhase::Count); i++) state.tile.ns[i] += state.layerCounters.ns[i];
+	state.features += features;
+
+	// Skip layers that weren't drawn at this zoom
+	if (features == 0 && bytes == 0 && total < 1000) return;
+	state.profiler->writeRow(state, state.layer.c_str(), total, state.layerCounters, features, bytes, bytes);
+}
+
+void TileProfiler::endTile(size_t bytes, size_t compressedBytes) {
+	if (!current) return;
+	ThreadState &state = *current;
+	current = nullptr;
+	state.profiler->writeRow(state, nullptr, nanosecondsSince(state.tileStart), state.tile, state.features, bytes, compressedBytes);
+	if (state.buffer.size() >= PROFILE_BUFFER_SIZE) state.profiler->writeBuffer(state.buffer);
+}
+
+void TileProfiler::addTime(TilePhase phase, uint64_t ns) {
+	if (!current) return;
+	Counters &counters = current->inLayer ? current->layerCounters : current->tile;
+	counters.ns[size_t(phase)] += ns;
+}
+
+void TileProfiler::writeRow(ThreadState &state, const char *layer, uint64_t totalNs, const Counters &counters,
+                            size_t features, size_t bytes, size_t compressedBytes) {
+	char number[32];
+	string &buffer = state.buffer;
+	auto append = [&](const char *key, uint64_t value) {
+		if (ndjson) { buffer += ",\""; buffer += key; buffer += "\":"; }
+		else buffer += ',';
+		snprintf(number, sizeof(number), "%llu", (unsigned long long)value);
+		buffer += number;
+	};
+
+	if (ndjson) {
+		snprintf(number, sizeof(number), "{\"zoom\":%u", state.zoom);
+		buffer += number;
+		append("x", state.index.x);
+		append("y", state.index.y);
+		buffer += ",\"layer\":";
+		if (layer) appendQuoted(buffer, layer, true);
+		else buffer += "null";
+	} else {
+		snprintf(number, sizeof(number), "%u,%u,%u,", state.zoom, state.index.x, state.index.y);
+		buffer += number;
+		if (layer) appendQuoted(buffer, layer, false);
+	}
+
+	append("total_us", totalNs / 1000);
+	for (size_t i = 0; i < size_t(TilePhase::Count); i++) append(phaseColumns[i], counters.ns[i] / 1000);
+	append("features", features);
+	append("bytes", bytes);
+	append("compressed_bytes", compressedBytes);
+	buffer += ndjson ? "}\n" : "\n";
+}
+
+void TileProfiler::writeBuffer(string &buffer) {
+	std::lock_guard<std::mutex> lock(mutex);
+	out.write(buffer.data(), buffer.size());
+	buffer.clear();
+}
+
+// Only call this once the worker threads have finished
+void TileProfiler::flush() {
+	for (auto &state : states) writeBuffer(state->buffer);
+	std::lock_guard<std::mutex> lock(mutex);
+	out.flush();
+}
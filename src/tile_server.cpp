@@ -0,0 +1,339 @@
+#include "tile_server.h"
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <boost/asio.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include <sqlite3.h>
+#include "rapidjson/document.h"
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
+#include "helpers.h"
+
+using namespace std;
+using boost::asio::ip::tcp;
+
+// Requests with longer headers than this are dropped
+#define SERVER_MAX_HEADER_BYTES 16384
+// Connections that don't send a whole request for this long are closed
+#define SERVER_IDLE_SECONDS 30
+
+// A read-only database handle, with the tile query prepared
+struct TileServer::Connection {
+	sqlite3 *db = nullptr;
+	sqlite3_stmt *tileQuery = nullptr;
+
+	~Connection() {
+		if (tileQuery) sqlite3_finalize(tileQuery);
+		if (db) sqlite3_close(db);
+	}
+
+	bool open(const std::string &filename) {
+		if (sqlite3_open_v2(filename.c_str(), &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr) != SQLITE_OK) return false;
+		return sqlite3_prepare_v2(db, "SELECT tile_data FROM tiles WHERE zoom_level=? AND tile_column=? AND tile_row=?", -1, &tileQuery, nullptr) == SQLITE_OK;
+	}
+};
+
+TileServer::TileServer(const std::string &filename, unsigned int maxAge):
+	filename(filename),
+	maxAge(maxAge) {
+	if (!boost::filesystem::exists(filename)) {
+		cerr << "Couldn't find " << filename << " to serve" << endl;
+		return;
+	}
+	if (!readMetadata()) {
+		cerr << "Couldn't read " << filename << " as an .mbtiles" << endl;
+		metadataJson.clear();
+	}
+}
+
+TileServer::~TileServer() { }
+
+std::unique_ptr<TileServer::Connection> TileServer::acquire() {
+	{
+		std::lock_guard<std::mutex> lock(poolMutex);
+		if (!idleConnections.empty()) {
+			std::unique_ptr<Connection> connection = std::move(idleConnections.back());
+			idleConnections.pop_back();
+			return connection;
+		}
+	}
+	std::unique_ptr<Connection> connection(new Connection());
+	if (!connection->open(filename)) {
+		cerr << "Couldn't open " << filename << ": " << sqlite3_errmsg(connection->db) << endl;
+		return nullptr;
+	}
+	return connection;
+}
+
+void TileServer::release(std::unique_ptr<Connection> connection) {
+	std::lock_guard<std::mutex> lock(poolMutex);
+	idleConnections.push_back(std::move(connection));
+}
+
+bool TileServer::readTile(unsigned int zoom, unsigned int x, unsigned int y, std::string &data) {
+	std::unique_ptr<Connection> connection = acquire();
+	if (!connection) return false;
+	sqlite3_stmt *query = connection->tileQuery;
+	sqlite3_reset(query);
+	sqlite3_bind_int(query, 1, zoom);
+	sqlite3_bind_int(query, 2, x);
+	sqlite3_bind_int(query, 3, (1u << zoom) - 1 - y);	// TMS
+	const bool found = sqlite3_step(query) == SQLITE_ROW;
+	if (found) {
+		const char *blob = static_cast<const char*>(sqlite3_column_blob(query, 0));
+		data.assign(blob ? blob : "", sqlite3_column_bytes(query, 0));
+	}
+	sqlite3_reset(query);
+	release(std::move(connection));
+	return found;
+}
+
+// Read the metadata table once, as JSON (the "json" entry is JSON already)
+bool TileServer::readMetadata() {
+	std::unique_ptr<Connection> connection = acquire();
+	if (!connection) return false;
+	sqlite3_stmt *query;
+	if (sqlite3_prepare_v2(connection->db, "SELECT name,value FROM metadata", -1, &query, nullptr) != SQLITE_OK) return false;
+
+	rapidjson::Document document;
+	document.SetObject();
+	auto &allocator = document.GetAllocator();
+	while (sqlite3_step(query) == SQLITE_ROW) {
+		const char *name = reinterpret_cast<const char*>(sqlite3_column_text(query, 0));
+		const char *value = reinterpret_cast<const char*>(sqlite3_column_text(query, 1));
+		if (!name || !value) continue;
+		rapidjson::Value key(name, allocator), entry;
+		rapidjson::Document parsed;
+		if (strcmp(name, "json") == 0 && !parsed.Parse(value).HasParseError()) entry.CopyFrom(parsed, allocator);
+		else entry.SetString(value, allocator);
+		document.AddMember(key, entry, allocator);
+	}
+	sqlite3_finalize(query);
+	release(std::move(connection));
+
+	rapidjson::StringBuffer strbuf;
+	rapidjson::Writer<rapidjson::StringBuffer> writer(strbuf);
+	document.Accept(writer);
+	metadataJson = strbuf.GetString();
+	return true;
+}
+
+// Whether an Accept-Encoding header allows a coding: it has to be listed (or
+// covered by *) with a non-zero q
+static bool acceptsEncoding(const std::string &header, const std::string &coding) {
+	std::vector<std::string> items;
+	boost::algorithm::split(items, header, boost::algorithm::is_any_of(","));
+	double named = -1, wildcard = -1;
+	for (const std::string &item : items) {
+		const size_t semicolon = item.find(';');
+		std::string name = boost::algorithm::to_lower_copy(boost::algorithm::trim_copy(item.substr(0, semicolon)));
+		double q = 1;
+		if (semicolon != std::string::npos) {
+			std::string params = boost::algorithm::to_lower_copy(item.substr(semicolon + 1));
+			boost::algorithm::erase_all(params, " ");
+			if (params.compare(0, 2, "q=") == 0) q = atof(params.c_str() + 2);
+		}
+		if (name == coding || name == "x-" + coding) named = std::max(named, q);
+		else if (name == "*") wildcard = q;
+	}
+	return named >= 0 ? named > 0 : wildcard > 0;
+}
+
+// Whether an If-None-Match header lists this ETag (compared weakly, as RFC 7232 asks)
+static bool matchesETag(const std::string &header, const std::string &etag) {
+	std::vector<std::string> items;
+	boost::algorithm::split(items, header, boost::algorithm::is_any_of(","));
+	for (std::string item : items) {
+		boost::algorithm::trim(item);
+		if (item == "*") return true;
+		if (item.compare(0, 2, "W/") == 0) item.erase(0, 2);
+		if (item == etag) return true;
+	}
+	return false;
+}
+
+TileServer::Response TileServer::handle(const std::string &method, const std::string &target,
+                                        const std::string &ifNoneMatch, const std::string &acceptEncoding) {
+	Response response { 200, "", "", "", "", false };
+	if (method != "GET" && method != "HEAD") {
+		response.status = 405;
+		return response;
+	}
+
+	const std::string path = target.substr(0, target.find('?'));
+	unsigned int zoom, x, y;
+	char extension[8];
+	int length = 0;
+	if (sscanf(path.c_str(), "/%u/%u/%u.%7[a-z]%n", &zoom, &x, &y, extension, &length) == 4 &&
+	    length == static_cast<int>(path.size()) && (strcmp(extension, "pbf") == 0 || strcmp(extension, "mvt") == 0)) {
+		if (zoom > 30 || x >= (1u << zoom) || y >= (1u << zoom)) {
+			response.status = 404;
+			return response;
+		}
+		std::string data;
+		if (!readTile(zoom, x, y, data)) {
+			response.status = 204;
+			return response;
+		}
+
+		// Pass compressed tiles through, unless the client can't take them
+		const bool gzip = data.size() >= 2 && static_cast<unsigned char>(data[0]) == 0x1f && static_cast<unsigned char>(data[1]) == 0x8b;
+		const bool zlib = data.size() >= 2 && static_cast<unsigned char>(data[0]) == 0x78;
+		response.varyEncoding = gzip || zlib;
+		bool decompress = false;
+		if (gzip || zlib) {
+			const std::string encoding = gzip ? "gzip" : "deflate";
+			if (acceptsEncoding(acceptEncoding, encoding)) response.contentEncoding = encoding;
+			else decompress = true;
+		}
+
+		// Each encoding is a different representation, so needs its own ETag
+		char etag[40];
+		snprintf(etag, sizeof(etag), "\"%016llx%s%s\"", static_cast<unsigned long long>(std::hash<std::string>()(data)),
+		         response.contentEncoding.empty() ? "" : "-", response.contentEncoding.c_str());
+		response.etag = etag;
+		response.contentType = "application/x-protobuf";
+		if (!ifNoneMatch.empty() && matchesETag(ifNoneMatch, response.etag)) {
+			response.status = 304;
+			return response;
+		}
+
+		if (decompress) data = decompress_string(data, gzip);
+		response.body = std::move(data);
+		return response;
+	}
+
+	if (path == "/metadata" || path == "/metadata.json") {
+		response.contentType = "application/json";
+		response.body = metadataJson;
+		return response;
+	}
+
+	response.status = 404;
+	return response;
+}
+
+static const char *statusText(int status) {
+	switch (status) {
+		case 200: return "OK";
+		case 204: return "No Content";
+		case 304: return "Not Modified";
+		case 400: return "Bad Request";
+		case 405: return "Method Not Allowed";
+		default:  return "Not Found";
+	}
+}
+
+// One client connection, which may make several requests in turn
+class HttpSession : public std::enable_shared_from_this<HttpSession> {
+public:
+	HttpSession(tcp::socket socket, TileServer &server, unsigned int maxAge):
+		socket(std::move(socket)), timer(this->socket.get_executor()), reading(false),
+		buffer(SERVER_MAX_HEADER_BYTES), server(server), maxAge(maxAge) { }
+
+	// Read the next request, giving up on the connection if it doesn't come.
+	// The socket's executor is a strand, so the timer and the read don't race.
+	void read() {
+		auto self = shared_from_this();
+		reading = true;
+		timer.expires_after(std::chrono::seconds(SERVER_IDLE_SECONDS));
+		timer.async_wait([self](const boost::system::error_code &ec) {
+			if (ec || !self->reading || self->timer.expiry() > boost::asio::steady_timer::clock_type::now()) return;
+			boost::system::error_code ignored;
+			self->socket.close(ignored);
+		});
+		boost::asio::async_read_until(socket, buffer, "\r\n\r\n", [self](const boost::system::error_code &ec, size_t) {
+			self->reading = false;
+			self->timer.cancel();
+			if (!ec) self->respond();
+		});
+	}
+
+private:
+	tcp::socket socket;
+	boost::asio::steady_timer timer;
+	bool reading;
+	boost::asio::streambuf buffer;
+	TileServer &server;
+	unsigned int maxAge;
+	std::string head;
+	TileServer::Response response;
+
+	void respond() {
+		// Parse the request line and the headers we use
+		std::istream in(&buffer);
+		std::string line, method, target, version, ifNoneMatch, acceptEncoding, connection;
+		std::getline(in, line);
+		std::istringstream requestLine(line);
+		requestLine >> method >> target >> version;
+		while (std::getline(in, line) && line != "\r") {
+			const size_t colon = line.find(':');
+			if (colon == std::string::npos) continue;
+			std::string name = boost::algorithm::to_lower_copy(line.substr(0, colon));
+			std::string value = boost::algorithm::trim_copy(line.substr(colon + 1));
+			if (name == "if-none-match") ifNoneMatch = value;
+			else if (name == "accept-encoding") acceptEncoding = value;
+			else if (name == "connection") connection = boost::algorithm::to_lower_copy(value);
+		}
+		const bool keepAlive = version == "HTTP/1.1" ? connection != "close" : connection == "keep-alive";
+
+		if (method.empty() || target.empty() || target[0] != '/') response = { 400, "", "", "", "", false };
+		else response = server.handle(method, target, ifNoneMatch, acceptEncoding);
+		// A HEAD response gives the length the GET would have had
+		const size_t contentLength = response.body.size();
+		if (method == "HEAD") response.body.clear();
+
+		std::ostringstream out;
+		out << "HTTP/1.1 " << response.status << " " << statusText(response.status) << "\r\n";
+		if (!response.contentType.empty()) out << "Content-Type: " << response.contentType << "\r\n";
+		if (!response.contentEncoding.empty()) out << "Content-Encoding: " << response.contentEncoding << "\r\n";
+		if (response.varyEncoding) out << "Vary: Accept-Encoding\r\n";
+		if (!response.etag.empty()) out << "ETag: " << response.etag << "\r\n";
+		// 204 and 304 responses never have a body, so mustn't give a length
+		if (response.status != 204 && response.status != 304) out << "Content-Length: " << contentLength << "\r\n";
+		out << "Cache-Control: max-age=" << maxAge << "\r\n"
+		    << "Access-Control-Allow-Origin: *\r\n"
+		    << "Connection: " << (keepAlive ? "keep-alive" : "close") << "\r\n\r\n";
+		head = out.str();
+
+		auto self = shared_from_this();
+		std::vector<boost::asio::const_buffer> buffers { boost::asio::buffer(head), boost::asio::buffer(response.body) };
+		boost::asio::async_write(socket, buffers, [self, keepAlive](const boost::system::error_code &ec, size_t) {
+			if (ec) return;
+			if (keepAlive) self->read();
+			else {
+				boost::system::error_code ignored;
+				self->socket.shutdown(tcp::socket::shutdown_both, ignored);
+			}
+		});
+	}
+};
+
+static void acceptConnections(tcp::acceptor &acceptor, TileServer &server, unsigned int maxAge) {
+	// Each connection gets a strand, so its handlers run one at a time
+	acceptor.async_accept(boost::asio::make_strand(acceptor.get_executor()), [&acceptor, &server, maxAge](const boost::system::error_code &ec, tcp::socket socket) {
+		if (!ec) std::make_shared<HttpSession>(std::move(socket), server, maxAge)->read();
+		if (acceptor.is_open()) acceptConnections(acceptor, server, maxAge);
+	});
+}
+
+void TileServer::run(unsigned short port, unsigned int threadNum) {
+	boost::asio::io_context context(threadNum);
+	tcp::acceptor acceptor(context, tcp::endpoint(tcp::v4(), port));
+	acceptConnections(acceptor, *this, maxAge);
+
+	boost::asio::signal_set signals(context, SIGINT, SIGTERM);
+	signals.async_wait([&](const boost::system::error_code&, int) { context.stop(); });
+
+	cout << "Serving " << filename << " at http://localhost:" << port << "/{z}/{x}/{y}.pbf (Ctrl-C to stop)" << endl;
+	std::vector<std::thread> threads;
+	for (unsigned int i = 1; i < threadNum; i++)
+		threads.emplace_back([&]() { context.run(); });
+	context.run();
+	for (auto &thread : threads) thread.join();
+}
@@ -0,0 +1,123 @@
+#include "tile_sink.h"
+#include "trace.h"
+#include <fstream>
+#include <iostream>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/filesystem.hpp>
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Tile data that can be queued for a sink's writer threads before saveTile blocks
+#define SINK_MAX_PENDING_BYTES (128 * 1024 * 1024)
+// Directory output has this many writer threads, each taking up to this many tiles at once
+#define SINK_DIRECTORY_WRITERS 4
+#define SINK_DIRECTORY_BATCH 256
+
+OutputMode outputModeFor(const std::string &path) {
+	if (boost::algorithm::ends_with(path, ".mbtiles") || boost::algorithm::ends_with(path, ".sqlite")) return OutputMode::MBTiles;
+	if (boost::algorithm::ends_with(path, ".pmtiles")) return OutputMode::PMTiles;
+	return OutputMode::File;
+}
+
+TileSink::TileSink(const std::string &path):
+	mode(outputModeFor(path)),
+	path(path),
+	pendingBytes(0),
+	stopWriter(false) {
+}
+
+TileSink::~TileSink() {
+	finish();
+}
+
+void TileSink::start() {
+	const unsigned writers = mode == OutputMode::File ? SINK_DIRECTORY_WRITERS :
+	                         mode == OutputMode::PMTiles ? 1 : 0;
+	for (unsigned i = 0; i < writers; i++)
+		writerThreads.emplace_back(&TileSink::writerLoop, this);
+}
+
+void TileSink::saveTile(int zoom, int x, int y, std::string *data) {
+	if (mode == OutputMode::MBTiles) {
+		mbtiles.saveTile(zoom, x, y, data, false);
+		return;
+	}
+	{
+		std::unique_lock<std::mutex> lock(pendingMutex);
+		auto hasRoom = [&]() { return pendingBytes < SINK_MAX_PENDING_BYTES || pendingTiles.empty(); };
+		if (!hasRoom()) {
+			TRACE_SPAN("wait for tile writer");
+			pendingNotFull.wait(lock, hasRoom);
+		}
+		pendingTiles.push_back({zoom, x, y, *data});
+		pendingBytes += data->size();
+	}
+	pendingNotEmpty.notify_one();
+}
+
+void TileSink::finish() {
+	{
+		std::lock_guard<std::mutex> lock(pendingMutex);
+		stopWriter = true;
+	}
+	pendingNotEmpty.notify_all();
+	for (auto &thread : writerThreads) thread.join();
+	writerThreads.clear();
+}
+
+// Take everything from the queue (or, for a directory, a batch of it) in one go
+void TileSink::writerLoop() {
+	std::vector<PendingTile> batch;
+	std::unordered_set<std::string> knownDirs;
+	const size_t batchSize = mode == OutputMode::File ? SINK_DIRECTORY_BATCH : SIZE_MAX;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(pendingMutex);
+			pendingNotEmpty.wait(lock, [&]() { return !pendingTiles.empty() || stopWriter; });
+			if (pendingTiles.empty()) return;
+			while (!pendingTiles.empty() && batch.size() < batchSize) {
+				pendingBytes -= pendingTiles.front().data.size();
+				batch.push_back(std::move(pendingTiles.front()));
+				pendingTiles.pop_front();
+			}
+		}
+		pendingNotFull.notify_all();
+
+		for (PendingTile &tile : batch) {
+			if (mode == OutputMode::PMTiles) pmtiles.saveTile(tile.zoom, tile.x, tile.y, &tile.data);
+			else writeTileFile(tile, knownDirs);
+		}
+		batch.clear();
+	}
+}
+
+void TileSink::writeTileFile(const PendingTile &tile, std::unordered_set<std::string> &knownDirs) {
+	const std::string dirname = path + "/" + std::to_string(tile.zoom) + "/" + std::to_string(tile.x);
+	const std::string filename = dirname + "/" + std::to_string(tile.y) + ".pbf";
+	if (knownDirs.insert(dirname).second)
+		boost::filesystem::create_directories(dirname);
+
+#ifndef _WIN32
+	int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	bool ok = fd >= 0;
+	for (size_t written = 0; ok && written < tile.data.size(); ) {
+		const ssize_t n = write(fd, tile.data.data() + written, tile.data.size() - written);
+		if (n < 0) { if (errno != EINTR) ok = false; }
+		else written += n;
+	}
+	if (fd >= 0 && close(fd) != 0) ok = false;
+#else
+	fstream outfile(filename, ios::out | ios::trunc | ios::binary);
+	outfile.write(tile.data.data(), tile.data.size());
+	bool ok = static_cast<bool>(outfile);
+	outfile.close();
+#endif
+	if (!ok) {
+		cerr << "Couldn't write to " << filename << endl;
+	}
+}
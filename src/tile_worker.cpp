@@ -1,13 +1,20 @@
 /*! \file */ 
 #include "tile_worker.h"
-#include <fstream>
-#include <boost/filesystem.hpp>
 #include <signal.h>
 #include "helpers.h"
 #include "write_geometry.h"
+#include "mvt_writer.h"
+#include "tile_profiler.h"
+#include "tile_pool.h"
+#include "polygon_grid.h"
 using namespace std;
 extern bool verbose;
 
+// Below this zoom, layers of a tile with at least this many objects are
+// written on threads of their own
+#define PARALLEL_LAYERS_BELOW 6
+#define PARALLEL_LAYER_OBJECTS 1000
+
 thread_local bool enabledUserSignal = false;
 typedef std::vector<OutputObjectID>::const_iterator OutputObjectsConstIt;
 typedef std::pair<OutputObjectsConstIt, OutputObjectsConstIt> OutputObjectsConstItPair;
@@ -73,26 +80,89 @@ void ReorderMultiLinestring(MultiLinestring &input, MultiLinestring &output) {
 	}
 }
 
-// Merge two multilinestrings by simply appending
+// Merge multilinestrings by simply appending
 // (the constituent parts will be matched up in subsequent call to ReorderMultiLinestring)
-void MergeIntersecting(MultiLinestring &input, MultiLinestring &to_merge) {
-	for (auto ls : to_merge) input.emplace_back(ls);
+void MergeAll(MultiLinestring &input, std::vector<MultiLinestring> &to_merge) {
+	for (auto &mls : to_merge)
+		for (auto &ls : mls) input.emplace_back(std::move(ls));
+}
+
+// Union two multipolygons, or just put them together if they can't touch
+static void UnionPair(MultiPolygon &a, Box &aBox, MultiPolygon &b, const Box &bBox) {
+	if (geom::intersects(aBox, bBox)) {
+		try {
+			MultiPolygon union_result;
+			boost::geometry::union_(a, b, union_result);
+			a = std::move(union_result);
+			geom::expand(aBox, bBox);
+			return;
+		} catch (geom::inconsistent_turns_exception &err) {
+			cerr << "Inconsistent turns error while merging polygons" << endl;
+		}
+	}
+	for (auto &p : b) a.emplace_back(std::move(p));
+	geom::expand(aBox, bBox);
 }
 
-// Merge two multipolygons by doing intersection checks for each constituent polygon
-void MergeIntersecting(MultiPolygon &input, MultiPolygon &to_merge) {
-	if (boost::geometry::intersects(input, to_merge)) {
-		for (std::size_t i=0; i<input.size(); i++) {
-			if (boost::geometry::intersects(input[i], to_merge)) {
-				MultiPolygon union_result;
-				boost::geometry::union_(input[i], to_merge, union_result);
-				for (auto output : union_result) input.emplace_back(output);
-				input.erase(input.begin() + i);
-				return;
+// Merge multipolygons, unioning the polygons that overlap
+//
+// Polygons are grouped by envelope: any two whose envelopes overlap are in the
+// same group, and polygons on their own are just appended. Each group is
+// unioned pairwise in a balanced tree, so each union is between geometries of
+// similar size, rather than adding one polygon at a time to an ever-growing
+// result.
+void MergeAll(MultiPolygon &input, std::vector<MultiPolygon> &to_merge) {
+	std::vector<Polygon> polygons;
+	for (auto &p : input) polygons.emplace_back(std::move(p));
+	for (auto &mp : to_merge)
+		for (auto &p : mp) polygons.emplace_back(std::move(p));
+	input.clear();
+
+	std::vector<Box> boxes(polygons.size());
+	std::vector<std::pair<Box, size_t>> indexed;
+	for (size_t i = 0; i < polygons.size(); i++) {
+		geom::envelope(polygons[i], boxes[i]);
+		indexed.emplace_back(boxes[i], i);
+	}
+
+	// Group polygons with overlapping envelopes
+	std::vector<size_t> group(polygons.size());
+	for (size_t i = 0; i < group.size(); i++) group[i] = i;
+	auto find = [&](size_t i) {
+		while (group[i] != i) i = group[i] = group[group[i]];
+		return i;
+	};
+	boost::geometry::index::rtree<std::pair<Box, size_t>, boost::geometry::index::quadratic<16>> rtree(indexed.begin(), indexed.end());
+	for (size_t i = 0; i < polygons.size(); i++) {
+		for (auto const &other : rtree | boost::geometry::index::adaptors::queried(boost::geometry::index::intersects(boxes[i]))) {
+			size_t a = find(i), b = find(other.second);
+			if (a != b) group[std::max(a, b)] = std::min(a, b);
+		}
+	}
+	std::vector<std::vector<size_t>> groups(polygons.size());
+	for (size_t i = 0; i < polygons.size(); i++) groups[find(i)].push_back(i);
+
+	for (auto const &members : groups) {
+		if (members.empty()) continue;
+		if (members.size() == 1) {
+			input.emplace_back(std::move(polygons[members[0]]));
+			continue;
+		}
+
+		std::vector<MultiPolygon> level(members.size());
+		std::vector<Box> levelBoxes(members.size());
+		for (size_t i = 0; i < members.size(); i++) {
+			level[i].emplace_back(std::move(polygons[members[i]]));
+			levelBoxes[i] = boxes[members[i]];
+		}
+		for (size_t width = 1; width < level.size(); width *= 2) {
+			for (size_t i = 0; i + width < level.size(); i += width * 2) {
+				UnionPair(level[i], levelBoxes[i], level[i + width], levelBoxes[i + width]);
+				MultiPolygon().swap(level[i + width]);
 			}
 		}
+		for (auto &p : level[0]) input.emplace_back(std::move(p));
 	}
-	for (auto output : to_merge) input.emplace_back(output);
 }
 
 template <typename T>
@@ -109,8 +179,10 @@ void CheckNextObjectAndMerge(
 	// If an object is a linestring/polygon that is followed by
 	// other linestrings/polygons with the same attributes,
 	// the following objects are merged into the first object, by taking union of geometries.
+	// They're all built first, so that they can be merged in one go.
 	OutputObjectID oo = *jt;
 	OutputObjectID ooNext = *(jt + 1);
+	std::vector<T> to_merge;
 
 	// TODO: do we need ooNext? Could we instead just update jt and dereference it?
 	//       put differently: we don't need to keep overwriting oo/ooNext
@@ -126,13 +198,66 @@ void CheckNextObjectAndMerge(
 		}
 
 		try {
-			T to_merge = boost::get<T>(source->buildWayGeometry(oo.oo.geomType, oo.oo.objectID, bbox));
-			MergeIntersecting(g, to_merge);
+			to_merge.emplace_back(boost::get<T>(source->buildWayGeometry(oo.oo.geomType, oo.oo.objectID, bbox)));
 		} catch (std::out_of_range &err) { cerr << "Geometry out of range " << gt << ": " << static_cast<int>(oo.oo.objectID) <<"," << err.what() << endl;
 		} catch (boost::bad_get &err) { cerr << "Type error while processing " << gt << ": " << static_cast<int>(oo.oo.objectID) << endl;
-		} catch (geom::inconsistent_turns_exception &err) { cerr << "Inconsistent turns error while processing " << gt << ": " << static_cast<int>(oo.oo.objectID) << endl;
 		}
 	}
+	if (!to_merge.empty())
+		MergeAll(g, to_merge);
+}
+
+// Grids with more cells than this (a 1024x1024 tile, with its buffer) free
+// their storage after each use, rather than keep it for the next
+#define AGGREGATE_KEEP_CELLS (1100 * 1100)
+
+// Rasterize a polygon, and the polygons that follow it with the same
+// attributes, onto a grid over the tile and its buffer, and trace the grid's
+// outlines. Moves jt to the last object used.
+static void AggregatePolygons(
+	TileDataSource* source,
+	OutputObjectsConstIt& jt,
+	OutputObjectsConstIt ooSameLayerEnd,
+	unsigned zoom,
+	const TileBbox& bbox,
+	unsigned resolution,
+	MultiPolygon& out
+) {
+	thread_local PolygonGrid grid;
+	// The geometries are clipped to the extended box, so the grid covers all
+	// of it. Its cells are those that resolution gives over the tile itself,
+	// lined up with the tile's edges, with as many whole cells on each side
+	// as it takes to cover the buffer.
+	const Box tileBox = bbox.getTileBox(), extendBox = bbox.getExtendBox();
+	const double cellWidth  = (tileBox.max_corner().x() - tileBox.min_corner().x()) / resolution;
+	const double cellHeight = (tileBox.max_corner().y() - tileBox.min_corner().y()) / resolution;
+	const double buffer = std::max(
+		std::max((tileBox.min_corner().x() - extendBox.min_corner().x()) / cellWidth, (extendBox.max_corner().x() - tileBox.max_corner().x()) / cellWidth),
+		std::max((tileBox.min_corner().y() - extendBox.min_corner().y()) / cellHeight, (extendBox.max_corner().y() - tileBox.max_corner().y()) / cellHeight));
+	const unsigned bufferCells = unsigned(std::max(0.0, std::ceil(buffer - 1e-6)));
+	grid.reset(Box(Point(tileBox.min_corner().x() - bufferCells * cellWidth, tileBox.min_corner().y() - bufferCells * cellHeight),
+	               Point(tileBox.max_corner().x() + bufferCells * cellWidth, tileBox.max_corner().y() + bufferCells * cellHeight)),
+	           resolution + 2 * bufferCells);
+	const OutputObjectID first = *jt;
+	auto add = [&](const OutputObjectID &oo) {
+		try {
+			grid.add(boost::get<MultiPolygon>(source->buildWayGeometry(oo.oo.geomType, oo.oo.objectID, bbox)));
+		} catch (std::out_of_range &err) {
+			if (verbose) cerr << "Error while processing geometry " << oo.oo.geomType << "," << static_cast<int>(oo.oo.objectID) << "," << err.what() << endl;
+		}
+	};
+	add(first);
+	while (jt + 1 != ooSameLayerEnd &&
+			(jt + 1)->oo.geomType == first.oo.geomType &&
+			(jt + 1)->oo.z_order == first.oo.z_order &&
+			(jt + 1)->oo.attributes == first.oo.attributes) {
+		jt++;
+		if (zoom < jt->oo.minZoom) continue;
+		add(*jt);
+	}
+	grid.trace(out);
+	// A fine grid takes hundreds of MB to trace, too much to keep for every thread
+	if (grid.cellCount() > AGGREGATE_KEEP_CELLS) grid.release();
 }
 
 void RemovePartsBelowSize(MultiPolygon &g, double filterArea) {
@@ -161,13 +286,15 @@ void ProcessObjects(
 	OutputObjectsConstIt ooSameLayerEnd, 
 	class SharedData& sharedData,
 	double simplifyLevel,
+	bool fastSimplify,
+	bool shareSimplified,
 	double filterArea,
 	bool combinePolygons,
+	unsigned aggregateResolution,
 	unsigned zoom,
 	const TileBbox &bbox,
-	vector_tile::Tile_Layer* vtLayer,
-	vector<string>& keyList,
-	vector<vector_tile::Tile_Value>& valueList
+	MvtLayerWriter& layer,
+	LayerDictionary& dictionary
 ) {
 
 	for (auto jt = ooSameLayerBegin; jt != ooSameLayerEnd; ++jt) {
@@ -175,71 +302,86 @@ void ProcessObjects(
 		if (zoom < oo.oo.minZoom) { continue; }
 
 		if (oo.oo.geomType == POINT_) {
-			vector_tile::Tile_Feature *featurePtr = vtLayer->add_features();
-			LatpLon pos = source->buildNodeGeometry(oo.oo.geomType, oo.oo.objectID, bbox);
+			LatpLon pos;
+			{
+				TilePhaseTimer timer(TilePhase::Geometry);
+				pos = source->buildNodeGeometry(oo.oo.geomType, oo.oo.objectID, bbox);
+			}
+
+			TilePhaseTimer timer(TilePhase::Encode);
+			vector_tile::Tile_Feature *featurePtr = layer.feature();
 			featurePtr->add_geometry(9);					// moveTo, repeat x1
 			pair<int,int> xy = bbox.scaleLatpLon(pos.latp/10000000.0, pos.lon/10000000.0);
 			featurePtr->add_geometry((xy.first  << 1) ^ (xy.first  >> 31));
 			featurePtr->add_geometry((xy.second << 1) ^ (xy.second >> 31));
 			featurePtr->set_type(vector_tile::Tile_GeomType_POINT);
 
-			oo.oo.writeAttributes(&keyList, &valueList, attributeStore, featurePtr, zoom);
+			oo.oo.writeAttributes(dictionary, attributeStore, featurePtr, zoom);
 
 			if (sharedData.config.includeID && oo.id) { featurePtr->set_id(oo.id); }
+			layer.addFeature();
 		} else {
 			Geometry g;
-			try {
-				g = source->buildWayGeometry(oo.oo.geomType, oo.oo.objectID, bbox);
-			} catch (std::out_of_range &err) {
-				if (verbose) cerr << "Error while processing geometry " << oo.oo.geomType << "," << static_cast<int>(oo.oo.objectID) <<"," << err.what() << endl;
-				continue;
-			}
+			bool simplified = false;
+			{
+				TilePhaseTimer timer(TilePhase::Geometry);
+				try {
+					// aggregate_below: drawn with the objects that follow it, on a grid
+					if (oo.oo.geomType == POLYGON_ && aggregateResolution > 0) {
+						MultiPolygon aggregated;
+						AggregatePolygons(source, jt, ooSameLayerEnd, zoom, bbox, aggregateResolution, aggregated);
+						oo = *jt;
+						g = std::move(aggregated);
+					} else {
+						// Big objects are clipped from their simplified copy for this zoom,
+						// made by the first tile to need it. Not if it's to be merged
+						// with the next objects, which are simplified along with it.
+						const bool merging = (oo.oo.geomType == LINESTRING_ && zoom < sharedData.config.combineBelow) ||
+						                     (oo.oo.geomType == POLYGON_ && combinePolygons);
+						if (shareSimplified && !merging && source->sharesSimplified(oo.oo.geomType, oo.oo.objectID)) {
+							if (!source->buildSimplifiedWayGeometry(oo.oo.geomType, oo.oo.objectID, oo.oo.layer, bbox, g))
+								g = source->simplifyWayGeometry(oo.oo.geomType, oo.oo.objectID, oo.oo.layer, bbox, simplifyLevel, fastSimplify);
+							simplified = true;
+						} else {
+							g = source->buildWayGeometry(oo.oo.geomType, oo.oo.objectID, bbox);
+						}
+					}
+				} catch (std::out_of_range &err) {
+					if (verbose) cerr << "Error while processing geometry " << oo.oo.geomType << "," << static_cast<int>(oo.oo.objectID) <<"," << err.what() << endl;
+					continue;
+				}
 
-			if (oo.oo.geomType == POLYGON_ && filterArea > 0.0) {
-				RemovePartsBelowSize(boost::get<MultiPolygon>(g), filterArea);
-				if (geom::is_empty(g)) continue;
-			}
+				if (oo.oo.geomType == POLYGON_ && filterArea > 0.0) {
+					RemovePartsBelowSize(boost::get<MultiPolygon>(g), filterArea);
+					if (geom::is_empty(g)) continue;
+				}
 
-			//This may increment the jt iterator
-			if (oo.oo.geomType == LINESTRING_ && zoom < sharedData.config.combineBelow) {
-				CheckNextObjectAndMerge(source, jt, ooSameLayerEnd, bbox, boost::get<MultiLinestring>(g));
-				MultiLinestring reordered;
-				ReorderMultiLinestring(boost::get<MultiLinestring>(g), reordered);
-				g = move(reordered);
-				oo = *jt;
-			} else if (oo.oo.geomType == POLYGON_ && combinePolygons) {
-				CheckNextObjectAndMerge(source, jt, ooSameLayerEnd, bbox, boost::get<MultiPolygon>(g));
-				oo = *jt;
+				//This may increment the jt iterator
+				if (oo.oo.geomType == LINESTRING_ && zoom < sharedData.config.combineBelow) {
+					CheckNextObjectAndMerge(source, jt, ooSameLayerEnd, bbox, boost::get<MultiLinestring>(g));
+					MultiLinestring reordered;
+					ReorderMultiLinestring(boost::get<MultiLinestring>(g), reordered);
+					g = move(reordered);
+					oo = *jt;
+				} else if (oo.oo.geomType == POLYGON_ && combinePolygons) {
+					CheckNextObjectAndMerge(source, jt, ooSameLayerEnd, bbox, boost::get<MultiPolygon>(g));
+					oo = *jt;
+				}
 			}
 
-			vector_tile::Tile_Feature *featurePtr = vtLayer->add_features();
-			WriteGeometryVisitor w(&bbox, featurePtr, simplifyLevel);
+			TilePhaseTimer timer(TilePhase::Encode);
+			vector_tile::Tile_Feature *featurePtr = layer.feature();
+			WriteGeometryVisitor w(&bbox, featurePtr, simplified ? 0.0 : simplifyLevel, fastSimplify);
 			boost::apply_visitor(w, g);
-			if (featurePtr->geometry_size()==0) { vtLayer->mutable_features()->RemoveLast(); continue; }
-			oo.oo.writeAttributes(&keyList, &valueList, attributeStore, featurePtr, zoom);
+			if (featurePtr->geometry_size()==0) { continue; }
+			oo.oo.writeAttributes(dictionary, attributeStore, featurePtr, zoom);
 			if (sharedData.config.includeID && oo.id) { featurePtr->set_id(oo.id); }
+			layer.addFeature();
 
 		}
 	}
 }
 
-vector_tile::Tile_Layer* findLayerByName(
-	vector_tile::Tile& tile,
-	std::string& layerName,
-	vector<string>& keyList,
-	vector<vector_tile::Tile_Value>& valueList
-) {
-	for (unsigned i=0; i<tile.layers_size(); i++) {
-		if (tile.layers(i).name()!=layerName) continue;
-		// we already have this layer, so copy the key/value lists, and return it
-		for (unsigned j=0; j<tile.layers(i).keys_size(); j++) keyList.emplace_back(tile.layers(i).keys(j));
-		for (unsigned j=0; j<tile.layers(i).values_size(); j++) valueList.emplace_back(tile.layers(i).values(j));
-		return tile.mutable_layers(i);
-	}
-	// not found, so add new layer
-	return tile.add_layers();
-}
-
 OutputObjectsConstItPair getObjectsAtSubLayer(
 	const std::vector<OutputObjectID>& data,
 	uint_least8_t layerNum
@@ -258,21 +400,40 @@ OutputObjectsConstItPair getObjectsAtSubLayer(
 
 
 
+// The area below which parts of a layer's polygons are dropped, at a latp in
+// a tile of this zoom
+static double FilterArea(const LayerDef &ld, uint zoom, double latp) {
+	if (zoom >= ld.filterBelow) return 0.0;
+	return meter2degp(ld.filterArea, latp) * pow(2.0, (ld.filterBelow-1) - zoom);
+}
+
 void ProcessLayer(
 	const SourceList& sources,
 	const AttributeStore& attributeStore,
 	TileCoordinates index,
 	uint zoom, 
 	const std::vector<std::vector<OutputObjectID>>& data,
-	vector_tile::Tile& tile, 
+	const vector_tile::Tile_Layer* existingLayer,
+	std::string& output,
 	const TileBbox& bbox,
 	const std::vector<uint>& ltx,
 	SharedData& sharedData
 ) {
-	vector<string> keyList;
-	vector<vector_tile::Tile_Value> valueList;
+	thread_local MvtLayerWriter layer;
+	thread_local LayerDictionary dictionary;
+	layer.reset();
+	dictionary.clear();
 	std::string layerName = sharedData.layers.layers[ltx.at(0)].name;
-	vector_tile::Tile_Layer *vtLayer = sharedData.mergeSqlite ? findLayerByName(tile, layerName, keyList, valueList) : tile.add_layers();
+	TRACE_SPAN("ProcessLayer", sharedData.layers.layers[ltx.at(0)].name.c_str());
+	TileProfiler::beginLayer(layerName);
+	const size_t outputStart = output.size();
+
+	// If merging into a layer we already have, start from its contents
+	if (existingLayer) {
+		for (unsigned j=0; j<existingLayer->features_size(); j++) layer.addFeature(existingLayer->features(j));
+		for (unsigned j=0; j<existingLayer->keys_size(); j++) dictionary.addKey(existingLayer->keys(j));
+		for (unsigned j=0; j<existingLayer->values_size(); j++) dictionary.addValue(existingLayer->values(j));
+	}
 
 	//TileCoordinate tileX = index.x;
 	TileCoordinate tileY = index.y;
@@ -295,9 +456,13 @@ void ProcessLayer(
 			}
 			simplifyLevel *= pow(ld.simplifyRatio, (ld.simplifyBelow-1) - zoom);
 		}
-		if (zoom < ld.filterBelow) { 
-			filterArea = meter2degp(ld.filterArea, latp) * pow(2.0, (ld.filterBelow-1) - zoom);
-		}
+		// With simplify_length, the tolerance depends on the tile's latitude, so
+		// each tile simplifies its own clip
+		const bool shareSimplified = simplifyLevel > 0 && ld.simplifyLength <= 0;
+		filterArea = FilterArea(ld, zoom, latp);
+		// Aggregated polygons are traced from a grid, instead of being combined
+		const unsigned aggregateResolution = zoom < ld.aggregateBelow ? ld.aggregateResolution : 0;
+		const bool combinePolygons = zoom < ld.combinePolygonsBelow && aggregateResolution == 0;
 
 		for (size_t i=0; i<sources.size(); i++) {
 			// Loop through output objects
@@ -306,7 +471,8 @@ void ProcessLayer(
 			if (ld.featureLimit>0 && end-ooListSameLayer.first>ld.featureLimit && zoom<ld.featureLimitBelow) end = ooListSameLayer.first+ld.featureLimit;
 			ProcessObjects(sources[i], attributeStore, 
 				ooListSameLayer.first, end, sharedData, 
-				simplifyLevel, filterArea, zoom < ld.combinePolygonsBelow, zoom, bbox, vtLayer, keyList, valueList);
+				simplifyLevel, ld.simplifyFast, shareSimplified, filterArea, combinePolygons, aggregateResolution,
+				zoom, bbox, layer, dictionary);
 		}
 	}
 	if (verbose && std::time(0)-start>3) {
@@ -314,20 +480,11 @@ void ProcessLayer(
 	}
 
 	// If there are any objects, then add tags
-	if (vtLayer->features_size()>0) {
-		vtLayer->set_name(layerName);
-		vtLayer->set_version(sharedData.config.mvtVersion);
-		vtLayer->set_extent(bbox.hires ? 8192 : 4096);
-		for (uint j=vtLayer->keys_size(); j<keyList.size(); j++) {
-			vtLayer->add_keys(keyList[j]);
-		}
-		for (uint j=vtLayer->values_size(); j<valueList.size(); j++) { 
-			vector_tile::Tile_Value *v = vtLayer->add_values();
-			*v = valueList[j];
-		}
-	} else {
-		tile.mutable_layers()->RemoveLast();
+	if (layer.featureCount()>0) {
+		TilePhaseTimer timer(TilePhase::Encode);
+		layer.writeLayer(output, layerName, dictionary.keys, dictionary.values, bbox.hires ? 8192 : 4096, sharedData.config.mvtVersion);
 	}
+	TileProfiler::endLayer(layer.featureCount(), output.size() - outputStart);
 }
 
 bool signalStop=false;
@@ -336,6 +493,149 @@ void handleUserSignal(int signum) {
 	signalStop=true;
 }
 
+// If all there is in a tile is one polygon that covers it, write the tile as
+// that polygon's layer with just the tile's square in it, and return true.
+// These tiles only differ in the polygon's layer and attributes, so each
+// combination is encoded once and reused.
+static bool WriteFillTile(
+	SharedData& sharedData,
+	const SourceList& sources,
+	const AttributeStore& attributeStore,
+	const std::vector<std::vector<OutputObjectID>>& data,
+	const TileBbox& bbox,
+	std::string& output
+) {
+	const uint zoom = bbox.zoom;
+	const OutputObjectID *only = nullptr;
+	size_t source = 0;
+	for (size_t i = 0; i < data.size(); i++) {
+		for (auto const &oo : data[i]) {
+			if (zoom < oo.oo.minZoom) continue;
+			if (only) return false;
+			only = &oo;
+			source = i;
+		}
+	}
+	if (!only || only->oo.geomType != POLYGON_) return false;
+	const LayerDef &ld = sharedData.layers.layers[only->oo.layer];
+	if (zoom < ld.minzoom || zoom > ld.maxzoom) return false;
+	const double latp = (tiley2latp(bbox.index.y, zoom) + tiley2latp(bbox.index.y+1, zoom)) / 2;
+	if (geom::area(bbox.clippingBox) < FilterArea(ld, zoom, latp)) return false;
+	if (!sources[source]->polygonCoversTile(only->oo.objectID, bbox)) return false;
+
+	// The layer may be written along with others, under the first one's name
+	const std::string *layerName = nullptr;
+	for (auto const &group : sharedData.layers.layerOrder)
+		if (std::find(group.begin(), group.end(), only->oo.layer) != group.end())
+			layerName = &sharedData.layers.layers[group.at(0)].name;
+	if (!layerName) return false;
+
+	const bool includeID = sharedData.config.includeID && only->id;
+	std::string key = std::to_string(only->oo.layer) + "/" + std::to_string(only->oo.attributes) + "/" +
+	                  std::to_string(zoom) + (bbox.hires ? "/hires" : "");
+	if (includeID) key += "/" + std::to_string(only->id);
+	if (sharedData.fillTiles.find(key, output)) return true;
+
+	TilePhaseTimer timer(TilePhase::Encode);
+	MvtLayerWriter layer;
+	LayerDictionary dictionary;
+	vector_tile::Tile_Feature *featurePtr = layer.feature();
+	MultiPolygon square;
+	square.resize(1);
+	geom::convert(bbox.clippingBox, square[0]);
+	Geometry g = std::move(square);
+	WriteGeometryVisitor w(&bbox, featurePtr, 0.0, false);
+	boost::apply_visitor(w, g);
+	only->oo.writeAttributes(dictionary, attributeStore, featurePtr, zoom);
+	if (includeID) featurePtr->set_id(only->id);
+	layer.addFeature();
+	layer.writeLayer(output, *layerName, dictionary.keys, dictionary.values, bbox.hires ? 8192 : 4096, sharedData.config.mvtVersion);
+	sharedData.fillTiles.add(key, output);
+	return true;
+}
+
+// Write each layer of a tile, merged with the layers of an existing tile
+static void WriteLayers(
+	SharedData& sharedData,
+	const SourceList& sources,
+	const AttributeStore& attributeStore,
+	const std::vector<std::vector<OutputObjectID>>& data,
+	TileCoordinates coordinates,
+	uint zoom,
+	const TileBbox& bbox,
+	const vector_tile::Tile& existingTile,
+	std::string& outputdata
+) {
+	// Layers from a tile we're merging into keep their place, and new layers follow them.
+	// The output buffers are kept per thread so their storage is reused from tile to tile.
+	thread_local string newLayers;
+	newLayers.clear();
+	vector<string> mergedLayers(existingTile.layers_size());
+	const std::vector<std::vector<uint>> &layerOrder = sharedData.layers.layerOrder;
+
+	// At low zooms, a few layers (water, landcover...) can take minutes in one
+	// tile while the other threads sit idle at the end of the run. So layers
+	// with many objects are shared with any idle threads of the tile pool (in
+	// this thread's group), each into its own buffer, and put back in order
+	// afterwards; no threads are started, so the CPUs aren't oversubscribed.
+	// Not when profiling, as the profiler's timings are per thread.
+	std::vector<bool> parallel(layerOrder.size(), false);
+	bool anyParallel = false;
+	if (zoom < PARALLEL_LAYERS_BELOW && !TileProfiler::active()) {
+		for (size_t l = 0; l < layerOrder.size(); l++) {
+			size_t count = 0;
+			for (uint layerNum : layerOrder[l])
+				for (auto const &sourceData : data) {
+					auto range = getObjectsAtSubLayer(sourceData, layerNum);
+					count += range.second - range.first;
+				}
+			parallel[l] = count >= PARALLEL_LAYER_OBJECTS;
+			anyParallel |= parallel[l];
+		}
+	}
+
+	std::vector<int> existingLayers(layerOrder.size(), -1);
+	std::vector<string> layerOutputs(anyParallel ? layerOrder.size() : 0);
+	std::vector<size_t> heavyLayers, lightLayers;
+	for (size_t l = 0; l < layerOrder.size(); l++) {
+		if (signalStop) break;
+		const std::string &layerName = sharedData.layers.layers[layerOrder[l].at(0)].name;
+		int existing = -1;
+		for (int i=0; i<existingTile.layers_size(); i++) {
+			if (existingTile.layers(i).name()==layerName) { existing = i; break; }
+		}
+		existingLayers[l] = existing;
+		const vector_tile::Tile_Layer *existingLayer = existing>-1 ? &existingTile.layers(existing) : nullptr;
+
+		if (!anyParallel) {
+			ProcessLayer(sources, attributeStore, coordinates, zoom, data, existingLayer,
+				existing>-1 ? mergedLayers[existing] : newLayers,
+				bbox, layerOrder[l], sharedData);
+			continue;
+		}
+		(parallel[l] ? heavyLayers : lightLayers).push_back(l);
+	}
+	if (anyParallel) {
+		// The heavy layers first, so that they're the ones the other threads take
+		heavyLayers.insert(heavyLayers.end(), lightLayers.begin(), lightLayers.end());
+		TilePool::runShared(heavyLayers.size(), [&](size_t i) {
+			const size_t l = heavyLayers[i];
+			const vector_tile::Tile_Layer *existingLayer = existingLayers[l]>-1 ? &existingTile.layers(existingLayers[l]) : nullptr;
+			ProcessLayer(sources, attributeStore, coordinates, zoom, data, existingLayer,
+				layerOutputs[l], bbox, layerOrder[l], sharedData);
+		});
+	}
+	for (size_t l = 0; l < layerOutputs.size(); l++) {
+		if (existingLayers[l] > -1) mergedLayers[existingLayers[l]].append(layerOutputs[l]);
+		else newLayers.append(layerOutputs[l]);
+	}
+	for (int i=0; i<existingTile.layers_size(); i++) {
+		if (mergedLayers[i].empty()) MvtLayerWriter::writeLayer(outputdata, existingTile.layers(i));
+		else outputdata.append(mergedLayers[i]);
+	}
+	outputdata.append(newLayers);
+}
+
 void outputProc(
 	SharedData& sharedData, 
 	const SourceList& sources,
@@ -344,21 +644,14 @@ void outputProc(
 	TileCoordinates coordinates,
 	uint zoom
 ) {
-	// Create tile
-	vector_tile::Tile tile;
+	TRACE_SPAN("outputProc");
 	TileBbox bbox(coordinates, zoom, sharedData.config.highResolution && zoom==sharedData.config.endZoom, zoom==sharedData.config.endZoom);
-	if (sharedData.config.clippingBoxFromJSON && (
-			sharedData.config.maxLon <= bbox.minLon ||
-			sharedData.config.minLon >= bbox.maxLon ||
-			sharedData.config.maxLat <= bbox.minLat ||
-			sharedData.config.minLat >= bbox.maxLat))
-		return;
-
 	// Read existing tile if merging
+	vector_tile::Tile existingTile;
 	if (sharedData.mergeSqlite) {
 		std::string rawTile;
 		if (sharedData.mbtiles.readTileAndUncompress(rawTile, zoom, bbox.index.x, bbox.index.y, sharedData.config.compress, sharedData.config.gzip)) {
-			tile.ParseFromString(rawTile);
+			existingTile.ParseFromString(rawTile);
 		}
 	}
 
@@ -371,34 +664,31 @@ void outputProc(
 #endif
 	signalStop=false;
 
-	for (auto lt = sharedData.layers.layerOrder.begin(); lt != sharedData.layers.layerOrder.end(); ++lt) {
-		if (signalStop) break;
-		ProcessLayer(sources, attributeStore, coordinates, zoom, data, tile, bbox, *lt, sharedData);
+	thread_local string outputdata, compressed;
+	outputdata.clear();
+	if (sharedData.mergeSqlite || !WriteFillTile(sharedData, sources, attributeStore, data, bbox, outputdata))
+		WriteLayers(sharedData, sources, attributeStore, data, coordinates, zoom, bbox, existingTile, outputdata);
+
+	// Compress, reusing the compressed bytes if we've already seen an identical tile
+	if (sharedData.config.compress && !sharedData.tileDedup.find(outputdata, compressed)) {
+		TilePhaseTimer timer(TilePhase::Compress);
+		TileCompressor::forThread().compress(outputdata, sharedData.config.compression, sharedData.config.compressLevelAt(zoom), compressed);
+		sharedData.tileDedup.add(outputdata, compressed);
 	}
+	string *tileData = sharedData.config.compress ? &compressed : &outputdata;
 
-	// Write to file or sqlite
-	string outputdata, compressed;
-	if (sharedData.sqlite) {
-		// Write to sqlite
-		tile.SerializeToString(&outputdata);
-		if (sharedData.config.compress) { compressed = compress_string(outputdata, Z_DEFAULT_COMPRESSION, sharedData.config.gzip); }
-		sharedData.mbtiles.saveTile(zoom, bbox.index.x, bbox.index.y, sharedData.config.compress ? &compressed : &outputdata, sharedData.mergeSqlite);
-
-	} else {
-		// Write to file
-		stringstream dirname, filename;
-		dirname  << sharedData.outputFile << "/" << zoom << "/" << bbox.index.x;
-		filename << sharedData.outputFile << "/" << zoom << "/" << bbox.index.x << "/" << bbox.index.y << ".pbf";
-		boost::filesystem::create_directories(dirname.str());
-		fstream outfile(filename.str(), ios::out | ios::trunc | ios::binary);
-		if (sharedData.config.compress) {
-			tile.SerializeToString(&outputdata);
-			outfile << compress_string(outputdata, Z_DEFAULT_COMPRESSION, sharedData.config.gzip);
-		} else {
-			if (!tile.SerializeToOstream(&outfile)) {
-				cerr << "Couldn't write to " << filename.str() << endl;
-			}
+	{
+		TilePhaseTimer timer(TilePhase::Write);
+		// Write to file, sqlite or pmtiles
+		if (sharedData.outputMode == OutputMode::MBTiles) {
+			sharedData.mbtilesForTile(zoom, bbox.index.x, bbox.index.y).saveTile(zoom, bbox.index.x, bbox.index.y, tileData, sharedData.mergeSqlite || sharedData.replaceTiles);
+
+		} else if (sharedData.outputMode == OutputMode::PMTiles) {
+			sharedData.pmtiles.saveTile(zoom, bbox.index.x, bbox.index.y, tileData);
 		}
-		outfile.close();
+		// Directory output goes to its sink, so workers don't wait on the filesystem
+		for (auto &output : sharedData.outputSinks)
+			output->saveTile(zoom, bbox.index.x, bbox.index.y, tileData);
 	}
+	TileProfiler::endTile(outputdata.size(), tileData->size());
 }
@@ -12,6 +12,8 @@
 #include <stdexcept>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <functional>
 #include <chrono>
 
 // Other utilities
@@ -21,8 +23,6 @@
 #include <boost/program_options.hpp>
 #include <boost/variant.hpp>
 #include <boost/algorithm/string.hpp>
-#include <boost/asio/thread_pool.hpp>
-#include <boost/sort/sort.hpp>
 
 #include "rapidjson/document.h"
 #include "rapidjson/writer.h"
@@ -33,6 +33,7 @@
 #ifndef _MSC_VER
 #include <sys/resource.h>
 #endif
+#include <shared_mutex>
 
 #include "geom.h"
 #include "node_stores.h"
@@ -51,12 +52,26 @@
 #include "shared_data.h"
 #include "read_pbf.h"
 #include "read_shp.h"
+#include "read_fgb.h"
+#include "read_geojson.h"
+#include "source_cache.h"
+#include "snapshot.h"
+#include "read_osc.h"
 #include "tile_worker.h"
+#include "tile_profiler.h"
+#include "tile_pool.h"
+#include "tile_server.h"
+#include "metrics.h"
+#include "trace.h"
+#include "lua_profiler.h"
 #include "osm_mem_tiles.h"
 #include "shp_mem_tiles.h"
 
 #include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
 #include <boost/interprocess/streams/bufferstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 #ifndef TM_VERSION
 #define TM_VERSION (version not set)
@@ -72,29 +87,39 @@ namespace geom = boost::geometry;
 // Global verbose switch
 bool verbose = false;
 
-void WriteSqliteMetadata(rapidjson::Document const &jsonConfig, SharedData &sharedData, LayerDefinition const &layers)
+// With --pipeline, z6 tiles this close to a later .pbf's bounding box wait for
+// it, as ways that cross the edge of an extract reach beyond it
+#define PIPELINE_CELL_MARGIN 1
+
+// With --pin-threads, runs of tiles dealt to each group of threads
+#define TILE_POOL_RUNS_PER_GROUP 32
+
+// Tiles to cost before the counting is worth sharing out between threads
+#define TILE_COST_PARALLEL_TILES 16384
+
+void WriteSqliteMetadata(rapidjson::Document const &jsonConfig, MBTiles &mbtiles, LayerDefinition const &layers)
 {
 	// Write mbtiles 1.3+ json object
-	sharedData.mbtiles.writeMetadata("json", layers.serialiseToJSON());
+	mbtiles.writeMetadata("json", layers.serialiseToJSON());
 
 	// Write user-defined metadata
 	if (jsonConfig["settings"].HasMember("metadata")) {
 		const rapidjson::Value &md = jsonConfig["settings"]["metadata"];
 		for(rapidjson::Value::ConstMemberIterator it=md.MemberBegin(); it != md.MemberEnd(); ++it) {
 			if (it->value.IsString()) {
-				sharedData.mbtiles.writeMetadata(it->name.GetString(), it->value.GetString());
+				mbtiles.writeMetadata(it->name.GetString(), it->value.GetString());
 			} else {
 				rapidjson::StringBuffer strbuf;
 				rapidjson::Writer<rapidjson::StringBuffer> writer(strbuf);
 				it->value.Accept(writer);
-				sharedData.mbtiles.writeMetadata(it->name.GetString(), strbuf.GetString());
+				mbtiles.writeMetadata(it->name.GetString(), strbuf.GetString());
 			}
 		}
 	}
-	sharedData.mbtiles.closeForWriting();
+	mbtiles.closeForWriting();
 }
 
-void WriteFileMetadata(rapidjson::Document const &jsonConfig, SharedData const &sharedData, LayerDefinition const &layers)
+void WriteFileMetadata(rapidjson::Document const &jsonConfig, SharedData const &sharedData, const std::string &dir, LayerDefinition const &layers)
 {
 	if(sharedData.config.compress) 
 		std::cout << "When serving compressed tiles, make sure to include 'Content-Encoding: gzip' in your webserver configuration for serving pbf files"  << std::endl;
@@ -121,7 +146,7 @@ void WriteFileMetadata(rapidjson::Document const &jsonConfig, SharedData const &
 	document.AddMember("maxzoom", rapidjson::Value(sharedData.config.endZoom), document.GetAllocator());
 	document.AddMember("vector_layers", layers.serialiseToJSONValue(document.GetAllocator()), document.GetAllocator());
 
-	auto fp = std::fopen((sharedData.outputFile + "/metadata.json").c_str(), "w");
+	auto fp = std::fopen((dir + "/metadata.json").c_str(), "w");
 
 	char writeBuffer[65536];
 	rapidjson::FileWriteStream os(fp, writeBuffer, sizeof(writeBuffer));
@@ -131,6 +156,117 @@ void WriteFileMetadata(rapidjson::Document const &jsonConfig, SharedData const &
 	fclose(fp);
 }
 
+void WritePmtilesMetadata(rapidjson::Document const &jsonConfig, SharedData const &sharedData, PMTiles &pmtiles, LayerDefinition const &layers)
+{
+	rapidjson::Document document;
+	document.SetObject();
+
+	// Write user-defined metadata
+	if (jsonConfig["settings"].HasMember("metadata")) {
+		const rapidjson::Value &md = jsonConfig["settings"]["metadata"];
+		document.CopyFrom(md, document.GetAllocator());
+	}
+
+	document.AddMember("name", rapidjson::Value().SetString(sharedData.config.projectName.c_str(), document.GetAllocator()), document.GetAllocator());
+	document.AddMember("version", rapidjson::Value().SetString(sharedData.config.projectVersion.c_str(), document.GetAllocator()), document.GetAllocator());
+	document.AddMember("description", rapidjson::Value().SetString(sharedData.config.projectDesc.c_str(), document.GetAllocator()), document.GetAllocator());
+	document.AddMember("type", "baselayer", document.GetAllocator());
+	document.AddMember("vector_layers", layers.serialiseToJSONValue(document.GetAllocator()), document.GetAllocator());
+
+	rapidjson::StringBuffer strbuf;
+	rapidjson::Writer<rapidjson::StringBuffer> writer(strbuf);
+	document.Accept(writer);
+	pmtiles.closeForWriting(strbuf.GetString());
+}
+
+// Create an .mbtiles and write the metadata that's known before the tiles.
+// When adding to an existing .mbtiles, its bounds are taken in too.
+void OpenMbtiles(MBTiles &mbtiles, std::string filename, Config &config, bool existing)
+{
+	mbtiles.openForWriting(filename);
+	mbtiles.writeMetadata("name",config.projectName);
+	mbtiles.writeMetadata("type","baselayer");
+	mbtiles.writeMetadata("version",config.projectVersion);
+	mbtiles.writeMetadata("description",config.projectDesc);
+	mbtiles.writeMetadata("format","pbf");
+	mbtiles.writeMetadata("minzoom",to_string(config.startZoom));
+	mbtiles.writeMetadata("maxzoom",to_string(config.endZoom));
+
+	ostringstream bounds;
+	if (existing) {
+		double cMinLon, cMaxLon, cMinLat, cMaxLat;
+		mbtiles.readBoundingBox(cMinLon, cMaxLon, cMinLat, cMaxLat);
+		config.enlargeBbox(cMinLon, cMaxLon, cMinLat, cMaxLat);
+	}
+	bounds << fixed << config.minLon << "," << config.minLat << "," << config.maxLon << "," << config.maxLat;
+	mbtiles.writeMetadata("bounds",bounds.str());
+
+	if (!config.defaultView.empty()) {
+		mbtiles.writeMetadata("center",config.defaultView);
+	} else {
+		double centerLon = (config.minLon + config.maxLon) / 2;
+		double centerLat = (config.minLat + config.maxLat) / 2;
+		int centerZoom = floor((config.startZoom + config.endZoom) / 2);
+		ostringstream center;
+		center << fixed << centerLon << "," << centerLat << "," << centerZoom;
+		mbtiles.writeMetadata("center",center.str());
+	}
+}
+
+// Create a .pmtiles and fill in its header
+void OpenPmtiles(PMTiles &pmtiles, std::string filename, Config &config)
+{
+	pmtiles.openForWriting(filename);
+
+	PMTilesHeader &header = pmtiles.header;
+	header.tileCompression = config.compression == CompressionType::Zstd ? PMTILES_COMPRESSION_ZSTD :
+	                         config.compress ? PMTILES_COMPRESSION_GZIP : PMTILES_COMPRESSION_NONE;
+	header.minZoom = config.startZoom;
+	header.maxZoom = config.endZoom;
+	header.minLonE7 = config.minLon * 10000000;
+	header.minLatE7 = config.minLat * 10000000;
+	header.maxLonE7 = config.maxLon * 10000000;
+	header.maxLatE7 = config.maxLat * 10000000;
+
+	double centerLon = (config.minLon + config.maxLon) / 2;
+	double centerLat = (config.minLat + config.maxLat) / 2;
+	int centerZoom = floor((config.startZoom + config.endZoom) / 2);
+	if (!config.defaultView.empty()) {
+		vector<string> view = split_string(config.defaultView, ',');
+		centerLon = stod(view[0]); centerLat = stod(view[1]); centerZoom = stoi(view[2]);
+	}
+	header.centerLonE7 = centerLon * 10000000;
+	header.centerLatE7 = centerLat * 10000000;
+	header.centerZoom = centerZoom;
+}
+
+// Combine the .mbtiles written by each --tile-partition worker. The
+// partitions hold different tiles, and the same metadata, so the first is
+// copied and the tiles from the rest are added to it.
+bool CombinePartitions(std::string outputFile, const vector<string> &partitionFiles)
+{
+	for (const string &file : partitionFiles) {
+		if (!boost::filesystem::exists(file)) { cerr << "Couldn't find " << file << " to combine" << endl; return false; }
+		if (boost::filesystem::equivalent(file, outputFile)) { cerr << "--combine can't include the --output file" << endl; return false; }
+	}
+	try {
+		boost::filesystem::remove(outputFile);
+		boost::filesystem::copy_file(partitionFiles[0], outputFile);
+		MBTiles mbtiles;
+		mbtiles.openForWriting(outputFile);
+		for (size_t i = 1; i < partitionFiles.size(); i++) {
+			cout << "Combining " << partitionFiles[i] << " (" << (i+1) << "/" << partitionFiles.size() << ")          \r" << std::flush;
+			mbtiles.mergeFrom(partitionFiles[i]);
+		}
+		cout << endl;
+		mbtiles.closeForWriting();
+	} catch (std::exception &e) {
+		cerr << "Couldn't combine into " << outputFile << ": " << e.what() << endl;
+		return false;
+	}
+	return true;
+}
+
 double bboxElementFromStr(const string& number) {
 	try {
 		return boost::lexical_cast<double>(number);
@@ -162,37 +298,114 @@ vector<string> parseBox(const string& bbox) {
  *
  * Worker threads write the output tiles, and start in the outputProc function.
  */
+// Read an external layer source, choosing the reader by its extension
+void readLayerSource(const Box &clippingBox, LayerDefinition &layers, uint baseZoom, uint layerNum, uint threadNum,
+                     ShpMemTiles &shpMemTiles, OsmLuaProcessing &osmLuaProcessing) {
+	const string &source = layers.layers[layerNum].source;
+	if (ends_with(source, ".fgb"))
+		readFlatGeobuf(clippingBox, layers, layerNum, threadNum, shpMemTiles, osmLuaProcessing);
+	else if (ends_with(source, ".geojson") || ends_with(source, ".json") ||
+	         ends_with(source, ".geojsonl") || ends_with(source, ".geojsons") || ends_with(source, ".ndjson"))
+		readGeoJson(clippingBox, layers, layerNum, threadNum, shpMemTiles, osmLuaProcessing);
+	else
+		readShapefile(clippingBox, layers, baseZoom, layerNum, threadNum, shpMemTiles, osmLuaProcessing);
+}
+
+// Read it from its cache if that's up to date, and otherwise read it and save the cache
+void readCachedLayerSource(const Box &clippingBox, LayerDefinition &layers, uint baseZoom, uint layerNum, uint threadNum,
+                           ShpMemTiles &shpMemTiles, OsmLuaProcessing &osmLuaProcessing, const string &luaFile) {
+	LayerDef &layer = layers.layers[layerNum];
+	vector<string> luaFiles;
+	if (osmLuaProcessing.canRemapShapefiles()) {
+		luaFiles = osmLuaProcessing.moduleFiles();
+		luaFiles.insert(luaFiles.begin(), luaFile);
+	}
+	SourceCache cache(layer.source + ".tmcache",
+	                  SourceCache::signature(layer, clippingBox, baseZoom, luaFiles),
+	                  osmLuaProcessing.getAttributeStore());
+	if (cache.load(layerNum, layer, shpMemTiles, threadNum)) {
+		cout << "Using source cache " << layer.source << ".tmcache" << endl;
+		return;
+	}
+	bool saving = cache.startSaving();
+	if (saving) shpMemTiles.SetLayerCache(layerNum, &cache);
+	readLayerSource(clippingBox, layers, baseZoom, layerNum, threadNum, shpMemTiles, osmLuaProcessing);
+	shpMemTiles.SetLayerCache(layerNum, nullptr);
+	if (saving) cache.finishSaving(layer);
+}
+
 int main(int argc, char* argv[]) {
 
 	// ----	Read command-line options
 	vector<string> inputFiles;
 	string luaFile;
 	string osmStoreFile;
+	string reuseStoreFile;
+	bool indexPbf = false;
+	bool cacheSources = false;
+	string oscFile;
 	string jsonFile;
 	uint threadNum;
+	uint mbtilesShards;
+	uint memoryBudget, memoryLimit, readAheadLimit;
+	vector<string> outputFiles;
 	string outputFile;
 	string bbox;
-	bool _verbose = false, sqlite= false, mergeSqlite = false, mapsplit = false, osmStoreCompact = false, skipIntegrity = false, osmStoreUncompressedNodes = false, osmStoreUncompressedWays = false, materializeGeometries = false;
-	bool logTileTimings = false;
+	bool _verbose = false, mergeSqlite = false, mapsplit = false, osmStoreCompact = false, osmStoreHashNodes = false, skipIntegrity = false, osmStoreUncompressedNodes = false, osmStoreUncompressedWays = false, materializeGeometries = false, hugePages = false, profileLua = false, pipeline = false, pinThreads = false;
+	string tileTimingsFile, phaseTimingsFile, metricsAddress;
+	string serveFile;
+	uint port, metricsPort;
+	string metricsFile;
+	string traceFile;
+	size_t traceEvents;
+	string tilePartition;
+	string snapshotFile, fromSnapshotFile;
+	vector<string> combineFiles;
+	OutputMode outputMode = OutputMode::File;
 
 	po::options_description desc("tilemaker " STR(TM_VERSION) "\nConvert OpenStreetMap .pbf files into vector tiles\n\nAvailable options");
 	desc.add_options()
 		("help",                                                                 "show help message")
 		("input",  po::value< vector<string> >(&inputFiles),                     "source .osm.pbf file")
-		("output", po::value< string >(&outputFile),                             "target directory or .mbtiles/.sqlite file")
+		("output", po::value< vector<string> >(&outputFiles),                    "target directory or .mbtiles/.sqlite/.pmtiles file (give more than once to write the same tiles to each)")
 		("bbox",   po::value< string >(&bbox),                                   "bounding box to use if input file does not have a bbox header set, example: minlon,minlat,maxlon,maxlat")
 		("merge"  ,po::bool_switch(&mergeSqlite),                                "merge with existing .mbtiles (overwrites otherwise)")
+		("pipeline", po::bool_switch(&pipeline), "with several .pbf extracts, write each area's tiles once no later extract can reach it, while the rest are read")
+		("osc",    po::value< string >(&oscFile),                                "only rewrite the tiles in an existing .mbtiles affected by this .osc change file")
 		("config", po::value< string >(&jsonFile)->default_value("config.json"), "config JSON file")
 		("process",po::value< string >(&luaFile)->default_value("process.lua"),  "tag-processing Lua file")
 		("store",  po::value< string >(&osmStoreFile),  "temporary storage for node/ways/relations data")
+		("huge-pages", po::bool_switch(&hugePages), "keep node/way stores in the kernel's reserved huge pages, if it has enough")
+		("reuse-store", po::value< string >(&reuseStoreFile), "save node/way stores to (or load them from) this path, for reuse with the same .pbf")
+		("snapshot", po::value< string >(&snapshotFile), "once the input is read, save everything needed to write tiles to this file")
+		("from-snapshot", po::value< string >(&fromSnapshotFile), "write tiles from a file saved with --snapshot, rather than reading the input again")
+		("index-pbf", po::bool_switch(&indexPbf), "save which kinds of object each .pbf block holds to a .idx file next to the .pbf, and use it on later runs")
+		("cache-sources", po::bool_switch(&cacheSources), "save the features read from each shapefile (or other layer source) to a .tmcache file next to it, and use it on later runs")
 		("compact",po::bool_switch(&osmStoreCompact),  "Reduce overall memory usage (compact mode).\nNOTE: This requires the input to be renumbered (osmium renumber)")
+		("hash-nodes", po::bool_switch(&osmStoreHashNodes),  "Store nodes in a hash table. Faster than the default for unsorted .pbfs, but uses more memory")
 		("no-compress-nodes", po::bool_switch(&osmStoreUncompressedNodes),  "Store nodes uncompressed")
 		("no-compress-ways", po::bool_switch(&osmStoreUncompressedWays),  "Store ways uncompressed")
 		("materialize-geometries", po::bool_switch(&materializeGeometries),  "Materialize geometries - faster, but requires more memory")
+		("memory-budget", po::value< uint >(&memoryBudget)->default_value(0),  "MB to spend on materializing the ways that appear in most tiles, and caching the rest (ignored with --materialize-geometries)")
+		("memory-limit", po::value< uint >(&memoryLimit)->default_value(0),  "MB of output objects to keep in memory; beyond that, they're written to disk (in --store, if given)")
+		("read-ahead-limit", po::value< uint >(&readAheadLimit)->default_value(0), "with mapsplit input, MB of memory in use beyond which no more source tiles are read ahead")
 		("verbose",po::bool_switch(&_verbose),                                   "verbose error output")
 		("skip-integrity",po::bool_switch(&skipIntegrity),                       "don't enforce way/node integrity")
-		("log-tile-timings", po::bool_switch(&logTileTimings), "log how long each tile takes")
-		("threads",po::value< uint >(&threadNum)->default_value(0),              "number of threads (automatically detected if 0)");
+		("log-tile-timings", po::value< string >(&tileTimingsFile), "write per-tile and per-layer timings to this .csv or .ndjson file")
+		("profile-lua", po::bool_switch(&profileLua), "report where the Lua profile spends its time, by function, primary tag, layer and helper, at the end of the run")
+		("log-phase-timings", po::value< string >(&phaseTimingsFile), "write the time spent reading input, indexing and writing tiles, with peak memory, to this .json file")
+		("metrics-port", po::value< uint >(&metricsPort)->default_value(0), "serve progress metrics over HTTP on this port, at /metrics (for Prometheus) and /metrics.json")
+		("metrics-address", po::value< string >(&metricsAddress)->default_value("127.0.0.1"), "address to serve progress metrics on (0.0.0.0 for every interface)")
+		("metrics-file", po::value< string >(&metricsFile), "rewrite this .json file with progress metrics every few seconds")
+		("trace",  po::value< string >(&traceFile), "write a timeline of what each thread does to this Chrome trace .json file (needs a build with tracing)")
+		("trace-events", po::value< size_t >(&traceEvents)->default_value(TRACE_EVENTS_PER_THREAD), "spans to keep per thread with --trace, 32 bytes each; beyond that, the oldest are overwritten")
+		("threads",po::value< uint >(&threadNum)->default_value(0),              "number of threads (automatically detected if 0)")
+		("pin-threads", po::bool_switch(&pinThreads),                             "pin the tile-writing threads to CPUs, in a group per NUMA node")
+		("mbtiles-shards",po::value< uint >(&mbtilesShards)->default_value(1),   "number of .mbtiles files to write in parallel, merged at the end")
+		("tile-partition",po::value< string >(&tilePartition),                   "only write this worker's share of the tiles, given as i/N (worker 0 also writes z0-z5)")
+		("combine",po::value< vector<string> >(&combineFiles)->multitoken(),     "combine these .mbtiles, written with --tile-partition, into --output")
+		("serve",  po::value< string >(&serveFile),                              "serve the tiles in this .mbtiles over HTTP, rather than making tiles")
+		("port",   po::value< uint >(&port)->default_value(8080),               "port to listen on with --serve");
 	po::positional_options_description p;
 	p.add("input", -1);
 	po::variables_map vm;
@@ -205,14 +418,85 @@ int main(int argc, char* argv[]) {
 	po::notify(vm);
 	
 	if (vm.count("help")) { cout << desc << endl; return 0; }
+	if (!serveFile.empty()) {
+		TileServer server(serveFile);
+		if (!server.good()) return -1;
+		server.run(port, threadNum == 0 ? max(thread::hardware_concurrency(), 1u) : threadNum);
+		return 0;
+	}
 	if (vm.count("output")==0) { cerr << "You must specify an output file or directory. Run with --help to find out more." << endl; return -1; }
+	{
+		// Two outputs at the same path would both write to it at once
+		unordered_set<string> outputPaths;
+		for (const string &file : outputFiles) {
+			boost::filesystem::path path = boost::filesystem::weakly_canonical(boost::filesystem::absolute(file));
+			if (path.filename() == ".") path = path.parent_path();
+			if (!outputPaths.insert(path.string()).second) {
+				cerr << "--output " << file << " is given more than once" << endl;
+				return -1;
+			}
+		}
+	}
+	if (!combineFiles.empty()) {
+		if (outputFiles.size() != 1 || outputModeFor(outputFiles[0]) != OutputMode::MBTiles) {
+			cerr << "--combine needs a single .mbtiles --output" << endl;
+			return -1;
+		}
+		return CombinePartitions(outputFiles[0], combineFiles) ? 0 : -1;
+	}
 	if (vm.count("input")==0) { cout << "No source .osm.pbf file supplied" << endl; }
 
+	// Worker partitionIndex of partitionCount writes only its share of the z6 tiles
+	uint partitionIndex = 0, partitionCount = 1;
+	if (!tilePartition.empty()) {
+		int length = 0;
+		if (sscanf(tilePartition.c_str(), "%u/%u%n", &partitionIndex, &partitionCount, &length) != 2 ||
+		    length != static_cast<int>(tilePartition.size()) || partitionCount == 0 || partitionIndex >= partitionCount) {
+			cerr << "--tile-partition should be i/N, with i from 0 to N-1" << endl;
+			return -1;
+		}
+	}
+
 	vector<string> bboxElements = parseBox(bbox);
 
-	if (ends_with(outputFile, ".mbtiles") || ends_with(outputFile, ".sqlite")) { sqlite=true; }
+	outputFile = outputFiles[0];
+	outputMode = outputModeFor(outputFile);
+	bool anyPmtiles = false, allPmtiles = true;
+	for (const string &file : outputFiles) {
+		anyPmtiles = anyPmtiles || outputModeFor(file) == OutputMode::PMTiles;
+		allPmtiles = allPmtiles && outputModeFor(file) == OutputMode::PMTiles;
+	}
 	if (threadNum == 0) { threadNum = max(thread::hardware_concurrency(), 1u); }
 	verbose = _verbose;
+	void_mmap_allocator::useHugePages(hugePages);
+
+	// Wall-clock seconds spent in each phase, for --log-phase-timings
+	const auto runStart = std::chrono::steady_clock::now();
+	auto phaseStart = runStart;
+	vector<pair<string, double>> phaseTimes;
+	double indexSeconds = 0;
+	auto secondsSince = [](std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	};
+	auto endPhase = [&](const char *name) {
+		phaseTimes.emplace_back(name, secondsSince(phaseStart));
+		phaseStart = std::chrono::steady_clock::now();
+	};
+
+	if (!traceFile.empty()) {
+#ifdef TM_TRACE
+		if (!Tracer::start(traceFile, traceEvents)) return -1;
+#else
+		cerr << "This tilemaker was built without tracing: rebuild with make TRACE=1 (or cmake -DTILEMAKER_TRACE=ON) to use --trace" << endl;
+		return -1;
+#endif
+	}
+
+	MetricsExporter metricsExporter(metricsPort, metricsAddress, metricsFile);
+	metricsExporter.gauge("blocks_processed", "Blocks of the .pbf read in this phase", []() { return blocksProcessed.load(); });
+	metricsExporter.gauge("blocks_to_process", "Blocks of the .pbf to read in this phase", []() { return blocksToProcess.load(); });
+	metricsExporter.gauge("store_bytes", "Memory mapped for the node, way and relation stores", []() { return void_mmap_allocator::memoryBytes(); }, "location", "ram");
+	metricsExporter.gauge("store_bytes", "Memory mapped for the node, way and relation stores", []() { return void_mmap_allocator::fileBytes(); }, "location", "file");
 
 
 	// ---- Check config
@@ -222,18 +506,43 @@ int main(int argc, char* argv[]) {
 
 	// ---- Remove existing .mbtiles if it exists
 
-	if (sqlite && !mergeSqlite && static_cast<bool>(std::ifstream(outputFile))) {
-		cout << "mbtiles file exists, will overwrite (Ctrl-C to abort, rerun with --merge to keep)" << endl;
-		std::this_thread::sleep_for(std::chrono::milliseconds(2000));
-		if (remove(outputFile.c_str()) != 0) {
-			cerr << "Couldn't remove existing file" << endl;
-			return 0;
+	if (outputMode==OutputMode::PMTiles && mergeSqlite) {
+		cerr << "--merge is not supported for .pmtiles output" << endl;
+		return -1;
+	}
+	if (partitionCount > 1 && anyPmtiles) {
+		cerr << "--tile-partition can't be used with .pmtiles output, as the partitions couldn't be combined" << endl;
+		return -1;
+	}
+	if (outputFiles.size() > 1 && (mergeSqlite || !oscFile.empty())) {
+		cerr << "--merge and --osc can only be used with a single --output" << endl;
+		return -1;
+	}
+	if (!oscFile.empty() && (outputMode!=OutputMode::MBTiles || mergeSqlite || !static_cast<bool>(std::ifstream(outputFile)))) {
+		cerr << "--osc needs an existing .mbtiles output, and can't be used with --merge" << endl;
+		return -1;
+	}
+	for (const string &file : outputFiles) {
+		if (outputModeFor(file)==OutputMode::MBTiles && !mergeSqlite && oscFile.empty() && static_cast<bool>(std::ifstream(file))) {
+			cout << file << " exists, will overwrite (Ctrl-C to abort, rerun with --merge to keep)" << endl;
+			std::this_thread::sleep_for(std::chrono::milliseconds(2000));
+			if (remove(file.c_str()) != 0) {
+				cerr << "Couldn't remove existing file" << endl;
+				return 0;
+			}
 		}
-	} else if (mergeSqlite && !static_cast<bool>(std::ifstream(outputFile))) {
+	}
+	if (mergeSqlite && !static_cast<bool>(std::ifstream(outputFile))) {
 		cout << "--merge specified but .mbtiles file doesn't already exist, ignoring" << endl;
 		mergeSqlite = false;
 	}
 
+	// The read-ahead limit is checked against the memory the process is using
+	if (readAheadLimit > 0 && residentBytes() == 0) {
+		cerr << "--read-ahead-limit can't be used here, as tilemaker can't measure its memory use on this platform" << endl;
+		return -1;
+	}
+
 	// ----	Read bounding box from first .pbf (if there is one) or mapsplit file
 
 	bool hasClippingBox = false;
@@ -258,6 +567,45 @@ int main(int argc, char* argv[]) {
 		if(ret != 0) return ret;
 	}
 
+	// ----	With --pipeline, find the z6 tiles each .pbf's bounding box reaches;
+	//		each is written once the last .pbf that reaches it has been read
+
+	std::vector<size_t> cellSealedAt;
+	if (pipeline) {
+		if (mapsplit || inputFiles.size() < 2) {
+			cerr << "--pipeline needs two or more .pbf files" << endl;
+			return -1;
+		}
+		if (!oscFile.empty() || !snapshotFile.empty() || !fromSnapshotFile.empty() || !reuseStoreFile.empty() || memoryLimit > 0) {
+			cerr << "--pipeline can't be used with --osc, --snapshot, --from-snapshot, --reuse-store or --memory-limit" << endl;
+			return -1;
+		}
+		cellSealedAt.assign(CLUSTER_ZOOM_AREA, 0);
+		for (size_t i = 0; i < inputFiles.size(); i++) {
+			double left = 0, right = 0, bottom = 0, top = 0;
+			bool hasBox = false;
+			int ret = ReadPbfBoundingBox(inputFiles[i], left, right, bottom, top, hasBox);
+			if (ret != 0) return ret;
+			if (!hasBox) {
+				cerr << "--pipeline needs each .pbf to have a bounding box in its header, and " << inputFiles[i] << " doesn't" << endl;
+				return -1;
+			}
+			// Without --bbox, write all of the extracts rather than the first
+			if (bboxElements.empty() && i > 0) {
+				minLon = std::min(minLon, left); maxLon = std::max(maxLon, right);
+				minLat = std::min(minLat, bottom); maxLat = std::max(maxLat, top);
+			}
+			const int maxCell = CLUSTER_ZOOM_WIDTH - 1;
+			const int minX = std::max<int>(0, int(lon2tilex(left, CLUSTER_ZOOM)) - PIPELINE_CELL_MARGIN);
+			const int maxX = std::min<int>(maxCell, int(lon2tilex(right, CLUSTER_ZOOM)) + PIPELINE_CELL_MARGIN);
+			const int minY = std::max<int>(0, int(latp2tiley(lat2latp(top), CLUSTER_ZOOM)) - PIPELINE_CELL_MARGIN);
+			const int maxY = std::min<int>(maxCell, int(latp2tiley(lat2latp(bottom), CLUSTER_ZOOM)) + PIPELINE_CELL_MARGIN);
+			for (int x = minX; x <= maxX; x++)
+				for (int y = minY; y <= maxY; y++)
+					cellSealedAt[x * CLUSTER_ZOOM_WIDTH + y] = i;
+		}
+	}
+
 	if (hasClippingBox) {
 		clippingBox = Box(geom::make<Point>(minLon, lat2latp(minLat)),
 		                  geom::make<Point>(maxLon, lat2latp(maxLat)));
@@ -276,10 +624,28 @@ int main(int argc, char* argv[]) {
 		fclose(fp);
 
 		config.readConfig(jsonConfig, hasClippingBox, clippingBox);
+	} catch (std::runtime_error &e) {
+		cerr << e.what() << endl;
+		return -1;
 	} catch (...) {
 		cerr << "Couldn't find expected details in JSON file." << endl;
 		return -1;
 	}
+	if (config.compression == CompressionType::Zstd && !allPmtiles) {
+		cerr << "zstd compression is only supported for .pmtiles output" << endl;
+		return -1;
+	}
+	if (config.compression == CompressionType::Deflate && anyPmtiles) {
+		cout << "PMTiles doesn't support deflate compression, so tiles will be gzip-compressed" << endl;
+		config.compression = CompressionType::Gzip;
+		config.gzip = true;
+	}
+#ifndef TM_ZSTD
+	if (config.compression == CompressionType::Zstd) {
+		cerr << "Compile tilemaker with zstd installed to enable zstd compression" << endl;
+		return -1;
+	}
+#endif
 	if (hasClippingBox) {
 		cout << "Bounding box " << clippingBox.min_corner().x() << ", " << latp2lat(clippingBox.min_corner().y()) << ", " << 
 		                           clippingBox.max_corner().x() << ", " << latp2lat(clippingBox.max_corner().y()) << endl;
@@ -290,29 +656,37 @@ int main(int argc, char* argv[]) {
 
 	bool allPbfsHaveSortTypeThenID = true;
 	bool anyPbfHasLocationsOnWays = false;
+	bool allPbfsHaveLocationsOnWays = true;
 
 	for (const std::string& file: inputFiles) {
 		if (ends_with(file, ".pbf")) {
 			allPbfsHaveSortTypeThenID = allPbfsHaveSortTypeThenID && PbfHasOptionalFeature(file, OptionSortTypeThenID);
-			anyPbfHasLocationsOnWays = anyPbfHasLocationsOnWays || PbfHasOptionalFeature(file, OptionLocationsOnWays);
+			const bool locationsOnWays = PbfHasOptionalFeature(file, OptionLocationsOnWays);
+			anyPbfHasLocationsOnWays = anyPbfHasLocationsOnWays || locationsOnWays;
+			allPbfsHaveLocationsOnWays = allPbfsHaveLocationsOnWays && locationsOnWays;
 		}
 	}
 
-	if (osmStoreCompact)
-		nodeStore = make_shared<CompactNodeStore>();
-	else {
+	// Mapsplit source tiles are each read into stores of their own, made the same way
+	auto makeNodeStore = [&]() -> shared_ptr<NodeStore> {
+		if (osmStoreCompact)
+			return make_shared<CompactNodeStore>();
 		if (allPbfsHaveSortTypeThenID)
-			nodeStore = make_shared<SortedNodeStore>(!osmStoreUncompressedNodes);
-		else
-			nodeStore = make_shared<BinarySearchNodeStore>();
-	}
-
-	shared_ptr<WayStore> wayStore;
-	if (!anyPbfHasLocationsOnWays && allPbfsHaveSortTypeThenID) {
-		wayStore = make_shared<SortedWayStore>(!osmStoreUncompressedNodes, *nodeStore.get());
-	} else {
-		wayStore = make_shared<BinarySearchWayStore>();
-	}
+			return make_shared<SortedNodeStore>(!osmStoreUncompressedNodes);
+		if (osmStoreHashNodes)
+			return make_shared<HashNodeStore>();
+		return make_shared<BinarySearchNodeStore>();
+	};
+	auto makeWayStore = [&](const NodeStore &nodes) -> shared_ptr<WayStore> {
+		if (!anyPbfHasLocationsOnWays && allPbfsHaveSortTypeThenID)
+			return make_shared<SortedWayStore>(!osmStoreUncompressedNodes, nodes);
+		if (anyPbfHasLocationsOnWays && allPbfsHaveLocationsOnWays && allPbfsHaveSortTypeThenID && !mapsplit)
+			// Ways have their coordinates in the .pbf, so keep those rather than node IDs
+			return make_shared<SortedWayStore>(!osmStoreUncompressedWays);
+		return make_shared<BinarySearchWayStore>();
+	};
+	nodeStore = makeNodeStore();
+	shared_ptr<WayStore> wayStore = makeWayStore(*nodeStore);
 
 	OSMStore osmStore(*nodeStore.get(), *wayStore.get());
 	osmStore.use_compact_store(osmStoreCompact);
@@ -327,57 +701,222 @@ int main(int argc, char* argv[]) {
 	class LayerDefinition layers(config.layers);
 	class OsmMemTiles osmMemTiles(threadNum, config.baseZoom, config.includeID, *nodeStore, *wayStore);
 	class ShpMemTiles shpMemTiles(threadNum, config.baseZoom);
+	osmMemTiles.setSortOrders(layers.getSortOrders());
+	shpMemTiles.setSortOrders(layers.getSortOrders());
+	if (hasClippingBox) {
+		osmMemTiles.setClippingBox(clippingBox);
+		shpMemTiles.setClippingBox(clippingBox);
+	}
 	osmMemTiles.open();
 	shpMemTiles.open();
+	if (!materializeGeometries) osmMemTiles.setMemoryBudget(size_t(memoryBudget) * 1024 * 1024);
 
+	if (profileLua) LuaProfiler::enable();
 	OsmLuaProcessing osmLuaProcessing(osmStore, config, layers, luaFile, 
 		shpMemTiles, osmMemTiles, attributeStore, materializeGeometries);
 
+	// ----	Check snapshot options
+
+	uint64_t snapshotSignature = 0;
+	if (!snapshotFile.empty() || !fromSnapshotFile.empty()) {
+		if (mapsplit || !dynamic_pointer_cast<SortedNodeStore>(nodeStore) || !dynamic_pointer_cast<SortedWayStore>(wayStore)) {
+			cerr << "--snapshot and --from-snapshot need .pbf input sorted by type then ID" << endl;
+			return -1;
+		}
+		if (!fromSnapshotFile.empty() && (!snapshotFile.empty() || !reuseStoreFile.empty() || !oscFile.empty())) {
+			cerr << "--from-snapshot can't be used with --snapshot, --reuse-store or --osc" << endl;
+			return -1;
+		}
+		vector<string> luaFiles = osmLuaProcessing.moduleFiles();
+		luaFiles.insert(luaFiles.begin(), luaFile);
+		snapshotSignature = Snapshot::signature(inputFiles, luaFiles, config, clippingBox, !osmStoreUncompressedNodes, !osmStoreUncompressedWays);
+	}
+	// A snapshot that can't be used is made again, so that's decided before anything is read
+	std::unique_ptr<Snapshot> snapshot;
+	if (!fromSnapshotFile.empty()) {
+		snapshot = Snapshot::open(fromSnapshotFile, snapshotSignature);
+		if (!snapshot ||
+		    !StoreFile::load(fromSnapshotFile + ".nodes", STORE_FILE_NODES, snapshotSignature) ||
+		    !StoreFile::load(fromSnapshotFile + ".ways", STORE_FILE_WAYS, snapshotSignature)) {
+			cerr << "Couldn't use snapshot " << fromSnapshotFile << ", so the input will be read, and saved to it again" << endl;
+			snapshot.reset();
+			snapshotFile = fromSnapshotFile;
+			fromSnapshotFile.clear();
+		}
+	}
+
+	// A snapshot's objects are already in a file, mapped as they're needed
+	if (memoryLimit > 0 && fromSnapshotFile.empty()) {
+		string spillDir = osmStoreFile.empty() ? boost::filesystem::temp_directory_path().string() : osmStoreFile;
+		osmMemTiles.setMemoryLimit(size_t(memoryLimit) * 1024 * 1024, spillDir);
+		shpMemTiles.setMemoryLimit(size_t(memoryLimit) * 1024 * 1024, spillDir);
+	}
+
+	endPhase("setup");
+	metrics.setPhase("reading");
+
 	// ---- Load external shp files
 
+	// Lua can query indexed layers, so those are read now; the rest are read
+	// alongside the .pbf (unless it's mapsplit, which reads tiles later)
+	vector<size_t> backgroundLayers;
+	auto readSource = [&](uint layerNum, uint threads) {
+		if (cacheSources) readCachedLayerSource(clippingBox, layers, config.baseZoom, layerNum, threads, shpMemTiles, osmLuaProcessing, luaFile);
+		else readLayerSource(clippingBox, layers, config.baseZoom, layerNum, threads, shpMemTiles, osmLuaProcessing);
+	};
 	for (size_t layerNum=0; layerNum<layers.layers.size(); layerNum++) {
 		// External layer sources
 		LayerDef &layer = layers.layers[layerNum];
 		if(layer.indexed) { shpMemTiles.CreateNamedLayerIndex(layer.name); }
 
-		if (layer.source.size()>0) {
+		if (layer.source.size()>0 && fromSnapshotFile.empty()) {
 			if (!hasClippingBox) {
-				cerr << "Can't read shapefiles unless a bounding box is provided." << endl;
+				cerr << "Can't read external layer sources unless a bounding box is provided." << endl;
 				exit(EXIT_FAILURE);
 			}
-			cout << "Reading .shp " << layer.name << endl;
-			readShapefile(clippingBox,
-			              layers,
-			              config.baseZoom, layerNum,
-			              threadNum,
-			              shpMemTiles, osmLuaProcessing);
+			if (!layer.indexed && !mapsplit && !pipeline && threadNum > 1) { backgroundLayers.push_back(layerNum); continue; }
+			cout << "Reading " << layer.source << " into " << layer.name << endl;
+			readSource(layerNum, threadNum);
 		}
 	}
-	shpMemTiles.reportSize();
+	shpMemTiles.BuildGridIndices(threadNum);
+	// Lua queries read the indexed layers' geometries while the rest are stored
+	if (!backgroundLayers.empty()) shpMemTiles.sealStores();
+	// The background reader takes a share of the threads from the .pbf's
+	const uint backgroundThreads = backgroundLayers.empty() ? 0 : std::max(1u, threadNum / 4);
+	const uint pbfThreads = threadNum - backgroundThreads;
+	if (backgroundLayers.empty()) shpMemTiles.reportSize();
 
 	// ----	Read significant node tags
 
 	vector<string> nodeKeyVec = osmLuaProcessing.GetSignificantNodeKeys();
 	unordered_set<string> nodeKeys(nodeKeyVec.begin(), nodeKeyVec.end());
+	for (auto &key : config.rules.filterEntries(true)) nodeKeys.insert(key);
 
 	// ----	Read all PBFs
 	
 	PbfReader pbfReader(osmStore);
+	// Tags the rules match must get past way_keys/relation_keys too (multipolygons are relations)
+	vector<string> wayKeyVec = osmLuaProcessing.GetSignificantWayKeys();
+	vector<string> relationKeyVec = osmLuaProcessing.GetSignificantRelationKeys();
+	vector<string> ruleKeyVec = config.rules.filterEntries(false);
+	if (!wayKeyVec.empty()) wayKeyVec.insert(wayKeyVec.end(), ruleKeyVec.begin(), ruleKeyVec.end());
+	if (!relationKeyVec.empty()) relationKeyVec.insert(relationKeyVec.end(), ruleKeyVec.begin(), ruleKeyVec.end());
+	pbfReader.wayFilter = TagFilter(wayKeyVec);
+	pbfReader.relationFilter = TagFilter(relationKeyVec);
+	// Only the main read reports its phases: mapsplit and --pipeline read while tiles are written
+	pbfReader.onPhase = [](PbfReader::ReadPhase phase) {
+		metrics.setPhase(phase == PbfReader::ReadPhase::Nodes ? "nodes" : phase == PbfReader::ReadPhase::RelationScan ? "relation_scan" :
+		                 phase == PbfReader::ReadPhase::Ways ? "ways" : "relations");
+	};
 	std::vector<bool> sortOrders = layers.getSortOrders();
+	std::vector<std::vector<uint>> featureLimits;
+	for (uint zoom = 0; zoom <= config.endZoom; zoom++) featureLimits.push_back(layers.getFeatureLimits(zoom));
+
+	// The rest of the layers are read in the background, once the main Lua state
+	// has been asked for its keys, as the layers are remapped with it
+	std::thread shapefileThread;
+	if (!backgroundLayers.empty()) shapefileThread = std::thread([&]() {
+		for (size_t layerNum : backgroundLayers) {
+			cout << "Reading " << layers.layers[layerNum].source << " into " << layers.layers[layerNum].name << " in the background" << endl;
+			readSource(layerNum, backgroundThreads);
+		}
+	});
+	// Wait for it on any early return, too
+	struct JoinOnExit { std::thread &t; ~JoinOnExit() { if (t.joinable()) t.join(); } } joinShapefileThread { shapefileThread };
+
+	// ----	Load saved node/way stores, or arrange to save them
+
+	shared_ptr<SortedNodeStore> sortedNodeStore = dynamic_pointer_cast<SortedNodeStore>(nodeStore);
+	shared_ptr<SortedWayStore> sortedWayStore = dynamic_pointer_cast<SortedWayStore>(wayStore);
+	uint64_t storeSignature = 0;
+	bool saveStores = false;
+
+	// Untagged nodes are only needed to build ways, unless they're kept for another run
+	// or to find the tiles an .osc changes
+	pbfReader.storeTaggedNodesOnly = anyPbfHasLocationsOnWays && allPbfsHaveLocationsOnWays && !mapsplit &&
+		!wayStore->requiresNodes() && reuseStoreFile.empty() && oscFile.empty();
+	if (!reuseStoreFile.empty()) {
+		if (mapsplit || inputFiles.size()!=1 || !sortedNodeStore || !sortedWayStore) {
+			cerr << "--reuse-store needs a single .pbf, sorted by type then ID" << endl;
+			return -1;
+		}
+		storeSignature = StoreFile::signature(inputFiles[0]);
+		if (sortedNodeStore->load(reuseStoreFile + ".nodes", storeSignature) &&
+		    sortedWayStore->load(reuseStoreFile + ".ways", storeSignature)) {
+			pbfReader.storesPreloaded = true;
+		} else {
+			cout << "Node and way stores will be saved to " << reuseStoreFile << ".nodes/.ways" << endl;
+			saveStores = true;
+			pbfReader.storeAllWays = true;
+		}
+	}
+
+	// ----	Read a change file, so the ways and relations it moves are found as the .pbf is read
+
+	OscChanges oscChanges;
+	if (!oscFile.empty()) {
+		if (mapsplit) { cerr << "--osc can't be used with mapsplit input" << endl; return -1; }
+		cout << "Reading .osc " << oscFile << endl;
+		if (!readOscFile(oscFile, oscChanges)) return -1;
+		oscChanges.index();
+		pbfReader.oscChanges = &oscChanges;
+	}
 
-	if (!mapsplit) {
+	if (!fromSnapshotFile.empty()) {
+		// Everything the tiles are written from (the input isn't read)
+		if (!snapshot->load({&osmMemTiles, &shpMemTiles}, attributeStore, layers) ||
+		    !sortedNodeStore->load(fromSnapshotFile + ".nodes", snapshotSignature) ||
+		    !sortedWayStore->load(fromSnapshotFile + ".ways", snapshotSignature)) {
+			cerr << "Couldn't load snapshot " << fromSnapshotFile << endl;
+			return -1;
+		}
+		osmMemTiles.reportSize();
+		shpMemTiles.reportSize();
+		attributeStore.reportSize();
+	} else if (!mapsplit && !pipeline) {
 		for (auto inputFile : inputFiles) {
 			cout << "Reading .pbf " << inputFile << endl;
 			ifstream infile(inputFile, ios::in | ios::binary);
 			if (!infile) { cerr << "Couldn't open .pbf file " << inputFile << endl; return -1; }
 			
+			// Map the file once and have every thread read blocks straight out of it,
+			// rather than each one seeking and reading through its own ifstream
+			std::unique_ptr<boost::interprocess::mapped_region> pbfRegion;
+			try {
+				boost::interprocess::file_mapping mapping(inputFile.c_str(), boost::interprocess::read_only);
+				pbfRegion.reset(new boost::interprocess::mapped_region(mapping, boost::interprocess::read_only));
+				pbfRegion->advise(boost::interprocess::mapped_region::advice_sequential);
+			} catch (boost::interprocess::interprocess_exception &e) {
+				cerr << "Couldn't map " << inputFile << " (" << e.what() << "), reading it as a stream instead" << endl;
+				pbfRegion.reset();
+			}
+
+			pbfReader.indexFile = indexPbf ? inputFile + ".idx" : "";
+			pbfReader.indexSignature = indexPbf ? StoreFile::signature(inputFile) : 0;
+
 			const bool hasSortTypeThenID = PbfHasOptionalFeature(inputFile, OptionSortTypeThenID);
 			int ret = pbfReader.ReadPbfFile(
 				hasSortTypeThenID,
 				nodeKeys,
-				threadNum,
-				[&]() {
-					thread_local std::shared_ptr<ifstream> pbfStream(new ifstream(inputFile, ios::in | ios::binary));
+				pbfThreads,
+				[&]() -> std::shared_ptr<std::istream> {
+					// Each thread keeps its stream, pointing it at the current file if need be
+					if (pbfRegion) {
+						thread_local std::shared_ptr<boost::interprocess::ibufferstream> pbfStream(new boost::interprocess::ibufferstream(nullptr, 0, ios::in | ios::binary));
+						char *data = static_cast<char*>(pbfRegion->get_address());
+						// The next file's mapping may land at the same address, so the size is checked too
+						if (pbfStream->buffer().first != data || pbfStream->buffer().second != pbfRegion->get_size())
+							pbfStream->buffer(data, pbfRegion->get_size());
+						pbfStream->clear();
+						return pbfStream;
+					}
+					thread_local std::shared_ptr<ifstream> pbfStream;
+					thread_local std::string pbfStreamFile;
+					if (!pbfStream || pbfStreamFile != inputFile) {
+						pbfStream.reset(new ifstream(inputFile, ios::in | ios::binary));
+						pbfStreamFile = inputFile;
+					}
 					return pbfStream;
 				},
 				[&]() {
@@ -387,48 +926,57 @@ int main(int argc, char* argv[]) {
 			);
 			if (ret != 0) return ret;
 		} 
+		if (saveStores) {
+			if (sortedNodeStore->save(reuseStoreFile + ".nodes", storeSignature) &&
+			    sortedWayStore->save(reuseStoreFile + ".ways", storeSignature))
+				cout << "Saved node and way stores to " << reuseStoreFile << ".nodes/.ways" << endl;
+		}
+		if (shapefileThread.joinable()) {
+			shapefileThread.join();
+			shpMemTiles.reportSize();
+		}
 		attributeStore.finalize();
 		osmMemTiles.reportSize();
 		attributeStore.reportSize();
+		if (verbose) void_mmap_allocator::reportArenas(cout);
+	}
+	// ----	Find tiles affected by a change file
+
+	std::unique_ptr<TileOccupancy> dirtyTiles;
+	if (!oscFile.empty()) {
+		std::set<TileCoordinates> dirtyBaseTiles;
+		findDirtyTiles(oscChanges, *nodeStore, *wayStore, config.baseZoom, dirtyBaseTiles);
+		cout << "Change file affects " << dirtyBaseTiles.size() << " tiles at z" << config.baseZoom << endl;
+
+		dirtyTiles.reset(new TileOccupancy(config.baseZoom, CLUSTER_ZOOM));
+		for (const auto &tile : dirtyBaseTiles)
+			if (osmMemTiles.inClippingBox(tile)) dirtyTiles->set(tile.x, tile.y);
 	}
+
 	// ----	Initialise SharedData
 	SourceList sources = {&osmMemTiles, &shpMemTiles};
 	class SharedData sharedData(config, layers);
 	sharedData.outputFile = outputFile;
-	sharedData.sqlite = sqlite;
+	sharedData.outputMode = outputMode;
 	sharedData.mergeSqlite = mergeSqlite;
+	sharedData.replaceTiles = !oscFile.empty();
 
-	// ----	Initialise mbtiles if required
+	// ----	Initialise the outputs
 	
-	if (sharedData.sqlite) {
-		sharedData.mbtiles.openForWriting(sharedData.outputFile);
-		sharedData.mbtiles.writeMetadata("name",sharedData.config.projectName);
-		sharedData.mbtiles.writeMetadata("type","baselayer");
-		sharedData.mbtiles.writeMetadata("version",sharedData.config.projectVersion);
-		sharedData.mbtiles.writeMetadata("description",sharedData.config.projectDesc);
-		sharedData.mbtiles.writeMetadata("format","pbf");
-		sharedData.mbtiles.writeMetadata("minzoom",to_string(sharedData.config.startZoom));
-		sharedData.mbtiles.writeMetadata("maxzoom",to_string(sharedData.config.endZoom));
-
-		ostringstream bounds;
-		if (mergeSqlite) {
-			double cMinLon, cMaxLon, cMinLat, cMaxLat;
-			sharedData.mbtiles.readBoundingBox(cMinLon, cMaxLon, cMinLat, cMaxLat);
-			sharedData.config.enlargeBbox(cMinLon, cMaxLon, cMinLat, cMaxLat);
-		}
-		bounds << fixed << sharedData.config.minLon << "," << sharedData.config.minLat << "," << sharedData.config.maxLon << "," << sharedData.config.maxLat;
-		sharedData.mbtiles.writeMetadata("bounds",bounds.str());
-
-		if (!sharedData.config.defaultView.empty()) {
-			sharedData.mbtiles.writeMetadata("center",sharedData.config.defaultView);
-		} else {
-			double centerLon = (sharedData.config.minLon + sharedData.config.maxLon) / 2;
-			double centerLat = (sharedData.config.minLat + sharedData.config.maxLat) / 2;
-			int centerZoom = floor((sharedData.config.startZoom + sharedData.config.endZoom) / 2);
-			ostringstream center;
-			center << fixed << centerLon << "," << centerLat << "," << centerZoom;
-			sharedData.mbtiles.writeMetadata("center",center.str());
-		}
+	if (sharedData.outputMode == OutputMode::MBTiles) {
+		OpenMbtiles(sharedData.mbtiles, sharedData.outputFile, sharedData.config, mergeSqlite || sharedData.replaceTiles);
+		if (mbtilesShards > 1) sharedData.openMbtilesShards(mbtilesShards);
+	} else if (sharedData.outputMode == OutputMode::PMTiles) {
+		OpenPmtiles(sharedData.pmtiles, sharedData.outputFile, sharedData.config);
+	}
+	// A directory output, and any output after the first, is written by a sink
+	for (size_t i = 0; i < outputFiles.size(); i++) {
+		if (i == 0 && sharedData.outputMode != OutputMode::File) continue;
+		std::unique_ptr<TileSink> output(new TileSink(outputFiles[i]));
+		if (output->mode == OutputMode::MBTiles) OpenMbtiles(output->mbtiles, output->path, sharedData.config, false);
+		else if (output->mode == OutputMode::PMTiles) OpenPmtiles(output->pmtiles, output->path, sharedData.config);
+		output->start();
+		sharedData.outputSinks.push_back(std::move(output));
 	}
 
 	// ----	Write out data
@@ -439,28 +987,151 @@ int main(int argc, char* argv[]) {
 	if (mapsplit) {
 		mapsplitFile.readTileList(tileList);
 		runs = tileList.size();
+	} else if (pipeline) {
+		runs = inputFiles.size();
 	}
 
-	for (unsigned run=0; run<runs; run++) {
-		// Read mapsplit tile and parse, if applicable
-		int srcZ = -1, srcX = -1, srcY = -1, tmsY = -1;
-
-		if (mapsplit) {
-			osmMemTiles.Clear();
+	bool warnedStartZoom = false;
+	for (const auto &tile : tileList) {
+		if (get<0>(tile) > config.baseZoom) {
+			cerr << "Mapsplit tiles (zoom " << get<0>(tile) << ") must not be greater than basezoom " << config.baseZoom << endl;
+			return 0;
+		} else if (get<0>(tile) > config.startZoom && !warnedStartZoom) {
+			cout << "Mapsplit tiles (zoom " << get<0>(tile) << ") can't write data at zoom level " << config.startZoom << endl;
+			warnedStartZoom = true;
+		}
+	}
 
-			tie(srcZ,srcX,tmsY) = tileList.back();
-			srcY = pow(2,srcZ) - tmsY - 1; // TMS
-			if (srcZ > config.baseZoom) {
-				cerr << "Mapsplit tiles (zoom " << srcZ << ") must not be greater than basezoom " << config.baseZoom << endl;
-				return 0;
-			} else if (srcZ > config.startZoom) {
-				cout << "Mapsplit tiles (zoom " << srcZ << ") can't write data at zoom level " << config.startZoom << endl;
-			}
+	std::unique_ptr<TileProfiler> profiler;
+	if (!tileTimingsFile.empty()) {
+		profiler.reset(new TileProfiler(tileTimingsFile));
+		if (!profiler->good()) return -1;
+	}
 
-			cout << "Reading tile " << srcZ << ": " << srcX << "," << srcY << " (" << (run+1) << "/" << runs << ")" << endl;
-			vector<char> pbf = mapsplitFile.readTile(srcZ,srcX,tmsY);
+	// Launch the pool with threadNum threads, in a group per NUMA node if they're pinned
+	TilePool pool(threadNum, pinThreads);
+	if (pinThreads && pool.groups() > 1) cout << "Writing tiles with " << pool.groups() << " groups of pinned threads, one per NUMA node" << endl;
+
+	// Mutex is hold when IO is performed
+	std::mutex io_mutex;
+
+	// Loop through tiles
+	std::atomic<uint64_t> tilesWritten(0);
+	std::atomic<uint64_t> tilesQueued(0);
+
+	// The clip caches are counted over every source tiles are written from:
+	// mapsplit tiles' and --pipeline runs' as they're taken, and a mapsplit
+	// tile's counts are kept once it's freed
+	std::mutex clipCountsMutex;
+	SourceList clipCountSources = sources;
+	uint64_t releasedClipHits = 0, releasedClipMisses = 0;
+	auto addClipCountSource = [&](TileDataSource *source) {
+		std::lock_guard<std::mutex> lock(clipCountsMutex);
+		clipCountSources.push_back(source);
+	};
+	auto releaseClipCountSource = [&](TileDataSource *source) {
+		std::lock_guard<std::mutex> lock(clipCountsMutex);
+		releasedClipHits += source->clipCacheHits();
+		releasedClipMisses += source->clipCacheMisses();
+		clipCountSources.erase(std::remove(clipCountSources.begin(), clipCountSources.end(), source), clipCountSources.end());
+	};
+	auto clipCacheHits = [&]() {
+		std::lock_guard<std::mutex> lock(clipCountsMutex);
+		uint64_t hits = releasedClipHits;
+		for (auto source : clipCountSources) hits += source->clipCacheHits();
+		return hits;
+	};
+	auto clipCacheMisses = [&]() {
+		std::lock_guard<std::mutex> lock(clipCountsMutex);
+		uint64_t misses = releasedClipMisses;
+		for (auto source : clipCountSources) misses += source->clipCacheMisses();
+		return misses;
+	};
+
+	MetricsScope tileMetrics(metricsExporter);
+	tileMetrics.gauge("tiles_queued", "Tiles queued to be written so far", [&]() { return tilesQueued.load(); });
+	tileMetrics.counter("clip_cache_hits", "Clipped geometries reused from the cache", clipCacheHits);
+	tileMetrics.counter("clip_cache_misses", "Geometries that had to be clipped", clipCacheMisses);
+	if (sharedData.outputMode == OutputMode::MBTiles)
+		tileMetrics.gauge("mbtiles_queue_depth", "Tiles waiting to be written to the .mbtiles", [&]() { return sharedData.mbtiles.queueDepth(); });
+
+	// Tile batches hold this shared, and the attribute store is only
+	// finalized while it's held exclusively, as mapsplit tiles are read
+	// (and their attributes added) while others are written. Batches pass
+	// through the gate first, so a finalize waiting for the lock holds back
+	// new batches rather than waiting for a gap between them.
+	std::shared_timed_mutex attributeMutex;
+	std::mutex attributeGate;
+
+	// ----	Read mapsplit tiles ahead of writing them
+	//
+	// Each source tile is read, on a thread of its own, into node, way and
+	// output object stores of its own. Its tiles are queued on the pool as soon
+	// as it's been read, while other source tiles are still being read, so
+	// small source tiles don't leave most of the cores idle. Up to threadNum
+	// source tiles are in flight (being read or written); with --read-ahead-limit,
+	// no more are started while the process is using more memory than that.
+	struct MapsplitRun {
+		int srcZ, srcX, srcY;
+		shared_ptr<NodeStore> nodeStore;
+		shared_ptr<WayStore> wayStore;
+		std::unique_ptr<OSMStore> osmStore;
+		std::unique_ptr<OsmMemTiles> osmMemTiles;
+		// Batches not yet written, less those written before they were all posted
+		long pendingBatches = 0;
+	};
+	std::mutex runMutex;
+	std::condition_variable runChanged;
+	std::deque<std::shared_ptr<MapsplitRun>> readRuns;	// read, and waiting to be written
+	size_t runsInFlight = 0, runsStarted = 0;
+	int mapsplitError = 0;
+	const size_t maxRunsInFlight = std::max<size_t>(1, std::min<size_t>(threadNum, runs));
+	// Each run's budget is its share of --memory-budget
+	const size_t runMemoryBudget = size_t(memoryBudget) * 1024 * 1024 / maxRunsInFlight;
+	// Free a source tile's stores once it's written (with runMutex held)
+	auto releaseRun = [&](MapsplitRun &run) {
+		releaseClipCountSource(run.osmMemTiles.get());
+		run.osmMemTiles.reset();
+		run.osmStore.reset();
+		run.wayStore.reset();
+		run.nodeStore.reset();
+		runsInFlight--;
+		runChanged.notify_all();
+	};
+	auto readMapsplitTiles = [&]() {
+		while (true) {
+			std::unique_lock<std::mutex> lock(runMutex);
+			runChanged.wait(lock, [&]() {
+				return mapsplitError != 0 || tileList.empty() || (runsInFlight < maxRunsInFlight &&
+				       (runsInFlight == 0 || readAheadLimit == 0 || residentBytes() <= size_t(readAheadLimit) * 1024 * 1024));
+			});
+			if (mapsplitError != 0 || tileList.empty()) return;
 
-			int ret = pbfReader.ReadPbfFile(
+			auto run = std::make_shared<MapsplitRun>();
+			int tmsY;
+			tie(run->srcZ, run->srcX, tmsY) = tileList.back();
+			tileList.pop_back();
+			run->srcY = pow(2, run->srcZ) - tmsY - 1; // TMS
+			runsInFlight++;
+			cout << "Reading tile " << run->srcZ << ": " << run->srcX << "," << run->srcY << " (" << (++runsStarted) << "/" << runs << ")" << endl;
+			vector<char> pbf = mapsplitFile.readTile(run->srcZ, run->srcX, tmsY);
+			lock.unlock();
+
+			run->nodeStore = makeNodeStore();
+			run->wayStore = makeWayStore(*run->nodeStore);
+			run->osmStore.reset(new OSMStore(*run->nodeStore, *run->wayStore));
+			run->osmStore->use_compact_store(osmStoreCompact);
+			run->osmStore->enforce_integrity(!skipIntegrity);
+			run->osmMemTiles.reset(new OsmMemTiles(threadNum, config.baseZoom, config.includeID, *run->nodeStore, *run->wayStore));
+			run->osmMemTiles->setSortOrders(layers.getSortOrders());
+			run->osmMemTiles->setClippingBox(clippingBox);
+			run->osmMemTiles->open();
+			if (!materializeGeometries) run->osmMemTiles->setMemoryBudget(runMemoryBudget);
+
+			PbfReader reader(*run->osmStore);
+			reader.wayFilter = pbfReader.wayFilter;
+			reader.relationFilter = pbfReader.relationFilter;
+			int ret = reader.ReadPbfFile(
 				false,
 				nodeKeys,
 				1,
@@ -468,212 +1139,559 @@ int main(int argc, char* argv[]) {
 					return make_unique<boost::interprocess::bufferstream>(pbf.data(), pbf.size(),  ios::in | ios::binary);
 				},
 				[&]() {
-					return std::make_unique<OsmLuaProcessing>(osmStore, config, layers, luaFile, shpMemTiles, osmMemTiles, attributeStore, materializeGeometries);
+					return std::make_unique<OsmLuaProcessing>(*run->osmStore, config, layers, luaFile, shpMemTiles, *run->osmMemTiles, attributeStore, materializeGeometries);
 				}
 			);
-			if (ret != 0) return ret;
 
-			tileList.pop_back();
+			lock.lock();
+			if (ret != 0) mapsplitError = ret;
+			else readRuns.push_back(run);
+			runChanged.notify_all();
 		}
-
-		// Launch the pool with threadNum threads
-		boost::asio::thread_pool pool(threadNum);
-
-		// Mutex is hold when IO is performed
-		std::mutex io_mutex;
-
-		// Loop through tiles
-		std::atomic<uint64_t> tilesWritten(0);
-
-		for (auto source : sources) {
-			source->finalize(threadNum);
+	};
+	std::vector<std::thread> mapsplitReaders;
+
+	// ----	Read .pbf extracts while writing the tiles of those already read
+	//
+	// With --pipeline, each .pbf is read in turn, on a thread of its own, into
+	// node, way and output object stores of its own (as the node and way
+	// stores would be cleared between files anyway), and is then read-only.
+	// Once a .pbf has been read, the z6 tiles that no later one reaches are
+	// written from every .pbf read so far, while the next is read. z0-z5 are
+	// written once they've all been read. A .pbf's stores are freed once the
+	// last z6 tile it reaches is written, unless z0-z5 need them.
+	//
+	// Reading and writing share threadNum CPUs: each batch of tiles takes one,
+	// and each read (after the first, when there's nothing to write) half.
+	struct PipelineRun {
+		shared_ptr<NodeStore> nodeStore;
+		shared_ptr<WayStore> wayStore;
+		std::unique_ptr<OSMStore> osmStore;
+		std::unique_ptr<OsmMemTiles> osmMemTiles;
+		size_t lastNeeded = SIZE_MAX;	// the last run with tiles it has objects in, once indexed
+		long pendingBatches = 0;		// as for mapsplit runs
+		bool written = false;			// its own tiles are all written
+	};
+	std::vector<std::shared_ptr<PipelineRun>> pipelineRuns;	// read so far, guarded by runMutex
+	int pipelineError = 0;
+	// Free the stores of runs whose tiles, and those of every later run they
+	// have objects in, are written (with runMutex held)
+	auto releasePipelineRuns = [&]() {
+		for (size_t i = 0; i < pipelineRuns.size(); i++) {
+			PipelineRun &run = *pipelineRuns[i];
+			if (!run.osmMemTiles || run.lastNeeded >= pipelineRuns.size()) continue;
+			bool done = true;
+			for (size_t j = i; done && j <= run.lastNeeded; j++) done = pipelineRuns[j]->written;
+			if (!done) continue;
+			releaseClipCountSource(run.osmMemTiles.get());
+			run.osmMemTiles.reset();
+			run.osmStore.reset();
+			run.wayStore.reset();
+			run.nodeStore.reset();
 		}
-		// tiles by zoom level
-
-		// The clipping bbox check is expensive - as an optimization, compute the set of
-		// z6 tiles that are wholly covered by the clipping box. Membership in this
-		// set is quick to test.
-		std::set<TileCoordinates> coveredZ6Tiles;
-		if (hasClippingBox) {
-			for (int x = 0; x < 1 << 6; x++) {
-				for (int y = 0; y < 1 << 6; y++) {
-					if (boost::geometry::within(
-								TileBbox(TileCoordinates(x, y), 6, false, false).getTileBox(),
-								clippingBox
-							))
-						coveredZ6Tiles.insert(TileCoordinates(x, y));
-				}
-			}
+	};
+	std::mutex cpuMutex;
+	std::condition_variable cpuFreed;
+	size_t cpusFree = threadNum;
+	bool readerWaiting = false;
+	// Batches don't take a CPU while a read waits for its share, so it isn't starved
+	auto takeCpus = [&](size_t count, bool reader) {
+		std::unique_lock<std::mutex> lock(cpuMutex);
+		if (reader) readerWaiting = true;
+		cpuFreed.wait(lock, [&]() { return cpusFree >= count && (reader || !readerWaiting); });
+		if (reader) readerWaiting = false;
+		cpusFree -= count;
+	};
+	auto returnCpus = [&](size_t count) {
+		{
+			std::lock_guard<std::mutex> lock(cpuMutex);
+			cpusFree += count;
 		}
+		cpuFreed.notify_all();
+	};
+	auto readPipelineFiles = [&]() {
+		for (size_t fileNum = 0; fileNum < inputFiles.size(); fileNum++) {
+			const string &inputFile = inputFiles[fileNum];
+			{
+				std::lock_guard<std::mutex> lock(runMutex);
+				if (pipelineError != 0) return;
+			}
+			const size_t readThreads = fileNum == 0 ? threadNum : std::max<size_t>(1, threadNum / 2);
+			auto run = std::make_shared<PipelineRun>();
+			run->nodeStore = makeNodeStore();
+			run->wayStore = makeWayStore(*run->nodeStore);
+			run->osmStore.reset(new OSMStore(*run->nodeStore, *run->wayStore));
+			run->osmStore->use_compact_store(osmStoreCompact);
+			run->osmStore->enforce_integrity(!skipIntegrity);
+			run->osmMemTiles.reset(new OsmMemTiles(threadNum, config.baseZoom, config.includeID, *run->nodeStore, *run->wayStore));
+			run->osmMemTiles->setSortOrders(layers.getSortOrders());
+			run->osmMemTiles->setClippingBox(clippingBox);
+			run->osmMemTiles->open();
+			if (!materializeGeometries) run->osmMemTiles->setMemoryBudget(size_t(memoryBudget) * 1024 * 1024 / inputFiles.size());
 
-		std::deque<std::pair<unsigned int, TileCoordinates>> tileCoordinates;
-		for (uint zoom=sharedData.config.startZoom; zoom <= sharedData.config.endZoom; zoom++) {
-			auto zoomResult = getTilesAtZoom(sources, zoom);
-			for (int x = 0; x < 1 << zoom; x++) {
-				for (int y = 0; y < 1 << zoom; y++) {
-					if (!zoomResult.test(x, y))
-						continue;
-
-					// If we're constrained to a source tile, check we're within it
-					if (srcZ > -1) {
-						int xAtSrcZ = x / pow(2, zoom-srcZ);
-						int yAtSrcZ = y / pow(2, zoom-srcZ);
-						if (xAtSrcZ != srcX || yAtSrcZ != srcY) continue;
+			cout << "Reading .pbf " << inputFile << endl;
+			PbfReader reader(*run->osmStore);
+			reader.wayFilter = pbfReader.wayFilter;
+			reader.relationFilter = pbfReader.relationFilter;
+			OsmMemTiles *runTiles = run->osmMemTiles.get();
+			takeCpus(readThreads, true);
+			int ret = reader.ReadPbfFile(
+				PbfHasOptionalFeature(inputFile, OptionSortTypeThenID),
+				nodeKeys,
+				readThreads,
+				[&]() -> std::shared_ptr<std::istream> {
+					thread_local std::shared_ptr<ifstream> pbfStream;
+					thread_local std::string pbfStreamFile;
+					if (!pbfStream || pbfStreamFile != inputFile) {
+						pbfStream.reset(new ifstream(inputFile, ios::in | ios::binary));
+						pbfStreamFile = inputFile;
 					}
-				
-					if (hasClippingBox) {
-						bool isInAWhollyCoveredZ6Tile = false;
-						if (zoom >= 6) {
-							TileCoordinate z6x = x / (1 << (zoom - 6));
-							TileCoordinate z6y = y / (1 << (zoom - 6));
-							isInAWhollyCoveredZ6Tile = coveredZ6Tiles.find(TileCoordinates(z6x, z6y)) != coveredZ6Tiles.end();
-						}
-
-						if(!isInAWhollyCoveredZ6Tile && !boost::geometry::intersects(TileBbox(TileCoordinates(x, y), zoom, false, false).getTileBox(), clippingBox)) 
-							continue;
+					return pbfStream;
+				},
+				[&]() -> std::shared_ptr<OsmLuaProcessing> {
+					// Each thread keeps a Lua state per .pbf, as each has its own stores
+					thread_local std::shared_ptr<OsmLuaProcessing> osmLuaProcessing;
+					thread_local const OsmMemTiles *luaTiles = nullptr;
+					if (luaTiles != runTiles) {
+						osmLuaProcessing.reset(new OsmLuaProcessing(*run->osmStore, config, layers, luaFile, shpMemTiles, *runTiles, attributeStore, materializeGeometries));
+						luaTiles = runTiles;
 					}
-
-					tileCoordinates.push_back(std::make_pair(zoom, TileCoordinates(x, y)));
+					return osmLuaProcessing;
 				}
-			}
+			);
+			returnCpus(readThreads);
+			if (ret == 0) run->osmMemTiles->reportSize();
+
+			std::lock_guard<std::mutex> lock(runMutex);
+			if (ret != 0) pipelineError = ret;
+			else pipelineRuns.push_back(run);
+			runChanged.notify_all();
+			if (ret != 0) return;
 		}
+	};
+	std::thread pipelineReader;
+
+	if (mapsplit || pipeline) {
+		// Shapefiles are shared by every source tile (or .pbf), so are finalized once
+		shpMemTiles.finalize(threadNum);
+		shpMemTiles.buildPyramids(layers, sharedData.config.startZoom, threadNum);
+		if (mapsplit)
+			for (size_t i = 0; i < maxRunsInFlight; i++) mapsplitReaders.emplace_back(readMapsplitTiles);
+		else
+			pipelineReader = std::thread(readPipelineFiles);
+	}
 
-		// Cluster tiles: breadth-first for z0..z5, depth-first for z6
-		const size_t baseZoom = config.baseZoom;
-		boost::sort::block_indirect_sort(
-			tileCoordinates.begin(), tileCoordinates.end(), 
-			[baseZoom](auto const &a, auto const &b) {
-				const auto aZoom = a.first;
-				const auto bZoom = b.first;
-				const auto aX = a.second.x;
-				const auto aY = a.second.y;
-				const auto bX = b.second.x;
-				const auto bY = b.second.y;
-				const bool aLowZoom = aZoom < CLUSTER_ZOOM;
-				const bool bLowZoom = bZoom < CLUSTER_ZOOM;
-
-				// Breadth-first for z0..5
-				if (aLowZoom != bLowZoom)
-					return aLowZoom;
-
-				if (aLowZoom && bLowZoom) {
-					if (aZoom != bZoom)
-						return aZoom < bZoom;
-
-					if (aX != bX)
-						return aX < bX;
-
-					return aY < bY;
-				}
-
-				for (size_t z = CLUSTER_ZOOM; z <= baseZoom; z++) {
-					// Translate both a and b to zoom z, compare.
-					// First, sanity check: can we translate it to this zoom?
-					if (aZoom < z || bZoom < z) {
-						return aZoom < bZoom;
-					}
-
-					const auto aXz = aX / (1 << (aZoom - z));
-					const auto aYz = aY / (1 << (aZoom - z));
-					const auto bXz = bX / (1 << (bZoom - z));
-					const auto bYz = bY / (1 << (bZoom - z));
+	endPhase("read");
+	metrics.setPhase("tiles");
+	for (unsigned run=0; run<runs; run++) {
+		// Take the next mapsplit tile that's been read, if applicable
+		int srcZ = -1, srcX = -1, srcY = -1;
+		SourceList runSources = sources;
+		std::shared_ptr<MapsplitRun> mapsplitRun;
+		std::shared_ptr<PipelineRun> pipelineRun;
 
-					if (aXz != bXz)
-						return aXz < bXz;
+		if (mapsplit) {
+			{
+				std::unique_lock<std::mutex> lock(runMutex);
+				runChanged.wait(lock, [&]() { return mapsplitError != 0 || !readRuns.empty(); });
+				if (mapsplitError != 0) break;
+				mapsplitRun = readRuns.front();
+				readRuns.pop_front();
+			}
+			srcZ = mapsplitRun->srcZ;
+			srcX = mapsplitRun->srcX;
+			srcY = mapsplitRun->srcY;
+			runSources = { mapsplitRun->osmMemTiles.get(), &shpMemTiles };
+			addClipCountSource(mapsplitRun->osmMemTiles.get());
+			const auto indexStart = std::chrono::steady_clock::now();
+			{
+				std::lock_guard<std::mutex> gate(attributeGate);
+				std::unique_lock<std::shared_timed_mutex> lock(attributeMutex);
+				attributeStore.finalize();
+			}
+			mapsplitRun->osmMemTiles->finalize(threadNum);
+			mapsplitRun->osmMemTiles->buildPyramids(layers, sharedData.config.startZoom, threadNum);
+			indexSeconds += secondsSince(indexStart);
+		} else if (pipeline) {
+			{
+				std::unique_lock<std::mutex> lock(runMutex);
+				runChanged.wait(lock, [&]() { return pipelineError != 0 || pipelineRuns.size() > run; });
+				if (pipelineError != 0) break;
+				pipelineRun = pipelineRuns[run];
+				runSources.clear();
+				// Only runs up to this one: later ones are still being read, and aren't
+				// finalized. Of those, only the ones with objects in this run's tiles.
+				for (size_t earlier = 0; earlier <= run; earlier++)
+					if (pipelineRuns[earlier]->lastNeeded >= run) runSources.push_back(pipelineRuns[earlier]->osmMemTiles.get());
+				runSources.push_back(&shpMemTiles);
+			}
+			addClipCountSource(pipelineRun->osmMemTiles.get());
+			const auto indexStart = std::chrono::steady_clock::now();
+			{
+				std::lock_guard<std::mutex> gate(attributeGate);
+				std::unique_lock<std::shared_timed_mutex> lock(attributeMutex);
+				attributeStore.finalize();
+			}
+			pipelineRun->osmMemTiles->finalize(threadNum);
+			pipelineRun->osmMemTiles->buildPyramids(layers, sharedData.config.startZoom, threadNum);
+			indexSeconds += secondsSince(indexStart);
+
+			// Find the last run whose z6 tiles this one has objects in. Objects
+			// beyond an extract's bounding box (and its margin) may reach z6
+			// tiles that have already been written, without them.
+			std::vector<const TileOccupancy*> occupancy;
+			pipelineRun->osmMemTiles->getTileOccupancy(occupancy);
+			size_t lastNeeded = run, lateCells = 0;
+			for (size_t cell = 0; cell < CLUSTER_ZOOM_AREA && sharedData.config.endZoom >= CLUSTER_ZOOM; cell++) {
+				bool reached = false;
+				for (const TileOccupancy *tiles : occupancy)
+					reached = reached || tiles->test(CLUSTER_ZOOM, cell / CLUSTER_ZOOM_WIDTH, cell % CLUSTER_ZOOM_WIDTH);
+				if (!reached) continue;
+				if (cellSealedAt[cell] < run) lateCells++;
+				lastNeeded = std::max(lastNeeded, cellSealedAt[cell]);
+			}
+			std::lock_guard<std::mutex> lock(runMutex);
+			if (lateCells > 0) {
+				cerr << "Objects in " << inputFiles[run] << " reach " << lateCells << " z6 tiles that were written from earlier .pbfs. "
+				     << "The extracts reach further beyond their bounding boxes than --pipeline allows for; run without it." << endl;
+				pipelineError = -1;
+				break;
+			}
+			// z0-z5 are written last, from every run
+			pipelineRun->lastNeeded = partitionIndex == 0 && sharedData.config.startZoom < CLUSTER_ZOOM ? runs - 1 : lastNeeded;
+		} else {
+			const auto indexStart = std::chrono::steady_clock::now();
+			metrics.setPhase("index");
+			for (auto source : sources) {
+				source->finalize(threadNum);
+				source->buildPyramids(layers, sharedData.config.startZoom, threadNum);
+			}
+			metrics.setPhase("tiles");
+			indexSeconds += secondsSince(indexStart);
+		}
+		if (!snapshotFile.empty()) {
+			cout << "Saving snapshot to " << snapshotFile << endl;
+			if (Snapshot::save(snapshotFile, snapshotSignature, sources, attributeStore, layers) &&
+			    sortedNodeStore->save(snapshotFile + ".nodes", snapshotSignature) &&
+			    sortedWayStore->save(snapshotFile + ".ways", snapshotSignature))
+				cout << "Saved snapshot to " << snapshotFile << " (and .nodes/.ways)" << endl;
+		}
+		// tiles by zoom level
 
-					if (aYz != bYz)
-						return aYz < bYz;
+		// Whether a tile with objects (or affected by the change file) should be
+		// written. Objects outside the bounding box were never indexed, so
+		// only mapsplit input needs checking here.
+		auto wantTile = [&](uint zoom, int x, int y) -> bool {
+			// If we're constrained to a source tile, check we're within it
+			if (srcZ > -1) {
+				int xAtSrcZ = x / pow(2, zoom-srcZ);
+				int yAtSrcZ = y / pow(2, zoom-srcZ);
+				if (xAtSrcZ != srcX || yAtSrcZ != srcY) return false;
+			}
+			return true;
+		};
+
+		// The tiles with objects in them, or, with a change file, only those
+		// affected by it (including any that are now empty)
+		std::vector<const TileOccupancy*> occupiedTiles;
+		if (dirtyTiles)
+			occupiedTiles.push_back(dirtyTiles.get());
+		else
+			for (auto source : runSources) source->getTileOccupancy(occupiedTiles);
+
+		// List tiles in the order they're written, which clusters them:
+		// breadth-first for z0..z5, then depth-first within each z6 tile
+		using TileList = std::deque<std::pair<unsigned int, TileCoordinates>>;
+		auto collectTiles = [&](uint startZoom, uint endZoom, TileList &tiles) {
+			if (startZoom < CLUSTER_ZOOM)
+				forEachOccupiedTileByZoom(occupiedTiles, startZoom, std::min<uint>(endZoom, CLUSTER_ZOOM - 1), [&](uint zoom, uint32_t x, uint32_t y) {
+					if (wantTile(zoom, x, y)) tiles.push_back(std::make_pair(zoom, TileCoordinates(x, y)));
+				});
+		};
+		auto collectCellTiles = [&](TileCoordinates cell, uint startZoom, uint endZoom, TileList &tiles) {
+			auto add = [&](uint zoom, uint32_t x, uint32_t y) {
+				if (wantTile(zoom, x, y)) tiles.push_back(std::make_pair(zoom, TileCoordinates(x, y)));
+			};
+			forEachOccupiedTileDepthFirst(occupiedTiles, CLUSTER_ZOOM, cell.x, cell.y, std::max<uint>(startZoom, CLUSTER_ZOOM), endZoom, add);
+		};
+		const uint baseZoom = config.baseZoom;
+
+		// With --tile-partition, z6 tiles are dealt out to the workers in turn,
+		// in Hilbert order so that each worker gets a share of every dense
+		// area; worker 0 writes z0-z5.
+		auto ownsCell = [&](TileCoordinates cell) -> bool {
+			return PMTiles::zxyToTileId(CLUSTER_ZOOM, cell.x, cell.y) % partitionCount == partitionIndex;
+		};
+		const bool ownsLowZooms = partitionIndex == 0;
+
+		// Estimate each tile's cost from the objects it holds (plus a fixed
+		// overhead per tile), so that batches carry similar amounts of work.
+		// Batches stay contiguous in the depth-first order for the clip cache,
+		// and are small enough that idle threads take the remaining batches
+		// rather than waiting on one dense area at the end.
+		//
+		// Returns the number of batches posted; batchDone is called as each finishes.
+		auto postTiles = [&](std::shared_ptr<const TileList> tiles, std::function<void()> batchDone) -> size_t {
+			const TileList &tileCoordinates = *tiles;
+			tilesQueued += tileCoordinates.size();
+			if (sharedData.mergeSqlite) {
+				// Read the tiles to merge with ahead of the workers
+				std::vector<std::tuple<int,int,int>> toRead;
+				toRead.reserve(tileCoordinates.size());
+				for (auto const &tile : tileCoordinates) toRead.emplace_back(tile.first, tile.second.x, tile.second.y);
+				sharedData.mbtiles.prefetchTiles(toRead);
+			}
+			std::vector<uint32_t> tileCosts(tileCoordinates.size());
+			auto countCosts = [&](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; i++) {
+					size_t cost = 1;
+					for (auto source : runSources)
+						cost += source->countObjectsForTile(tileCoordinates[i].first, tileCoordinates[i].second);
+					tileCosts[i] = std::min<size_t>(cost, UINT32_MAX);
 				}
-
-				return false;
-			}, 
-			threadNum);
-
-		std::size_t batchSize = 0;
-		for(std::size_t startIndex = 0; startIndex < tileCoordinates.size(); startIndex += batchSize) {
-			// Compute how many tiles should be assigned to this batch --
-			// higher-zoom tiles are cheaper to compute, lower-zoom tiles more expensive.
-			batchSize = 0;
-			size_t weight = 0;
-			while (weight < 1000 && startIndex + batchSize < tileCoordinates.size()) {
-				const auto& zoom = tileCoordinates[startIndex + batchSize].first;
-				if (zoom > 12)
-					weight++;
-				else if (zoom > 11)
-					weight += 10;
-				else if (zoom > 10)
-					weight += 100;
-				else
-					weight += 1000;
-
-				batchSize++;
+			};
+			// A whole planet's list is millions of tiles, so each thread takes a share
+			const size_t tileCount = tileCoordinates.size();
+			if (threadNum > 1 && tileCount >= TILE_COST_PARALLEL_TILES) {
+				boost::asio::thread_pool countPool(threadNum);
+				for (size_t t = 0; t < threadNum; t++)
+					boost::asio::post(countPool, [&, t]() { countCosts(tileCount * t / threadNum, tileCount * (t + 1) / threadNum); });
+				countPool.join();
+			} else {
+				countCosts(0, tileCount);
 			}
-
-			boost::asio::post(pool, [=, &tileCoordinates, &pool, &sharedData, &sources, &attributeStore, &io_mutex, &tilesWritten]() {
-				std::vector<std::string> tileTimings;
-				std::size_t endIndex = std::min(tileCoordinates.size(), startIndex + batchSize);
-				for(std::size_t i = startIndex; i < endIndex; ++i) {
-					unsigned int zoom = tileCoordinates[i].first;
-					TileCoordinates coords = tileCoordinates[i].second;
-
-#ifndef _WIN32
-					timespec start, end;
-					if (logTileTimings)
-						clock_gettime(CLOCK_MONOTONIC, &start);
-#endif
-
-					std::vector<std::vector<OutputObjectID>> data;
-					for (auto source : sources) {
-						data.emplace_back(source->getObjectsForTile(sortOrders, zoom, coords));
-					}
-					outputProc(sharedData, sources, attributeStore, data, coords, zoom);
-
-#ifndef _WIN32
-					if (logTileTimings) {
-						clock_gettime(CLOCK_MONOTONIC, &end);
-						uint64_t tileNs = 1e9 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec;
-						std::string output = "z" + std::to_string(zoom) + "/" + std::to_string(coords.x) + "/" + std::to_string(coords.y) + " took " + std::to_string(tileNs/1e6) + " ms";
-						tileTimings.push_back(output);
-					}
-#endif
+			uint64_t totalCost = 0;
+			for (uint32_t cost : tileCosts) totalCost += cost;
+			const uint64_t batchCost = std::max<uint64_t>(1000, totalCost / (threadNum * 64));
+			// With a group of threads per NUMA node, the tiles are cut into runs of
+			// similar cost, dealt to the groups in turn, so that each group writes
+			// whole stretches of z6 subtrees and finds their clips in its own cache.
+			// There are a few runs per group, so that they finish together.
+			const size_t groups = pool.groups();
+			const uint64_t runCost = totalCost / (groups * TILE_POOL_RUNS_PER_GROUP) + 1;
+			uint64_t costBefore = 0;
+
+			size_t batches = 0;
+			std::size_t batchSize = 0;
+			for(std::size_t startIndex = 0; startIndex < tileCoordinates.size(); startIndex += batchSize) {
+				batchSize = 0;
+				uint64_t cost = 0;
+				while (cost < batchCost && startIndex + batchSize < tileCoordinates.size()) {
+					cost += tileCosts[startIndex + batchSize];
+					batchSize++;
 				}
+				batches++;
+				const size_t group = (costBefore / runCost) % groups;
+				costBefore += cost;
+
+				// runSources is copied, as mapsplit tiles' batches outlive the loop
+				pool.post(group, [=, &sharedData, &attributeStore, &attributeMutex, &attributeGate, &io_mutex, &tilesWritten, &tilesQueued, &profiler]() {
+					const TileList &tileCoordinates = *tiles;
+					if (pipeline) takeCpus(1, false);
+					std::shared_lock<std::shared_timed_mutex> attributeLock(attributeMutex, std::defer_lock);
+					{
+						std::lock_guard<std::mutex> gate(attributeGate);
+						attributeLock.lock();
+					}
+					std::size_t endIndex = std::min(tileCoordinates.size(), startIndex + batchSize);
+					uint32_t zoomCounts[METRICS_MAX_ZOOM + 1] = { 0 };
+					for(std::size_t i = startIndex; i < endIndex; ++i) {
+						unsigned int zoom = tileCoordinates[i].first;
+						TileCoordinates coords = tileCoordinates[i].second;
+						zoomCounts[Metrics::zoomSlot(zoom)]++;
+						if (profiler) profiler->beginTile(zoom, coords);
+
+						// Kept per thread so the object lists' storage is reused from tile to tile
+						thread_local std::vector<std::vector<OutputObjectID>> data;
+						data.resize(runSources.size());
+						{
+							TilePhaseTimer timer(TilePhase::Collect);
+							for (size_t s = 0; s < runSources.size(); s++) {
+								runSources[s]->getObjectsForTile(sortOrders, featureLimits[zoom], zoom, coords, data[s]);
+							}
+						}
+						outputProc(sharedData, runSources, attributeStore, data, coords, zoom);
 
-				if (logTileTimings) {
-					const std::lock_guard<std::mutex> lock(io_mutex);
-					std::cout << std::endl;
-					for (const auto& output : tileTimings)
-						std::cout << output << std::endl;
-				}
+						// In case outputProc skipped the tile before finishing it
+						TileProfiler::endTile(0, 0);
+					}
 
-				tilesWritten += (endIndex - startIndex); 
-
-				if (io_mutex.try_lock()) {
-					// Show progress grouped by z6 (or lower)
-					size_t z = tileCoordinates[startIndex].first;
-					size_t x = tileCoordinates[startIndex].second.x;
-					size_t y = tileCoordinates[startIndex].second.y;
-					if (z > CLUSTER_ZOOM) {
-						x = x / (1 << (z - CLUSTER_ZOOM));
-						y = y / (1 << (z - CLUSTER_ZOOM));
-						z = CLUSTER_ZOOM;
+					tilesWritten += (endIndex - startIndex); 
+					for (unsigned int z = 0; z <= METRICS_MAX_ZOOM; z++)
+						if (zoomCounts[z]) metrics.tilesWritten[z].add(zoomCounts[z]);
+
+					if (io_mutex.try_lock()) {
+						// Show progress grouped by z6 (or lower)
+						size_t z = tileCoordinates[startIndex].first;
+						size_t x = tileCoordinates[startIndex].second.x;
+						size_t y = tileCoordinates[startIndex].second.y;
+						if (z > CLUSTER_ZOOM) {
+							x = x / (1 << (z - CLUSTER_ZOOM));
+							y = y / (1 << (z - CLUSTER_ZOOM));
+							z = CLUSTER_ZOOM;
+						}
+						cout << "z" << z << "/" << x << "/" << y << ", writing tile " << tilesWritten.load() << " of " << tilesQueued.load();
+						if (verbose && sharedData.outputMode == OutputMode::MBTiles)
+							cout << ", " << sharedData.mbtiles.queueDepth() << " queued for mbtiles";
+						cout << "               \r" << std::flush;
+						io_mutex.unlock();
 					}
-					cout << "z" << z << "/" << x << "/" << y << ", writing tile " << tilesWritten.load() << " of " << tileCoordinates.size() << "               \r" << std::flush;
-					io_mutex.unlock();
-				}
+					attributeLock.unlock();
+					if (pipeline) returnCpus(1);
+					if (batchDone) batchDone();
+				});
+			}
+			return batches;
+		};
+
+		if (memoryLimit > 0 && !mapsplit && baseZoom >= CLUSTER_ZOOM && sharedData.config.endZoom >= CLUSTER_ZOOM) {
+			// Out-of-core: write z0-z5, then each z6 tile's subtree in turn (in
+			// Hilbert order), freeing each z6 tile's objects once it's written.
+			// Only the tiles being written need to be listed, and the
+			// next z6 tile is queued while the last one finishes.
+			std::vector<TileCoordinates> cells;
+			for (TileCoordinate x = 0; x < CLUSTER_ZOOM_WIDTH; x++)
+				for (TileCoordinate y = 0; y < CLUSTER_ZOOM_WIDTH; y++)
+					cells.push_back(TileCoordinates(x, y));
+			std::sort(cells.begin(), cells.end(), [](const TileCoordinates &a, const TileCoordinates &b) {
+				return PMTiles::zxyToTileId(CLUSTER_ZOOM, a.x, a.y) < PMTiles::zxyToTileId(CLUSTER_ZOOM, b.x, b.y);
 			});
+
+			// Step 0 is z0-z5; step n is cells[n-1]
+			std::mutex stepMutex;
+			std::condition_variable stepDone;
+			// Batches can finish before the rest of their step is posted, taking its count below zero
+			std::vector<long> pendingBatches(cells.size() + 1, 0);
+			auto postStep = [&](size_t step, std::shared_ptr<TileList> tiles) {
+				size_t batches = postTiles(tiles, [&, step]() {
+					std::lock_guard<std::mutex> lock(stepMutex);
+					if (--pendingBatches[step] == 0) stepDone.notify_all();
+				});
+				std::lock_guard<std::mutex> lock(stepMutex);
+				pendingBatches[step] += batches;
+				if (pendingBatches[step] == 0) stepDone.notify_all();
+			};
+			// Wait for every step up to this one to finish
+			auto waitForStep = [&](size_t step) {
+				std::unique_lock<std::mutex> lock(stepMutex);
+				stepDone.wait(lock, [&]() {
+					for (size_t i = 0; i <= step; i++) if (pendingBatches[i] > 0) return false;
+					return true;
+				});
+			};
+
+			auto lowZooms = std::make_shared<TileList>();
+			if (sharedData.config.startZoom < CLUSTER_ZOOM && ownsLowZooms)
+				collectTiles(sharedData.config.startZoom, CLUSTER_ZOOM - 1, *lowZooms);
+			postStep(0, lowZooms);
+
+			for (size_t n = 0; n < cells.size(); n++) {
+				auto tiles = std::make_shared<TileList>();
+				if (ownsCell(cells[n]))
+					collectCellTiles(cells[n], sharedData.config.startZoom, sharedData.config.endZoom, *tiles);
+				postStep(n + 1, tiles);
+
+				// Everything before the z6 tile we've just queued is done with
+				waitForStep(n);
+				if (n > 0)
+					for (auto source : runSources) source->releaseCell(cells[n - 1]);
+			}
+			waitForStep(cells.size());
+		} else {
+			// With --pipeline, each .pbf's run writes the z6 tiles it seals, and
+			// the last writes z0-z5 too
+			auto tileCoordinates = std::make_shared<TileList>();
+			if (ownsLowZooms && (!pipeline || run + 1 == runs))
+				collectTiles(sharedData.config.startZoom, sharedData.config.endZoom, *tileCoordinates);
+			if (sharedData.config.endZoom >= CLUSTER_ZOOM)
+				for (TileCoordinate x = 0; x < CLUSTER_ZOOM_WIDTH; x++)
+					for (TileCoordinate y = 0; y < CLUSTER_ZOOM_WIDTH; y++)
+						if (ownsCell(TileCoordinates(x, y)) && (!pipeline || cellSealedAt[x * CLUSTER_ZOOM_WIDTH + y] == run))
+							collectCellTiles(TileCoordinates(x, y), sharedData.config.startZoom, sharedData.config.endZoom, *tileCoordinates);
+			if (mapsplitRun) {
+				// Don't wait for the batches: the next source tile's can be
+				// queued behind them, and its last batch frees it. Batches can
+				// finish while the rest are posted, taking the count below zero,
+				// so whichever brings it back to zero frees the run.
+				size_t batches = postTiles(tileCoordinates, [&, mapsplitRun]() {
+					std::lock_guard<std::mutex> lock(runMutex);
+					if (--mapsplitRun->pendingBatches == 0) releaseRun(*mapsplitRun);
+				});
+				std::lock_guard<std::mutex> lock(runMutex);
+				mapsplitRun->pendingBatches += batches;
+				if (mapsplitRun->pendingBatches == 0) releaseRun(*mapsplitRun);
+			} else if (pipelineRun) {
+				// Likewise, a run's last batch may free it and earlier runs
+				auto runWritten = [&, pipelineRun]() {
+					pipelineRun->written = true;
+					releasePipelineRuns();
+				};
+				size_t batches = postTiles(tileCoordinates, [&, pipelineRun, runWritten]() {
+					std::lock_guard<std::mutex> lock(runMutex);
+					if (--pipelineRun->pendingBatches == 0) runWritten();
+				});
+				std::lock_guard<std::mutex> lock(runMutex);
+				pipelineRun->pendingBatches += batches;
+				if (pipelineRun->pendingBatches == 0) runWritten();
+			} else {
+				postTiles(tileCoordinates, nullptr);
+			}
 		}
-		// Wait for all tasks in the pool to complete.
-		pool.join();
 	}
+	// Wait for all tasks in the pool to complete.
+	pool.join();
+	if (profiler) profiler->flush();
+	for (auto &reader : mapsplitReaders) reader.join();
+	if (mapsplitError != 0) return mapsplitError;
+	if (pipelineReader.joinable()) pipelineReader.join();
+	if (pipelineError != 0) return pipelineError;
+	// Finalizing happens between (or, with mapsplit or --pipeline, alongside) writing tiles
+	phaseTimes.emplace_back("index", indexSeconds);
+	phaseTimes.emplace_back("tiles", secondsSince(phaseStart) - indexSeconds);
+	phaseStart = std::chrono::steady_clock::now();
+	metrics.setPhase("metadata");
 
 	// ----	Close tileset
 
-	if (sqlite)
-		WriteSqliteMetadata(jsonConfig, sharedData, layers);
-	else 
-		WriteFileMetadata(jsonConfig, sharedData, layers);
+	if (outputMode == OutputMode::MBTiles) {
+		// Bring the tiles from any shards into the main file
+		sharedData.mergeMbtilesShards();
+		WriteSqliteMetadata(jsonConfig, sharedData.mbtiles, layers);
+	} else if (outputMode == OutputMode::PMTiles)
+		WritePmtilesMetadata(jsonConfig, sharedData, sharedData.pmtiles, layers);
+	for (auto &output : sharedData.outputSinks) {
+		output->finish();
+		if (output->mode == OutputMode::MBTiles)
+			WriteSqliteMetadata(jsonConfig, output->mbtiles, layers);
+		else if (output->mode == OutputMode::PMTiles)
+			WritePmtilesMetadata(jsonConfig, sharedData, output->pmtiles, layers);
+		else
+			WriteFileMetadata(jsonConfig, sharedData, output->path, layers);
+	}
 
 	google::protobuf::ShutdownProtobufLibrary();
+	endPhase("metadata");
+	metrics.setPhase("done");
+	Tracer::finish();
+
+	if (!phaseTimingsFile.empty()) {
+		ofstream timings(phaseTimingsFile);
+		if (!timings) cerr << "Couldn't open " << phaseTimingsFile << " to write phase timings" << endl;
+		uint64_t inputBytes = 0;
+		for (const string &file : inputFiles)
+			if (boost::filesystem::exists(file)) inputBytes += boost::filesystem::file_size(file);
+		timings << "{\"threads\":" << threadNum << ",\"input_bytes\":" << inputBytes
+		        << ",\"tiles_written\":" << tilesWritten.load() << ",\"total_s\":" << secondsSince(runStart);
+#ifndef _MSC_VER
+		struct rusage r_usage;
+		getrusage(RUSAGE_SELF, &r_usage);
+		timings << ",\"peak_rss_kb\":" << r_usage.ru_maxrss;
+#endif
+		timings << ",\"phases\":{";
+		for (size_t i = 0; i < phaseTimes.size(); i++)
+			timings << (i ? "," : "") << "\"" << phaseTimes[i].first << "_s\":" << phaseTimes[i].second;
+		timings << "}}" << endl;
+	}
 
 #ifndef _MSC_VER
 	if (verbose) {
@@ -682,8 +1700,23 @@ int main(int argc, char* argv[]) {
 		cout << "\nMemory used: " << r_usage.ru_maxrss << endl;
 	}
 #endif
+	if (verbose) cout << "Reused compressed data for " << sharedData.tileDedup.hitCount() << " identical tiles" << endl;
+	if (verbose) cout << "Clip cache: " << clipCacheHits() << " hits, " << clipCacheMisses() << " misses" << endl;
+	if (verbose) cout << "Way geometry cache: " << osmMemTiles.linestringCacheHits() << " hits, "
+	                  << osmMemTiles.linestringCacheMisses() << " misses" << endl;
+	if (verbose && sortedNodeStore && sortedNodeStore->chunkCacheMisses() > 0)
+		cout << "Node chunk cache: " << sortedNodeStore->chunkCacheHits() << " hits, "
+		     << sortedNodeStore->chunkCacheMisses() << " misses" << endl;
+
+	if (profileLua) {
+		vector<string> layerNames;
+		for (const auto &layer : layers.layers) layerNames.push_back(layer.name);
+		LuaProfiler::report(cout, layerNames);
+	}
 
-	cout << endl << "Filled the tileset with good things at " << sharedData.outputFile << endl;
+	cout << endl << "Filled the tileset with good things at " << sharedData.outputFile;
+	for (size_t i = 1; i < outputFiles.size(); i++) cout << " and " << outputFiles[i];
+	cout << endl;
 	void_mmap_allocator::shutdown(); // this clears the mmap'ed nodes/ways/relations (quickly!)
 }
 
@@ -0,0 +1,98 @@
+#include "trace.h"
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+
+using namespace std;
+
+std::atomic<bool> Tracer::enabled(false);
+std::chrono::steady_clock::time_point Tracer::origin;
+std::string Tracer::filename;
+size_t Tracer::capacity = TRACE_EVENTS_PER_THREAD;
+std::mutex Tracer::mutex;
+std::vector<std::unique_ptr<Tracer::ThreadBuffer>> Tracer::buffers;
+thread_local Tracer::ThreadBuffer *Tracer::buffer = nullptr;
+
+bool Tracer::start(const string &file, size_t eventsPerThread) {
+	if (eventsPerThread == 0) {
+		cerr << "A trace needs room for at least one event per thread" << endl;
+		return false;
+	}
+	// Check now that it can be written, rather than after the run
+	ofstream out(file, ios::trunc);
+	if (!out) {
+		cerr << "Couldn't open " << file << " to write a trace" << endl;
+		return false;
+	}
+	filename = file;
+	capacity = eventsPerThread;
+	origin = chrono::steady_clock::now();
+	enabled = true;
+	return true;
+}
+
+void Tracer::record(const char *name, const char *detail, uint64_t start, uint64_t end) {
+	if (!buffer) {
+		std::lock_guard<std::mutex> lock(mutex);
+		buffers.emplace_back(new ThreadBuffer { {}, 0, false, static_cast<unsigned int>(buffers.size() + 1) });
+		buffer = buffers.back().get();
+	}
+	const Event event { name, detail, start, end - start };
+	if (buffer->events.size() < capacity) {
+		buffer->events.push_back(event);
+		return;
+	}
+	buffer->events[buffer->next] = event;
+	buffer->wrapped = true;
+	buffer->next = (buffer->next + 1) % capacity;
+}
+
+static void appendEscaped(string &out, const char *text) {
+	for (const char *c = text; *c; c++) {
+		if (*c == '"' || *c == '\\') out += '\\';
+		if (static_cast<unsigned char>(*c) >= 0x20) out += *c;
+	}
+}
+
+void Tracer::finish() {
+	if (!enabled) return;
+	enabled = false;
+
+	ofstream out(filename, ios::trunc);
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	char number[96];
+	bool first = true;
+	size_t events = 0, overwritten = 0;
+	std::lock_guard<std::mutex> lock(mutex);
+	for (const auto &thread : buffers) {
+		snprintf(number, sizeof(number), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,", first ? "" : ",\n", thread->id);
+		out << number << "\"args\":{\"name\":\"thread " << thread->id << "\"}}";
+		first = false;
+
+		// Oldest first, so a ring that's wrapped round starts at its next slot
+		const size_t count = thread->events.size();
+		if (thread->wrapped) overwritten++;
+		string line;
+		for (size_t n = 0; n < count; n++) {
+			const Event &event = thread->events[(thread->next + n) % count];
+			line = ",\n{\"name\":\"";
+			appendEscaped(line, event.name);
+			snprintf(number, sizeof(number), "\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+			         thread->id, event.start / 1000.0, event.duration / 1000.0);
+			line += number;
+			if (event.detail) {
+				line += ",\"args\":{\"detail\":\"";
+				appendEscaped(line, event.detail);
+				line += "\"}";
+			}
+			line += "}";
+			out << line;
+		}
+		events += count;
+	}
+	out << "\n]}" << endl;
+	if (!out) cerr << "Couldn't write trace to " << filename << endl;
+	else cout << "Wrote " << events << " trace events to " << filename << endl;
+	if (overwritten > 0)
+		cout << overwritten << " threads' oldest events were overwritten; only the last " << capacity << " of each are kept (see --trace-events)" << endl;
+}
@@ -1,13 +1,9 @@
-#include <boost/sort/sort.hpp>
-
 #include "way_stores.h"
+#include "radix_sort.h"
 
 void BinarySearchWayStore::finalize(unsigned int threadNum) { 
 	std::lock_guard<std::mutex> lock(mutex);
-	boost::sort::block_indirect_sort(
-		mLatpLonLists->begin(), mLatpLonLists->end(), 
-		[](auto const &a, auto const &b) { return a.first < b.first; }, 
-		threadNum);
+	radixSort(*mLatpLonLists, threadNum, [](auto const &e) { return e.first; });
 }
 
 void BinarySearchWayStore::reopen() {
@@ -15,21 +11,20 @@ void BinarySearchWayStore::reopen() {
 }
 
 std::vector<LatpLon> BinarySearchWayStore::at(WayID wayid) const {
+	std::vector<LatpLon> rv;
+	at(wayid, rv);
+	return rv;
+}
+
+void BinarySearchWayStore::at(WayID wayid, std::vector<LatpLon> &out) const {
 	std::lock_guard<std::mutex> lock(mutex);
 	
-	auto iter = std::lower_bound(mLatpLonLists->begin(), mLatpLonLists->end(), wayid, [](auto const &e, auto wayid) { 
-		return e.first < wayid; 
-	});
+	auto iter = interpolationSearch(mLatpLonLists->begin(), mLatpLonLists->end(), wayid, [](auto const &e) { return e.first; });
 
 	if(iter == mLatpLonLists->end() || iter->first != wayid)
 		throw std::out_of_range("Could not find way with id " + std::to_string(wayid));
 
-	std::vector<LatpLon> rv;
-	rv.reserve(iter->second.size());
-	// TODO: copy iter->second to rv more efficiently
-	for (const LatpLon& el : iter->second)
-		rv.push_back(el);
-	return rv;
+	out.assign(iter->second.begin(), iter->second.end());
 }
 
 void BinarySearchWayStore::insertLatpLons(std::vector<WayStore::ll_element_t> &newWays) {
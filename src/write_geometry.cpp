@@ -1,6 +1,7 @@
 #include "write_geometry.h"
 #include <iostream>
 #include "helpers.h"
+#include "tile_profiler.h"
 
 #include <boost/geometry/geometries/segment.hpp>
 #include <boost/geometry/index/rtree.hpp>
@@ -9,10 +10,11 @@ using namespace std;
 namespace geom = boost::geometry;
 extern bool verbose;
 
-WriteGeometryVisitor::WriteGeometryVisitor(const TileBbox *bp, vector_tile::Tile_Feature *fp, double sl) {
+WriteGeometryVisitor::WriteGeometryVisitor(const TileBbox *bp, vector_tile::Tile_Feature *fp, double sl, bool fast) {
 	bboxPtr = bp;
 	featurePtr = fp;
 	simplifyLevel = sl;
+	fastSimplify = fast;
 }
 
 // Point
@@ -29,7 +31,11 @@ void WriteGeometryVisitor::operator()(const Point &p) const {
 // Multipolygon
 void WriteGeometryVisitor::operator()(const MultiPolygon &mp) const {
 	MultiPolygon current = bboxPtr->scaleGeometry(mp);
-	if (simplifyLevel>0) { current = simplify(current, simplifyLevel/bboxPtr->xscale); geom::remove_spikes(current); }
+	if (simplifyLevel>0) {
+		TilePhaseTimer timer(TilePhase::Simplify);
+		current = simplify(current, simplifyLevel/bboxPtr->xscale, fastSimplify);
+		geom::remove_spikes(current);
+	}
 	if (geom::is_empty(current)) return;
 
 #if BOOST_VERSION >= 105800
@@ -49,22 +55,22 @@ void WriteGeometryVisitor::operator()(const MultiPolygon &mp) const {
 #endif
 
 	pair<int,int> lastPos(0,0);
+	thread_local XYString points;
 	for (MultiPolygon::const_iterator it = current.begin(); it != current.end(); ++it) {
-		XYString points;
-		Ring ring = geom::exterior_ring(*it);
+		const Ring &ring = geom::exterior_ring(*it);
+		points.clear();
+		points.reserve(ring.size());
 		for (auto jt = ring.begin(); jt != ring.end(); ++jt) {
-			pair<int,int> xy(jt->get<0>(), jt->get<1>());
-			points.push_back(xy);
+			points.emplace_back(jt->get<0>(), jt->get<1>());
 		}
 		bool success = writeDeltaString(&points, featurePtr, &lastPos, true);
 		if (!success) continue;
 
-		InteriorRing interiors = geom::interior_rings(*it);
-		for (auto ii = interiors.begin(); ii != interiors.end(); ++ii) {
+		for (auto const &inner : geom::interior_rings(*it)) {
 			points.clear();
-			for (auto jt = ii->begin(); jt != ii->end(); ++jt) {
-				pair<int,int> xy(jt->get<0>(), jt->get<1>());
-				points.push_back(xy);
+			points.reserve(inner.size());
+			for (auto jt = inner.begin(); jt != inner.end(); ++jt) {
+				points.emplace_back(jt->get<0>(), jt->get<1>());
 			}
 			writeDeltaString(&points, featurePtr, &lastPos, true);
 		}
@@ -74,21 +80,18 @@ void WriteGeometryVisitor::operator()(const MultiPolygon &mp) const {
 
 // Multilinestring
 void WriteGeometryVisitor::operator()(const MultiLinestring &mls) const {
-	MultiLinestring current;
-	if (simplifyLevel>0) {
-		for(auto const &ls: mls) {
-			current.push_back(simplify(ls, simplifyLevel));
-		}
-	} else {
-		current = mls;
-	}
-
 	pair<int,int> lastPos(0,0);
-	for (MultiLinestring::const_iterator it = current.begin(); it != current.end(); ++it) {
-		XYString scaledString;
-		for (Linestring::const_iterator jt = it->begin(); jt != it->end(); ++jt) {
-			pair<int,int> xy = bboxPtr->scaleLatpLon(jt->get<1>(), jt->get<0>());
-			scaledString.push_back(xy);
+	thread_local XYString scaledString;
+	for (auto const &ls : mls) {
+		if (simplifyLevel>0) {
+			Linestring simplified;
+			{
+				TilePhaseTimer timer(TilePhase::Simplify);
+				simplified = simplify(ls, simplifyLevel);
+			}
+			scaleLinestring(simplified, scaledString);
+		} else {
+			scaleLinestring(ls, scaledString);
 		}
 		writeDeltaString(&scaledString, featurePtr, &lastPos, false);
 	}
@@ -97,63 +100,73 @@ void WriteGeometryVisitor::operator()(const MultiLinestring &mls) const {
 
 // Linestring
 void WriteGeometryVisitor::operator()(const Linestring &ls) const { 
-	Linestring current;
+	pair<int,int> lastPos(0,0);
+	thread_local XYString scaledString;
 	if (simplifyLevel>0) {
-		current = simplify(ls, simplifyLevel);
+		Linestring simplified;
+		{
+			TilePhaseTimer timer(TilePhase::Simplify);
+			simplified = simplify(ls, simplifyLevel);
+		}
+		scaleLinestring(simplified, scaledString);
 	} else {
-		current = ls;
-	}
-
-	pair<int,int> lastPos(0,0);
-	XYString scaledString;
-	for (Linestring::const_iterator jt = current.begin(); jt != current.end(); ++jt) {
-		pair<int,int> xy = bboxPtr->scaleLatpLon(jt->get<1>(), jt->get<0>());
-		scaledString.push_back(xy);
+		scaleLinestring(ls, scaledString);
 	}
 	writeDeltaString(&scaledString, featurePtr, &lastPos, false);
 	featurePtr->set_type(vector_tile::Tile_GeomType_LINESTRING);
 }
 
+// Scale a linestring to tile pixels, reusing the output's storage
+void WriteGeometryVisitor::scaleLinestring(const Linestring &ls, XYString &output) const {
+	output.resize(ls.size());
+	for (size_t i = 0; i < ls.size(); i++) {
+		output[i] = bboxPtr->scaleLatpLon(ls[i].get<1>(), ls[i].get<0>());
+	}
+}
+
 // Encode a series of pixel co-ordinates into the feature, using delta and zigzag encoding
 bool WriteGeometryVisitor::writeDeltaString(XYString *scaledString, vector_tile::Tile_Feature *featurePtr, pair<int,int> *lastPos, bool closePath) const {
 	if (scaledString->size()<2) return false;
-	vector<uint32_t> geometry;
+
+	// Write straight into the feature, and roll back if the path is rejected
+	auto &geometry = *featurePtr->mutable_geometry();
+	const int start = geometry.size();
+	geometry.Reserve(start + scaledString->size()*2 + 3);
 
 	// Start with a moveTo
-	int lastX = scaledString->at(0).first;
-	int lastY = scaledString->at(0).second;
+	const pair<int,int> *points = scaledString->data();
+	int lastX = points[0].first;
+	int lastY = points[0].second;
 	int dx = lastX - lastPos->first;
 	int dy = lastY - lastPos->second;
-	geometry.push_back(9);						// moveTo, repeat x1
-	geometry.push_back((dx << 1) ^ (dx >> 31));
-	geometry.push_back((dy << 1) ^ (dy >> 31));
+	geometry.Add(9);						// moveTo, repeat x1
+	geometry.Add((dx << 1) ^ (dx >> 31));
+	geometry.Add((dy << 1) ^ (dy >> 31));
 
 	// Then write out the line for each point
 	uint len=0;
-	geometry.push_back(0);						// this'll be our lineTo opcode, we set it later
+	geometry.Add(0);						// this'll be our lineTo opcode, we set it later
 	uint end=closePath ? scaledString->size()-1 : scaledString->size();
 	for (uint i=1; i<end; i++) {
-		int x = scaledString->at(i).first;
-		int y = scaledString->at(i).second;
+		int x = points[i].first;
+		int y = points[i].second;
 		if (x==lastX && y==lastY) { continue; }
 		dx = x-lastX;
 		dy = y-lastY;
-		geometry.push_back((dx << 1) ^ (dx >> 31));
-		geometry.push_back((dy << 1) ^ (dy >> 31));
+		geometry.Add((dx << 1) ^ (dx >> 31));
+		geometry.Add((dy << 1) ^ (dy >> 31));
 		lastX = x; lastY = y;
 		len++;
 	}
-	if (closePath && len<2) return false;		// reject ABA polygons
-	if (len==0) return false;
-	geometry[3] = (len << 3) + 2;				// lineTo plus repeat
+	if ((closePath && len<2) || len==0) {		// reject ABA polygons, and single points
+		geometry.Truncate(start);
+		return false;
+	}
+	geometry.Set(start + 3, (len << 3) + 2);	// lineTo plus repeat
 	if (closePath) {
-		geometry.push_back(7+8);				// closePath
+		geometry.Add(7+8);						// closePath
 	}
-	for (uint i=0; i<geometry.size(); i++) { 
-		featurePtr->add_geometry(geometry[i]);
-	};
 	lastPos->first  = lastX;
 	lastPos->second = lastY;
 	return true;
 }
-
@@ -0,0 +1,143 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "external/minunit.h"
+#include "attribute_store.h"
+
+bool verbose = false;
+
+MU_TEST(test_attribute_pairs) {
+	AttributeStore store;
+	AttributeSet a, b;
+	store.addAttribute(a, "highway", std::string("primary"), 0);
+	store.addAttribute(a, "name", std::string("High Street"), 0);
+	store.addAttribute(a, "lanes", 2.0f, 0);
+	store.addAttribute(b, "lanes", 2.0f, 0);
+	store.addAttribute(b, "name", std::string("High Street"), 0);
+	store.addAttribute(b, "highway", std::string("primary"), 0);
+
+	// Same pairs in a different order are the same set
+	AttributeIndex ia = store.add(a), ib = store.add(b);
+	mu_check(ia == ib);
+
+	std::vector<const AttributePair*> pairs = store.getUnsafe(ia);
+	mu_check(pairs.size() == 3);
+	for (const AttributePair* pair : pairs) {
+		const std::string& key = store.keyStore.getKey(pair->keyIndex);
+		if (key == "name") mu_check(pair->hasStringValue() && pair->stringValue() == "High Street");
+		if (key == "lanes") mu_check(pair->hasFloatValue() && pair->floatValue() == 2.0f);
+		if (key == "highway") mu_check(pair->hasStringValue() && pair->stringValue() == "primary");
+	}
+	// highway=primary and lanes=2 are hot; names never are
+	mu_check(store.pairStore.hotPairCount() == 2);
+	mu_check(store.pairStore.coldPairCount() == 1);
+
+	AttributeSet c;
+	store.addAttribute(c, "lanes", 3.0f, 0);
+	mu_check(store.add(c) != ia);
+
+	// Pairs with the same string share one copy of it
+	mu_check(sizeof(AttributePair) == 8);
+	AttributePair ref1(1, std::string("A1"), 0), ref2(2, std::string("A1"), 0);
+	mu_check(ref1.value_ == ref2.value_ && !(ref1 == ref2));
+	mu_check(ref1.stringValue().data() == ref2.stringValue().data());
+}
+
+MU_TEST(test_concurrent_interning) {
+	// Threads adding the same sets in different orders must all get the same indices
+	AttributeStore store;
+	const size_t threadCount = 8, setCount = 20000;
+	std::vector<std::vector<AttributeIndex>> indices(threadCount, std::vector<AttributeIndex>(setCount));
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < threadCount; t++) {
+		threads.emplace_back([&, t]() {
+			for (size_t n = 0; n < setCount; n++) {
+				size_t i = (t % 2 ? setCount - 1 - n : n + t * 7919) % setCount;
+				AttributeSet set;
+				store.addAttribute(set, "ref", std::string("A") + std::to_string(i), 0);
+				store.addAttribute(set, "oneway", i % 2 == 0, 0);
+				store.addAttribute(set, "name", std::string("Road ") + std::to_string(i / 3), 0);
+				indices[t][i] = store.add(set);
+			}
+		});
+	}
+	for (auto& thread : threads) thread.join();
+
+	for (size_t i = 0; i < setCount; i++) {
+		for (size_t t = 1; t < threadCount; t++) mu_check(indices[t][i] == indices[0][i]);
+		std::vector<const AttributePair*> pairs = store.getUnsafe(indices[0][i]);
+		mu_check(pairs.size() == 3);
+		for (const AttributePair* pair : pairs) {
+			if (store.keyStore.getKey(pair->keyIndex) == "ref")
+				mu_check(pair->stringValue() == std::string("A") + std::to_string(i));
+		}
+	}
+	// Names of every third road are shared, and the two oneway values are hot
+	mu_check(store.pairStore.coldPairCount() + store.pairStore.hotPairCount() == setCount + setCount / 3 + 1 + 2);
+}
+
+MU_TEST(test_flattened_sets) {
+	AttributeStore store;
+	AttributeSet a, b;
+	store.addAttribute(a, "highway", std::string("primary"), 0);
+	store.addAttribute(a, "name", std::string("High Street"), 12);
+	for (int i = 0; i < 10; i++) store.addAttribute(b, "key" + std::to_string(i), float(i), i);
+	AttributeIndex ia = store.add(a), ib = store.add(b);
+	store.finalize();
+
+	AttributeSpan span = store.getSpan(ia);
+	mu_check(span.size() == 2 && span.maxMinZoom == 12);
+	std::vector<const AttributePair*> pairs = store.getUnsafe(ia);
+	size_t n = 0;
+	for (uint32_t pairIndex : span) mu_check(&store.pairStore.getPair(pairIndex) == pairs[n++]);
+	span = store.getSpan(ib);
+	mu_check(span.size() == 10 && span.maxMinZoom == 9);
+
+	// Sets added later (e.g. from the next mapsplit tile) are flattened by the next finalize
+	AttributeSet c;
+	store.addAttribute(c, "oneway", true, 0);
+	AttributeIndex ic = store.add(c);
+	bool threw = false;
+	try { store.getSpan(ic); } catch (std::runtime_error &e) { threw = true; }
+	mu_check(threw && store.getUnsafe(ic).size() == 1);
+	store.finalize();
+	span = store.getSpan(ic);
+	mu_check(span.size() == 1 && store.pairStore.getPair(*span.begin()).boolValue());
+	mu_check(store.getSpan(ia).size() == 2);
+}
+
+MU_TEST(test_key_stats) {
+	AttributeStore store;
+	// "Class" values look nothing like IDs, but repeat a lot;
+	// "code" values look like IDs, but never repeat
+	for (size_t i = 0; i < KEY_SAMPLE; i++) {
+		AttributeSet set;
+		store.addAttribute(set, "Class", std::string(i % 2 ? "Minor" : "Major"), 0);
+		std::string code;
+		for (size_t n = i; n; n /= 26) code += char('a' + n % 26);
+		store.addAttribute(set, "code", code, 0);
+	}
+	uint16_t classKey = store.keyStore.key2index("Class"), codeKey = store.keyStore.key2index("code");
+	mu_check(store.pairStore.keyStats.count(classKey) == KEY_SAMPLE);
+	mu_check(store.pairStore.keyStats.distinct(classKey) == 2);
+	mu_check(store.pairStore.keyStats.distinct(codeKey) == KEY_SAMPLE);
+	mu_check(store.pairStore.keyStats.bytes(classKey) == 2 * (sizeof(AttributePair) + 5));
+
+	AttributePair classPair(classKey, std::string("Unknown"), 0), codePair(codeKey, std::string("zzzzzz"), 0);
+	mu_check(!AttributePair::isHot(classPair, "Class") && AttributePair::isHot(codePair, "code"));
+	mu_check(store.pairStore.keyStats.isHot(classPair, "Class"));
+	mu_check(!store.pairStore.keyStats.isHot(codePair, "code"));
+}
+
+MU_TEST_SUITE(test_suite_attribute_store) {
+	MU_RUN_TEST(test_attribute_pairs);
+	MU_RUN_TEST(test_flattened_sets);
+	MU_RUN_TEST(test_key_stats);
+	MU_RUN_TEST(test_concurrent_interning);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_attribute_store);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
@@ -0,0 +1,58 @@
+#include <iostream>
+#include "external/minunit.h"
+#include "coordinates.h"
+
+MU_TEST(test_tile_conversions) {
+	mu_check(lon2tilex(0, 1) == 1);
+	mu_check(latp2tiley(0, 1) == 1);
+	mu_check(lon2tilexClamped(-179.99, 14) == 0);
+	mu_check(lon2tilexClamped(179.99, 14) == 16383);
+	mu_check(latp2tileyClamped(lat2latp(51.5), 14) == lat2tiley(51.5, 14));
+}
+
+MU_TEST(test_clamped_to_world) {
+	// A (-180,-90,180,90) box, as in planet headers, covers every tile
+	for (uint8_t zoom : { 0, 6, 14, 20 }) {
+		const uint32_t last = (uint32_t(1) << zoom) - 1;
+		mu_check(lon2tilexClamped(-180.0, zoom) == 0);
+		mu_check(lon2tilexClamped(180.0, zoom) == last);
+		mu_check(latp2tileyClamped(lat2latp(90.0), zoom) == 0);
+		mu_check(latp2tileyClamped(lat2latp(-90.0), zoom) == last);
+	}
+	// Beyond the world, too
+	mu_check(lon2tilexClamped(-200.0, 14) == 0);
+	mu_check(lon2tilexClamped(200.0, 14) == 16383);
+	mu_check(latp2tileyClamped(200.0, 14) == 0);
+	mu_check(latp2tileyClamped(-200.0, 14) == 16383);
+}
+
+MU_TEST(test_clamped_end) {
+	// A far edge on a tile boundary leaves out the tile that starts there
+	mu_check(lon2tilexClampedEnd(0, 1) == 0);
+	mu_check(latp2tileyClampedEnd(0, 1) == 0);
+	mu_check(lon2tilexClampedEnd(tilex2lon(100, 14), 14) == 99);
+	mu_check(latp2tileyClampedEnd(tiley2latp(100, 14), 14) == 99);
+	// Inside a tile, it's the tile containing the edge
+	mu_check(lon2tilexClampedEnd(0.001, 1) == 1);
+	mu_check(lon2tilexClampedEnd(179.99, 14) == 16383);
+	// And the world's edges still give the last tile
+	for (uint8_t zoom : { 0, 6, 14, 20 }) {
+		const uint32_t last = (uint32_t(1) << zoom) - 1;
+		mu_check(lon2tilexClampedEnd(180.0, zoom) == last);
+		mu_check(latp2tileyClampedEnd(lat2latp(-90.0), zoom) == last);
+		mu_check(lon2tilexClampedEnd(200.0, zoom) == last);
+		mu_check(lon2tilexClampedEnd(-200.0, zoom) == 0);
+	}
+}
+
+MU_TEST_SUITE(test_suite_coordinates) {
+	MU_RUN_TEST(test_tile_conversions);
+	MU_RUN_TEST(test_clamped_to_world);
+	MU_RUN_TEST(test_clamped_end);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_coordinates);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
@@ -0,0 +1,126 @@
+#include <iostream>
+#include <random>
+#include "external/minunit.h"
+#include "geom.h"
+
+// Rings are built from whole numbers of 1e-7 degrees, as is_simple_valid expects
+static Point fixed(int x, int y) { return Point(x / 10000000.0, y / 10000000.0); }
+
+static MultiPolygon polygon(std::vector<std::pair<int, int>> const &points) {
+	MultiPolygon mp;
+	mp.emplace_back();
+	for (auto const &p : points) mp.back().outer().push_back(fixed(p.first, p.second));
+	return mp;
+}
+
+static bool boostValid(MultiPolygon const &mp) {
+	std::string reason;
+	return geom::is_valid(mp, reason);
+}
+
+// is_simple_valid may give up on a valid ring, but must never pass an invalid one
+static bool agrees(MultiPolygon const &mp) {
+	return !is_simple_valid(mp) || boostValid(mp);
+}
+
+MU_TEST(test_simple_rings) {
+	// Clockwise, as boost wants
+	MultiPolygon square = polygon({ {0,0}, {0,10}, {10,10}, {10,0}, {0,0} });
+	mu_check(boostValid(square));
+	mu_check(is_simple_valid(square));
+
+	// Points in a line along an edge are fine
+	MultiPolygon straight = polygon({ {0,0}, {0,5}, {0,10}, {10,10}, {10,0}, {0,0} });
+	mu_check(boostValid(straight));
+	mu_check(is_simple_valid(straight));
+
+	MultiPolygon concave = polygon({ {0,0}, {0,10}, {5,4}, {10,10}, {10,0}, {0,0} });
+	mu_check(boostValid(concave));
+	mu_check(is_simple_valid(concave));
+}
+
+MU_TEST(test_degenerate_rings) {
+	const std::vector<std::vector<std::pair<int, int>>> rings = {
+		{ {0,0}, {10,0}, {10,10}, {0,10}, {0,0} },				// anticlockwise
+		{ {0,0}, {0,10}, {10,10}, {10,0} },						// not closed
+		{ {0,0}, {0,10}, {0,0} },								// too few points
+		{ {0,0}, {0,10}, {10,10}, {0,0}, {0,0} },				// repeated point (which boost allows)
+		{ {0,0}, {0,10}, {0,10}, {10,10}, {10,0}, {0,0} },		// repeated point (ditto)
+		{ {0,0}, {0,10}, {10,0}, {10,10}, {0,0} },				// bowtie
+		{ {0,0}, {0,10}, {5,10}, {5,15}, {5,10}, {10,10}, {10,0}, {0,0} },	// spike out
+		{ {0,0}, {0,10}, {5,10}, {5,5}, {5,10}, {10,10}, {10,0}, {0,0} },	// spike in
+		{ {0,0}, {0,10}, {10,10}, {10,0}, {0,0}, {0,10}, {10,10}, {10,0}, {0,0} },	// round twice
+		{ {0,0}, {0,10}, {5,0}, {10,10}, {10,0}, {0,0} },		// touches itself at a vertex
+		{ {0,0}, {0,10}, {10,10}, {10,0}, {5,5}, {0,10}, {0,0} },	// back through a vertex
+		{ {0,0}, {0,10}, {10,10}, {10,0}, {7,0}, {5,10}, {3,0}, {0,0} },	// touches an edge
+		{ {0,0}, {0,10}, {10,10}, {10,5}, {0,5}, {0,0} },		// runs back along an edge
+		{ {0,0}, {0,0}, {0,0}, {0,0} },							// a point
+		{ {0,0}, {5,5}, {10,10}, {0,0} }						// no area
+	};
+	for (auto const &ring : rings) {
+		MultiPolygon mp = polygon(ring);
+		mu_check(!is_simple_valid(mp));
+		mu_check(agrees(mp));
+	}
+
+	// More than one polygon, or a hole, is left to boost
+	MultiPolygon square = polygon({ {0,0}, {0,10}, {10,10}, {10,0}, {0,0} });
+	MultiPolygon withHole = square;
+	withHole[0].inners().push_back({ fixed(2,2), fixed(8,2), fixed(8,8), fixed(2,8), fixed(2,2) });
+	mu_check(boostValid(withHole) && !is_simple_valid(withHole));
+	MultiPolygon two = square;
+	two.push_back(polygon({ {20,0}, {20,10}, {30,10}, {30,0}, {20,0} })[0]);
+	mu_check(boostValid(two) && !is_simple_valid(two));
+
+	// Nor are points that aren't whole numbers of 1e-7 degrees
+	MultiPolygon offGrid;
+	offGrid.emplace_back();
+	offGrid[0].outer() = { Point(0, 0), Point(0, 1.00000001), Point(1, 1), Point(1, 0), Point(0, 0) };
+	mu_check(boostValid(offGrid) && !is_simple_valid(offGrid));
+}
+
+// Small rings on a small grid, so that many touch or cross themselves
+MU_TEST(test_random_rings) {
+	std::mt19937 random(42);
+	size_t valid = 0, tested = 0;
+	for (int i = 0; i < 20000; i++) {
+		const int points = 3 + random() % 8, span = 4 + random() % 16;
+		std::vector<std::pair<int, int>> ring;
+		for (int j = 0; j < points; j++) {
+			std::pair<int, int> p(random() % span, random() % span);
+			// Now and then, repeat a point
+			if (j > 0 && random() % 16 == 0) p = ring[random() % ring.size()];
+			ring.push_back(p);
+		}
+		ring.push_back(ring.front());
+		MultiPolygon mp = polygon(ring);
+		const bool isSimple = is_simple_valid(mp), isValid = boostValid(mp);
+		if (isSimple && !isValid) std::cout << "Passed an invalid ring: " << geom::wkt(mp) << std::endl;
+		mu_check(!isSimple || isValid);
+
+		// boost allows repeated points, which is_simple_valid leaves to it; without
+		// them, these rings are too small to reach the test limit, so a valid one
+		// is never given up on
+		bool repeats = false;
+		for (size_t j = 1; j < ring.size(); j++) repeats |= ring[j] == ring[j-1];
+		if (repeats) continue;
+		if (isValid && !isSimple) std::cout << "Gave up on a valid ring: " << geom::wkt(mp) << std::endl;
+		mu_check(isSimple == isValid);
+		valid += isValid;
+		tested++;
+	}
+	// Enough of both kinds to mean something
+	mu_check(valid > tested / 20 && valid < tested / 2);
+}
+
+MU_TEST_SUITE(test_suite_geom) {
+	MU_RUN_TEST(test_simple_rings);
+	MU_RUN_TEST(test_degenerate_rings);
+	MU_RUN_TEST(test_random_rings);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_geom);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
@@ -0,0 +1,59 @@
+#include <iostream>
+#include "external/minunit.h"
+#include "mvt_writer.h"
+
+void fillFeature(vector_tile::Tile_Feature *feature, uint32_t n) {
+	feature->set_type(vector_tile::Tile_GeomType_LINESTRING);
+	feature->add_geometry(9);
+	feature->add_geometry(n * 2);
+	feature->add_geometry(n * 300);
+	feature->add_tags(0);
+	feature->add_tags(n);
+	if (n % 2) feature->set_id(n * 1000000);
+}
+
+MU_TEST(test_matches_protobuf) {
+	std::vector<std::string> keys = { "name", "highway" };
+	std::vector<vector_tile::Tile_Value> values(3);
+	values[0].set_string_value("Main Street");
+	values[1].set_float_value(1.5);
+	values[2].set_bool_value(true);
+
+	vector_tile::Tile tile;
+	std::string encoded;
+	MvtLayerWriter writer;
+	for (uint32_t l = 0; l < 2; l++) {
+		vector_tile::Tile_Layer *layer = tile.add_layers();
+		writer.reset();
+		for (uint32_t n = 0; n < 200; n++) {
+			fillFeature(layer->add_features(), n);
+			fillFeature(writer.feature(), n);
+			writer.addFeature();
+		}
+		layer->set_name(l ? "roads" : "water");
+		layer->set_version(2);
+		layer->set_extent(4096);
+		for (const auto &key : keys) layer->add_keys(key);
+		for (const auto &value : values) *layer->add_values() = value;
+		writer.writeLayer(encoded, l ? "roads" : "water", keys, values, 4096, 2);
+	}
+	mu_check(writer.featureCount() == 200);
+	mu_check(encoded == tile.SerializeAsString());
+
+	// Re-encoding a parsed layer gives the same bytes
+	vector_tile::Tile parsed;
+	mu_check(parsed.ParseFromString(encoded));
+	std::string reencoded;
+	for (int i = 0; i < parsed.layers_size(); i++) MvtLayerWriter::writeLayer(reencoded, parsed.layers(i));
+	mu_check(reencoded == encoded);
+}
+
+MU_TEST_SUITE(test_suite_mvt_writer) {
+	MU_RUN_TEST(test_matches_protobuf);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_mvt_writer);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
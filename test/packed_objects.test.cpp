@@ -0,0 +1,82 @@
+#include <iostream>
+#include <random>
+#include "external/minunit.h"
+#include "packed_objects.h"
+
+static bool same(const OutputObjectID &a, const OutputObjectID &b) {
+	return a.id == b.id && a.oo.objectID == b.oo.objectID && a.oo.attributes == b.oo.attributes &&
+		a.oo.layer == b.oo.layer && a.oo.geomType == b.oo.geomType && a.oo.minZoom == b.oo.minZoom && a.oo.z_order == b.oo.z_order;
+}
+
+// Sorted runs of keys, as in the minZoom buckets of a finalized z6 tile
+static void makeObjects(size_t count, std::vector<Z6OffsetKey> &keys, std::vector<OutputObjectID> &objects, std::vector<size_t> &runs) {
+	std::mt19937_64 rng(count);
+	keys.clear(); objects.clear(); runs = { 0 };
+	Z6OffsetKey key = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (rng() % 500 == 0) { runs.push_back(i); key = rng() % 1000; }
+		key += rng() % 3 == 0 ? rng() % 50 : 0;
+		OutputObject oo(OutputGeometryType(rng() % 4), rng() % 4, (1ull << 35) + rng() % 1000000, rng() % 5000, rng() % 16);
+		oo.setZOrder(double(rng() % 8) - 4);
+		keys.push_back(key);
+		// Few IDs are large enough to be stored whole
+		objects.push_back(OutputObjectID({ oo, rng() % 1000 == 0 ? rng() : rng() % 100000 }));
+	}
+	runs.push_back(count);
+}
+
+MU_TEST(test_round_trip) {
+	for (size_t count : { 0, 1, 127, 128, 129, 5000 }) {
+		std::vector<Z6OffsetKey> keys;
+		std::vector<OutputObjectID> objects;
+		std::vector<size_t> runs;
+		makeObjects(count, keys, objects, runs);
+		PackedObjects packed;
+		packed.pack(keys, objects);
+		mu_check(packed.size() == count);
+		bool ok = true;
+		for (size_t i = 0; i < count; i++)
+			ok = ok && packed.key(i) == keys[i] && same(packed.object(i), objects[i]);
+		size_t next = 17 % (count + 1);
+		packed.forEach(next, count, [&](const OutputObjectID &object) { ok = ok && same(object, objects[next++]); });
+		mu_check(ok && next == count);
+
+		std::vector<Z6OffsetKey> unpackedKeys;
+		std::vector<OutputObject> unpacked;
+		packed.unpack(unpackedKeys, unpacked);
+		mu_check(unpackedKeys == keys && unpacked.size() == count);
+	}
+}
+
+MU_TEST(test_lower_bound) {
+	std::vector<Z6OffsetKey> keys;
+	std::vector<OutputObjectID> objects;
+	std::vector<size_t> runs;
+	makeObjects(20000, keys, objects, runs);
+	PackedObjects packed;
+	packed.pack(keys, objects);
+	std::mt19937 rng(1);
+	bool ok = true;
+	for (size_t r = 0; r + 1 < runs.size(); r++) {
+		for (int q = 0; q < 50; q++) {
+			const uint64_t target = rng() % (keys[runs[r + 1] - 1] + 100);
+			const size_t first = runs[r] + (q % 2 ? rng() % (runs[r + 1] - runs[r] + 1) : 0);
+			const size_t expected = std::lower_bound(keys.begin() + first, keys.begin() + runs[r + 1], target) - keys.begin();
+			ok = ok && packed.lowerBound(first, runs[r + 1], target) == expected;
+		}
+	}
+	mu_check(ok);
+	// Smaller than most of the objects
+	mu_check(packed.bytes() < keys.size() * (sizeof(Z6OffsetKey) + sizeof(OutputObjectID)) / 2);
+}
+
+MU_TEST_SUITE(test_suite_packed_objects) {
+	MU_RUN_TEST(test_round_trip);
+	MU_RUN_TEST(test_lower_bound);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_packed_objects);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
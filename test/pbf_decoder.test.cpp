@@ -0,0 +1,191 @@
+#include <iostream>
+#include "external/minunit.h"
+#include "osmformat.pb.h"
+#include "pbf_decoder.h"
+#include "tag_map.h"
+
+// Build a block with libprotobuf, and check we decode the same values from it
+MU_TEST(test_matches_protobuf) {
+	PrimitiveBlock block;
+	for (auto s : { "", "highway", "primary", "name", "Long Street Name That Won't Fit Inline", "type", "multipolygon", "outer" })
+		block.mutable_stringtable()->add_s(s);
+
+	PrimitiveGroup *nodeGroup = block.add_primitivegroup();
+	DenseNodes *dense = nodeGroup->mutable_dense();
+	int64_t ids[] = { 1, 2, 5000000000 };
+	int64_t lats[] = { 515000000, -335000000, 100 };
+	for (int i = 0; i < 3; i++) {
+		dense->add_id(ids[i] - (i ? ids[i-1] : 0));
+		dense->add_lat(lats[i] - (i ? lats[i-1] : 0));
+		dense->add_lon(-lats[i] - (i ? -lats[i-1] : 0));
+		if (i == 1) { dense->add_keys_vals(3); dense->add_keys_vals(4); }
+		dense->add_keys_vals(0);
+	}
+
+	PrimitiveGroup *wayGroup = block.add_primitivegroup();
+	Way *way = wayGroup->add_ways();
+	way->set_id(4398046511103);
+	way->add_keys(1); way->add_vals(2);
+	way->add_keys(3); way->add_vals(4);
+	way->add_refs(1); way->add_refs(1); way->add_refs(-2);
+	way->mutable_info()->set_version(3);
+	wayGroup->add_ways()->set_id(7);
+
+	PrimitiveGroup *relationGroup = block.add_primitivegroup();
+	Relation *relation = relationGroup->add_relations();
+	relation->set_id(99);
+	relation->add_keys(5); relation->add_vals(6);
+	relation->add_memids(10); relation->add_types(Relation_MemberType_WAY); relation->add_roles_sid(7);
+	relation->add_memids(-3); relation->add_types(Relation_MemberType_NODE); relation->add_roles_sid(0);
+
+	std::string encoded = block.SerializeAsString();
+	PbfPrimitiveBlock pb;
+	pb.parse(encoded.data(), encoded.size());
+
+	mu_check(pb.strings.size() == 8);
+	mu_check(pb.strings[4] == "Long Street Name That Won't Fit Inline");
+	mu_check(pb.findString("multipolygon") == 6);
+	mu_check(pb.findString("missing") == -1);
+	mu_check(pb.groups.size() == 3);
+
+	// Dense nodes
+	PbfPrimitiveGroup pg;
+	pg.parse(pb.groups[0]);
+	mu_check(pg.hasNodes() && pg.ways.empty() && pg.relations.empty());
+	PbfDenseNodes nodes;
+	nodes.parse(pg.dense);
+	mu_check(nodes.ids.size() == 3);
+	int64_t id = 0, lat = 0, lon = 0;
+	for (int i = 0; i < 3; i++) {
+		id += nodes.ids.nextSigned();
+		lat += nodes.lats.nextSigned();
+		lon += nodes.lons.nextSigned();
+		mu_check(id == ids[i]);
+		mu_check(lat == lats[i]);
+		mu_check(lon == -lats[i]);
+	}
+	mu_check(nodes.ids.empty());
+	mu_check(nodes.keysVals.next() == 0);
+	mu_check(nodes.keysVals.next() == 3);
+	mu_check(nodes.keysVals.next() == 4);
+	mu_check(nodes.keysVals.next() == 0);
+
+	// Ways, skipping the Info message
+	pg.parse(pb.groups[1]);
+	mu_check(!pg.hasNodes() && pg.ways.size() == 2);
+	PbfWay pbfWay;
+	pbfWay.parse(pg.ways[0]);
+	mu_check(pbfWay.id == 4398046511103);
+	mu_check(pbfWay.keys.size() == 2 && pbfWay.vals.size() == 2);
+	mu_check(pbfWay.keys.next() == 1 && pbfWay.vals.next() == 2);
+	mu_check(pbfWay.refs.nextSigned() == 1);
+	mu_check(pbfWay.refs.nextSigned() == 1);
+	mu_check(pbfWay.refs.nextSigned() == -2);
+	mu_check(pbfWay.refs.empty() && pbfWay.lats.empty());
+	pbfWay.parse(pg.ways[1]);
+	mu_check(pbfWay.id == 7 && pbfWay.keys.empty() && pbfWay.refs.empty());
+
+	// Relations
+	pg.parse(pb.groups[2]);
+	mu_check(pg.relations.size() == 1);
+	PbfRelation pbfRelation;
+	pbfRelation.parse(pg.relations[0]);
+	mu_check(pbfRelation.id == 99);
+	mu_check(pbfRelation.isType(5, 6));
+	mu_check(!pbfRelation.isType(5, 7));
+	mu_check(!pbfRelation.isType(-1, 6));
+	mu_check(pbfRelation.memids.nextSigned() == 10);
+	mu_check(pbfRelation.types.next() == Relation_MemberType_WAY);
+	mu_check(pbfRelation.roles.next() == 7);
+	mu_check(pbfRelation.memids.nextSigned() == -3);
+	mu_check(pbfRelation.types.next() == Relation_MemberType_NODE);
+}
+
+MU_TEST(test_truncated) {
+	PrimitiveBlock block;
+	block.mutable_stringtable()->add_s("highway");
+	std::string encoded = block.SerializeAsString();
+
+	PbfPrimitiveBlock pb;
+	bool threw = false;
+	try { pb.parse(encoded.data(), encoded.size() - 2); } catch (std::runtime_error &e) { threw = true; }
+	mu_check(threw);
+}
+
+MU_TEST(test_tag_map) {
+	PrimitiveBlock block;
+	block.mutable_stringtable()->add_s("");
+	for (int i = 0; i < 1000; i++) block.mutable_stringtable()->add_s("string" + std::to_string(i));
+	block.mutable_stringtable()->add_s("string7");
+	std::string encoded = block.SerializeAsString();
+
+	PbfPrimitiveBlock pb;
+	pb.parse(encoded.data(), encoded.size());
+	for (int i = 0; i < 1000; i++) mu_check(pb.findString("string" + std::to_string(i)) == i + 1);
+	mu_check(pb.findString("string1000") == -1);
+
+	TagMap tags;
+	tags.reset(pb);
+	tags.add(11, 12);
+	tags.add(500, 1);
+	boost::string_view value;
+	mu_check(tags.find("string10", value) && value == "string11");
+	mu_check(tags.find("string499", value) && value == "string0");
+	mu_check(!tags.contains("string11"));
+	mu_check(!tags.contains("highway"));
+	mu_check(tags.size() == 2 && tags.key(1) == "string499");
+
+	// The last of a repeated key wins
+	tags.add(11, 13);
+	mu_check(tags.find("string10", value) && value == "string12");
+	mu_check(tags.size() == 2);
+
+	bool threw = false;
+	try { tags.add(5000, 1); } catch (std::out_of_range &e) { threw = true; }
+	mu_check(threw);
+}
+
+MU_TEST(test_tag_filter) {
+	PrimitiveBlock block;
+	for (auto s : { "", "highway", "primary", "track", "building", "yes", "name" })
+		block.mutable_stringtable()->add_s(s);
+	Way *way = block.add_primitivegroup()->add_ways();
+	way->set_id(1);
+	way->add_keys(6); way->add_vals(5);
+	way->add_keys(1); way->add_vals(3);
+	std::string encoded = block.SerializeAsString();
+
+	PbfPrimitiveBlock pb;
+	pb.parse(encoded.data(), encoded.size());
+	PbfPrimitiveGroup pg;
+	pg.parse(pb.groups[0]);
+	PbfWay pbfWay;
+	pbfWay.parse(pg.ways[0]);
+
+	TagFilter::Prepared prepared;
+	TagFilter().prepare(pb, prepared);
+	mu_check(TagFilter::matches(prepared, pbfWay.keys, pbfWay.vals));
+
+	TagFilter({ "building", "highway=primary", "railway" }).prepare(pb, prepared);
+	mu_check(!TagFilter::matches(prepared, pbfWay.keys, pbfWay.vals));
+	TagFilter({ "highway=primary", "highway=track" }).prepare(pb, prepared);
+	mu_check(TagFilter::matches(prepared, pbfWay.keys, pbfWay.vals));
+	TagFilter({ "highway=primary", "highway" }).prepare(pb, prepared);
+	mu_check(TagFilter::matches(prepared, pbfWay.keys, pbfWay.vals));
+	TagFilter({ "landuse" }).prepare(pb, prepared);
+	mu_check(!TagFilter::matches(prepared, pbfWay.keys, pbfWay.vals));
+	mu_check(!TagFilter::matches(prepared, PbfPackedVarints(), PbfPackedVarints()));
+}
+
+MU_TEST_SUITE(test_suite_pbf_decoder) {
+	MU_RUN_TEST(test_matches_protobuf);
+	MU_RUN_TEST(test_tag_map);
+	MU_RUN_TEST(test_tag_filter);
+	MU_RUN_TEST(test_truncated);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_pbf_decoder);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
@@ -0,0 +1,57 @@
+#include <iostream>
+#include "external/minunit.h"
+#include "pmtiles.h"
+
+MU_TEST(test_tile_ids) {
+	mu_check(PMTiles::zxyToTileId(0, 0, 0) == 0);
+	mu_check(PMTiles::zxyToTileId(1, 0, 0) == 1);
+	mu_check(PMTiles::zxyToTileId(1, 0, 1) == 2);
+	mu_check(PMTiles::zxyToTileId(1, 1, 1) == 3);
+	mu_check(PMTiles::zxyToTileId(1, 1, 0) == 4);
+	mu_check(PMTiles::zxyToTileId(2, 0, 0) == 5);
+	mu_check(PMTiles::zxyToTileId(3, 7, 0) == 84);
+	mu_check(PMTiles::zxyToTileId(20, 0, 0) == 366503875925ull);
+}
+
+MU_TEST(test_directory_roundtrip) {
+	std::vector<PMTilesEntry> entries = {
+		{ 0, 0, 100, 1 },
+		{ 1, 100, 50, 1 },
+		{ 5, 0, 100, 3 },
+		{ 300, 150, 12, 0 }
+	};
+	const std::string serialized = PMTiles::serializeDirectory(entries);
+	const std::vector<PMTilesEntry> roundtrip = PMTiles::deserializeDirectory(serialized);
+
+	mu_check(roundtrip.size() == entries.size());
+	for (size_t i = 0; i < entries.size(); i++) {
+		mu_check(roundtrip[i].tileId == entries[i].tileId);
+		mu_check(roundtrip[i].offset == entries[i].offset);
+		mu_check(roundtrip[i].length == entries[i].length);
+		mu_check(roundtrip[i].runLength == entries[i].runLength);
+	}
+}
+
+MU_TEST(test_header) {
+	PMTilesHeader header;
+	header.minZoom = 0;
+	header.maxZoom = 14;
+	header.minLonE7 = -1800000000;
+	const std::string serialized = header.serialize();
+	mu_check(serialized.size() == PMTILES_HEADER_LENGTH);
+	mu_check(serialized.substr(0, 7) == "PMTiles");
+	mu_check(serialized[7] == 3);
+	mu_check(serialized[101] == 14);
+}
+
+MU_TEST_SUITE(test_suite_pmtiles) {
+	MU_RUN_TEST(test_tile_ids);
+	MU_RUN_TEST(test_directory_roundtrip);
+	MU_RUN_TEST(test_header);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_pmtiles);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
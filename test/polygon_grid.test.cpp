@@ -0,0 +1,122 @@
+#include <iostream>
+#include <random>
+#include "external/minunit.h"
+#include "polygon_grid.h"
+
+static MultiPolygon square(double minX, double minY, double maxX, double maxY) {
+	MultiPolygon mp;
+	mp.emplace_back();
+	mp.back().outer() = { Point(minX, minY), Point(minX, maxY), Point(maxX, maxY), Point(maxX, minY), Point(minX, minY) };
+	return mp;
+}
+
+static bool isValid(MultiPolygon const &mp) {
+	std::string reason;
+	return boost::geometry::is_valid(mp, reason);
+}
+
+MU_TEST(test_square) {
+	PolygonGrid grid;
+	grid.reset(Box(Point(0, 0), Point(10, 10)), 10);
+	mu_check(grid.empty());
+	grid.add(square(2.2, 3.1, 5.8, 6.9));
+	mu_check(!grid.empty());
+	MultiPolygon out;
+	grid.trace(out);
+	// Covers the centres of cells 2-5 across and 3-6 up
+	mu_check(out.size() == 1);
+	mu_check(out[0].outer().size() == 5);
+	mu_check(out[0].inners().empty());
+	mu_check(boost::geometry::area(out) == 16);
+	mu_check(isValid(out));
+}
+
+MU_TEST(test_joined_and_apart) {
+	PolygonGrid grid;
+	grid.reset(Box(Point(0, 0), Point(10, 10)), 10);
+	// Two polygons that share cell edges become one
+	grid.add(square(0, 0, 3, 3));
+	grid.add(square(3, 0, 6, 2));
+	// Two cells that only meet at a corner stay apart
+	grid.add(square(7, 7, 8, 8));
+	grid.add(square(8, 8, 9, 9));
+	MultiPolygon out;
+	grid.trace(out);
+	mu_check(out.size() == 3);
+	mu_check(boost::geometry::area(out) == 9 + 6 + 2);
+	mu_check(isValid(out));
+}
+
+MU_TEST(test_hole) {
+	PolygonGrid grid;
+	grid.reset(Box(Point(0, 0), Point(10, 10)), 10);
+	MultiPolygon donut = square(1, 1, 9, 9);
+	donut[0].inners().push_back({ Point(3, 3), Point(7, 3), Point(7, 7), Point(3, 7), Point(3, 3) });
+	grid.add(donut);
+	// Something inside the hole is a polygon of its own
+	grid.add(square(4, 4, 6, 6));
+	MultiPolygon out;
+	grid.trace(out);
+	mu_check(out.size() == 2);
+	size_t holes = 0;
+	for (auto const &polygon : out) holes += polygon.inners().size();
+	mu_check(holes == 1);
+	mu_check(boost::geometry::area(out) == 64 - 16 + 4);
+	mu_check(isValid(out));
+}
+
+MU_TEST(test_random) {
+	// Every filled cell is covered once, and the result is always valid
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<double> coordinate(0, 100);
+	PolygonGrid grid;
+	MultiPolygon out;
+	for (int run = 0; run < 200; run++) {
+		grid.reset(Box(Point(0, 0), Point(100, 100)), 32);
+		MultiPolygon inputs;
+		for (int i = 0; i < 20; i++) {
+			double x1 = coordinate(rng), x2 = coordinate(rng), y1 = coordinate(rng), y2 = coordinate(rng);
+			inputs.push_back(square(std::min(x1, x2), std::min(y1, y2), std::max(x1, x2), std::max(y1, y2))[0]);
+			grid.add(MultiPolygon { inputs.back() });
+		}
+		grid.trace(out);
+		size_t covered = 0;
+		for (int y = 0; y < 32; y++)
+			for (int x = 0; x < 32; x++) {
+				Point centre((x + 0.5) * 100 / 32, (y + 0.5) * 100 / 32);
+				for (auto const &input : inputs)
+					if (boost::geometry::within(centre, input)) { covered++; break; }
+			}
+		mu_check(isValid(out));
+		mu_check(std::abs(boost::geometry::area(out) - covered * (100.0 / 32) * (100.0 / 32)) < 1e-6);
+	}
+}
+
+MU_TEST(test_release) {
+	PolygonGrid grid;
+	grid.reset(Box(Point(0, 0), Point(10, 10)), 10);
+	grid.add(square(2.2, 3.1, 5.8, 6.9));
+	MultiPolygon out;
+	grid.trace(out);
+	grid.release();
+	mu_check(grid.cellCount() == 0);
+	// It can be reset and used again
+	grid.reset(Box(Point(0, 0), Point(10, 10)), 5);
+	grid.add(square(0, 0, 4, 4));
+	grid.trace(out);
+	mu_check(out.size() == 1 && boost::geometry::area(out) == 16);
+}
+
+MU_TEST_SUITE(test_suite_polygon_grid) {
+	MU_RUN_TEST(test_square);
+	MU_RUN_TEST(test_joined_and_apart);
+	MU_RUN_TEST(test_hole);
+	MU_RUN_TEST(test_random);
+	MU_RUN_TEST(test_release);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_polygon_grid);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
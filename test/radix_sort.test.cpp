@@ -0,0 +1,116 @@
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <random>
+#include <utility>
+#include <vector>
+#include "external/minunit.h"
+#include "radix_sort.h"
+
+typedef std::pair<uint64_t, uint32_t> Element;		// key, and position before sorting
+
+static uint64_t keyOf(const Element &e) { return e.first; }
+
+// Sort with radixSort, and check the keys are in order and nothing's been lost
+template<class Container>
+static bool sortsByKey(std::vector<uint64_t> const &keys, unsigned threads) {
+	Container data;
+	for (size_t i = 0; i < keys.size(); i++) data.emplace_back(keys[i], i);
+	radixSort(data, threads, keyOf);
+	for (size_t i = 1; i < data.size(); i++)
+		if (data[i - 1].first > data[i].first) return false;
+	std::vector<bool> seen(keys.size());
+	for (const Element &e : data) {
+		if (e.second >= keys.size() || seen[e.second] || keys[e.second] != e.first) return false;
+		seen[e.second] = true;
+	}
+	return data.size() == keys.size();
+}
+
+static bool sortsByKey(std::vector<uint64_t> const &keys, unsigned threads) {
+	return sortsByKey<std::vector<Element>>(keys, threads) && sortsByKey<std::deque<Element>>(keys, threads);
+}
+
+MU_TEST(test_random_keys) {
+	std::mt19937_64 rng(1);
+	for (size_t n : { 0, 1, 100, RADIX_SORT_MIN_ELEMENTS - 1, RADIX_SORT_MIN_ELEMENTS, RADIX_SORT_MIN_ELEMENTS + 1, 3 * RADIX_SORT_MIN_ELEMENTS + 7, 200000 }) {
+		std::vector<uint64_t> keys(n);
+		for (auto &key : keys) key = rng();
+		for (unsigned threads : { 0, 1, 2, 3, 8 })
+			mu_check(sortsByKey(keys, threads));
+	}
+}
+
+MU_TEST(test_skewed_keys) {
+	std::mt19937_64 rng(2);
+	const size_t n = 100000;
+	std::vector<uint64_t> keys(n);
+
+	// Few distinct values, so most bytes are the same and passes are skipped
+	for (auto &key : keys) key = rng() % 4;
+	mu_check(sortsByKey(keys, 4));
+	// All equal
+	std::fill(keys.begin(), keys.end(), 12345);
+	mu_check(sortsByKey(keys, 4));
+	// Only a middle byte varies
+	for (auto &key : keys) key = 0x1122330000445566ull | ((rng() & 0xff) << 24);
+	mu_check(sortsByKey(keys, 3));
+	// Mostly small, with a few outliers in the top byte
+	for (auto &key : keys) key = rng() % 1000 < 5 ? rng() : rng() % 256;
+	mu_check(sortsByKey(keys, 4));
+	// Already sorted, and reversed
+	for (size_t i = 0; i < n; i++) keys[i] = i * 3;
+	mu_check(sortsByKey(keys, 4));
+	std::reverse(keys.begin(), keys.end());
+	mu_check(sortsByKey(keys, 4));
+}
+
+MU_TEST(test_way_ids) {
+	// OSM way IDs: dense below about 2^30, with some up to the 42 bits tilemaker allows
+	std::mt19937_64 rng(3);
+	std::vector<uint64_t> keys(150000);
+	for (auto &key : keys) key = rng() % 100 == 0 ? rng() % (uint64_t(1) << 42) : 1000000000 + rng() % 300000000;
+	for (unsigned threads : { 1, 2, 7 })
+		mu_check(sortsByKey(keys, threads));
+}
+
+MU_TEST(test_interpolation_search) {
+	std::mt19937_64 rng(4);
+	for (int distribution = 0; distribution < 3; distribution++) {
+		std::vector<uint64_t> keys(50000);
+		for (auto &key : keys) {
+			if (distribution == 0) key = rng() % 10000000;						// even
+			else if (distribution == 1) key = rng() % 10 == 0 ? rng() : rng() % 1000;	// clustered, with outliers
+			else key = (rng() % 100) * 1000000;							// many duplicates
+		}
+		std::sort(keys.begin(), keys.end());
+		auto identity = [](uint64_t k) { return k; };
+
+		std::vector<uint64_t> targets = { 0, keys.front(), keys.back(), keys.back() + 1, UINT64_MAX };
+		for (size_t i = 0; i < 2000; i++) {
+			targets.push_back(keys[rng() % keys.size()]);
+			targets.push_back(keys[rng() % keys.size()] + 1);
+		}
+		for (uint64_t target : targets) {
+			// The whole range, and a part of it
+			mu_check(interpolationSearch(keys.begin(), keys.end(), target, identity) == std::lower_bound(keys.begin(), keys.end(), target));
+			auto begin = keys.begin() + 1000, end = keys.end() - 1000;
+			mu_check(interpolationSearch(begin, end, target, identity) == std::lower_bound(begin, end, target));
+		}
+	}
+	std::vector<uint64_t> none;
+	mu_check(interpolationSearch(none.begin(), none.end(), 5, [](uint64_t k) { return k; }) == none.end());
+}
+
+MU_TEST_SUITE(test_suite_radix_sort) {
+	MU_RUN_TEST(test_random_keys);
+	MU_RUN_TEST(test_skewed_keys);
+	MU_RUN_TEST(test_way_ids);
+	MU_RUN_TEST(test_interpolation_search);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_radix_sort);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
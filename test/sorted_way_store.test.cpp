@@ -1,4 +1,5 @@
 #include <iostream>
+#include <cstdio>
 #include "external/minunit.h"
 #include "sorted_way_store.h"
 #include "node_store.h"
@@ -46,6 +47,20 @@ void roundtripWay(const std::vector<NodeID>& way) {
 	}
 }
 
+void roundtripLatpLons(const std::vector<LatpLon>& way) {
+	for (bool compress : { false, true }) {
+		std::vector<uint8_t> output;
+		uint16_t flags = SortedWayStore::encodeLatpLons(way, output, compress);
+		const std::vector<LatpLon> roundtrip = SortedWayStore::decodeLatpLons(flags, &output[0]);
+
+		mu_check(roundtrip.size() == way.size());
+		for (int i = 0; i < way.size(); i++) {
+			mu_check(roundtrip[i].latp == way[i].latp);
+			mu_check(roundtrip[i].lon == way[i].lon);
+		}
+	}
+}
+
 MU_TEST(test_encode_way) {
 	roundtripWay({ 1 });
 	roundtripWay({ 1, 2 });
@@ -56,6 +71,23 @@ MU_TEST(test_encode_way) {
 	// zigzag encoding hasn't broken anything.
 	roundtripWay({ 5056880431, 538663248, 538663257, 538663260, 538663263, 11386679771, 538663266 });
 
+	// Long enough to be decoded four at a time, with big jumps either way
+	{
+		std::vector<NodeID> way;
+		for (int i = 0; i < 1999; i++)
+			way.push_back(i % 7 == 0 ? 11386679771 - i : 538663248 + i * 13 + (i % 3) * 100000 + (uint64_t(i % 5) << 32));
+		roundtripWay(way);
+	}
+
+	// A length of zero decodes to nothing, however it's flagged
+	{
+		const uint8_t input[16] = { 0 };
+		for (uint16_t flags : { 0, 1 << 13, 1 << 14, (1 << 15) | (1 << 13), (1 << 15) | (1 << 14) }) {
+			mu_check(SortedWayStore::decodeWay(flags, input).empty());
+			mu_check(SortedWayStore::decodeLatpLons(flags, input).empty());
+		}
+	}
+
 	// When the high bytes are all the same, it should take
 	// less space to encode.
 	{
@@ -70,6 +102,29 @@ MU_TEST(test_encode_way) {
 	}
 }
 
+MU_TEST(test_encode_latplons) {
+	roundtripLatpLons({ { 1, 2 } });
+	roundtripLatpLons({ { 515000000, -1000000 }, { 515000100, -1000050 } });
+	roundtripLatpLons({ { 1, 2 }, { 3, 4 }, { 5, 6 }, { 1, 2 } });
+	roundtripLatpLons({ { 900000000, -1800000000 }, { -900000000, 1800000000 }, { 0, 0 }, { 7, -7 }, { 8, 8 } });
+	{
+		std::vector<LatpLon> way;
+		for (int i = 0; i < 1001; i++)
+			way.push_back({ i % 2 ? 900000000 - i : -900000000 + i, 1800000000 - i * 3600 });
+		roundtripLatpLons(way);
+	}
+
+	// Nearby points take much less space compressed
+	std::vector<LatpLon> way;
+	for (int i = 0; i < 100; i++)
+		way.push_back({ 515000000 + i * 10, -1000000 - i * 7 });
+	std::vector<uint8_t> output;
+	SortedWayStore::encodeLatpLons(way, output, false);
+	const size_t uncompressed = output.size();
+	SortedWayStore::encodeLatpLons(way, output, true);
+	mu_check(output.size() * 3 < uncompressed);
+}
+
 MU_TEST(test_way_store) {
 	TestNodeStore ns;
 	SortedWayStore sws(true, ns);
@@ -143,6 +198,77 @@ MU_TEST(test_way_store) {
 	} catch (...) {}
 	mu_check(threw == true);
 
+	// save, then load into a new store
+	const std::string filename = "test.sorted_way_store.ways";
+	mu_check(sws.save(filename, 42));
+
+	SortedWayStore loaded(true, ns);
+	mu_check(!loaded.load(filename, 43));
+	mu_check(loaded.load(filename, 42));
+	mu_check(loaded.size() == 5);
+	{
+		const auto& rv = loaded.at(131072);
+		mu_check(rv.size() == 100);
+		mu_check(rv[0].latp == 200);
+		mu_check(rv[99].latp == 299);
+	}
+	mu_check(loaded.at(513).size() == 1);
+
+	// Decoding into a reused vector gives the same points
+	{
+		std::vector<LatpLon> buffer;
+		loaded.at(131072, buffer);
+		mu_check(buffer.size() == 100);
+		mu_check(buffer[0].latp == 200);
+		mu_check(buffer[99].latp == 299);
+		loaded.at(513, buffer);
+		mu_check(buffer.size() == 1);
+		mu_check(buffer[0].latp == 123);
+	}
+
+	loaded.reopen();
+	remove(filename.c_str());
+}
+
+MU_TEST(test_way_store_latplons) {
+	SortedWayStore sws(true);
+	mu_check(!sws.requiresNodes());
+	sws.batchStart();
+
+	std::vector<WayStore::ll_element_t> ways;
+	WayStore::latplon_vector_t shortWay;
+	shortWay.push_back({ 10, 20 });
+	ways.push_back(std::make_pair(1, shortWay));
+	ways.push_back(std::make_pair(513, shortWay));
+
+	WayStore::latplon_vector_t longWay;
+	for (int i = 200; i < 300; i++)
+		longWay.push_back({ i, -i });
+	longWay.push_back({ 200, -200 });
+	ways.push_back(std::make_pair(65536, longWay));
+
+	sws.insertLatpLons(ways);
+	sws.finalize(1);
+	mu_check(sws.size() == 3);
+
+	mu_check(sws.at(513).size() == 1 && sws.at(513)[0].lon == 20);
+	{
+		const auto& rv = sws.at(65536);
+		mu_check(rv.size() == 101);
+		mu_check(rv[0].latp == 200 && rv[0].lon == -200);
+		mu_check(rv[99].latp == 299 && rv[99].lon == -299);
+		mu_check(rv[100].latp == 200);
+	}
+
+	bool threw = false;
+	try {
+		sws.at(2);
+	} catch (std::out_of_range &e) {
+		threw = true;
+	}
+	mu_check(threw);
+
+	sws.reopen();
 }
 
 MU_TEST(test_populate_mask) {
@@ -178,7 +304,9 @@ MU_TEST(test_populate_mask) {
 
 MU_TEST_SUITE(test_suite_sorted_way_store) {
 	MU_RUN_TEST(test_encode_way);
+	MU_RUN_TEST(test_encode_latplons);
 	MU_RUN_TEST(test_way_store);
+	MU_RUN_TEST(test_way_store_latplons);
 }
 
 MU_TEST_SUITE(test_suite_bitmask) {
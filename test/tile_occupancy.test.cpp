@@ -0,0 +1,157 @@
+#include <iostream>
+#include <random>
+#include <set>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include "external/minunit.h"
+#include "tile_occupancy.h"
+
+// The tiles at each zoom from 0 to baseZoom covered by a set of base zoom tiles
+static std::vector<std::set<std::pair<TileCoordinate, TileCoordinate>>> expected(
+	uint baseZoom, const std::set<std::pair<TileCoordinate, TileCoordinate>>& tiles) {
+	std::vector<std::set<std::pair<TileCoordinate, TileCoordinate>>> rv(baseZoom + 1);
+	for (const auto& tile : tiles)
+		for (uint zoom = 0; zoom <= baseZoom; zoom++)
+			rv[zoom].insert(std::make_pair(tile.first >> (baseZoom - zoom), tile.second >> (baseZoom - zoom)));
+	return rv;
+}
+
+static bool matches(const TileOccupancy& occupancy, uint baseZoom, const std::set<std::pair<TileCoordinate, TileCoordinate>>& tiles) {
+	auto want = expected(baseZoom, tiles);
+	for (uint zoom = 0; zoom <= baseZoom; zoom++) {
+		std::set<std::pair<TileCoordinate, TileCoordinate>> got;
+		size_t calls = 0;
+		occupancy.forEachTile(zoom, [&](TileCoordinate x, TileCoordinate y) { got.insert(std::make_pair(x, y)); calls++; });
+		if (got != want[zoom] || calls != got.size()) return false;
+		for (const auto& tile : want[zoom])
+			if (!occupancy.test(zoom, tile.first, tile.second)) return false;
+	}
+	return true;
+}
+
+MU_TEST(test_tiles) {
+	const uint baseZoom = 10;
+	TileOccupancy occupancy(baseZoom, 6);
+	std::set<std::pair<TileCoordinate, TileCoordinate>> tiles;
+	std::mt19937 rng(1);
+	for (size_t i = 0; i < 5000; i++) {
+		TileCoordinate x = rng() % 1024, y = rng() % 1024;
+		occupancy.set(x, y);
+		tiles.insert(std::make_pair(x, y));
+	}
+	mu_check(matches(occupancy, baseZoom, tiles));
+	mu_check(!occupancy.test(baseZoom, 1024, 0));
+
+	// Tiles within one z6 cell, relative to it
+	std::set<std::pair<TileCoordinate, TileCoordinate>> inCell;
+	occupancy.forEachTileInCell(8, TileCoordinates(5, 7), [&](TileCoordinate x, TileCoordinate y) { inCell.insert(std::make_pair(x, y)); });
+	for (TileCoordinate x = 0; x < 4; x++)
+		for (TileCoordinate y = 0; y < 4; y++)
+			mu_check(inCell.count(std::make_pair(x, y)) == occupancy.test(8, 5 * 4 + x, 7 * 4 + y));
+
+	occupancy.clear();
+	mu_check(!occupancy.test(0, 0, 0));
+	mu_check(matches(occupancy, baseZoom, {}));
+}
+
+MU_TEST(test_boxes) {
+	const uint baseZoom = 11;
+	TileOccupancy occupancy(baseZoom, 6);
+	std::set<std::pair<TileCoordinate, TileCoordinate>> tiles;
+	std::mt19937 rng(2);
+	for (size_t i = 0; i < 40; i++) {
+		TileCoordinate x1 = rng() % 2048, y1 = rng() % 2048;
+		TileCoordinate x2 = std::min<TileCoordinate>(2047, x1 + rng() % 300), y2 = std::min<TileCoordinate>(2047, y1 + rng() % 300);
+		occupancy.setBox(x1, y1, x2, y2);
+		for (TileCoordinate x = x1; x <= x2; x++)
+			for (TileCoordinate y = y1; y <= y2; y++)
+				tiles.insert(std::make_pair(x, y));
+	}
+	// Boxes running off the edge of the world are clipped
+	occupancy.setBox(2040, 2040, 5000, 5000);
+	for (TileCoordinate x = 2040; x < 2048; x++)
+		for (TileCoordinate y = 2040; y < 2048; y++)
+			tiles.insert(std::make_pair(x, y));
+	mu_check(matches(occupancy, baseZoom, tiles));
+}
+
+MU_TEST(test_low_base_zoom) {
+	// With a base zoom below the cell zoom, cells are base zoom tiles
+	TileOccupancy occupancy(4, 6);
+	occupancy.set(3, 9);
+	occupancy.setBox(10, 10, 12, 11);
+	mu_check(matches(occupancy, 4, { {3, 9}, {10, 10}, {11, 10}, {12, 10}, {10, 11}, {11, 11}, {12, 11} }));
+}
+
+MU_TEST(test_concurrent_set) {
+	const uint baseZoom = 14;
+	TileOccupancy occupancy(baseZoom, 6);
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < 8; t++) {
+		threads.emplace_back([&, t]() {
+			std::mt19937 rng(t);
+			for (size_t i = 0; i < 20000; i++) {
+				TileCoordinate x = 8000 + rng() % 512;
+				occupancy.set(x, 5000 + rng() % 512);
+			}
+			occupancy.setBox(1000 + t * 100, 1000, 1000 + t * 100 + 150, 1200);
+		});
+	}
+	for (auto& thread : threads) thread.join();
+
+	std::set<std::pair<TileCoordinate, TileCoordinate>> tiles;
+	for (size_t t = 0; t < 8; t++) {
+		std::mt19937 rng(t);
+		for (size_t i = 0; i < 20000; i++) {
+			TileCoordinate x = 8000 + rng() % 512;
+			tiles.insert(std::make_pair(x, 5000 + rng() % 512));
+		}
+		for (TileCoordinate x = 1000 + t * 100; x <= 1000 + t * 100 + 150; x++)
+			for (TileCoordinate y = 1000; y <= 1200; y++)
+				tiles.insert(std::make_pair(x, y));
+	}
+	mu_check(matches(occupancy, baseZoom, tiles));
+}
+
+MU_TEST(test_tile_order) {
+	// Two tiles in the same z6 tile, one in another, and a box
+	const uint baseZoom = 8;
+	TileOccupancy a(baseZoom, 6), b(baseZoom, 6);
+	a.set(4 * 3 + 3, 4 * 2 + 0);
+	b.set(4 * 3 + 0, 4 * 2 + 1);
+	a.set(4 * 1 + 2, 4 * 9 + 2);
+	b.setBox(4 * 3 + 2, 4 * 2 + 2, 4 * 3 + 3, 4 * 2 + 3);
+	std::vector<const TileOccupancy*> occupancies { &a, &b };
+
+	std::vector<std::tuple<uint, uint32_t, uint32_t>> tiles;
+	auto add = [&](uint zoom, uint32_t x, uint32_t y) { tiles.push_back(std::make_tuple(zoom, x, y)); };
+	forEachOccupiedTileByZoom(occupancies, 5, 6, add);
+	mu_check(tiles.size() == 4);
+	mu_check(tiles[0] == std::make_tuple(5u, 0u, 4u) && tiles[1] == std::make_tuple(5u, 1u, 1u));
+	mu_check(tiles[2] == std::make_tuple(6u, 1u, 9u) && tiles[3] == std::make_tuple(6u, 3u, 2u));
+
+	// Each tile comes before those below it, which are in Morton order
+	tiles.clear();
+	forEachOccupiedTileDepthFirst(occupancies, 6, 3, 2, 7, 8, add);
+	std::vector<std::tuple<uint, uint32_t, uint32_t>> expected {
+		std::make_tuple(7u, 6u, 4u), std::make_tuple(8u, 12u, 9u),
+		std::make_tuple(7u, 7u, 4u), std::make_tuple(8u, 15u, 8u),
+		std::make_tuple(7u, 7u, 5u), std::make_tuple(8u, 14u, 10u), std::make_tuple(8u, 14u, 11u), std::make_tuple(8u, 15u, 10u), std::make_tuple(8u, 15u, 11u)
+	};
+	mu_check(tiles == expected);
+}
+
+MU_TEST_SUITE(test_suite_tile_occupancy) {
+	MU_RUN_TEST(test_tiles);
+	MU_RUN_TEST(test_boxes);
+	MU_RUN_TEST(test_low_base_zoom);
+	MU_RUN_TEST(test_tile_order);
+	MU_RUN_TEST(test_concurrent_set);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_tile_occupancy);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
@@ -0,0 +1,80 @@
+#include <iostream>
+#include <cstdio>
+#include "external/minunit.h"
+#include "mbtiles.h"
+#include "helpers.h"
+#include "tile_server.h"
+
+static std::string filename = "test.tile_server.mbtiles";
+static std::string gzipped = compress_string("a tile", Z_DEFAULT_COMPRESSION, true);
+
+static void writeMbtiles() {
+	remove(filename.c_str());
+	MBTiles mbtiles;
+	mbtiles.openForWriting(filename);
+	mbtiles.writeMetadata("name", "Test");
+	mbtiles.writeMetadata("json", "{\"vector_layers\":[]}");
+	std::string plain = "uncompressed";
+	mbtiles.saveTile(3, 2, 1, &gzipped, false);
+	mbtiles.saveTile(3, 2, 2, &plain, false);
+	mbtiles.closeForWriting();
+}
+
+MU_TEST(test_tiles) {
+	TileServer server(filename);
+	mu_check(server.good());
+
+	TileServer::Response tile = server.handle("GET", "/3/2/1.pbf", "", "gzip, deflate");
+	mu_check(tile.status == 200);
+	mu_check(tile.contentEncoding == "gzip");
+	mu_check(tile.body == gzipped);
+	mu_check(!tile.etag.empty());
+	mu_check(tile.varyEncoding);
+
+	// Unless the client can't take gzip, tiles go out as they're stored
+	TileServer::Response decompressed = server.handle("GET", "/3/2/1.pbf", "", "");
+	mu_check(decompressed.contentEncoding.empty() && decompressed.body == "a tile");
+	mu_check(decompressed.varyEncoding);
+	mu_check(decompressed.etag != tile.etag);
+	mu_check(server.handle("GET", "/3/2/1.pbf", "", "gzip;q=0, deflate").contentEncoding.empty());
+	mu_check(server.handle("GET", "/3/2/1.pbf", "", "br, *;q=0.5").contentEncoding == "gzip");
+	mu_check(server.handle("GET", "/3/2/1.pbf", "", "*, gzip; q=0").contentEncoding.empty());
+	TileServer::Response uncompressed = server.handle("GET", "/3/2/2.mvt?key=x", "", "gzip");
+	mu_check(uncompressed.body == "uncompressed" && !uncompressed.varyEncoding);
+
+	// So does a 304, for caches revalidating either encoding
+	TileServer::Response notModified = server.handle("GET", "/3/2/1.pbf", tile.etag, "gzip");
+	mu_check(notModified.status == 304 && notModified.varyEncoding);
+	mu_check(server.handle("GET", "/3/2/1.pbf", "\"x\", W/" + tile.etag, "gzip").status == 304);
+	// ...but not with the ETag of the other encoding
+	mu_check(server.handle("GET", "/3/2/1.pbf", tile.etag, "").status == 200);
+
+	mu_check(server.handle("GET", "/3/2/3.pbf", "", "gzip").status == 204);
+	mu_check(server.handle("GET", "/3/8/1.pbf", "", "gzip").status == 404);
+	mu_check(server.handle("GET", "/3/2/1.png", "", "gzip").status == 404);
+	mu_check(server.handle("POST", "/3/2/1.pbf", "", "gzip").status == 405);
+}
+
+MU_TEST(test_metadata) {
+	TileServer server(filename);
+	TileServer::Response metadata = server.handle("GET", "/metadata", "", "");
+	mu_check(metadata.status == 200);
+	mu_check(metadata.contentType == "application/json");
+	mu_check(metadata.body.find("\"name\":\"Test\"") != std::string::npos);
+	mu_check(metadata.body.find("\"json\":{\"vector_layers\":[]}") != std::string::npos);
+
+	mu_check(!TileServer("test.tile_server.missing.mbtiles").good());
+}
+
+MU_TEST_SUITE(test_suite_tile_server) {
+	MU_RUN_TEST(test_tiles);
+	MU_RUN_TEST(test_metadata);
+}
+
+int main() {
+	writeMbtiles();
+	MU_RUN_SUITE(test_suite_tile_server);
+	MU_REPORT();
+	remove(filename.c_str());
+	return MU_EXIT_CODE;
+}